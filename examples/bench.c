@@ -0,0 +1,336 @@
+/**
+ * \file bench.c
+ * Example program that measures the transfer throughput, transaction
+ * latency and enumeration time of an MTP device. The results are
+ * printed as one "key=value" pair per line so that runs can be
+ * compared by scripts.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "config.h"
+#include "common.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+// PTP GetNumObjects, a transaction without a data phase
+#define BENCH_OC_GETNUMOBJECTS 0x1006
+
+static void usage(void)
+{
+  fprintf(stderr, "Usage: mtp-bench [-d] [-i <device index>] "
+	  "[-n <transactions>] [-s <megabytes>] [-r <fileid>] [-k]\n"
+	  "                 [-S <files> [-F <folders>] [-P <mtp-detect log>]\n"
+	  "                  [-L <microseconds>] [-B <bytes per second>]]\n");
+  fprintf(stderr, "  -r reads an existing file instead of sending "
+	  "and reading one\n");
+  fprintf(stderr, "  -k keeps the file that was sent on the device\n");
+  fprintf(stderr, "  -S measures a simulated device with that many files "
+	  "instead,\n     with the device info of -P and the transaction "
+	  "latency\n     and bandwidth of -L and -B\n");
+  exit(1);
+}
+
+// Microseconds from an arbitrary point, for intervals only
+static uint64_t now_us(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+  uint64_t const x = *(uint64_t const *) a;
+  uint64_t const y = *(uint64_t const *) b;
+
+  return (x > y) - (x < y);
+}
+
+// The data handlers only count, so that the disk is not measured
+typedef struct {
+  uint64_t left;
+  uint64_t done;
+} bench_transfer_t;
+
+static uint16_t bench_get(void *params, void *priv, uint32_t wantlen,
+			  unsigned char *data, uint32_t *gotlen)
+{
+  bench_transfer_t *t = (bench_transfer_t *) priv;
+  uint32_t n = wantlen;
+  uint32_t i;
+
+  if (n > t->left)
+    n = t->left;
+  for (i = 0; i < n; i++)
+    data[i] = (unsigned char) (t->done + i);
+  t->left -= n;
+  t->done += n;
+  *gotlen = n;
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+static uint16_t bench_put(void *params, void *priv, uint32_t sendlen,
+			  unsigned char *data, uint32_t *putlen)
+{
+  bench_transfer_t *t = (bench_transfer_t *) priv;
+
+  t->done += sendlen;
+  *putlen = sendlen;
+  return LIBMTP_HANDLER_RETURN_OK;
+}
+
+static void print_rate(char const *name, uint64_t bytes, uint64_t us)
+{
+  printf("%s_bytes=%llu\n", name, (unsigned long long) bytes);
+  printf("%s_us=%llu\n", name, (unsigned long long) us);
+  printf("%s_mbps=%.2f\n", name, us ? (double) bytes / us : 0.0);
+}
+
+/*
+ * Times the open of a device, with or without enumerating its objects,
+ * and leaves it open. The device is simulated if simulation is set.
+ */
+static LIBMTP_mtpdevice_t *bench_open(LIBMTP_raw_device_t *rawdevice,
+				      LIBMTP_simulation_t const *simulation,
+				      int const cached, char const *name)
+{
+  LIBMTP_mtpdevice_t *device;
+  uint64_t start = now_us();
+
+  if (simulation != NULL && cached)
+    device = LIBMTP_Open_Simulated_Device(simulation);
+  else if (simulation != NULL)
+    device = LIBMTP_Open_Simulated_Device_Uncached(simulation);
+  else if (cached)
+    device = LIBMTP_Open_Raw_Device(rawdevice);
+  else
+    device = LIBMTP_Open_Raw_Device_Uncached(rawdevice);
+  if (device == NULL) {
+    fprintf(stderr, "Unable to open raw device\n");
+    return NULL;
+  }
+  printf("%s_us=%llu\n", name, (unsigned long long) (now_us() - start));
+  return device;
+}
+
+static int bench_latency(LIBMTP_mtpdevice_t *device, int const count)
+{
+  uint64_t *lat;
+  uint64_t sum = 0;
+  int i;
+
+  lat = (uint64_t *) malloc(count * sizeof(uint64_t));
+  if (lat == NULL)
+    return -1;
+  for (i = 0; i < count; i++) {
+    uint64_t start = now_us();
+
+    // Number of objects in the root of all storages
+    if (LIBMTP_Custom_Operation(device, BENCH_OC_GETNUMOBJECTS, 3,
+				0xffffffffU, 0, 0xffffffffU) != 0) {
+      LIBMTP_Dump_Errorstack(device);
+      LIBMTP_Clear_Errorstack(device);
+      free(lat);
+      return -1;
+    }
+    lat[i] = now_us() - start;
+    sum += lat[i];
+  }
+  qsort(lat, count, sizeof(uint64_t), compare_u64);
+  printf("transaction_count=%d\n", count);
+  printf("transaction_min_us=%llu\n", (unsigned long long) lat[0]);
+  printf("transaction_median_us=%llu\n", (unsigned long long) lat[count / 2]);
+  printf("transaction_p95_us=%llu\n",
+	 (unsigned long long) lat[(count * 95) / 100]);
+  printf("transaction_max_us=%llu\n", (unsigned long long) lat[count - 1]);
+  printf("transaction_mean_us=%llu\n", (unsigned long long) (sum / count));
+  free(lat);
+  return 0;
+}
+
+static int bench_read(LIBMTP_mtpdevice_t *device, uint32_t const id)
+{
+  bench_transfer_t t;
+  uint64_t start;
+
+  memset(&t, 0, sizeof(t));
+  start = now_us();
+  if (LIBMTP_Get_File_To_Handler(device, id, bench_put, &t,
+				 NULL, NULL) != 0) {
+    LIBMTP_Dump_Errorstack(device);
+    LIBMTP_Clear_Errorstack(device);
+    return -1;
+  }
+  print_rate("read", t.done, now_us() - start);
+  return 0;
+}
+
+static int bench_write(LIBMTP_mtpdevice_t *device, uint64_t const size,
+		       uint32_t *id)
+{
+  LIBMTP_file_t *file;
+  bench_transfer_t t;
+  uint64_t start;
+  int ret;
+
+  file = LIBMTP_new_file_t();
+  file->filename = strdup("mtp-bench.bin");
+  file->filesize = size;
+  file->filetype = LIBMTP_FILETYPE_UNKNOWN;
+  file->parent_id = 0;
+  file->storage_id = 0;
+  memset(&t, 0, sizeof(t));
+  t.left = size;
+  start = now_us();
+  ret = LIBMTP_Send_File_From_Handler(device, bench_get, &t, file,
+				      NULL, NULL);
+  if (ret == 0) {
+    print_rate("write", t.done, now_us() - start);
+    *id = file->item_id;
+  } else {
+    LIBMTP_Dump_Errorstack(device);
+    LIBMTP_Clear_Errorstack(device);
+  }
+  LIBMTP_destroy_file_t(file);
+  return ret;
+}
+
+int main(int argc, char **argv)
+{
+  LIBMTP_raw_device_t *rawdevices = NULL;
+  LIBMTP_raw_device_t *rawdevice = NULL;
+  LIBMTP_simulation_t simulation;
+  LIBMTP_simulation_t *simulated = NULL;
+  LIBMTP_mtpdevice_t *device;
+  int numrawdevices;
+  int index = 0;
+  int count = 100;
+  uint64_t size = 64;
+  uint32_t readid = 0;
+  uint32_t sentid = 0;
+  int keep = 0;
+  int ret = 0;
+  char *serial;
+  int opt;
+  extern int optind;
+  extern char *optarg;
+
+  memset(&simulation, 0, sizeof(simulation));
+  simulation.nroffolders = 100;
+  simulation.filesize = 4 * 1024 * 1024;
+  while ((opt = getopt(argc, argv, "di:n:s:r:kS:F:P:L:B:h")) != -1 ) {
+    switch (opt) {
+    case 'd':
+      LIBMTP_Set_Debug(LIBMTP_DEBUG_PTP | LIBMTP_DEBUG_DATA);
+      break;
+    case 'i':
+      index = atoi(optarg);
+      break;
+    case 'n':
+      count = atoi(optarg);
+      break;
+    case 's':
+      size = strtoull(optarg, NULL, 0);
+      break;
+    case 'r':
+      readid = strtoul(optarg, NULL, 0);
+      break;
+    case 'k':
+      keep = 1;
+      break;
+    case 'S':
+      simulation.nroffiles = strtoul(optarg, NULL, 0);
+      simulated = &simulation;
+      break;
+    case 'F':
+      simulation.nroffolders = strtoul(optarg, NULL, 0);
+      break;
+    case 'P':
+      simulation.profile = optarg;
+      break;
+    case 'L':
+      simulation.latency = strtoul(optarg, NULL, 0);
+      break;
+    case 'B':
+      simulation.bandwidth = strtoull(optarg, NULL, 0);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (count < 1 || index < 0 || (readid == 0 && size == 0))
+    usage();
+
+  LIBMTP_Init();
+
+  printf("libmtp_version=" LIBMTP_VERSION_STRING "\n");
+  if (simulated != NULL) {
+    printf("simulated_files=%u\n", simulation.nroffiles);
+    printf("simulated_folders=%u\n", simulation.nroffolders);
+    printf("simulated_latency_us=%u\n", simulation.latency);
+    printf("simulated_bandwidth=%llu\n",
+	   (unsigned long long) simulation.bandwidth);
+  } else {
+    if (LIBMTP_Detect_Raw_Devices(&rawdevices, &numrawdevices) !=
+	LIBMTP_ERROR_NONE || index >= numrawdevices) {
+      fprintf(stderr, "No such raw device\n");
+      return 1;
+    }
+    rawdevice = &rawdevices[index];
+    printf("vendor_id=0x%04x\n", rawdevice->device_entry.vendor_id);
+    printf("product_id=0x%04x\n", rawdevice->device_entry.product_id);
+    printf("device_flags=0x%08x\n", rawdevice->device_entry.device_flags);
+  }
+
+  // Open without and then with the object enumeration
+  device = bench_open(rawdevice, simulated, 0, "open_uncached");
+  if (device == NULL) {
+    free(rawdevices);
+    return 1;
+  }
+  serial = LIBMTP_Get_Serialnumber(device);
+  printf("serial=%s\n", serial ? serial : "");
+  free(serial);
+  LIBMTP_Release_Device(device);
+  device = bench_open(rawdevice, simulated, 1, "open_cached");
+  if (device == NULL) {
+    free(rawdevices);
+    return 1;
+  }
+
+  if (bench_latency(device, count) != 0)
+    ret = 1;
+  if (readid != 0) {
+    if (bench_read(device, readid) != 0)
+      ret = 1;
+  } else if (bench_write(device, size * 1024 * 1024, &sentid) != 0) {
+    ret = 1;
+  } else {
+    if (bench_read(device, sentid) != 0)
+      ret = 1;
+    if (!keep && LIBMTP_Delete_Object(device, sentid) != 0) {
+      LIBMTP_Dump_Errorstack(device);
+      LIBMTP_Clear_Errorstack(device);
+    }
+  }
+  printf("status=%s\n", ret ? "failed" : "ok");
+
+  LIBMTP_Release_Device(device);
+  free(rawdevices);
+  return ret;
+}
@@ -0,0 +1,319 @@
+/**
+ * \file digest.c
+ *
+ * Digests computed over the data of object transfers as it passes
+ * through the data handlers, so that a host does not have to read a
+ * file again to check it. CRC32C uses the CRC32 instructions of the
+ * CPU where there are any, SHA-256 comes from libgcrypt.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "digest.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+#ifdef HAVE_LIBGCRYPT
+#include <gcrypt.h>
+#endif
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define CRC32C_SSE42 1
+#endif
+
+/* CRC32C (Castagnoli), reflected */
+#define CRC32C_POLY 0x82f63b78U
+
+/* Slicing-by-8 tables for CPUs without CRC32 instructions */
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw;
+
+static void crc32c_init(void)
+{
+  uint32_t i, j, crc;
+
+  for (i = 0; i < 256; i++) {
+    crc = i;
+    for (j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ (CRC32C_POLY & (0U - (crc & 1)));
+    crc32c_table[0][i] = crc;
+  }
+  for (i = 0; i < 256; i++) {
+    crc = crc32c_table[0][i];
+    for (j = 1; j < 8; j++) {
+      crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+      crc32c_table[j][i] = crc;
+    }
+  }
+#ifdef CRC32C_SSE42
+  __builtin_cpu_init();
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  crc32c_hw = 1;
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, unsigned char const *p,
+			  unsigned long len)
+{
+  while (len && ((uintptr_t) p & 7)) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  while (len >= 8) {
+    // Little endian order of the bytes, whatever the host
+    uint32_t lo = crc ^ ((uint32_t) p[0] | (uint32_t) p[1] << 8 |
+			 (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24);
+    uint32_t hi = (uint32_t) p[4] | (uint32_t) p[5] << 8 |
+      (uint32_t) p[6] << 16 | (uint32_t) p[7] << 24;
+
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+      crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+      crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+      crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw_update(uint32_t crc, unsigned char const *p,
+				 unsigned long len)
+{
+  uint64_t crc64;
+
+  while (len && ((uintptr_t) p & 7)) {
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+    len--;
+  }
+  crc64 = crc;
+  while (len >= 8) {
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+    crc64 = __builtin_ia32_crc32di(crc64, v);
+    p += 8;
+    len -= 8;
+  }
+  crc = (uint32_t) crc64;
+  while (len--)
+    crc = __builtin_ia32_crc32qi(crc, *p++);
+  return crc;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32c_hw_update(uint32_t crc, unsigned char const *p,
+				 unsigned long len)
+{
+  while (len && ((uintptr_t) p & 7)) {
+    crc = __crc32cb(crc, *p++);
+    len--;
+  }
+  while (len >= 8) {
+    uint64_t v;
+
+    memcpy(&v, p, 8);
+    crc = __crc32cd(crc, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len--)
+    crc = __crc32cb(crc, *p++);
+  return crc;
+}
+#else
+static uint32_t crc32c_hw_update(uint32_t crc, unsigned char const *p,
+				 unsigned long len)
+{
+  return crc32c_sw(crc, p, len);
+}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+#else
+static int crc32c_ready;
+#endif
+
+static void crc32c_setup(void)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_once(&crc32c_once, crc32c_init);
+#else
+  if (!crc32c_ready) {
+    crc32c_init();
+    crc32c_ready = 1;
+  }
+#endif
+}
+
+#ifdef HAVE_LIBGCRYPT
+static int gcrypt_ready(void)
+{
+  // The MTPZ code may have set libgcrypt up already
+  if (!gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P)) {
+    if (gcry_check_version(NULL) == NULL)
+      return 0;
+    gcry_control(GCRYCTL_INITIALIZATION_FINISHED, 0);
+  }
+  return 1;
+}
+#endif
+
+/**
+ * Checks whether a digest can be computed by this build.
+ * @param type the digest.
+ * @return 1 if it can, 0 if not.
+ */
+int digest_supported(LIBMTP_digest_t const type)
+{
+  switch (type) {
+  case LIBMTP_DIGEST_CRC32C:
+    return 1;
+  case LIBMTP_DIGEST_SHA256:
+#ifdef HAVE_LIBGCRYPT
+    return gcrypt_ready() && gcry_md_test_algo(GCRY_MD_SHA256) == 0;
+#else
+    return 0;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/**
+ * Starts a digest.
+ * @param d the digest state to set up.
+ * @param type the digest to compute.
+ * @return 0 on success, -1 if the digest cannot be computed.
+ */
+int digest_begin(digest_t *d, LIBMTP_digest_t const type)
+{
+  memset(d, 0, sizeof(digest_t));
+  switch (type) {
+  case LIBMTP_DIGEST_CRC32C:
+    crc32c_setup();
+    d->crc = 0xffffffffU;
+    break;
+#ifdef HAVE_LIBGCRYPT
+  case LIBMTP_DIGEST_SHA256:
+    {
+      gcry_md_hd_t md;
+
+      if (!gcrypt_ready() || gcry_md_open(&md, GCRY_MD_SHA256, 0) != 0)
+	return -1;
+      d->md = md;
+    }
+    break;
+#endif
+  default:
+    return -1;
+  }
+  d->type = type;
+  return 0;
+}
+
+/**
+ * Copies a digest that is under way, so that the copy can be finished
+ * while the original goes on.
+ * @param to the new digest state.
+ * @param from the digest to copy.
+ * @return 0 on success, -1 on failure.
+ */
+int digest_copy(digest_t *to, digest_t const *from)
+{
+  *to = *from;
+#ifdef HAVE_LIBGCRYPT
+  if (from->type == LIBMTP_DIGEST_SHA256) {
+    gcry_md_hd_t md;
+
+    if (gcry_md_copy(&md, (gcry_md_hd_t) from->md) != 0) {
+      to->type = LIBMTP_DIGEST_NONE;
+      to->md = NULL;
+      return -1;
+    }
+    to->md = md;
+  }
+#endif
+  return 0;
+}
+
+void digest_update(digest_t *d, unsigned char const *data, unsigned long len)
+{
+  switch (d->type) {
+  case LIBMTP_DIGEST_CRC32C:
+    if (crc32c_hw)
+      d->crc = crc32c_hw_update(d->crc, data, len);
+    else
+      d->crc = crc32c_sw(d->crc, data, len);
+    break;
+#ifdef HAVE_LIBGCRYPT
+  case LIBMTP_DIGEST_SHA256:
+    gcry_md_write((gcry_md_hd_t) d->md, data, len);
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+/**
+ * Finishes a digest and frees what it holds.
+ * @param d the digest state.
+ * @param out the digest is written here, or NULL to throw it away.
+ *        It must hold DIGEST_MAX_LENGTH bytes.
+ * @return the length of the digest in bytes.
+ */
+unsigned int digest_end(digest_t *d, unsigned char *out)
+{
+  unsigned int len = 0;
+
+  switch (d->type) {
+  case LIBMTP_DIGEST_CRC32C:
+    d->crc ^= 0xffffffffU;
+    // Most significant byte first, the way it is usually printed
+    if (out != NULL) {
+      out[0] = d->crc >> 24;
+      out[1] = d->crc >> 16;
+      out[2] = d->crc >> 8;
+      out[3] = d->crc;
+    }
+    len = 4;
+    break;
+#ifdef HAVE_LIBGCRYPT
+  case LIBMTP_DIGEST_SHA256:
+    len = gcry_md_get_algo_dlen(GCRY_MD_SHA256);
+    if (out != NULL)
+      memcpy(out, gcry_md_read((gcry_md_hd_t) d->md, GCRY_MD_SHA256), len);
+    gcry_md_close((gcry_md_hd_t) d->md);
+    break;
+#endif
+  default:
+    break;
+  }
+  d->type = LIBMTP_DIGEST_NONE;
+  d->md = NULL;
+  return len;
+}
@@ -0,0 +1,41 @@
+/**
+ * \file digest.h
+ * Digests of data in flight, see LIBMTP_Set_Transfer_Digest().
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef __MTP__DIGEST__H
+#define __MTP__DIGEST__H
+
+#include "config.h" /* HAVE_LIBGCRYPT or not */
+#include "libmtp.h"
+
+/* The longest digest, SHA-256 */
+#define DIGEST_MAX_LENGTH 32
+
+typedef struct {
+  LIBMTP_digest_t type;
+  uint32_t crc;
+  void *md; /* libgcrypt handle */
+} digest_t;
+
+int digest_supported(LIBMTP_digest_t const type);
+int digest_begin(digest_t *d, LIBMTP_digest_t const type);
+int digest_copy(digest_t *to, digest_t const *from);
+void digest_update(digest_t *d, unsigned char const *data, unsigned long len);
+unsigned int digest_end(digest_t *d, unsigned char *out);
+
+#endif //__MTP__DIGEST__H
@@ -42,6 +42,9 @@
 #include "device-flags.h"
 #include "playlist-spl.h"
 #include "util.h"
+#include "digest.h"
+#include "simulator.h"
+#include "ptpip.h"
 
 #include "mtpz.h"
 int use_mtpz;
@@ -56,6 +59,13 @@ int use_mtpz;
 #include <fcntl.h>
 #include <time.h>
 #include <errno.h>
+#include <dirent.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #ifdef _MSC_VER // For MSVC++
 #define USE_WINDOWS_IO_H
 #include <io.h>
@@ -121,15 +131,61 @@ typedef struct propertymap_struct {
  * for parsing onwards to the usb_event_async function.
  */
 typedef struct event_cb_data_struct {
+  LIBMTP_mtpdevice_t *device;
   LIBMTP_event_cb_fn cb;
   void *user_data;
 } event_cb_data_t;
 
+typedef struct {
+  LIBMTP_mtpdevice_t *device;
+  LIBMTP_transaction_cb_fn cb;
+  void *user_data;
+} transaction_cb_data_t;
+
+/*
+ * A device as libmtp allocates it: the public device struct followed
+ * by the state that is only used internally, which can then grow
+ * without changing the layout applications see.
+ */
+typedef struct mtp_device_private_struct {
+  LIBMTP_mtpdevice_t device;
+  /** Worker thread of this device */
+  void *worker;
+  /** Thumbnail cache of this device */
+  void *thumbnails;
+  /** Playlist and album references cache */
+  void *references;
+  /** Free space accounting of the storages */
+  void *freespace;
+  /** Digest of object transfers */
+  void *digest;
+} mtp_device_private_t;
+
+#define DEVICE_PRIVATE(device) ((mtp_device_private_t *) (device))
+
+/*
+ * The state of a non-blocking operation, kept until its callback has
+ * been called.
+ */
+typedef struct nonblocking_op_struct nonblocking_op_t;
+
 // Global variables
 // This holds the global filetype mapping table
 static filemap_t *g_filemap = NULL;
 // This holds the global property mapping table
 static propertymap_t *g_propertymap = NULL;
+// Lookup indexes into the mapping tables, built by LIBMTP_Init():
+// by libmtp type, and sorted by PTP type for binary search.
+static filemap_t *g_filemap_by_id[LIBMTP_FILETYPE_UNKNOWN+1];
+static filemap_t *g_filemap_by_ptp_id[LIBMTP_FILETYPE_UNKNOWN+1];
+static unsigned int g_filemap_nr_ptp_ids = 0;
+static propertymap_t *g_propertymap_by_id[LIBMTP_PROPERTY_UNKNOWN+1];
+static propertymap_t *g_propertymap_by_ptp_id[LIBMTP_PROPERTY_UNKNOWN+1];
+static unsigned int g_propertymap_nr_ptp_ids = 0;
+// Directory where object cache snapshots are kept, NULL when disabled
+static char *g_metadata_cache_dir = NULL;
+// Directory where thumbnails are kept, NULL when disabled
+static char *g_thumbnail_cache_dir = NULL;
 
 /*
  * Forward declarations of local (static) functions.
@@ -137,9 +193,11 @@ static propertymap_t *g_propertymap = NULL;
 static int register_filetype(char const * const description, LIBMTP_filetype_t const id,
 			     uint16_t const ptp_id);
 static void init_filemap();
+static void index_filemap();
 static int register_property(char const * const description, LIBMTP_property_t const id,
 			     uint16_t const ptp_id);
 static void init_propertymap();
+static void index_propertymap();
 static void add_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 				    LIBMTP_error_number_t errornumber,
 				    char const * const error_text);
@@ -147,20 +205,39 @@ static void add_ptp_error_to_errorstack(LIBMTP_mtpdevice_t *device,
 					uint16_t ptp_error,
 					char const * const error_text);
 static void flush_handles(LIBMTP_mtpdevice_t *device);
-static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
-				    PTPParams *params,
-				    uint32_t storageid,
-				    uint32_t parent);
+static void update_cache(LIBMTP_mtpdevice_t *device);
+static void locate_default_folders(LIBMTP_mtpdevice_t *device);
+static int load_metadata_cache(LIBMTP_mtpdevice_t *device);
+static LIBMTP_enumeration_t *new_enumeration(LIBMTP_mtpdevice_t *device,
+					     size_t const max_memory);
+static int enumeration_step(LIBMTP_enumeration_t *e,
+			    unsigned int const max_folders);
+static void get_folder_metadata_fast(LIBMTP_mtpdevice_t *device,
+				     uint32_t const parent,
+				     PTPObjectHandles const * const handles);
 static void free_storage_list(LIBMTP_mtpdevice_t *device);
 static int sort_storage_by(LIBMTP_mtpdevice_t *device, int const sortby);
 static uint32_t get_writeable_storageid(LIBMTP_mtpdevice_t *device,
 					uint64_t fitsize);
+static int refresh_storage_info(LIBMTP_mtpdevice_t *device,
+				LIBMTP_devicestorage_t *storage);
 static int get_storage_freespace(LIBMTP_mtpdevice_t *device,
 				 LIBMTP_devicestorage_t *storage,
 				 uint64_t *freespace);
 static int check_if_file_fits(LIBMTP_mtpdevice_t *device,
 			      LIBMTP_devicestorage_t *storage,
 			      uint64_t const filesize);
+static void *new_freespace(int const fresh);
+static void free_freespace(LIBMTP_mtpdevice_t *device);
+static void freespace_checked(LIBMTP_mtpdevice_t *device,
+			      uint32_t const storage_id);
+static void invalidate_freespace(LIBMTP_mtpdevice_t *device,
+				 uint32_t const storage_id);
+static void account_freespace(LIBMTP_mtpdevice_t *device,
+			      uint32_t const storage_id,
+			      int64_t const bytes, int const objects);
+static int cached_object_size(PTPParams *params, uint32_t const id,
+			      uint32_t *storage_id, uint64_t *size);
 static uint16_t map_libmtp_type_to_ptp_type(LIBMTP_filetype_t intype);
 static LIBMTP_filetype_t map_ptp_type_to_libmtp_type(uint16_t intype);
 static uint16_t map_libmtp_property_to_ptp_property(LIBMTP_property_t inproperty);
@@ -190,7 +267,10 @@ static int set_object_u8(LIBMTP_mtpdevice_t *device, uint32_t const object_id,
 			 uint16_t const attribute_id, uint8_t const value);
 static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat,
 			       LIBMTP_track_t *track);
-static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent);
+typedef struct folder_index_struct folder_index_t;
+static LIBMTP_folder_t *get_subfolders_for_folder(folder_index_t *index,
+						  unsigned int n,
+						  uint32_t parent);
 static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
 				    char const * const name,
 				    char const * const artist,
@@ -213,6 +293,11 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
 				uint32_t const * const tracks,
 				uint32_t const no_tracks);
 static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata);
+static uint32_t get_default_folder(LIBMTP_mtpdevice_t *device,
+				   LIBMTP_filetype_t const filetype,
+				   uint16_t const of);
+static int nonblocking_result(LIBMTP_mtpdevice_t *device, uint16_t const ret,
+			      char const * const what);
 static void add_object_to_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
 static void update_metadata_cache(LIBMTP_mtpdevice_t *device, uint32_t object_id);
 static int set_object_filename(LIBMTP_mtpdevice_t *device,
@@ -221,8 +306,25 @@ static int set_object_filename(LIBMTP_mtpdevice_t *device,
                 const char **newname);
 static char *generate_unique_filename(PTPParams* params, char const * const filename);
 static int check_filename_exists(PTPParams* params, char const * const filename);
-static void LIBMTP_Handle_Event(PTPContainer *ptp_event,
+static void LIBMTP_Handle_Event(LIBMTP_mtpdevice_t *device,
+                                PTPContainer *ptp_event,
                                 LIBMTP_event_t *event, uint32_t *out1);
+static void queue_cache_event(LIBMTP_mtpdevice_t *device, uint16_t code,
+                              uint32_t object_id);
+static void stop_device_worker(LIBMTP_mtpdevice_t *device);
+static void free_thumbnail_cache(LIBMTP_mtpdevice_t *device);
+static void free_references_cache(LIBMTP_mtpdevice_t *device);
+static void references_forget(LIBMTP_mtpdevice_t *device, uint32_t const id);
+static void free_transfer_digest(LIBMTP_mtpdevice_t *device);
+static void free_device_lock(PTPParams *params);
+static void init_timeout_policy(PTPParams *params, PTP_USB *ptp_usb);
+static void lock_errorstack(LIBMTP_mtpdevice_t *device, int const lock);
+static uint32_t partial_object_length(PTPParams *params, uint64_t const offset,
+				      uint32_t maxbytes, uint64_t const filesize);
+static uint16_t get_object_range(PTPParams *params, uint32_t const id,
+				 uint64_t const offset, uint32_t const len,
+				 PTPDataHandler *handler,
+				 unsigned char **data, uint32_t *gotlen);
 
 /**
  * These are to wrap the get/put handlers to convert from the MTP types to PTP types
@@ -237,6 +339,18 @@ typedef struct _MTPDataHandler {
 static uint16_t get_func_wrapper(PTPParams* params, void* priv, unsigned long wantlen, unsigned char *data, unsigned long *gotlen);
 static uint16_t put_func_wrapper(PTPParams* params, void* priv, unsigned long sendlen, unsigned char *data);
 
+struct nonblocking_op_struct {
+  LIBMTP_mtpdevice_t *device;
+  LIBMTP_nonblocking_cb_fn cb;
+  LIBMTP_filemetadata_cb_fn metadata_cb;
+  void *user_data;
+  MTPDataHandler mtp_handler;
+  PTPDataHandler handler;
+  uint32_t id;
+  LIBMTP_file_t *filedata; /**< The file being sent */
+  PTPObjectInfo oi; /**< What was sent as its object info */
+};
+
 /**
  * Checks if a filename ends with ".ogg". Used in various
  * situations when the device has no idea that it support
@@ -410,6 +524,59 @@ static void init_filemap()
   register_filetype("Undefined filetype", LIBMTP_FILETYPE_UNKNOWN, PTP_OFC_Undefined);
 }
 
+/**
+ * Build the lookup indexes for the filetype mapping table, so that
+ * mapping a type either way does not have to walk the list. When a
+ * PTP type is registered more than once the first entry wins, like
+ * it did when walking the list.
+ */
+static void index_filemap()
+{
+  filemap_t *current;
+
+  memset(g_filemap_by_id, 0, sizeof(g_filemap_by_id));
+  g_filemap_nr_ptp_ids = 0;
+  for (current = g_filemap; current != NULL; current = current->next) {
+    unsigned int i;
+
+    if ((unsigned int) current->id > LIBMTP_FILETYPE_UNKNOWN)
+      continue;
+    g_filemap_by_id[current->id] = current;
+    // Insertion sort on the PTP type, it is only done once
+    for (i = g_filemap_nr_ptp_ids;
+	 i > 0 && g_filemap_by_ptp_id[i-1]->ptp_id > current->ptp_id; i--)
+      ;
+    if (i > 0 && g_filemap_by_ptp_id[i-1]->ptp_id == current->ptp_id)
+      continue;
+    memmove(&g_filemap_by_ptp_id[i+1], &g_filemap_by_ptp_id[i],
+	    (g_filemap_nr_ptp_ids - i) * sizeof(filemap_t *));
+    g_filemap_by_ptp_id[i] = current;
+    g_filemap_nr_ptp_ids++;
+  }
+}
+
+/**
+ * Look up the filetype mapping entry for a PTP type.
+ * @param intype the PTP (libgphoto2) interface type
+ * @return the mapping entry or NULL if the type is not known.
+ */
+static filemap_t *find_filemap_ptp_id(uint16_t intype)
+{
+  unsigned int lo = 0, hi = g_filemap_nr_ptp_ids;
+
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
+
+    if (g_filemap_by_ptp_id[mid]->ptp_id == intype)
+      return g_filemap_by_ptp_id[mid];
+    if (g_filemap_by_ptp_id[mid]->ptp_id < intype)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
 /**
  * Returns the PTP filetype that maps to a certain libmtp internal file type.
  * @param intype the MTP library interface type
@@ -417,15 +584,9 @@ static void init_filemap()
  */
 static uint16_t map_libmtp_type_to_ptp_type(LIBMTP_filetype_t intype)
 {
-  filemap_t *current;
-
-  current = g_filemap;
-
-  while (current != NULL) {
-    if(current->id == intype) {
-      return current->ptp_id;
-    }
-    current = current->next;
+  if ((unsigned int) intype <= LIBMTP_FILETYPE_UNKNOWN &&
+      g_filemap_by_id[intype] != NULL) {
+    return g_filemap_by_id[intype]->ptp_id;
   }
   // printf("map_libmtp_type_to_ptp_type: unknown filetype.\n");
   return PTP_OFC_Undefined;
@@ -440,15 +601,10 @@ static uint16_t map_libmtp_type_to_ptp_type(LIBMTP_filetype_t intype)
  */
 static LIBMTP_filetype_t map_ptp_type_to_libmtp_type(uint16_t intype)
 {
-  filemap_t *current;
-
-  current = g_filemap;
+  filemap_t *current = find_filemap_ptp_id(intype);
 
-  while (current != NULL) {
-    if(current->ptp_id == intype) {
-      return current->id;
-    }
-    current = current->next;
+  if (current != NULL) {
+    return current->id;
   }
   // printf("map_ptp_type_to_libmtp_type: unknown filetype.\n");
   return LIBMTP_FILETYPE_UNKNOWN;
@@ -704,6 +860,34 @@ static void init_propertymap()
   register_property("Unknown property", LIBMTP_PROPERTY_UNKNOWN, 0);
 }
 
+/**
+ * Build the lookup indexes for the property mapping table, the same
+ * way as <code>index_filemap()</code> does for filetypes.
+ */
+static void index_propertymap()
+{
+  propertymap_t *current;
+
+  memset(g_propertymap_by_id, 0, sizeof(g_propertymap_by_id));
+  g_propertymap_nr_ptp_ids = 0;
+  for (current = g_propertymap; current != NULL; current = current->next) {
+    unsigned int i;
+
+    if ((unsigned int) current->id > LIBMTP_PROPERTY_UNKNOWN)
+      continue;
+    g_propertymap_by_id[current->id] = current;
+    for (i = g_propertymap_nr_ptp_ids;
+	 i > 0 && g_propertymap_by_ptp_id[i-1]->ptp_id > current->ptp_id; i--)
+      ;
+    if (i > 0 && g_propertymap_by_ptp_id[i-1]->ptp_id == current->ptp_id)
+      continue;
+    memmove(&g_propertymap_by_ptp_id[i+1], &g_propertymap_by_ptp_id[i],
+	    (g_propertymap_nr_ptp_ids - i) * sizeof(propertymap_t *));
+    g_propertymap_by_ptp_id[i] = current;
+    g_propertymap_nr_ptp_ids++;
+  }
+}
+
 /**
  * Returns the PTP property that maps to a certain libmtp internal property type.
  * @param inproperty the MTP library interface property
@@ -711,15 +895,9 @@ static void init_propertymap()
  */
 static uint16_t map_libmtp_property_to_ptp_property(LIBMTP_property_t inproperty)
 {
-  propertymap_t *current;
-
-  current = g_propertymap;
-
-  while (current != NULL) {
-    if(current->id == inproperty) {
-      return current->ptp_id;
-    }
-    current = current->next;
+  if ((unsigned int) inproperty <= LIBMTP_PROPERTY_UNKNOWN &&
+      g_propertymap_by_id[inproperty] != NULL) {
+    return g_propertymap_by_id[inproperty]->ptp_id;
   }
   return 0;
 }
@@ -733,15 +911,17 @@ static uint16_t map_libmtp_property_to_ptp_property(LIBMTP_property_t inproperty
  */
 static LIBMTP_property_t map_ptp_property_to_libmtp_property(uint16_t inproperty)
 {
-  propertymap_t *current;
+  unsigned int lo = 0, hi = g_propertymap_nr_ptp_ids;
 
-  current = g_propertymap;
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
 
-  while (current != NULL) {
-    if(current->ptp_id == inproperty) {
-      return current->id;
-    }
-    current = current->next;
+    if (g_propertymap_by_ptp_id[mid]->ptp_id == inproperty)
+      return g_propertymap_by_ptp_id[mid]->id;
+    if (g_propertymap_by_ptp_id[mid]->ptp_id < inproperty)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
   // printf("map_ptp_type_to_libmtp_type: unknown filetype.\n");
   return LIBMTP_PROPERTY_UNKNOWN;
@@ -774,6 +954,8 @@ void LIBMTP_Set_Debug(int level)
 void LIBMTP_Init(void)
 {
   const char *env_debug = getenv("LIBMTP_DEBUG");
+  const char *env_cache_dir;
+
   if (env_debug) {
     const long debug_flags = strtol(env_debug, NULL, 0);
     if (debug_flags != LONG_MIN && debug_flags != LONG_MAX &&
@@ -785,8 +967,14 @@ void LIBMTP_Init(void)
     }
   }
 
+  env_cache_dir = getenv("LIBMTP_CACHE_DIR");
+  if (env_cache_dir)
+    LIBMTP_Set_Metadata_Cache_Directory(env_cache_dir);
+
   init_filemap();
   init_propertymap();
+  index_filemap();
+  index_propertymap();
 
   if (mtpz_loaddata() == -1)
     use_mtpz = 0;
@@ -806,15 +994,9 @@ void LIBMTP_Init(void)
  */
 char const * LIBMTP_Get_Filetype_Description(LIBMTP_filetype_t intype)
 {
-  filemap_t *current;
-
-  current = g_filemap;
-
-  while (current != NULL) {
-    if(current->id == intype) {
-      return current->description;
-    }
-    current = current->next;
+  if ((unsigned int) intype <= LIBMTP_FILETYPE_UNKNOWN &&
+      g_filemap_by_id[intype] != NULL) {
+    return g_filemap_by_id[intype]->description;
   }
 
   return "Unknown filetype";
@@ -829,15 +1011,9 @@ char const * LIBMTP_Get_Filetype_Description(LIBMTP_filetype_t intype)
  */
 char const * LIBMTP_Get_Property_Description(LIBMTP_property_t inproperty)
 {
-  propertymap_t *current;
-
-  current = g_propertymap;
-
-  while (current != NULL) {
-    if(current->id == inproperty) {
-      return current->description;
-    }
-    current = current->next;
+  if ((unsigned int) inproperty <= LIBMTP_PROPERTY_UNKNOWN &&
+      g_propertymap_by_id[inproperty] != NULL) {
+    return g_propertymap_by_id[inproperty]->description;
   }
 
   return "Unknown property";
@@ -1836,25 +2012,254 @@ static void parse_extension_descriptor(LIBMTP_mtpdevice_t *mtpdevice,
   }
 }
 
+/*
+ * What the probes of open_raw_device_uncached() found out about a
+ * model, by VID/PID and firmware version, so that further devices of
+ * the same kind are opened without them.
+ */
+typedef struct capability_cache_struct capability_cache_t;
+struct capability_cache_struct {
+  uint16_t vendor_id;
+  uint16_t product_id;
+  char *version;
+  uint8_t object_bitsize;
+  uint8_t maximum_battery_level; /**< 0 if it has not been probed yet */
+  capability_cache_t *next;
+};
+static capability_cache_t *g_capability_cache = NULL;
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t g_capability_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+// Probe as little as possible when opening, see LIBMTP_Set_Fast_Open()
+static int g_fast_open = 0;
+
+static void lock_capabilities(int const lock)
+{
+#ifdef HAVE_PTHREAD_H
+  if (lock)
+    pthread_mutex_lock(&g_capability_lock);
+  else
+    pthread_mutex_unlock(&g_capability_lock);
+#endif
+}
+
+static capability_cache_t *find_capabilities(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  char const *version = params->deviceinfo.DeviceVersion;
+  capability_cache_t *cc;
+
+  if (version == NULL)
+    version = "";
+  for (cc = g_capability_cache; cc != NULL; cc = cc->next) {
+    if (cc->vendor_id == ptp_usb->rawdevice.device_entry.vendor_id &&
+	cc->product_id == ptp_usb->rawdevice.device_entry.product_id &&
+	!strcmp(cc->version, version))
+      return cc;
+  }
+  return NULL;
+}
+
 /**
- * This function opens a device from a raw device. It is the
- * preferred way to access devices in the new interface where
- * several devices can come and go as the library is working
- * on a certain device.
+ * Internal function to take the probe results of an earlier device of
+ * the same model and firmware.
+ * @param device the device being opened.
+ * @return 1 if the device got the object bit size and maybe the
+ *         maximum battery level, 0 if this model has not been seen.
+ */
+static int lookup_capabilities(LIBMTP_mtpdevice_t *device)
+{
+  capability_cache_t *cc;
+  int found = 0;
+
+  lock_capabilities(1);
+  cc = find_capabilities(device);
+  if (cc != NULL) {
+    device->object_bitsize = cc->object_bitsize;
+    device->maximum_battery_level = cc->maximum_battery_level;
+    found = 1;
+  }
+  lock_capabilities(0);
+  return found;
+}
+
+/**
+ * Internal function to keep the probe results of a device for the
+ * next device of the same model and firmware.
+ * @param device the device that was probed.
+ */
+static void remember_capabilities(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  capability_cache_t *cc;
+
+  lock_capabilities(1);
+  cc = find_capabilities(device);
+  if (cc == NULL) {
+    cc = (capability_cache_t *) calloc(1, sizeof(capability_cache_t));
+    if (cc != NULL)
+      cc->version = strdup(params->deviceinfo.DeviceVersion ?
+			   params->deviceinfo.DeviceVersion : "");
+    if (cc == NULL || cc->version == NULL) {
+      free(cc);
+      lock_capabilities(0);
+      return;
+    }
+    cc->vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+    cc->product_id = ptp_usb->rawdevice.device_entry.product_id;
+    cc->next = g_capability_cache;
+    g_capability_cache = cc;
+  }
+  cc->object_bitsize = device->object_bitsize;
+  if (device->maximum_battery_level != 0)
+    cc->maximum_battery_level = device->maximum_battery_level;
+  lock_capabilities(0);
+}
+
+/**
+ * Internal function to find out if the object size is 32 or 64 bit
+ * wide, from the ObjectSize property description of the formats.
+ * @param params the PTP parameters of the device.
+ * @param first_only settle on the first format that has a description
+ *        rather than checking that all formats agree.
+ * @return 32 or 64.
+ */
+static uint8_t probe_object_bitsize(PTPParams *params, int const first_only)
+{
+  uint8_t bs = 0;
+  unsigned int i;
+
+  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjectPropsSupported)) {
+    for (i=0;i<params->deviceinfo.ImageFormats_len;i++) {
+      PTPObjectPropDesc opd;
+
+      if (ptp_mtp_getobjectpropdesc(params,
+                                    PTP_OPC_ObjectSize,
+                                    params->deviceinfo.ImageFormats[i],
+                                    &opd) != PTP_RC_OK) {
+        LIBMTP_ERROR("LIBMTP PANIC: "
+                     "could not inspect object property description 0x%04x!\n", params->deviceinfo.ImageFormats[i]);
+      } else {
+        if (opd.DataType == PTP_DTC_UINT32) {
+          if (bs == 0) {
+            bs = 32;
+          } else if (bs != 32) {
+            LIBMTP_ERROR("LIBMTP PANIC: "
+                         "different objects support different object sizes!\n");
+            bs = 0;
+            break;
+          }
+        } else if (opd.DataType == PTP_DTC_UINT64) {
+          if (bs == 0) {
+            bs = 64;
+          } else if (bs != 64) {
+            LIBMTP_ERROR("LIBMTP PANIC: "
+                         "different objects support different object sizes!\n");
+            bs = 0;
+            break;
+          }
+        } else {
+          // Ignore if other size.
+          LIBMTP_ERROR("LIBMTP PANIC: "
+                       "awkward object size data type: %04x\n", opd.DataType);
+          bs = 0;
+          break;
+        }
+        if (first_only)
+          break;
+      }
+    }
+  }
+  if (bs == 0) {
+    // Could not detect object bitsize, assume 32 bits
+    bs = 32;
+  }
+  return bs;
+}
+
+/**
+ * Internal function to read the maximum battery level of a device,
+ * which is 100 unless the device says otherwise.
+ * @param device the device to probe.
+ */
+static void probe_battery_level(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+
+  /* Default Max Battery Level, we will adjust this if possible */
+  device->maximum_battery_level = 100;
+
+  /* Check if device supports reading maximum battery level */
+  if(!FLAG_BROKEN_BATTERY_LEVEL(ptp_usb) &&
+     ptp_property_issupported(params, PTP_DPC_BatteryLevel)) {
+    PTPDevicePropDesc dpd;
+
+    /* Try to read maximum battery level */
+    if(ptp_getdevicepropdesc(params,
+			     PTP_DPC_BatteryLevel,
+			     &dpd) != PTP_RC_OK) {
+      add_error_to_errorstack(device,
+			      LIBMTP_ERROR_CONNECTING,
+			      "Unable to read Maximum Battery Level for this "
+			      "device even though the device supposedly "
+			      "supports this functionality");
+      return;
+    }
+
+    /* TODO: is this appropriate? */
+    /* If max battery level is 0 then leave the default, otherwise assign */
+    if (dpd.FORM.Range.MaximumValue.u8 != 0) {
+      device->maximum_battery_level = dpd.FORM.Range.MaximumValue.u8;
+    }
+
+    ptp_free_devicepropdesc(&dpd);
+  }
+}
+
+/**
+ * This makes opening devices probe as little as possible. The object
+ * size width is taken from the first object format that describes its
+ * ObjectSize instead of checking that all formats agree, and the
+ * maximum battery level is only read on the first call to
+ * <code>LIBMTP_Get_Batterylevel()</code>, so
+ * <code>maximum_battery_level</code> of a device stays 0 until then.
+ *
+ * Whether fast open is enabled or not, the probe results are kept for
+ * the rest of the process by VID/PID and firmware version, and a
+ * device of a model that has been opened before is not probed again.
+ * @param enable 1 to enable fast open, 0 to probe everything, which
+ *        is the default.
+ */
+void LIBMTP_Set_Fast_Open(int const enable)
+{
+  g_fast_open = enable;
+}
+
+/**
+ * Opens a device from a raw device without caching its objects.
  * @param rawdevice the raw device to open a "real" device for.
+ * @param private_context give the device a USB context of its own.
+ * @param simulation the simulated device to serve the transport, or
+ *        NULL to use the USB device.
+ * @param address the PTP/IP device to connect to instead, or NULL.
  * @return an open device.
  */
-LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevice)
+static LIBMTP_mtpdevice_t *open_raw_device_uncached(LIBMTP_raw_device_t *rawdevice,
+						    int const private_context,
+						    LIBMTP_simulation_t const *simulation,
+						    char const *address)
 {
   LIBMTP_mtpdevice_t *mtp_device;
-  uint8_t bs = 0;
   PTPParams *current_params;
   PTP_USB *ptp_usb;
   LIBMTP_error_number_t err;
   unsigned int i;
 
   /* Allocate dynamic space for our device */
-  mtp_device = (LIBMTP_mtpdevice_t *) malloc(sizeof(LIBMTP_mtpdevice_t));
+  mtp_device = (LIBMTP_mtpdevice_t *) malloc(sizeof(mtp_device_private_t));
   /* Check if there was a memory allocation error */
   if(mtp_device == NULL) {
     /* There has been an memory allocation error. We are going to ignore this
@@ -1867,7 +2272,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
 
     return NULL;
   }
-  memset(mtp_device, 0, sizeof(LIBMTP_mtpdevice_t));
+  memset(mtp_device, 0, sizeof(mtp_device_private_t));
   // Non-cached by default
   mtp_device->cached = 0;
 
@@ -1907,9 +2312,21 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   mtp_device->params = current_params;
 
   /* Create usbinfo, this also opens the session */
-  err = configure_usb_device(rawdevice,
-			     current_params,
-			     &mtp_device->usbinfo);
+  if (simulation != NULL)
+    err = configure_simulated_device(simulation,
+				     rawdevice,
+				     current_params,
+				     &mtp_device->usbinfo);
+  else if (address != NULL)
+    err = configure_ptpip_device(address,
+				 rawdevice,
+				 current_params,
+				 &mtp_device->usbinfo);
+  else
+    err = configure_usb_device(rawdevice,
+			       current_params,
+			       private_context,
+			       &mtp_device->usbinfo);
   if (err != LIBMTP_ERROR_NONE) {
     free(current_params);
     free(mtp_device);
@@ -1918,6 +2335,7 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   ptp_usb = (PTP_USB*) mtp_device->usbinfo;
   /* Set pointer back to params */
   ptp_usb->params = current_params;
+  init_timeout_policy(current_params, ptp_usb);
 
   /* Cache the device information for later use */
   if (ptp_getdeviceinfo(current_params,
@@ -1997,6 +2415,12 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
       ptp_usb->rawdevice.device_entry.device_flags |= DEVICE_FLAGS_SONY_NWZ_BUGS;
       LIBMTP_INFO("SONY NWZ device detected, assigning default bug flags\n");
     }
+
+    /*
+     * Applications on an Android device write to the same storage
+     * without telling us, so its free space is asked for every time.
+     */
+    DEVICE_PRIVATE(mtp_device)->freespace = new_freespace(is_android);
   }
 
   /*
@@ -2024,82 +2448,20 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
     }
   }
 
-  /* Determine if the object size supported is 32 or 64 bit wide */
-  if (ptp_operation_issupported(current_params,PTP_OC_MTP_GetObjectPropsSupported)) {
-    for (i=0;i<current_params->deviceinfo.ImageFormats_len;i++) {
-      PTPObjectPropDesc opd;
-
-      if (ptp_mtp_getobjectpropdesc(current_params,
-                                    PTP_OPC_ObjectSize,
-                                    current_params->deviceinfo.ImageFormats[i],
-                                    &opd) != PTP_RC_OK) {
-        LIBMTP_ERROR("LIBMTP PANIC: "
-                     "could not inspect object property description 0x%04x!\n", current_params->deviceinfo.ImageFormats[i]);
-      } else {
-        if (opd.DataType == PTP_DTC_UINT32) {
-          if (bs == 0) {
-            bs = 32;
-          } else if (bs != 32) {
-            LIBMTP_ERROR("LIBMTP PANIC: "
-                         "different objects support different object sizes!\n");
-            bs = 0;
-            break;
-          }
-        } else if (opd.DataType == PTP_DTC_UINT64) {
-          if (bs == 0) {
-            bs = 64;
-          } else if (bs != 64) {
-            LIBMTP_ERROR("LIBMTP PANIC: "
-                         "different objects support different object sizes!\n");
-            bs = 0;
-            break;
-          }
-        } else {
-          // Ignore if other size.
-          LIBMTP_ERROR("LIBMTP PANIC: "
-                       "awkward object size data type: %04x\n", opd.DataType);
-          bs = 0;
-          break;
-        }
-      }
-    }
-  }
-  if (bs == 0) {
-    // Could not detect object bitsize, assume 32 bits
-    bs = 32;
-  }
-  mtp_device->object_bitsize = bs;
-
   /* No Errors yet for this device */
   mtp_device->errorstack = NULL;
 
-  /* Default Max Battery Level, we will adjust this if possible */
-  mtp_device->maximum_battery_level = 100;
-
-  /* Check if device supports reading maximum battery level */
-  if(!FLAG_BROKEN_BATTERY_LEVEL(ptp_usb) &&
-     ptp_property_issupported( current_params, PTP_DPC_BatteryLevel)) {
-    PTPDevicePropDesc dpd;
-
-    /* Try to read maximum battery level */
-    if(ptp_getdevicepropdesc(current_params,
-			     PTP_DPC_BatteryLevel,
-			     &dpd) != PTP_RC_OK) {
-      add_error_to_errorstack(mtp_device,
-			      LIBMTP_ERROR_CONNECTING,
-			      "Unable to read Maximum Battery Level for this "
-			      "device even though the device supposedly "
-			      "supports this functionality");
-    }
-
-    /* TODO: is this appropriate? */
-    /* If max battery level is 0 then leave the default, otherwise assign */
-    if (dpd.FORM.Range.MaximumValue.u8 != 0) {
-      mtp_device->maximum_battery_level = dpd.FORM.Range.MaximumValue.u8;
-    }
-
-    ptp_free_devicepropdesc(&dpd);
-  }
+  /*
+   * Determine if the object size supported is 32 or 64 bit wide and
+   * the maximum battery level, unless this model has been probed
+   * already. Fast open leaves the battery for LIBMTP_Get_Batterylevel().
+   */
+  if (!lookup_capabilities(mtp_device))
+    mtp_device->object_bitsize = probe_object_bitsize(current_params,
+						      g_fast_open);
+  if (mtp_device->maximum_battery_level == 0 && !g_fast_open)
+    probe_battery_level(mtp_device);
+  remember_capabilities(mtp_device);
 
   /* Set all default folders to 0xffffffffU (root directory) */
   mtp_device->default_music_folder = 0xffffffffU;
@@ -2124,9 +2486,37 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevi
   return mtp_device;
 }
 
-LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
+/**
+ * This function opens a device from a raw device. It is the
+ * preferred way to access devices in the new interface where
+ * several devices can come and go as the library is working
+ * on a certain device.
+ * @param rawdevice the raw device to open a "real" device for.
+ * @return an open device.
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Uncached(LIBMTP_raw_device_t *rawdevice)
+{
+  return open_raw_device_uncached(rawdevice, 0, NULL, NULL);
+}
+
+/**
+ * Opens a device from a raw device and caches its objects.
+ * @param rawdevice the raw device to open a "real" device for.
+ * @param private_context give the device a USB context of its own.
+ * @param simulation the simulated device to serve the transport, or
+ *        NULL to use the USB device.
+ * @param address the PTP/IP device to connect to instead, or NULL.
+ * @return an open device.
+ */
+static LIBMTP_mtpdevice_t *open_raw_device(LIBMTP_raw_device_t *rawdevice,
+					   int const private_context,
+					   LIBMTP_simulation_t const *simulation,
+					   char const *address)
 {
-  LIBMTP_mtpdevice_t *mtp_device = LIBMTP_Open_Raw_Device_Uncached(rawdevice);
+  LIBMTP_mtpdevice_t *mtp_device = open_raw_device_uncached(rawdevice,
+							    private_context,
+							    simulation,
+							    address);
 
   if (mtp_device == NULL)
     return NULL;
@@ -2154,12 +2544,126 @@ LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
   /*
    * Then get the handles and try to locate the default folders.
    * This has the desired side effect of caching all handles from
-   * the device which speeds up later operations.
+   * the device which speeds up later operations. A snapshot from
+   * an earlier session saves the enumeration if it is still valid.
    */
-  flush_handles(mtp_device);
+  if (load_metadata_cache(mtp_device) != 0)
+    flush_handles(mtp_device);
   return mtp_device;
 }
 
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device(LIBMTP_raw_device_t *rawdevice)
+{
+  return open_raw_device(rawdevice, 0, NULL, NULL);
+}
+
+/**
+ * Opens a simulated device, that answers from memory instead of the
+ * bus, with the objects it is described to have. This is meant for
+ * benchmarks and tests of applications and the library that need the
+ * same device every time, of any size, without the hardware.
+ *
+ * The device info is taken from the output of <code>mtp-detect</code>
+ * in <code>simulation->profile</code> if it is set, so that the device
+ * says what that device said and the library treats it like it, or
+ * made up otherwise. The storages hold the folders and files that
+ * were asked for, all with made-up names and contents. Each
+ * transaction takes <code>latency</code> microseconds and the data
+ * phases take the time <code>bandwidth</code> bytes per second allow;
+ * if both are 0, the device answers as fast as it can, which shows the
+ * time spent in the library. Objects can be sent to and deleted from
+ * the device as long as it is open.
+ *
+ * Events are not simulated: <code>LIBMTP_Read_Event()</code> and the
+ * event listener fail on these devices.
+ *
+ * @param simulation the device to simulate.
+ * @return an open device with its objects cached, or NULL if the
+ *         profile could not be read or the device could not be set up.
+ * @see LIBMTP_Open_Simulated_Device_Uncached()
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Simulated_Device(LIBMTP_simulation_t const *simulation)
+{
+  LIBMTP_raw_device_t rawdevice;
+
+  if (simulated_raw_device(simulation, &rawdevice) != LIBMTP_ERROR_NONE)
+    return NULL;
+  return open_raw_device(&rawdevice, 0, simulation, NULL);
+}
+
+/**
+ * Opens a simulated device like
+ * <code>LIBMTP_Open_Simulated_Device()</code> does, without caching
+ * its objects.
+ * @param simulation the device to simulate.
+ * @return an open device, or NULL if it could not be set up.
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_Simulated_Device_Uncached(LIBMTP_simulation_t const *simulation)
+{
+  LIBMTP_raw_device_t rawdevice;
+
+  if (simulated_raw_device(simulation, &rawdevice) != LIBMTP_ERROR_NONE)
+    return NULL;
+  return open_raw_device_uncached(&rawdevice, 0, simulation, NULL);
+}
+
+/**
+ * Connects to a device over PTP/IP, the network transport of PTP that
+ * cameras with Wi-Fi or Ethernet offer, and opens it. The device must
+ * be waiting for a connection, which many cameras only do once
+ * they were paired with the host in their menus; the pairing
+ * remembers the host by a GUID made from its host name.
+ *
+ * Data phases go as fast as the network allows: the socket buffers
+ * are made large and the packets go straight between the socket and
+ * the buffers of the application where it can. Events come on a
+ * connection of their own and are read with
+ * <code>LIBMTP_Read_Event()</code>; the event listener and
+ * <code>LIBMTP_Read_Event_Async()</code> only work on USB devices.
+ *
+ * @param address the device, as "host" or "host:port", for instance
+ *        "192.168.1.1" or "[fe80::1%wlan0]:15740". The port is 15740
+ *        if none is given.
+ * @return an open device with its objects cached, or NULL if it could
+ *         not be connected to.
+ * @see LIBMTP_Open_PTPIP_Device_Uncached()
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_PTPIP_Device(char const *address)
+{
+  LIBMTP_raw_device_t rawdevice;
+
+  if (ptpip_raw_device(address, &rawdevice) != LIBMTP_ERROR_NONE)
+    return NULL;
+  return open_raw_device(&rawdevice, 0, NULL, address);
+}
+
+/**
+ * Connects to a device over PTP/IP like
+ * <code>LIBMTP_Open_PTPIP_Device()</code> does, without caching its
+ * objects.
+ * @param address the device, as "host" or "host:port".
+ * @return an open device, or NULL if it could not be connected to.
+ */
+LIBMTP_mtpdevice_t *LIBMTP_Open_PTPIP_Device_Uncached(char const *address)
+{
+  LIBMTP_raw_device_t rawdevice;
+
+  if (ptpip_raw_device(address, &rawdevice) != LIBMTP_ERROR_NONE)
+    return NULL;
+  return open_raw_device_uncached(&rawdevice, 0, NULL, address);
+}
+
+/*
+ * Whether a device is simulated or reached over PTP/IP, and has no USB
+ * event endpoint to read events from.
+ */
+static int is_off_bus(LIBMTP_mtpdevice_t *device)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) device->usbinfo;
+
+  return ptp_usb->simulation != NULL || ptp_usb->ptpip;
+}
+
 /**
  * To read events sent by the device, repeatedly call this function from a secondary
  * thread until the return value is < 0.
@@ -2183,17 +2687,24 @@ int LIBMTP_Read_Event(LIBMTP_mtpdevice_t *device, LIBMTP_event_t *event, uint32_
    */
   PTPParams *params = (PTPParams *) device->params;
   PTPContainer ptp_event;
-  uint16_t ret = ptp_usb_event_wait(params, &ptp_event);
+  uint16_t ret;
 
+  if (((PTP_USB *) device->usbinfo)->ptpip)
+    ret = params->event_wait(params, &ptp_event);
+  else if (is_off_bus(device))
+    return -1;
+  else
+    ret = ptp_usb_event_wait(params, &ptp_event);
   if (ret != PTP_RC_OK) {
     /* Device is closing down or other fatal stuff, exit thread */
     return -1;
   }
-  LIBMTP_Handle_Event(&ptp_event, event, out1);
+  LIBMTP_Handle_Event(device, &ptp_event, event, out1);
   return 0;
 }
 
-void LIBMTP_Handle_Event(PTPContainer *ptp_event,
+void LIBMTP_Handle_Event(LIBMTP_mtpdevice_t *device,
+                         PTPContainer *ptp_event,
                          LIBMTP_event_t *event, uint32_t *out1) {
   uint16_t code;
   uint32_t session_id;
@@ -2217,11 +2728,13 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       LIBMTP_INFO("Received event PTP_EC_ObjectAdded in session %u\n", session_id);
       *event = LIBMTP_EVENT_OBJECT_ADDED;
       *out1 = param1;
+      queue_cache_event(device, code, param1);
       break;
     case PTP_EC_ObjectRemoved:
       LIBMTP_INFO("Received event PTP_EC_ObjectRemoved in session %u\n", session_id);
       *event = LIBMTP_EVENT_OBJECT_REMOVED;
       *out1 = param1;
+      queue_cache_event(device, code, param1);
       break;
     case PTP_EC_StoreAdded:
       LIBMTP_INFO("Received event PTP_EC_StoreAdded in session %u\n", session_id);
@@ -2243,7 +2756,7 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_ObjectInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_ObjectInfoChanged in session %u\n", session_id);
-      /* TODO: rescan object cache or just for this one object */
+      queue_cache_event(device, code, param1);
       break;
     case PTP_EC_DeviceInfoChanged:
       LIBMTP_INFO("Received event PTP_EC_DeviceInfoChanged in session %u\n", session_id);
@@ -2254,13 +2767,15 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
       break;
     case PTP_EC_StoreFull:
       LIBMTP_INFO("Received event PTP_EC_StoreFull in session %u\n", session_id);
+      invalidate_freespace(device, param1);
       break;
     case PTP_EC_DeviceReset:
       LIBMTP_INFO("Received event PTP_EC_DeviceReset in session %u\n", session_id);
       break;
     case PTP_EC_StorageInfoChanged :
       LIBMTP_INFO( "Received event PTP_EC_StorageInfoChanged in session %u\n", session_id);
-     /* TODO: update storage info */
+      /* The next free space check asks the device */
+      invalidate_freespace(device, param1);
       break;
     case PTP_EC_CaptureComplete :
       LIBMTP_INFO( "Received event PTP_EC_CaptureComplete in session %u\n", session_id);
@@ -2268,6 +2783,11 @@ void LIBMTP_Handle_Event(PTPContainer *ptp_event,
     case PTP_EC_UnreportedStatus :
       LIBMTP_INFO( "Received event PTP_EC_UnreportedStatus in session %u\n", session_id);
       break;
+    case PTP_EC_MTP_ObjectReferencesChanged :
+      LIBMTP_INFO( "Received event PTP_EC_MTP_ObjectReferencesChanged in session %u\n", session_id);
+      /* The next listing asks the device again */
+      queue_cache_event(device, code, param1);
+      break;
     default :
       LIBMTP_INFO( "Received unknown event in session %u\n", session_id);
       break;
@@ -2284,7 +2804,7 @@ static void LIBMTP_Read_Event_Cb(PTPParams *params, uint16_t ret_code,
   switch (ret_code) {
   case PTP_RC_OK:
     handler_ret = LIBMTP_HANDLER_RETURN_OK;
-    LIBMTP_Handle_Event(ptp_event, &event, &param1);
+    LIBMTP_Handle_Event(data->device, ptp_event, &event, &param1);
     break;
   case PTP_ERROR_CANCEL:
     handler_ret = LIBMTP_HANDLER_RETURN_CANCEL;
@@ -2318,9 +2838,13 @@ static void LIBMTP_Read_Event_Cb(PTPParams *params, uint16_t ret_code,
  */
 int LIBMTP_Read_Event_Async(LIBMTP_mtpdevice_t *device, LIBMTP_event_cb_fn cb, void *user_data) {
   PTPParams *params = (PTPParams *) device->params;
-  event_cb_data_t *data =  malloc(sizeof(event_cb_data_t));
+  event_cb_data_t *data;
   uint16_t ret;
 
+  if (is_off_bus(device))
+    return -1;
+  data = malloc(sizeof(event_cb_data_t));
+  data->device = device;
   data->cb = cb;
   data->user_data = user_data;
 
@@ -2328,6 +2852,185 @@ int LIBMTP_Read_Event_Async(LIBMTP_mtpdevice_t *device, LIBMTP_event_cb_fn cb, v
   return ret == PTP_RC_OK ? 0 : -1;
 }
 
+/**
+ * This starts a listener for the events of a device, that keeps
+ * several reads of the event endpoint underway so that events sent in
+ * a quick burst, like the object additions of a camera capturing, are
+ * not lost between two reads. The events are queued as they come in,
+ * from within <code>LIBMTP_Handle_Events_Timeout_Completed()</code>,
+ * and then read with <code>LIBMTP_Read_Queued_Event()</code>.
+ *
+ * The queue is bounded: if the application does not keep up, the
+ * events that do not fit are dropped and reported as a single
+ * <code>LIBMTP_EVENT_EVENTS_LOST</code> where they would have been.
+ * While the listener runs, <code>LIBMTP_Read_Event()</code> and
+ * <code>LIBMTP_Read_Event_Async()</code> fail. It is stopped with
+ * <code>LIBMTP_Stop_Event_Listener()</code> or when the device is
+ * released.
+ *
+ * This only works with libusb-1.0, and not on devices opened with
+ * <code>LIBMTP_Open_Raw_Device_Worker()</code>.
+ *
+ * @param device a pointer to the MTP device to listen to.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Start_Event_Listener(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  if (is_off_bus(device)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Start_Event_Listener(): "
+			    "only USB devices can be listened to.");
+    return -1;
+  }
+  ret = ptp_usb_event_listen_start(params);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Start_Event_Listener(): "
+				"could not start listening for events.");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * This stops the event listener of a device, dropping any events that
+ * were not read yet.
+ * @param device a pointer to the MTP device to stop listening to.
+ * @see LIBMTP_Start_Event_Listener()
+ */
+void LIBMTP_Stop_Event_Listener(LIBMTP_mtpdevice_t *device)
+{
+  if (is_off_bus(device))
+    return;
+  ptp_usb_event_listen_stop((PTPParams *) device->params);
+}
+
+/**
+ * This reads the next event queued by the event listener, without
+ * waiting for one. It handles the event like
+ * <code>LIBMTP_Read_Event()</code> does, so the object cache follows
+ * it if that was asked for with
+ * <code>LIBMTP_Set_Event_Cache_Update()</code>.
+ *
+ * Where events were dropped, this returns
+ * <code>LIBMTP_EVENT_EVENTS_LOST</code> with the number of them in
+ * <code>out1</code>. As the cache can then no longer follow the device,
+ * it is thrown away and built again the next time it is read.
+ *
+ * @param device a pointer to the MTP device to read an event from.
+ * @param event a pointer to the variable that will hold the event.
+ * @param out1 a pointer to the variable that will hold the parameter
+ *        of the event, or the number of dropped events.
+ * @return 1 if an event was read, 0 if none is queued, -1 if none is
+ *         queued and the listener has ended, for instance because the
+ *         device went away, or does not run.
+ * @see LIBMTP_Start_Event_Listener()
+ */
+int LIBMTP_Read_Queued_Event(LIBMTP_mtpdevice_t *device,
+			     LIBMTP_event_t *event, uint32_t *out1)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPContainer ptp_event;
+  unsigned int lost;
+  int ret;
+
+  *event = LIBMTP_EVENT_NONE;
+  if (is_off_bus(device))
+    return -1;
+  ret = ptp_usb_event_listen_get(params, &ptp_event, &lost);
+  if (ret != 1)
+    return ret;
+  if (lost == 0) {
+    LIBMTP_Handle_Event(device, &ptp_event, event, out1);
+    return 1;
+  }
+  LIBMTP_INFO("Event queue of the device overflowed, %u events lost\n", lost);
+  *event = LIBMTP_EVENT_EVENTS_LOST;
+  *out1 = lost;
+  if (params->events_update_cache) {
+    // Lost track, so start over on the next read
+    ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+    ptp_free_objects(params);
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  }
+  return 1;
+}
+
+/**
+ * This makes the object cache of a device follow the object events
+ * the device sends, so that it stays current after changes made on
+ * the device itself without a full rescan. The events still have to
+ * be read with <code>LIBMTP_Read_Event()</code> or
+ * <code>LIBMTP_Read_Event_Async()</code>: removed objects are dropped
+ * from the cache right away, added and changed objects are (re)loaded
+ * the next time the cache is read.
+ *
+ * @param device a pointer to the device to configure.
+ * @param enable 1 to update the cache from events, 0 to leave it alone.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Event_Cache_Update(LIBMTP_mtpdevice_t *device, int const enable)
+{
+  PTPParams *params = (PTPParams *) device->params;
+
+  params->events_update_cache = enable ? 1 : 0;
+  return 0;
+}
+
+/**
+ * Queue an object event from the device for <code>update_cache()</code>.
+ * This runs in the event callbacks, which may be called from inside
+ * another thread's transfer or in the middle of decoding a property
+ * list, so it takes no lock but the event lock and leaves the object
+ * cache alone. Only the last object event for an object is kept,
+ * folded so that applying it still has the effect of all of them.
+ * Reference changes are queued apart from them.
+ * @param device the device whose cache should be updated.
+ * @param code the PTP event code.
+ * @param object_id the object the event is about.
+ */
+static void queue_cache_event(LIBMTP_mtpdevice_t *device, uint16_t code,
+                              uint32_t object_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObjectEvent *events;
+  int const refs = code == PTP_EC_MTP_ObjectReferencesChanged;
+  unsigned int i;
+
+  // Removals are also needed for the references cache
+  if (!params->events_update_cache && !refs && code != PTP_EC_ObjectRemoved)
+    return;
+
+  ptp_lock(params, PTP_LOCK_EVENTS);
+  for (i = 0; i < params->nrofobject_events; i++) {
+    if (params->object_events[i].oid == object_id &&
+	(params->object_events[i].code == PTP_EC_MTP_ObjectReferencesChanged) == refs) {
+      // Anything after an earlier removal or change is a change
+      if (!refs && code != PTP_EC_ObjectRemoved &&
+	  params->object_events[i].code != PTP_EC_ObjectAdded)
+	code = PTP_EC_ObjectInfoChanged;
+      params->nrofobject_events--;
+      memmove(&params->object_events[i], &params->object_events[i+1],
+	      (params->nrofobject_events - i) * sizeof(PTPObjectEvent));
+      break;
+    }
+  }
+  events = realloc(params->object_events,
+		   (params->nrofobject_events + 1) * sizeof(PTPObjectEvent));
+  if (events == NULL) {
+    // Lost track, so start over on the next read
+    params->object_events_lost = 1;
+  } else {
+    params->object_events = events;
+    params->object_events[params->nrofobject_events].oid = object_id;
+    params->object_events[params->nrofobject_events].code = code;
+    params->nrofobject_events++;
+  }
+  ptp_lock(params, PTP_UNLOCK_EVENTS);
+}
+
 /**
  * Recursive function that adds MTP devices to a linked list
  * @param devices a list of raw devices to have real devices created for.
@@ -2441,7 +3144,18 @@ void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  close_device(ptp_usb, params);
+  // Let the worker finish what was submitted before closing
+  stop_device_worker(device);
+  if (g_metadata_cache_dir != NULL && device->cached)
+    LIBMTP_Save_Metadata_Cache(device);
+  if (ptp_usb->simulation != NULL)
+    close_simulated_device(ptp_usb, params);
+  else if (ptp_usb->ptpip)
+    close_ptpip_device(ptp_usb, params);
+  else
+    close_device(ptp_usb, params);
+  LIBMTP_Set_Transaction_Callback(device, NULL, NULL);
+  free_transfer_digest(device);
   // Clear error stack
   LIBMTP_Clear_Errorstack(device);
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
@@ -2449,9 +3163,13 @@ void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
   iconv_close(params->cd_ucs2_to_locale);
 #endif
   free(ptp_usb);
+  free_device_lock(params);
   ptp_free_params(params);
   free(params);
   free_storage_list(device);
+  free_thumbnail_cache(device);
+  free_references_cache(device);
+  free_freespace(device);
   // Free extension list...
   if (device->extensions != NULL) {
     LIBMTP_device_extension_t *tmp = device->extensions;
@@ -2469,3038 +3187,6756 @@ void LIBMTP_Release_Device(LIBMTP_mtpdevice_t *device)
 }
 
 /**
- * This can be used by any libmtp-intrinsic code that
- * need to stack up an error on the stack. You are only
- * supposed to add errors to the error stack using this
- * function, do not create and reference error entries
- * directly.
+ * A piece of work queued for a device worker.
  */
-static void add_error_to_errorstack(LIBMTP_mtpdevice_t *device,
-				    LIBMTP_error_number_t errornumber,
-				    char const * const error_text)
+typedef struct device_work_struct device_work_t;
+struct device_work_struct {
+  LIBMTP_work_func_t work;
+  LIBMTP_work_done_t done;
+  void *data;
+  device_work_t *next;
+};
+
+#ifdef HAVE_PTHREAD_H
+/**
+ * The worker thread of a device opened with
+ * LIBMTP_Open_Raw_Device_Worker(), with its queue of work.
+ */
+typedef struct device_worker_struct {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  /** Signalled when work is queued or the worker is to stop */
+  pthread_cond_t wakeup;
+  /** Signalled when the queue has run empty */
+  pthread_cond_t idle;
+  device_work_t *first;
+  device_work_t *last;
+  int busy;
+  int stop;
+} device_worker_t;
+
+static void *device_worker_main(void *arg)
 {
-  LIBMTP_error_t *newerror;
+  LIBMTP_mtpdevice_t *device = (LIBMTP_mtpdevice_t *) arg;
+  device_worker_t *worker = (device_worker_t *) DEVICE_PRIVATE(device)->worker;
 
-  if (device == NULL) {
-    LIBMTP_ERROR("LIBMTP PANIC: Trying to add error to a NULL device!\n");
-    return;
-  }
-  newerror = (LIBMTP_error_t *) malloc(sizeof(LIBMTP_error_t));
-  newerror->errornumber = errornumber;
-  newerror->error_text = strdup(error_text);
-  newerror->next = NULL;
-  if (device->errorstack == NULL) {
-    device->errorstack = newerror;
-  } else {
-    LIBMTP_error_t *tmp = device->errorstack;
+  pthread_mutex_lock(&worker->lock);
+  for (;;) {
+    device_work_t *job;
+    int ret;
 
-    while (tmp->next != NULL) {
-      tmp = tmp->next;
-    }
-    tmp->next = newerror;
+    while (worker->first == NULL && !worker->stop)
+      pthread_cond_wait(&worker->wakeup, &worker->lock);
+    // Everything submitted before stopping still gets done
+    job = worker->first;
+    if (job == NULL)
+      break;
+    worker->first = job->next;
+    if (worker->first == NULL)
+      worker->last = NULL;
+    worker->busy = 1;
+    pthread_mutex_unlock(&worker->lock);
+
+    ret = job->work(device, job->data);
+    if (job->done != NULL)
+      job->done(device, ret, job->data);
+    free(job);
+
+    pthread_mutex_lock(&worker->lock);
+    worker->busy = 0;
+    if (worker->first == NULL)
+      pthread_cond_broadcast(&worker->idle);
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return NULL;
+}
+
+static int start_device_worker(LIBMTP_mtpdevice_t *device)
+{
+  device_worker_t *worker;
+
+  worker = (device_worker_t *) malloc(sizeof(device_worker_t));
+  if (worker == NULL)
+    return -1;
+  memset(worker, 0, sizeof(device_worker_t));
+  pthread_mutex_init(&worker->lock, NULL);
+  pthread_cond_init(&worker->wakeup, NULL);
+  pthread_cond_init(&worker->idle, NULL);
+  DEVICE_PRIVATE(device)->worker = worker;
+  if (pthread_create(&worker->thread, NULL, device_worker_main, device) != 0) {
+    DEVICE_PRIVATE(device)->worker = NULL;
+    pthread_cond_destroy(&worker->idle);
+    pthread_cond_destroy(&worker->wakeup);
+    pthread_mutex_destroy(&worker->lock);
+    free(worker);
+    return -1;
   }
+  return 0;
 }
 
-/**
- * Adds an error from the PTP layer to the error stack.
- */
-static void add_ptp_error_to_errorstack(LIBMTP_mtpdevice_t *device,
-					uint16_t ptp_error,
-					char const * const error_text)
+static void stop_device_worker(LIBMTP_mtpdevice_t *device)
 {
-  PTPParams      *params = (PTPParams *) device->params;
+  device_worker_t *worker = (device_worker_t *) DEVICE_PRIVATE(device)->worker;
 
-  if (device == NULL) {
-    LIBMTP_ERROR("LIBMTP PANIC: Trying to add PTP error to a NULL device!\n");
+  if (worker == NULL)
     return;
-  } else {
-    char outstr[256];
-    snprintf(outstr, sizeof(outstr), "PTP Layer error %04x: %s", ptp_error, error_text);
-    outstr[sizeof(outstr)-1] = '\0';
-    add_error_to_errorstack(device, LIBMTP_ERROR_PTP_LAYER, outstr);
+  pthread_mutex_lock(&worker->lock);
+  worker->stop = 1;
+  pthread_cond_signal(&worker->wakeup);
+  pthread_mutex_unlock(&worker->lock);
+  pthread_join(worker->thread, NULL);
+  DEVICE_PRIVATE(device)->worker = NULL;
+  pthread_cond_destroy(&worker->idle);
+  pthread_cond_destroy(&worker->wakeup);
+  pthread_mutex_destroy(&worker->lock);
+  free(worker);
+}
+#else
+static int start_device_worker(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_ERROR("LIBMTP PANIC: device workers need pthreads, "
+	       "which this library was built without.\n");
+  return -1;
+}
 
-    snprintf(outstr, sizeof(outstr), "Error %04x: %s", ptp_error, ptp_strerror(ptp_error, params->deviceinfo.VendorExtensionID));
-    outstr[sizeof(outstr)-1] = '\0';
-    add_error_to_errorstack(device, LIBMTP_ERROR_PTP_LAYER, outstr);
-  }
+static void stop_device_worker(LIBMTP_mtpdevice_t *device)
+{
 }
+#endif
 
 /**
- * This returns the error stack for a device in case you
- * need to either reference the error numbers (e.g. when
- * creating multilingual apps with multiple-language text
- * representations for each error number) or when you need
- * to build a multi-line error text widget or something like
- * that. You need to call the <code>LIBMTP_Clear_Errorstack</code>
- * to clear it when you're finished with it.
- * @param device a pointer to the MTP device to get the error
- *        stack for.
- * @return the error stack or NULL if there are no errors
- *         on the stack.
- * @see LIBMTP_Clear_Errorstack()
- * @see LIBMTP_Dump_Errorstack()
+ * This function opens a device from a raw device, for use from a
+ * worker thread dedicated to it. This is meant for hosts driving
+ * many devices at once: each such device gets a USB context of its
+ * own and all of its traffic is done by its worker, so transfers to
+ * different devices run in parallel without any locking between them.
+ *
+ * Work is handed to the worker with <code>LIBMTP_Submit_Work()</code>,
+ * and all other calls on the device must be made from inside such work
+ * only. The objects of the device are cached as with
+ * <code>LIBMTP_Open_Raw_Device()</code>. Asynchronous events of the
+ * device are not served by
+ * <code>LIBMTP_Handle_Events_Timeout_Completed()</code>; read them
+ * with <code>LIBMTP_Read_Event()</code> from submitted work instead.
+ * <code>LIBMTP_Release_Device()</code> waits for all submitted work
+ * before it closes the device.
+ *
+ * @param rawdevice the raw device to open a "real" device for.
+ * @return an open device, or NULL if it could not be opened or the
+ *         worker could not be started.
+ * @see LIBMTP_Submit_Work()
  */
-LIBMTP_error_t *LIBMTP_Get_Errorstack(LIBMTP_mtpdevice_t *device)
+LIBMTP_mtpdevice_t *LIBMTP_Open_Raw_Device_Worker(LIBMTP_raw_device_t *rawdevice)
 {
-  if (device == NULL) {
-    LIBMTP_ERROR("LIBMTP PANIC: Trying to get the error stack of a NULL device!\n");
+  LIBMTP_mtpdevice_t *mtp_device = open_raw_device(rawdevice, 1, NULL, NULL);
+
+  if (mtp_device == NULL)
+    return NULL;
+  if (start_device_worker(mtp_device) != 0) {
+    LIBMTP_ERROR("LIBMTP PANIC: could not start worker for device "
+		 "%d on bus %d\n", rawdevice->devnum, rawdevice->bus_location);
+    LIBMTP_Release_Device(mtp_device);
     return NULL;
   }
-  return device->errorstack;
+  return mtp_device;
 }
 
 /**
- * This function clears the error stack of a device and frees
- * any memory used by it. Call this when you're finished with
- * using the errors.
- * @param device a pointer to the MTP device to clear the error
- *        stack for.
+ * This queues a piece of work for the worker thread of a device
+ * opened with <code>LIBMTP_Open_Raw_Device_Worker()</code>. Work is
+ * done one piece at a time in the order it was submitted. Each call
+ * returns at once; when the work has been done its completion callback
+ * is called on the worker thread with the result of the work.
+ *
+ * @param device a pointer to the device to do the work on.
+ * @param work the work to do, it may use any other call on the device.
+ * @param done a callback for when the work is done, or NULL.
+ * @param data a user-defined pointer handed to both callbacks.
+ * @return 0 if the work was queued, any other value means failure.
+ * @see LIBMTP_Wait_Work()
  */
-void LIBMTP_Clear_Errorstack(LIBMTP_mtpdevice_t *device)
+int LIBMTP_Submit_Work(LIBMTP_mtpdevice_t *device, LIBMTP_work_func_t work,
+		       LIBMTP_work_done_t done, void *data)
 {
-  if (device == NULL) {
-    LIBMTP_ERROR("LIBMTP PANIC: Trying to clear the error stack of a NULL device!\n");
-  } else {
-    LIBMTP_error_t *tmp = device->errorstack;
-
-    while (tmp != NULL) {
-      LIBMTP_error_t *tmp2;
+#ifdef HAVE_PTHREAD_H
+  device_worker_t *worker = (device_worker_t *) DEVICE_PRIVATE(device)->worker;
+  device_work_t *job;
 
-      if (tmp->error_text != NULL) {
-	free(tmp->error_text);
-      }
-      tmp2 = tmp;
-      tmp = tmp->next;
-      free(tmp2);
-    }
-    device->errorstack = NULL;
+  if (worker == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Submit_Work(): device has no worker.");
+    return -1;
   }
+  job = (device_work_t *) malloc(sizeof(device_work_t));
+  if (job == NULL)
+    return -1;
+  job->work = work;
+  job->done = done;
+  job->data = data;
+  job->next = NULL;
+
+  pthread_mutex_lock(&worker->lock);
+  if (worker->last == NULL)
+    worker->first = job;
+  else
+    worker->last->next = job;
+  worker->last = job;
+  pthread_cond_signal(&worker->wakeup);
+  pthread_mutex_unlock(&worker->lock);
+  return 0;
+#else
+  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			  "LIBMTP_Submit_Work(): device has no worker.");
+  return -1;
+#endif
 }
 
 /**
- * This function dumps the error stack to <code>stderr</code>.
- * (You still have to clear the stack though.)
- * @param device a pointer to the MTP device to dump the error
- *        stack for.
+ * This waits until the worker of a device has done all work submitted
+ * to it so far, including the completion callbacks. It must not be
+ * called from inside submitted work.
+ * @param device a pointer to the device to wait for.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Submit_Work()
  */
-void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
+int LIBMTP_Wait_Work(LIBMTP_mtpdevice_t *device)
 {
-  if (device == NULL) {
-    LIBMTP_ERROR("LIBMTP PANIC: Trying to dump the error stack of a NULL device!\n");
-  } else {
-    LIBMTP_error_t *tmp = device->errorstack;
+#ifdef HAVE_PTHREAD_H
+  device_worker_t *worker = (device_worker_t *) DEVICE_PRIVATE(device)->worker;
 
-    while (tmp != NULL) {
-      if (tmp->error_text != NULL) {
-	LIBMTP_ERROR("Error %d: %s\n", tmp->errornumber, tmp->error_text);
-      } else {
-	LIBMTP_ERROR("Error %d: (unknown)\n", tmp->errornumber);
+  if (worker == NULL)
+    return -1;
+  pthread_mutex_lock(&worker->lock);
+  while (worker->first != NULL || worker->busy)
+    pthread_cond_wait(&worker->idle, &worker->lock);
+  pthread_mutex_unlock(&worker->lock);
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+#ifdef HAVE_PTHREAD_H
+/**
+ * The locks of a device shared between threads, see
+ * LIBMTP_Set_Device_Locking().
+ */
+typedef struct device_lock_struct {
+  /** Serializes transactions, may be taken again by its holder */
+  pthread_mutex_t transaction;
+  /** Guards the object lock state below and the error stack */
+  pthread_mutex_t lock;
+  /** Signalled when the object lock is given up */
+  pthread_cond_t released;
+  /** Signalled when a thread that had to wait gets the transaction lock */
+  pthread_cond_t granted;
+  /** Guards the event queue of the listener */
+  pthread_mutex_t events;
+  /** Guards the cache of object property descriptions */
+  pthread_mutex_t propcache;
+  /** Guards the transaction statistics */
+  pthread_mutex_t stats;
+  unsigned int readers;
+  /** How many times the writer holds the object lock */
+  unsigned int writing;
+  pthread_t writer;
+  /** Threads waiting for the transaction lock */
+  unsigned int waiting;
+  /** How many waiting threads got the transaction lock so far */
+  unsigned long grants;
+  /** The holder of the transaction lock and how often it holds it */
+  pthread_t owner;
+  unsigned int depth;
+  /** Size of the segments of a download, 0 to get objects in one go */
+  uint32_t segment;
+} device_lock_t;
+
+static void unlock_transaction(device_lock_t *dl)
+{
+  pthread_mutex_lock(&dl->lock);
+  dl->depth--;
+  pthread_mutex_unlock(&dl->lock);
+  pthread_mutex_unlock(&dl->transaction);
+}
+
+/**
+ * Tells whether the calling thread holds the transaction lock, from
+ * anywhere up its stack.
+ */
+static int holds_transaction(device_lock_t *dl)
+{
+  int held;
+
+  pthread_mutex_lock(&dl->lock);
+  held = dl->depth > 0 && pthread_equal(dl->owner, pthread_self());
+  pthread_mutex_unlock(&dl->lock);
+  return held;
+}
+
+static void device_lock_func(PTPParams *params, int what)
+{
+  device_lock_t *dl = (device_lock_t *) params->lock_data;
+  pthread_t self = pthread_self();
+  int writer;
+
+  switch (what) {
+  case PTP_LOCK_TRANSACTION:
+    if (pthread_mutex_trylock(&dl->transaction) == 0) {
+      pthread_mutex_lock(&dl->lock);
+    } else {
+      // Count the waiters, a segmented download lets them go first
+      pthread_mutex_lock(&dl->lock);
+      dl->waiting++;
+      pthread_mutex_unlock(&dl->lock);
+      pthread_mutex_lock(&dl->transaction);
+      pthread_mutex_lock(&dl->lock);
+      dl->waiting--;
+      dl->grants++;
+      pthread_cond_broadcast(&dl->granted);
+    }
+    dl->owner = self;
+    dl->depth++;
+    pthread_mutex_unlock(&dl->lock);
+    break;
+  case PTP_UNLOCK_TRANSACTION:
+    unlock_transaction(dl);
+    break;
+  case PTP_LOCK_OBJECTS_READ:
+  case PTP_LOCK_OBJECTS_WRITE:
+    if (what == PTP_LOCK_OBJECTS_WRITE) {
+      // A writer holds the transaction lock as well, which comes first
+      pthread_mutex_lock(&dl->lock);
+      writer = dl->writing && pthread_equal(dl->writer, self);
+      pthread_mutex_unlock(&dl->lock);
+      if (!writer)
+	device_lock_func(params, PTP_LOCK_TRANSACTION);
+    }
+    pthread_mutex_lock(&dl->lock);
+    if (dl->writing && pthread_equal(dl->writer, self)) {
+      // The writer may take it again, in either mode
+      dl->writing++;
+    } else if (what == PTP_LOCK_OBJECTS_READ) {
+      while (dl->writing)
+	pthread_cond_wait(&dl->released, &dl->lock);
+      dl->readers++;
+    } else {
+      while (dl->writing || dl->readers)
+	pthread_cond_wait(&dl->released, &dl->lock);
+      dl->writing = 1;
+      dl->writer = self;
+    }
+    pthread_mutex_unlock(&dl->lock);
+    break;
+  case PTP_UNLOCK_OBJECTS:
+    writer = 0;
+    pthread_mutex_lock(&dl->lock);
+    if (dl->writing && pthread_equal(dl->writer, self)) {
+      if (--dl->writing == 0) {
+	pthread_cond_broadcast(&dl->released);
+	writer = 1;
       }
-      tmp = tmp->next;
+    } else if (--dl->readers == 0) {
+      pthread_cond_broadcast(&dl->released);
     }
+    pthread_mutex_unlock(&dl->lock);
+    if (writer)
+      unlock_transaction(dl);
+    break;
+  case PTP_LOCK_EVENTS:
+    pthread_mutex_lock(&dl->events);
+    break;
+  case PTP_UNLOCK_EVENTS:
+    pthread_mutex_unlock(&dl->events);
+    break;
+  case PTP_LOCK_PROPCACHE:
+    pthread_mutex_lock(&dl->propcache);
+    break;
+  case PTP_UNLOCK_PROPCACHE:
+    pthread_mutex_unlock(&dl->propcache);
+    break;
+  case PTP_LOCK_STATS:
+    pthread_mutex_lock(&dl->stats);
+    break;
+  case PTP_UNLOCK_STATS:
+    pthread_mutex_unlock(&dl->stats);
+    break;
+  default:
+    break;
   }
 }
 
 /**
- * This command gets all handles and stuff by FAST directory retrieveal
- * which is available by getting all metadata for object
- * <code>0xffffffff</code> which simply means "all metadata for all objects".
- * This works on the vast majority of MTP devices (there ARE exceptions!)
- * and is quite quick. Check the error stack to see if there were
- * problems getting the metadata.
- * @return 0 if all was OK, -1 on failure.
+ * Called between the segments of a download without holding the
+ * transaction lock: waits until the threads that are waiting for it
+ * right now had their turn. Threads that start waiting later do not
+ * hold the download up any further, so it can not be starved.
+ *
+ * A thread that holds the transaction lock further up its stack still
+ * holds it here, as the lock is recursive, and the waiting threads
+ * could never get it; such a thread does not wait.
  */
-static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
+static void yield_transactions(PTPParams *params)
 {
-  PTPParams      *params = (PTPParams *) device->params;
-  int		 cnt = 0;
-  int            i, j, nrofprops;
-  uint32_t	 lasthandle = 0xffffffff;
-  MTPProperties  *props = NULL;
-  MTPProperties  *prop;
-  uint16_t       ret;
-  int            oldtimeout;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  device_lock_t *dl = (device_lock_t *) params->lock_data;
+  unsigned long until;
 
-  /*
-   * The follow request causes the device to generate
-   * a list of every file on the device and return it
-   * in a single response.
-   *
-   * Some slow devices as well as devices with very
-   * large file systems can easily take longer then
-   * the standard timeout value before it is able
-   * to return a response.
-   *
-   * Temporarly set timeout to allow working with
-   * widest range of devices.
-   */
-  get_usb_device_timeout(ptp_usb, &oldtimeout);
-  set_usb_device_timeout(ptp_usb, 60000);
+  if (dl == NULL)
+    return;
+  pthread_mutex_lock(&dl->lock);
+  if (dl->depth > 0 && pthread_equal(dl->owner, pthread_self())) {
+    pthread_mutex_unlock(&dl->lock);
+    return;
+  }
+  until = dl->grants + dl->waiting;
+  while ((long) (until - dl->grants) > 0)
+    pthread_cond_wait(&dl->granted, &dl->lock);
+  pthread_mutex_unlock(&dl->lock);
+}
 
-  ret = ptp_mtp_getobjectproplist(params, 0xffffffff, &props, &nrofprops);
-  set_usb_device_timeout(ptp_usb, oldtimeout);
+/**
+ * Internal function that tells whether a download of
+ * <code>size</code> bytes is split into partial reads, which it is on
+ * a device with locking enabled that has a partial read reaching the
+ * whole object. It is not when the calling thread holds the
+ * transaction lock already, as it could not let the others in between.
+ * @return the size of the segments, or 0 to get the object in one go.
+ */
+static uint32_t transfer_segment(PTPParams *params, uint64_t const size)
+{
+  device_lock_t *dl = (device_lock_t *) params->lock_data;
 
-  if (ret == PTP_RC_MTP_Specification_By_Group_Unsupported) {
-    // What's the point in the device implementing this command if
-    // you cannot use it to get all props for AT LEAST one object?
-    // Well, whatever...
-    add_ptp_error_to_errorstack(device, ret, "get_all_metadata_fast(): "
-    "cannot retrieve all metadata for an object on this device.");
-    return -1;
+  if (dl == NULL || dl->segment == 0 || size <= dl->segment ||
+      holds_transaction(dl))
+    return 0;
+  if (ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64))
+    return dl->segment;
+  if (ptp_operation_issupported(params, PTP_OC_GetPartialObject) &&
+      size >> 32 == 0)
+    return dl->segment;
+  return 0;
+}
+
+static void free_device_lock(PTPParams *params)
+{
+  device_lock_t *dl = (device_lock_t *) params->lock_data;
+
+  if (dl == NULL)
+    return;
+  params->lock_func = NULL;
+  params->lock_data = NULL;
+  pthread_cond_destroy(&dl->granted);
+  pthread_cond_destroy(&dl->released);
+  pthread_mutex_destroy(&dl->stats);
+  pthread_mutex_destroy(&dl->propcache);
+  pthread_mutex_destroy(&dl->events);
+  pthread_mutex_destroy(&dl->lock);
+  pthread_mutex_destroy(&dl->transaction);
+  free(dl);
+}
+#else
+static void yield_transactions(PTPParams *params)
+{
+}
+
+static uint32_t transfer_segment(PTPParams *params, uint64_t const size)
+{
+  return 0;
+}
+
+static void free_device_lock(PTPParams *params)
+{
+}
+#endif
+
+/**
+ * This makes a device safe to use from several threads at once.
+ * Transactions with the device are then done one at a time, while
+ * the object cache has a reader/writer lock of its own, so one thread
+ * can for instance read metadata from the cache with
+ * <code>LIBMTP_Get_Filemetadata()</code> while another one is busy
+ * with a long <code>LIBMTP_Get_File_To_Handler()</code>. Changes to
+ * the cache wait for the transaction lock like the transactions do,
+ * and the device is asked for an object property list while the
+ * cache is only locked for each block of it that is stored.
+ *
+ * This is off by default. Enable it before the device is shared and
+ * disable it only when no other thread uses the device any more. The
+ * transfer callbacks (data handlers and progress functions) must not
+ * call back into libmtp for the same device. Devices with a worker
+ * from <code>LIBMTP_Open_Raw_Device_Worker()</code> do not need this
+ * as long as they are only used from submitted work.
+ *
+ * With locking enabled, large downloads can also be split into
+ * partial reads where the device has them, so that the transactions
+ * other threads are waiting for go in between and browsing the device
+ * or reading its battery level does not wait for a transfer of
+ * gigabytes. This is off by default, see
+ * <code>LIBMTP_Set_Transfer_Segment_Size()</code>.
+ *
+ * @param device a pointer to the device to configure.
+ * @param enable 1 to enable locking, 0 to disable it.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Device_Locking(LIBMTP_mtpdevice_t *device, int const enable)
+{
+#ifdef HAVE_PTHREAD_H
+  PTPParams *params = (PTPParams *) device->params;
+  device_lock_t *dl;
+  pthread_mutexattr_t attr;
+
+  if (!enable) {
+    free_device_lock(params);
+    return 0;
   }
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "get_all_metadata_fast(): "
-    "could not get proplist of all objects.");
+  if (params->lock_data != NULL)
+    return 0;
+  dl = (device_lock_t *) malloc(sizeof(device_lock_t));
+  if (dl == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Set_Device_Locking(): out of memory.");
     return -1;
   }
-  if (props == NULL && nrofprops != 0) {
+  memset(dl, 0, sizeof(device_lock_t));
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&dl->transaction, &attr);
+  pthread_mutexattr_destroy(&attr);
+  pthread_mutex_init(&dl->lock, NULL);
+  pthread_mutex_init(&dl->events, NULL);
+  pthread_mutex_init(&dl->propcache, NULL);
+  pthread_mutex_init(&dl->stats, NULL);
+  pthread_cond_init(&dl->released, NULL);
+  pthread_cond_init(&dl->granted, NULL);
+  params->lock_data = dl;
+  params->lock_func = device_lock_func;
+  return 0;
+#else
+  if (!enable)
+    return 0;
+  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			  "LIBMTP_Set_Device_Locking(): built without pthreads.");
+  return -1;
+#endif
+}
+
+/**
+ * This sets the size of the partial reads that
+ * <code>LIBMTP_Get_File_To_Handler()</code> and
+ * <code>LIBMTP_Get_File_To_File_Descriptor()</code> split a download
+ * into on a device with locking enabled. Between two of them the
+ * transactions that other threads are waiting for are done first, so
+ * the size bounds how long they wait behind a download: smaller
+ * segments give those threads shorter waits, larger ones give the
+ * download itself more throughput, and a few MB is a good start. The
+ * default is 0, downloads are not split.
+ *
+ * Downloads are only split on devices that support
+ * PTP_OC_GetPartialObject for the size of the object, or the Android
+ * PTP_OC_ANDROID_GetPartialObject64 extension.
+ *
+ * A download started by a thread that holds the transaction lock
+ * already, such as from within the transaction callback of
+ * <code>LIBMTP_Set_Transaction_Callback()</code>, is not split, as the
+ * lock could not be given up between segments.
+ *
+ * @param device a pointer to the device to configure, which must have
+ *        locking enabled with <code>LIBMTP_Set_Device_Locking()</code>.
+ * @param size the size of the segments in bytes, 0 to get objects in
+ *        one go.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Transfer_Segment_Size(LIBMTP_mtpdevice_t *device,
+				     uint32_t const size)
+{
+#ifdef HAVE_PTHREAD_H
+  PTPParams *params = (PTPParams *) device->params;
+  device_lock_t *dl = (device_lock_t *) params->lock_data;
+
+  if (dl == NULL) {
     add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "get_all_metadata_fast(): "
-			    "call to ptp_mtp_getobjectproplist() returned "
-			    "inconsistent results.");
+			    "LIBMTP_Set_Transfer_Segment_Size(): "
+			    "device locking is not enabled.");
     return -1;
   }
-  /*
-   * We count the number of objects by counting the ObjectHandle
-   * references, whenever it changes we get a new object, when it's
-   * the same, it is just different properties of the same object.
-   */
-  prop = props;
-  for (i=0;i<nrofprops;i++) {
-      if (lasthandle != prop->ObjectHandle) {
-	cnt++;
-	lasthandle = prop->ObjectHandle;
-      }
-      prop++;
-  }
-  lasthandle = 0xffffffff;
-  params->objects = calloc (cnt, sizeof(PTPObject));
-  prop = props;
-  i = -1;
-  for (j=0;j<nrofprops;j++) {
-    if (lasthandle != prop->ObjectHandle) {
-      if (i >= 0) {
-        params->objects[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-	if (!params->objects[i].oi.Filename) {
-	  /* I have one such file on my Creative (Marcus) */
-	  params->objects[i].oi.Filename = strdup("<null>");
-	}
-      }
-      i++;
-      lasthandle = prop->ObjectHandle;
-      params->objects[i].oid = prop->ObjectHandle;
-    }
-    switch (prop->property) {
-    case PTP_OPC_ParentObject:
-      params->objects[i].oi.ParentObject = prop->propval.u32;
-      params->objects[i].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
-      break;
-    case PTP_OPC_ObjectFormat:
-      params->objects[i].oi.ObjectFormat = prop->propval.u16;
-      break;
-    case PTP_OPC_ObjectSize:
-      // We loose precision here, up to 32 bits! However the commands that
-      // retrieve metadata for files and tracks will make sure that the
-      // PTP_OPC_ObjectSize is read in and duplicated again.
-      if (device->object_bitsize == 64) {
-	params->objects[i].oi.ObjectCompressedSize = (uint32_t) prop->propval.u64;
-      } else {
-	params->objects[i].oi.ObjectCompressedSize = prop->propval.u32;
-      }
-      break;
-    case PTP_OPC_StorageID:
-      params->objects[i].oi.StorageID = prop->propval.u32;
-      params->objects[i].flags |= PTPOBJECT_STORAGEID_LOADED;
-      break;
-    case PTP_OPC_ObjectFileName:
-      if (prop->propval.str != NULL)
-        params->objects[i].oi.Filename = strdup(prop->propval.str);
-      break;
-    default: {
-      MTPProperties *newprops;
+  ptp_lock(params, PTP_LOCK_TRANSACTION);
+  dl->segment = size;
+  ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+  return 0;
+#else
+  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			  "LIBMTP_Set_Transfer_Segment_Size(): built without pthreads.");
+  return -1;
+#endif
+}
 
-      /* Copy all of the other MTP oprierties into the per-object proplist */
-      if (params->objects[i].nrofmtpprops) {
-        newprops = realloc(params->objects[i].mtpprops,
-		(params->objects[i].nrofmtpprops+1)*sizeof(MTPProperties));
-      } else {
-        newprops = calloc(1,sizeof(MTPProperties));
-      }
-      if (!newprops) return 0; /* FIXME: error handling? */
-      params->objects[i].mtpprops = newprops;
-      memcpy(&params->objects[i].mtpprops[params->objects[i].nrofmtpprops],
-	     &props[j],sizeof(props[j]));
-      params->objects[i].nrofmtpprops++;
-      params->objects[i].flags |= PTPOBJECT_MTPPROPLIST_LOADED;
-      break;
-    }
+/**
+ * This returns a snapshot of the transaction statistics of a device:
+ * transactions, bytes and latency per PTP operation, bulk transfers,
+ * cleared stalls and timeouts. They are counted from the opening of
+ * the device or the last <code>LIBMTP_Reset_Device_Stats()</code>.
+ * On a device with locking enabled this does not wait for a running
+ * transaction, so a monitoring thread can call it during a transfer.
+ *
+ * @param device a pointer to the device to get the statistics of.
+ * @return a newly allocated statistics structure, to be freed with
+ *         <code>LIBMTP_destroy_device_stats_t()</code>, or NULL on
+ *         failure.
+ */
+LIBMTP_device_stats_t *LIBMTP_Get_Device_Stats(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_device_stats_t *stats;
+  unsigned int i, j;
+
+  stats = (LIBMTP_device_stats_t *) calloc(1, sizeof(LIBMTP_device_stats_t));
+  if (stats == NULL)
+    return NULL;
+  ptp_lock(params, PTP_LOCK_STATS);
+  if (params->stats.nrofopcodes > 0) {
+    stats->opcodes = (LIBMTP_opcode_stats_t *)
+      calloc(params->stats.nrofopcodes, sizeof(LIBMTP_opcode_stats_t));
+    if (stats->opcodes == NULL) {
+      ptp_lock(params, PTP_UNLOCK_STATS);
+      free(stats);
+      return NULL;
     }
-    prop++;
-  }
-  /* mark last entry also */
-  if (i >= 0) {
-    params->objects[i].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-    params->nrofobjects = i+1;
-  } else {
-    params->nrofobjects = 0;
   }
-  free (props);
-  /* The device might not give the list in linear ascending order */
-  ptp_objects_sort (params);
-  return 0;
+  stats->transactions = params->stats.transactions;
+  stats->bytes_in = params->stats.bytes_in;
+  stats->bytes_out = params->stats.bytes_out;
+  stats->bulk_transfers = params->stats.bulk_transfers;
+  stats->stalls_cleared = params->stats.stalls_cleared;
+  stats->timeouts = params->stats.timeouts;
+  stats->retries = params->stats.retries;
+  stats->nrofopcodes = params->stats.nrofopcodes;
+  for (i = 0; i < params->stats.nrofopcodes; i++) {
+    PTPOpcodeStats *ops = &params->stats.opcodes[i];
+
+    stats->opcodes[i].opcode = ops->opcode;
+    stats->opcodes[i].transactions = ops->transactions;
+    stats->opcodes[i].errors = ops->errors;
+    stats->opcodes[i].bytes_in = ops->bytes_in;
+    stats->opcodes[i].bytes_out = ops->bytes_out;
+    stats->opcodes[i].total_us = ops->total_us;
+    for (j = 0; j < LIBMTP_STATS_LATENCY_BUCKETS &&
+	   j < PTP_STATS_LATENCY_BUCKETS; j++)
+      stats->opcodes[i].latency[j] = ops->latency[j];
+  }
+  ptp_lock(params, PTP_UNLOCK_STATS);
+  return stats;
 }
 
 /**
- * This function will recurse through all the directories on the device,
- * starting at the root directory, gathering metadata as it moves along.
- * It works better on some devices that will only return data for a
- * certain directory and does not respect the option to get all metadata
- * for all objects.
+ * This destroys a statistics structure returned by
+ * <code>LIBMTP_Get_Device_Stats()</code>.
+ * @param stats the statistics structure to destroy.
  */
-static uint16_t get_handles_recursively(LIBMTP_mtpdevice_t *device,
-				    PTPParams *params,
-				    uint32_t storageid,
-				    uint32_t parent)
+void LIBMTP_destroy_device_stats_t(LIBMTP_device_stats_t *stats)
 {
-  PTPObjectHandles currentHandles;
-  unsigned int i = 0;
-  uint16_t ret = ptp_getobjecthandles(params,
-                                      storageid,
-                                      PTP_GOH_ALL_FORMATS,
-                                      parent,
-                                      &currentHandles);
+  if (stats == NULL)
+    return;
+  free(stats->opcodes);
+  free(stats);
+}
 
-  if (ret != PTP_RC_OK) {
-    char buf[80];
-    sprintf(buf,"get_handles_recursively(): could not get object handles of %08x", parent);
-    add_ptp_error_to_errorstack(device, ret, buf);
-    return ret;
-  }
+/**
+ * This clears the transaction statistics of a device.
+ * @param device a pointer to the device to clear the statistics of.
+ */
+void LIBMTP_Reset_Device_Stats(LIBMTP_mtpdevice_t *device)
+{
+  ptp_reset_stats((PTPParams *) device->params);
+}
 
-  if (currentHandles.Handler == NULL || currentHandles.n == 0)
-    return PTP_RC_OK;
+static void transaction_cb(PTPParams *params, void *data, uint16_t opcode,
+			   int end, uint16_t ret, uint64_t usecs)
+{
+  transaction_cb_data_t *cbdata = (transaction_cb_data_t *) data;
 
-  // Now descend into any subdirectories found
-  for (i = 0; i < currentHandles.n; i++) {
-    PTPObject *ob;
-    ret = ptp_object_want(params,currentHandles.Handler[i],
-			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
-    if (ret == PTP_RC_OK) {
-      if (ob->oi.ObjectFormat == PTP_OFC_Association)
-        get_handles_recursively(device, params,
-				storageid, currentHandles.Handler[i]);
-    } else {
-      add_error_to_errorstack(device,
-			      LIBMTP_ERROR_CONNECTING,
-			      "Found a bad handle, trying to ignore it.");
-      return ret;
+  cbdata->cb(cbdata->device, opcode, end, ret, usecs, cbdata->user_data);
+}
+
+/**
+ * This sets a callback that is called right before and right after
+ * every PTP transaction with a device, for example to feed a metrics
+ * or tracing system. The callback runs while the device is busy with
+ * the transaction, so it has to return quickly and must not use the
+ * device.
+ *
+ * @param device a pointer to the device to observe.
+ * @param cb the callback, or NULL to remove it.
+ * @param user_data arbitrary user data passed to the callback.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Set_Transaction_Callback(LIBMTP_mtpdevice_t *device,
+				    LIBMTP_transaction_cb_fn cb,
+				    void *user_data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  transaction_cb_data_t *data = NULL;
+  void *old = NULL;
+
+  if (cb != NULL) {
+    data = (transaction_cb_data_t *) malloc(sizeof(transaction_cb_data_t));
+    if (data == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Set_Transaction_Callback(): "
+			      "out of memory.");
+      return -1;
     }
-  }
-  free(currentHandles.Handler);
-  return PTP_RC_OK;
+    data->device = device;
+    data->cb = cb;
+    data->user_data = user_data;
+  }
+  ptp_lock(params, PTP_LOCK_TRANSACTION);
+  if (params->transaction_func == transaction_cb)
+    old = params->transaction_data;
+  params->transaction_func = data != NULL ? transaction_cb : NULL;
+  params->transaction_data = data;
+  ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+  free(old);
+  return 0;
 }
 
 /**
- * This function refresh the internal handle list whenever
- * the items stored inside the device is altered. On operations
- * that do not add or remove objects, this is typically not
- * called.
- * @param device a pointer to the MTP device to flush handles for.
+ * Guards the error stack of a device that has locking enabled.
  */
-static void flush_handles(LIBMTP_mtpdevice_t *device)
+static void lock_errorstack(LIBMTP_mtpdevice_t *device, int const lock)
 {
+#ifdef HAVE_PTHREAD_H
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  int ret;
-  uint32_t i;
+  device_lock_t *dl;
 
-  if (!device->cached) {
+  if (params == NULL || params->lock_data == NULL)
     return;
-  }
+  dl = (device_lock_t *) params->lock_data;
+  if (lock)
+    pthread_mutex_lock(&dl->lock);
+  else
+    pthread_mutex_unlock(&dl->lock);
+#endif
+}
 
-  if (params->objects != NULL) {
-    for (i=0;i<params->nrofobjects;i++)
-      ptp_free_object (&params->objects[i]);
-    free(params->objects);
-    params->objects = NULL;
-    params->nrofobjects = 0;
-  }
+/**
+ * This can be used by any libmtp-intrinsic code that
+ * need to stack up an error on the stack. You are only
+ * supposed to add errors to the error stack using this
+ * function, do not create and reference error entries
+ * directly.
+ */
+static void add_error_to_errorstack(LIBMTP_mtpdevice_t *device,
+				    LIBMTP_error_number_t errornumber,
+				    char const * const error_text)
+{
+  LIBMTP_error_t *newerror;
 
-  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)
-      && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)
-      && !FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)) {
-    // Use the fast method. Ignore return value for now.
-    ret = get_all_metadata_fast(device);
+  if (device == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: Trying to add error to a NULL device!\n");
+    return;
   }
+  newerror = (LIBMTP_error_t *) malloc(sizeof(LIBMTP_error_t));
+  newerror->errornumber = errornumber;
+  newerror->error_text = strdup(error_text);
+  newerror->next = NULL;
+  lock_errorstack(device, 1);
+  if (device->errorstack == NULL) {
+    device->errorstack = newerror;
+  } else {
+    LIBMTP_error_t *tmp = device->errorstack;
 
-  // If the previous failed or returned no objects, use classic
-  // methods instead.
-  if (params->nrofobjects == 0) {
-    // Get all the handles using just standard commands.
-    if (device->storage == NULL) {
-      get_handles_recursively(device, params,
-			      PTP_GOH_ALL_STORAGE,
-			      PTP_GOH_ROOT_PARENT);
-    } else {
-      // Get handles for each storage in turn.
-      LIBMTP_devicestorage_t *storage = device->storage;
-      while(storage != NULL) {
-	get_handles_recursively(device, params,
-				storage->id,
-				PTP_GOH_ROOT_PARENT);
-	storage = storage->next;
-      }
+    while (tmp->next != NULL) {
+      tmp = tmp->next;
     }
+    tmp->next = newerror;
   }
+  lock_errorstack(device, 0);
+}
 
-  /*
-   * Loop over the handles, fix up any NULL filenames or
-   * keywords, then attempt to locate some default folders
-   * in the root directory of the primary storage.
-   */
-  for(i = 0; i < params->nrofobjects; i++) {
-    PTPObject *ob, *xob;
-
-    ob = &params->objects[i];
-    ret = ptp_object_want(params,params->objects[i].oid,
-			  PTPOBJECT_OBJECTINFO_LOADED, &xob);
-    if (ret != PTP_RC_OK) {
-	LIBMTP_ERROR("broken! %x not found\n", params->objects[i].oid);
-    }
-    if (ob->oi.Filename == NULL)
-      ob->oi.Filename = strdup("<null>");
-    if (ob->oi.Keywords == NULL)
-      ob->oi.Keywords = strdup("<null>");
+/**
+ * Adds an error from the PTP layer to the error stack.
+ */
+static void add_ptp_error_to_errorstack(LIBMTP_mtpdevice_t *device,
+					uint16_t ptp_error,
+					char const * const error_text)
+{
+  PTPParams      *params = (PTPParams *) device->params;
 
-    /* Ignore handles that point to non-folders */
-    if(ob->oi.ObjectFormat != PTP_OFC_Association)
-      continue;
-    /* Only look in the root folder */
-    if (ob->oi.ParentObject == 0xffffffffU) {
-      LIBMTP_ERROR("object %x has parent 0xffffffff (-1) continuing anyway\n",
-		   ob->oid);
-    } else if (ob->oi.ParentObject != 0x00000000U)
-      continue;
-    /* Only look in the primary storage */
-    if (device->storage != NULL && ob->oi.StorageID != device->storage->id)
-      continue;
+  if (device == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: Trying to add PTP error to a NULL device!\n");
+    return;
+  } else {
+    char outstr[256];
+    snprintf(outstr, sizeof(outstr), "PTP Layer error %04x: %s", ptp_error, error_text);
+    outstr[sizeof(outstr)-1] = '\0';
+    add_error_to_errorstack(device, LIBMTP_ERROR_PTP_LAYER, outstr);
 
-    /* Is this the Music Folder */
-    if (!strcasecmp(ob->oi.Filename, "My Music") ||
-	!strcasecmp(ob->oi.Filename, "My_Music") ||
-	!strcasecmp(ob->oi.Filename, "Music")) {
-      device->default_music_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Playlists") ||
-	     !strcasecmp(ob->oi.Filename, "My_Playlists") ||
-	     !strcasecmp(ob->oi.Filename, "Playlists")) {
-      device->default_playlist_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Pictures") ||
-	     !strcasecmp(ob->oi.Filename, "My_Pictures") ||
-	     !strcasecmp(ob->oi.Filename, "Pictures")) {
-      device->default_picture_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Video") ||
-	     !strcasecmp(ob->oi.Filename, "My_Video") ||
-	     !strcasecmp(ob->oi.Filename, "Video")) {
-	device->default_video_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Organizer") ||
-	     !strcasecmp(ob->oi.Filename, "My_Organizer")) {
-      device->default_organizer_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "ZENcast") ||
-	     !strcasecmp(ob->oi.Filename, "Datacasts")) {
-      device->default_zencast_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "My Albums") ||
-	     !strcasecmp(ob->oi.Filename, "My_Albums") ||
-	     !strcasecmp(ob->oi.Filename, "Albums")) {
-      device->default_album_folder = ob->oid;
-    }
-    else if (!strcasecmp(ob->oi.Filename, "Text") ||
-	     !strcasecmp(ob->oi.Filename, "Texts")) {
-      device->default_text_folder = ob->oid;
-    }
+    snprintf(outstr, sizeof(outstr), "Error %04x: %s", ptp_error, ptp_strerror(ptp_error, params->deviceinfo.VendorExtensionID));
+    outstr[sizeof(outstr)-1] = '\0';
+    add_error_to_errorstack(device, LIBMTP_ERROR_PTP_LAYER, outstr);
   }
 }
 
 /**
- * This function traverses a devices storage list freeing up the
- * strings and the structs.
- * @param device a pointer to the MTP device to free the storage
- * list for.
+ * This returns the error stack for a device in case you
+ * need to either reference the error numbers (e.g. when
+ * creating multilingual apps with multiple-language text
+ * representations for each error number) or when you need
+ * to build a multi-line error text widget or something like
+ * that. You need to call the <code>LIBMTP_Clear_Errorstack</code>
+ * to clear it when you're finished with it.
+ * @param device a pointer to the MTP device to get the error
+ *        stack for.
+ * @return the error stack or NULL if there are no errors
+ *         on the stack.
+ * @see LIBMTP_Clear_Errorstack()
+ * @see LIBMTP_Dump_Errorstack()
  */
-static void free_storage_list(LIBMTP_mtpdevice_t *device)
+LIBMTP_error_t *LIBMTP_Get_Errorstack(LIBMTP_mtpdevice_t *device)
 {
-  LIBMTP_devicestorage_t *storage;
-  LIBMTP_devicestorage_t *tmp;
-
-  storage = device->storage;
-  while(storage != NULL) {
-    if (storage->StorageDescription != NULL) {
-      free(storage->StorageDescription);
-    }
-    if (storage->VolumeIdentifier != NULL) {
-      free(storage->VolumeIdentifier);
-    }
-    tmp = storage;
-    storage = storage->next;
-    free(tmp);
+  if (device == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: Trying to get the error stack of a NULL device!\n");
+    return NULL;
   }
-  device->storage = NULL;
-
-  return;
+  return device->errorstack;
 }
 
 /**
- * This function traverses a devices storage list freeing up the
- * strings and the structs.
- * @param device a pointer to the MTP device to free the storage
- * list for.
+ * This function clears the error stack of a device and frees
+ * any memory used by it. Call this when you're finished with
+ * using the errors.
+ * @param device a pointer to the MTP device to clear the error
+ *        stack for.
  */
-static int sort_storage_by(LIBMTP_mtpdevice_t *device,int const sortby)
+void LIBMTP_Clear_Errorstack(LIBMTP_mtpdevice_t *device)
 {
-  LIBMTP_devicestorage_t *oldhead, *ptr1, *ptr2, *newlist;
-
-  if (device->storage == NULL)
-    return -1;
-  if (sortby == LIBMTP_STORAGE_SORTBY_NOTSORTED)
-    return 0;
-
-  oldhead = ptr1 = ptr2 = device->storage;
-
-  newlist = NULL;
-
-  while(oldhead != NULL) {
-    ptr1 = ptr2 = oldhead;
-    while(ptr1 != NULL) {
-
-      if (sortby == LIBMTP_STORAGE_SORTBY_FREESPACE && ptr1->FreeSpaceInBytes > ptr2->FreeSpaceInBytes)
-        ptr2 = ptr1;
-      if (sortby == LIBMTP_STORAGE_SORTBY_MAXSPACE && ptr1->FreeSpaceInBytes > ptr2->FreeSpaceInBytes)
-        ptr2 = ptr1;
+  if (device == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: Trying to clear the error stack of a NULL device!\n");
+  } else {
+    LIBMTP_error_t *tmp;
 
-      ptr1 = ptr1->next;
-    }
+    lock_errorstack(device, 1);
+    tmp = device->errorstack;
+    device->errorstack = NULL;
+    lock_errorstack(device, 0);
+    while (tmp != NULL) {
+      LIBMTP_error_t *tmp2;
 
-    // Make our previous entries next point to our next
-    if(ptr2->prev != NULL) {
-      ptr1 = ptr2->prev;
-      ptr1->next = ptr2->next;
-    } else {
-      oldhead = ptr2->next;
-      if(oldhead != NULL)
-        oldhead->prev = NULL;
+      if (tmp->error_text != NULL) {
+	free(tmp->error_text);
+      }
+      tmp2 = tmp;
+      tmp = tmp->next;
+      free(tmp2);
     }
+  }
+}
 
-    // Make our next entries previous point to our previous
-    ptr1 = ptr2->next;
-    if(ptr1 != NULL) {
-      ptr1->prev = ptr2->prev;
-    } else {
-      ptr1 = ptr2->prev;
-      if(ptr1 != NULL)
-        ptr1->next = NULL;
-    }
+/**
+ * This function dumps the error stack to <code>stderr</code>.
+ * (You still have to clear the stack though.)
+ * @param device a pointer to the MTP device to dump the error
+ *        stack for.
+ */
+void LIBMTP_Dump_Errorstack(LIBMTP_mtpdevice_t *device)
+{
+  if (device == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: Trying to dump the error stack of a NULL device!\n");
+  } else {
+    LIBMTP_error_t *tmp = device->errorstack;
 
-    if(newlist == NULL) {
-      newlist = ptr2;
-      newlist->prev = NULL;
-    } else {
-      ptr2->prev = newlist;
-      newlist->next = ptr2;
-      newlist = newlist->next;
+    while (tmp != NULL) {
+      if (tmp->error_text != NULL) {
+	LIBMTP_ERROR("Error %d: %s\n", tmp->errornumber, tmp->error_text);
+      } else {
+	LIBMTP_ERROR("Error %d: (unknown)\n", tmp->errornumber);
+      }
+      tmp = tmp->next;
     }
   }
-
-  if (newlist != NULL) {
-    newlist->next = NULL;
-    while(newlist->prev != NULL)
-      newlist = newlist->prev;
-    device->storage = newlist;
-  }
-
-  return 0;
 }
 
 /**
- * This function grabs the first writeable storageid from the
- * device storage list.
- * @param device a pointer to the MTP device to locate writeable
- *        storage for.
- * @param fitsize a file of this file must fit on the device.
+ * This command gets all handles and stuff by FAST directory retrieveal
+ * which is available by getting all metadata for object
+ * <code>0xffffffff</code> which simply means "all metadata for all objects".
+ * This works on the vast majority of MTP devices (there ARE exceptions!)
+ * and is quite quick. Check the error stack to see if there were
+ * problems getting the metadata.
+ * @return 0 if all was OK, -1 on failure.
  */
-static uint32_t get_writeable_storageid(LIBMTP_mtpdevice_t *device,
-					uint64_t fitsize)
+static int get_all_metadata_fast(LIBMTP_mtpdevice_t *device)
 {
-  LIBMTP_devicestorage_t *storage;
-  uint32_t store = 0x00000000; //Should this be 0xffffffffu instead?
-  int subcall_ret;
-
-  // See if there is some storage we can fit this file on.
-  storage = device->storage;
-  if (storage == NULL) {
-    // Sometimes the storage just cannot be detected.
-    store = 0x00000000U;
-  } else {
-    while(storage != NULL) {
-      // These storages cannot be used.
-      if (storage->StorageType == PTP_ST_FixedROM ||
-	  storage->StorageType == PTP_ST_RemovableROM) {
-	storage = storage->next;
-	continue;
-      }
-      // Storage IDs with the lower 16 bits 0x0000 are not supposed
-      // to be writeable.
-      if ((storage->id & 0x0000FFFFU) == 0x00000000U) {
-	storage = storage->next;
-	continue;
-      }
-      // Also check the access capability to avoid e.g. deletable only storages
-      if (storage->AccessCapability == PTP_AC_ReadOnly ||
-	  storage->AccessCapability == PTP_AC_ReadOnly_with_Object_Deletion) {
-	storage = storage->next;
-	continue;
-      }
-      // Then see if we can fit the file.
-      subcall_ret = check_if_file_fits(device, storage, fitsize);
-      if (subcall_ret != 0) {
-	storage = storage->next;
-      } else {
-	// We found a storage that is writable and can fit the file!
-	break;
-      }
-    }
-    if (storage == NULL) {
-      add_error_to_errorstack(device, LIBMTP_ERROR_STORAGE_FULL,
-			      "get_writeable_storageid(): "
-			      "all device storage is full or corrupt.");
-      return -1;
-    }
-    store = storage->id;
-  }
+  PTPParams      *params = (PTPParams *) device->params;
+  uint16_t       ret;
+  int            oldtimeout;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  return store;
+  /*
+   * The follow request causes the device to generate
+   * a list of every file on the device and return it
+   * in a single response. It is decoded into the object
+   * cache while it arrives.
+   *
+   * Some slow devices as well as devices with very
+   * large file systems can easily take longer then
+   * the standard timeout value before it is able
+   * to return a response.
+   *
+   * Temporarly set timeout to allow working with
+   * widest range of devices, see LIBMTP_Set_Timeout_Policy().
+   */
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  if (ptp_usb->long_timeout > oldtimeout)
+    set_usb_device_timeout(ptp_usb, ptp_usb->long_timeout);
+
+  ret = ptp_mtp_getobjectproplist_cache(params, 0xffffffff, 0xffffffff, NULL);
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+
+  if (ret == PTP_RC_MTP_Specification_By_Group_Unsupported) {
+    // What's the point in the device implementing this command if
+    // you cannot use it to get all props for AT LEAST one object?
+    // Well, whatever...
+    add_ptp_error_to_errorstack(device, ret, "get_all_metadata_fast(): "
+    "cannot retrieve all metadata for an object on this device.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "get_all_metadata_fast(): "
+    "could not get proplist of all objects.");
+    return -1;
+  }
+  /* The device might not give the list in linear ascending order */
+  ptp_objects_sort (params);
+  return 0;
 }
 
 /**
- * Tries to suggest a storage_id of a given ID when we have a parent
- * @param device a pointer to the device where to search for the storage ID
- * @param fitsize a file of this file must fit on the device.
- * @param parent_id look for this ID
- * @ret storageID
+ * A folder that an enumeration still has to list.
  */
-static int get_suggested_storage_id(LIBMTP_mtpdevice_t *device,
-				    uint64_t fitsize,
-				    uint32_t parent_id)
+typedef struct {
+  uint32_t storageid;
+  uint32_t parent;
+} folder_frontier_t;
+
+/**
+ * The memory the folder queue of flush_handles() may take, enough
+ * for 128k folders waiting at once.
+ */
+#define DEFAULT_ENUMERATION_MEMORY (1024 * 1024)
+
+/**
+ * An enumeration of the objects on a device, see
+ * LIBMTP_Begin_Enumeration(). The folders still to be listed are
+ * kept in a queue that starts out with the root of every storage, so
+ * the storages are walked level by level side by side rather than one
+ * whole tree after the other. Once the queue is full, further folders
+ * are left out and picked up again from the object cache, where the
+ * folders that were listed already are marked
+ * PTPOBJECT_DIRECTORY_LOADED, when the queue runs empty.
+ */
+struct LIBMTP_enumeration_struct {
+  LIBMTP_mtpdevice_t *device;
+  folder_frontier_t *frontier;
+  unsigned int first; /**< Next folder to list */
+  unsigned int last; /**< End of the queued folders */
+  unsigned int size; /**< Allocated entries */
+  unsigned int max_queued; /**< Ceiling on the queued folders */
+  int started;
+  int overflowed; /**< Folders were left out of the queue */
+  int root_listed;
+  int done;
+};
+
+/**
+ * Adds a folder to the queue of an enumeration.
+ * @return 0 if it was queued, 1 if the queue is at its ceiling,
+ *         -1 if out of memory.
+ */
+static int enumeration_queue(LIBMTP_enumeration_t *e,
+			     uint32_t const storageid, uint32_t const parent,
+			     int const ceiling)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  PTPObject *ob;
-  uint16_t ret;
+  folder_frontier_t *tmp;
+  unsigned int size;
 
-  ret = ptp_object_want(params, parent_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if ((ret != PTP_RC_OK) || (ob->oi.StorageID == 0)) {
-    add_ptp_error_to_errorstack(device, ret, "get_suggested_storage_id(): "
-				"could not get storage id from parent id.");
-    return get_writeable_storageid(device, fitsize);
-  } else {
-    /* OK we know the parent storage, then use that */
-    return ob->oi.StorageID;
+  if (ceiling && e->last - e->first >= e->max_queued)
+    return 1;
+  if (e->last == e->size) {
+    // Reuse the space of the folders already listed first
+    if (e->first > 0) {
+      memmove(e->frontier, &e->frontier[e->first],
+	      (e->last - e->first) * sizeof(folder_frontier_t));
+      e->last -= e->first;
+      e->first = 0;
+    } else {
+      size = e->size ? e->size * 2 : 16;
+      tmp = realloc(e->frontier, size * sizeof(folder_frontier_t));
+      if (tmp == NULL)
+	return -1;
+      e->frontier = tmp;
+      e->size = size;
+    }
   }
+  e->frontier[e->last].storageid = storageid;
+  e->frontier[e->last].parent = parent;
+  e->last++;
+  return 0;
 }
 
 /**
- * This function grabs the freespace from a certain storage in
- * device storage list.
- * @param device a pointer to the MTP device to free the storage
- * list for.
- * @param storageid the storage ID for the storage to flush and
- * get free space for.
- * @param freespace the free space on this storage will be returned
- * in this variable.
+ * Queues again the folders that were left out when the queue was full,
+ * as far as they fit now. The caller holds the objects lock.
  */
-static int get_storage_freespace(LIBMTP_mtpdevice_t *device,
-				 LIBMTP_devicestorage_t *storage,
-				 uint64_t *freespace)
+static int enumeration_refill(LIBMTP_enumeration_t *e)
 {
-  PTPParams *params = (PTPParams *) device->params;
+  PTPParams *params = (PTPParams *) e->device->params;
+  unsigned int i;
+  int ret;
 
-  // Always query the device about this, since some models explicitly
-  // needs that. We flush all data on queries storage here.
-  if (ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
-    PTPStorageInfo storageInfo;
-    uint16_t ret;
+  e->overflowed = 0;
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = params->objects[i];
 
-    ret = ptp_getstorageinfo(params, storage->id, &storageInfo);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret,
-		"get_storage_freespace(): could not get storage info.");
+    if (ob->oi.ObjectFormat != PTP_OFC_Association ||
+	(ob->flags & PTPOBJECT_DIRECTORY_LOADED))
+      continue;
+    ret = enumeration_queue(e, ob->oi.StorageID, ob->oid, 1);
+    if (ret < 0)
       return -1;
+    if (ret > 0) {
+      e->overflowed = 1;
+      break;
     }
-    if (storage->StorageDescription != NULL) {
-      free(storage->StorageDescription);
-    }
-    if (storage->VolumeIdentifier != NULL) {
-      free(storage->VolumeIdentifier);
-    }
-    storage->StorageType = storageInfo.StorageType;
-    storage->FilesystemType = storageInfo.FilesystemType;
-    storage->AccessCapability = storageInfo.AccessCapability;
-    storage->MaxCapacity = storageInfo.MaxCapability;
-    storage->FreeSpaceInBytes = storageInfo.FreeSpaceInBytes;
-    storage->FreeSpaceInObjects = storageInfo.FreeSpaceInImages;
-    storage->StorageDescription = storageInfo.StorageDescription;
-    storage->VolumeIdentifier = storageInfo.VolumeLabel;
   }
-  if(storage->FreeSpaceInBytes == (uint64_t) -1)
-    return -1;
-  *freespace = storage->FreeSpaceInBytes;
   return 0;
 }
 
 /**
- * This function dumps out a large chunk of textual information
- * provided from the PTP protocol and additionally some extra
- * MTP-specific information where applicable.
- * @param device a pointer to the MTP device to report info from.
+ * Sets up an enumeration of a device, see LIBMTP_Begin_Enumeration().
  */
-void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
+static LIBMTP_enumeration_t *new_enumeration(LIBMTP_mtpdevice_t *device,
+					     size_t const max_memory)
 {
-  unsigned int i;
+  LIBMTP_enumeration_t *e;
+  LIBMTP_devicestorage_t *storage = device->storage;
+
+  e = (LIBMTP_enumeration_t *) calloc(1, sizeof(LIBMTP_enumeration_t));
+  if (e == NULL)
+    return NULL;
+  e->device = device;
+  if (max_memory == 0 || max_memory / sizeof(folder_frontier_t) > UINT_MAX)
+    e->max_queued = UINT_MAX;
+  else
+    e->max_queued = max_memory / sizeof(folder_frontier_t);
+  // A few folders at least, or the walk cannot go on
+  if (e->max_queued < 16)
+    e->max_queued = 16;
+  // The roots do not count against the ceiling, they are not objects
+  do {
+    if (enumeration_queue(e, storage ? storage->id : PTP_GOH_ALL_STORAGE,
+			  PTP_GOH_ROOT_PARENT, 0) != 0) {
+      free(e->frontier);
+      free(e);
+      return NULL;
+    }
+    if (storage != NULL)
+      storage = storage->next;
+  } while (storage != NULL);
+  return e;
+}
+
+/**
+ * Lists the next folders of an enumeration. This throws away the
+ * object cache on the first step. Where the device gives the property
+ * list of all objects at once, that is all there is to it; otherwise
+ * the folders are walked breadth first. Where the device can give the
+ * property list of a folder, all the children of a folder come in with
+ * one request instead of one per object. The caller holds the objects
+ * lock for writing.
+ * @param e the enumeration.
+ * @param max_folders the number of folders to list at most.
+ * @return 1 if there is more to do, 0 if the enumeration is complete,
+ *         -1 if it had to stop for lack of memory.
+ */
+static int enumeration_step(LIBMTP_enumeration_t *e,
+			    unsigned int const max_folders)
+{
+  LIBMTP_mtpdevice_t *device = e->device;
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_devicestorage_t *storage = device->storage;
-  LIBMTP_device_extension_t *tmpext = device->extensions;
+  int fast = ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList) &&
+    !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb);
+  unsigned int listed = 0;
 
-  printf("USB low-level info:\n");
-  dump_usbinfo(ptp_usb);
-  /* Print out some verbose information */
-  printf("Device info:\n");
-  printf("   Manufacturer: %s\n", params->deviceinfo.Manufacturer);
-  printf("   Model: %s\n", params->deviceinfo.Model);
-  printf("   Device version: %s\n", params->deviceinfo.DeviceVersion);
-  printf("   Serial number: %s\n", params->deviceinfo.SerialNumber);
-  printf("   Vendor extension ID: 0x%08x\n",
-	 params->deviceinfo.VendorExtensionID);
-  printf("   Vendor extension description: %s\n",
-	 params->deviceinfo.VendorExtensionDesc);
-  printf("   Detected object size: %d bits\n",
-	 device->object_bitsize);
-  printf("   Extensions:\n");
-  while (tmpext != NULL) {
-    printf("        %s: %d.%d\n",
-           tmpext->name,
-           tmpext->major,
-           tmpext->minor);
-    tmpext = tmpext->next;
-  }
-  printf("Supported operations:\n");
-  for (i=0;i<params->deviceinfo.OperationsSupported_len;i++)
-    printf("   %04x: %s\n", params->deviceinfo.OperationsSupported[i], ptp_get_opcode_name(params, params->deviceinfo.OperationsSupported[i]));
-  printf("Events supported:\n");
-  if (params->deviceinfo.EventsSupported_len == 0) {
-    printf("   None.\n");
-  } else {
-    for (i=0;i<params->deviceinfo.EventsSupported_len;i++) {
-      printf("   0x%04x: %s\n", params->deviceinfo.EventsSupported[i], ptp_get_event_code_name(params, params->deviceinfo.EventsSupported[i]));
+  if (e->done)
+    return 0;
+  if (!e->started) {
+    e->started = 1;
+    ptp_free_objects(params);
+    if (fast && !FLAG_BROKEN_MTPGETOBJPROPLIST_ALL(ptp_usb)) {
+      // Use the fast method. Ignore return value for now.
+      get_all_metadata_fast(device);
     }
+    // If the previous failed or returned no objects, use classic
+    // methods instead.
+    if (params->nrofobjects != 0)
+      e->first = e->last;
   }
-  printf("Device Properties Supported:\n");
-  for (i=0;i<params->deviceinfo.DevicePropertiesSupported_len;i++) {
-    char const *propdesc = ptp_get_property_description(params,
-			params->deviceinfo.DevicePropertiesSupported[i]);
 
-    if (propdesc != NULL) {
-      printf("   0x%04x: %s\n",
-	     params->deviceinfo.DevicePropertiesSupported[i], propdesc);
-    } else {
-      uint16_t prop = params->deviceinfo.DevicePropertiesSupported[i];
-      printf("   0x%04x: Unknown property\n", prop);
+  while (listed < max_folders) {
+    folder_frontier_t folder;
+    PTPObjectHandles currentHandles;
+    PTPObject *ob;
+    unsigned int i;
+    uint16_t r;
+
+    if (e->first == e->last && e->overflowed) {
+      if (enumeration_refill(e) != 0)
+	goto oom;
+    }
+    if (e->first == e->last)
+      break;
+    folder = e->frontier[e->first++];
+    listed++;
+
+    // Marked first, so that a folder that fails is not tried again
+    if (folder.parent != PTP_GOH_ROOT_PARENT &&
+	ptp_object_find(params, folder.parent, &ob) == PTP_RC_OK)
+      ob->flags |= PTPOBJECT_DIRECTORY_LOADED;
+
+    r = ptp_getobjecthandles(params, folder.storageid, PTP_GOH_ALL_FORMATS,
+			     folder.parent, &currentHandles);
+    if (r != PTP_RC_OK) {
+      char buf[80];
+      sprintf(buf,"enumeration_step(): could not get object handles of %08x", folder.parent);
+      add_ptp_error_to_errorstack(device, r, buf);
+      continue;
+    }
+    if (currentHandles.Handler == NULL || currentHandles.n == 0) {
+      free(currentHandles.Handler);
+      continue;
     }
-  }
 
-  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjectPropsSupported)) {
-    printf("Playable File (Object) Types and Object Properties Supported:\n");
-    for (i=0;i<params->deviceinfo.ImageFormats_len;i++) {
-      char txt[256];
-      uint16_t ret;
-      uint16_t *props = NULL;
-      uint32_t propcnt = 0;
-      unsigned int j;
+    // The root listing covers the roots of all storages
+    if (fast && (folder.parent != PTP_GOH_ROOT_PARENT || !e->root_listed))
+      get_folder_metadata_fast(device, folder.parent, &currentHandles);
+    if (folder.parent == PTP_GOH_ROOT_PARENT)
+      e->root_listed = 1;
 
-      (void) ptp_render_ofc (params, params->deviceinfo.ImageFormats[i],
-			     sizeof(txt), txt);
-      printf("   %04x: %s\n", params->deviceinfo.ImageFormats[i], txt);
+    // Queue any subdirectories found
+    for (i = 0; i < currentHandles.n; i++) {
+      int ret;
 
-      ret = ptp_mtp_getobjectpropssupported (params,
-			params->deviceinfo.ImageFormats[i], &propcnt, &props);
-      if (ret != PTP_RC_OK) {
-	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Dump_Device_Info(): "
-				    "error on query for object properties.");
-      } else {
-	for (j=0;j<propcnt;j++) {
-	  PTPObjectPropDesc opd;
-	  int k;
+      r = ptp_object_want(params, currentHandles.Handler[i],
+			  PTPOBJECT_OBJECTINFO_LOADED, &ob);
+      if (r != PTP_RC_OK) {
+	add_error_to_errorstack(device,
+				LIBMTP_ERROR_CONNECTING,
+				"Found a bad handle, trying to ignore it.");
+	continue;
+      }
+      if (ob->oi.ObjectFormat != PTP_OFC_Association ||
+	  e->overflowed)
+	continue;
+      ret = enumeration_queue(e, folder.storageid, currentHandles.Handler[i], 1);
+      if (ret < 0) {
+	free(currentHandles.Handler);
+	goto oom;
+      }
+      if (ret > 0)
+	e->overflowed = 1;
+    }
+    free(currentHandles.Handler);
+  }
 
-	  printf("      %04x: %s", props[j],
-		 LIBMTP_Get_Property_Description(map_ptp_property_to_libmtp_property(props[j])));
-	  // Get a more verbose description
-	  ret = ptp_mtp_getobjectpropdesc(params, props[j],
-					  params->deviceinfo.ImageFormats[i],
-					  &opd);
-	  if (ret != PTP_RC_OK) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-				    "LIBMTP_Dump_Device_Info(): "
-				    "could not get property description.");
-	    break;
-	  }
+  if (e->first < e->last || e->overflowed)
+    return 1;
+  e->done = 1;
+  locate_default_folders(device);
+  return 0;
 
-	  if (opd.DataType == PTP_DTC_STR) {
-	    printf(" STRING data type");
-	    switch (opd.FormFlag) {
-	    case PTP_OPFF_DateTime:
-	      printf(" DATETIME FORM (%s)", opd.FORM.DateTime.String);
-	      break;
-	    case PTP_OPFF_RegularExpression:
-	      printf(" REGULAR EXPRESSION FORM (%s)", opd.FORM.RegularExpression.String);
-	      break;
-	    case PTP_OPFF_LongString:
-	      printf(" LONG STRING FORM");
-	      break;
-	    default:
-	      break;
-	    }
-	  } else {
-	    if (opd.DataType & PTP_DTC_ARRAY_MASK) {
-	      printf(" array of");
-	    }
-
-	    switch (opd.DataType & (~PTP_DTC_ARRAY_MASK)) {
-
-	    case PTP_DTC_UNDEF:
-	      printf(" UNDEFINED data type");
-	      break;
-	    case PTP_DTC_INT8:
-	      printf(" INT8 data type");
-	      switch (opd.FormFlag) {
-	      case PTP_OPFF_Range:
-		printf(" range: MIN %d, MAX %d, STEP %d",
-		       opd.FORM.Range.MinimumValue.i8,
-		       opd.FORM.Range.MaximumValue.i8,
-		       opd.FORM.Range.StepSize.i8);
-		break;
-	      case PTP_OPFF_Enumeration:
-		printf(" enumeration: ");
-		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
-		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].i8);
-		}
-		break;
-	      case PTP_OPFF_ByteArray:
-		printf(" byte array: ");
-		break;
-	      default:
-		printf(" ANY 8BIT VALUE form");
-		break;
-	      }
-	      break;
+ oom:
+  add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			  "enumeration_step(): out of memory.");
+  return -1;
+}
 
-	    case PTP_DTC_UINT8:
-	      printf(" UINT8 data type");
-	      switch (opd.FormFlag) {
-	      case PTP_OPFF_Range:
-		printf(" range: MIN %d, MAX %d, STEP %d",
-		       opd.FORM.Range.MinimumValue.u8,
-		       opd.FORM.Range.MaximumValue.u8,
-		       opd.FORM.Range.StepSize.u8);
-		break;
-	      case PTP_OPFF_Enumeration:
-		printf(" enumeration: ");
-		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
-		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].u8);
-		}
-		break;
-	      case PTP_OPFF_ByteArray:
-		printf(" byte array: ");
-		break;
-	      default:
-		printf(" ANY 8BIT VALUE form");
-		break;
-	      }
-	      break;
+/**
+ * This starts enumerating the objects on a device step by step, as an
+ * alternative to the enumeration that opening a device does in one go.
+ * Open the device with <code>LIBMTP_Open_Raw_Device_Uncached()</code>
+ * to skip that one; the device is turned into a cached device here.
+ * The object cache is thrown away on the first step and then fills up
+ * with every call to <code>LIBMTP_Continue_Enumeration()</code>, so
+ * an application can show what was found so far between the steps,
+ * or put the enumeration aside and go on with it later. The object
+ * cache is all there is until the enumeration is complete, so any
+ * listing meanwhile shows only part of the device.
+ *
+ * Typical usage:
+ *
+ * <pre>
+ * LIBMTP_enumeration_t *e = LIBMTP_Begin_Enumeration(device, 0);
+ *
+ * while (LIBMTP_Continue_Enumeration(e, 16) == 1) {
+ *   // Show what is in the cache so far...
+ * }
+ * LIBMTP_End_Enumeration(e);
+ * </pre>
+ *
+ * @param device a pointer to the device to enumerate.
+ * @param max_memory the memory in bytes that the queue of folders still
+ *        to be listed may take, or 0 for no limit. Folders that do not
+ *        fit are found again in the object cache later, at the cost of
+ *        a pass over the cache each time the queue runs empty.
+ * @return the enumeration, or NULL if it could not be set up.
+ * @see LIBMTP_Continue_Enumeration()
+ * @see LIBMTP_End_Enumeration()
+ */
+LIBMTP_enumeration_t *LIBMTP_Begin_Enumeration(LIBMTP_mtpdevice_t *device,
+					       size_t const max_memory)
+{
+  LIBMTP_enumeration_t *e = new_enumeration(device, max_memory);
 
-	    case PTP_DTC_INT16:
-	      printf(" INT16 data type");
-	      switch (opd.FormFlag) {
-	      case PTP_OPFF_Range:
-	      printf(" range: MIN %d, MAX %d, STEP %d",
-		     opd.FORM.Range.MinimumValue.i16,
-		     opd.FORM.Range.MaximumValue.i16,
-		     opd.FORM.Range.StepSize.i16);
-	      break;
-	      case PTP_OPFF_Enumeration:
-		printf(" enumeration: ");
-		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
-		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].i16);
-		}
-		break;
-	      default:
-		printf(" ANY 16BIT VALUE form");
-		break;
-	      }
-	      break;
+  if (e == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Begin_Enumeration(): out of memory.");
+    return NULL;
+  }
+  device->cached = 1;
+  return e;
+}
 
-	    case PTP_DTC_UINT16:
-	      printf(" UINT16 data type");
-	      switch (opd.FormFlag) {
-	      case PTP_OPFF_Range:
-		printf(" range: MIN %d, MAX %d, STEP %d",
-		       opd.FORM.Range.MinimumValue.u16,
-		       opd.FORM.Range.MaximumValue.u16,
-		       opd.FORM.Range.StepSize.u16);
-		break;
-	      case PTP_OPFF_Enumeration:
-		printf(" enumeration: ");
-		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
-		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].u16);
-		}
-		break;
-	      default:
-		printf(" ANY 16BIT VALUE form");
-		break;
-	      }
-	      break;
+/**
+ * This goes on with an enumeration, listing a number of folders.
+ * @param enumeration the enumeration from
+ *        <code>LIBMTP_Begin_Enumeration()</code>.
+ * @param max_folders the number of folders to list at most in this
+ *        call, which bounds the time it takes.
+ * @return 1 if there is more to do, 0 if the enumeration is complete,
+ *         -1 if it failed. Check the error stack for problems with
+ *         single folders, which are skipped.
+ */
+int LIBMTP_Continue_Enumeration(LIBMTP_enumeration_t *enumeration,
+				unsigned int const max_folders)
+{
+  PTPParams *params = (PTPParams *) enumeration->device->params;
+  int ret;
 
-	    case PTP_DTC_INT32:
-	      printf(" INT32 data type");
-	      switch (opd.FormFlag) {
-	      case PTP_OPFF_Range:
-		printf(" range: MIN %d, MAX %d, STEP %d",
-		       opd.FORM.Range.MinimumValue.i32,
-		       opd.FORM.Range.MaximumValue.i32,
-		       opd.FORM.Range.StepSize.i32);
-		break;
-	      case PTP_OPFF_Enumeration:
-		printf(" enumeration: ");
-		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
-		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].i32);
-		}
-		break;
-	      default:
-		printf(" ANY 32BIT VALUE form");
-		break;
-	      }
-	      break;
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  ret = enumeration_step(enumeration, max_folders);
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  return ret;
+}
 
-	    case PTP_DTC_UINT32:
-	      printf(" UINT32 data type");
-	      switch (opd.FormFlag) {
-	      case PTP_OPFF_Range:
-		printf(" range: MIN %u, MAX %u, STEP %u",
-		       opd.FORM.Range.MinimumValue.u32,
-		       opd.FORM.Range.MaximumValue.u32,
-		       opd.FORM.Range.StepSize.u32);
-		break;
-	      case PTP_OPFF_Enumeration:
-		// Special pretty-print for FOURCC codes
-		if (params->deviceinfo.ImageFormats[i] == PTP_OPC_VideoFourCCCodec) {
-		  printf(" enumeration of u32 casted FOURCC: ");
-		  for (k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
-		    if (opd.FORM.Enum.SupportedValue[k].u32 == 0) {
-		      printf("ANY, ");
-		    } else {
-		      char fourcc[6];
-		      fourcc[0] = (opd.FORM.Enum.SupportedValue[k].u32 >> 24) & 0xFFU;
-		      fourcc[1] = (opd.FORM.Enum.SupportedValue[k].u32 >> 16) & 0xFFU;
-		      fourcc[2] = (opd.FORM.Enum.SupportedValue[k].u32 >> 8) & 0xFFU;
-		      fourcc[3] = opd.FORM.Enum.SupportedValue[k].u32 & 0xFFU;
-		      fourcc[4] = '\n';
-		      fourcc[5] = '\0';
-		      printf("\"%s\", ", fourcc);
-		    }
-		  }
-		} else {
-		  printf(" enumeration: ");
-		  for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
-		    printf("%u, ", opd.FORM.Enum.SupportedValue[k].u32);
-		  }
-		}
-		break;
-	      default:
-		printf(" ANY 32BIT VALUE form");
-		break;
-	      }
-	      break;
+/**
+ * This frees an enumeration. The objects it found stay in the cache,
+ * even if it was not complete.
+ * @param enumeration the enumeration to free.
+ */
+void LIBMTP_End_Enumeration(LIBMTP_enumeration_t *enumeration)
+{
+  if (enumeration == NULL)
+    return;
+  free(enumeration->frontier);
+  free(enumeration);
+}
 
-	    case PTP_DTC_INT64:
-	      printf(" INT64 data type");
-	      break;
+/**
+ * This function refresh the internal handle list whenever
+ * the items stored inside the device is altered. On operations
+ * that do not add or remove objects, this is typically not
+ * called.
+ * @param device a pointer to the MTP device to flush handles for.
+ */
+static void flush_handles(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_enumeration_t *e;
 
-	    case PTP_DTC_UINT64:
-	      printf(" UINT64 data type");
-	      break;
+  if (!device->cached) {
+    return;
+  }
 
-	    case PTP_DTC_INT128:
-	      printf(" INT128 data type");
-	      break;
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  e = new_enumeration(device, DEFAULT_ENUMERATION_MEMORY);
+  if (e == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "flush_handles(): out of memory.");
+  } else {
+    while (enumeration_step(e, UINT_MAX) == 1)
+      ;
+    LIBMTP_End_Enumeration(e);
+  }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+}
 
-	    case PTP_DTC_UINT128:
-	      printf(" UINT128 data type");
-	      break;
+/**
+ * Loop over the cached objects, fix up any NULL filenames or
+ * keywords, then attempt to locate some default folders in the
+ * root directory of the primary storage. The caller holds the
+ * objects lock for writing.
+ * @param device a pointer to the device to scan the cache of.
+ */
+static void locate_default_folders(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+  int ret;
 
-	    default:
-	      printf(" UNKNOWN data type");
-	      break;
-	    }
-	  }
-	  if (opd.GetSet) {
-	    printf(" GET/SET");
-	  } else {
-	    printf(" READ ONLY");
-	  }
-	  printf(" GROUP 0x%x", opd.GroupCode);
+  for(i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob, *xob;
 
-	  printf("\n");
-	  ptp_free_objectpropdesc(&opd);
-	}
-	free(props);
-      }
+    ob = params->objects[i];
+    ret = ptp_object_want(params,params->objects[i]->oid,
+			  PTPOBJECT_OBJECTINFO_LOADED, &xob);
+    if (ret != PTP_RC_OK) {
+	LIBMTP_ERROR("broken! %x not found\n", params->objects[i]->oid);
     }
-  }
+    if (ob->oi.Filename == NULL) {
+      ob->oi.Filename = ptp_cache_strdup(params, "<null>");
+      ptp_object_name_changed(params, ob);
+    }
+    if (ob->oi.Keywords == NULL)
+      ob->oi.Keywords = ptp_cache_strdup(params, "<null>");
 
-  if(storage != NULL &&
-     ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
-    printf("Storage Devices:\n");
-    while(storage != NULL) {
-      printf("   StorageID: 0x%08x\n",storage->id);
-      printf("      StorageType: 0x%04x ",storage->StorageType);
-      switch (storage->StorageType) {
-      case PTP_ST_Undefined:
-	printf("(undefined)\n");
-	break;
-      case PTP_ST_FixedROM:
-	printf("fixed ROM storage\n");
-	break;
-      case PTP_ST_RemovableROM:
-	printf("removable ROM storage\n");
-	break;
-      case PTP_ST_FixedRAM:
-	printf("fixed RAM storage\n");
-	break;
-      case PTP_ST_RemovableRAM:
-	printf("removable RAM storage\n");
-	break;
-      default:
-	printf("UNKNOWN storage\n");
-	break;
-      }
-      printf("      FilesystemType: 0x%04x ",storage->FilesystemType);
-      switch(storage->FilesystemType) {
-      case PTP_FST_Undefined:
-	printf("(undefined)\n");
-	break;
-      case PTP_FST_GenericFlat:
-	printf("generic flat filesystem\n");
-	break;
-      case PTP_FST_GenericHierarchical:
-	printf("generic hierarchical\n");
-	break;
-      case PTP_FST_DCF:
-	printf("DCF\n");
-	break;
-      default:
-	printf("UNKNONWN filesystem type\n");
-	break;
-      }
-      printf("      AccessCapability: 0x%04x ",storage->AccessCapability);
-      switch(storage->AccessCapability) {
-      case PTP_AC_ReadWrite:
-	printf("read/write\n");
-	break;
-      case PTP_AC_ReadOnly:
-	printf("read only\n");
-	break;
-      case PTP_AC_ReadOnly_with_Object_Deletion:
-	printf("read only + object deletion\n");
-	break;
-      default:
-	printf("UNKNOWN access capability\n");
-	break;
-      }
-      printf("      MaxCapacity: %llu\n",
-	     (long long unsigned int) storage->MaxCapacity);
-      printf("      FreeSpaceInBytes: %llu\n",
-	     (long long unsigned int) storage->FreeSpaceInBytes);
-      printf("      FreeSpaceInObjects: %llu\n",
-	     (long long unsigned int) storage->FreeSpaceInObjects);
-      printf("      StorageDescription: %s\n",storage->StorageDescription);
-      printf("      VolumeIdentifier: %s\n",storage->VolumeIdentifier);
-      storage = storage->next;
+    /* Ignore handles that point to non-folders */
+    if(ob->oi.ObjectFormat != PTP_OFC_Association)
+      continue;
+    /* Only look in the root folder */
+    if (ob->oi.ParentObject == 0xffffffffU) {
+      LIBMTP_ERROR("object %x has parent 0xffffffff (-1) continuing anyway\n",
+		   ob->oid);
+    } else if (ob->oi.ParentObject != 0x00000000U)
+      continue;
+    /* Only look in the primary storage */
+    if (device->storage != NULL && ob->oi.StorageID != device->storage->id)
+      continue;
+
+    /* Is this the Music Folder */
+    if (!strcasecmp(ob->oi.Filename, "My Music") ||
+	!strcasecmp(ob->oi.Filename, "My_Music") ||
+	!strcasecmp(ob->oi.Filename, "Music")) {
+      device->default_music_folder = ob->oid;
+    }
+    else if (!strcasecmp(ob->oi.Filename, "My Playlists") ||
+	     !strcasecmp(ob->oi.Filename, "My_Playlists") ||
+	     !strcasecmp(ob->oi.Filename, "Playlists")) {
+      device->default_playlist_folder = ob->oid;
+    }
+    else if (!strcasecmp(ob->oi.Filename, "My Pictures") ||
+	     !strcasecmp(ob->oi.Filename, "My_Pictures") ||
+	     !strcasecmp(ob->oi.Filename, "Pictures")) {
+      device->default_picture_folder = ob->oid;
+    }
+    else if (!strcasecmp(ob->oi.Filename, "My Video") ||
+	     !strcasecmp(ob->oi.Filename, "My_Video") ||
+	     !strcasecmp(ob->oi.Filename, "Video")) {
+	device->default_video_folder = ob->oid;
+    }
+    else if (!strcasecmp(ob->oi.Filename, "My Organizer") ||
+	     !strcasecmp(ob->oi.Filename, "My_Organizer")) {
+      device->default_organizer_folder = ob->oid;
+    }
+    else if (!strcasecmp(ob->oi.Filename, "ZENcast") ||
+	     !strcasecmp(ob->oi.Filename, "Datacasts")) {
+      device->default_zencast_folder = ob->oid;
+    }
+    else if (!strcasecmp(ob->oi.Filename, "My Albums") ||
+	     !strcasecmp(ob->oi.Filename, "My_Albums") ||
+	     !strcasecmp(ob->oi.Filename, "Albums")) {
+      device->default_album_folder = ob->oid;
+    }
+    else if (!strcasecmp(ob->oi.Filename, "Text") ||
+	     !strcasecmp(ob->oi.Filename, "Texts")) {
+      device->default_text_folder = ob->oid;
     }
   }
-
-  printf("Special directories:\n");
-  printf("   Default music folder: 0x%08x\n",
-	 device->default_music_folder);
-  printf("   Default playlist folder: 0x%08x\n",
-	 device->default_playlist_folder);
-  printf("   Default picture folder: 0x%08x\n",
-	 device->default_picture_folder);
-  printf("   Default video folder: 0x%08x\n",
-	 device->default_video_folder);
-  printf("   Default organizer folder: 0x%08x\n",
-	 device->default_organizer_folder);
-  printf("   Default zencast folder: 0x%08x\n",
-	 device->default_zencast_folder);
-  printf("   Default album folder: 0x%08x\n",
-	 device->default_album_folder);
-  printf("   Default text folder: 0x%08x\n",
-	 device->default_text_folder);
 }
 
 /**
- * This resets a device in case it supports the <code>PTP_OC_ResetDevice</code>
- * operation code (0x1010).
- * @param device a pointer to the device to reset.
- * @return 0 on success, any other value means failure.
+ * This makes sure the object cache can be read: the first time it
+ * enumerates the device, after that it applies the object events that
+ * were queued by <code>queue_cache_event()</code> in the meantime.
+ * @param device a pointer to the device to update the cache for.
  */
-int LIBMTP_Reset_Device(LIBMTP_mtpdevice_t *device)
+static void update_cache(LIBMTP_mtpdevice_t *device)
 {
   PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
-
-  if (!ptp_operation_issupported(params,PTP_OC_ResetDevice)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Reset_Device(): "
-			    "device does not support resetting.");
-    return -1;
+  PTPObjectEvent *events;
+  unsigned int i, n;
+  int lost;
+
+  // Take the queue first, loading objects does not add to it
+  ptp_lock(params, PTP_LOCK_EVENTS);
+  events = params->object_events;
+  n = params->nrofobject_events;
+  lost = params->object_events_lost;
+  params->object_events = NULL;
+  params->nrofobject_events = 0;
+  params->object_events_lost = 0;
+  ptp_lock(params, PTP_UNLOCK_EVENTS);
+
+  // Usually there is nothing to do, which a reader can tell
+  if (n == 0 && !lost) {
+    ptp_lock(params, PTP_LOCK_OBJECTS_READ);
+    i = params->nrofobjects;
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+    if (i != 0) {
+      free(events);
+      return;
+    }
   }
-  ret = ptp_resetdevice(params);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "Error resetting.");
-    return -1;
+
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  for (i = 0; i < n; i++)
+    if (events[i].code == PTP_EC_ObjectRemoved ||
+	events[i].code == PTP_EC_MTP_ObjectReferencesChanged)
+      references_forget(device, events[i].oid);
+  if (lost && params->events_update_cache)
+    ptp_free_objects(params);
+  if (params->nrofobjects == 0) {
+    flush_handles(device);
+  } else if (params->events_update_cache) {
+    for (i = 0; i < n; i++) {
+      if (events[i].code == PTP_EC_MTP_ObjectReferencesChanged)
+	continue;
+      if (events[i].code != PTP_EC_ObjectAdded)
+	ptp_remove_object_from_cache(params, events[i].oid);
+      if (events[i].code != PTP_EC_ObjectRemoved)
+	add_object_to_cache(device, events[i].oid);
+    }
   }
-  return 0;
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  free(events);
 }
 
+/*
+ * The object cache snapshot: the storage list and the object infos of
+ * a device in a file named after its serial number, so that a device
+ * that did not change since the last session can be opened without
+ * enumerating all of its objects again. The file is a header, the
+ * storage records, the fixed size object records and then a table of
+ * NUL terminated strings that the object records point into. It is in
+ * host byte order, a snapshot written by another host is not used.
+ */
+#define METADATA_CACHE_MAGIC "LIBMTPMC"
+#define METADATA_CACHE_BYTEORDER 0x01020304U
+#define METADATA_CACHE_VERSION 1
+// Objects compared with the device before a snapshot is used
+#define METADATA_CACHE_SAMPLES 8
+// Object flags that hold for a restored object
+#define METADATA_CACHE_OBJECTFLAGS (PTPOBJECT_OBJECTINFO_LOADED|\
+				    PTPOBJECT_PARENTOBJECT_LOADED|\
+				    PTPOBJECT_STORAGEID_LOADED|\
+				    PTPOBJECT_COREPROPS_LOADED|\
+				    PTPOBJECT_OBJECTSIZE_LOADED)
+
+typedef struct {
+  char magic[8];
+  uint32_t byteorder;
+  uint32_t version;
+  uint32_t nrofstorages;
+  uint32_t nrofobjects;
+  uint32_t stringsize;
+  uint32_t reserved;
+} metadata_cache_header_t;
+
+typedef struct {
+  uint64_t MaxCapacity;
+  uint64_t FreeSpaceInBytes;
+  uint64_t FreeSpaceInObjects;
+  uint32_t id;
+  uint32_t nrofrootobjects;
+} metadata_cache_storage_t;
+
+typedef struct {
+  uint64_t ObjectCompressedSize;
+  int64_t CaptureDate;
+  int64_t ModificationDate;
+  uint32_t oid;
+  uint32_t StorageID;
+  uint32_t ParentObject;
+  uint32_t AssociationDesc;
+  // Offsets into the string table, 0 is NULL
+  uint32_t Filename;
+  uint32_t Keywords;
+  uint16_t ObjectFormat;
+  uint16_t ProtectionStatus;
+  uint16_t AssociationType;
+  uint16_t flags;
+} metadata_cache_object_t;
+
 /**
- * This retrieves the manufacturer name of an MTP device.
- * @param device a pointer to the device to get the manufacturer name for.
- * @return a newly allocated UTF-8 string representing the manufacturer name.
- *         The string must be freed by the caller after use. If the call
- *         was unsuccessful this will contain NULL.
+ * This sets the directory where LIBMTP_Save_Metadata_Cache() and
+ * LIBMTP_Release_Device() keep the object cache of each device, and
+ * where LIBMTP_Open_Raw_Device() looks for it. The directory must
+ * exist. It can also be set with the LIBMTP_CACHE_DIR environment
+ * variable before LIBMTP_Init() is called.
+ * @param path the directory to use, or NULL to stop using snapshots,
+ *        which is the default.
  */
-char *LIBMTP_Get_Manufacturername(LIBMTP_mtpdevice_t *device)
+void LIBMTP_Set_Metadata_Cache_Directory(char const * const path)
 {
-  char *retmanuf = NULL;
-  PTPParams *params = (PTPParams *) device->params;
-
-  if (params->deviceinfo.Manufacturer != NULL) {
-    retmanuf = strdup(params->deviceinfo.Manufacturer);
-  }
-  return retmanuf;
+  if (g_metadata_cache_dir != NULL)
+    free(g_metadata_cache_dir);
+  g_metadata_cache_dir = NULL;
+  if (path != NULL && path[0] != '\0')
+    g_metadata_cache_dir = strdup(path);
 }
 
 /**
- * This retrieves the model name (often equal to product name)
- * of an MTP device.
- * @param device a pointer to the device to get the model name for.
- * @return a newly allocated UTF-8 string representing the model name.
- *         The string must be freed by the caller after use. If the call
- *         was unsuccessful this will contain NULL.
+ * This returns the path of a file kept for a device in a cache
+ * directory, named after the serial number of the device. Anything in
+ * the serial number but letters, digits, '-' and '_' becomes '_' so
+ * that it can only name a file in the cache directory.
+ * @param device a pointer to the device to get the path for.
+ * @param dir the cache directory, NULL if that cache is disabled.
+ * @param suffix what follows the serial number in the file name.
+ * @return a newly allocated path, or NULL if the cache is disabled
+ *         or the device has no serial number.
  */
-char *LIBMTP_Get_Modelname(LIBMTP_mtpdevice_t *device)
+static char *device_cache_path(LIBMTP_mtpdevice_t *device,
+			       char const * const dir,
+			       char const * const suffix)
 {
-  char *retmodel = NULL;
   PTPParams *params = (PTPParams *) device->params;
+  char const *serial = params->deviceinfo.SerialNumber;
+  char *path;
+  size_t dirlen;
+  size_t n;
 
-  if (params->deviceinfo.Model != NULL) {
-    retmodel = strdup(params->deviceinfo.Model);
+  if (dir == NULL || serial == NULL || serial[0] == '\0')
+    return NULL;
+  dirlen = strlen(dir);
+  path = (char *) malloc(dirlen + strlen(serial) + strlen(suffix) + 2);
+  if (path == NULL)
+    return NULL;
+  memcpy(path, dir, dirlen);
+  n = dirlen;
+  path[n++] = '/';
+  for (; *serial != '\0'; serial++) {
+    char c = *serial;
+
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	(c >= '0' && c <= '9') || c == '-' || c == '_')
+      path[n++] = c;
+    else
+      path[n++] = '_';
   }
-  return retmodel;
+  strcpy(path + n, suffix);
+  return path;
 }
 
 /**
- * This retrieves the serial number of an MTP device.
- * @param device a pointer to the device to get the serial number for.
- * @return a newly allocated UTF-8 string representing the serial number.
- *         The string must be freed by the caller after use. If the call
- *         was unsuccessful this will contain NULL.
+ * This returns the path of the object cache snapshot of a device.
+ * @param device a pointer to the device to get the snapshot path for.
+ * @return a newly allocated path, or NULL if snapshots are disabled
+ *         or the device has no serial number.
  */
-char *LIBMTP_Get_Serialnumber(LIBMTP_mtpdevice_t *device)
+static char *metadata_cache_path(LIBMTP_mtpdevice_t *device)
 {
-  char *retnumber = NULL;
-  PTPParams *params = (PTPParams *) device->params;
-
-  if (params->deviceinfo.SerialNumber != NULL) {
-    retnumber = strdup(params->deviceinfo.SerialNumber);
-  }
-  return retnumber;
+  return device_cache_path(device, g_metadata_cache_dir, ".cache");
 }
 
 /**
- * This retrieves the device version (hardware and firmware version) of an
- * MTP device.
- * @param device a pointer to the device to get the device version for.
- * @return a newly allocated UTF-8 string representing the device version.
- *         The string must be freed by the caller after use. If the call
- *         was unsuccessful this will contain NULL.
+ * This writes a snapshot of the object cache of a device to the
+ * directory set with LIBMTP_Set_Metadata_Cache_Directory(), so that
+ * the next LIBMTP_Open_Raw_Device() of the same device can start from
+ * it instead of enumerating all objects. LIBMTP_Release_Device() does
+ * this as well when a directory is set. The free space of the storages
+ * is read from the device again, so it must still be connected.
+ *
+ * Before a snapshot is used, the storages, the number of objects, the
+ * root folders and a sample of the objects are compared with the
+ * device, and the device is enumerated as usual if any of them
+ * differ. This is a best effort rather than a guarantee: a change by
+ * another host that leaves all of these as they were, such as a file
+ * deep in the tree replaced by one of the same name, size and date,
+ * is not noticed. Applications that cannot live with that should not
+ * use snapshots for devices that are shared with other hosts.
+ * @param device a pointer to the device to save the object cache of.
+ * @return 0 on success, any other value means failure.
  */
-char *LIBMTP_Get_Deviceversion(LIBMTP_mtpdevice_t *device)
+int LIBMTP_Save_Metadata_Cache(LIBMTP_mtpdevice_t *device)
 {
-  char *retversion = NULL;
   PTPParams *params = (PTPParams *) device->params;
+  metadata_cache_header_t header;
+  metadata_cache_storage_t *storages = NULL;
+  metadata_cache_object_t *objects = NULL;
+  LIBMTP_devicestorage_t *storage;
+  char *path;
+  char *tmppath = NULL;
+  FILE *f = NULL;
+  uint32_t stringsize = 1;
+  unsigned int nrofstorages = 0;
+  unsigned int i, j;
+  int ret = -1;
+
+  path = metadata_cache_path(device);
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Save_Metadata_Cache(): no cache directory "
+			    "set or device has no serial number.");
+    return -1;
+  }
+  if (!device->cached || device->storage == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Save_Metadata_Cache(): "
+			    "device has no object cache.");
+    free(path);
+    return -1;
+  }
 
-  if (params->deviceinfo.DeviceVersion != NULL) {
-    retversion = strdup(params->deviceinfo.DeviceVersion);
+  // The snapshot is checked against the current free space when loaded
+  for (storage = device->storage; storage != NULL; storage = storage->next) {
+    if (ptp_operation_issupported(params,PTP_OC_GetStorageInfo) &&
+	refresh_storage_info(device, storage) != 0) {
+      free(path);
+      return -1;
+    }
+    nrofstorages++;
+  }
+
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  // Take in what the device reported since the cache was filled
+  update_cache(device);
+  storages = (metadata_cache_storage_t *)
+    calloc(nrofstorages, sizeof(metadata_cache_storage_t));
+  objects = (metadata_cache_object_t *)
+    calloc(params->nrofobjects ? params->nrofobjects : 1,
+	   sizeof(metadata_cache_object_t));
+  if (storages == NULL || objects == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Save_Metadata_Cache(): out of memory.");
+    goto out;
+  }
+  for (storage = device->storage, i = 0; storage != NULL;
+       storage = storage->next, i++) {
+    storages[i].MaxCapacity = storage->MaxCapacity;
+    storages[i].FreeSpaceInBytes = storage->FreeSpaceInBytes;
+    storages[i].FreeSpaceInObjects = storage->FreeSpaceInObjects;
+    storages[i].id = storage->id;
   }
-  return retversion;
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = params->objects[i];
+    metadata_cache_object_t *rec = &objects[i];
+
+    if (!(ob->flags & PTPOBJECT_OBJECTINFO_LOADED)) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			      "LIBMTP_Save_Metadata_Cache(): "
+			      "object cache is not complete.");
+      goto out;
+    }
+    rec->ObjectCompressedSize = ob->oi.ObjectCompressedSize;
+    rec->CaptureDate = (int64_t) ob->oi.CaptureDate;
+    rec->ModificationDate = (int64_t) ob->oi.ModificationDate;
+    rec->oid = ob->oid;
+    rec->StorageID = ob->oi.StorageID;
+    rec->ParentObject = ob->oi.ParentObject;
+    rec->AssociationDesc = ob->oi.AssociationDesc;
+    rec->ObjectFormat = ob->oi.ObjectFormat;
+    rec->ProtectionStatus = ob->oi.ProtectionStatus;
+    rec->AssociationType = ob->oi.AssociationType;
+    rec->flags = ob->flags & METADATA_CACHE_OBJECTFLAGS;
+    if (ob->oi.Filename != NULL) {
+      rec->Filename = stringsize;
+      stringsize += strlen(ob->oi.Filename) + 1;
+    }
+    if (ob->oi.Keywords != NULL) {
+      rec->Keywords = stringsize;
+      stringsize += strlen(ob->oi.Keywords) + 1;
+    }
+    if (ob->oi.ParentObject == 0x00000000U) {
+      for (j = 0; j < nrofstorages; j++) {
+	if (storages[j].id == ob->oi.StorageID) {
+	  storages[j].nrofrootobjects++;
+	  break;
+	}
+      }
+    }
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, METADATA_CACHE_MAGIC, sizeof(header.magic));
+  header.byteorder = METADATA_CACHE_BYTEORDER;
+  header.version = METADATA_CACHE_VERSION;
+  header.nrofstorages = nrofstorages;
+  header.nrofobjects = params->nrofobjects;
+  header.stringsize = stringsize;
+
+  // Write next to the old snapshot and replace it when complete
+  tmppath = (char *) malloc(strlen(path) + sizeof(".tmp"));
+  if (tmppath == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Save_Metadata_Cache(): out of memory.");
+    goto out;
+  }
+  strcpy(tmppath, path);
+  strcat(tmppath, ".tmp");
+  f = fopen(tmppath, "wb");
+  if (f == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Save_Metadata_Cache(): "
+			    "could not create snapshot file.");
+    goto out;
+  }
+  if (fwrite(&header, sizeof(header), 1, f) != 1 ||
+      fwrite(storages, sizeof(metadata_cache_storage_t), nrofstorages, f)
+        != nrofstorages ||
+      fwrite(objects, sizeof(metadata_cache_object_t), params->nrofobjects, f)
+        != params->nrofobjects ||
+      fputc('\0', f) == EOF)
+    goto writeerror;
+  for (i = 0; i < params->nrofobjects; i++) {
+    PTPObject *ob = params->objects[i];
+
+    if (ob->oi.Filename != NULL &&
+	fwrite(ob->oi.Filename, strlen(ob->oi.Filename) + 1, 1, f) != 1)
+      goto writeerror;
+    if (ob->oi.Keywords != NULL &&
+	fwrite(ob->oi.Keywords, strlen(ob->oi.Keywords) + 1, 1, f) != 1)
+      goto writeerror;
+  }
+  if (fclose(f) != 0) {
+    f = NULL;
+    goto writeerror;
+  }
+  f = NULL;
+#ifdef __WIN32__
+  // rename() does not replace an existing file here
+  remove(path);
+#endif
+  if (rename(tmppath, path) != 0)
+    goto writeerror;
+  ret = 0;
+  goto out;
+
+ writeerror:
+  add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			  "LIBMTP_Save_Metadata_Cache(): "
+			  "could not write snapshot file.");
+  if (f != NULL)
+    fclose(f);
+  remove(tmppath);
+ out:
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  free(storages);
+  free(objects);
+  free(tmppath);
+  free(path);
+  return ret;
 }
 
+static int compare_object_handles(const void *a, const void *b)
+{
+  uint32_t const ha = *(uint32_t const *) a;
+  uint32_t const hb = *(uint32_t const *) b;
+
+  return ha < hb ? -1 : ha > hb;
+}
 
 /**
- * This retrieves the "friendly name" of an MTP device. Usually
- * this is simply the name of the owner or something like
- * "John Doe's Digital Audio Player". This property should be supported
- * by all MTP devices.
- * @param device a pointer to the device to get the friendly name for.
- * @return a newly allocated UTF-8 string representing the friendly name.
- *         The string must be freed by the caller after use.
- * @see LIBMTP_Set_Friendlyname()
+ * This compares the storages of a snapshot, its number of objects,
+ * the root folder of every storage and a few of the objects with what
+ * the device reports. Together with the free space this catches most
+ * changes another host made to the device since the snapshot was
+ * written, at the cost of a handful of transactions and a list of
+ * handles instead of a full enumeration. It is a best effort: a
+ * change that keeps all of these, such as a file in a subfolder that
+ * was overwritten with one of the same size and date, goes unseen.
+ * It only reads the snapshot, so the object cache is not locked
+ * while the device is asked.
+ * @param device a pointer to the device the snapshot was loaded for.
+ * @param header the header of the snapshot.
+ * @param storages the storage records of the snapshot.
+ * @param objects the object records of the snapshot.
+ * @param strings the string table of the snapshot.
+ * @return 0 if the snapshot matches the device, -1 otherwise.
  */
-char *LIBMTP_Get_Friendlyname(LIBMTP_mtpdevice_t *device)
+static int check_metadata_cache(LIBMTP_mtpdevice_t *device,
+				metadata_cache_header_t const *header,
+				metadata_cache_storage_t const *storages,
+				metadata_cache_object_t const *objects,
+				char const *strings)
 {
-  PTPPropertyValue propval;
-  char *retstring = NULL;
   PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
+  PTPStorageIDs storageids;
+  uint64_t nrofobjects = 0;
+  unsigned int i, j;
 
-  if (!ptp_property_issupported(params, PTP_DPC_MTP_DeviceFriendlyName)) {
-    return NULL;
+  // The same storages, asked of the device again
+  if (ptp_getstorageids(params, &storageids) != PTP_RC_OK)
+    return -1;
+  for (i = 0; i < storageids.n; i++) {
+    for (j = 0; j < header->nrofstorages; j++)
+      if (storages[j].id == storageids.Storage[i])
+	break;
+    if (j == header->nrofstorages)
+      break;
   }
+  free(storageids.Storage);
+  if (i != storageids.n || storageids.n != header->nrofstorages)
+    return -1;
 
-  ret = ptp_getdevicepropvalue(params,
-			       PTP_DPC_MTP_DeviceFriendlyName,
-			       &propval,
-			       PTP_DTC_STR);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "Error getting friendlyname.");
-    return NULL;
-  }
-  if (propval.str != NULL) {
-    retstring = strdup(propval.str);
-    free(propval.str);
-  }
-  return retstring;
-}
+  for (i = 0; i < header->nrofstorages; i++) {
+    PTPObjectHandles handles;
+    unsigned int found = 0;
 
-/**
- * Sets the "friendly name" of an MTP device.
- * @param device a pointer to the device to set the friendly name for.
- * @param friendlyname the new friendly name for the device.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Get_Friendlyname()
- */
-int LIBMTP_Set_Friendlyname(LIBMTP_mtpdevice_t *device,
-			 char const * const friendlyname)
-{
-  PTPPropertyValue propval;
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
+    // The same number of objects
+    if (ptp_getobjecthandles(params, storages[i].id, PTP_GOH_ALL_FORMATS,
+			     PTP_GOH_ALL_ASSOCS, &handles) != PTP_RC_OK)
+      return -1;
+    nrofobjects += handles.n;
+    free(handles.Handler);
 
-  if (!ptp_property_issupported(params, PTP_DPC_MTP_DeviceFriendlyName)) {
-    return -1;
+    if (ptp_getobjecthandles(params, storages[i].id, PTP_GOH_ALL_FORMATS,
+			     PTP_GOH_ROOT_PARENT, &handles) != PTP_RC_OK)
+      return -1;
+    // Every root object of the snapshot has to be among them
+    if (handles.n == storages[i].nrofrootobjects) {
+      qsort(handles.Handler, handles.n, sizeof(uint32_t),
+	    compare_object_handles);
+      for (j = 0; j < header->nrofobjects; j++) {
+	if (objects[j].ParentObject != 0x00000000U ||
+	    objects[j].StorageID != storages[i].id)
+	  continue;
+	if (bsearch(&objects[j].oid, handles.Handler, handles.n,
+		    sizeof(uint32_t), compare_object_handles) == NULL)
+	  break;
+	found++;
+      }
+    }
+    free(handles.Handler);
+    if (found != storages[i].nrofrootobjects)
+      return -1;
   }
-  propval.str = (char *) friendlyname;
-  ret = ptp_setdevicepropvalue(params,
-			       PTP_DPC_MTP_DeviceFriendlyName,
-			       &propval,
-			       PTP_DTC_STR);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "Error setting friendlyname.");
+  if (nrofobjects != header->nrofobjects)
     return -1;
+
+  for (i = 0; i < METADATA_CACHE_SAMPLES && i < header->nrofobjects; i++) {
+    metadata_cache_object_t const *rec =
+      &objects[(uint64_t) i * header->nrofobjects / METADATA_CACHE_SAMPLES];
+    char const *filename;
+    PTPObjectInfo oi;
+    int match;
+
+    if (rec->Filename >= header->stringsize)
+      return -1;
+    filename = rec->Filename ? strings + rec->Filename : "<null>";
+    memset(&oi, 0, sizeof(oi));
+    if (ptp_getobjectinfo(params, rec->oid, &oi) != PTP_RC_OK) {
+      ptp_free_objectinfo(&oi);
+      return -1;
+    }
+    match = oi.ObjectFormat == rec->ObjectFormat &&
+      !strcmp(oi.Filename != NULL ? oi.Filename : "<null>", filename);
+    // The ObjectInfo size is 32 bits, larger objects report 0xffffffff
+    if (oi.ObjectCompressedSize != 0xffffffffU &&
+	oi.ObjectCompressedSize != rec->ObjectCompressedSize)
+      match = 0;
+    // Not every way of filling the cache has the dates
+    if (oi.ModificationDate != 0 && rec->ModificationDate != 0 &&
+	(int64_t) oi.ModificationDate != rec->ModificationDate)
+      match = 0;
+    ptp_free_objectinfo(&oi);
+    if (!match)
+      return -1;
   }
   return 0;
 }
 
 /**
- * This retrieves the synchronization partner of an MTP device. This
- * property should be supported by all MTP devices.
- * @param device a pointer to the device to get the sync partner for.
- * @return a newly allocated UTF-8 string representing the synchronization
- *         partner. The string must be freed by the caller after use.
- * @see LIBMTP_Set_Syncpartner()
+ * This fills the object cache of a freshly opened device from its
+ * snapshot, if there is one and the device still matches it.
+ * @param device a pointer to the device to fill the object cache of.
+ * @return 0 if the cache was filled, -1 if the device has to be
+ *         enumerated.
  */
-char *LIBMTP_Get_Syncpartner(LIBMTP_mtpdevice_t *device)
+static int load_metadata_cache(LIBMTP_mtpdevice_t *device)
 {
-  PTPPropertyValue propval;
-  char *retstring = NULL;
   PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
+  metadata_cache_header_t const *header;
+  metadata_cache_storage_t const *storages;
+  metadata_cache_object_t const *objects;
+  LIBMTP_devicestorage_t *storage;
+  char const *strings;
+  unsigned char *map = NULL;
+  struct stat sb;
+  char *path;
+  uint64_t size;
+  unsigned int nrofstorages = 0;
+  unsigned int i;
+  int fd;
+  int ret = -1;
 
-  if (!ptp_property_issupported(params, PTP_DPC_MTP_SynchronizationPartner)) {
-    return NULL;
+  path = metadata_cache_path(device);
+  if (path == NULL)
+    return -1;
+#ifdef __WIN32__
+  fd = open(path, O_RDONLY|O_BINARY);
+#else
+  fd = open(path, O_RDONLY);
+#endif
+  free(path);
+  if (fd == -1)
+    return -1;
+  if (fstat(fd, &sb) == -1 || sb.st_size < (off_t) sizeof(*header)) {
+    close(fd);
+    return -1;
   }
+  size = sb.st_size;
+#ifdef HAVE_SYS_MMAN_H
+  map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    map = NULL;
+#else
+  map = (unsigned char *) malloc(size);
+  if (map != NULL) {
+    uint64_t got = 0;
 
-  ret = ptp_getdevicepropvalue(params,
-			       PTP_DPC_MTP_SynchronizationPartner,
-			       &propval,
-			       PTP_DTC_STR);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "Error getting syncpartner.");
-    return NULL;
+    while (got < size) {
+      int n = read(fd, map + got, size - got > 0x10000 ? 0x10000 : size - got);
+
+      if (n <= 0)
+	break;
+      got += n;
+    }
+    if (got != size) {
+      free(map);
+      map = NULL;
+    }
   }
-  if (propval.str != NULL) {
-    retstring = strdup(propval.str);
-    free(propval.str);
+#endif
+  close(fd);
+  if (map == NULL)
+    return -1;
+
+  header = (metadata_cache_header_t const *) map;
+  if (memcmp(header->magic, METADATA_CACHE_MAGIC, sizeof(header->magic)) ||
+      header->byteorder != METADATA_CACHE_BYTEORDER ||
+      header->version != METADATA_CACHE_VERSION ||
+      header->stringsize == 0 ||
+      size != sizeof(*header) +
+        (uint64_t) header->nrofstorages * sizeof(metadata_cache_storage_t) +
+        (uint64_t) header->nrofobjects * sizeof(metadata_cache_object_t) +
+        header->stringsize)
+    goto out;
+  storages = (metadata_cache_storage_t const *) (header + 1);
+  objects = (metadata_cache_object_t const *) (storages + header->nrofstorages);
+  strings = (char const *) (objects + header->nrofobjects);
+  if (strings[header->stringsize - 1] != '\0')
+    goto out;
+
+  // The storages must be the same ones with the same free space
+  for (storage = device->storage; storage != NULL; storage = storage->next)
+    nrofstorages++;
+  if (nrofstorages != header->nrofstorages)
+    goto out;
+  for (i = 0; i < header->nrofstorages; i++) {
+    for (storage = device->storage; storage != NULL; storage = storage->next)
+      if (storage->id == storages[i].id)
+	break;
+    if (storage == NULL ||
+	storage->MaxCapacity != storages[i].MaxCapacity ||
+	storage->FreeSpaceInBytes != storages[i].FreeSpaceInBytes ||
+	storage->FreeSpaceInObjects != storages[i].FreeSpaceInObjects)
+      goto out;
   }
-  return retstring;
-}
 
+  // Ask the device before the cache is locked
+  if (check_metadata_cache(device, header, storages, objects, strings) != 0) {
+    LIBMTP_INFO("Object cache snapshot is out of date, "
+		"enumerating the device.\n");
+    goto out;
+  }
 
-/**
- * Sets the synchronization partner of an MTP device. Note that
- * we have no idea what the effect of setting this to "foobar"
- * may be. But the general idea seems to be to tell which program
- * shall synchronize with this device and tell others to leave
- * it alone.
- * @param device a pointer to the device to set the sync partner for.
- * @param syncpartner the new synchronization partner for the device.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Get_Syncpartner()
- */
-int LIBMTP_Set_Syncpartner(LIBMTP_mtpdevice_t *device,
-			 char const * const syncpartner)
-{
-  PTPPropertyValue propval;
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  ptp_free_objects(params);
+  for (i = 0; i < header->nrofobjects; i++) {
+    metadata_cache_object_t const *rec = &objects[i];
+    PTPObject *ob;
 
-  if (!ptp_property_issupported(params, PTP_DPC_MTP_SynchronizationPartner)) {
-    return -1;
-  }
-  propval.str = (char *) syncpartner;
-  ret = ptp_setdevicepropvalue(params,
-			       PTP_DPC_MTP_SynchronizationPartner,
-			       &propval,
-			       PTP_DTC_STR);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "Error setting syncpartner.");
-    return -1;
+    if (rec->Filename >= header->stringsize ||
+	rec->Keywords >= header->stringsize ||
+	ptp_object_find_or_insert(params, rec->oid, &ob) != PTP_RC_OK ||
+	ob->flags != 0)
+      break;
+    ob->oi.ObjectCompressedSize = rec->ObjectCompressedSize;
+    ob->oi.CaptureDate = (time_t) rec->CaptureDate;
+    ob->oi.ModificationDate = (time_t) rec->ModificationDate;
+    ob->oi.StorageID = rec->StorageID;
+    ob->oi.ParentObject = rec->ParentObject;
+    ob->oi.AssociationDesc = rec->AssociationDesc;
+    ob->oi.ObjectFormat = rec->ObjectFormat;
+    ob->oi.ProtectionStatus = rec->ProtectionStatus;
+    ob->oi.AssociationType = rec->AssociationType;
+    if (rec->Filename)
+      ob->oi.Filename = ptp_cache_strdup(params, strings + rec->Filename);
+    if (rec->Keywords)
+      ob->oi.Keywords = ptp_cache_strdup(params, strings + rec->Keywords);
+    // The ObjectInfo holds the parent and storage as well
+    ob->flags = (rec->flags & METADATA_CACHE_OBJECTFLAGS) |
+      PTPOBJECT_OBJECTINFO_LOADED | PTPOBJECT_PARENTOBJECT_LOADED |
+      PTPOBJECT_STORAGEID_LOADED;
+    ptp_object_name_changed(params, ob);
+  }
+  if (i == header->nrofobjects) {
+    locate_default_folders(device);
+    ret = 0;
+  } else {
+    ptp_free_objects(params);
   }
-  return 0;
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+
+ out:
+#ifdef HAVE_SYS_MMAN_H
+  munmap(map, size);
+#else
+  free(map);
+#endif
+  return ret;
 }
 
 /**
- * Checks if the device can stora a file of this size or
- * if it's too big.
- * @param device a pointer to the device.
- * @param filesize the size of the file to check whether it will fit.
- * @param storageid the ID of the storage to try to fit the file on.
- * @return 0 if the file fits, any other value means failure.
+ * This function traverses a devices storage list freeing up the
+ * strings and the structs.
+ * @param device a pointer to the MTP device to free the storage
+ * list for.
  */
-static int check_if_file_fits(LIBMTP_mtpdevice_t *device,
-			      LIBMTP_devicestorage_t *storage,
-			      uint64_t const filesize) {
-  PTPParams *params = (PTPParams *) device->params;
-  uint64_t freebytes;
-  int ret;
-
-  // If we cannot check the storage, no big deal.
-  if (!ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
-    return 0;
-  }
+static void free_storage_list(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_devicestorage_t *storage;
+  LIBMTP_devicestorage_t *tmp;
 
-  ret = get_storage_freespace(device, storage, &freebytes);
-  if (ret != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "check_if_file_fits(): error checking free storage.");
-    return -1;
-  } else {
-    // See if it fits.
-    if (filesize > freebytes) {
-      return -1;
+  storage = device->storage;
+  while(storage != NULL) {
+    if (storage->StorageDescription != NULL) {
+      free(storage->StorageDescription);
+    }
+    if (storage->VolumeIdentifier != NULL) {
+      free(storage->VolumeIdentifier);
     }
+    tmp = storage;
+    storage = storage->next;
+    free(tmp);
   }
-  return 0;
-}
+  device->storage = NULL;
 
+  return;
+}
 
 /**
- * This function retrieves the current battery level on the device.
- * @param device a pointer to the device to get the battery level for.
- * @param maximum_level a pointer to a variable that will hold the
- *        maximum level of the battery if the call was successful.
- * @param current_level a pointer to a variable that will hold the
- *        current level of the battery if the call was successful.
- *        A value of 0 means that the device is on external power.
- * @return 0 if the storage info was successfully retrieved, any other
- *        means failure. A typical cause of failure is that
- *        the device does not support the battery level property.
+ * This function traverses a devices storage list freeing up the
+ * strings and the structs.
+ * @param device a pointer to the MTP device to free the storage
+ * list for.
  */
-int LIBMTP_Get_Batterylevel(LIBMTP_mtpdevice_t *device,
-			    uint8_t * const maximum_level,
-			    uint8_t * const current_level)
+static int sort_storage_by(LIBMTP_mtpdevice_t *device,int const sortby)
 {
-  PTPPropertyValue propval;
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-
-  *maximum_level = 0;
-  *current_level = 0;
+  LIBMTP_devicestorage_t *oldhead, *ptr1, *ptr2, *newlist;
 
-  if (FLAG_BROKEN_BATTERY_LEVEL(ptp_usb) ||
-      !ptp_property_issupported(params, PTP_DPC_BatteryLevel)) {
+  if (device->storage == NULL)
     return -1;
-  }
+  if (sortby == LIBMTP_STORAGE_SORTBY_NOTSORTED)
+    return 0;
 
-  ret = ptp_getdevicepropvalue(params, PTP_DPC_BatteryLevel,
-			       &propval, PTP_DTC_UINT8);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret,
-				"LIBMTP_Get_Batterylevel(): "
-				"could not get device property value.");
-    return -1;
-  }
+  oldhead = ptr1 = ptr2 = device->storage;
 
-  *maximum_level = device->maximum_battery_level;
-  *current_level = propval.u8;
+  newlist = NULL;
 
-  return 0;
-}
+  while(oldhead != NULL) {
+    ptr1 = ptr2 = oldhead;
+    while(ptr1 != NULL) {
 
+      if (sortby == LIBMTP_STORAGE_SORTBY_FREESPACE && ptr1->FreeSpaceInBytes > ptr2->FreeSpaceInBytes)
+        ptr2 = ptr1;
+      if (sortby == LIBMTP_STORAGE_SORTBY_MAXSPACE && ptr1->FreeSpaceInBytes > ptr2->FreeSpaceInBytes)
+        ptr2 = ptr1;
 
-/**
- * Formats device storage (if the device supports the operation).
- * WARNING: This WILL delete all data from the device. Make sure you've
- * got confirmation from the user BEFORE you call this function.
- *
- * @param device a pointer to the device containing the storage to format.
- * @param storage the actual storage to format.
- * @return 0 on success, any other value means failure.
- */
-int LIBMTP_Format_Storage(LIBMTP_mtpdevice_t *device,
-			  LIBMTP_devicestorage_t *storage)
-{
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
+      ptr1 = ptr1->next;
+    }
 
-  if (!ptp_operation_issupported(params,PTP_OC_FormatStore)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Format_Storage(): "
-			    "device does not support formatting storage.");
-    return -1;
-  }
-  ret = ptp_formatstore(params, storage->id);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Format_Storage(): "
-				"failed to format storage.");
-    return -1;
+    // Make our previous entries next point to our next
+    if(ptr2->prev != NULL) {
+      ptr1 = ptr2->prev;
+      ptr1->next = ptr2->next;
+    } else {
+      oldhead = ptr2->next;
+      if(oldhead != NULL)
+        oldhead->prev = NULL;
+    }
+
+    // Make our next entries previous point to our previous
+    ptr1 = ptr2->next;
+    if(ptr1 != NULL) {
+      ptr1->prev = ptr2->prev;
+    } else {
+      ptr1 = ptr2->prev;
+      if(ptr1 != NULL)
+        ptr1->next = NULL;
+    }
+
+    if(newlist == NULL) {
+      newlist = ptr2;
+      newlist->prev = NULL;
+    } else {
+      ptr2->prev = newlist;
+      newlist->next = ptr2;
+      newlist = newlist->next;
+    }
+  }
+
+  if (newlist != NULL) {
+    newlist->next = NULL;
+    while(newlist->prev != NULL)
+      newlist = newlist->prev;
+    device->storage = newlist;
   }
+
   return 0;
 }
 
 /**
- * Helper function to extract a unicode property off a device.
- * This is the standard way of retrieveing unicode device
- * properties as described by the PTP spec.
- * @param device a pointer to the device to get the property from.
- * @param unicstring a pointer to a pointer that will hold the
- *        property after this call is completed.
- * @param property the property to retrieve.
- * @return 0 on success, any other value means failure.
+ * This function grabs the first writeable storageid from the
+ * device storage list.
+ * @param device a pointer to the MTP device to locate writeable
+ *        storage for.
+ * @param fitsize a file of this file must fit on the device.
  */
-static int get_device_unicode_property(LIBMTP_mtpdevice_t *device,
-				       char **unicstring, uint16_t property)
+static uint32_t get_writeable_storageid(LIBMTP_mtpdevice_t *device,
+					uint64_t fitsize)
 {
-  PTPPropertyValue propval;
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t *tmp;
-  uint16_t ret;
-  unsigned int i;
+  LIBMTP_devicestorage_t *storage;
+  uint32_t store = 0x00000000; //Should this be 0xffffffffu instead?
+  int subcall_ret;
 
-  if (!ptp_property_issupported(params, property)) {
-    return -1;
+  // See if there is some storage we can fit this file on.
+  storage = device->storage;
+  if (storage == NULL) {
+    // Sometimes the storage just cannot be detected.
+    store = 0x00000000U;
+  } else {
+    while(storage != NULL) {
+      // These storages cannot be used.
+      if (storage->StorageType == PTP_ST_FixedROM ||
+	  storage->StorageType == PTP_ST_RemovableROM) {
+	storage = storage->next;
+	continue;
+      }
+      // Storage IDs with the lower 16 bits 0x0000 are not supposed
+      // to be writeable.
+      if ((storage->id & 0x0000FFFFU) == 0x00000000U) {
+	storage = storage->next;
+	continue;
+      }
+      // Also check the access capability to avoid e.g. deletable only storages
+      if (storage->AccessCapability == PTP_AC_ReadOnly ||
+	  storage->AccessCapability == PTP_AC_ReadOnly_with_Object_Deletion) {
+	storage = storage->next;
+	continue;
+      }
+      // Then see if we can fit the file.
+      subcall_ret = check_if_file_fits(device, storage, fitsize);
+      if (subcall_ret != 0) {
+	storage = storage->next;
+      } else {
+	// We found a storage that is writable and can fit the file!
+	break;
+      }
+    }
+    if (storage == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_STORAGE_FULL,
+			      "get_writeable_storageid(): "
+			      "all device storage is full or corrupt.");
+      return -1;
+    }
+    store = storage->id;
   }
 
-  // Unicode strings are 16bit unsigned integer arrays.
-  ret = ptp_getdevicepropvalue(params,
-			       property,
-			       &propval,
-			       PTP_DTC_AUINT16);
-  if (ret != PTP_RC_OK) {
-    // TODO: add a note on WHICH property that we failed to get.
-    *unicstring = NULL;
-    add_ptp_error_to_errorstack(device, ret,
-				"get_device_unicode_property(): "
-				"failed to get unicode property.");
-    return -1;
-  }
+  return store;
+}
 
-  // Extract the actual array.
-  // printf("Array of %d elements\n", propval.a.count);
-  tmp = malloc((propval.a.count + 1)*sizeof(uint16_t));
-  for (i = 0; i < propval.a.count; i++) {
-    tmp[i] = propval.a.v[i].u16;
-    // printf("%04x ", tmp[i]);
+/**
+ * Tries to suggest a storage_id of a given ID when we have a parent
+ * @param device a pointer to the device where to search for the storage ID
+ * @param fitsize a file of this file must fit on the device.
+ * @param parent_id look for this ID
+ * @ret storageID
+ */
+static int get_suggested_storage_id(LIBMTP_mtpdevice_t *device,
+				    uint64_t fitsize,
+				    uint32_t parent_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+  uint16_t ret;
+
+  ret = ptp_object_want(params, parent_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
+  if ((ret != PTP_RC_OK) || (ob->oi.StorageID == 0)) {
+    add_ptp_error_to_errorstack(device, ret, "get_suggested_storage_id(): "
+				"could not get storage id from parent id.");
+    return get_writeable_storageid(device, fitsize);
+  } else {
+    /* OK we know the parent storage, then use that */
+    return ob->oi.StorageID;
   }
-  tmp[propval.a.count] = 0x0000U;
-  free(propval.a.v);
+}
 
-  *unicstring = utf16_to_utf8(device, tmp);
+/*
+ * Free space accounting. Asking for the StorageInfo before every send
+ * costs a round trip, so the free space of a storage is only asked for
+ * every FREESPACE_REFRESH seconds. In between it is the last answer
+ * adjusted by the objects sent and deleted through this device. A
+ * StoreFull or StorageInfoChanged event, or an operation we cannot
+ * account for, makes the next check ask the device again.
+ */
+#define FREESPACE_REFRESH 30
 
-  free(tmp);
+typedef struct {
+  uint32_t storage_id;
+  time_t checked; /**< When the device was last asked, 0 to ask again */
+} freespace_entry_t;
 
-  return 0;
-}
+typedef struct {
+  int fresh; /**< Always ask the device, the storage changes under us */
+  unsigned int nrofentries;
+  freespace_entry_t *entries;
+} freespace_t;
 
 /**
- * This function returns the secure time as an XML document string from
- * the device.
- * @param device a pointer to the device to get the secure time for.
- * @param sectime the secure time string as an XML document or NULL if the call
- *         failed or the secure time property is not supported. This string
- *         must be <code>free()</code>:ed by the caller after use.
- * @return 0 on success, any other value means failure.
+ * Internal function to set up the free space accounting of a device.
+ * @param fresh nonzero for devices that must be asked for the free
+ *        space every time.
+ * @return the accounting, NULL if out of memory in which case the
+ *         device is always asked.
  */
-int LIBMTP_Get_Secure_Time(LIBMTP_mtpdevice_t *device, char ** const sectime)
+static void *new_freespace(int const fresh)
 {
-  return get_device_unicode_property(device, sectime, PTP_DPC_MTP_SecureTime);
+  freespace_t *fs = (freespace_t *) calloc(1, sizeof(freespace_t));
+
+  if (fs != NULL)
+    fs->fresh = fresh;
+  return fs;
 }
 
-/**
- * This function returns the device (public key) certificate as an
- * XML document string from the device.
- * @param device a pointer to the device to get the device certificate for.
- * @param devcert the device certificate as an XML string or NULL if the call
- *        failed or the device certificate property is not supported. This
- *        string must be <code>free()</code>:ed by the caller after use.
- * @return 0 on success, any other value means failure.
- */
-int LIBMTP_Get_Device_Certificate(LIBMTP_mtpdevice_t *device, char ** const devcert)
+static void free_freespace(LIBMTP_mtpdevice_t *device)
 {
-  return get_device_unicode_property(device, devcert,
-				     PTP_DPC_MTP_DeviceCertificate);
+  freespace_t *fs = (freespace_t *) DEVICE_PRIVATE(device)->freespace;
+
+  if (fs == NULL)
+    return;
+  free(fs->entries);
+  free(fs);
+  DEVICE_PRIVATE(device)->freespace = NULL;
+}
+
+static freespace_entry_t *find_freespace(LIBMTP_mtpdevice_t *device,
+					 uint32_t const storage_id)
+{
+  freespace_t *fs = (freespace_t *) DEVICE_PRIVATE(device)->freespace;
+  unsigned int i;
+
+  if (fs == NULL)
+    return NULL;
+  for (i = 0; i < fs->nrofentries; i++)
+    if (fs->entries[i].storage_id == storage_id)
+      return &fs->entries[i];
+  return NULL;
 }
 
 /**
- * This function retrieves a list of supported file types, i.e. the file
- * types that this device claims it supports, e.g. audio file types that
- * the device can play etc. This list is mitigated to
- * include the file types that libmtp can handle, i.e. it will not list
- * filetypes that libmtp will handle internally like playlists and folders.
- * @param device a pointer to the device to get the filetype capabilities for.
- * @param filetypes a pointer to a pointer that will hold the list of
- *        supported filetypes if the call was successful. This list must
- *        be <code>free()</code>:ed by the caller after use.
- * @param length a pointer to a variable that will hold the length of the
- *        list of supported filetypes if the call was successful.
- * @return 0 on success, any other value means failure.
- * @see LIBMTP_Get_Filetype_Description()
+ * Internal function to record that the free space of a storage was
+ * just read from the device.
+ * @param device a pointer to the device.
+ * @param storage_id the storage that was asked for.
  */
-int LIBMTP_Get_Supported_Filetypes(LIBMTP_mtpdevice_t *device, uint16_t ** const filetypes,
-				  uint16_t * const length)
+static void freespace_checked(LIBMTP_mtpdevice_t *device,
+			      uint32_t const storage_id)
 {
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint16_t *localtypes;
-  uint16_t localtypelen;
-  uint32_t i;
-
-  // This is more memory than needed if there are unknown types, but what the heck.
-  localtypes = (uint16_t *) malloc(params->deviceinfo.ImageFormats_len * sizeof(uint16_t));
-  localtypelen = 0;
+  freespace_t *fs = (freespace_t *) DEVICE_PRIVATE(device)->freespace;
+  freespace_entry_t *entry = find_freespace(device, storage_id);
 
-  for (i=0;i<params->deviceinfo.ImageFormats_len;i++) {
-    uint16_t localtype = map_ptp_type_to_libmtp_type(params->deviceinfo.ImageFormats[i]);
-    if (localtype != LIBMTP_FILETYPE_UNKNOWN) {
-      localtypes[localtypelen] = localtype;
-      localtypelen++;
-    }
-  }
-  // The forgotten Ogg support on YP-10 and others...
-  if (FLAG_OGG_IS_UNKNOWN(ptp_usb)) {
-    uint16_t *tmp = (uint16_t *) realloc(
-        localtypes, (params->deviceinfo.ImageFormats_len+1) * sizeof(uint16_t));
-    if (tmp == NULL)
-      return -ENOMEM;
-    localtypes = tmp;
-    localtypes[localtypelen] = LIBMTP_FILETYPE_OGG;
-    localtypelen++;
-  }
-  // The forgotten FLAC support on Cowon iAudio S9 and others...
-  if (FLAG_FLAC_IS_UNKNOWN(ptp_usb)) {
-    uint16_t *tmp = (uint16_t *) realloc(
-        localtypes, (params->deviceinfo.ImageFormats_len+1) * sizeof(uint16_t));
-    if (tmp == NULL)
-      return -ENOMEM;
-    localtypes = tmp;
-    localtypes[localtypelen] = LIBMTP_FILETYPE_FLAC;
-    localtypelen++;
+  if (fs == NULL)
+    return;
+  if (entry == NULL) {
+    entry = (freespace_entry_t *)
+      realloc(fs->entries, (fs->nrofentries + 1) * sizeof(freespace_entry_t));
+    if (entry == NULL)
+      return;
+    fs->entries = entry;
+    entry = &fs->entries[fs->nrofentries++];
+    entry->storage_id = storage_id;
   }
+  entry->checked = time(NULL);
+}
 
-  *filetypes = localtypes;
-  *length = localtypelen;
+/**
+ * Internal function to make the next free space check of a storage
+ * ask the device.
+ * @param device a pointer to the device.
+ * @param storage_id the storage, 0xffffffff for all of them.
+ */
+static void invalidate_freespace(LIBMTP_mtpdevice_t *device,
+				 uint32_t const storage_id)
+{
+  freespace_t *fs = (freespace_t *) DEVICE_PRIVATE(device)->freespace;
+  unsigned int i;
 
-  return 0;
+  if (fs == NULL)
+    return;
+  for (i = 0; i < fs->nrofentries; i++)
+    if (storage_id == 0xffffffffU || fs->entries[i].storage_id == storage_id)
+      fs->entries[i].checked = 0;
 }
 
 /**
- * This function checks if the device has some specific capabilities, in
- * order to avoid calling APIs that may disturb the device.
- *
- * @param device a pointer to the device to check the capability on.
- * @param cap the capability to check.
- * @return 0 if not supported, any other value means the device has the
- * requested capability.
+ * Internal function to account for objects written to or removed from
+ * a storage.
+ * @param device a pointer to the device.
+ * @param storage_id the storage holding the objects.
+ * @param bytes the bytes taken, negative for bytes released.
+ * @param objects the objects added, negative for objects removed.
  */
-int LIBMTP_Check_Capability(LIBMTP_mtpdevice_t *device, LIBMTP_devicecap_t cap)
+static void account_freespace(LIBMTP_mtpdevice_t *device,
+			      uint32_t const storage_id,
+			      int64_t const bytes, int const objects)
 {
-  switch (cap) {
-  case LIBMTP_DEVICECAP_GetPartialObject:
-    return (ptp_operation_issupported(device->params,
-				      PTP_OC_GetPartialObject) ||
-	    ptp_operation_issupported(device->params,
-				      PTP_OC_ANDROID_GetPartialObject64));
-  case LIBMTP_DEVICECAP_SendPartialObject:
-    return ptp_operation_issupported(device->params,
-				     PTP_OC_ANDROID_SendPartialObject);
-  case LIBMTP_DEVICECAP_EditObjects:
-    return (ptp_operation_issupported(device->params,
-				      PTP_OC_ANDROID_TruncateObject) &&
-	    ptp_operation_issupported(device->params,
-				      PTP_OC_ANDROID_BeginEditObject) &&
-	    ptp_operation_issupported(device->params,
-				      PTP_OC_ANDROID_EndEditObject));
-  case LIBMTP_DEVICECAP_MoveObject:
-    return ptp_operation_issupported(device->params,
-				     PTP_OC_MoveObject);
-  case LIBMTP_DEVICECAP_CopyObject:
-    return ptp_operation_issupported(device->params,
-				     PTP_OC_CopyObject);
-  /*
-   * Handle other capabilities here, this is also a good place to
-   * blacklist some advanced operations on specific devices if need
-   * be.
-   */
+  LIBMTP_devicestorage_t *storage;
 
-  default:
-    break;
+  for (storage = device->storage; storage != NULL; storage = storage->next)
+    if (storage->id == storage_id)
+      break;
+  if (storage == NULL) {
+    invalidate_freespace(device, 0xffffffffU);
+    return;
+  }
+  // (uint64_t) -1 means the device does not know
+  if (storage->FreeSpaceInBytes != (uint64_t) -1) {
+    if (bytes > 0 && (uint64_t) bytes > storage->FreeSpaceInBytes)
+      storage->FreeSpaceInBytes = 0;
+    else
+      storage->FreeSpaceInBytes -= bytes;
+  }
+  if (storage->FreeSpaceInObjects != (uint64_t) -1) {
+    if (objects > 0 && (uint64_t) objects > storage->FreeSpaceInObjects)
+      storage->FreeSpaceInObjects = 0;
+    else
+      storage->FreeSpaceInObjects -= objects;
   }
-  return 0;
 }
 
 /**
- * This function updates all the storage id's of a device and their
- * properties, then creates a linked list and puts the list head into
- * the device struct. It also optionally sorts this list. If you want
- * to display storage information in your application you should call
- * this function, then dereference the device struct
- * (<code>device-&gt;storage</code>) to get out information on the storage.
- *
- * You need to call this every time you want to update the
- * <code>device-&gt;storage</code> list, for example anytime you need
- * to check available storage somewhere.
- *
- * <b>WARNING:</b> since this list is dynamically updated, do not
- * reference its fields in external applications by pointer! E.g
- * do not put a reference to any <code>char *</code> field. instead
- * <code>strncpy()</code> it!
- *
- * @param device a pointer to the device to get the storage for.
- * @param sortby an integer that determines the sorting of the storage list.
- *        Valid sort methods are defined in libmtp.h with beginning with
- *        LIBMTP_STORAGE_SORTBY_. 0 or LIBMTP_STORAGE_SORTBY_NOTSORTED to not
- *        sort.
- * @return 0 on success, 1 success but only with storage id's, storage
- *        properities could not be retrieved and -1 means failure.
+ * Internal function to get the storage and size of a file from the
+ * object cache without asking the device.
+ * @param params the PTP parameters of the device.
+ * @param id the object.
+ * @param storage_id the storage of the object is returned here.
+ * @param size the size of the object is returned here.
+ * @return 0 if found, -1 if the object is not cached or is a folder.
  */
-int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
+static int cached_object_size(PTPParams *params, uint32_t const id,
+			      uint32_t *storage_id, uint64_t *size)
 {
-  uint32_t i = 0;
-  PTPStorageInfo storageInfo;
-  PTPParams *params = (PTPParams *) device->params;
-  PTPStorageIDs storageIDs;
-  LIBMTP_devicestorage_t *storage = NULL;
-  LIBMTP_devicestorage_t *storageprev = NULL;
-
-  if (device->storage != NULL)
-    free_storage_list(device);
-
-  // if (!ptp_operation_issupported(params,PTP_OC_GetStorageIDs))
-  //   return -1;
-  if (ptp_getstorageids (params, &storageIDs) != PTP_RC_OK)
-    return -1;
-  if (storageIDs.n < 1)
-    return -1;
-
-  if (!ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
-    for (i = 0; i < storageIDs.n; i++) {
-
-      storage = (LIBMTP_devicestorage_t *)
-	malloc(sizeof(LIBMTP_devicestorage_t));
-      storage->prev = storageprev;
-      if (storageprev != NULL)
-        storageprev->next = storage;
-      if (device->storage == NULL)
-        device->storage = storage;
-
-      storage->id = storageIDs.Storage[i];
-      storage->StorageType = PTP_ST_Undefined;
-      storage->FilesystemType = PTP_FST_Undefined;
-      storage->AccessCapability = PTP_AC_ReadWrite;
-      storage->MaxCapacity = (uint64_t) -1;
-      storage->FreeSpaceInBytes = (uint64_t) -1;
-      storage->FreeSpaceInObjects = (uint64_t) -1;
-      storage->StorageDescription = strdup("Unknown storage");
-      storage->VolumeIdentifier = strdup("Unknown volume");
-      storage->next = NULL;
-
-      storageprev = storage;
-    }
-    free(storageIDs.Storage);
-    return 1;
-  } else {
-    for (i = 0; i < storageIDs.n; i++) {
-      uint16_t ret;
-      ret = ptp_getstorageinfo(params, storageIDs.Storage[i], &storageInfo);
-      if (ret != PTP_RC_OK) {
-	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Storage(): "
-				    "Could not get storage info.");
-	if (device->storage != NULL) {
-          free_storage_list(device);
-	}
-	return -1;
-      }
-
-      storage = (LIBMTP_devicestorage_t *)
-	malloc(sizeof(LIBMTP_devicestorage_t));
-      storage->prev = storageprev;
-      if (storageprev != NULL)
-        storageprev->next = storage;
-      if (device->storage == NULL)
-        device->storage = storage;
-
-      storage->id = storageIDs.Storage[i];
-      storage->StorageType = storageInfo.StorageType;
-      storage->FilesystemType = storageInfo.FilesystemType;
-      storage->AccessCapability = storageInfo.AccessCapability;
-      storage->MaxCapacity = storageInfo.MaxCapability;
-      storage->FreeSpaceInBytes = storageInfo.FreeSpaceInBytes;
-      storage->FreeSpaceInObjects = storageInfo.FreeSpaceInImages;
-      storage->StorageDescription = storageInfo.StorageDescription;
-      storage->VolumeIdentifier = storageInfo.VolumeLabel;
-      storage->next = NULL;
-
-      storageprev = storage;
-    }
-
-    if (storage != NULL)
-      storage->next = NULL;
+  PTPObject *ob;
+  int ret = -1;
 
-    sort_storage_by(device,sortby);
-    free(storageIDs.Storage);
-    return 0;
+  ptp_lock(params, PTP_LOCK_OBJECTS_READ);
+  if (ptp_object_find(params, id, &ob) == PTP_RC_OK &&
+      (ob->flags & PTPOBJECT_OBJECTINFO_LOADED) &&
+      ob->oi.ObjectFormat != PTP_OFC_Association) {
+    *storage_id = ob->oi.StorageID;
+    *size = ob->oi.ObjectCompressedSize;
+    ret = 0;
   }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  return ret;
 }
 
 /**
- * This creates a new file metadata structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_destroy_file_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings, e.g.:
- *
- * <pre>
- * LIBMTP_file_t *file = LIBMTP_new_file_t();
- * file->filename = strdup(namestr);
- * ....
- * LIBMTP_destroy_file_t(file);
- * </pre>
- *
- * @return a pointer to the newly allocated metadata structure.
- * @see LIBMTP_destroy_file_t()
+ * This function reads the storage info of a certain storage in the
+ * device storage list from the device.
+ * @param device a pointer to the MTP device.
+ * @param storage the storage to update.
+ * @return 0 on success, any other value means failure.
  */
-LIBMTP_file_t *LIBMTP_new_file_t(void)
+static int refresh_storage_info(LIBMTP_mtpdevice_t *device,
+				LIBMTP_devicestorage_t *storage)
 {
-  LIBMTP_file_t *new = (LIBMTP_file_t *) malloc(sizeof(LIBMTP_file_t));
-  if (new == NULL) {
-    return NULL;
+  PTPParams *params = (PTPParams *) device->params;
+  PTPStorageInfo storageInfo;
+  uint16_t ret;
+
+  ret = ptp_getstorageinfo(params, storage->id, &storageInfo);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret,
+		"refresh_storage_info(): could not get storage info.");
+    return -1;
   }
-  new->filename = NULL;
-  new->item_id = 0;
-  new->parent_id = 0;
-  new->storage_id = 0;
-  new->filesize = 0;
-  new->modificationdate = 0;
-  new->filetype = LIBMTP_FILETYPE_UNKNOWN;
-  new->next = NULL;
-  return new;
+  if (storage->StorageDescription != NULL) {
+    free(storage->StorageDescription);
+  }
+  if (storage->VolumeIdentifier != NULL) {
+    free(storage->VolumeIdentifier);
+  }
+  storage->StorageType = storageInfo.StorageType;
+  storage->FilesystemType = storageInfo.FilesystemType;
+  storage->AccessCapability = storageInfo.AccessCapability;
+  storage->MaxCapacity = storageInfo.MaxCapability;
+  storage->FreeSpaceInBytes = storageInfo.FreeSpaceInBytes;
+  storage->FreeSpaceInObjects = storageInfo.FreeSpaceInImages;
+  storage->StorageDescription = storageInfo.StorageDescription;
+  storage->VolumeIdentifier = storageInfo.VolumeLabel;
+  freespace_checked(device, storage->id);
+  return 0;
 }
 
 /**
- * This destroys a file metadata structure and deallocates the memory
- * used by it, including any strings. Never use a file metadata
- * structure again after calling this function on it.
- * @param file the file metadata to destroy.
- * @see LIBMTP_new_file_t()
+ * This function grabs the freespace from a certain storage in
+ * device storage list.
+ * @param device a pointer to the MTP device to free the storage
+ * list for.
+ * @param storageid the storage ID for the storage to flush and
+ * get free space for.
+ * @param freespace the free space on this storage will be returned
+ * in this variable.
  */
-void LIBMTP_destroy_file_t(LIBMTP_file_t *file)
+static int get_storage_freespace(LIBMTP_mtpdevice_t *device,
+				 LIBMTP_devicestorage_t *storage,
+				 uint64_t *freespace)
 {
-  if (file == NULL) {
-    return;
+  PTPParams *params = (PTPParams *) device->params;
+
+  // Ask the device unless the accounted free space is recent enough,
+  // some models explicitly need to be asked every time.
+  if (ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
+    freespace_t *fs = (freespace_t *) DEVICE_PRIVATE(device)->freespace;
+    freespace_entry_t *entry = find_freespace(device, storage->id);
+    time_t now = time(NULL);
+
+    if (fs == NULL || fs->fresh || entry == NULL || entry->checked == 0 ||
+	now < entry->checked || now - entry->checked >= FREESPACE_REFRESH) {
+      if (refresh_storage_info(device, storage) != 0)
+	return -1;
+    }
   }
-  if (file->filename != NULL)
-    free(file->filename);
-  free(file);
-  return;
+  if(storage->FreeSpaceInBytes == (uint64_t) -1)
+    return -1;
+  *freespace = storage->FreeSpaceInBytes;
+  return 0;
 }
 
 /**
- * Helper function that takes one PTP object and creates a
- * LIBMTP_file_t metadata entry.
+ * This function dumps out a large chunk of textual information
+ * provided from the PTP protocol and additionally some extra
+ * MTP-specific information where applicable.
+ * @param device a pointer to the MTP device to report info from.
  */
-static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob)
+void LIBMTP_Dump_Device_Info(LIBMTP_mtpdevice_t *device)
 {
+  unsigned int i;
   PTPParams *params = (PTPParams *) device->params;
   PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_file_t *file;
-  unsigned int i;
-
-  // Allocate a new file type
-  file = LIBMTP_new_file_t();
-
-  file->parent_id = ob->oi.ParentObject;
-  file->storage_id = ob->oi.StorageID;
+  LIBMTP_devicestorage_t *storage = device->storage;
+  LIBMTP_device_extension_t *tmpext = device->extensions;
 
-  if (ob->oi.Filename != NULL) {
-    file->filename = strdup(ob->oi.Filename);
+  if (ptp_usb->simulation != NULL) {
+    printf("Simulated device\n");
+  } else if (ptp_usb->ptpip) {
+    printf("PTP/IP device: %s\n", params->cameraname ? params->cameraname : "");
+  } else {
+    printf("USB low-level info:\n");
+    dump_usbinfo(ptp_usb);
   }
-
-  // Set the filetype
-  file->filetype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
-
-  /*
-   * A special quirk for devices that doesn't quite
-   * remember that some files marked as "unknown" type are
-   * actually OGG or FLAC files. We look at the filename extension
-   * and see if it happens that this was atleast named "ogg" or "flac"
-   * and fall back on this heuristic approach in that case,
-   * for these bugged devices only.
-   */
-  if (file->filetype == LIBMTP_FILETYPE_UNKNOWN) {
-    if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
-        FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
-        has_ogg_extension(file->filename)) {
-      file->filetype = LIBMTP_FILETYPE_OGG;
+  /* Print out some verbose information */
+  printf("Device info:\n");
+  printf("   Manufacturer: %s\n", params->deviceinfo.Manufacturer);
+  printf("   Model: %s\n", params->deviceinfo.Model);
+  printf("   Device version: %s\n", params->deviceinfo.DeviceVersion);
+  printf("   Serial number: %s\n", params->deviceinfo.SerialNumber);
+  printf("   Vendor extension ID: 0x%08x\n",
+	 params->deviceinfo.VendorExtensionID);
+  printf("   Vendor extension description: %s\n",
+	 params->deviceinfo.VendorExtensionDesc);
+  printf("   Detected object size: %d bits\n",
+	 device->object_bitsize);
+  printf("   Extensions:\n");
+  while (tmpext != NULL) {
+    printf("        %s: %d.%d\n",
+           tmpext->name,
+           tmpext->major,
+           tmpext->minor);
+    tmpext = tmpext->next;
+  }
+  printf("Supported operations:\n");
+  for (i=0;i<params->deviceinfo.OperationsSupported_len;i++)
+    printf("   %04x: %s\n", params->deviceinfo.OperationsSupported[i], ptp_get_opcode_name(params, params->deviceinfo.OperationsSupported[i]));
+  printf("Events supported:\n");
+  if (params->deviceinfo.EventsSupported_len == 0) {
+    printf("   None.\n");
+  } else {
+    for (i=0;i<params->deviceinfo.EventsSupported_len;i++) {
+      printf("   0x%04x: %s\n", params->deviceinfo.EventsSupported[i], ptp_get_event_code_name(params, params->deviceinfo.EventsSupported[i]));
     }
+  }
+  printf("Device Properties Supported:\n");
+  for (i=0;i<params->deviceinfo.DevicePropertiesSupported_len;i++) {
+    char const *propdesc = ptp_get_property_description(params,
+			params->deviceinfo.DevicePropertiesSupported[i]);
 
-    if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && has_flac_extension(file->filename)) {
-        file->filetype = LIBMTP_FILETYPE_FLAC;
+    if (propdesc != NULL) {
+      printf("   0x%04x: %s\n",
+	     params->deviceinfo.DevicePropertiesSupported[i], propdesc);
+    } else {
+      uint16_t prop = params->deviceinfo.DevicePropertiesSupported[i];
+      printf("   0x%04x: Unknown property\n", prop);
     }
   }
 
-  // Set the modification date
-  file->modificationdate = ob->oi.ModificationDate;
-
-  // We only have 32-bit file size here; later we use the PTP_OPC_ObjectSize property
-  file->filesize = ob->oi.ObjectCompressedSize;
-
-  // This is a unique ID so we can keep track of the file.
-  file->item_id = ob->oid;
+  if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjectPropsSupported)) {
+    printf("Playable File (Object) Types and Object Properties Supported:\n");
+    for (i=0;i<params->deviceinfo.ImageFormats_len;i++) {
+      char txt[256];
+      uint16_t ret;
+      uint16_t *props = NULL;
+      uint32_t propcnt = 0;
+      unsigned int j;
 
-  /*
-   * If we have a cached, large set of metadata, then use it!
-   */
-  if (ob->mtpprops) {
-    MTPProperties *prop = ob->mtpprops;
+      (void) ptp_render_ofc (params, params->deviceinfo.ImageFormats[i],
+			     sizeof(txt), txt);
+      printf("   %04x: %s\n", params->deviceinfo.ImageFormats[i], txt);
 
-    for (i=0; i < ob->nrofmtpprops; i++, prop++) {
-      // Pick ObjectSize here...
-      if (prop->property == PTP_OPC_ObjectSize) {
-	// This may already be set, but this 64bit precision value
-	// is better than the PTP 32bit value, so let it override.
-	if (device->object_bitsize == 64) {
-	  file->filesize = prop->propval.u64;
-	} else {
-	  file->filesize = prop->propval.u32;
-	}
-	break;
-      }
-    }
-  } else if (ptp_operation_issupported(params,PTP_OC_MTP_GetObjectPropsSupported)) {
-    uint16_t *props = NULL;
-    uint32_t propcnt = 0;
-    int ret;
+      ret = ptp_mtp_getobjectpropssupported (params,
+			params->deviceinfo.ImageFormats[i], &propcnt, &props);
+      if (ret != PTP_RC_OK) {
+	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Dump_Device_Info(): "
+				    "error on query for object properties.");
+      } else {
+	for (j=0;j<propcnt;j++) {
+	  PTPObjectPropDesc opd;
+	  int k;
 
-    // First see which properties can be retrieved for this object format
-    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(file->filetype), &propcnt, &props);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "obj2file: call to ptp_mtp_getobjectpropssupported() failed.");
-      // Silently fall through.
-    } else {
-      for (i = 0; i < propcnt; i++) {
-	switch (props[i]) {
-	case PTP_OPC_ObjectSize:
-	  if (device->object_bitsize == 64) {
-	    file->filesize = get_u64_from_object(device, file->item_id, PTP_OPC_ObjectSize, 0);
-	  } else {
-	    file->filesize = get_u32_from_object(device, file->item_id, PTP_OPC_ObjectSize, 0);
+	  printf("      %04x: %s", props[j],
+		 LIBMTP_Get_Property_Description(map_ptp_property_to_libmtp_property(props[j])));
+	  // Get a more verbose description
+	  ret = ptp_mtp_getobjectpropdesc(params, props[j],
+					  params->deviceinfo.ImageFormats[i],
+					  &opd);
+	  if (ret != PTP_RC_OK) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+				    "LIBMTP_Dump_Device_Info(): "
+				    "could not get property description.");
+	    break;
 	  }
-	  break;
-	default:
-	  break;
-	}
-      }
-      free(props);
-    }
-  }
 
-  return file;
-}
-
-
-/**
- * This function retrieves the metadata for a single file off
- * the device.
- *
- * Do not call this function repeatedly! The file handles are linearly
- * searched O(n) and the call may involve (slow) USB traffic, so use
- * <code>LIBMTP_Get_Filelisting()</code> and cache the file, preferably
- * as an efficient data structure such as a hash list.
- *
- * Incidentally this function will return metadata for
- * a folder (association) as well, but this is not a proper use
- * of it, it is intended for file manipulation, not folder manipulation.
- *
- * @param device a pointer to the device to get the file metadata from.
- * @param fileid the object ID of the file that you want the metadata for.
- * @return a metadata entry on success or NULL on failure.
- * @see LIBMTP_Get_Filelisting()
- */
-LIBMTP_file_t *LIBMTP_Get_Filemetadata(LIBMTP_mtpdevice_t *device, uint32_t const fileid)
-{
-  PTPParams *params = (PTPParams *) device->params;
-  uint16_t ret;
-  PTPObject *ob;
+	  if (opd.DataType == PTP_DTC_STR) {
+	    printf(" STRING data type");
+	    switch (opd.FormFlag) {
+	    case PTP_OPFF_DateTime:
+	      printf(" DATETIME FORM (%s)", opd.FORM.DateTime.String);
+	      break;
+	    case PTP_OPFF_RegularExpression:
+	      printf(" REGULAR EXPRESSION FORM (%s)", opd.FORM.RegularExpression.String);
+	      break;
+	    case PTP_OPFF_LongString:
+	      printf(" LONG STRING FORM");
+	      break;
+	    default:
+	      break;
+	    }
+	  } else {
+	    if (opd.DataType & PTP_DTC_ARRAY_MASK) {
+	      printf(" array of");
+	    }
 
-  // Get all the handles if we haven't already done that
-  // (Only on cached devices.)
-  if (device->cached && params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+	    switch (opd.DataType & (~PTP_DTC_ARRAY_MASK)) {
 
-  ret = ptp_object_want(params, fileid, PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if (ret != PTP_RC_OK)
-    return NULL;
+	    case PTP_DTC_UNDEF:
+	      printf(" UNDEFINED data type");
+	      break;
+	    case PTP_DTC_INT8:
+	      printf(" INT8 data type");
+	      switch (opd.FormFlag) {
+	      case PTP_OPFF_Range:
+		printf(" range: MIN %d, MAX %d, STEP %d",
+		       opd.FORM.Range.MinimumValue.i8,
+		       opd.FORM.Range.MaximumValue.i8,
+		       opd.FORM.Range.StepSize.i8);
+		break;
+	      case PTP_OPFF_Enumeration:
+		printf(" enumeration: ");
+		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
+		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].i8);
+		}
+		break;
+	      case PTP_OPFF_ByteArray:
+		printf(" byte array: ");
+		break;
+	      default:
+		printf(" ANY 8BIT VALUE form");
+		break;
+	      }
+	      break;
 
-  return obj2file(device, ob);
-}
+	    case PTP_DTC_UINT8:
+	      printf(" UINT8 data type");
+	      switch (opd.FormFlag) {
+	      case PTP_OPFF_Range:
+		printf(" range: MIN %d, MAX %d, STEP %d",
+		       opd.FORM.Range.MinimumValue.u8,
+		       opd.FORM.Range.MaximumValue.u8,
+		       opd.FORM.Range.StepSize.u8);
+		break;
+	      case PTP_OPFF_Enumeration:
+		printf(" enumeration: ");
+		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
+		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].u8);
+		}
+		break;
+	      case PTP_OPFF_ByteArray:
+		printf(" byte array: ");
+		break;
+	      default:
+		printf(" ANY 8BIT VALUE form");
+		break;
+	      }
+	      break;
 
-/**
-* THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
- * NOT TO USE IT.
- * @see LIBMTP_Get_Filelisting_With_Callback()
- */
-LIBMTP_file_t *LIBMTP_Get_Filelisting(LIBMTP_mtpdevice_t *device)
-{
-  LIBMTP_INFO("WARNING: LIBMTP_Get_Filelisting() is deprecated.\n");
-  LIBMTP_INFO("WARNING: please update your code to use LIBMTP_Get_Filelisting_With_Callback()\n");
-  return LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
-}
+	    case PTP_DTC_INT16:
+	      printf(" INT16 data type");
+	      switch (opd.FormFlag) {
+	      case PTP_OPFF_Range:
+	      printf(" range: MIN %d, MAX %d, STEP %d",
+		     opd.FORM.Range.MinimumValue.i16,
+		     opd.FORM.Range.MaximumValue.i16,
+		     opd.FORM.Range.StepSize.i16);
+	      break;
+	      case PTP_OPFF_Enumeration:
+		printf(" enumeration: ");
+		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
+		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].i16);
+		}
+		break;
+	      default:
+		printf(" ANY 16BIT VALUE form");
+		break;
+	      }
+	      break;
 
-/**
- * This returns a long list of all files available
- * on the current MTP device. Folders will not be returned, but abstract
- * entities like playlists and albums will show up as "files". Typical usage:
- *
- * <pre>
- * LIBMTP_file_t *filelist;
- *
- * filelist = LIBMTP_Get_Filelisting_With_Callback(device, callback, data);
- * while (filelist != NULL) {
- *   LIBMTP_file_t *tmp;
- *
- *   // Do something on each element in the list here...
- *   tmp = filelist;
- *   filelist = filelist->next;
- *   LIBMTP_destroy_file_t(tmp);
- * }
- * </pre>
- *
- * If you want to group your file listing by storage (per storage unit) or
- * arrange files into folders, you must dereference the <code>storage_id</code>
- * and/or <code>parent_id</code> field of the returned <code>LIBMTP_file_t</code>
- * struct. To arrange by folders or files you typically have to create the proper
- * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or
- * <code>LIBMTP_Get_Folder_List()</code> first.
- *
- * @param device a pointer to the device to get the file listing for.
- * @param callback a function to be called during the tracklisting retrieveal
- *        for displaying progress bars etc, or NULL if you don't want
- *        any callbacks.
- * @param data a user-defined pointer that is passed along to
- *        the <code>progress</code> function in order to
- *        pass along some user defined data to the progress
- *        updates. If not used, set this to NULL.
- * @return a list of files that can be followed using the <code>next</code>
- *        field of the <code>LIBMTP_file_t</code> data structure.
- *        Each of the metadata tags must be freed after use, and may
- *        contain only partial metadata information, i.e. one or several
- *        fields may be NULL or 0.
- * @see LIBMTP_Get_Filemetadata()
- */
-LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
-                                                    LIBMTP_progressfunc_t const callback,
-                                                    void const * const data)
-{
-  uint32_t i = 0;
-  LIBMTP_file_t *retfiles = NULL;
-  LIBMTP_file_t *curfile = NULL;
-  PTPParams *params = (PTPParams *) device->params;
-
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
-
-  for (i = 0; i < params->nrofobjects; i++) {
-    LIBMTP_file_t *file;
-    PTPObject *ob;
-
-    if (callback != NULL)
-      callback(i, params->nrofobjects, data);
-
-    ob = &params->objects[i];
-
-    if (ob->oi.ObjectFormat == PTP_OFC_Association) {
-      // MTP use this object format for folders which means
-      // these "files" will turn up on a folder listing instead.
-      continue;
-    }
-
-    // Look up metadata
-    file = obj2file(device, ob);
-    if (file == NULL) {
-      continue;
-    }
+	    case PTP_DTC_UINT16:
+	      printf(" UINT16 data type");
+	      switch (opd.FormFlag) {
+	      case PTP_OPFF_Range:
+		printf(" range: MIN %d, MAX %d, STEP %d",
+		       opd.FORM.Range.MinimumValue.u16,
+		       opd.FORM.Range.MaximumValue.u16,
+		       opd.FORM.Range.StepSize.u16);
+		break;
+	      case PTP_OPFF_Enumeration:
+		printf(" enumeration: ");
+		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
+		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].u16);
+		}
+		break;
+	      default:
+		printf(" ANY 16BIT VALUE form");
+		break;
+	      }
+	      break;
 
-    // Add track to a list that will be returned afterwards.
-    if (retfiles == NULL) {
-      retfiles = file;
-      curfile = file;
-    } else {
-      curfile->next = file;
-      curfile = file;
-    }
+	    case PTP_DTC_INT32:
+	      printf(" INT32 data type");
+	      switch (opd.FormFlag) {
+	      case PTP_OPFF_Range:
+		printf(" range: MIN %d, MAX %d, STEP %d",
+		       opd.FORM.Range.MinimumValue.i32,
+		       opd.FORM.Range.MaximumValue.i32,
+		       opd.FORM.Range.StepSize.i32);
+		break;
+	      case PTP_OPFF_Enumeration:
+		printf(" enumeration: ");
+		for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
+		  printf("%d, ", opd.FORM.Enum.SupportedValue[k].i32);
+		}
+		break;
+	      default:
+		printf(" ANY 32BIT VALUE form");
+		break;
+	      }
+	      break;
 
-    // Call listing callback
-    // double progressPercent = (double)i*(double)100.0 / (double)params->handles.n;
+	    case PTP_DTC_UINT32:
+	      printf(" UINT32 data type");
+	      switch (opd.FormFlag) {
+	      case PTP_OPFF_Range:
+		printf(" range: MIN %u, MAX %u, STEP %u",
+		       opd.FORM.Range.MinimumValue.u32,
+		       opd.FORM.Range.MaximumValue.u32,
+		       opd.FORM.Range.StepSize.u32);
+		break;
+	      case PTP_OPFF_Enumeration:
+		// Special pretty-print for FOURCC codes
+		if (params->deviceinfo.ImageFormats[i] == PTP_OPC_VideoFourCCCodec) {
+		  printf(" enumeration of u32 casted FOURCC: ");
+		  for (k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
+		    if (opd.FORM.Enum.SupportedValue[k].u32 == 0) {
+		      printf("ANY, ");
+		    } else {
+		      char fourcc[6];
+		      fourcc[0] = (opd.FORM.Enum.SupportedValue[k].u32 >> 24) & 0xFFU;
+		      fourcc[1] = (opd.FORM.Enum.SupportedValue[k].u32 >> 16) & 0xFFU;
+		      fourcc[2] = (opd.FORM.Enum.SupportedValue[k].u32 >> 8) & 0xFFU;
+		      fourcc[3] = opd.FORM.Enum.SupportedValue[k].u32 & 0xFFU;
+		      fourcc[4] = '\n';
+		      fourcc[5] = '\0';
+		      printf("\"%s\", ", fourcc);
+		    }
+		  }
+		} else {
+		  printf(" enumeration: ");
+		  for(k=0;k<opd.FORM.Enum.NumberOfValues;k++) {
+		    printf("%u, ", opd.FORM.Enum.SupportedValue[k].u32);
+		  }
+		}
+		break;
+	      default:
+		printf(" ANY 32BIT VALUE form");
+		break;
+	      }
+	      break;
 
-  } // Handle counting loop
-  return retfiles;
-}
+	    case PTP_DTC_INT64:
+	      printf(" INT64 data type");
+	      break;
 
-/**
- * This function retrieves the contents of a certain folder
- * with id parent on a certain storage on a certain device.
- * The result contains both files and folders.
- * The device used with this operations must have been opened with
- * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
- *
- * NOTE: the request will always perform I/O with the device.
- * @param device a pointer to the MTP device to report info from.
- * @param storage a storage on the device to report info from. If
- *        0 is passed in, the files for the given parent will be
- *        searched across all available storages.
- * @param parent the parent folder id.
- */
-LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
-			     uint32_t const storage,
-			     uint32_t const parent)
-{
-  PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_file_t *retfiles = NULL;
-  LIBMTP_file_t *curfile = NULL;
-  PTPObjectHandles currentHandles;
-  uint32_t storageid;
-  uint16_t ret;
-  unsigned int i = 0;
+	    case PTP_DTC_UINT64:
+	      printf(" UINT64 data type");
+	      break;
 
-  if (device->cached) {
-    // This function is only supposed to be used by devices
-    // opened as uncached!
-    LIBMTP_ERROR("tried to use %s on a cached device!\n",
-		 __func__);
-    return NULL;
-  }
+	    case PTP_DTC_INT128:
+	      printf(" INT128 data type");
+	      break;
 
-  if (storage == 0)
-    storageid = PTP_GOH_ALL_STORAGE;
-  else
-    storageid = storage;
+	    case PTP_DTC_UINT128:
+	      printf(" UINT128 data type");
+	      break;
 
-  ret = ptp_getobjecthandles(params,
-			     storageid,
-			     PTP_GOH_ALL_FORMATS,
-			     parent,
-			     &currentHandles);
+	    default:
+	      printf(" UNKNOWN data type");
+	      break;
+	    }
+	  }
+	  if (opd.GetSet) {
+	    printf(" GET/SET");
+	  } else {
+	    printf(" READ ONLY");
+	  }
+	  printf(" GROUP 0x%x", opd.GroupCode);
 
-  if (ret != PTP_RC_OK) {
-    char buf[80];
-    sprintf(buf,"LIBMTP_Get_Files_And_Folders(): could not get object handles of %08x.", parent);
-    add_ptp_error_to_errorstack(device, ret, buf);
-    return NULL;
+	  printf("\n");
+	  ptp_free_objectpropdesc(&opd);
+	}
+	free(props);
+      }
+    }
   }
 
-  if (currentHandles.Handler == NULL || currentHandles.n == 0)
-    return NULL;
-
-  for (i = 0; i < currentHandles.n; i++) {
-    LIBMTP_file_t *file;
-
-    // Get metadata for one file, if it fails, try next file
-    file = LIBMTP_Get_Filemetadata(device, currentHandles.Handler[i]);
-    if (file == NULL)
-      continue;
-
-    // Add track to a list that will be returned afterwards.
-    if (curfile == NULL) {
-      curfile = file;
-      retfiles = file;
-    } else {
-      curfile->next = file;
-      curfile = file;
+  if(storage != NULL &&
+     ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
+    printf("Storage Devices:\n");
+    while(storage != NULL) {
+      printf("   StorageID: 0x%08x\n",storage->id);
+      printf("      StorageType: 0x%04x ",storage->StorageType);
+      switch (storage->StorageType) {
+      case PTP_ST_Undefined:
+	printf("(undefined)\n");
+	break;
+      case PTP_ST_FixedROM:
+	printf("fixed ROM storage\n");
+	break;
+      case PTP_ST_RemovableROM:
+	printf("removable ROM storage\n");
+	break;
+      case PTP_ST_FixedRAM:
+	printf("fixed RAM storage\n");
+	break;
+      case PTP_ST_RemovableRAM:
+	printf("removable RAM storage\n");
+	break;
+      default:
+	printf("UNKNOWN storage\n");
+	break;
+      }
+      printf("      FilesystemType: 0x%04x ",storage->FilesystemType);
+      switch(storage->FilesystemType) {
+      case PTP_FST_Undefined:
+	printf("(undefined)\n");
+	break;
+      case PTP_FST_GenericFlat:
+	printf("generic flat filesystem\n");
+	break;
+      case PTP_FST_GenericHierarchical:
+	printf("generic hierarchical\n");
+	break;
+      case PTP_FST_DCF:
+	printf("DCF\n");
+	break;
+      default:
+	printf("UNKNONWN filesystem type\n");
+	break;
+      }
+      printf("      AccessCapability: 0x%04x ",storage->AccessCapability);
+      switch(storage->AccessCapability) {
+      case PTP_AC_ReadWrite:
+	printf("read/write\n");
+	break;
+      case PTP_AC_ReadOnly:
+	printf("read only\n");
+	break;
+      case PTP_AC_ReadOnly_with_Object_Deletion:
+	printf("read only + object deletion\n");
+	break;
+      default:
+	printf("UNKNOWN access capability\n");
+	break;
+      }
+      printf("      MaxCapacity: %llu\n",
+	     (long long unsigned int) storage->MaxCapacity);
+      printf("      FreeSpaceInBytes: %llu\n",
+	     (long long unsigned int) storage->FreeSpaceInBytes);
+      printf("      FreeSpaceInObjects: %llu\n",
+	     (long long unsigned int) storage->FreeSpaceInObjects);
+      printf("      StorageDescription: %s\n",storage->StorageDescription);
+      printf("      VolumeIdentifier: %s\n",storage->VolumeIdentifier);
+      storage = storage->next;
     }
   }
 
-  free(currentHandles.Handler);
-
-  // Return a pointer to the original first file
-  // in the big list.
-  return retfiles;
+  printf("Special directories:\n");
+  printf("   Default music folder: 0x%08x\n",
+	 device->default_music_folder);
+  printf("   Default playlist folder: 0x%08x\n",
+	 device->default_playlist_folder);
+  printf("   Default picture folder: 0x%08x\n",
+	 device->default_picture_folder);
+  printf("   Default video folder: 0x%08x\n",
+	 device->default_video_folder);
+  printf("   Default organizer folder: 0x%08x\n",
+	 device->default_organizer_folder);
+  printf("   Default zencast folder: 0x%08x\n",
+	 device->default_zencast_folder);
+  printf("   Default album folder: 0x%08x\n",
+	 device->default_album_folder);
+  printf("   Default text folder: 0x%08x\n",
+	 device->default_text_folder);
 }
 
+/**
+ * This resets a device in case it supports the <code>PTP_OC_ResetDevice</code>
+ * operation code (0x1010).
+ * @param device a pointer to the device to reset.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Reset_Device(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  if (!ptp_operation_issupported(params,PTP_OC_ResetDevice)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Reset_Device(): "
+			    "device does not support resetting.");
+    return -1;
+  }
+  ret = ptp_resetdevice(params);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "Error resetting.");
+    return -1;
+  }
+  return 0;
+}
 
 /**
- * This creates a new track metadata structure and allocates memory
- * for it. Notice that if you add strings to this structure they
- * will be freed by the corresponding <code>LIBMTP_destroy_track_t</code>
- * operation later, so be careful of using strdup() when assigning
- * strings, e.g.:
+ * This tunes how bulk data is moved to and from a device. Large
+ * transfers are split up into blocks of <code>blocksize</code> bytes
+ * and up to <code>depth</code> of these are kept queued on the USB bus
+ * at the same time, so the device never has to wait for the host
+ * between blocks. Fast (USB 3.0) devices moving large files will
+ * typically benefit from a deeper queue and larger blocks.
  *
- * <pre>
- * LIBMTP_track_t *track = LIBMTP_new_track_t();
- * track->title = strdup(titlestr);
- * ....
- * LIBMTP_destroy_track_t(track);
- * </pre>
+ * The block size is rounded down to a multiple of the endpoint packet
+ * size. A depth of 1 gives the old one-block-at-a-time behaviour.
+ * Backends that can only do synchronous transfers ignore this.
  *
- * @return a pointer to the newly allocated metadata structure.
- * @see LIBMTP_destroy_track_t()
+ * @param device a pointer to the device to tune.
+ * @param depth the number of transfers to keep in flight.
+ * @param blocksize the size of each transfer in bytes.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Transfer_Queue()
  */
-LIBMTP_track_t *LIBMTP_new_track_t(void)
+int LIBMTP_Set_Transfer_Queue(LIBMTP_mtpdevice_t *device,
+			      int const depth, uint32_t const blocksize)
 {
-  LIBMTP_track_t *new = (LIBMTP_track_t *) malloc(sizeof(LIBMTP_track_t));
-  if (new == NULL) {
-    return NULL;
+  PTP_USB *ptp_usb = (PTP_USB *) device->usbinfo;
+
+  if (depth < 1 || blocksize == 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Transfer_Queue(): "
+			    "invalid queue depth or block size.");
+    return -1;
   }
-  new->item_id = 0;
-  new->parent_id = 0;
-  new->storage_id = 0;
-  new->title = NULL;
-  new->artist = NULL;
-  new->composer = NULL;
-  new->album = NULL;
-  new->genre = NULL;
-  new->date = NULL;
-  new->filename = NULL;
-  new->duration = 0;
-  new->tracknumber = 0;
-  new->filesize = 0;
-  new->filetype = LIBMTP_FILETYPE_UNKNOWN;
-  new->samplerate = 0;
-  new->nochannels = 0;
-  new->wavecodec = 0;
-  new->bitrate = 0;
-  new->bitratetype = 0;
-  new->rating = 0;
-  new->usecount = 0;
-  new->modificationdate = 0;
-  new->next = NULL;
-  return new;
+  set_usb_device_transfer_queue(ptp_usb, depth, blocksize);
+  return 0;
 }
 
 /**
- * This destroys a track metadata structure and deallocates the memory
- * used by it, including any strings. Never use a track metadata
- * structure again after calling this function on it.
- * @param track the track metadata to destroy.
- * @see LIBMTP_new_track_t()
+ * This retrieves the bulk transfer queue settings of a device.
+ * @param device a pointer to the device to query.
+ * @param depth a pointer to an integer that will hold the number of
+ *        transfers kept in flight.
+ * @param blocksize a pointer to a variable that will hold the size of
+ *        each transfer in bytes.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Set_Transfer_Queue()
  */
-void LIBMTP_destroy_track_t(LIBMTP_track_t *track)
+int LIBMTP_Get_Transfer_Queue(LIBMTP_mtpdevice_t *device,
+			      int * const depth, uint32_t * const blocksize)
 {
-  if (track == NULL) {
-    return;
+  PTP_USB *ptp_usb = (PTP_USB *) device->usbinfo;
+  unsigned long size;
+
+  get_usb_device_transfer_queue(ptp_usb, depth, &size);
+  *blocksize = size;
+  return 0;
+}
+
+/* Block sizes tried by LIBMTP_Tune_Transfer_Block_Size() */
+static const uint32_t tune_block_sizes[] = {
+  0x4000, 0x10000, 0x40000, 0x100000
+};
+// How much of the object each block size reads
+#define TUNE_SAMPLE_SIZE (4 * 1024 * 1024)
+
+static uint16_t discard_put_func(PTPParams *params, void *priv,
+				 unsigned long sendlen, unsigned char *data)
+{
+  return PTP_RC_OK;
+}
+
+static uint64_t tune_time_us(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/**
+ * This measures which bulk transfer block size moves data fastest
+ * for a device and keeps that one, see
+ * <code>LIBMTP_Set_Transfer_Queue()</code>. The start of a file on
+ * the device is read once with each of a few block sizes from 16KiB
+ * to 1MiB; the data is thrown away. Devices otherwise get a block
+ * size that suits the USB speed they are connected at.
+ *
+ * This needs a device supporting GetPartialObject and a file of at
+ * least a few megabytes, and should be done while the device is idle.
+ *
+ * @param device a pointer to the device to tune.
+ * @param object_id a file on the device to read for the measurement.
+ * @return the block size chosen, or -1 on failure in which case the
+ *         block size is left as it was.
+ */
+int LIBMTP_Tune_Transfer_Block_Size(LIBMTP_mtpdevice_t *device,
+				    uint32_t const object_id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB *) device->usbinfo;
+  PTPDataHandler handler;
+  PTPObject *ob;
+  unsigned long oldsize;
+  uint64_t best_us = 0;
+  uint32_t best = 0;
+  uint32_t len;
+  uint16_t ret;
+  unsigned int i;
+  int depth;
+
+  if (!ptp_operation_issupported(params, PTP_OC_GetPartialObject) &&
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Tune_Transfer_Block_Size(): "
+			    "partial object reads are not supported.");
+    return -1;
   }
-  if (track->title != NULL)
-    free(track->title);
-  if (track->artist != NULL)
-    free(track->artist);
-  if (track->composer != NULL)
-    free(track->composer);
-  if (track->album != NULL)
-    free(track->album);
-  if (track->genre != NULL)
-    free(track->genre);
-  if (track->date != NULL)
-    free(track->date);
-  if (track->filename != NULL)
-    free(track->filename);
-  free(track);
-  return;
+  ret = ptp_object_want(params, object_id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Tune_Transfer_Block_Size(): "
+				"could not get object info.");
+    return -1;
+  }
+  len = ob->oi.ObjectCompressedSize < TUNE_SAMPLE_SIZE ?
+    (uint32_t) ob->oi.ObjectCompressedSize : TUNE_SAMPLE_SIZE;
+  if (len < tune_block_sizes[sizeof(tune_block_sizes) /
+			     sizeof(tune_block_sizes[0]) - 1]) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Tune_Transfer_Block_Size(): "
+			    "file is too small to measure with.");
+    return -1;
+  }
+  len = partial_object_length(params, 0, len, ob->oi.ObjectCompressedSize);
+
+  memset(&handler, 0, sizeof(handler));
+  handler.putfunc = discard_put_func;
+  get_usb_device_transfer_queue(ptp_usb, &depth, &oldsize);
+  // Read once first so the device has the data at hand for every size
+  ret = get_object_range(params, object_id, 0, len, &handler, NULL, NULL);
+  for (i = 0; ret == PTP_RC_OK &&
+	 i < sizeof(tune_block_sizes) / sizeof(tune_block_sizes[0]); i++) {
+    uint64_t start, us;
+
+    set_usb_device_transfer_queue(ptp_usb, depth, tune_block_sizes[i]);
+    start = tune_time_us();
+    ret = get_object_range(params, object_id, 0, len, &handler, NULL, NULL);
+    us = tune_time_us() - start;
+    LIBMTP_INFO("Block size 0x%x: %u bytes in %llu us\n",
+		tune_block_sizes[i], len, (unsigned long long) us);
+    if (ret == PTP_RC_OK && (best == 0 || us < best_us)) {
+      best = tune_block_sizes[i];
+      best_us = us;
+    }
+  }
+  if (ret != PTP_RC_OK) {
+    set_usb_device_transfer_queue(ptp_usb, depth, oldsize);
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Tune_Transfer_Block_Size(): "
+				"could not read the file.");
+    return -1;
+  }
+  set_usb_device_transfer_queue(ptp_usb, depth, best);
+  return best;
 }
 
 /**
- * This function maps and copies a property onto the track metadata if applicable.
+ * This enables or disables zero-copy sending for a device. When
+ * enabled, <code>LIBMTP_Send_File_From_File_Descriptor()</code> memory
+ * maps regular files and hands the mapping straight to the USB
+ * transfers instead of reading the file into a buffer first. Data
+ * that can not be mapped (pipes, handlers) is sent from DMA-able
+ * buffers allocated by the kernel where it supports that, which
+ * saves the copy inside the USB stack.
+ *
+ * This is off by default since some platforms and file systems
+ * perform poorly or badly with large shared mappings.
+ *
+ * @param device a pointer to the device to configure.
+ * @param enable 1 to enable zero-copy sends, 0 to disable them.
+ * @return 0 on success, any other value means failure.
  */
-static void pick_property_to_track_metadata(LIBMTP_mtpdevice_t *device, MTPProperties *prop, LIBMTP_track_t *track)
+int LIBMTP_Set_Zero_Copy_Send(LIBMTP_mtpdevice_t *device, int const enable)
 {
-  switch (prop->property) {
-  case PTP_OPC_Name:
-    if (prop->propval.str != NULL)
-      track->title = strdup(prop->propval.str);
-    else
-      track->title = NULL;
-    break;
-  case PTP_OPC_Artist:
-    if (prop->propval.str != NULL)
-      track->artist = strdup(prop->propval.str);
-    else
-      track->artist = NULL;
-    break;
-  case PTP_OPC_Composer:
-    if (prop->propval.str != NULL)
-      track->composer = strdup(prop->propval.str);
-    else
-      track->composer = NULL;
-    break;
-  case PTP_OPC_Duration:
-    track->duration = prop->propval.u32;
-    break;
-  case PTP_OPC_Track:
-    track->tracknumber = prop->propval.u16;
-    break;
-  case PTP_OPC_Genre:
-    if (prop->propval.str != NULL)
-      track->genre = strdup(prop->propval.str);
-    else
-      track->genre = NULL;
-    break;
-  case PTP_OPC_AlbumName:
-    if (prop->propval.str != NULL)
-      track->album = strdup(prop->propval.str);
-    else
-      track->album = NULL;
-    break;
-  case PTP_OPC_OriginalReleaseDate:
-    if (prop->propval.str != NULL)
-      track->date = strdup(prop->propval.str);
-    else
-      track->date = NULL;
-    break;
-    // These are, well not so important.
-  case PTP_OPC_SampleRate:
-    track->samplerate = prop->propval.u32;
-    break;
-  case PTP_OPC_NumberOfChannels:
-    track->nochannels = prop->propval.u16;
-    break;
-  case PTP_OPC_AudioWAVECodec:
-    track->wavecodec = prop->propval.u32;
-    break;
-  case PTP_OPC_AudioBitRate:
-    track->bitrate = prop->propval.u32;
-    break;
-  case PTP_OPC_BitRateType:
-    track->bitratetype = prop->propval.u16;
-    break;
-  case PTP_OPC_Rating:
-    track->rating = prop->propval.u16;
-    break;
-  case PTP_OPC_UseCount:
-    track->usecount = prop->propval.u32;
-    break;
-  case PTP_OPC_ObjectSize:
-    if (device->object_bitsize == 64) {
-      track->filesize = prop->propval.u64;
-    } else {
-      track->filesize = prop->propval.u32;
-    }
-    break;
-  default:
-    break;
-  }
+  PTP_USB *ptp_usb = (PTP_USB *) device->usbinfo;
+
+  ptp_usb->zerocopy_send = enable ? 1 : 0;
+  return 0;
 }
 
 /**
- * This function retrieves the track metadata for a track
- * given by a unique ID.
- * @param device a pointer to the device to get the track metadata off.
- * @param trackid the unique ID of the track.
- * @param objectformat the object format of this track, so we know what it supports.
- * @param track a metadata set to fill in.
+ * The defaults of the timeout policy of a newly opened device, the
+ * timeout of a request is the one its transport chose.
  */
-static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat,
-			       LIBMTP_track_t *track)
+#define DEFAULT_LONG_TIMEOUT 60000
+#define DEFAULT_MIN_THROUGHPUT (1024 * 1024)
+#define DEFAULT_CANCEL_TIMEOUT 300
+#define DEFAULT_RETRIES 2
+#define DEFAULT_RETRY_DELAY 100
+#define DEFAULT_MAX_RETRY_DELAY 2000
+
+static void init_timeout_policy(PTPParams *params, PTP_USB *ptp_usb)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  uint32_t i;
-  MTPProperties *prop;
-  PTPObject *ob;
-
-  /*
-   * If we have a cached, large set of metadata, then use it!
-   */
-  ret = ptp_object_want(params, track->item_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if (ob->mtpprops) {
-    prop = ob->mtpprops;
-    for (i=0;i<ob->nrofmtpprops;i++,prop++)
-      pick_property_to_track_metadata(device, prop, track);
-  } else {
-    uint16_t *props = NULL;
-    uint32_t propcnt = 0;
-
-    // First see which properties can be retrieved for this object format
-    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(track->filetype), &propcnt, &props);
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "get_track_metadata(): call to ptp_mtp_getobjectpropssupported() failed.");
-      // Just bail out for now, nothing is ever set.
-      return;
-    } else {
-      for (i=0;i<propcnt;i++) {
-	switch (props[i]) {
-	case PTP_OPC_Name:
-	  track->title = get_string_from_object(device, track->item_id, PTP_OPC_Name);
-	  break;
-	case PTP_OPC_Artist:
-	  track->artist = get_string_from_object(device, track->item_id, PTP_OPC_Artist);
-	  break;
-	case PTP_OPC_Composer:
-	  track->composer = get_string_from_object(device, track->item_id, PTP_OPC_Composer);
-	  break;
-	case PTP_OPC_Duration:
-	  track->duration = get_u32_from_object(device, track->item_id, PTP_OPC_Duration, 0);
-	  break;
-	case PTP_OPC_Track:
-	  track->tracknumber = get_u16_from_object(device, track->item_id, PTP_OPC_Track, 0);
-	  break;
-	case PTP_OPC_Genre:
-	  track->genre = get_string_from_object(device, track->item_id, PTP_OPC_Genre);
-	  break;
-	case PTP_OPC_AlbumName:
-	  track->album = get_string_from_object(device, track->item_id, PTP_OPC_AlbumName);
-	  break;
-	case PTP_OPC_OriginalReleaseDate:
-	  track->date = get_string_from_object(device, track->item_id, PTP_OPC_OriginalReleaseDate);
-	  break;
-	  // These are, well not so important.
-	case PTP_OPC_SampleRate:
-	  track->samplerate = get_u32_from_object(device, track->item_id, PTP_OPC_SampleRate, 0);
-	  break;
-	case PTP_OPC_NumberOfChannels:
-	  track->nochannels = get_u16_from_object(device, track->item_id, PTP_OPC_NumberOfChannels, 0);
-	  break;
-	case PTP_OPC_AudioWAVECodec:
-	  track->wavecodec = get_u32_from_object(device, track->item_id, PTP_OPC_AudioWAVECodec, 0);
-	  break;
-	case PTP_OPC_AudioBitRate:
-	  track->bitrate = get_u32_from_object(device, track->item_id, PTP_OPC_AudioBitRate, 0);
-	  break;
-	case PTP_OPC_BitRateType:
-	  track->bitratetype = get_u16_from_object(device, track->item_id, PTP_OPC_BitRateType, 0);
-	  break;
-	case PTP_OPC_Rating:
-	  track->rating = get_u16_from_object(device, track->item_id, PTP_OPC_Rating, 0);
-	  break;
-	case PTP_OPC_UseCount:
-	  track->usecount = get_u32_from_object(device, track->item_id, PTP_OPC_UseCount, 0);
-	  break;
-	case PTP_OPC_ObjectSize:
-	  if (device->object_bitsize == 64) {
-	    track->filesize = get_u64_from_object(device, track->item_id, PTP_OPC_ObjectSize, 0);
-	  } else {
-	    track->filesize = (uint64_t) get_u32_from_object(device, track->item_id, PTP_OPC_ObjectSize, 0);
-	  }
-	  break;
-	}
-      }
-      free(props);
-    }
-  }
+  ptp_usb->long_timeout = DEFAULT_LONG_TIMEOUT;
+  ptp_usb->stall_timeout = 0;
+  ptp_usb->min_throughput = DEFAULT_MIN_THROUGHPUT;
+  ptp_usb->cancel_timeout = DEFAULT_CANCEL_TIMEOUT;
+  params->retries = DEFAULT_RETRIES;
+  params->retry_delay = DEFAULT_RETRY_DELAY;
+  params->retry_delay_max = DEFAULT_MAX_RETRY_DELAY;
+  params->max_failures = 0;
 }
 
 /**
- * THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
- * NOT TO USE IT.
- * @see LIBMTP_Get_Tracklisting_With_Callback()
+ * This retrieves the timeout policy of a device, see
+ * <code>LIBMTP_Set_Timeout_Policy()</code>.
+ *
+ * @param device a pointer to the device to get the policy of.
+ * @param policy a pointer to a policy structure that is filled in.
+ * @return 0 on success, any other value means failure.
  */
-LIBMTP_track_t *LIBMTP_Get_Tracklisting(LIBMTP_mtpdevice_t *device)
+int LIBMTP_Get_Timeout_Policy(LIBMTP_mtpdevice_t *device,
+			      LIBMTP_timeout_policy_t *policy)
 {
-  LIBMTP_INFO("WARNING: LIBMTP_Get_Tracklisting() is deprecated.\n");
-  LIBMTP_INFO("WARNING: please update your code to use LIBMTP_Get_Tracklisting_With_Callback()\n");
-  return LIBMTP_Get_Tracklisting_With_Callback(device, NULL, NULL);
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB *) device->usbinfo;
+  int timeout;
+
+  ptp_lock(params, PTP_LOCK_TRANSACTION);
+  get_usb_device_timeout(ptp_usb, &timeout);
+  policy->timeout = timeout;
+  policy->long_timeout = ptp_usb->long_timeout;
+  policy->stall_timeout = ptp_usb->stall_timeout;
+  policy->min_throughput = ptp_usb->min_throughput;
+  policy->cancel_timeout = ptp_usb->cancel_timeout;
+  policy->retries = params->retries;
+  policy->retry_delay = params->retry_delay;
+  policy->max_retry_delay = params->retry_delay_max;
+  policy->max_failures = params->max_failures;
+  ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+  return 0;
 }
 
 /**
- * This returns a long list of all tracks available on the current MTP device.
- * Tracks include multimedia objects, both music tracks and video tracks.
- * Typical usage:
- *
- * <pre>
- * LIBMTP_track_t *tracklist;
- *
- * tracklist = LIBMTP_Get_Tracklisting_With_Callback(device, callback, data);
- * while (tracklist != NULL) {
- *   LIBMTP_track_t *tmp;
+ * This sets the timeout policy of a device: how long transactions may
+ * take before they time out, and how often the ones that only read
+ * from the device (object info, partial reads, properties and the
+ * like) are tried again after failing on the bus. Before a retry the
+ * transfer is cancelled, data the device still sends for it is
+ * dropped and endpoint stalls are cleared, then the retry waits for a
+ * delay that doubles with every further attempt.
  *
- *   // Do something on each element in the list here...
- *   tmp = tracklist;
- *   tracklist = tracklist->next;
- *   LIBMTP_destroy_track_t(tmp);
- * }
- * </pre>
+ * A stall in the middle of a transfer shows much sooner with a
+ * <code>stall_timeout</code>: once the device is sending, each bulk
+ * transfer then only gets that much time on top of what its size
+ * takes at the expected throughput, instead of the full timeout of a
+ * request. The expected throughput follows the throughput measured
+ * on large transfers. A device that is unplugged, or that failed
+ * <code>max_failures</code> transactions in a row, is taken as gone
+ * and all further transactions fail at once instead of timing out.
  *
- * If you want to group your track listing by storage (per storage unit) or
- * arrange tracks into folders, you must dereference the <code>storage_id</code>
- * and/or <code>parent_id</code> field of the returned <code>LIBMTP_track_t</code>
- * struct. To arrange by folders or files you typically have to create the proper
- * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or
- * <code>LIBMTP_Get_Folder_List()</code> first.
+ * Retries and the stall timeout need the libusb-1.0 transport, other
+ * devices go by the rest of the policy. Get the current policy with
+ * <code>LIBMTP_Get_Timeout_Policy()</code> and change what is needed.
  *
- * @param device a pointer to the device to get the track listing for.
- * @param callback a function to be called during the tracklisting retrieveal
- *        for displaying progress bars etc, or NULL if you don't want
- *        any callbacks.
- * @param data a user-defined pointer that is passed along to
- *        the <code>progress</code> function in order to
- *        pass along some user defined data to the progress
- *        updates. If not used, set this to NULL.
- * @return a list of tracks that can be followed using the <code>next</code>
- *        field of the <code>LIBMTP_track_t</code> data structure.
- *        Each of the metadata tags must be freed after use, and may
- *        contain only partial metadata information, i.e. one or several
- *        fields may be NULL or 0.
- * @see LIBMTP_Get_Trackmetadata()
+ * @param device a pointer to the device to configure.
+ * @param policy the new policy.
+ * @return 0 on success, any other value means failure.
  */
-LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback(LIBMTP_mtpdevice_t *device,
-                                                      LIBMTP_progressfunc_t const callback,
-                                                      void const * const data)
+int LIBMTP_Set_Timeout_Policy(LIBMTP_mtpdevice_t *device,
+			      LIBMTP_timeout_policy_t const *policy)
 {
-	return LIBMTP_Get_Tracklisting_With_Callback_For_Storage(device, 0, callback, data);
-}
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB *) device->usbinfo;
 
+  if (policy->timeout == 0 || policy->timeout > INT_MAX ||
+      policy->long_timeout > INT_MAX || policy->stall_timeout > INT_MAX ||
+      policy->cancel_timeout > INT_MAX) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Timeout_Policy(): bad timeout.");
+    return -1;
+  }
+  ptp_lock(params, PTP_LOCK_TRANSACTION);
+  set_usb_device_timeout(ptp_usb, policy->timeout);
+  ptp_usb->long_timeout = policy->long_timeout;
+  ptp_usb->stall_timeout = policy->stall_timeout;
+  ptp_usb->min_throughput = policy->min_throughput;
+  ptp_usb->cancel_timeout = policy->cancel_timeout;
+  params->retries = policy->retries;
+  params->retry_delay = policy->retry_delay;
+  params->retry_delay_max = policy->max_retry_delay;
+  params->max_failures = policy->max_failures;
+  ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+  return 0;
+}
 
 /**
- * This returns a long list of all tracks available on the current MTP device.
- * Tracks include multimedia objects, both music tracks and video tracks.
- * Typical usage:
- *
- * <pre>
- * LIBMTP_track_t *tracklist;
- *
- * tracklist = LIBMTP_Get_Tracklisting_With_Callback_For_Storage(device, storage_id, callback, data);
- * while (tracklist != NULL) {
- *   LIBMTP_track_t *tmp;
- *
- *   // Do something on each element in the list here...
- *   tmp = tracklist;
- *   tracklist = tracklist->next;
- *   LIBMTP_destroy_track_t(tmp);
- * }
- * </pre>
- *
- * If you want to group your track listing by storage (per storage unit) or
- * arrange tracks into folders, you must dereference the <code>storage_id</code>
- * and/or <code>parent_id</code> field of the returned <code>LIBMTP_track_t</code>
- * struct. To arrange by folders or files you typically have to create the proper
- * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or 
- * <code>LIBMTP_Get_Folder_List()</code> first.
- *
- * @param device a pointer to the device to get the track listing for.
- * @param storage_id ID of device storage (if null, no filter)
- * @param callback a function to be called during the tracklisting retrieveal
- *        for displaying progress bars etc, or NULL if you don't want
- *        any callbacks.
- * @param data a user-defined pointer that is passed along to
- *        the <code>progress</code> function in order to
- *        pass along some user defined data to the progress
- *        updates. If not used, set this to NULL.
- * @return a list of tracks that can be followed using the <code>next</code>
- *        field of the <code>LIBMTP_track_t</code> data structure.
- *        Each of the metadata tags must be freed after use, and may
- *        contain only partial metadata information, i.e. one or several
- *        fields may be NULL or 0.
- * @see LIBMTP_Get_Trackmetadata()
+ * This retrieves the manufacturer name of an MTP device.
+ * @param device a pointer to the device to get the manufacturer name for.
+ * @return a newly allocated UTF-8 string representing the manufacturer name.
+ *         The string must be freed by the caller after use. If the call
+ *         was unsuccessful this will contain NULL.
  */
-LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevice_t *device, uint32_t const storage_id,
-                                                      LIBMTP_progressfunc_t const callback,
-                                                      void const * const data)
+char *LIBMTP_Get_Manufacturername(LIBMTP_mtpdevice_t *device)
 {
-  uint32_t i = 0;
-  LIBMTP_track_t *retracks = NULL;
-  LIBMTP_track_t *curtrack = NULL;
+  char *retmanuf = NULL;
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
+  if (params->deviceinfo.Manufacturer != NULL) {
+    retmanuf = strdup(params->deviceinfo.Manufacturer);
   }
+  return retmanuf;
+}
 
-  for (i = 0; i < params->nrofobjects; i++) {
-    LIBMTP_track_t *track;
-    PTPObject *ob;
-    LIBMTP_filetype_t mtptype;
-
-    if (callback != NULL)
-      callback(i, params->nrofobjects, data);
-
-    ob = &params->objects[i];
-    mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+/**
+ * This retrieves the model name (often equal to product name)
+ * of an MTP device.
+ * @param device a pointer to the device to get the model name for.
+ * @return a newly allocated UTF-8 string representing the model name.
+ *         The string must be freed by the caller after use. If the call
+ *         was unsuccessful this will contain NULL.
+ */
+char *LIBMTP_Get_Modelname(LIBMTP_mtpdevice_t *device)
+{
+  char *retmodel = NULL;
+  PTPParams *params = (PTPParams *) device->params;
 
-    // Ignore stuff we don't know how to handle...
-    // TODO: get this list as an intersection of the sets
-    // supported by the device and the from the device and
-    // all known track files?
-    if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
-	// This row lets through undefined files for examination since they may be forgotten OGG files.
-	(ob->oi.ObjectFormat != PTP_OFC_Undefined ||
-	 (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
-	  !FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
-	  !FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
-	) {
-      //printf("Not a music track (name: %s format: %d), skipping...\n", oi->Filename, oi->ObjectFormat);
-      continue;
-    }
+  if (params->deviceinfo.Model != NULL) {
+    retmodel = strdup(params->deviceinfo.Model);
+  }
+  return retmodel;
+}
 
-	// Ignore stuff that isn't into the storage device
-	if ((storage_id != 0) && (ob->oi.StorageID != storage_id ))
-		continue;
+/**
+ * This retrieves the serial number of an MTP device.
+ * @param device a pointer to the device to get the serial number for.
+ * @return a newly allocated UTF-8 string representing the serial number.
+ *         The string must be freed by the caller after use. If the call
+ *         was unsuccessful this will contain NULL.
+ */
+char *LIBMTP_Get_Serialnumber(LIBMTP_mtpdevice_t *device)
+{
+  char *retnumber = NULL;
+  PTPParams *params = (PTPParams *) device->params;
 
-    // Allocate a new track type
-    track = LIBMTP_new_track_t();
+  if (params->deviceinfo.SerialNumber != NULL) {
+    retnumber = strdup(params->deviceinfo.SerialNumber);
+  }
+  return retnumber;
+}
 
-    // This is some sort of unique ID so we can keep track of the track.
-    track->item_id = ob->oid;
-    track->parent_id = ob->oi.ParentObject;
-    track->storage_id = ob->oi.StorageID;
-    track->modificationdate = ob->oi.ModificationDate;
+/**
+ * This retrieves the device version (hardware and firmware version) of an
+ * MTP device.
+ * @param device a pointer to the device to get the device version for.
+ * @return a newly allocated UTF-8 string representing the device version.
+ *         The string must be freed by the caller after use. If the call
+ *         was unsuccessful this will contain NULL.
+ */
+char *LIBMTP_Get_Deviceversion(LIBMTP_mtpdevice_t *device)
+{
+  char *retversion = NULL;
+  PTPParams *params = (PTPParams *) device->params;
 
-    track->filetype = mtptype;
+  if (params->deviceinfo.DeviceVersion != NULL) {
+    retversion = strdup(params->deviceinfo.DeviceVersion);
+  }
+  return retversion;
+}
 
-    // Original file-specific properties
-    track->filesize = ob->oi.ObjectCompressedSize;
-    if (ob->oi.Filename != NULL) {
-      track->filename = strdup(ob->oi.Filename);
-    }
 
-    get_track_metadata(device, ob->oi.ObjectFormat, track);
+/**
+ * This retrieves the "friendly name" of an MTP device. Usually
+ * this is simply the name of the owner or something like
+ * "John Doe's Digital Audio Player". This property should be supported
+ * by all MTP devices.
+ * @param device a pointer to the device to get the friendly name for.
+ * @return a newly allocated UTF-8 string representing the friendly name.
+ *         The string must be freed by the caller after use.
+ * @see LIBMTP_Set_Friendlyname()
+ */
+char *LIBMTP_Get_Friendlyname(LIBMTP_mtpdevice_t *device)
+{
+  PTPPropertyValue propval;
+  char *retstring = NULL;
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
 
-    /*
-     * A special quirk for iriver devices that doesn't quite
-     * remember that some files marked as "unknown" type are
-     * actually OGG or FLAC files. We look at the filename extension
-     * and see if it happens that this was atleast named "ogg" or "flac"
-     * and fall back on this heuristic approach in that case,
-     * for these bugged devices only.
-     */
-    if (track->filetype == LIBMTP_FILETYPE_UNKNOWN &&
-	track->filename != NULL) {
-      if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
-	   FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
-	  has_ogg_extension(track->filename))
-	track->filetype = LIBMTP_FILETYPE_OGG;
-      else if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) &&
-	       has_flac_extension(track->filename))
-	track->filetype = LIBMTP_FILETYPE_FLAC;
-      else {
-	// This was not an OGG/FLAC file so discard it and continue
-	LIBMTP_destroy_track_t(track);
-	continue;
-      }
-    }
+  if (!ptp_property_issupported(params, PTP_DPC_MTP_DeviceFriendlyName)) {
+    return NULL;
+  }
 
-    // Add track to a list that will be returned afterwards.
-    if (retracks == NULL) {
-      retracks = track;
-      curtrack = track;
-    } else {
-      curtrack->next = track;
-      curtrack = track;
-    }
+  ret = ptp_getdevicepropvalue(params,
+			       PTP_DPC_MTP_DeviceFriendlyName,
+			       &propval,
+			       PTP_DTC_STR);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "Error getting friendlyname.");
+    return NULL;
+  }
+  if (propval.str != NULL) {
+    retstring = strdup(propval.str);
+    free(propval.str);
+  }
+  return retstring;
+}
 
-    // Call listing callback
-    // double progressPercent = (double)i*(double)100.0 / (double)params->handles.n;
+/**
+ * Sets the "friendly name" of an MTP device.
+ * @param device a pointer to the device to set the friendly name for.
+ * @param friendlyname the new friendly name for the device.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Friendlyname()
+ */
+int LIBMTP_Set_Friendlyname(LIBMTP_mtpdevice_t *device,
+			 char const * const friendlyname)
+{
+  PTPPropertyValue propval;
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
 
-  } // Handle counting loop
-  return retracks;
+  if (!ptp_property_issupported(params, PTP_DPC_MTP_DeviceFriendlyName)) {
+    return -1;
+  }
+  propval.str = (char *) friendlyname;
+  ret = ptp_setdevicepropvalue(params,
+			       PTP_DPC_MTP_DeviceFriendlyName,
+			       &propval,
+			       PTP_DTC_STR);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "Error setting friendlyname.");
+    return -1;
+  }
+  return 0;
 }
 
 /**
- * This function retrieves the metadata for a single track off
- * the device.
- *
- * Do not call this function repeatedly! The track handles are linearly
- * searched O(n) and the call may involve (slow) USB traffic, so use
- * <code>LIBMTP_Get_Tracklisting()</code> and cache the tracks, preferably
- * as an efficient data structure such as a hash list.
- *
- * @param device a pointer to the device to get the track metadata from.
- * @param trackid the object ID of the track that you want the metadata for.
- * @return a track metadata entry on success or NULL on failure.
- * @see LIBMTP_Get_Tracklisting()
+ * This retrieves the synchronization partner of an MTP device. This
+ * property should be supported by all MTP devices.
+ * @param device a pointer to the device to get the sync partner for.
+ * @return a newly allocated UTF-8 string representing the synchronization
+ *         partner. The string must be freed by the caller after use.
+ * @see LIBMTP_Set_Syncpartner()
  */
-LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t const trackid)
+char *LIBMTP_Get_Syncpartner(LIBMTP_mtpdevice_t *device)
 {
+  PTPPropertyValue propval;
+  char *retstring = NULL;
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  PTPObject *ob;
-  LIBMTP_track_t *track;
-  LIBMTP_filetype_t mtptype;
   uint16_t ret;
 
-  // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0)
-    flush_handles(device);
-
-  ret = ptp_object_want (params, trackid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
-  if (ret != PTP_RC_OK)
+  if (!ptp_property_issupported(params, PTP_DPC_MTP_SynchronizationPartner)) {
     return NULL;
+  }
 
-  mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
-
-  // Ignore stuff we don't know how to handle...
-  if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
-      /*
-       * This row lets through undefined files for examination
-       * since they may be forgotten OGG or FLAC files.
-       */
-      (ob->oi.ObjectFormat != PTP_OFC_Undefined ||
-       (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
-	!FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
-	!FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
-      ) {
-    //printf("Not a music track (name: %s format: %d), skipping...\n", oi->Filename, oi->ObjectFormat);
+  ret = ptp_getdevicepropvalue(params,
+			       PTP_DPC_MTP_SynchronizationPartner,
+			       &propval,
+			       PTP_DTC_STR);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "Error getting syncpartner.");
     return NULL;
   }
+  if (propval.str != NULL) {
+    retstring = strdup(propval.str);
+    free(propval.str);
+  }
+  return retstring;
+}
 
-  // Allocate a new track type
-  track = LIBMTP_new_track_t();
-
-  // This is some sort of unique ID so we can keep track of the track.
-  track->item_id = ob->oid;
-  track->parent_id = ob->oi.ParentObject;
-  track->storage_id = ob->oi.StorageID;
-  track->modificationdate = ob->oi.ModificationDate;
-
-  track->filetype = mtptype;
-
-  // Original file-specific properties
-  track->filesize = ob->oi.ObjectCompressedSize;
-  if (ob->oi.Filename != NULL) {
-    track->filename = strdup(ob->oi.Filename);
-  }
-
-  /*
-   * A special quirk for devices that doesn't quite
-   * remember that some files marked as "unknown" type are
-   * actually OGG or FLAC files. We look at the filename extension
-   * and see if it happens that this was atleast named "ogg"
-   * and fall back on this heuristic approach in that case,
-   * for these bugged devices only.
-   */
-  if (track->filetype == LIBMTP_FILETYPE_UNKNOWN &&
-      track->filename != NULL) {
-    if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
-	 FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
-	has_ogg_extension(track->filename))
-      track->filetype = LIBMTP_FILETYPE_OGG;
-    else if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) &&
-	     has_flac_extension(track->filename))
-      track->filetype = LIBMTP_FILETYPE_FLAC;
-    else {
-      // This was not an OGG/FLAC file so discard it
-      LIBMTP_destroy_track_t(track);
-      return NULL;
-    }
-  }
-  get_track_metadata(device, ob->oi.ObjectFormat, track);
-  return track;
-}
 
 /**
- * This is a manual conversion from MTPDataGetFunc to PTPDataGetFunc
- * to isolate the internal type.
+ * Sets the synchronization partner of an MTP device. Note that
+ * we have no idea what the effect of setting this to "foobar"
+ * may be. But the general idea seems to be to tell which program
+ * shall synchronize with this device and tell others to leave
+ * it alone.
+ * @param device a pointer to the device to set the sync partner for.
+ * @param syncpartner the new synchronization partner for the device.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Syncpartner()
  */
-static uint16_t get_func_wrapper(PTPParams* params, void* priv, unsigned long wantlen, unsigned char *data, unsigned long *gotlen)
+int LIBMTP_Set_Syncpartner(LIBMTP_mtpdevice_t *device,
+			 char const * const syncpartner)
 {
-  MTPDataHandler *handler = (MTPDataHandler *)priv;
+  PTPPropertyValue propval;
+  PTPParams *params = (PTPParams *) device->params;
   uint16_t ret;
-  uint32_t local_gotlen = 0;
-  ret = handler->getfunc(params, handler->priv, wantlen, data, &local_gotlen);
-  *gotlen = local_gotlen;
-  switch (ret)
-  {
-    case LIBMTP_HANDLER_RETURN_OK:
-      return PTP_RC_OK;
-    case LIBMTP_HANDLER_RETURN_ERROR:
-      return PTP_ERROR_IO;
-    case LIBMTP_HANDLER_RETURN_CANCEL:
-      return PTP_ERROR_CANCEL;
-    default:
-      return PTP_ERROR_IO;
+
+  if (!ptp_property_issupported(params, PTP_DPC_MTP_SynchronizationPartner)) {
+    return -1;
+  }
+  propval.str = (char *) syncpartner;
+  ret = ptp_setdevicepropvalue(params,
+			       PTP_DPC_MTP_SynchronizationPartner,
+			       &propval,
+			       PTP_DTC_STR);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "Error setting syncpartner.");
+    return -1;
   }
+  return 0;
 }
 
 /**
- * This is a manual conversion from MTPDataPutFunc to PTPDataPutFunc
- * to isolate the internal type.
+ * Checks if the device can stora a file of this size or
+ * if it's too big.
+ * @param device a pointer to the device.
+ * @param filesize the size of the file to check whether it will fit.
+ * @param storageid the ID of the storage to try to fit the file on.
+ * @return 0 if the file fits, any other value means failure.
  */
-static uint16_t put_func_wrapper(PTPParams* params, void* priv, unsigned long sendlen, unsigned char *data)
-{
-  MTPDataHandler *handler = (MTPDataHandler *)priv;
-  uint16_t ret;
-  uint32_t local_putlen = 0;
+static int check_if_file_fits(LIBMTP_mtpdevice_t *device,
+			      LIBMTP_devicestorage_t *storage,
+			      uint64_t const filesize) {
+  PTPParams *params = (PTPParams *) device->params;
+  uint64_t freebytes;
+  int ret;
 
-  ret = handler->putfunc(params, handler->priv, sendlen, data, &local_putlen);
+  // If we cannot check the storage, no big deal.
+  if (!ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
+    return 0;
+  }
 
-  switch (ret)
-  {
-    case LIBMTP_HANDLER_RETURN_OK:
-      if (local_putlen != sendlen)
-	return PTP_ERROR_IO;
-      return PTP_RC_OK;
-    case LIBMTP_HANDLER_RETURN_ERROR:
-      return PTP_ERROR_IO;
-    case LIBMTP_HANDLER_RETURN_CANCEL:
-      return PTP_ERROR_CANCEL;
-    default:
-      return PTP_ERROR_IO;
+  ret = get_storage_freespace(device, storage, &freebytes);
+  if (ret != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "check_if_file_fits(): error checking free storage.");
+    return -1;
+  } else {
+    // See if it fits.
+    if (filesize > freebytes) {
+      return -1;
+    }
   }
+  return 0;
 }
 
+
 /**
- * This gets a file off the device to a local file identified
- * by a filename.
- * @param device a pointer to the device to get the track from.
- * @param id the file ID of the file to retrieve.
- * @param path a filename to use for the retrieved file.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Get_File_To_File_Descriptor()
+ * This function retrieves the current battery level on the device.
+ * @param device a pointer to the device to get the battery level for.
+ * @param maximum_level a pointer to a variable that will hold the
+ *        maximum level of the battery if the call was successful.
+ * @param current_level a pointer to a variable that will hold the
+ *        current level of the battery if the call was successful.
+ *        A value of 0 means that the device is on external power.
+ * @return 0 if the storage info was successfully retrieved, any other
+ *        means failure. A typical cause of failure is that
+ *        the device does not support the battery level property.
  */
-int LIBMTP_Get_File_To_File(LIBMTP_mtpdevice_t *device, uint32_t const id,
-			 char const * const path, LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+int LIBMTP_Get_Batterylevel(LIBMTP_mtpdevice_t *device,
+			    uint8_t * const maximum_level,
+			    uint8_t * const current_level)
 {
-  int fd = -1;
-  int ret;
+  PTPPropertyValue propval;
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  // Sanity check
-  if (path == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File(): Bad arguments, path was NULL.");
+  *maximum_level = 0;
+  *current_level = 0;
+
+  if (FLAG_BROKEN_BATTERY_LEVEL(ptp_usb) ||
+      !ptp_property_issupported(params, PTP_DPC_BatteryLevel)) {
     return -1;
   }
 
-  // Open file
-#ifdef __WIN32__
-#ifdef USE_WINDOWS_IO_H
-  if ( (fd = _open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,_S_IREAD)) == -1 ) {
-#else
-  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,S_IRWXU)) == -1 ) {
-#endif
-#else
-  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP)) == -1) {
-#endif
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File(): Could not create file.");
+  ret = ptp_getdevicepropvalue(params, PTP_DPC_BatteryLevel,
+			       &propval, PTP_DTC_UINT8);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret,
+				"LIBMTP_Get_Batterylevel(): "
+				"could not get device property value.");
     return -1;
   }
 
-  ret = LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data);
-
-  // Close file
-  close(fd);
-
-  // Delete partial file.
-  if (ret == -1) {
-    unlink(path);
+  // Not probed yet when the device was opened with fast open
+  if (device->maximum_battery_level == 0) {
+    probe_battery_level(device);
+    remember_capabilities(device);
   }
+  *maximum_level = device->maximum_battery_level;
+  *current_level = propval.u8;
 
-  return ret;
+  return 0;
 }
 
+
 /**
- * This gets a file off the device to a file identified
- * by a file descriptor.
- *
- * This function can potentially be used for streaming
- * files off the device for playback or broadcast for example,
- * by downloading the file into a stream sink e.g. a socket.
+ * Formats device storage (if the device supports the operation).
+ * WARNING: This WILL delete all data from the device. Make sure you've
+ * got confirmation from the user BEFORE you call this function.
  *
- * @param device a pointer to the device to get the file from.
- * @param id the file ID of the file to retrieve.
- * @param fd a local file descriptor to write the file to.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Get_File_To_File()
+ * @param device a pointer to the device containing the storage to format.
+ * @param storage the actual storage to format.
+ * @return 0 on success, any other value means failure.
  */
-int LIBMTP_Get_File_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
-					uint32_t const id,
-					int const fd,
-					LIBMTP_progressfunc_t const callback,
-					void const * const data)
+int LIBMTP_Format_Storage(LIBMTP_mtpdevice_t *device,
+			  LIBMTP_devicestorage_t *storage)
 {
   uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
 
-  LIBMTP_file_t *mtpfile = LIBMTP_Get_Filemetadata(device, id);
-  if (mtpfile == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
+  if (!ptp_operation_issupported(params,PTP_OC_FormatStore)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Format_Storage(): "
+			    "device does not support formatting storage.");
     return -1;
   }
-  if (mtpfile->filetype == LIBMTP_FILETYPE_FOLDER) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
-    LIBMTP_destroy_file_t (mtpfile);
+  ret = ptp_formatstore(params, storage->id);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Format_Storage(): "
+				"failed to format storage.");
     return -1;
   }
-
-  // Callbacks
-  ptp_usb->callback_active = 1;
-  ptp_usb->current_transfer_total = mtpfile->filesize +
-    PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
-  ptp_usb->current_transfer_complete = 0;
-  ptp_usb->current_transfer_callback = callback;
-  ptp_usb->current_transfer_callback_data = data;
-
-  // Don't need mtpfile anymore
-  LIBMTP_destroy_file_t(mtpfile);
-
-  ret = ptp_getobject_tofd(params, id, fd);
-
-  ptp_usb->callback_active = 0;
-  ptp_usb->current_transfer_callback = NULL;
-  ptp_usb->current_transfer_callback_data = NULL;
-
-  if (ret == PTP_ERROR_CANCEL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_From_File_Descriptor(): Cancelled transfer.");
-    return -1;
-  }
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_File_Descriptor(): Could not get file from device.");
-    return -1;
-  }
-
-  return 0;
-}
+  return 0;
+}
 
 /**
- * This gets a file off the device and calls put_func
- * with chunks of data
- *
- * @param device a pointer to the device to get the file from.
- * @param id the file ID of the file to retrieve.
- * @param put_func the function to call when we have data.
- * @param priv the user-defined pointer that is passed to
- *             <code>put_func</code>.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
+ * Helper function to extract a unicode property off a device.
+ * This is the standard way of retrieveing unicode device
+ * properties as described by the PTP spec.
+ * @param device a pointer to the device to get the property from.
+ * @param unicstring a pointer to a pointer that will hold the
+ *        property after this call is completed.
+ * @param property the property to retrieve.
+ * @return 0 on success, any other value means failure.
  */
-int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t *device,
-					uint32_t const id,
-					MTPDataPutFunc put_func,
-          void * priv,
-					LIBMTP_progressfunc_t const callback,
-					void const * const data)
+static int get_device_unicode_property(LIBMTP_mtpdevice_t *device,
+				       char **unicstring, uint16_t property)
 {
-  uint16_t ret;
+  PTPPropertyValue propval;
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t *tmp;
+  uint16_t ret;
+  unsigned int i;
 
-  LIBMTP_file_t *mtpfile = LIBMTP_Get_Filemetadata(device, id);
-  if (mtpfile == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
+  if (!ptp_property_issupported(params, property)) {
     return -1;
   }
-  if (mtpfile->filetype == LIBMTP_FILETYPE_FOLDER) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
-    LIBMTP_destroy_file_t (mtpfile);
+
+  // Unicode strings are 16bit unsigned integer arrays.
+  ret = ptp_getdevicepropvalue(params,
+			       property,
+			       &propval,
+			       PTP_DTC_AUINT16);
+  if (ret != PTP_RC_OK) {
+    // TODO: add a note on WHICH property that we failed to get.
+    *unicstring = NULL;
+    add_ptp_error_to_errorstack(device, ret,
+				"get_device_unicode_property(): "
+				"failed to get unicode property.");
     return -1;
   }
 
-  // Callbacks
-  ptp_usb->callback_active = 1;
-  ptp_usb->current_transfer_total = mtpfile->filesize +
-    PTP_USB_BULK_HDR_LEN+sizeof(uint32_t); // Request length, one parameter
-  ptp_usb->current_transfer_complete = 0;
-  ptp_usb->current_transfer_callback = callback;
-  ptp_usb->current_transfer_callback_data = data;
-
-  // Don't need mtpfile anymore
-  LIBMTP_destroy_file_t(mtpfile);
-
-  MTPDataHandler mtp_handler;
-  mtp_handler.getfunc = NULL;
-  mtp_handler.putfunc = put_func;
-  mtp_handler.priv = priv;
-
-  PTPDataHandler handler;
-  handler.getfunc = NULL;
-  handler.putfunc = put_func_wrapper;
-  handler.priv = &mtp_handler;
-
-  ret = ptp_getobject_to_handler(params, id, &handler);
+  // Extract the actual array.
+  // printf("Array of %d elements\n", propval.a.count);
+  tmp = malloc((propval.a.count + 1)*sizeof(uint16_t));
+  for (i = 0; i < propval.a.count; i++) {
+    tmp[i] = propval.a.v[i].u16;
+    // printf("%04x ", tmp[i]);
+  }
+  tmp[propval.a.count] = 0x0000U;
+  free(propval.a.v);
 
-  ptp_usb->callback_active = 0;
-  ptp_usb->current_transfer_callback = NULL;
-  ptp_usb->current_transfer_callback_data = NULL;
+  *unicstring = utf16_to_utf8(device, tmp);
 
-  if (ret == PTP_ERROR_CANCEL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_From_File_Descriptor(): Cancelled transfer.");
-    return -1;
-  }
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_File_Descriptor(): Could not get file from device.");
-    return -1;
-  }
+  free(tmp);
 
   return 0;
 }
 
-
 /**
- * This gets a track off the device to a file identified
- * by a filename. This is actually just a wrapper for the
- * \c LIBMTP_Get_Track_To_File() function.
- * @param device a pointer to the device to get the track from.
- * @param id the track ID of the track to retrieve.
- * @param path a filename to use for the retrieved track.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Get_Track_To_File_Descriptor()
+ * This function returns the secure time as an XML document string from
+ * the device.
+ * @param device a pointer to the device to get the secure time for.
+ * @param sectime the secure time string as an XML document or NULL if the call
+ *         failed or the secure time property is not supported. This string
+ *         must be <code>free()</code>:ed by the caller after use.
+ * @return 0 on success, any other value means failure.
  */
-int LIBMTP_Get_Track_To_File(LIBMTP_mtpdevice_t *device, uint32_t const id,
-			 char const * const path, LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+int LIBMTP_Get_Secure_Time(LIBMTP_mtpdevice_t *device, char ** const sectime)
 {
-  // This is just a wrapper
-  return LIBMTP_Get_File_To_File(device, id, path, callback, data);
+  return get_device_unicode_property(device, sectime, PTP_DPC_MTP_SecureTime);
 }
 
 /**
- * This gets a track off the device to a file identified
- * by a file descriptor. This is actually just a wrapper for
- * the \c LIBMTP_Get_File_To_File_Descriptor() function.
- * @param device a pointer to the device to get the track from.
- * @param id the track ID of the track to retrieve.
- * @param fd a file descriptor to write the track to.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Get_Track_To_File()
+ * This function returns the device (public key) certificate as an
+ * XML document string from the device.
+ * @param device a pointer to the device to get the device certificate for.
+ * @param devcert the device certificate as an XML string or NULL if the call
+ *        failed or the device certificate property is not supported. This
+ *        string must be <code>free()</code>:ed by the caller after use.
+ * @return 0 on success, any other value means failure.
  */
-int LIBMTP_Get_Track_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
-					uint32_t const id,
-					int const fd,
-					LIBMTP_progressfunc_t const callback,
-					void const * const data)
+int LIBMTP_Get_Device_Certificate(LIBMTP_mtpdevice_t *device, char ** const devcert)
 {
-  // This is just a wrapper
-  return LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data);
+  return get_device_unicode_property(device, devcert,
+				     PTP_DPC_MTP_DeviceCertificate);
 }
 
 /**
- * This gets a track off the device to a handler function.
- * This is actually just a wrapper for
- * the \c LIBMTP_Get_File_To_Handler() function.
- * @param device a pointer to the device to get the track from.
- * @param id the track ID of the track to retrieve.
- * @param put_func the function to call when we have data.
- * @param priv the user-defined pointer that is passed to
- *             <code>put_func</code>.
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
+ * This function retrieves a list of supported file types, i.e. the file
+ * types that this device claims it supports, e.g. audio file types that
+ * the device can play etc. This list is mitigated to
+ * include the file types that libmtp can handle, i.e. it will not list
+ * filetypes that libmtp will handle internally like playlists and folders.
+ * @param device a pointer to the device to get the filetype capabilities for.
+ * @param filetypes a pointer to a pointer that will hold the list of
+ *        supported filetypes if the call was successful. This list must
+ *        be <code>free()</code>:ed by the caller after use.
+ * @param length a pointer to a variable that will hold the length of the
+ *        list of supported filetypes if the call was successful.
+ * @return 0 on success, any other value means failure.
+ * @see LIBMTP_Get_Filetype_Description()
  */
-int LIBMTP_Get_Track_To_Handler(LIBMTP_mtpdevice_t *device,
-					uint32_t const id,
-					MTPDataPutFunc put_func,
-          void * priv,
-					LIBMTP_progressfunc_t const callback,
-					void const * const data)
+int LIBMTP_Get_Supported_Filetypes(LIBMTP_mtpdevice_t *device, uint16_t ** const filetypes,
+				  uint16_t * const length)
 {
-  // This is just a wrapper
-  return LIBMTP_Get_File_To_Handler(device, id, put_func, priv, callback, data);
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t *localtypes;
+  uint16_t localtypelen;
+  uint32_t i;
+
+  // This is more memory than needed if there are unknown types, but what the heck.
+  localtypes = (uint16_t *) malloc(params->deviceinfo.ImageFormats_len * sizeof(uint16_t));
+  localtypelen = 0;
+
+  for (i=0;i<params->deviceinfo.ImageFormats_len;i++) {
+    uint16_t localtype = map_ptp_type_to_libmtp_type(params->deviceinfo.ImageFormats[i]);
+    if (localtype != LIBMTP_FILETYPE_UNKNOWN) {
+      localtypes[localtypelen] = localtype;
+      localtypelen++;
+    }
+  }
+  // The forgotten Ogg support on YP-10 and others...
+  if (FLAG_OGG_IS_UNKNOWN(ptp_usb)) {
+    uint16_t *tmp = (uint16_t *) realloc(
+        localtypes, (params->deviceinfo.ImageFormats_len+1) * sizeof(uint16_t));
+    if (tmp == NULL)
+      return -ENOMEM;
+    localtypes = tmp;
+    localtypes[localtypelen] = LIBMTP_FILETYPE_OGG;
+    localtypelen++;
+  }
+  // The forgotten FLAC support on Cowon iAudio S9 and others...
+  if (FLAG_FLAC_IS_UNKNOWN(ptp_usb)) {
+    uint16_t *tmp = (uint16_t *) realloc(
+        localtypes, (params->deviceinfo.ImageFormats_len+1) * sizeof(uint16_t));
+    if (tmp == NULL)
+      return -ENOMEM;
+    localtypes = tmp;
+    localtypes[localtypelen] = LIBMTP_FILETYPE_FLAC;
+    localtypelen++;
+  }
+
+  *filetypes = localtypes;
+  *length = localtypelen;
+
+  return 0;
 }
 
 /**
- * This function sends a track from a local file to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
- * @param device a pointer to the device to send the track to.
+ * This function checks if the device has some specific capabilities, in
+ * order to avoid calling APIs that may disturb the device.
+ *
+ * @param device a pointer to the device to check the capability on.
+ * @param cap the capability to check.
+ * @return 0 if not supported, any other value means the device has the
+ * requested capability.
+ */
+int LIBMTP_Check_Capability(LIBMTP_mtpdevice_t *device, LIBMTP_devicecap_t cap)
+{
+  switch (cap) {
+  case LIBMTP_DEVICECAP_GetPartialObject:
+    return (ptp_operation_issupported(device->params,
+				      PTP_OC_GetPartialObject) ||
+	    ptp_operation_issupported(device->params,
+				      PTP_OC_ANDROID_GetPartialObject64));
+  case LIBMTP_DEVICECAP_SendPartialObject:
+    return ptp_operation_issupported(device->params,
+				     PTP_OC_ANDROID_SendPartialObject);
+  case LIBMTP_DEVICECAP_EditObjects:
+    return (ptp_operation_issupported(device->params,
+				      PTP_OC_ANDROID_TruncateObject) &&
+	    ptp_operation_issupported(device->params,
+				      PTP_OC_ANDROID_BeginEditObject) &&
+	    ptp_operation_issupported(device->params,
+				      PTP_OC_ANDROID_EndEditObject));
+  case LIBMTP_DEVICECAP_MoveObject:
+    return ptp_operation_issupported(device->params,
+				     PTP_OC_MoveObject);
+  case LIBMTP_DEVICECAP_CopyObject:
+    return ptp_operation_issupported(device->params,
+				     PTP_OC_CopyObject);
+  /*
+   * Handle other capabilities here, this is also a good place to
+   * blacklist some advanced operations on specific devices if need
+   * be.
+   */
+
+  default:
+    break;
+  }
+  return 0;
+}
+
+/**
+ * This function updates all the storage id's of a device and their
+ * properties, then creates a linked list and puts the list head into
+ * the device struct. It also optionally sorts this list. If you want
+ * to display storage information in your application you should call
+ * this function, then dereference the device struct
+ * (<code>device-&gt;storage</code>) to get out information on the storage.
+ *
+ * You need to call this every time you want to update the
+ * <code>device-&gt;storage</code> list, for example anytime you need
+ * to check available storage somewhere.
+ *
+ * <b>WARNING:</b> since this list is dynamically updated, do not
+ * reference its fields in external applications by pointer! E.g
+ * do not put a reference to any <code>char *</code> field. instead
+ * <code>strncpy()</code> it!
+ *
+ * @param device a pointer to the device to get the storage for.
+ * @param sortby an integer that determines the sorting of the storage list.
+ *        Valid sort methods are defined in libmtp.h with beginning with
+ *        LIBMTP_STORAGE_SORTBY_. 0 or LIBMTP_STORAGE_SORTBY_NOTSORTED to not
+ *        sort.
+ * @return 0 on success, 1 success but only with storage id's, storage
+ *        properities could not be retrieved and -1 means failure.
+ */
+int LIBMTP_Get_Storage(LIBMTP_mtpdevice_t *device, int const sortby)
+{
+  uint32_t i = 0;
+  PTPStorageInfo storageInfo;
+  PTPParams *params = (PTPParams *) device->params;
+  PTPStorageIDs storageIDs;
+  LIBMTP_devicestorage_t *storage = NULL;
+  LIBMTP_devicestorage_t *storageprev = NULL;
+
+  if (device->storage != NULL)
+    free_storage_list(device);
+
+  // if (!ptp_operation_issupported(params,PTP_OC_GetStorageIDs))
+  //   return -1;
+  if (ptp_getstorageids (params, &storageIDs) != PTP_RC_OK)
+    return -1;
+  if (storageIDs.n < 1)
+    return -1;
+
+  if (!ptp_operation_issupported(params,PTP_OC_GetStorageInfo)) {
+    for (i = 0; i < storageIDs.n; i++) {
+
+      storage = (LIBMTP_devicestorage_t *)
+	malloc(sizeof(LIBMTP_devicestorage_t));
+      storage->prev = storageprev;
+      if (storageprev != NULL)
+        storageprev->next = storage;
+      if (device->storage == NULL)
+        device->storage = storage;
+
+      storage->id = storageIDs.Storage[i];
+      storage->StorageType = PTP_ST_Undefined;
+      storage->FilesystemType = PTP_FST_Undefined;
+      storage->AccessCapability = PTP_AC_ReadWrite;
+      storage->MaxCapacity = (uint64_t) -1;
+      storage->FreeSpaceInBytes = (uint64_t) -1;
+      storage->FreeSpaceInObjects = (uint64_t) -1;
+      storage->StorageDescription = strdup("Unknown storage");
+      storage->VolumeIdentifier = strdup("Unknown volume");
+      storage->next = NULL;
+
+      storageprev = storage;
+    }
+    free(storageIDs.Storage);
+    return 1;
+  } else {
+    for (i = 0; i < storageIDs.n; i++) {
+      uint16_t ret;
+      ret = ptp_getstorageinfo(params, storageIDs.Storage[i], &storageInfo);
+      if (ret != PTP_RC_OK) {
+	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Storage(): "
+				    "Could not get storage info.");
+	if (device->storage != NULL) {
+          free_storage_list(device);
+	}
+	return -1;
+      }
+
+      storage = (LIBMTP_devicestorage_t *)
+	malloc(sizeof(LIBMTP_devicestorage_t));
+      storage->prev = storageprev;
+      if (storageprev != NULL)
+        storageprev->next = storage;
+      if (device->storage == NULL)
+        device->storage = storage;
+
+      storage->id = storageIDs.Storage[i];
+      storage->StorageType = storageInfo.StorageType;
+      storage->FilesystemType = storageInfo.FilesystemType;
+      storage->AccessCapability = storageInfo.AccessCapability;
+      storage->MaxCapacity = storageInfo.MaxCapability;
+      storage->FreeSpaceInBytes = storageInfo.FreeSpaceInBytes;
+      storage->FreeSpaceInObjects = storageInfo.FreeSpaceInImages;
+      storage->StorageDescription = storageInfo.StorageDescription;
+      storage->VolumeIdentifier = storageInfo.VolumeLabel;
+      storage->next = NULL;
+      freespace_checked(device, storage->id);
+
+      storageprev = storage;
+    }
+
+    if (storage != NULL)
+      storage->next = NULL;
+
+    sort_storage_by(device,sortby);
+    free(storageIDs.Storage);
+    return 0;
+  }
+}
+
+/**
+ * This creates a new file metadata structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_destroy_file_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings, e.g.:
+ *
+ * <pre>
+ * LIBMTP_file_t *file = LIBMTP_new_file_t();
+ * file->filename = strdup(namestr);
+ * ....
+ * LIBMTP_destroy_file_t(file);
+ * </pre>
+ *
+ * @return a pointer to the newly allocated metadata structure.
+ * @see LIBMTP_destroy_file_t()
+ */
+LIBMTP_file_t *LIBMTP_new_file_t(void)
+{
+  LIBMTP_file_t *new = (LIBMTP_file_t *) malloc(sizeof(LIBMTP_file_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->filename = NULL;
+  new->item_id = 0;
+  new->parent_id = 0;
+  new->storage_id = 0;
+  new->filesize = 0;
+  new->modificationdate = 0;
+  new->filetype = LIBMTP_FILETYPE_UNKNOWN;
+  new->next = NULL;
+  return new;
+}
+
+/**
+ * This destroys a file metadata structure and deallocates the memory
+ * used by it, including any strings. Never use a file metadata
+ * structure again after calling this function on it.
+ * @param file the file metadata to destroy.
+ * @see LIBMTP_new_file_t()
+ */
+void LIBMTP_destroy_file_t(LIBMTP_file_t *file)
+{
+  if (file == NULL) {
+    return;
+  }
+  if (file->filename != NULL)
+    free(file->filename);
+  free(file);
+  return;
+}
+
+/**
+ * Helper function that asks the device for the size of a file that
+ * <code>obj2file()</code> could not find a good size for in the cache.
+ * This does device I/O, so it must not be called with the objects
+ * read lock held.
+ */
+static void get_file_size_from_device(LIBMTP_mtpdevice_t *device,
+				      LIBMTP_file_t *file)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t *props = NULL;
+  uint32_t propcnt = 0;
+  unsigned int i;
+  int ret;
+
+  // First see which properties can be retrieved for this object format
+  ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(file->filetype), &propcnt, &props);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "obj2file: call to ptp_mtp_getobjectpropssupported() failed.");
+    // Silently fall through.
+    return;
+  }
+  for (i = 0; i < propcnt; i++) {
+    switch (props[i]) {
+    case PTP_OPC_ObjectSize:
+      if (device->object_bitsize == 64) {
+	file->filesize = get_u64_from_object(device, file->item_id, PTP_OPC_ObjectSize, 0);
+      } else {
+	file->filesize = get_u32_from_object(device, file->item_id, PTP_OPC_ObjectSize, 0);
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  free(props);
+}
+
+/**
+ * Helper function that takes one PTP object and creates a
+ * LIBMTP_file_t metadata entry. This only copies what is in the
+ * cache, so it can run under the objects read lock; if the cache has
+ * no good size for the file, <code>ask_device</code> is set and the
+ * caller should get it with <code>get_file_size_from_device()</code>
+ * once the lock is released.
+ */
+static LIBMTP_file_t *obj2file(LIBMTP_mtpdevice_t *device, PTPObject *ob,
+			       int *ask_device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *file;
+  unsigned int i;
+
+  *ask_device = 0;
+
+  // Allocate a new file type
+  file = LIBMTP_new_file_t();
+
+  file->parent_id = ob->oi.ParentObject;
+  file->storage_id = ob->oi.StorageID;
+
+  if (ob->oi.Filename != NULL) {
+    file->filename = strdup(ob->oi.Filename);
+  }
+
+  // Set the filetype
+  file->filetype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+
+  /*
+   * A special quirk for devices that doesn't quite
+   * remember that some files marked as "unknown" type are
+   * actually OGG or FLAC files. We look at the filename extension
+   * and see if it happens that this was atleast named "ogg" or "flac"
+   * and fall back on this heuristic approach in that case,
+   * for these bugged devices only.
+   */
+  if (file->filetype == LIBMTP_FILETYPE_UNKNOWN) {
+    if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
+        FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
+        has_ogg_extension(file->filename)) {
+      file->filetype = LIBMTP_FILETYPE_OGG;
+    }
+
+    if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && has_flac_extension(file->filename)) {
+        file->filetype = LIBMTP_FILETYPE_FLAC;
+    }
+  }
+
+  // Set the modification date
+  file->modificationdate = ob->oi.ModificationDate;
+
+  // This is the whole 64-bit size if it came as PTP_OPC_ObjectSize
+  file->filesize = ob->oi.ObjectCompressedSize;
+
+  // This is a unique ID so we can keep track of the file.
+  file->item_id = ob->oid;
+
+  // Then there is no better size to look for
+  if (ob->flags & PTPOBJECT_OBJECTSIZE_LOADED) {
+    return file;
+  }
+
+  /*
+   * If we have a cached, large set of metadata, then use it!
+   */
+  if (ob->mtpprops || (ob->flags & PTPOBJECT_MTPPROPLIST_LOADED)) {
+    MTPProperties *prop = ob->mtpprops;
+
+    for (i=0; i < ob->nrofmtpprops; i++, prop++) {
+      // Pick ObjectSize here...
+      if (prop->property == PTP_OPC_ObjectSize) {
+	// This may already be set, but this 64bit precision value
+	// is better than the PTP 32bit value, so let it override.
+	if (device->object_bitsize == 64) {
+	  file->filesize = prop->propval.u64;
+	} else {
+	  file->filesize = prop->propval.u32;
+	}
+	break;
+      }
+    }
+  } else if (!(ob->flags & PTPOBJECT_COREPROPS_LOADED) &&
+	     ptp_operation_issupported(params,PTP_OC_MTP_GetObjectPropsSupported)) {
+    *ask_device = 1;
+  }
+
+  return file;
+}
+
+
+/**
+ * This function retrieves the metadata for a single file off
+ * the device.
+ *
+ * Do not call this function repeatedly! The file handles are linearly
+ * searched O(n) and the call may involve (slow) USB traffic, so use
+ * <code>LIBMTP_Get_Filelisting()</code> and cache the file, preferably
+ * as an efficient data structure such as a hash list.
+ *
+ * Incidentally this function will return metadata for
+ * a folder (association) as well, but this is not a proper use
+ * of it, it is intended for file manipulation, not folder manipulation.
+ *
+ * @param device a pointer to the device to get the file metadata from.
+ * @param fileid the object ID of the file that you want the metadata for.
+ * @return a metadata entry on success or NULL on failure.
+ * @see LIBMTP_Get_Filelisting()
+ */
+LIBMTP_file_t *LIBMTP_Get_Filemetadata(LIBMTP_mtpdevice_t *device, uint32_t const fileid)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_file_t *file = NULL;
+  int ask_device = 0;
+  uint16_t ret;
+  PTPObject *ob;
+
+  // Get all the handles if we haven't already done that
+  // (Only on cached devices.)
+  update_cache(device);
+
+  // The core tier is all obj2file() looks at
+  ret = ptp_object_want(params, fileid, PTPOBJECT_COREPROPS_LOADED, &ob);
+  if (ret != PTP_RC_OK)
+    return NULL;
+
+  // Copy it out where no other thread can change or drop it meanwhile
+  ptp_lock(params, PTP_LOCK_OBJECTS_READ);
+  if (ptp_object_find(params, fileid, &ob) == PTP_RC_OK)
+    file = obj2file(device, ob, &ask_device);
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  // Readers may not do transactions, so the copy is filled in afterwards
+  if (file != NULL && ask_device)
+    get_file_size_from_device(device, file);
+  return file;
+}
+
+static void nonblocking_metadata_done(PTPParams *params, PTPContainer *resp,
+				      uint16_t ret, void *data)
+{
+  nonblocking_op_t *op = (nonblocking_op_t *) data;
+  LIBMTP_file_t *file = NULL;
+  int ask_device = 0;
+  PTPObject *ob;
+  int result;
+
+  result = nonblocking_result(op->device, ret,
+			      "LIBMTP_Get_Filemetadata_Nonblocking(): "
+			      "could not get object properties.");
+  if (result == 0) {
+    ptp_lock(params, PTP_LOCK_OBJECTS_READ);
+    if (ptp_object_find(params, op->id, &ob) == PTP_RC_OK)
+      file = obj2file(op->device, ob, &ask_device);
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+    if (file != NULL && ask_device)
+      get_file_size_from_device(op->device, file);
+    if (file == NULL) {
+      add_error_to_errorstack(op->device, LIBMTP_ERROR_GENERAL,
+			      "LIBMTP_Get_Filemetadata_Nonblocking(): "
+			      "no such object.");
+      result = -1;
+    }
+  }
+  op->metadata_cb(op->device, result, file, op->user_data);
+  free(op);
+}
+
+/**
+ * This function retrieves the metadata for a single file off
+ * the device without blocking, like
+ * <code>LIBMTP_Get_Filemetadata()</code> but always asking the
+ * device. The request is only started here and the callback is
+ * called once the answer is in, from within
+ * <code>LIBMTP_Handle_Events_Timeout_Completed()</code>.
+ *
+ * Only one non-blocking operation at a time can be underway on a
+ * device, and no other calls on the device may be made until its
+ * callback has been called. This works with libusb-1.0 only, on
+ * devices supporting the MTP object property lists, and not on devices
+ * opened with <code>LIBMTP_Open_Raw_Device_Worker()</code>.
+ *
+ * @param device a pointer to the device to get the file metadata from.
+ * @param fileid the object ID of the file that you want the metadata for.
+ * @param cb the callback, which is handed 0 and the metadata on
+ *        success, which it has to destroy with
+ *        <code>LIBMTP_destroy_file_t()</code>, or any other value
+ *        and NULL on failure.
+ * @param user_data arbitrary user data passed to the callback.
+ * @return 0 on success, any other value means that the request was not
+ *         started and the callback will not be called.
+ * @see LIBMTP_Get_Pollfds()
+ */
+int LIBMTP_Get_Filemetadata_Nonblocking(LIBMTP_mtpdevice_t *device,
+					uint32_t const fileid,
+					LIBMTP_filemetadata_cb_fn cb,
+					void *user_data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  nonblocking_op_t *op;
+  uint16_t ret;
+
+  if (!ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList) ||
+      FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Get_Filemetadata_Nonblocking(): "
+			    "device has no usable object property lists.");
+    return -1;
+  }
+  op = (nonblocking_op_t *) calloc(1, sizeof(nonblocking_op_t));
+  if (op == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Get_Filemetadata_Nonblocking(): "
+			    "out of memory.");
+    return -1;
+  }
+  op->device = device;
+  op->metadata_cb = cb;
+  op->user_data = user_data;
+  op->id = fileid;
+  ret = ptp_mtp_getobjectproplist_cache_async(params, fileid, 0,
+					      nonblocking_metadata_done, op);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret,
+				"LIBMTP_Get_Filemetadata_Nonblocking(): "
+				"could not start the request.");
+    free(op);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
+ * NOT TO USE IT.
+ * @see LIBMTP_Get_Filelisting_With_Callback()
+ */
+LIBMTP_file_t *LIBMTP_Get_Filelisting(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_INFO("WARNING: LIBMTP_Get_Filelisting() is deprecated.\n");
+  LIBMTP_INFO("WARNING: please update your code to use LIBMTP_Get_Filelisting_With_Callback()\n");
+  return LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
+}
+
+/**
+ * This returns a long list of all files available
+ * on the current MTP device. Folders will not be returned, but abstract
+ * entities like playlists and albums will show up as "files". Typical usage:
+ *
+ * <pre>
+ * LIBMTP_file_t *filelist;
+ *
+ * filelist = LIBMTP_Get_Filelisting_With_Callback(device, callback, data);
+ * while (filelist != NULL) {
+ *   LIBMTP_file_t *tmp;
+ *
+ *   // Do something on each element in the list here...
+ *   tmp = filelist;
+ *   filelist = filelist->next;
+ *   LIBMTP_destroy_file_t(tmp);
+ * }
+ * </pre>
+ *
+ * If you want to group your file listing by storage (per storage unit) or
+ * arrange files into folders, you must dereference the <code>storage_id</code>
+ * and/or <code>parent_id</code> field of the returned <code>LIBMTP_file_t</code>
+ * struct. To arrange by folders or files you typically have to create the proper
+ * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or
+ * <code>LIBMTP_Get_Folder_List()</code> first.
+ *
+ * @param device a pointer to the device to get the file listing for.
+ * @param callback a function to be called during the tracklisting retrieveal
+ *        for displaying progress bars etc, or NULL if you don't want
+ *        any callbacks.
+ * @param data a user-defined pointer that is passed along to
+ *        the <code>progress</code> function in order to
+ *        pass along some user defined data to the progress
+ *        updates. If not used, set this to NULL.
+ * @return a list of files that can be followed using the <code>next</code>
+ *        field of the <code>LIBMTP_file_t</code> data structure.
+ *        Each of the metadata tags must be freed after use, and may
+ *        contain only partial metadata information, i.e. one or several
+ *        fields may be NULL or 0.
+ * @see LIBMTP_Get_Filemetadata()
+ */
+LIBMTP_file_t *LIBMTP_Get_Filelisting_With_Callback(LIBMTP_mtpdevice_t *device,
+                                                    LIBMTP_progressfunc_t const callback,
+                                                    void const * const data)
+{
+  uint32_t i = 0;
+  LIBMTP_file_t *retfiles = NULL;
+  LIBMTP_file_t *curfile = NULL;
+  PTPParams *params = (PTPParams *) device->params;
+  const PTPObjectColumns *cols;
+
+  // Get all the handles if we haven't already done that
+  update_cache(device);
+  // Nothing may change the cache while walking it
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  cols = ptp_object_columns(params);
+
+  for (i = 0; i < params->nrofobjects; i++) {
+    LIBMTP_file_t *file;
+    int ask_device;
+    PTPObject *ob;
+
+    if (callback != NULL)
+      callback(i, params->nrofobjects, data);
+
+    // Folders are sorted out without touching the object
+    if (cols != NULL && cols->generation == params->objects_generation &&
+	cols->format[i] == PTP_OFC_Association)
+      continue;
+
+    ob = params->objects[i];
+
+    if (ob->oi.ObjectFormat == PTP_OFC_Association) {
+      // MTP use this object format for folders which means
+      // these "files" will turn up on a folder listing instead.
+      continue;
+    }
+
+    // Look up metadata
+    file = obj2file(device, ob, &ask_device);
+    if (file == NULL) {
+      continue;
+    }
+    // Writers hold the transaction lock, so this may ask right away
+    if (ask_device)
+      get_file_size_from_device(device, file);
+
+    // Add track to a list that will be returned afterwards.
+    if (retfiles == NULL) {
+      retfiles = file;
+      curfile = file;
+    } else {
+      curfile->next = file;
+      curfile = file;
+    }
+
+    // Call listing callback
+    // double progressPercent = (double)i*(double)100.0 / (double)params->handles.n;
+
+  } // Handle counting loop
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  return retfiles;
+}
+
+/**
+ * An iteration over the object cache, see
+ * LIBMTP_Begin_Object_Iteration(). It keeps its place by the index and
+ * ID of the last object it looked at, so that objects added to or
+ * removed from the cache between two steps cost no more than a search
+ * for that object.
+ */
+struct LIBMTP_object_iterator_struct {
+  LIBMTP_mtpdevice_t *device;
+  uint32_t storage_id;
+  LIBMTP_iterate_t what;
+  LIBMTP_filetype_t filetype;
+  unsigned int next; /**< Index of the next object to look at */
+  uint32_t last_id; /**< ID of the object before it, 0 at the start */
+  char *filename; /**< The filename of the view, reused for every object */
+  size_t filename_size;
+  LIBMTP_object_view_t view;
+};
+
+/**
+ * This starts an iteration over the objects on a device, an
+ * alternative to the file and track listings that does not build
+ * them. The objects are handed out one at a time as views of the
+ * object cache that are reused from one object to the next, so going
+ * through the objects takes the same little memory however many of
+ * them there are. Only what is in the cache is returned: unlike the
+ * listings, the iteration does not ask the device for metadata that is
+ * missing, so for instance the size is the 32-bit one of the object
+ * info on devices that give no property lists.
+ *
+ * Typical usage:
+ *
+ * <pre>
+ * LIBMTP_object_iterator_t *it;
+ * LIBMTP_object_view_t const *view;
+ *
+ * it = LIBMTP_Begin_Object_Iteration(device, 0, LIBMTP_ITERATE_TRACKS, 0);
+ * while ((view = LIBMTP_Next_Object(it)) != NULL) {
+ *   // Do something with the view here, copy what you want to keep...
+ * }
+ * LIBMTP_End_Object_Iteration(it);
+ * </pre>
+ *
+ * The iterator holds no lock between calls, so the device may be used
+ * meanwhile. Objects that are added to the cache during the iteration
+ * turn up at its end, and the iteration goes on past objects that are
+ * removed. A removed object leaves its place to the last one in the
+ * cache, though, so an object may be missed when an object the
+ * iteration already went past is removed, or visited twice or missed
+ * when the object it stopped at is removed together with others.
+ *
+ * @param device a pointer to the device to iterate over.
+ * @param storage_id the storage to iterate over, or 0 for all.
+ * @param what the kind of objects to visit.
+ * @param filetype the filetype of the objects to visit if
+ *        <code>what</code> is <code>LIBMTP_ITERATE_FILETYPE</code>,
+ *        ignored otherwise.
+ * @return the iterator, or NULL if out of memory.
+ * @see LIBMTP_Next_Object()
+ * @see LIBMTP_End_Object_Iteration()
+ */
+LIBMTP_object_iterator_t *LIBMTP_Begin_Object_Iteration(LIBMTP_mtpdevice_t *device,
+							 uint32_t const storage_id,
+							 LIBMTP_iterate_t const what,
+							 LIBMTP_filetype_t const filetype)
+{
+  LIBMTP_object_iterator_t *it;
+
+  it = (LIBMTP_object_iterator_t *) calloc(1, sizeof(LIBMTP_object_iterator_t));
+  if (it == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Begin_Object_Iteration(): out of memory.");
+    return NULL;
+  }
+  it->device = device;
+  it->storage_id = storage_id;
+  it->what = what;
+  it->filetype = filetype;
+  // Get all the handles if we haven't already done that
+  update_cache(device);
+  return it;
+}
+
+/**
+ * This hands out the next object of an iteration.
+ * @param it the iterator from
+ *        <code>LIBMTP_Begin_Object_Iteration()</code>.
+ * @return a view of the next object, which is only valid until the
+ *         next call on the iterator, or NULL at the end of the
+ *         iteration.
+ */
+LIBMTP_object_view_t const *LIBMTP_Next_Object(LIBMTP_object_iterator_t *it)
+{
+  LIBMTP_mtpdevice_t *device = it->device;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_object_view_t *view = NULL;
+  PTPObject *last;
+  unsigned int i;
+
+  ptp_lock(params, PTP_LOCK_OBJECTS_READ);
+
+  // Find our place again if the cache changed since the last call
+  if (it->last_id != 0 &&
+      (it->next > params->nrofobjects ||
+       params->objects[it->next - 1]->oid != it->last_id)) {
+    if (ptp_object_find(params, it->last_id, &last) == PTP_RC_OK) {
+      it->next = last->index + 1;
+    } else {
+      // It was removed, and another object now holds its place
+      it->next--;
+      if (it->next > params->nrofobjects)
+	it->next = params->nrofobjects;
+    }
+  }
+
+  while (it->next < params->nrofobjects) {
+    PTPObject *ob = params->objects[it->next++];
+    LIBMTP_filetype_t filetype;
+
+    it->last_id = ob->oid;
+    if (it->storage_id != 0 && ob->oi.StorageID != it->storage_id)
+      continue;
+
+    filetype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+    if (it->what == LIBMTP_ITERATE_TRACKS &&
+	!LIBMTP_FILETYPE_IS_TRACK(filetype) &&
+	ob->oi.ObjectFormat != PTP_OFC_Undefined)
+      continue;
+    // The same guess as the file and track listings make
+    if (filetype == LIBMTP_FILETYPE_UNKNOWN) {
+      if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
+	   FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
+	  has_ogg_extension(ob->oi.Filename))
+	filetype = LIBMTP_FILETYPE_OGG;
+      else if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) &&
+	       has_flac_extension(ob->oi.Filename))
+	filetype = LIBMTP_FILETYPE_FLAC;
+    }
+
+    switch (it->what) {
+    case LIBMTP_ITERATE_FILES:
+      if (ob->oi.ObjectFormat == PTP_OFC_Association)
+	continue;
+      break;
+    case LIBMTP_ITERATE_TRACKS:
+      if (!LIBMTP_FILETYPE_IS_TRACK(filetype))
+	continue;
+      break;
+    case LIBMTP_ITERATE_FILETYPE:
+      if (filetype != it->filetype)
+	continue;
+      break;
+    default:
+      break;
+    }
+
+    view = &it->view;
+    view->item_id = ob->oid;
+    view->parent_id = ob->oi.ParentObject;
+    view->storage_id = ob->oi.StorageID;
+    view->filesize = ob->oi.ObjectCompressedSize;
+    view->modificationdate = ob->oi.ModificationDate;
+    view->filetype = filetype;
+    // The 64bit size is better than the 32bit one, if it is there
+    for (i = 0; !(ob->flags & PTPOBJECT_OBJECTSIZE_LOADED) &&
+	   i < ob->nrofmtpprops; i++) {
+      if (ob->mtpprops[i].property == PTP_OPC_ObjectSize) {
+	if (device->object_bitsize == 64)
+	  view->filesize = ob->mtpprops[i].propval.u64;
+	else
+	  view->filesize = ob->mtpprops[i].propval.u32;
+	break;
+      }
+    }
+    // The cache may change once the lock is given up, so copy the name
+    view->filename = NULL;
+    if (ob->oi.Filename != NULL) {
+      size_t const len = strlen(ob->oi.Filename) + 1;
+
+      if (len > it->filename_size) {
+	char *tmp = realloc(it->filename, len);
+
+	if (tmp == NULL) {
+	  add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+				  "LIBMTP_Next_Object(): out of memory.");
+	  view = NULL;
+	  break;
+	}
+	it->filename = tmp;
+	it->filename_size = len;
+      }
+      memcpy(it->filename, ob->oi.Filename, len);
+      view->filename = it->filename;
+    }
+    break;
+  }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  return view;
+}
+
+/**
+ * This frees an object iterator, the last view it handed out
+ * included.
+ * @param it the iterator to free.
+ */
+void LIBMTP_End_Object_Iteration(LIBMTP_object_iterator_t *it)
+{
+  if (it == NULL)
+    return;
+  free(it->filename);
+  free(it);
+}
+
+/**
+ * This batches up the metadata retrieval for one folder: a single
+ * GetObjPropList of depth 1 on the folder puts all of its children
+ * into the object cache, so that listing them afterwards needs no
+ * further round trips per object. Devices that cannot do this just
+ * leave the cache alone and the per-object calls are used instead.
+ * @param device a pointer to the device to get the metadata from.
+ * @param parent the folder to list, or PTP_GOH_ROOT_PARENT.
+ * @param handles the children of the folder, their cached property
+ *        lists are stale and dropped first.
+ */
+static void get_folder_metadata_fast(LIBMTP_mtpdevice_t *device,
+				     uint32_t const parent,
+				     PTPObjectHandles const * const handles)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTPObject *ob;
+  uint32_t handle;
+  unsigned int i;
+
+  // Handle 0 with depth 1 means the objects in the root folder
+  handle = (parent == PTP_GOH_ROOT_PARENT) ? 0x00000000U : parent;
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  for (i = 0; i <= handles->n; i++) {
+    uint32_t h = (i < handles->n) ? handles->Handler[i] : handle;
+
+    if (ptp_object_find(params, h, &ob) != PTP_RC_OK)
+      continue;
+    ptp_object_free_props(params, ob);
+    ob->flags &= ~PTPOBJECT_MTPPROPLIST_LOADED;
+  }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+
+  // Ignore the return value, whatever did not make it into the
+  // cache is fetched per object.
+  (void) ptp_mtp_getobjectproplist_cache(params, handle, 1, NULL);
+}
+
+/**
+ * This function retrieves the contents of a certain folder
+ * with id parent on a certain storage on a certain device.
+ * The result contains both files and folders.
+ * The device used with this operations must have been opened with
+ * LIBMTP_Open_Raw_Device_Uncached() or it will fail.
+ *
+ * NOTE: the request will always perform I/O with the device.
+ * @param device a pointer to the MTP device to report info from.
+ * @param storage a storage on the device to report info from. If
+ *        0 is passed in, the files for the given parent will be
+ *        searched across all available storages.
+ * @param parent the parent folder id.
+ */
+LIBMTP_file_t * LIBMTP_Get_Files_And_Folders(LIBMTP_mtpdevice_t *device,
+			     uint32_t const storage,
+			     uint32_t const parent)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *retfiles = NULL;
+  LIBMTP_file_t *curfile = NULL;
+  PTPObjectHandles currentHandles;
+  uint32_t storageid;
+  uint16_t ret;
+  unsigned int i = 0;
+
+  if (device->cached) {
+    // This function is only supposed to be used by devices
+    // opened as uncached!
+    LIBMTP_ERROR("tried to use %s on a cached device!\n",
+		 __func__);
+    return NULL;
+  }
+
+  if (storage == 0)
+    storageid = PTP_GOH_ALL_STORAGE;
+  else
+    storageid = storage;
+
+  ret = ptp_getobjecthandles(params,
+			     storageid,
+			     PTP_GOH_ALL_FORMATS,
+			     parent,
+			     &currentHandles);
+
+  if (ret != PTP_RC_OK) {
+    char buf[80];
+    sprintf(buf,"LIBMTP_Get_Files_And_Folders(): could not get object handles of %08x.", parent);
+    add_ptp_error_to_errorstack(device, ret, buf);
+    return NULL;
+  }
+
+  if (currentHandles.Handler == NULL || currentHandles.n == 0)
+    return NULL;
+
+  // Fetch the metadata of the whole folder in one go if we can
+  if (ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList)
+      && !FLAG_BROKEN_MTPGETOBJPROPLIST(ptp_usb)) {
+    get_folder_metadata_fast(device, parent, &currentHandles);
+  }
+
+  for (i = 0; i < currentHandles.n; i++) {
+    LIBMTP_file_t *file;
+
+    // Get metadata for one file, if it fails, try next file
+    file = LIBMTP_Get_Filemetadata(device, currentHandles.Handler[i]);
+    if (file == NULL)
+      continue;
+
+    // Add track to a list that will be returned afterwards.
+    if (curfile == NULL) {
+      curfile = file;
+      retfiles = file;
+    } else {
+      curfile->next = file;
+      curfile = file;
+    }
+  }
+
+  free(currentHandles.Handler);
+
+  // Return a pointer to the original first file
+  // in the big list.
+  return retfiles;
+}
+
+
+/**
+ * This creates a new track metadata structure and allocates memory
+ * for it. Notice that if you add strings to this structure they
+ * will be freed by the corresponding <code>LIBMTP_destroy_track_t</code>
+ * operation later, so be careful of using strdup() when assigning
+ * strings, e.g.:
+ *
+ * <pre>
+ * LIBMTP_track_t *track = LIBMTP_new_track_t();
+ * track->title = strdup(titlestr);
+ * ....
+ * LIBMTP_destroy_track_t(track);
+ * </pre>
+ *
+ * @return a pointer to the newly allocated metadata structure.
+ * @see LIBMTP_destroy_track_t()
+ */
+LIBMTP_track_t *LIBMTP_new_track_t(void)
+{
+  LIBMTP_track_t *new = (LIBMTP_track_t *) malloc(sizeof(LIBMTP_track_t));
+  if (new == NULL) {
+    return NULL;
+  }
+  new->item_id = 0;
+  new->parent_id = 0;
+  new->storage_id = 0;
+  new->title = NULL;
+  new->artist = NULL;
+  new->composer = NULL;
+  new->album = NULL;
+  new->genre = NULL;
+  new->date = NULL;
+  new->filename = NULL;
+  new->duration = 0;
+  new->tracknumber = 0;
+  new->filesize = 0;
+  new->filetype = LIBMTP_FILETYPE_UNKNOWN;
+  new->samplerate = 0;
+  new->nochannels = 0;
+  new->wavecodec = 0;
+  new->bitrate = 0;
+  new->bitratetype = 0;
+  new->rating = 0;
+  new->usecount = 0;
+  new->modificationdate = 0;
+  new->next = NULL;
+  return new;
+}
+
+/**
+ * This destroys a track metadata structure and deallocates the memory
+ * used by it, including any strings. Never use a track metadata
+ * structure again after calling this function on it.
+ * @param track the track metadata to destroy.
+ * @see LIBMTP_new_track_t()
+ */
+void LIBMTP_destroy_track_t(LIBMTP_track_t *track)
+{
+  if (track == NULL) {
+    return;
+  }
+  if (track->title != NULL)
+    free(track->title);
+  if (track->artist != NULL)
+    free(track->artist);
+  if (track->composer != NULL)
+    free(track->composer);
+  if (track->album != NULL)
+    free(track->album);
+  if (track->genre != NULL)
+    free(track->genre);
+  if (track->date != NULL)
+    free(track->date);
+  if (track->filename != NULL)
+    free(track->filename);
+  free(track);
+  return;
+}
+
+/**
+ * This function maps and copies a property onto the track metadata if applicable.
+ */
+static void pick_property_to_track_metadata(LIBMTP_mtpdevice_t *device, MTPProperties *prop, LIBMTP_track_t *track)
+{
+  switch (prop->property) {
+  case PTP_OPC_Name:
+    if (prop->propval.str != NULL)
+      track->title = strdup(prop->propval.str);
+    else
+      track->title = NULL;
+    break;
+  case PTP_OPC_Artist:
+    if (prop->propval.str != NULL)
+      track->artist = strdup(prop->propval.str);
+    else
+      track->artist = NULL;
+    break;
+  case PTP_OPC_Composer:
+    if (prop->propval.str != NULL)
+      track->composer = strdup(prop->propval.str);
+    else
+      track->composer = NULL;
+    break;
+  case PTP_OPC_Duration:
+    track->duration = prop->propval.u32;
+    break;
+  case PTP_OPC_Track:
+    track->tracknumber = prop->propval.u16;
+    break;
+  case PTP_OPC_Genre:
+    if (prop->propval.str != NULL)
+      track->genre = strdup(prop->propval.str);
+    else
+      track->genre = NULL;
+    break;
+  case PTP_OPC_AlbumName:
+    if (prop->propval.str != NULL)
+      track->album = strdup(prop->propval.str);
+    else
+      track->album = NULL;
+    break;
+  case PTP_OPC_OriginalReleaseDate:
+    if (prop->propval.str != NULL)
+      track->date = strdup(prop->propval.str);
+    else
+      track->date = NULL;
+    break;
+    // These are, well not so important.
+  case PTP_OPC_SampleRate:
+    track->samplerate = prop->propval.u32;
+    break;
+  case PTP_OPC_NumberOfChannels:
+    track->nochannels = prop->propval.u16;
+    break;
+  case PTP_OPC_AudioWAVECodec:
+    track->wavecodec = prop->propval.u32;
+    break;
+  case PTP_OPC_AudioBitRate:
+    track->bitrate = prop->propval.u32;
+    break;
+  case PTP_OPC_BitRateType:
+    track->bitratetype = prop->propval.u16;
+    break;
+  case PTP_OPC_Rating:
+    track->rating = prop->propval.u16;
+    break;
+  case PTP_OPC_UseCount:
+    track->usecount = prop->propval.u32;
+    break;
+  case PTP_OPC_ObjectSize:
+    if (device->object_bitsize == 64) {
+      track->filesize = prop->propval.u64;
+    } else {
+      track->filesize = prop->propval.u32;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+/**
+ * This function retrieves the track metadata for a track
+ * given by a unique ID.
+ * @param device a pointer to the device to get the track metadata off.
+ * @param trackid the unique ID of the track.
+ * @param objectformat the object format of this track, so we know what it supports.
+ * @param track a metadata set to fill in.
+ */
+static void get_track_metadata(LIBMTP_mtpdevice_t *device, uint16_t objectformat,
+			       LIBMTP_track_t *track)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t i;
+  MTPProperties *prop;
+  PTPObject *ob;
+
+  /*
+   * If we have a cached, large set of metadata, then use it!
+   */
+  ret = ptp_object_want(params, track->item_id,
+			PTPOBJECT_COREPROPS_LOADED|PTPOBJECT_MEDIAPROPS_LOADED, &ob);
+  if (ob->mtpprops &&
+      (ob->flags & (PTPOBJECT_MTPPROPLIST_LOADED|PTPOBJECT_MEDIAPROPS_LOADED))) {
+    prop = ob->mtpprops;
+    for (i=0;i<ob->nrofmtpprops;i++,prop++)
+      pick_property_to_track_metadata(device, prop, track);
+  } else {
+    uint16_t *props = NULL;
+    uint32_t propcnt = 0;
+
+    // First see which properties can be retrieved for this object format
+    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(track->filetype), &propcnt, &props);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "get_track_metadata(): call to ptp_mtp_getobjectpropssupported() failed.");
+      // Just bail out for now, nothing is ever set.
+      return;
+    } else {
+      for (i=0;i<propcnt;i++) {
+	switch (props[i]) {
+	case PTP_OPC_Name:
+	  track->title = get_string_from_object(device, track->item_id, PTP_OPC_Name);
+	  break;
+	case PTP_OPC_Artist:
+	  track->artist = get_string_from_object(device, track->item_id, PTP_OPC_Artist);
+	  break;
+	case PTP_OPC_Composer:
+	  track->composer = get_string_from_object(device, track->item_id, PTP_OPC_Composer);
+	  break;
+	case PTP_OPC_Duration:
+	  track->duration = get_u32_from_object(device, track->item_id, PTP_OPC_Duration, 0);
+	  break;
+	case PTP_OPC_Track:
+	  track->tracknumber = get_u16_from_object(device, track->item_id, PTP_OPC_Track, 0);
+	  break;
+	case PTP_OPC_Genre:
+	  track->genre = get_string_from_object(device, track->item_id, PTP_OPC_Genre);
+	  break;
+	case PTP_OPC_AlbumName:
+	  track->album = get_string_from_object(device, track->item_id, PTP_OPC_AlbumName);
+	  break;
+	case PTP_OPC_OriginalReleaseDate:
+	  track->date = get_string_from_object(device, track->item_id, PTP_OPC_OriginalReleaseDate);
+	  break;
+	  // These are, well not so important.
+	case PTP_OPC_SampleRate:
+	  track->samplerate = get_u32_from_object(device, track->item_id, PTP_OPC_SampleRate, 0);
+	  break;
+	case PTP_OPC_NumberOfChannels:
+	  track->nochannels = get_u16_from_object(device, track->item_id, PTP_OPC_NumberOfChannels, 0);
+	  break;
+	case PTP_OPC_AudioWAVECodec:
+	  track->wavecodec = get_u32_from_object(device, track->item_id, PTP_OPC_AudioWAVECodec, 0);
+	  break;
+	case PTP_OPC_AudioBitRate:
+	  track->bitrate = get_u32_from_object(device, track->item_id, PTP_OPC_AudioBitRate, 0);
+	  break;
+	case PTP_OPC_BitRateType:
+	  track->bitratetype = get_u16_from_object(device, track->item_id, PTP_OPC_BitRateType, 0);
+	  break;
+	case PTP_OPC_Rating:
+	  track->rating = get_u16_from_object(device, track->item_id, PTP_OPC_Rating, 0);
+	  break;
+	case PTP_OPC_UseCount:
+	  track->usecount = get_u32_from_object(device, track->item_id, PTP_OPC_UseCount, 0);
+	  break;
+	case PTP_OPC_ObjectSize:
+	  if (ob->flags & PTPOBJECT_OBJECTSIZE_LOADED) {
+	    track->filesize = ob->oi.ObjectCompressedSize;
+	  } else if (device->object_bitsize == 64) {
+	    track->filesize = get_u64_from_object(device, track->item_id, PTP_OPC_ObjectSize, 0);
+	  } else {
+	    track->filesize = (uint64_t) get_u32_from_object(device, track->item_id, PTP_OPC_ObjectSize, 0);
+	  }
+	  break;
+	}
+      }
+      free(props);
+    }
+  }
+}
+
+/**
+ * THIS FUNCTION IS DEPRECATED. PLEASE UPDATE YOUR CODE IN ORDER
+ * NOT TO USE IT.
+ * @see LIBMTP_Get_Tracklisting_With_Callback()
+ */
+LIBMTP_track_t *LIBMTP_Get_Tracklisting(LIBMTP_mtpdevice_t *device)
+{
+  LIBMTP_INFO("WARNING: LIBMTP_Get_Tracklisting() is deprecated.\n");
+  LIBMTP_INFO("WARNING: please update your code to use LIBMTP_Get_Tracklisting_With_Callback()\n");
+  return LIBMTP_Get_Tracklisting_With_Callback(device, NULL, NULL);
+}
+
+/**
+ * This returns a long list of all tracks available on the current MTP device.
+ * Tracks include multimedia objects, both music tracks and video tracks.
+ * Typical usage:
+ *
+ * <pre>
+ * LIBMTP_track_t *tracklist;
+ *
+ * tracklist = LIBMTP_Get_Tracklisting_With_Callback(device, callback, data);
+ * while (tracklist != NULL) {
+ *   LIBMTP_track_t *tmp;
+ *
+ *   // Do something on each element in the list here...
+ *   tmp = tracklist;
+ *   tracklist = tracklist->next;
+ *   LIBMTP_destroy_track_t(tmp);
+ * }
+ * </pre>
+ *
+ * If you want to group your track listing by storage (per storage unit) or
+ * arrange tracks into folders, you must dereference the <code>storage_id</code>
+ * and/or <code>parent_id</code> field of the returned <code>LIBMTP_track_t</code>
+ * struct. To arrange by folders or files you typically have to create the proper
+ * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or
+ * <code>LIBMTP_Get_Folder_List()</code> first.
+ *
+ * @param device a pointer to the device to get the track listing for.
+ * @param callback a function to be called during the tracklisting retrieveal
+ *        for displaying progress bars etc, or NULL if you don't want
+ *        any callbacks.
+ * @param data a user-defined pointer that is passed along to
+ *        the <code>progress</code> function in order to
+ *        pass along some user defined data to the progress
+ *        updates. If not used, set this to NULL.
+ * @return a list of tracks that can be followed using the <code>next</code>
+ *        field of the <code>LIBMTP_track_t</code> data structure.
+ *        Each of the metadata tags must be freed after use, and may
+ *        contain only partial metadata information, i.e. one or several
+ *        fields may be NULL or 0.
+ * @see LIBMTP_Get_Trackmetadata()
+ */
+LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback(LIBMTP_mtpdevice_t *device,
+                                                      LIBMTP_progressfunc_t const callback,
+                                                      void const * const data)
+{
+	return LIBMTP_Get_Tracklisting_With_Callback_For_Storage(device, 0, callback, data);
+}
+
+
+/**
+ * This returns a long list of all tracks available on the current MTP device.
+ * Tracks include multimedia objects, both music tracks and video tracks.
+ * Typical usage:
+ *
+ * <pre>
+ * LIBMTP_track_t *tracklist;
+ *
+ * tracklist = LIBMTP_Get_Tracklisting_With_Callback_For_Storage(device, storage_id, callback, data);
+ * while (tracklist != NULL) {
+ *   LIBMTP_track_t *tmp;
+ *
+ *   // Do something on each element in the list here...
+ *   tmp = tracklist;
+ *   tracklist = tracklist->next;
+ *   LIBMTP_destroy_track_t(tmp);
+ * }
+ * </pre>
+ *
+ * If you want to group your track listing by storage (per storage unit) or
+ * arrange tracks into folders, you must dereference the <code>storage_id</code>
+ * and/or <code>parent_id</code> field of the returned <code>LIBMTP_track_t</code>
+ * struct. To arrange by folders or files you typically have to create the proper
+ * trees by calls to <code>LIBMTP_Get_Storage()</code> and/or 
+ * <code>LIBMTP_Get_Folder_List()</code> first.
+ *
+ * @param device a pointer to the device to get the track listing for.
+ * @param storage_id ID of device storage (if null, no filter)
+ * @param callback a function to be called during the tracklisting retrieveal
+ *        for displaying progress bars etc, or NULL if you don't want
+ *        any callbacks.
+ * @param data a user-defined pointer that is passed along to
+ *        the <code>progress</code> function in order to
+ *        pass along some user defined data to the progress
+ *        updates. If not used, set this to NULL.
+ * @return a list of tracks that can be followed using the <code>next</code>
+ *        field of the <code>LIBMTP_track_t</code> data structure.
+ *        Each of the metadata tags must be freed after use, and may
+ *        contain only partial metadata information, i.e. one or several
+ *        fields may be NULL or 0.
+ * @see LIBMTP_Get_Trackmetadata()
+ */
+LIBMTP_track_t *LIBMTP_Get_Tracklisting_With_Callback_For_Storage(LIBMTP_mtpdevice_t *device, uint32_t const storage_id,
+                                                      LIBMTP_progressfunc_t const callback,
+                                                      void const * const data)
+{
+  uint32_t i = 0;
+  LIBMTP_track_t *retracks = NULL;
+  LIBMTP_track_t *curtrack = NULL;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  const PTPObjectColumns *cols;
+
+  // Get all the handles if we haven't already done that
+  update_cache(device);
+  // Nothing may change the cache while walking it
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  cols = ptp_object_columns(params);
+
+  for (i = 0; i < params->nrofobjects; i++) {
+    LIBMTP_track_t *track;
+    PTPObject *ob;
+    LIBMTP_filetype_t mtptype;
+
+    if (callback != NULL)
+      callback(i, params->nrofobjects, data);
+
+    /*
+     * Sort out the objects of other storages and formats from the
+     * columns, unless reading metadata has made them stale.
+     */
+    if (cols != NULL && cols->generation == params->objects_generation) {
+      if (storage_id != 0 && cols->storage[i] != storage_id)
+	continue;
+      if (!LIBMTP_FILETYPE_IS_TRACK(map_ptp_type_to_libmtp_type(cols->format[i])) &&
+	  cols->format[i] != PTP_OFC_Undefined)
+	continue;
+    }
+
+    ob = params->objects[i];
+    mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+
+    // Ignore stuff we don't know how to handle...
+    // TODO: get this list as an intersection of the sets
+    // supported by the device and the from the device and
+    // all known track files?
+    if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
+	// This row lets through undefined files for examination since they may be forgotten OGG files.
+	(ob->oi.ObjectFormat != PTP_OFC_Undefined ||
+	 (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
+	  !FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
+	  !FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
+	) {
+      //printf("Not a music track (name: %s format: %d), skipping...\n", oi->Filename, oi->ObjectFormat);
+      continue;
+    }
+
+	// Ignore stuff that isn't into the storage device
+	if ((storage_id != 0) && (ob->oi.StorageID != storage_id ))
+		continue;
+
+    // Allocate a new track type
+    track = LIBMTP_new_track_t();
+
+    // This is some sort of unique ID so we can keep track of the track.
+    track->item_id = ob->oid;
+    track->parent_id = ob->oi.ParentObject;
+    track->storage_id = ob->oi.StorageID;
+    track->modificationdate = ob->oi.ModificationDate;
+
+    track->filetype = mtptype;
+
+    // Original file-specific properties
+    track->filesize = ob->oi.ObjectCompressedSize;
+    if (ob->oi.Filename != NULL) {
+      track->filename = strdup(ob->oi.Filename);
+    }
+
+    get_track_metadata(device, ob->oi.ObjectFormat, track);
+
+    /*
+     * A special quirk for iriver devices that doesn't quite
+     * remember that some files marked as "unknown" type are
+     * actually OGG or FLAC files. We look at the filename extension
+     * and see if it happens that this was atleast named "ogg" or "flac"
+     * and fall back on this heuristic approach in that case,
+     * for these bugged devices only.
+     */
+    if (track->filetype == LIBMTP_FILETYPE_UNKNOWN &&
+	track->filename != NULL) {
+      if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
+	   FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
+	  has_ogg_extension(track->filename))
+	track->filetype = LIBMTP_FILETYPE_OGG;
+      else if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) &&
+	       has_flac_extension(track->filename))
+	track->filetype = LIBMTP_FILETYPE_FLAC;
+      else {
+	// This was not an OGG/FLAC file so discard it and continue
+	LIBMTP_destroy_track_t(track);
+	continue;
+      }
+    }
+
+    // Add track to a list that will be returned afterwards.
+    if (retracks == NULL) {
+      retracks = track;
+      curtrack = track;
+    } else {
+      curtrack->next = track;
+      curtrack = track;
+    }
+
+    // Call listing callback
+    // double progressPercent = (double)i*(double)100.0 / (double)params->handles.n;
+
+  } // Handle counting loop
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  return retracks;
+}
+
+/**
+ * This function retrieves the metadata for a single track off
+ * the device.
+ *
+ * Do not call this function repeatedly! The track handles are linearly
+ * searched O(n) and the call may involve (slow) USB traffic, so use
+ * <code>LIBMTP_Get_Tracklisting()</code> and cache the tracks, preferably
+ * as an efficient data structure such as a hash list.
+ *
+ * @param device a pointer to the device to get the track metadata from.
+ * @param trackid the object ID of the track that you want the metadata for.
+ * @return a track metadata entry on success or NULL on failure.
+ * @see LIBMTP_Get_Tracklisting()
+ */
+LIBMTP_track_t *LIBMTP_Get_Trackmetadata(LIBMTP_mtpdevice_t *device, uint32_t const trackid)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObject *ob;
+  LIBMTP_track_t *track;
+  LIBMTP_filetype_t mtptype;
+  uint16_t ret;
+
+  // Get all the handles if we haven't already done that
+  update_cache(device);
+
+  ret = ptp_object_want (params, trackid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK)
+    return NULL;
+
+  mtptype = map_ptp_type_to_libmtp_type(ob->oi.ObjectFormat);
+
+  // Ignore stuff we don't know how to handle...
+  if (!LIBMTP_FILETYPE_IS_TRACK(mtptype) &&
+      /*
+       * This row lets through undefined files for examination
+       * since they may be forgotten OGG or FLAC files.
+       */
+      (ob->oi.ObjectFormat != PTP_OFC_Undefined ||
+       (!FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) &&
+	!FLAG_OGG_IS_UNKNOWN(ptp_usb) &&
+	!FLAG_FLAC_IS_UNKNOWN(ptp_usb)))
+      ) {
+    //printf("Not a music track (name: %s format: %d), skipping...\n", oi->Filename, oi->ObjectFormat);
+    return NULL;
+  }
+
+  // Allocate a new track type
+  track = LIBMTP_new_track_t();
+
+  // This is some sort of unique ID so we can keep track of the track.
+  track->item_id = ob->oid;
+  track->parent_id = ob->oi.ParentObject;
+  track->storage_id = ob->oi.StorageID;
+  track->modificationdate = ob->oi.ModificationDate;
+
+  track->filetype = mtptype;
+
+  // Original file-specific properties
+  track->filesize = ob->oi.ObjectCompressedSize;
+  if (ob->oi.Filename != NULL) {
+    track->filename = strdup(ob->oi.Filename);
+  }
+
+  /*
+   * A special quirk for devices that doesn't quite
+   * remember that some files marked as "unknown" type are
+   * actually OGG or FLAC files. We look at the filename extension
+   * and see if it happens that this was atleast named "ogg"
+   * and fall back on this heuristic approach in that case,
+   * for these bugged devices only.
+   */
+  if (track->filetype == LIBMTP_FILETYPE_UNKNOWN &&
+      track->filename != NULL) {
+    if ((FLAG_IRIVER_OGG_ALZHEIMER(ptp_usb) ||
+	 FLAG_OGG_IS_UNKNOWN(ptp_usb)) &&
+	has_ogg_extension(track->filename))
+      track->filetype = LIBMTP_FILETYPE_OGG;
+    else if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) &&
+	     has_flac_extension(track->filename))
+      track->filetype = LIBMTP_FILETYPE_FLAC;
+    else {
+      // This was not an OGG/FLAC file so discard it
+      LIBMTP_destroy_track_t(track);
+      return NULL;
+    }
+  }
+  get_track_metadata(device, ob->oi.ObjectFormat, track);
+  return track;
+}
+
+/**
+ * This is a manual conversion from MTPDataGetFunc to PTPDataGetFunc
+ * to isolate the internal type.
+ */
+static uint16_t get_func_wrapper(PTPParams* params, void* priv, unsigned long wantlen, unsigned char *data, unsigned long *gotlen)
+{
+  MTPDataHandler *handler = (MTPDataHandler *)priv;
+  uint16_t ret;
+  uint32_t local_gotlen = 0;
+  ret = handler->getfunc(params, handler->priv, wantlen, data, &local_gotlen);
+  *gotlen = local_gotlen;
+  switch (ret)
+  {
+    case LIBMTP_HANDLER_RETURN_OK:
+      return PTP_RC_OK;
+    case LIBMTP_HANDLER_RETURN_ERROR:
+      return PTP_ERROR_IO;
+    case LIBMTP_HANDLER_RETURN_CANCEL:
+      return PTP_ERROR_CANCEL;
+    default:
+      return PTP_ERROR_IO;
+  }
+}
+
+/**
+ * This is a manual conversion from MTPDataPutFunc to PTPDataPutFunc
+ * to isolate the internal type.
+ */
+static uint16_t put_func_wrapper(PTPParams* params, void* priv, unsigned long sendlen, unsigned char *data)
+{
+  MTPDataHandler *handler = (MTPDataHandler *)priv;
+  uint16_t ret;
+  uint32_t local_putlen = 0;
+
+  ret = handler->putfunc(params, handler->priv, sendlen, data, &local_putlen);
+
+  switch (ret)
+  {
+    case LIBMTP_HANDLER_RETURN_OK:
+      if (local_putlen != sendlen)
+	return PTP_ERROR_IO;
+      return PTP_RC_OK;
+    case LIBMTP_HANDLER_RETURN_ERROR:
+      return PTP_ERROR_IO;
+    case LIBMTP_HANDLER_RETURN_CANCEL:
+      return PTP_ERROR_CANCEL;
+    default:
+      return PTP_ERROR_IO;
+  }
+}
+
+#ifdef HAVE_SYS_MMAN_H
+/*
+ * Data handler that moves object data straight between the USB
+ * transfers and a memory mapping of a regular file, so the data is
+ * not copied through an intermediate buffer and no buffer needs to be
+ * allocated per transfer.
+ */
+typedef struct _MTPMmapHandler {
+  int fd;
+  int writable;
+  off_t start; /**< file offset where the object data begins */
+  off_t oldsize; /**< file size before we grew it, -1 if untouched */
+  void *map; /**< page aligned mapping */
+  size_t maplen;
+  unsigned char *data; /**< object data within the mapping */
+  uint64_t size;
+  uint64_t curoff;
+} MTPMmapHandler;
+
+static unsigned char *mmap_getbuffunc(PTPParams* params, void* priv,
+				      unsigned long ahead,
+				      unsigned long wantlen)
+{
+  MTPMmapHandler *mh = (MTPMmapHandler *) priv;
+
+  if (mh->curoff + ahead + wantlen > mh->size)
+    return NULL;
+  return mh->data + mh->curoff + ahead;
+}
+
+static uint16_t mmap_getfunc(PTPParams* params, void* priv,
+			     unsigned long wantlen, unsigned char *data,
+			     unsigned long *gotlen)
+{
+  MTPMmapHandler *mh = (MTPMmapHandler *) priv;
+
+  if (mh->curoff + wantlen > mh->size)
+    wantlen = mh->size - mh->curoff;
+  // Data handed out by mmap_getbuffunc() is already in place
+  if (data != mh->data + mh->curoff)
+    memcpy(data, mh->data + mh->curoff, wantlen);
+  mh->curoff += wantlen;
+  *gotlen = wantlen;
+  return PTP_RC_OK;
+}
+
+static uint16_t mmap_putfunc(PTPParams* params, void* priv,
+			     unsigned long sendlen, unsigned char *data)
+{
+  MTPMmapHandler *mh = (MTPMmapHandler *) priv;
+
+  if (mh->curoff + sendlen > mh->size) {
+    // More than the object size was announced, append the rest
+    if (pwrite(mh->fd, data, sendlen, mh->start + mh->curoff) != sendlen)
+      return PTP_ERROR_IO;
+  } else if (data != mh->data + mh->curoff) {
+    memcpy(mh->data + mh->curoff, data, sendlen);
+  }
+  mh->curoff += sendlen;
+  return PTP_RC_OK;
+}
+
+/**
+ * Map <code>size</code> bytes of the regular file <code>fd</code> from
+ * its current offset. For receiving (<code>writable</code>) the blocks
+ * for the whole object are allocated first, growing the file.
+ * @return 0 on success, -1 if the file can not be mapped, in which
+ *         case the caller should fall back to plain read()/write().
+ */
+static int init_mmap_handler(PTPDataHandler *handler, MTPMmapHandler *mh,
+			     int fd, uint64_t size, int writable)
+{
+  struct stat st;
+  long pagesize = sysconf(_SC_PAGESIZE);
+  off_t aligned;
+
+  if (size == 0 || size > SIZE_MAX || pagesize <= 0)
+    return -1;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    return -1;
+  mh->start = lseek(fd, 0, SEEK_CUR);
+  if (mh->start == (off_t) -1)
+    return -1;
+  aligned = mh->start - mh->start % pagesize;
+  if ((uint64_t) (mh->start - aligned) + size > SIZE_MAX)
+    return -1;
+
+  mh->oldsize = -1;
+  if (st.st_size < mh->start + (off_t) size && !writable)
+    return -1;
+  if (writable) {
+#ifdef HAVE_POSIX_FALLOCATE
+    /*
+     * Reserve the blocks, also of holes in the file: a full disk or
+     * quota would otherwise only show as SIGBUS on a store to the map.
+     */
+    if (posix_fallocate(fd, mh->start, size) != 0) {
+      if (st.st_size < mh->start + (off_t) size)
+	(void) ftruncate(fd, st.st_size);
+      return -1;
+    }
+    if (st.st_size < mh->start + (off_t) size)
+      mh->oldsize = st.st_size;
+#else
+    // Without a way to reserve the blocks, stores could raise SIGBUS
+    return -1;
+#endif
+  }
+
+  mh->maplen = (mh->start - aligned) + size;
+  mh->map = mmap(NULL, mh->maplen,
+		 writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		 MAP_SHARED, fd, aligned);
+  if (mh->map == MAP_FAILED) {
+    if (mh->oldsize != -1)
+      (void) ftruncate(fd, mh->oldsize);
+    return -1;
+  }
+#ifdef MADV_SEQUENTIAL
+  (void) madvise(mh->map, mh->maplen, MADV_SEQUENTIAL);
+#endif
+  mh->fd = fd;
+  mh->writable = writable;
+  mh->data = (unsigned char *) mh->map + (mh->start - aligned);
+  mh->size = size;
+  mh->curoff = 0;
+
+  handler->getfunc = mmap_getfunc;
+  handler->putfunc = mmap_putfunc;
+  handler->getbuffunc = mmap_getbuffunc;
+  handler->priv = mh;
+  return 0;
+}
+
+/**
+ * Unmap the file and leave the file offset after the transferred data,
+ * like read()/write() would have. A file we grew is cut back to what
+ * was actually received.
+ */
+static void exit_mmap_handler(MTPMmapHandler *mh)
+{
+  munmap(mh->map, mh->maplen);
+  if (mh->writable && mh->oldsize != -1 && mh->curoff < mh->size)
+    (void) ftruncate(mh->fd, mh->start + mh->curoff);
+  lseek(mh->fd, mh->start + mh->curoff, SEEK_SET);
+}
+#endif
+
+/**
+ * Sets up the progress accounting of the glue for the transfer of one
+ * object, whose request and data phase come to <code>total</code>
+ * bytes. The state is kept in the PTP_USB of the device, which every
+ * thread using the device shares, so the caller holds the transaction
+ * lock from here until stop_transfer_progress().
+ */
+static void start_transfer_progress(PTP_USB *ptp_usb, uint64_t const total,
+				    LIBMTP_progressfunc_t const callback,
+				    void const * const data)
+{
+  ptp_usb->callback_active = 1;
+  ptp_usb->current_transfer_total = total;
+  ptp_usb->current_transfer_complete = 0;
+  ptp_usb->current_transfer_callback = callback;
+  ptp_usb->current_transfer_callback_data = data;
+}
+
+/**
+ * Ends the progress accounting started with start_transfer_progress(),
+ * before the caller gives up the transaction lock.
+ */
+static void stop_transfer_progress(PTP_USB *ptp_usb)
+{
+  ptp_usb->callback_active = 0;
+  ptp_usb->current_transfer_callback = NULL;
+  ptp_usb->current_transfer_callback_data = NULL;
+}
+
+/**
+ * Passes the data of a segmented download on to the handler of the
+ * caller, counting what arrived for the current segment.
+ */
+typedef struct _MTPSegmentHandler {
+  PTPDataHandler *handler;
+  uint64_t got;
+} MTPSegmentHandler;
+
+static uint16_t segment_putfunc(PTPParams* params, void* priv,
+				unsigned long sendlen, unsigned char *data)
+{
+  MTPSegmentHandler *sh = (MTPSegmentHandler *) priv;
+  uint16_t ret;
+
+  ret = sh->handler->putfunc(params, sh->handler->priv, sendlen, data);
+  if (ret == PTP_RC_OK)
+    sh->got += sendlen;
+  return ret;
+}
+
+static unsigned char *segment_getbuffunc(PTPParams* params, void* priv,
+					 unsigned long ahead,
+					 unsigned long wantlen)
+{
+  MTPSegmentHandler *sh = (MTPSegmentHandler *) priv;
+
+  return sh->handler->getbuffunc(params, sh->handler->priv, ahead, wantlen);
+}
+
+/**
+ * Get an object of <code>size</code> bytes to a handler as a series of
+ * partial reads of <code>segment</code> bytes, see
+ * transfer_segment(). The transaction lock is given up after each of
+ * them and the threads waiting for it go first, then the callback, if
+ * any, is told how far the download got.
+ */
+static uint16_t get_object_segmented(PTPParams *params, uint32_t const id,
+				     uint64_t const size,
+				     uint32_t const segment,
+				     PTPDataHandler *handler,
+				     LIBMTP_progressfunc_t const callback,
+				     void const * const data)
+{
+  MTPSegmentHandler sh;
+  PTPDataHandler counted;
+  uint64_t done = 0;
+  uint32_t len;
+  uint16_t ret = PTP_RC_OK;
+
+  sh.handler = handler;
+  counted.getfunc = NULL;
+  counted.putfunc = segment_putfunc;
+  counted.getbuffunc = handler->getbuffunc != NULL ? segment_getbuffunc : NULL;
+  counted.priv = &sh;
+
+  while (done < size) {
+    if (done > 0)
+      yield_transactions(params);
+    len = partial_object_length(params, done, segment, size);
+    sh.got = 0;
+    ret = get_object_range(params, id, done, len, &counted, NULL, NULL);
+    if (ret != PTP_RC_OK)
+      break;
+    // A segment that comes back empty or overlong means the object
+    // is not what its size said, stop rather than loop
+    if (sh.got == 0 || sh.got > len) {
+      ret = PTP_ERROR_IO;
+      break;
+    }
+    done += sh.got;
+    if (callback != NULL && callback(done, size, data) != 0) {
+      ret = PTP_ERROR_CANCEL;
+      break;
+    }
+  }
+  return ret;
+}
+
+static uint16_t fd_putfunc(PTPParams* params, void* priv,
+			   unsigned long sendlen, unsigned char *data)
+{
+  int const fd = *(int *) priv;
+  ssize_t written;
+
+  while (sendlen > 0) {
+    written = write(fd, data, sendlen);
+    if (written <= 0)
+      return PTP_ERROR_IO;
+    data += written;
+    sendlen -= written;
+  }
+  return PTP_RC_OK;
+}
+
+/**
+ * Get an object to a file descriptor, straight into a mapping of the
+ * file when that is possible. With a <code>segment</code> size the
+ * download is split, see get_object_segmented().
+ */
+static uint16_t get_object_to_fd(PTPParams *params, uint32_t const id,
+				 int fd, uint64_t const size,
+				 uint32_t const segment,
+				 LIBMTP_progressfunc_t const callback,
+				 void const * const data)
+{
+  PTPDataHandler handler;
+#ifdef HAVE_SYS_MMAN_H
+  MTPMmapHandler mh;
+
+  if (init_mmap_handler(&handler, &mh, fd, size, 1) == 0) {
+    uint16_t ret;
+
+    if (segment != 0)
+      ret = get_object_segmented(params, id, size, segment, &handler,
+				 callback, data);
+    else
+      ret = ptp_getobject_to_handler(params, id, &handler);
+    exit_mmap_handler(&mh);
+    return ret;
+  }
+#endif
+  if (segment != 0) {
+    handler.getfunc = NULL;
+    handler.putfunc = fd_putfunc;
+    handler.getbuffunc = NULL;
+    handler.priv = &fd;
+    return get_object_segmented(params, id, size, segment, &handler,
+				callback, data);
+  }
+  return ptp_getobject_tofd(params, id, fd);
+}
+
+/**
+ * Send an object from a file descriptor. With zero-copy sends enabled
+ * on the device a regular file is memory mapped and the USB transfers
+ * go straight from the mapping.
+ */
+static uint16_t send_object_from_fd(PTPParams *params, PTP_USB *ptp_usb,
+				    int const fd, uint64_t const size)
+{
+#ifdef HAVE_SYS_MMAN_H
+  PTPDataHandler handler;
+  MTPMmapHandler mh;
+
+  if (ptp_usb->zerocopy_send &&
+      init_mmap_handler(&handler, &mh, fd, size, 0) == 0) {
+    uint16_t ret = ptp_sendobject_from_handler(params, &handler, size);
+
+    exit_mmap_handler(&mh);
+    return ret;
+  }
+#endif
+  return ptp_sendobject_fromfd(params, fd, size);
+}
+
+/**
+ * This gets a file off the device to a local file identified
+ * by a filename.
+ * @param device a pointer to the device to get the track from.
+ * @param id the file ID of the file to retrieve.
+ * @param path a filename to use for the retrieved file.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_File_To_File_Descriptor()
+ */
+int LIBMTP_Get_File_To_File(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			 char const * const path, LIBMTP_progressfunc_t const callback,
+			 void const * const data)
+{
+  int fd = -1;
+  int ret;
+
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File(): Bad arguments, path was NULL.");
+    return -1;
+  }
+
+  // Open file
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,_S_IREAD)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC|O_BINARY,S_IRWXU)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDWR|O_CREAT|O_TRUNC,S_IRWXU|S_IRGRP)) == -1) {
+#endif
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File(): Could not create file.");
+    return -1;
+  }
+
+  ret = LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data);
+
+  // Close file
+  close(fd);
+
+  // Delete partial file.
+  if (ret == -1) {
+    unlink(path);
+  }
+
+  return ret;
+}
+
+/**
+ * This gets a file off the device to a file identified
+ * by a file descriptor.
+ *
+ * This function can potentially be used for streaming
+ * files off the device for playback or broadcast for example,
+ * by downloading the file into a stream sink e.g. a socket.
+ *
+ * If <code>fd</code> is a regular file opened for reading and
+ * writing, it is grown to the size of the object and memory mapped
+ * so that the data is received straight into the file. The file
+ * offset is left after the received data in either case.
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param fd a local file descriptor to write the file to.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_File_To_File()
+ */
+int LIBMTP_Get_File_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
+					uint32_t const id,
+					int const fd,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint64_t filesize;
+  uint32_t segment;
+
+  LIBMTP_file_t *mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  if (mtpfile == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
+    return -1;
+  }
+  if (mtpfile->filetype == LIBMTP_FILETYPE_FOLDER) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
+    LIBMTP_destroy_file_t (mtpfile);
+    return -1;
+  }
+
+  filesize = mtpfile->filesize;
+  segment = transfer_segment(params, filesize);
+
+  // Callbacks, a segmented download reports progress by itself and
+  // leaves the state of the glue to the transfers in between
+  if (segment == 0) {
+    ptp_lock(params, PTP_LOCK_TRANSACTION);
+    start_transfer_progress(ptp_usb, filesize +
+      PTP_USB_BULK_HDR_LEN+sizeof(uint32_t), // Request length, one parameter
+			    callback, data);
+  }
+
+  // Don't need mtpfile anymore
+  LIBMTP_destroy_file_t(mtpfile);
+
+  ret = get_object_to_fd(params, id, fd, filesize, segment, callback, data);
+
+  if (segment == 0) {
+    stop_transfer_progress(ptp_usb);
+    ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+  }
+
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_From_File_Descriptor(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_File_Descriptor(): Could not get file from device.");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * The size of the ranges moved by
+ * LIBMTP_Get_File_Chunked_To_File_Descriptor() and
+ * LIBMTP_Send_File_Chunked_From_File_Descriptor() unless told otherwise.
+ */
+#define DEFAULT_PARTIAL_CHUNK (4 * 1024 * 1024)
+
+/**
+ * Internal function to fetch one range of an object with whichever
+ * partial read the device has. The caller gets <code>len</code> from
+ * the object size in the cache; a range received into memory is only
+ * allocated up front if the device announces that same length.
+ */
+static uint16_t get_object_range(PTPParams *params, uint32_t const id,
+				 uint64_t const offset, uint32_t const len,
+				 PTPDataHandler *handler,
+				 unsigned char **data, uint32_t *gotlen)
+{
+  uint16_t ret;
+
+  if (handler != NULL) {
+    if (ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64))
+      return ptp_android_getpartialobject64_to_handler(params, id, offset, len, handler);
+    return ptp_getpartialobject_to_handler(params, id, (uint32_t) offset, len, handler);
+  }
+
+  // The expected length is transaction state, keep other threads out
+  ptp_lock(params, PTP_LOCK_TRANSACTION);
+  params->data_phase_expected = len;
+  if (ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64))
+    ret = ptp_android_getpartialobject64(params, id, offset, len, data, gotlen);
+  else
+    ret = ptp_getpartialobject(params, id, (uint32_t) offset, len, data, gotlen);
+  params->data_phase_expected = 0;
+  ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+  return ret;
+}
+
+/**
+ * This gets a file off the device to a file descriptor as a series of
+ * partial object reads, so that a transfer that fails halfway can be
+ * picked up again where it stopped instead of starting over.
+ *
+ * Object byte N is stored at file offset N. The ranges are received
+ * straight into a memory mapping of the file where that is possible,
+ * otherwise each range is written once it is complete. When this
+ * returns, <code>*offset</code> holds the end of the data that arrived
+ * intact; after a failure, for example a timeout followed by a USB
+ * reset and reopening the device, call this again with the same
+ * <code>offset</code> to fetch the rest. Data after that offset is not
+ * valid, and a file that was grown for the mapping is cut back to it.
+ *
+ * This needs a device supporting GetPartialObject, or the Android
+ * 64bit variant for objects over 4GB.
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param fd a seekable local file descriptor opened for reading and
+ *        writing.
+ * @param offset where to start in the object, updated as ranges arrive.
+ * @param chunksize the size of each range, or 0 for the default.
+ * @param callback a progress indicator function or NULL to ignore, it
+ *        is called after each range.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the whole object has been received, any other value
+ *           means failure.
+ * @see LIBMTP_Get_File_To_File_Resumable()
+ */
+int LIBMTP_Get_File_Chunked_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
+					       uint32_t const id,
+					       int const fd,
+					       uint64_t * const offset,
+					       uint32_t chunksize,
+					       LIBMTP_progressfunc_t const callback,
+					       void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+#ifdef HAVE_SYS_MMAN_H
+  PTPDataHandler *handler = NULL;
+  PTPDataHandler mmap_handler;
+  MTPMmapHandler mh;
+#endif
+  LIBMTP_file_t *mtpfile;
+  unsigned char *buf;
+  uint64_t filesize;
+  uint64_t done;
+  uint32_t len;
+  uint32_t got;
+  uint16_t ret = PTP_RC_OK;
+
+  if (offset == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_Chunked_To_File_Descriptor(): Bad arguments, offset was NULL.");
+    return -1;
+  }
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64) &&
+      !ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_Chunked_To_File_Descriptor(): PTP_OC_GetPartialObject not supported.");
+    return -1;
+  }
+
+  mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  if (mtpfile == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_Chunked_To_File_Descriptor(): Could not get object info.");
+    return -1;
+  }
+  if (mtpfile->filetype == LIBMTP_FILETYPE_FOLDER) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_Chunked_To_File_Descriptor(): Bad object format.");
+    LIBMTP_destroy_file_t(mtpfile);
+    return -1;
+  }
+  filesize = mtpfile->filesize;
+  LIBMTP_destroy_file_t(mtpfile);
+
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64) &&
+      filesize >> 32 != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_Chunked_To_File_Descriptor(): PTP_OC_GetPartialObject only supports 32bit offsets.");
+    return -1;
+  }
+  if (*offset > filesize) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_Chunked_To_File_Descriptor(): Offset is past the end of the object.");
+    return -1;
+  }
+  if (chunksize == 0) {
+    chunksize = DEFAULT_PARTIAL_CHUNK;
+  }
+
+  done = *offset;
+#ifdef HAVE_SYS_MMAN_H
+  if (done < filesize && lseek(fd, 0, SEEK_SET) == 0 &&
+      init_mmap_handler(&mmap_handler, &mh, fd, filesize, 1) == 0) {
+    handler = &mmap_handler;
+  }
+#endif
+
+  while (done < filesize) {
+    len = partial_object_length(params, done, chunksize, filesize);
+    buf = NULL;
+    got = 0;
+#ifdef HAVE_SYS_MMAN_H
+    if (handler != NULL) {
+      mh.curoff = done;
+      ret = get_object_range(params, id, done, len, handler, NULL, NULL);
+      got = mh.curoff - done;
+    } else
+#endif
+    {
+      ret = get_object_range(params, id, done, len, NULL, &buf, &got);
+      if (ret == PTP_RC_OK && got > 0 && got <= len &&
+	  (lseek(fd, done, SEEK_SET) == (off_t) -1 ||
+	   write(fd, buf, got) != got)) {
+	ret = PTP_ERROR_IO;
+      }
+      free(buf);
+    }
+    if (ret != PTP_RC_OK)
+      break;
+    // A range that comes back empty or overlong means the object
+    // is not what its size said, stop rather than loop
+    if (got == 0 || got > len) {
+      ret = PTP_ERROR_IO;
+      break;
+    }
+    done += got;
+    *offset = done;
+    if (callback != NULL && callback(done, filesize, data) != 0) {
+      ret = PTP_ERROR_CANCEL;
+      break;
+    }
+  }
+
+#ifdef HAVE_SYS_MMAN_H
+  if (handler != NULL) {
+    // Drop whatever part of a failed range made it into the file
+    mh.curoff = done;
+    exit_mmap_handler(&mh);
+  }
+#endif
+
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_Chunked_To_File_Descriptor(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_Chunked_To_File_Descriptor(): Could not get file from device.");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * This gets a file off the device to a local file identified by a
+ * filename, resuming a previous attempt: unlike
+ * LIBMTP_Get_File_To_File(), an existing file is kept and the transfer
+ * starts at its end. A failed transfer leaves the file holding the
+ * data that arrived intact, so calling this again with the same path,
+ * after reopening the device if needed, fetches only what is missing.
+ *
+ * A file that already has the size of the object is taken as complete.
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param path a filename to use for the retrieved file.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_File_Chunked_To_File_Descriptor()
+ */
+int LIBMTP_Get_File_To_File_Resumable(LIBMTP_mtpdevice_t *device,
+				      uint32_t const id,
+				      char const * const path,
+				      LIBMTP_progressfunc_t const callback,
+				      void const * const data)
+{
+  int fd = -1;
+  int ret;
+  off_t size;
+  uint64_t offset;
+
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Bad arguments, path was NULL.");
+    return -1;
+  }
+
+  // Open file, keeping what an earlier attempt got
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDWR|O_CREAT|O_BINARY,_S_IREAD)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDWR|O_CREAT|O_BINARY,S_IRWXU)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDWR|O_CREAT,S_IRWXU|S_IRGRP)) == -1) {
+#endif
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not open file.");
+    return -1;
+  }
+
+  size = lseek(fd, 0, SEEK_END);
+  if (size == (off_t) -1) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Resumable(): Could not seek in file.");
+    close(fd);
+    return -1;
+  }
+  offset = size;
+
+  ret = LIBMTP_Get_File_Chunked_To_File_Descriptor(device, id, fd, &offset, 0,
+						   callback, data);
+
+  // Close file, a partial file stays for the next attempt
+  close(fd);
+
+  return ret;
+}
+
+/**
+ * This gets a file off the device and calls put_func
+ * with chunks of data
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve.
+ * @param put_func the function to call when we have data.
+ * @param priv the user-defined pointer that is passed to
+ *             <code>put_func</code>.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ */
+int LIBMTP_Get_File_To_Handler(LIBMTP_mtpdevice_t *device,
+					uint32_t const id,
+					MTPDataPutFunc put_func,
+          void * priv,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint64_t filesize;
+  uint32_t segment;
+
+  LIBMTP_file_t *mtpfile = LIBMTP_Get_Filemetadata(device, id);
+  if (mtpfile == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Could not get object info.");
+    return -1;
+  }
+  if (mtpfile->filetype == LIBMTP_FILETYPE_FOLDER) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Get_File_To_File_Descriptor(): Bad object format.");
+    LIBMTP_destroy_file_t (mtpfile);
+    return -1;
+  }
+
+  filesize = mtpfile->filesize;
+  segment = transfer_segment(params, filesize);
+
+  // Callbacks, a segmented download reports progress by itself and
+  // leaves the state of the glue to the transfers in between
+  if (segment == 0) {
+    ptp_lock(params, PTP_LOCK_TRANSACTION);
+    start_transfer_progress(ptp_usb, filesize +
+      PTP_USB_BULK_HDR_LEN+sizeof(uint32_t), // Request length, one parameter
+			    callback, data);
+  }
+
+  // Don't need mtpfile anymore
+  LIBMTP_destroy_file_t(mtpfile);
+
+  MTPDataHandler mtp_handler;
+  mtp_handler.getfunc = NULL;
+  mtp_handler.putfunc = put_func;
+  mtp_handler.priv = priv;
+
+  PTPDataHandler handler;
+  handler.getfunc = NULL;
+  handler.putfunc = put_func_wrapper;
+  handler.getbuffunc = NULL;
+  handler.priv = &mtp_handler;
+
+  if (segment != 0)
+    ret = get_object_segmented(params, id, filesize, segment, &handler,
+			       callback, data);
+  else
+    ret = ptp_getobject_to_handler(params, id, &handler);
+
+  if (segment == 0) {
+    stop_transfer_progress(ptp_usb);
+    ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+  }
+
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Get_File_From_File_Descriptor(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_File_To_File_Descriptor(): Could not get file from device.");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * Turns the outcome of a non-blocking transaction into the result
+ * handed to the callback, noting any error on the error stack.
+ */
+static int nonblocking_result(LIBMTP_mtpdevice_t *device, uint16_t const ret,
+			      char const * const what)
+{
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, what);
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, what);
+    return -1;
+  }
+  return 0;
+}
+
+static void nonblocking_get_done(PTPParams *params, PTPContainer *resp,
+				 uint16_t ret, void *data)
+{
+  nonblocking_op_t *op = (nonblocking_op_t *) data;
+  int result;
+
+  result = nonblocking_result(op->device, ret,
+			      "LIBMTP_Get_File_To_Handler_Nonblocking(): "
+			      "Could not get file from device.");
+  op->cb(op->device, result, op->user_data);
+  free(op);
+}
+
+/**
+ * This gets a file off the device and calls put_func with chunks of
+ * data, like <code>LIBMTP_Get_File_To_Handler()</code> but without
+ * blocking. The transfer is only started here; put_func and then the
+ * callback are called as it progresses, from within
+ * <code>LIBMTP_Handle_Events_Timeout_Completed()</code>, so an
+ * application can drive the transfer from its own event loop with
+ * <code>LIBMTP_Get_Pollfds()</code>.
+ *
+ * Only one non-blocking operation at a time can be underway on a
+ * device, and no other calls on the device may be made until its
+ * callback has been called. This works with libusb-1.0 only, and not
+ * on devices opened with <code>LIBMTP_Open_Raw_Device_Worker()</code>.
+ *
+ * @param device a pointer to the device to get the file from.
+ * @param id the file ID of the file to retrieve. This must be a file
+ *        and not a folder, as it is not looked up first.
+ * @param put_func the function to call when we have data.
+ * @param priv the user-defined pointer that is passed to
+ *             <code>put_func</code>.
+ * @param cb the callback to call when the transfer is over, with 0 if
+ *        it was successful and any other value if it failed.
+ * @param user_data arbitrary user data passed to the callback.
+ * @return 0 on success, any other value means that the transfer was not
+ *         started and the callback will not be called.
+ */
+int LIBMTP_Get_File_To_Handler_Nonblocking(LIBMTP_mtpdevice_t *device,
+					   uint32_t const id,
+					   MTPDataPutFunc put_func,
+					   void *priv,
+					   LIBMTP_nonblocking_cb_fn cb,
+					   void *user_data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  nonblocking_op_t *op;
+  uint16_t ret;
+
+  op = (nonblocking_op_t *) calloc(1, sizeof(nonblocking_op_t));
+  if (op == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Get_File_To_Handler_Nonblocking(): "
+			    "out of memory.");
+    return -1;
+  }
+  op->device = device;
+  op->cb = cb;
+  op->user_data = user_data;
+  op->id = id;
+  op->mtp_handler.getfunc = NULL;
+  op->mtp_handler.putfunc = put_func;
+  op->mtp_handler.priv = priv;
+  op->handler.getfunc = NULL;
+  op->handler.putfunc = put_func_wrapper;
+  op->handler.getbuffunc = NULL;
+  op->handler.priv = &op->mtp_handler;
+
+  ret = ptp_getobject_to_handler_async(params, id, &op->handler,
+				       nonblocking_get_done, op);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret,
+				"LIBMTP_Get_File_To_Handler_Nonblocking(): "
+				"could not start the transfer.");
+    free(op);
+    return -1;
+  }
+  return 0;
+}
+
+
+/**
+ * This gets a track off the device to a file identified
+ * by a filename. This is actually just a wrapper for the
+ * \c LIBMTP_Get_Track_To_File() function.
+ * @param device a pointer to the device to get the track from.
+ * @param id the track ID of the track to retrieve.
+ * @param path a filename to use for the retrieved track.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_Track_To_File_Descriptor()
+ */
+int LIBMTP_Get_Track_To_File(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			 char const * const path, LIBMTP_progressfunc_t const callback,
+			 void const * const data)
+{
+  // This is just a wrapper
+  return LIBMTP_Get_File_To_File(device, id, path, callback, data);
+}
+
+/**
+ * This gets a track off the device to a file identified
+ * by a file descriptor. This is actually just a wrapper for
+ * the \c LIBMTP_Get_File_To_File_Descriptor() function.
+ * @param device a pointer to the device to get the track from.
+ * @param id the track ID of the track to retrieve.
+ * @param fd a file descriptor to write the track to.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Get_Track_To_File()
+ */
+int LIBMTP_Get_Track_To_File_Descriptor(LIBMTP_mtpdevice_t *device,
+					uint32_t const id,
+					int const fd,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
+{
+  // This is just a wrapper
+  return LIBMTP_Get_File_To_File_Descriptor(device, id, fd, callback, data);
+}
+
+/**
+ * This gets a track off the device to a handler function.
+ * This is actually just a wrapper for
+ * the \c LIBMTP_Get_File_To_Handler() function.
+ * @param device a pointer to the device to get the track from.
+ * @param id the track ID of the track to retrieve.
+ * @param put_func the function to call when we have data.
+ * @param priv the user-defined pointer that is passed to
+ *             <code>put_func</code>.
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ */
+int LIBMTP_Get_Track_To_Handler(LIBMTP_mtpdevice_t *device,
+					uint32_t const id,
+					MTPDataPutFunc put_func,
+          void * priv,
+					LIBMTP_progressfunc_t const callback,
+					void const * const data)
+{
+  // This is just a wrapper
+  return LIBMTP_Get_File_To_Handler(device, id, put_func, priv, callback, data);
+}
+
+/**
+ * This function sends a track from a local file to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ * @param device a pointer to the device to send the track to.
+ * @param path the filename of a local file which will be sent.
+ * @param metadata a track metadata set to be written along with the file.
+ *        After this call the field <code>metadata-&gt;item_id</code>
+ *        will contain the new track ID. Other fields such
+ *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
+ *        or <code>metadata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this track in. Since some
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_Track_From_File_Descriptor()
+ * @see LIBMTP_Send_File_From_File()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Send_Track_From_File(LIBMTP_mtpdevice_t *device,
+			 char const * const path, LIBMTP_track_t * const metadata,
+                         LIBMTP_progressfunc_t const callback,
+			 void const * const data)
+{
+  int fd;
+  int ret;
+
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Track_From_File(): Bad arguments, path was NULL.");
+    return -1;
+  }
+
+  // Open file
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDONLY)) == -1) {
+#endif
+    LIBMTP_ERROR("LIBMTP_Send_Track_From_File(): Could not open source file \"%s\"\n", path);
+    return -1;
+  }
+
+  ret = LIBMTP_Send_Track_From_File_Descriptor(device, fd, metadata, callback, data);
+
+  // Close file.
+#ifdef USE_WINDOWS_IO_H
+  _close(fd);
+#else
+  close(fd);
+#endif
+
+  return ret;
+}
+
+
+
+/**
+ * This helper function checks if a filename already exists on the device
+ * @param PTPParams*
+ * @param string representing the filename
+ * @return 0 if the filename doesn't exist, -1 if it does
+ */
+static int check_filename_exists(PTPParams* params, char const * const filename)
+{
+  // Looked up in the filename index of the object cache
+  if (ptp_object_filename_exists(params, filename))
+    return -1;
+  return 0;
+}
+
+/**
+ * This helper function returns a unique filename, with a random string before the extension
+ * @param string representing the original filename
+ * @return a string representing the unique filename
+ */
+static char *generate_unique_filename(PTPParams* params, char const * const filename)
+{
+  int suffix;
+  char * extension_position;
+
+  if (check_filename_exists(params, filename))
+  {
+    extension_position = strrchr(filename,'.');
+
+    char basename[extension_position - filename + 1];
+    strncpy(basename, filename, extension_position - filename);
+    basename[extension_position - filename] = '\0';
+
+    suffix = 1;
+    char newname[ strlen(basename) + 6 + strlen(extension_position)];
+    sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
+    while ((check_filename_exists(params, newname)) && (suffix < 1000000)) {
+      suffix++;
+      sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
+    }
+  return strdup(newname);
+  }
+  else
+  {
+    return strdup(filename);
+  }
+}
+
+/**
+ * This function sends a track from a file descriptor to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ * @param device a pointer to the device to send the track to.
+ * @param fd the filedescriptor for a local file which will be sent.
+ * @param metadata a track metadata set to be written along with the file.
+ *        After this call the field <code>metadata-&gt;item_id</code>
+ *        will contain the new track ID. Other fields such
+ *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
+ *        or <code>metadata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this track in. Since some
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_Track_From_File()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Send_Track_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
+			 int const fd, LIBMTP_track_t * const metadata,
+                         LIBMTP_progressfunc_t const callback,
+			 void const * const data)
+{
+  int subcall_ret;
+  LIBMTP_file_t filedata;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPParams *params = (PTPParams *) device->params;
+
+  // Sanity check, is this really a track?
+  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_File_Descriptor(): "
+			    "I don't think this is actually a track, strange filetype...");
+  }
+
+  // Wrap around the file transfer function
+  filedata.item_id = metadata->item_id;
+  filedata.parent_id = metadata->parent_id;
+  filedata.storage_id = metadata->storage_id;
+  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
+    filedata.filename = generate_unique_filename(params, metadata->filename);
+  }
+  else {
+    filedata.filename = metadata->filename;
+  }
+  filedata.filesize = metadata->filesize;
+  filedata.filetype = metadata->filetype;
+  filedata.next = NULL;
+
+  subcall_ret = LIBMTP_Send_File_From_File_Descriptor(device,
+						      fd,
+						      &filedata,
+						      callback,
+						      data);
+
+  if (subcall_ret != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_File_Descriptor(): "
+			    "subcall to LIBMTP_Send_File_From_File_Descriptor failed.");
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
+  }
+
+  // Pick up new item (and parent, storage) ID
+  metadata->item_id = filedata.item_id;
+  metadata->parent_id = filedata.parent_id;
+  metadata->storage_id = filedata.storage_id;
+
+  // Set track metadata for the new fine track
+  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
+  if (subcall_ret != 0) {
+    // Subcall will add error to errorstack
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
+  }
+
+  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
+  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
+
+  return 0;
+}
+
+/**
+ * This function sends a track from a handler function to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ * @param device a pointer to the device to send the track to.
+ * @param get_func the function to call when we have data.
+ * @param priv the user-defined pointer that is passed to
+ *             <code>get_func</code>.
+ * @param metadata a track metadata set to be written along with the file.
+ *        After this call the field <code>metadata-&gt;item_id</code>
+ *        will contain the new track ID. Other fields such
+ *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
+ *        or <code>metadata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this track in. Since some
+ *        devices are a bit picky about where files
+ *        are placed, a default folder will be chosen if libmtp
+ *        has detected one for the current filetype and this
+ *        parameter is set to 0. If this is 0 and no default folder
+ *        can be found, the file will be stored in the root folder.
+ *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this track in. Setting this to 0 will store
+ *        the track on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_Track_From_File()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Send_Track_From_Handler(LIBMTP_mtpdevice_t *device,
+			 MTPDataGetFunc get_func, void * priv, LIBMTP_track_t * const metadata,
+                         LIBMTP_progressfunc_t const callback,
+			 void const * const data)
+{
+  int subcall_ret;
+  LIBMTP_file_t filedata;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPParams *params = (PTPParams *) device->params;
+
+  // Sanity check, is this really a track?
+  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_Handler(): "
+			    "I don't think this is actually a track, strange filetype...");
+  }
+
+  // Wrap around the file transfer function
+  filedata.item_id = metadata->item_id;
+  filedata.parent_id = metadata->parent_id;
+  filedata.storage_id = metadata->storage_id;
+  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
+    filedata.filename = generate_unique_filename(params, metadata->filename);
+  }
+  else {
+    filedata.filename = metadata->filename;
+  }
+  filedata.filesize = metadata->filesize;
+  filedata.filetype = metadata->filetype;
+  filedata.next = NULL;
+
+  subcall_ret = LIBMTP_Send_File_From_Handler(device,
+					      get_func,
+					      priv,
+					      &filedata,
+					      callback,
+					      data);
+
+  if (subcall_ret != 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_Track_From_Handler(): "
+			    "subcall to LIBMTP_Send_File_From_Handler failed.");
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
+  }
+
+  // Pick up new item (and parent, storage) ID
+  metadata->item_id = filedata.item_id;
+  metadata->parent_id = filedata.parent_id;
+  metadata->storage_id = filedata.storage_id;
+
+  // Set track metadata for the new fine track
+  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
+  if (subcall_ret != 0) {
+    // Subcall will add error to errorstack
+    // We used to delete the file here, but don't... It might be OK after all.
+    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+    return -1;
+  }
+
+  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
+  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
+
+  return 0;
+}
+
+/**
+ * This function sends a local file to an MTP device.
+ * A filename and a set of metadata must be
+ * given as input.
+ * @param device a pointer to the device to send the track to.
  * @param path the filename of a local file which will be sent.
- * @param metadata a track metadata set to be written along with the file.
- *        After this call the field <code>metadata-&gt;item_id</code>
- *        will contain the new track ID. Other fields such
- *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
- *        or <code>metadata-&gt;storage_id</code> may also change during this
+ * @param filedata a file metadata set to be written along with the file.
+ *        After this call the field <code>filedata-&gt;item_id</code>
+ *        will contain the new file ID. Other fields such
+ *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
+ *        or <code>filedata-&gt;storage_id</code> may also change during this
  *        operation due to device restrictions, so do not rely on the
  *        contents of this struct to be preserved in any way.
  *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this track in. Since some
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
+ *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this file in. If this is 0,
+ *        the file will be stored in the root folder.
+ *        <li><code>filedata-&gt;storage_id</code> should be set to the
  *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
+ *        presents) to store this file in. Setting this to 0 will store
+ *        the file on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_File_From_File_Descriptor()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Send_File_From_File(LIBMTP_mtpdevice_t *device,
+			       char const * const path, LIBMTP_file_t * const filedata,
+			       LIBMTP_progressfunc_t const callback,
+			       void const * const data)
+{
+  int fd;
+  int ret;
+
+  // Sanity check
+  if (path == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File(): Bad arguments, path was NULL.");
+    return -1;
+  }
+
+  // Open file
+#ifdef __WIN32__
+#ifdef USE_WINDOWS_IO_H
+  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#else
+  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
+#endif
+#else
+  if ( (fd = open(path, O_RDONLY)) == -1) {
+#endif
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File(): Could not open source file.");
+    return -1;
+  }
+
+  ret = LIBMTP_Send_File_From_File_Descriptor(device, fd, filedata, callback, data);
+
+  // Close file.
+#ifdef USE_WINDOWS_IO_H
+  _close(fd);
+#else
+  close(fd);
+#endif
+
+  return ret;
+}
+
+/**
+ * This function sends a generic file from a file descriptor to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ *
+ * This can potentially be used for sending in a stream of unknown
+ * length. Send music files with
+ * <code>LIBMTP_Send_Track_From_File_Descriptor()</code>
+ *
+ * If zero-copy sends have been enabled with
+ * <code>LIBMTP_Set_Zero_Copy_Send()</code> and <code>fd</code> is a
+ * regular file, the file is memory mapped from its current offset and
+ * sent straight from the mapping.
+ *
+ * @param device a pointer to the device to send the file to.
+ * @param fd the filedescriptor for a local file which will be sent.
+ * @param filedata a file metadata set to be written along with the file.
+ *        After this call the field <code>filedata-&gt;item_id</code>
+ *        will contain the new file ID. Other fields such
+ *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
+ *        or <code>filedata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this file in. If this is 0,
+ *        the file will be stored in the root folder.
+ *        <li><code>filedata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this file in. Setting this to 0 will store
+ *        the file on the primary storage.
+ *        </ul>
+ * @param callback a progress indicator function or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ * @see LIBMTP_Send_File_From_File()
+ * @see LIBMTP_Send_Track_From_File_Descriptor()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
+			 int const fd, LIBMTP_file_t * const filedata,
+                         LIBMTP_progressfunc_t const callback,
+			 void const * const data)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *newfilemeta;
+  int oldtimeout;
+  int timeout;
+
+  // Nothing else may go between the object info and the object
+  ptp_lock(params, PTP_LOCK_TRANSACTION);
+  if (send_file_object_info(device, filedata))
+  {
+    // no need to output an error since send_file_object_info will already have done so
+    ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+    return -1;
+  }
+
+  // Callbacks
+  // The callback will deactivate itself after this amount of data has been sent
+  // One BULK header for the request, one for the data phase. No parameters to the request.
+  start_transfer_progress(ptp_usb, filedata->filesize+PTP_USB_BULK_HDR_LEN*2,
+			  callback, data);
+
+  /*
+   * We might need to increase the timeout here, files can be pretty
+   * large. Take the default timeout and add the calculated time for
+   * this transfer
+   */
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  timeout = oldtimeout +
+    (ptp_usb->current_transfer_total / guess_usb_speed(ptp_usb)) * 1000;
+  set_usb_device_timeout(ptp_usb, timeout);
+
+  ret = send_object_from_fd(params, ptp_usb, fd, filedata->filesize);
+
+  stop_transfer_progress(ptp_usb);
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+  ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+
+  if (ret != PTP_RC_OK)
+    invalidate_freespace(device, filedata->storage_id);
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_File_Descriptor(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_From_File_Descriptor(): "
+				"Could not send object.");
+    return -1;
+  }
+
+  account_freespace(device, filedata->storage_id, filedata->filesize, 1);
+  add_object_to_cache(device, filedata->item_id);
+
+  /*
+   * Get the device-assigned parent_id from the cache.
+   * The operation that adds it to the cache will
+   * look it up from the device, so we get the new
+   * parent_id from the cache.
+   */
+  newfilemeta = LIBMTP_Get_Filemetadata(device, filedata->item_id);
+  if (newfilemeta != NULL) {
+    filedata->parent_id = newfilemeta->parent_id;
+    filedata->storage_id = newfilemeta->storage_id;
+    LIBMTP_destroy_file_t(newfilemeta);
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_File_From_File_Descriptor(): "
+			    "Could not retrieve updated metadata.");
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * This function sends a generic file from a handler function to an
+ * MTP device. A filename and a set of metadata must be
+ * given as input.
+ *
+ * This can potentially be used for sending in a stream of unknown
+ * length. Send music files with
+ * <code>LIBMTP_Send_Track_From_Handler()</code>
+ *
+ * @param device a pointer to the device to send the file to.
+ * @param get_func the function to call to get data to write
+ * @param priv a user-defined pointer that is passed along to
+ *        <code>get_func</code>. If not used, this is set to NULL.
+ * @param filedata a file metadata set to be written along with the file.
+ *        After this call the field <code>filedata-&gt;item_id</code>
+ *        will contain the new file ID. Other fields such
+ *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
+ *        or <code>filedata-&gt;storage_id</code> may also change during this
+ *        operation due to device restrictions, so do not rely on the
+ *        contents of this struct to be preserved in any way.
+ *        <ul>
+ *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
+ *        (e.g. folder) to store this file in. If this is 0,
+ *        the file will be stored in the root folder.
+ *        <li><code>filedata-&gt;storage_id</code> should be set to the
+ *        desired storage (e.g. memory card or whatever your device
+ *        presents) to store this file in. Setting this to 0 will store
+ *        the file on the primary storage.
  *        </ul>
  * @param callback a progress indicator function or NULL to ignore.
  * @param data a user-defined pointer that is passed along to
@@ -5509,1388 +9945,3787 @@ int LIBMTP_Get_Track_To_Handler(LIBMTP_mtpdevice_t *device,
  *             updates. If not used, set this to NULL.
  * @return 0 if the transfer was successful, any other value means
  *           failure.
- * @see LIBMTP_Send_Track_From_File_Descriptor()
- * @see LIBMTP_Send_File_From_File()
- * @see LIBMTP_Delete_Object()
+ * @see LIBMTP_Send_File_From_File()
+ * @see LIBMTP_Send_Track_From_File_Descriptor()
+ * @see LIBMTP_Delete_Object()
+ */
+int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
+			 MTPDataGetFunc get_func, void * priv, LIBMTP_file_t * const filedata,
+       LIBMTP_progressfunc_t const callback, void const * const data)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  LIBMTP_file_t *newfilemeta;
+
+  // Nothing else may go between the object info and the object
+  ptp_lock(params, PTP_LOCK_TRANSACTION);
+  if (send_file_object_info(device, filedata))
+  {
+    // no need to output an error since send_file_object_info will already have done so
+    ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+    return -1;
+  }
+
+  // Callbacks
+  // The callback will deactivate itself after this amount of data has been sent
+  // One BULK header for the request, one for the data phase. No parameters to the request.
+  start_transfer_progress(ptp_usb, filedata->filesize+PTP_USB_BULK_HDR_LEN*2,
+			  callback, data);
+
+  MTPDataHandler mtp_handler;
+  mtp_handler.getfunc = get_func;
+  mtp_handler.putfunc = NULL;
+  mtp_handler.priv = priv;
+
+  PTPDataHandler handler;
+  handler.getfunc = get_func_wrapper;
+  handler.putfunc = NULL;
+  handler.getbuffunc = NULL;
+  handler.priv = &mtp_handler;
+
+  ret = ptp_sendobject_from_handler(params, &handler, filedata->filesize);
+
+  stop_transfer_progress(ptp_usb);
+  ptp_lock(params, PTP_UNLOCK_TRANSACTION);
+
+  if (ret != PTP_RC_OK)
+    invalidate_freespace(device, filedata->storage_id);
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_Handler(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_From_Handler(): "
+				"Could not send object.");
+    return -1;
+  }
+
+  account_freespace(device, filedata->storage_id, filedata->filesize, 1);
+  add_object_to_cache(device, filedata->item_id);
+
+  /*
+   * Get the device-assined parent_id from the cache.
+   * The operation that adds it to the cache will
+   * look it up from the device, so we get the new
+   * parent_id from the cache.
+   */
+  newfilemeta = LIBMTP_Get_Filemetadata(device, filedata->item_id);
+  if (newfilemeta != NULL) {
+    filedata->parent_id = newfilemeta->parent_id;
+    filedata->storage_id = newfilemeta->storage_id;
+    LIBMTP_destroy_file_t(newfilemeta);
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_File_From_Handler(): "
+			    "Could not retrieve updated metadata.");
+    return -1;
+  }
+
+  return 0;
+}
+
+static void nonblocking_send_finish(nonblocking_op_t *op, int const result)
+{
+  op->cb(op->device, result, op->user_data);
+  free(op->oi.Filename);
+  free(op);
+}
+
+static void nonblocking_sendobject_done(PTPParams *params, PTPContainer *resp,
+					uint16_t ret, void *data)
+{
+  nonblocking_op_t *op = (nonblocking_op_t *) data;
+  PTPObject *ob;
+  int result;
+
+  result = nonblocking_result(op->device, ret,
+			      "LIBMTP_Send_File_From_Handler_Nonblocking(): "
+			      "Could not send object.");
+  if (result != 0) {
+    invalidate_freespace(op->device, op->oi.StorageID);
+  } else {
+    account_freespace(op->device, op->oi.StorageID, op->filedata->filesize, 1);
+    /*
+     * The device told where the object went, so it goes into the
+     * cache from what was sent without asking the device again.
+     */
+    ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+    if (ptp_object_find_or_insert(params, op->id, &ob) == PTP_RC_OK &&
+	!(ob->flags & PTPOBJECT_OBJECTINFO_LOADED)) {
+      ob->oi.ObjectFormat = op->oi.ObjectFormat;
+      ob->oi.ObjectCompressedSize = op->filedata->filesize;
+      ob->oi.StorageID = op->oi.StorageID;
+      ob->oi.ParentObject = op->oi.ParentObject;
+      ob->oi.ModificationDate = op->oi.ModificationDate;
+      if (op->oi.Filename != NULL)
+	ob->oi.Filename = ptp_cache_strdup(params, op->oi.Filename);
+      ob->flags |= PTPOBJECT_OBJECTINFO_LOADED | PTPOBJECT_COREPROPS_LOADED |
+	PTPOBJECT_PARENTOBJECT_LOADED | PTPOBJECT_STORAGEID_LOADED |
+	PTPOBJECT_OBJECTSIZE_LOADED;
+      ptp_object_name_changed(params, ob);
+    }
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  }
+  nonblocking_send_finish(op, result);
+}
+
+static void nonblocking_objectinfo_done(PTPParams *params, PTPContainer *resp,
+					uint16_t ret, void *data)
+{
+  nonblocking_op_t *op = (nonblocking_op_t *) data;
+  LIBMTP_file_t *filedata = op->filedata;
+
+  if (nonblocking_result(op->device, ret,
+			 "LIBMTP_Send_File_From_Handler_Nonblocking(): "
+			 "Could not send object info.") != 0) {
+    nonblocking_send_finish(op, -1);
+    return;
+  }
+  // Where the device put the object, see send_file_object_info()
+  op->oi.StorageID = resp->Param1;
+  op->oi.ParentObject = resp->Param2;
+  op->id = resp->Param3;
+  filedata->storage_id = resp->Param1;
+  filedata->parent_id = resp->Param2;
+  filedata->item_id = resp->Param3;
+
+  ret = ptp_sendobject_from_handler_async(params, &op->handler,
+					  filedata->filesize,
+					  nonblocking_sendobject_done, op);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(op->device, ret,
+				"LIBMTP_Send_File_From_Handler_Nonblocking(): "
+				"could not start sending the object.");
+    nonblocking_send_finish(op, -1);
+  }
+}
+
+/**
+ * This function sends a generic file from a handler function to an
+ * MTP device, like <code>LIBMTP_Send_File_From_Handler()</code> but
+ * without blocking. The object info and then the object are sent as
+ * two non-blocking transactions; get_func and then the callback are
+ * called as they progress, from within
+ * <code>LIBMTP_Handle_Events_Timeout_Completed()</code>.
+ *
+ * Unlike the blocking call this asks the device nothing along the
+ * way: the storage is the one given, that of the parent folder if it
+ * is cached, or else the primary storage, the object info is sent
+ * with the plain PTP SendObjectInfo operation, and no metadata is read
+ * back afterwards.
+ *
+ * Only one non-blocking operation at a time can be underway on a
+ * device, and no other calls on the device may be made until its
+ * callback has been called. This works with libusb-1.0 only, and not
+ * on devices opened with <code>LIBMTP_Open_Raw_Device_Worker()</code>.
+ *
+ * @param device a pointer to the device to send the file to.
+ * @param get_func the function to call to get data to write
+ * @param priv a user-defined pointer that is passed along to
+ *        <code>get_func</code>. If not used, this is set to NULL.
+ * @param filedata a file metadata set to be written along with the file,
+ *        as for <code>LIBMTP_Send_File_From_Handler()</code>. It must stay
+ *        around until the callback has been called, and then holds the
+ *        new file ID, parent and storage.
+ * @param cb the callback to call when the transfer is over, with 0 if
+ *        it was successful and any other value if it failed.
+ * @param user_data arbitrary user data passed to the callback.
+ * @return 0 on success, any other value means that the transfer was not
+ *         started and the callback will not be called.
+ * @see LIBMTP_Get_Pollfds()
+ */
+int LIBMTP_Send_File_From_Handler_Nonblocking(LIBMTP_mtpdevice_t *device,
+					      MTPDataGetFunc get_func,
+					      void *priv,
+					      LIBMTP_file_t * const filedata,
+					      LIBMTP_nonblocking_cb_fn cb,
+					      void *user_data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t of = map_libmtp_type_to_ptp_type(filedata->filetype);
+  uint32_t store = filedata->storage_id;
+  uint32_t localph = filedata->parent_id;
+  nonblocking_op_t *op;
+  PTPObject *ob;
+  uint16_t ret;
+
+  if (!ptp_operation_issupported(params, PTP_OC_SendObjectInfo)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_File_From_Handler_Nonblocking(): "
+			    "device cannot take plain object info.");
+    return -1;
+  }
+  if (store == 0 && localph != 0) {
+    ptp_lock(params, PTP_LOCK_OBJECTS_READ);
+    if (ptp_object_find(params, localph, &ob) == PTP_RC_OK &&
+	(ob->flags & PTPOBJECT_STORAGEID_LOADED))
+      store = ob->oi.StorageID;
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  }
+  if (store == 0 && device->storage != NULL)
+    store = device->storage->id;
+  if (store == 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_File_From_Handler_Nonblocking(): "
+			    "no storage to send the file to.");
+    return -1;
+  }
+  if (localph == 0 && device->storage != NULL && store == device->storage->id)
+    localph = get_default_folder(device, filedata->filetype, of);
+  if (FLAG_OGG_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_OGG)
+    of = PTP_OFC_Undefined;
+  if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_FLAC)
+    of = PTP_OFC_Undefined;
+
+  op = (nonblocking_op_t *) calloc(1, sizeof(nonblocking_op_t));
+  if (op == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Send_File_From_Handler_Nonblocking(): "
+			    "out of memory.");
+    return -1;
+  }
+  op->device = device;
+  op->cb = cb;
+  op->user_data = user_data;
+  op->filedata = filedata;
+  op->mtp_handler.getfunc = get_func;
+  op->mtp_handler.putfunc = NULL;
+  op->mtp_handler.priv = priv;
+  op->handler.getfunc = get_func_wrapper;
+  op->handler.putfunc = NULL;
+  op->handler.getbuffunc = NULL;
+  op->handler.priv = &op->mtp_handler;
+
+  if (filedata->filename != NULL) {
+    op->oi.Filename = strdup(filedata->filename);
+    if (op->oi.Filename != NULL && FLAG_ONLY_7BIT_FILENAMES(ptp_usb))
+      strip_7bit_from_utf8(op->oi.Filename);
+  }
+  if (filedata->filesize > 0xFFFFFFFFL) {
+    // This is a kludge in the MTP standard for large files.
+    op->oi.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
+  } else {
+    op->oi.ObjectCompressedSize = (uint32_t) filedata->filesize;
+  }
+  op->oi.ObjectFormat = of;
+  op->oi.StorageID = store;
+  op->oi.ParentObject = localph;
+  op->oi.ModificationDate = time(NULL);
+
+  ret = ptp_sendobjectinfo_async(params, store, localph, &op->oi,
+				 nonblocking_objectinfo_done, op);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret,
+				"LIBMTP_Send_File_From_Handler_Nonblocking(): "
+				"could not start the transfer.");
+    free(op->oi.Filename);
+    free(op);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * The transfer digest of a device, see LIBMTP_Set_Transfer_Digest().
+ */
+typedef struct {
+  LIBMTP_digest_t type; /**< The digest to compute */
+  digest_t running; /**< The digest of the current object */
+  int active; /**< Whether running is under way */
+  int watching; /**< What the current transaction is, see below */
+  uint32_t object_id; /**< The object of running */
+  uint64_t offset; /**< Where in the object running started */
+  uint64_t bytes; /**< How much went into running */
+  uint32_t sent_id; /**< The object of the last object info sent */
+  int have_last; /**< Whether last holds a digest */
+  LIBMTP_transfer_digest_t last;
+} transfer_digest_t;
+
+#define DIGEST_WATCH_DATA 1
+#define DIGEST_WATCH_INFO 2
+
+static void finish_transfer_digest(transfer_digest_t *td, int const keep)
+{
+  digest_t copy;
+
+  td->last.type = td->type;
+  td->last.object_id = td->object_id;
+  td->last.offset = td->offset;
+  td->last.bytes = td->bytes;
+  td->last.object_size = 0;
+  if (keep && digest_copy(&copy, &td->running) == 0) {
+    td->last.length = digest_end(&copy, td->last.digest);
+  } else {
+    td->last.length = digest_end(&td->running, td->last.digest);
+    td->active = 0;
+  }
+  td->have_last = 1;
+}
+
+/**
+ * The data phase observer of a device with a transfer digest. It is
+ * called from inside the transactions, so it must not do any.
+ */
+static int transfer_digest_func(PTPParams *params, void *data, int phase,
+				PTPContainer *ptp, uint16_t ret,
+				unsigned char const *bytes, unsigned long len)
+{
+  transfer_digest_t *td = (transfer_digest_t *) data;
+  uint32_t id;
+  uint64_t offset = 0;
+  int partial = 0;
+
+  switch (phase) {
+  case PTP_DATA_BEGIN:
+    switch (ptp->Code) {
+    case PTP_OC_SendObjectInfo:
+    case PTP_OC_MTP_SendObjectPropList:
+      // Only the response is of interest, for the object to come
+      td->watching = DIGEST_WATCH_INFO;
+      return 1;
+    case PTP_OC_GetObject:
+      id = ptp->Param1;
+      break;
+    case PTP_OC_SendObject:
+      id = td->sent_id;
+      break;
+    case PTP_OC_GetPartialObject:
+      id = ptp->Param1;
+      offset = ptp->Param2;
+      partial = 1;
+      break;
+    case PTP_OC_ANDROID_GetPartialObject64:
+    case PTP_OC_ANDROID_SendPartialObject:
+      id = ptp->Param1;
+      offset = ptp->Param2 | ((uint64_t) ptp->Param3 << 32);
+      partial = 1;
+      break;
+    default:
+      return 0;
+    }
+    // A partial transfer that goes on where the last one stopped
+    // goes on with its digest
+    if (td->active && (!partial || id != td->object_id ||
+		       offset != td->offset + td->bytes)) {
+      digest_end(&td->running, NULL);
+      td->active = 0;
+    }
+    if (!td->active) {
+      if (digest_begin(&td->running, td->type) != 0)
+	return 0;
+      td->active = 1;
+      td->object_id = id;
+      td->offset = offset;
+      td->bytes = 0;
+    }
+    td->watching = partial ? -DIGEST_WATCH_DATA : DIGEST_WATCH_DATA;
+    return 1;
+  case PTP_DATA_BLOCK:
+    if (td->watching == DIGEST_WATCH_DATA ||
+	td->watching == -DIGEST_WATCH_DATA) {
+      digest_update(&td->running, bytes, len);
+      td->bytes += len;
+    }
+    return 1;
+  case PTP_DATA_END:
+    if (td->watching == DIGEST_WATCH_INFO) {
+      if (ret == PTP_RC_OK)
+	td->sent_id = ptp->Param3;
+    } else if (ret != PTP_RC_OK) {
+      // A digest of what did not make it is no use
+      if (td->active)
+	digest_end(&td->running, NULL);
+      td->active = 0;
+      td->have_last = 0;
+    } else if (td->active) {
+      finish_transfer_digest(td, td->watching < 0);
+    }
+    td->watching = 0;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void free_transfer_digest(LIBMTP_mtpdevice_t *device)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  transfer_digest_t *td = (transfer_digest_t *) DEVICE_PRIVATE(device)->digest;
+
+  if (td == NULL)
+    return;
+  params->data_func = NULL;
+  params->data_data = NULL;
+  if (td->active)
+    digest_end(&td->running, NULL);
+  free(td);
+  DEVICE_PRIVATE(device)->digest = NULL;
+}
+
+/**
+ * This makes every object transfer with the device compute a digest
+ * of the data on the way, from the buffers that are transferred anyway,
+ * so that a file does not have to be read again to check it. Whole
+ * objects are covered by GetObject and SendObject, and partial
+ * transfers that follow on from each other for the same object, as in
+ * <code>LIBMTP_Get_File_Chunked_To_File_Descriptor()</code>, add up to
+ * one digest. Fetch the result with
+ * <code>LIBMTP_Get_Transfer_Digest()</code> after the transfer.
+ *
+ * CRC32C is computed with the CRC32 instructions of the CPU where
+ * available, and SHA-256 with libgcrypt if libmtp was built with it.
+ * @param device a pointer to the device.
+ * @param type the digest to compute, <code>LIBMTP_DIGEST_NONE</code>
+ *        to stop, which is the default.
+ * @return 0 on success, any other value means failure, typically that
+ *         the digest is not available in this build.
+ * @see LIBMTP_Get_Transfer_Digest()
+ */
+int LIBMTP_Set_Transfer_Digest(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_digest_t const type)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  transfer_digest_t *td = (transfer_digest_t *) DEVICE_PRIVATE(device)->digest;
+
+  if (type == LIBMTP_DIGEST_NONE) {
+    free_transfer_digest(device);
+    return 0;
+  }
+  if (!digest_supported(type)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Set_Transfer_Digest(): "
+			    "digest not supported by this build.");
+    return -1;
+  }
+  if (td == NULL) {
+    td = (transfer_digest_t *) calloc(1, sizeof(transfer_digest_t));
+    if (td == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Set_Transfer_Digest(): out of memory.");
+      return -1;
+    }
+    DEVICE_PRIVATE(device)->digest = td;
+  } else if (td->active) {
+    digest_end(&td->running, NULL);
+    td->active = 0;
+  }
+  td->type = type;
+  params->data_func = transfer_digest_func;
+  params->data_data = td;
+  return 0;
+}
+
+/**
+ * This hands out the digest of the last object transfer with the
+ * device, along with the size of the object in the object cache to
+ * check the number of bytes against.
+ * @param device a pointer to the device.
+ * @param digest the digest is returned here.
+ * @return 0 on success, any other value if there is no digest, because
+ *         none was set with <code>LIBMTP_Set_Transfer_Digest()</code>
+ *         or the last object transfer failed.
+ * @see LIBMTP_Set_Transfer_Digest()
+ */
+int LIBMTP_Get_Transfer_Digest(LIBMTP_mtpdevice_t *device,
+			       LIBMTP_transfer_digest_t * const digest)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  transfer_digest_t *td = (transfer_digest_t *) DEVICE_PRIVATE(device)->digest;
+  PTPObject *ob;
+
+  if (td == NULL || !td->have_last)
+    return -1;
+  *digest = td->last;
+  ptp_lock(params, PTP_LOCK_OBJECTS_READ);
+  if (ptp_object_find(params, digest->object_id, &ob) == PTP_RC_OK &&
+      (ob->flags & PTPOBJECT_OBJECTINFO_LOADED))
+    digest->object_size = ob->oi.ObjectCompressedSize;
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  return 0;
+}
+
+/**
+ * Internal function to read <code>len</code> bytes at offset
+ * <code>offset</code> of a file descriptor, retrying short reads.
+ * @return 0 on success, -1 on a read error or early end of file.
+ */
+static int read_fd_range(int const fd, uint64_t const offset,
+			 unsigned char *buf, uint32_t const len)
+{
+  uint32_t got = 0;
+
+  if (lseek(fd, offset, SEEK_SET) == (off_t) -1)
+    return -1;
+  while (got < len) {
+    int ret = read(fd, buf + got, len - got);
+
+    if (ret <= 0) {
+      if (ret == -1 && errno == EINTR)
+	continue;
+      return -1;
+    }
+    got += ret;
+  }
+  return 0;
+}
+
+/**
+ * This sends a file from a file descriptor to the device as a series
+ * of partial object writes, so that an upload that fails halfway can be
+ * picked up again where it stopped instead of starting over. This needs
+ * the Android edit object extensions.
+ *
+ * If <code>filedata->item_id</code> is 0 the object is created first,
+ * empty, from the metadata in <code>filedata</code> the same way
+ * LIBMTP_Send_File_From_File_Descriptor() does, and its new ID is put
+ * in <code>filedata->item_id</code>. Otherwise the upload continues
+ * into that object, which must come from an earlier call.
+ *
+ * Byte N of the object is read from file offset N of <code>fd</code>.
+ * <code>*offset</code> is where to start, and on return holds the end
+ * of the data the device confirmed. After a failure, for example a
+ * timeout followed by a USB reset and reopening the device, call this
+ * again with the same <code>filedata->item_id</code> and
+ * <code>offset</code> to send the rest. Anything the device got
+ * beyond the checkpoint is cut off before sending resumes.
+ *
+ * When all data is sent the size of the object on the device is
+ * checked against <code>filedata->filesize</code>.
+ *
+ * @param device a pointer to the device to send the file to.
+ * @param fd a seekable local file descriptor to read the file from.
+ * @param filedata a file metadata set to be written along with the file,
+ *        <code>filesize</code> is the full size of the file.
+ * @param offset where to start in the object, updated as ranges are
+ *        confirmed.
+ * @param chunksize the size of each range, or 0 for the default.
+ * @param callback a progress indicator function or NULL to ignore, it
+ *        is called after each range.
+ * @param data a user-defined pointer that is passed along to
+ *             the <code>progress</code> function in order to
+ *             pass along some user defined data to the progress
+ *             updates. If not used, set this to NULL.
+ * @return 0 if the whole file has been sent, any other value means
+ *           failure.
+ * @see LIBMTP_Send_File_From_File_Descriptor()
+ * @see LIBMTP_Get_File_Chunked_To_File_Descriptor()
+ */
+int LIBMTP_Send_File_Chunked_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
+						  int const fd,
+						  LIBMTP_file_t * const filedata,
+						  uint64_t * const offset,
+						  uint32_t chunksize,
+						  LIBMTP_progressfunc_t const callback,
+						  void const * const data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+#ifdef HAVE_SYS_MMAN_H
+  PTPDataHandler mmap_handler;
+  MTPMmapHandler mh;
+#endif
+  unsigned char *mapped = NULL;
+  unsigned char *buf = NULL;
+  LIBMTP_file_t *newfilemeta;
+  uint64_t filesize;
+  uint64_t done;
+  uint32_t len;
+  uint16_t ret = PTP_RC_OK;
+  int oldtimeout;
+  int timeout;
+
+  if (filedata == NULL || offset == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_Chunked_From_File_Descriptor(): Bad arguments, filedata or offset was NULL.");
+    return -1;
+  }
+  if (!ptp_operation_issupported(params, PTP_OC_ANDROID_SendPartialObject) ||
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_BeginEditObject) ||
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_EndEditObject) ||
+      !ptp_operation_issupported(params, PTP_OC_ANDROID_TruncateObject)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_Chunked_From_File_Descriptor(): Android edit object extensions not supported.");
+    return -1;
+  }
+  filesize = filedata->filesize;
+  if (*offset > filesize) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_Chunked_From_File_Descriptor(): Offset is past the end of the file.");
+    return -1;
+  }
+  if (chunksize == 0) {
+    chunksize = DEFAULT_PARTIAL_CHUNK;
+  }
+
+  if (filedata->item_id == 0) {
+    // Create the object empty, all data goes in as partial writes
+    *offset = 0;
+    filedata->filesize = 0;
+    if (send_file_object_info(device, filedata)) {
+      // no need to output an error since send_file_object_info will already have done so
+      filedata->filesize = filesize;
+      return -1;
+    }
+    filedata->filesize = filesize;
+    ret = ptp_sendobject(params, (unsigned char *) "", 0);
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_Chunked_From_File_Descriptor(): "
+				  "Could not create object.");
+      return -1;
+    }
+  }
+
+  ret = ptp_android_begineditobject(params, filedata->item_id);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_Chunked_From_File_Descriptor(): "
+				"Could not begin editing object.");
+    return -1;
+  }
+  // Drop whatever part of an unconfirmed range made it to the device
+  ret = ptp_android_truncate(params, filedata->item_id, *offset);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_Chunked_From_File_Descriptor(): "
+				"Could not truncate object to the checkpoint.");
+    (void) ptp_android_endeditobject(params, filedata->item_id);
+    return -1;
+  }
+
+  done = *offset;
+  if (done < filesize) {
+#ifdef HAVE_SYS_MMAN_H
+    if (lseek(fd, 0, SEEK_SET) == 0 &&
+	init_mmap_handler(&mmap_handler, &mh, fd, filesize, 0) == 0) {
+      mapped = mh.data;
+    }
+#endif
+    if (mapped == NULL) {
+      if (chunksize > filesize - done)
+	chunksize = filesize - done;
+      buf = malloc(chunksize);
+      if (buf == NULL) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Send_File_Chunked_From_File_Descriptor(): Could not allocate buffer.");
+	(void) ptp_android_endeditobject(params, filedata->item_id);
+	return -1;
+      }
+    }
+  }
+
+  // Give each range the time a transfer of its size needs
+  get_usb_device_timeout(ptp_usb, &oldtimeout);
+  timeout = oldtimeout + (chunksize / guess_usb_speed(ptp_usb)) * 1000;
+  set_usb_device_timeout(ptp_usb, timeout);
+
+  while (done < filesize) {
+    len = chunksize;
+    if (len > filesize - done)
+      len = filesize - done;
+    if (mapped != NULL) {
+      ret = ptp_android_sendpartialobject(params, filedata->item_id, done,
+					  mapped + done, len);
+    } else if (read_fd_range(fd, done, buf, len) != 0) {
+      ret = PTP_ERROR_IO;
+    } else {
+      ret = ptp_android_sendpartialobject(params, filedata->item_id, done,
+					  buf, len);
+    }
+    if (ret != PTP_RC_OK)
+      break;
+    done += len;
+    *offset = done;
+    if (callback != NULL && callback(done, filesize, data) != 0) {
+      ret = PTP_ERROR_CANCEL;
+      break;
+    }
+  }
+
+  set_usb_device_timeout(ptp_usb, oldtimeout);
+#ifdef HAVE_SYS_MMAN_H
+  if (mapped != NULL)
+    exit_mmap_handler(&mh);
+#endif
+  free(buf);
+
+  // Finish the edit in any case so the device drops its state, it
+  // is redone with the truncation when resuming
+  if (ret == PTP_RC_OK) {
+    ret = ptp_android_endeditobject(params, filedata->item_id);
+  } else {
+    (void) ptp_android_endeditobject(params, filedata->item_id);
+  }
+
+  if (ret == PTP_ERROR_CANCEL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_Chunked_From_File_Descriptor(): Cancelled transfer.");
+    return -1;
+  }
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_Chunked_From_File_Descriptor(): "
+				"Could not send object.");
+    return -1;
+  }
+
+  // The cached size is the empty one from creation, fetch it anew
+  update_metadata_cache(device, filedata->item_id);
+  newfilemeta = LIBMTP_Get_Filemetadata(device, filedata->item_id);
+  if (newfilemeta == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_File_Chunked_From_File_Descriptor(): "
+			    "Could not retrieve updated metadata.");
+    return -1;
+  }
+  filedata->parent_id = newfilemeta->parent_id;
+  filedata->storage_id = newfilemeta->storage_id;
+  if (newfilemeta->filesize != filesize) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Send_File_Chunked_From_File_Descriptor(): "
+			    "Object size on the device does not match the file.");
+    LIBMTP_destroy_file_t(newfilemeta);
+    return -1;
+  }
+  LIBMTP_destroy_file_t(newfilemeta);
+
+  return 0;
+}
+
+/**
+ * This looks up the folder where the device wants files of a type to
+ * go, if they are sent to the primary storage without a destination.
+ * @param device a pointer to the device to send the file to.
+ * @param filetype the file type of the file.
+ * @param of the PTP object format of the file.
+ * @return the folder ID, or 0 for the root folder.
+ */
+static uint32_t get_default_folder(LIBMTP_mtpdevice_t *device,
+				   LIBMTP_filetype_t const filetype,
+				   uint16_t const of)
+{
+  if (LIBMTP_FILETYPE_IS_AUDIO(filetype)) {
+    return device->default_music_folder;
+  } else if (LIBMTP_FILETYPE_IS_VIDEO(filetype)) {
+    return device->default_video_folder;
+  } else if (of == PTP_OFC_EXIF_JPEG ||
+	     of == PTP_OFC_JP2 ||
+	     of == PTP_OFC_JPX ||
+	     of == PTP_OFC_JFIF ||
+	     of == PTP_OFC_TIFF ||
+	     of == PTP_OFC_TIFF_IT ||
+	     of == PTP_OFC_BMP ||
+	     of == PTP_OFC_GIF ||
+	     of == PTP_OFC_PICT ||
+	     of == PTP_OFC_PNG ||
+	     of == PTP_OFC_MTP_WindowsImageFormat) {
+    return device->default_picture_folder;
+  } else if (of == PTP_OFC_MTP_vCalendar1 ||
+	     of == PTP_OFC_MTP_vCalendar2 ||
+	     of == PTP_OFC_MTP_UndefinedContact ||
+	     of == PTP_OFC_MTP_vCard2 ||
+	     of == PTP_OFC_MTP_vCard3 ||
+	     of == PTP_OFC_MTP_UndefinedCalendarItem) {
+    return device->default_organizer_folder;
+  } else if (of == PTP_OFC_Text) {
+    return device->default_text_folder;
+  }
+  return 0;
+}
+
+/**
+ * This function sends the file object info, ready for sendobject
+ * @param device a pointer to the device to send the file to.
+ * @param filedata a file metadata set to be written along with the file.
+ * @return 0 if the transfer was successful, any other value means
+ *           failure.
+ */
+static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t store;
+  int use_primary_storage = 1;
+  uint16_t of = map_libmtp_type_to_ptp_type(filedata->filetype);
+  LIBMTP_devicestorage_t *storage;
+  uint32_t localph = filedata->parent_id;
+  uint16_t ret;
+  unsigned int i;
+
+#if 0
+  // Sanity check: no zerolength files on some devices?
+  // If the zerolength files cause problems on some devices,
+  // then add a bug flag for this.
+  if (filedata->filesize == 0) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "send_file_object_info(): "
+			    "File of zero size.");
+    return -1;
+  }
+#endif
+  if (filedata->storage_id != 0) {
+    store = filedata->storage_id;
+  } else {
+    store = get_suggested_storage_id(device, filedata->filesize, localph);
+  }
+
+  // Detect if something non-primary is in use.
+  storage = device->storage;
+  if (storage != NULL && store != storage->id) {
+    use_primary_storage = 0;
+  }
+
+  /*
+   * If no destination folder was given, look up a default
+   * folder if possible. Perhaps there is some way of retrieveing
+   * the default folder for different forms of content, what
+   * do I know, we use a fixed list in lack of any better method.
+   * Some devices obviously need to have their files in certain
+   * folders in order to find/display them at all (hello Creative),
+   * so we have to have a method for this. We only do this if the
+   * primary storage is in use.
+   */
+
+  if (localph == 0 && use_primary_storage) {
+    localph = get_default_folder(device, filedata->filetype, of);
+  }
+
+  // Here we wire the type to unknown on bugged, but
+  // Ogg or FLAC-supportive devices.
+  if (FLAG_OGG_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_OGG) {
+    of = PTP_OFC_Undefined;
+  }
+  if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_FLAC) {
+    of = PTP_OFC_Undefined;
+  }
+
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
+      !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
+    /*
+     * MTP enhanched does it this way (from a sniff):
+     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
+     *    20 00 00 00 01 00 08 98 1B 00 00 00 01 00 01 00
+     *    FF FF FF FF 00 30 00 00 00 00 00 00 12 5E 00 00
+     *    Length: 0x00000020
+     *    Type:   0x0001 PTP_USB_CONTAINER_COMMAND
+     *    Code:   0x9808
+     *    Transaction ID: 0x0000001B
+     *    Param1: 0x00010001 <- store
+     *    Param2: 0xffffffff <- parent handle (-1 ?)
+     *    Param3: 0x00003000 <- file type PTP_OFC_Undefined - we don't know about PDF files
+     *    Param4: 0x00000000 <- file length MSB (-0x0c header len)
+     *    Param5: 0x00005e12 <- file length LSB (-0x0c header len)
+     *
+     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
+     *    46 00 00 00 02 00 08 98 1B 00 00 00 03 00 00 00
+     *    00 00 00 00 07 DC FF FF 0D 4B 00 53 00 30 00 36 - dc07 = file name
+     *    00 30 00 33 00 30 00 36 00 2E 00 70 00 64 00 66
+     *    00 00 00 00 00 00 00 03 DC 04 00 00 00 00 00 00 - dc03 = protection status
+     *    00 4F DC 02 00 01                               - dc4f = non consumable
+     *    Length: 0x00000046
+     *    Type:   0x0002 PTP_USB_CONTAINER_DATA
+     *    Code:   0x9808
+     *    Transaction ID: 0x0000001B
+     *    Metadata....
+     *    0x00000003 <- Number of metadata items
+     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
+     *    0xdc07     <- metadata type: file name
+     *    0xffff     <- metadata type: string
+     *    0x0d       <- number of (uint16_t) characters
+     *    4b 53 30 36 30 33 30 36 2e 50 64 66 00 "KS060306.pdf", null terminated
+     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
+     *    0xdc03     <- metadata type: protection status
+     *    0x0004     <- metadata type: uint16_t
+     *    0x0000     <- not protected
+     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
+     *    0xdc4f     <- non consumable
+     *    0x0002     <- metadata type: uint8_t
+     *    0x01       <- non-consumable (this device cannot display PDF)
+     *
+     * <- Read 0x18 bytes back
+     *    18 00 00 00 03 00 01 20 1B 00 00 00 01 00 01 00
+     *    00 00 00 00 01 40 00 00
+     *    Length: 0x000000018
+     *    Type:   0x0003 PTP_USB_CONTAINER_RESPONSE
+     *    Code:   0x2001 PTP_OK
+     *    Transaction ID: 0x0000001B
+     *    Param1: 0x00010001 <- store
+     *    Param2: 0x00000000 <- parent handle
+     *    Param3: 0x00004001 <- new file/object ID
+     *
+     * -> PTP_OC_SendObject (0x100d)
+     *    0C 00 00 00 01 00 0D 10 1C 00 00 00
+     * -> ... all the bytes ...
+     * <- Read 0x0c bytes back
+     *    0C 00 00 00 03 00 01 20 1C 00 00 00
+     *    ... Then update metadata one-by one, actually (instead of sending it first!) ...
+     */
+    MTPProperties *props = NULL;
+    int nrofprops = 0;
+    MTPProperties *prop = NULL;
+    uint16_t *properties = NULL;
+    uint32_t propcnt = 0;
+
+    // default parent handle
+    if (localph == 0)
+      localph = 0xFFFFFFFFU; // Set to -1
+
+    // Must be 0x00000000U for new objects
+    filedata->item_id = 0x00000000U;
+
+    ret = ptp_mtp_getobjectpropssupported(params, of, &propcnt, &properties);
+
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
+
+      ret = ptp_mtp_getobjectpropdesc(params, properties[i], of, &opd);
+      if (ret != PTP_RC_OK) {
+	add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
+				"could not get property description.");
+      } else if (opd.GetSet) {
+	switch (properties[i]) {
+	case PTP_OPC_ObjectFileName:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_ObjectFileName;
+	  prop->datatype = PTP_DTC_STR;
+	  if (filedata->filename != NULL) {
+	    prop->propval.str = strdup(filedata->filename);
+	    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+	      strip_7bit_from_utf8(prop->propval.str);
+	    }
+	  }
+	  break;
+	case PTP_OPC_ProtectionStatus:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_ProtectionStatus;
+	  prop->datatype = PTP_DTC_UINT16;
+	  prop->propval.u16 = 0x0000U; /* Not protected */
+	  break;
+	case PTP_OPC_NonConsumable:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_NonConsumable;
+	  prop->datatype = PTP_DTC_UINT8;
+	  prop->propval.u8 = 0x00; /* It is supported, then it is consumable */
+	  break;
+	case PTP_OPC_Name:
+	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	  prop->ObjectHandle = filedata->item_id;
+	  prop->property = PTP_OPC_Name;
+	  prop->datatype = PTP_DTC_STR;
+	  if (filedata->filename != NULL)
+	    prop->propval.str = strdup(filedata->filename);
+	  break;
+	case PTP_OPC_DateModified:
+	  // Tag with current time if that is supported
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
+	    prop->ObjectHandle = filedata->item_id;
+	    prop->property = PTP_OPC_DateModified;
+	    prop->datatype = PTP_DTC_STR;
+	    prop->propval.str = get_iso8601_stamp();
+	    filedata->modificationdate = time(NULL);
+	  }
+	  break;
+	}
+      }
+      ptp_free_objectpropdesc(&opd);
+    }
+    free(properties);
+
+    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, &filedata->item_id,
+				     of, filedata->filesize, props, nrofprops);
+
+    /* Free property list */
+    ptp_destroy_object_prop_list(props, nrofprops);
+
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "send_file_object_info():"
+				  "Could not send object property list.");
+      if (ret == PTP_RC_AccessDenied) {
+	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+      }
+      return -1;
+    }
+  } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
+    PTPObjectInfo new_file;
+
+    memset(&new_file, 0, sizeof(PTPObjectInfo));
+
+    new_file.Filename = filedata->filename;
+    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+      strip_7bit_from_utf8(new_file.Filename);
+    }
+    if (filedata->filesize > 0xFFFFFFFFL) {
+      // This is a kludge in the MTP standard for large files.
+      new_file.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
+    } else {
+      new_file.ObjectCompressedSize = (uint32_t) filedata->filesize;
+    }
+    new_file.ObjectFormat = of;
+    new_file.StorageID = store;
+    new_file.ParentObject = localph;
+    new_file.ModificationDate = time(NULL);
+
+    // Create the object
+    ret = ptp_sendobjectinfo(params, &store, &localph, &filedata->item_id, &new_file);
+
+    if (ret != PTP_RC_OK) {
+      add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
+				  "Could not send object info.");
+      if (ret == PTP_RC_AccessDenied) {
+	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+      }
+      return -1;
+    }
+    // NOTE: the char* pointers inside new_file are not copies so don't
+    // try to destroy this objectinfo!
+  }
+
+  // Now there IS an object with this parent handle.
+  filedata->parent_id = localph;
+
+  return 0;
+}
+
+/**
+ * Internal function to put the metadata of a track into an object
+ * property list, the way LIBMTP_Update_Track_Metadata() sends it.
+ * @param device a pointer to the device holding the track.
+ * @param metadata the track metadata to write.
+ * @param properties the properties the device supports for the
+ *        format of the track.
+ * @param propcnt the number of supported properties.
+ * @param props the list to append the properties to.
+ * @param nrofprops the number of properties in the list.
  */
-int LIBMTP_Send_Track_From_File(LIBMTP_mtpdevice_t *device,
-			 char const * const path, LIBMTP_track_t * const metadata,
-                         LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+static void add_track_metadata_props(LIBMTP_mtpdevice_t *device,
+				     LIBMTP_track_t const * const metadata,
+				     uint16_t const *properties,
+				     uint32_t const propcnt,
+				     MTPProperties **props, int *nrofprops)
 {
-  int fd;
-  int ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  MTPProperties *prop;
+  uint16_t ret;
+  uint32_t i;
 
-  // Sanity check
-  if (path == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_Track_From_File(): Bad arguments, path was NULL.");
+  for (i=0;i<propcnt;i++) {
+    PTPObjectPropDesc opd;
+
+    ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
+    if (ret != PTP_RC_OK) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+			"could not get property description.");
+    } else if (opd.GetSet) {
+      switch (properties[i]) {
+      case PTP_OPC_Name:
+	if (metadata->title == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Name;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->title);
+	break;
+      case PTP_OPC_AlbumName:
+	if (metadata->album == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_AlbumName;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->album);
+	break;
+      case PTP_OPC_Artist:
+	if (metadata->artist == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Artist;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->artist);
+	break;
+      case PTP_OPC_Composer:
+	if (metadata->composer == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Composer;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->composer);
+	break;
+      case PTP_OPC_Genre:
+	if (metadata->genre == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Genre;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->genre);
+	break;
+      case PTP_OPC_Duration:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Duration;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->duration, &opd);
+	break;
+      case PTP_OPC_Track:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Track;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->tracknumber, &opd);
+	break;
+      case PTP_OPC_OriginalReleaseDate:
+	if (metadata->date == NULL)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_OriginalReleaseDate;
+	prop->datatype = PTP_DTC_STR;
+	prop->propval.str = strdup(metadata->date);
+	break;
+      case PTP_OPC_SampleRate:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_SampleRate;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->samplerate, &opd);
+	break;
+      case PTP_OPC_NumberOfChannels:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_NumberOfChannels;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->nochannels, &opd);
+	break;
+      case PTP_OPC_AudioWAVECodec:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_AudioWAVECodec;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->wavecodec, &opd);
+	break;
+      case PTP_OPC_AudioBitRate:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_AudioBitRate;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->bitrate, &opd);
+	break;
+      case PTP_OPC_BitRateType:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_BitRateType;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->bitratetype, &opd);
+	break;
+      case PTP_OPC_Rating:
+	// TODO: shall this be set for rating 0?
+	if (metadata->rating == 0)
+	  break;
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_Rating;
+	prop->datatype = PTP_DTC_UINT16;
+	prop->propval.u16 = adjust_u16(metadata->rating, &opd);
+	break;
+      case PTP_OPC_UseCount:
+	prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	prop->ObjectHandle = metadata->item_id;
+	prop->property = PTP_OPC_UseCount;
+	prop->datatype = PTP_DTC_UINT32;
+	prop->propval.u32 = adjust_u32(metadata->usecount, &opd);
+	break;
+      case PTP_OPC_DateModified:
+	if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	  // Tag with current time if that is supported
+	  prop = ptp_get_new_object_prop_entry(props, nrofprops);
+	  prop->ObjectHandle = metadata->item_id;
+	  prop->property = PTP_OPC_DateModified;
+	  prop->datatype = PTP_DTC_STR;
+	  prop->propval.str = get_iso8601_stamp();
+	}
+	break;
+      default:
+	break;
+      }
+    }
+    ptp_free_objectpropdesc(&opd);
+  }
+}
+
+/**
+ * This function updates the MTP track object metadata on a
+ * single file identified by an object ID.
+ * @param device a pointer to the device to update the track
+ *        metadata on.
+ * @param metadata a track metadata set to be written to the file.
+ *        notice that the <code>track_id</code> field of the
+ *        metadata structure must be correct so that the
+ *        function can update the right file. If some properties
+ *        of this metadata are set to NULL (strings) or 0
+ *        (numerical values) they will be discarded and the
+ *        track will not be tagged with these blank values.
+ * @return 0 on success, any other value means failure. If some
+ *        or all of the properties fail to update we will still
+ *        return success. On some devices (notably iRiver T30)
+ *        properties that exist cannot be updated.
+ */
+int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
+				 LIBMTP_track_t const * const metadata)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint32_t i;
+  uint16_t *properties = NULL;
+  uint32_t propcnt = 0;
+
+  // First see which properties can be set on this file format and apply accordingly
+  // i.e only try to update this metadata for object tags that exist on the current player.
+  ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(metadata->filetype), &propcnt, &properties);
+  if (ret != PTP_RC_OK) {
+    // Just bail out for now, nothing is ever set.
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+			    "could not retrieve supported object properties.");
     return -1;
   }
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    int nrofprops = 0;
+
+    add_track_metadata_props(device, metadata, properties, propcnt,
+			     &props, &nrofprops);
+
+    // NOTE: File size is not updated, this should not change anyway.
+    // neither will we change the filename.
+
+    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+
+    ptp_destroy_object_prop_list(props, nrofprops);
+
+    if (ret != PTP_RC_OK) {
+      // TODO: return error of which property we couldn't set
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+			      "could not set object property list.");
+      free(properties);
+      return -1;
+    }
+
+  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
+    for (i=0;i<propcnt;i++) {
+      PTPObjectPropDesc opd;
+
+      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
+      if (ret != PTP_RC_OK) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				"could not get property description.");
+      } else if (opd.GetSet) {
+	switch (properties[i]) {
+	case PTP_OPC_Name:
+	  // Update title
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Name, metadata->title);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track title.");
+	  }
+	  break;
+	case PTP_OPC_AlbumName:
+	  // Update album
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_AlbumName, metadata->album);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track album name.");
+	  }
+	  break;
+	case PTP_OPC_Artist:
+	  // Update artist
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Artist, metadata->artist);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track artist name.");
+	  }
+	  break;
+	case PTP_OPC_Composer:
+	  // Update composer
+	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Composer, metadata->composer);
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set track composer name.");
+	  }
+	  break;
+	case PTP_OPC_Genre:
+	  // Update genre (but only if valid)
+	  if (metadata->genre) {
+	    ret = set_object_string(device, metadata->item_id, PTP_OPC_Genre, metadata->genre);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
+				      "could not set genre.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_Duration:
+	  // Update duration
+	  if (metadata->duration != 0) {
+	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_Duration, adjust_u32(metadata->duration, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set track duration.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_Track:
+	  // Update track number.
+	  if (metadata->tracknumber != 0) {
+	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Track, adjust_u16(metadata->tracknumber, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set track tracknumber.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_OriginalReleaseDate:
+	  // Update creation datetime
+	  // The date can be zero, but some devices do not support setting zero
+	  // dates (and it seems that a zero date should never be set anyway)
+	  if (metadata->date) {
+	    ret = set_object_string(device, metadata->item_id, PTP_OPC_OriginalReleaseDate, metadata->date);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set track release date.");
+	    }
+	  }
+	  break;
+	  // These are, well not so important.
+	case PTP_OPC_SampleRate:
+	  // Update sample rate
+	  if (metadata->samplerate != 0) {
+	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_SampleRate, adjust_u32(metadata->samplerate, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set samplerate.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_NumberOfChannels:
+	  // Update number of channels
+	  if (metadata->nochannels != 0) {
+	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_NumberOfChannels, adjust_u16(metadata->nochannels, &opd));
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				    "could not set number of channels.");
+	  }
+	}
+	  break;
+	case PTP_OPC_AudioWAVECodec:
+	  // Update WAVE codec
+	  if (metadata->wavecodec != 0) {
+	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioWAVECodec, adjust_u32(metadata->wavecodec, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set WAVE codec.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_AudioBitRate:
+	  // Update bitrate
+	  if (metadata->bitrate != 0) {
+	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioBitRate, adjust_u32(metadata->bitrate, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set bitrate.");
+	  }
+	  }
+	  break;
+	case PTP_OPC_BitRateType:
+	  // Update bitrate type
+	  if (metadata->bitratetype != 0) {
+	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_BitRateType, adjust_u16(metadata->bitratetype, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set bitratetype.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_Rating:
+	  // Update user rating
+	  // TODO: shall this be set for rating 0?
+	  if (metadata->rating != 0) {
+	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Rating, adjust_u16(metadata->rating, &opd));
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set user rating.");
+	    }
+	  }
+	  break;
+	case PTP_OPC_UseCount:
+	  // Update use count, set even to zero if desired.
+	  ret = set_object_u32(device, metadata->item_id, PTP_OPC_UseCount, adjust_u32(metadata->usecount, &opd));
+	  if (ret != 0) {
+	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				  "could not set use count.");
+	  }
+	  break;
+	case PTP_OPC_DateModified:
+	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
+	    // Update modification time if supported
+	    char *tmpstamp = get_iso8601_stamp();
+	    ret = set_object_string(device, metadata->item_id, PTP_OPC_DateModified, tmpstamp);
+	    if (ret != 0) {
+	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+				      "could not set modification date.");
+	    }
+	    free(tmpstamp);
+	  }
+	  break;
 
-  // Open file
-#ifdef __WIN32__
-#ifdef USE_WINDOWS_IO_H
-  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
-#else
-  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
-#endif
-#else
-  if ( (fd = open(path, O_RDONLY)) == -1) {
-#endif
-    LIBMTP_ERROR("LIBMTP_Send_Track_From_File(): Could not open source file \"%s\"\n", path);
+	  // NOTE: File size is not updated, this should not change anyway.
+	  // neither will we change the filename.
+	default:
+	  break;
+	}
+      }
+      ptp_free_objectpropdesc(&opd);
+    }
+  } else {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
+                            "Your device doesn't seem to support any known way of setting metadata.");
+    free(properties);
     return -1;
   }
 
-  ret = LIBMTP_Send_Track_From_File_Descriptor(device, fd, metadata, callback, data);
+  // update cached object properties if metadata cache exists
+  update_metadata_cache(device, metadata->item_id);
 
-  // Close file.
-#ifdef USE_WINDOWS_IO_H
-  _close(fd);
-#else
-  close(fd);
-#endif
+  free(properties);
 
-  return ret;
+  return 0;
 }
 
-
+/**
+ * The number of properties after which
+ * LIBMTP_Update_Tracklist_Metadata() sends what it collected. The
+ * properties of one track always go together, so a list may run over
+ * by one track.
+ */
+#define BULK_METADATA_PROPS 2048
 
 /**
- * This helper function checks if a filename already exists on the device
- * @param PTPParams*
- * @param string representing the filename
- * @return 0 if the filename doesn't exist, -1 if it does
+ * Internal function to apply properties that were written to a cached
+ * object. Properties the object has are overwritten; the others are
+ * added if its property list was read.
+ * @param params the PTP parameters holding the cache.
+ * @param props the properties that were written.
+ * @param n the number of properties.
  */
-static int check_filename_exists(PTPParams* params, char const * const filename)
+static void update_cached_object_props(PTPParams *params,
+				       MTPProperties const *props, int n)
 {
-  unsigned int i;
+  PTPObject *ob;
+  MTPProperties *newprops;
+  MTPProperties *prop;
+  int i, missing = 0;
+  unsigned int j;
 
-  for (i = 0; i < params->nrofobjects; i++) {
-    char *fname = params->objects[i].oi.Filename;
-    if ((fname != NULL) && (strcmp(filename, fname) == 0))
-    {
-      return -1;
+  if (n == 0 || ptp_object_find(params, props[0].ObjectHandle, &ob) != PTP_RC_OK)
+    return;
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < ob->nrofmtpprops; j++) {
+      if (ob->mtpprops[j].property == props[i].property)
+	break;
+    }
+    if (j == ob->nrofmtpprops) {
+      missing++;
+      continue;
     }
+    prop = &ob->mtpprops[j];
+    prop->datatype = props[i].datatype;
+    if (props[i].datatype == PTP_DTC_STR)
+      prop->propval.str = ptp_cache_strdup(params, props[i].propval.str);
+    else
+      prop->propval = props[i].propval;
   }
+  if (missing == 0 ||
+      !(ob->flags & (PTPOBJECT_MTPPROPLIST_LOADED|PTPOBJECT_MEDIAPROPS_LOADED)))
+    return;
 
-  return 0;
+  newprops = ptp_cache_alloc(params, (ob->nrofmtpprops + missing) * sizeof(MTPProperties));
+  if (newprops == NULL)
+    return;
+  if (ob->nrofmtpprops)
+    memcpy(newprops, ob->mtpprops, ob->nrofmtpprops * sizeof(MTPProperties));
+  ptp_cache_free(params, ob->mtpprops, ob->nrofmtpprops * sizeof(MTPProperties));
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < ob->nrofmtpprops; j++) {
+      if (newprops[j].property == props[i].property)
+	break;
+    }
+    if (j < ob->nrofmtpprops)
+      continue;
+    prop = &newprops[ob->nrofmtpprops++];
+    *prop = props[i];
+    if (props[i].datatype == PTP_DTC_STR)
+      prop->propval.str = ptp_cache_strdup(params, props[i].propval.str);
+  }
+  ob->mtpprops = newprops;
 }
 
 /**
- * This helper function returns a unique filename, with a random string before the extension
- * @param string representing the original filename
- * @return a string representing the unique filename
+ * Internal function to write the collected metadata of some tracks.
+ * All of it goes out as one object property list where the device
+ * takes that; if the list fails, every track is sent again with its
+ * own list, so that only the tracks at fault fail.
+ * @param device a pointer to the device holding the tracks.
+ * @param props the properties of all the tracks.
+ * @param starts the first property of each track, and after the last
+ *        track the number of properties.
+ * @param ok set to zero here for the tracks that failed.
+ * @param n the number of tracks.
+ * @return the number of tracks that failed.
  */
-static char *generate_unique_filename(PTPParams* params, char const * const filename)
+static unsigned int send_bulk_metadata(LIBMTP_mtpdevice_t *device,
+				       MTPProperties *props,
+				       int const *starts, int *ok,
+				       unsigned int const n)
 {
-  int suffix;
-  char * extension_position;
-
-  if (check_filename_exists(params, filename))
-  {
-    extension_position = strrchr(filename,'.');
-
-    char basename[extension_position - filename + 1];
-    strncpy(basename, filename, extension_position - filename);
-    basename[extension_position - filename] = '\0';
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  unsigned int i, failed = 0;
+  uint16_t ret;
+  int j;
 
-    suffix = 1;
-    char newname[ strlen(basename) + 6 + strlen(extension_position)];
-    sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
-    while ((check_filename_exists(params, newname)) && (suffix < 1000000)) {
-      suffix++;
-      sprintf(newname, "%s_%d%s", basename, suffix, extension_position);
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    if (n > 1 && ptp_mtp_setobjectproplist(params, props, starts[n]) == PTP_RC_OK)
+      return 0;
+    for (i = 0; i < n; i++) {
+      if (starts[i + 1] == starts[i])
+	continue;
+      ret = ptp_mtp_setobjectproplist(params, &props[starts[i]],
+				      starts[i + 1] - starts[i]);
+      if (ret != PTP_RC_OK) {
+	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Update_Tracklist_Metadata(): "
+				    "could not set object property list.");
+	ok[i] = 0;
+	failed++;
+      }
     }
-  return strdup(newname);
+    return failed;
   }
-  else
-  {
-    return strdup(filename);
+
+  // One property at a time, where failures do not fail the track
+  for (i = 0; i < n; i++) {
+    for (j = starts[i]; j < starts[i + 1]; j++) {
+      ret = ptp_mtp_setobjectpropvalue(params, props[j].ObjectHandle,
+				       props[j].property, &props[j].propval,
+				       props[j].datatype);
+      if (ret != PTP_RC_OK) {
+	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Update_Tracklist_Metadata(): "
+				    "could not set object property.");
+      }
+    }
   }
+  return 0;
 }
 
 /**
- * This function sends a track from a file descriptor to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
- * @param device a pointer to the device to send the track to.
- * @param fd the filedescriptor for a local file which will be sent.
- * @param metadata a track metadata set to be written along with the file.
- *        After this call the field <code>metadata-&gt;item_id</code>
- *        will contain the new track ID. Other fields such
- *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
- *        or <code>metadata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this track in. Since some
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Send_Track_From_File()
- * @see LIBMTP_Delete_Object()
+ * Internal function to send the collected metadata of some tracks,
+ * then update the cache from it and free it.
+ * @param device a pointer to the device holding the tracks.
+ * @param props the properties of all the tracks.
+ * @param nrofprops the number of properties.
+ * @param starts the first property of each track, with room for one
+ *        more entry.
+ * @param ok zero for the tracks that already failed.
+ * @param n the number of tracks.
+ * @param failed the count of failed tracks to add to.
  */
-int LIBMTP_Send_Track_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
-			 int const fd, LIBMTP_track_t * const metadata,
-                         LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+static void flush_bulk_metadata(LIBMTP_mtpdevice_t *device,
+				MTPProperties *props, int const nrofprops,
+				int *starts, int *ok, unsigned int const n,
+				int *failed)
 {
-  int subcall_ret;
-  LIBMTP_file_t filedata;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
   PTPParams *params = (PTPParams *) device->params;
+  unsigned int i;
 
-  // Sanity check, is this really a track?
-  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_File_Descriptor(): "
-			    "I don't think this is actually a track, strange filetype...");
+  starts[n] = nrofprops;
+  *failed += send_bulk_metadata(device, props, starts, ok, n);
+
+  // Then the cache, without asking the device again
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  for (i = 0; i < n; i++) {
+    if (ok[i])
+      update_cached_object_props(params, &props[starts[i]],
+				 starts[i + 1] - starts[i]);
   }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  ptp_destroy_object_prop_list(props, nrofprops);
+}
 
-  // Wrap around the file transfer function
-  filedata.item_id = metadata->item_id;
-  filedata.parent_id = metadata->parent_id;
-  filedata.storage_id = metadata->storage_id;
-  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
-    filedata.filename = generate_unique_filename(params, metadata->filename);
+/**
+ * This function updates the metadata of many tracks, as
+ * LIBMTP_Update_Track_Metadata() does for one. The properties of
+ * many tracks are sent together in one object property list where the
+ * device supports that, instead of one transaction per track, and the
+ * cached objects are updated from what was sent rather than read back
+ * from the device.
+ * @param device a pointer to the device to update the tracks on.
+ * @param tracks a list of track metadata linked by the
+ *        <code>next</code> field, with the <code>item_id</code> of
+ *        each track set to the file to update. Properties that are
+ *        NULL (strings) or 0 (numerical values) are left as they are,
+ *        as in LIBMTP_Update_Track_Metadata().
+ * @return 0 if all tracks were updated, the number of tracks that
+ *        failed otherwise, or -1 if the device cannot set metadata.
+ *        The reasons are on the error stack.
+ * @see LIBMTP_Update_Track_Metadata()
+ */
+int LIBMTP_Update_Tracklist_Metadata(LIBMTP_mtpdevice_t *device,
+				     LIBMTP_track_t const * const tracks)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_track_t const *track = tracks;
+  MTPProperties *props = NULL;
+  int nrofprops = 0;
+  int *starts = NULL;
+  int *ok = NULL;
+  unsigned int n = 0;
+  unsigned int alloced = 0;
+  int failed = 0;
+
+  if (!ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
+      !ptp_operation_issupported(params, PTP_OC_MTP_SetObjectPropValue)) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Tracklist_Metadata(): "
+                            "Your device doesn't seem to support any known way of setting metadata.");
+    return -1;
   }
-  else {
-    filedata.filename = metadata->filename;
+
+  while (track != NULL) {
+    uint16_t *properties = NULL;
+    uint32_t propcnt = 0;
+    uint16_t ret;
+
+    if (n + 1 >= alloced) {
+      unsigned int size = alloced ? alloced * 2 : 64;
+      int *tmp;
+
+      tmp = realloc(starts, size * sizeof(int));
+      if (tmp != NULL) {
+	starts = tmp;
+	tmp = realloc(ok, size * sizeof(int));
+      }
+      if (tmp == NULL) {
+	add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION, "LIBMTP_Update_Tracklist_Metadata(): "
+				"could not allocate memory.");
+	break;
+      }
+      ok = tmp;
+      alloced = size;
+    }
+
+    // The supported properties are cached per format
+    starts[n] = nrofprops;
+    ok[n] = 1;
+    ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(track->filetype), &propcnt, &properties);
+    if (ret != PTP_RC_OK) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Tracklist_Metadata(): "
+			      "could not retrieve supported object properties.");
+      ok[n] = 0;
+      failed++;
+    } else {
+      add_track_metadata_props(device, track, properties, propcnt,
+			       &props, &nrofprops);
+      free(properties);
+    }
+    n++;
+    track = track->next;
+    if (nrofprops >= BULK_METADATA_PROPS || track == NULL) {
+      flush_bulk_metadata(device, props, nrofprops, starts, ok, n, &failed);
+      props = NULL;
+      nrofprops = 0;
+      n = 0;
+    }
   }
-  filedata.filesize = metadata->filesize;
-  filedata.filetype = metadata->filetype;
-  filedata.next = NULL;
+  // Out of memory, what was collected still goes out
+  if (n > 0)
+    flush_bulk_metadata(device, props, nrofprops, starts, ok, n, &failed);
+  // and the tracks from there on count as failed
+  for (; track != NULL; track = track->next)
+    failed++;
+  free(starts);
+  free(ok);
+  return failed;
+}
 
-  subcall_ret = LIBMTP_Send_File_From_File_Descriptor(device,
-						      fd,
-						      &filedata,
-						      callback,
-						      data);
+/**
+ * This function deletes a single file, track, playlist, folder or
+ * any other object off the MTP device, identified by the object ID.
+ *
+ * If you delete a folder, there is no guarantee that the device will
+ * really delete all the files that were in that folder, rather it is
+ * expected that they will not be deleted, and will turn up in object
+ * listings with parent set to a non-existant object ID. The safe way
+ * to do this is to recursively delete all files (and folders) contained
+ * in the folder, then the folder itself.
+ *
+ * @param device a pointer to the device to delete the object from.
+ * @param object_id the object to delete.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t *device,
+			 uint32_t object_id)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t storage_id;
+  uint64_t size;
+  int known;
 
-  if (subcall_ret != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_File_Descriptor(): "
-			    "subcall to LIBMTP_Send_File_From_File_Descriptor failed.");
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+  // The object is gone from the cache once deleted
+  known = cached_object_size(params, object_id, &storage_id, &size);
+  ret = ptp_deleteobject(params, object_id, 0);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Object(): could not delete object.");
     return -1;
   }
+  if (known == 0)
+    account_freespace(device, storage_id, -(int64_t) size, -1);
+  else
+    invalidate_freespace(device, 0xffffffffU);
 
-  // Pick up new item (and parent, storage) ID
-  metadata->item_id = filedata.item_id;
-  metadata->parent_id = filedata.parent_id;
-  metadata->storage_id = filedata.storage_id;
+  return 0;
+}
 
-  // Set track metadata for the new fine track
-  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
-  if (subcall_ret != 0) {
-    // Subcall will add error to errorstack
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
+/**
+ * The function moves an object from one location on a device to another
+ * location.
+ *
+ * The semantics of moving a folder are not defined in the spec, but it
+ * appears to do the right thing when tested (but devices that implement
+ * this operation are rare).
+ *
+ * Note that moving an object may take a significant amount of time,
+ * particularly if being moved between storages. MTP does not provide
+ * any kind of progress mechanism, so the operation will simply block
+ * for the duration.
+ *
+ * @param device a pointer to the device where the object exists.
+ * @param object_id the object to move.
+ * @param storage_id the id of the destination storage.
+ * @param parent_id the id of the destination parent object (folder).
+ *	  If the destination is the root of the storage, pass '0'.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Move_Object(LIBMTP_mtpdevice_t *device,
+		       uint32_t object_id,
+		       uint32_t storage_id,
+		       uint32_t parent_id)
+{
+  uint16_t ret;
+  PTPParams *params = (PTPParams *) device->params;
+  uint32_t from;
+  uint64_t size;
+  int known;
+
+  known = cached_object_size(params, object_id, &from, &size);
+  ret = ptp_moveobject(params, object_id, storage_id, parent_id);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Move_Object(): could not move object.");
     return -1;
   }
-
-  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
-  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
+  if (known != 0) {
+    invalidate_freespace(device, 0xffffffffU);
+  } else if (from != storage_id) {
+    account_freespace(device, from, -(int64_t) size, -1);
+    account_freespace(device, storage_id, size, 1);
+  }
 
   return 0;
 }
 
 /**
- * This function sends a track from a handler function to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
- * @param device a pointer to the device to send the track to.
- * @param get_func the function to call when we have data.
- * @param priv the user-defined pointer that is passed to
- *             <code>get_func</code>.
- * @param metadata a track metadata set to be written along with the file.
- *        After this call the field <code>metadata-&gt;item_id</code>
- *        will contain the new track ID. Other fields such
- *        as the <code>metadata-&gt;filename</code>, <code>metadata-&gt;parent_id</code>
- *        or <code>metadata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>metadata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this track in. Since some
- *        devices are a bit picky about where files
- *        are placed, a default folder will be chosen if libmtp
- *        has detected one for the current filetype and this
- *        parameter is set to 0. If this is 0 and no default folder
- *        can be found, the file will be stored in the root folder.
- *        <li><code>metadata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this track in. Setting this to 0 will store
- *        the track on the primary storage.
- *        </ul>
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Send_Track_From_File()
- * @see LIBMTP_Delete_Object()
+ * The function copies an object from one location on a device to another
+ * location.
+ *
+ * The semantics of copying a folder are not defined in the spec, but it
+ * appears to do the right thing when tested (but devices that implement
+ * this operation are rare).
+ *
+ * Note that copying an object may take a significant amount of time.
+ * MTP does not provide any kind of progress mechanism, so the operation
+ * will simply block for the duration.
+ *
+ * @param device a pointer to the device where the object exists.
+ * @param object_id the object to copy.
+ * @param storage_id the id of the destination storage.
+ * @param parent_id the id of the destination parent object (folder).
+ *	  If the destination is the root of the storage, pass '0'.
+ * @return 0 on success, any other value means failure.
  */
-int LIBMTP_Send_Track_From_Handler(LIBMTP_mtpdevice_t *device,
-			 MTPDataGetFunc get_func, void * priv, LIBMTP_track_t * const metadata,
-                         LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+int LIBMTP_Copy_Object(LIBMTP_mtpdevice_t *device,
+		       uint32_t object_id,
+		       uint32_t storage_id,
+		       uint32_t parent_id)
 {
-  int subcall_ret;
-  LIBMTP_file_t filedata;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  uint16_t ret;
   PTPParams *params = (PTPParams *) device->params;
+  uint32_t from;
+  uint64_t size;
 
-  // Sanity check, is this really a track?
-  if (!LIBMTP_FILETYPE_IS_TRACK(metadata->filetype)) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_Handler(): "
-			    "I don't think this is actually a track, strange filetype...");
+  ret = ptp_copyobject(params, object_id, storage_id, parent_id);
+  if (ret != PTP_RC_OK) {
+    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Copy_Object(): could not copy object.");
+    return -1;
   }
+  if (cached_object_size(params, object_id, &from, &size) == 0)
+    account_freespace(device, storage_id, size, 1);
+  else
+    invalidate_freespace(device, 0xffffffffU);
 
-  // Wrap around the file transfer function
-  filedata.item_id = metadata->item_id;
-  filedata.parent_id = metadata->parent_id;
-  filedata.storage_id = metadata->storage_id;
-  if FLAG_UNIQUE_FILENAMES(ptp_usb) {
-    filedata.filename = generate_unique_filename(params, metadata->filename);
-  }
-  else {
-    filedata.filename = metadata->filename;
-  }
-  filedata.filesize = metadata->filesize;
-  filedata.filetype = metadata->filetype;
-  filedata.next = NULL;
+  return 0;
+}
 
-  subcall_ret = LIBMTP_Send_File_From_Handler(device,
-					      get_func,
-					      priv,
-					      &filedata,
-					      callback,
-					      data);
+/**
+ * The size of the buffer between the two devices of a copy with
+ * <code>LIBMTP_Copy_File_Between_Devices()</code>.
+ */
+#define DEVICE_COPY_BUFFER (1024 * 1024)
 
-  if (subcall_ret != 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_Track_From_Handler(): "
-			    "subcall to LIBMTP_Send_File_From_Handler failed.");
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
-    return -1;
-  }
+#ifdef HAVE_PTHREAD_H
+/**
+ * The ring buffer of a copy between two devices. The source side
+ * fills it from the data phase of GetObject while the destination side
+ * drains it into the data phase of SendObject.
+ */
+typedef struct {
+  pthread_mutex_t lock;
+  /** Signalled when data or room comes free or either side stops */
+  pthread_cond_t changed;
+  unsigned char *buf;
+  uint32_t head; /**< Where the next byte is read */
+  uint32_t fill; /**< How many bytes are buffered */
+  int received; /**< The source side is done, 0 on success */
+  int finished; /**< received is set */
+  int cancel; /**< The destination side gave up */
+  LIBMTP_mtpdevice_t *from;
+  uint32_t id;
+} device_copy_t;
+
+static uint16_t device_copy_put(void *params, void *priv, uint32_t sendlen,
+				unsigned char *data, uint32_t *putlen)
+{
+  device_copy_t *dc = (device_copy_t *) priv;
+  uint32_t done = 0;
+
+  pthread_mutex_lock(&dc->lock);
+  while (done < sendlen) {
+    uint32_t tail, n;
+
+    while (dc->fill == DEVICE_COPY_BUFFER && !dc->cancel)
+      pthread_cond_wait(&dc->changed, &dc->lock);
+    if (dc->cancel) {
+      pthread_mutex_unlock(&dc->lock);
+      return LIBMTP_HANDLER_RETURN_CANCEL;
+    }
+    tail = (dc->head + dc->fill) % DEVICE_COPY_BUFFER;
+    n = DEVICE_COPY_BUFFER - dc->fill;
+    if (n > DEVICE_COPY_BUFFER - tail)
+      n = DEVICE_COPY_BUFFER - tail;
+    if (n > sendlen - done)
+      n = sendlen - done;
+    memcpy(dc->buf + tail, data + done, n);
+    dc->fill += n;
+    done += n;
+    pthread_cond_broadcast(&dc->changed);
+  }
+  pthread_mutex_unlock(&dc->lock);
+  *putlen = sendlen;
+  return LIBMTP_HANDLER_RETURN_OK;
+}
 
-  // Pick up new item (and parent, storage) ID
-  metadata->item_id = filedata.item_id;
-  metadata->parent_id = filedata.parent_id;
-  metadata->storage_id = filedata.storage_id;
+static uint16_t device_copy_get(void *params, void *priv, uint32_t wantlen,
+				unsigned char *data, uint32_t *gotlen)
+{
+  device_copy_t *dc = (device_copy_t *) priv;
+  uint32_t done = 0;
+
+  // Short blocks end a USB transfer, so wait for all that was asked for
+  pthread_mutex_lock(&dc->lock);
+  while (done < wantlen) {
+    uint32_t n;
+
+    while (dc->fill == 0 && !dc->finished)
+      pthread_cond_wait(&dc->changed, &dc->lock);
+    if (dc->fill == 0) {
+      int received = dc->received;
+
+      pthread_mutex_unlock(&dc->lock);
+      if (received != 0)
+	return LIBMTP_HANDLER_RETURN_ERROR;
+      *gotlen = done;
+      return LIBMTP_HANDLER_RETURN_OK;
+    }
+    n = dc->fill;
+    if (n > DEVICE_COPY_BUFFER - dc->head)
+      n = DEVICE_COPY_BUFFER - dc->head;
+    if (n > wantlen - done)
+      n = wantlen - done;
+    memcpy(data + done, dc->buf + dc->head, n);
+    dc->head = (dc->head + n) % DEVICE_COPY_BUFFER;
+    dc->fill -= n;
+    done += n;
+    pthread_cond_broadcast(&dc->changed);
+  }
+  pthread_mutex_unlock(&dc->lock);
+  *gotlen = done;
+  return LIBMTP_HANDLER_RETURN_OK;
+}
 
-  // Set track metadata for the new fine track
-  subcall_ret = LIBMTP_Update_Track_Metadata(device, metadata);
-  if (subcall_ret != 0) {
-    // Subcall will add error to errorstack
-    // We used to delete the file here, but don't... It might be OK after all.
-    // (void) LIBMTP_Delete_Object(device, metadata->item_id);
-    return -1;
-  }
+static int device_copy_receive(LIBMTP_mtpdevice_t *device, void *data)
+{
+  device_copy_t *dc = (device_copy_t *) data;
+  int ret;
 
-  // note we don't need to update the cache here because LIBMTP_Send_File_From_File_Descriptor
-  // has added the object handle and LIBMTP_Update_Track_Metadata has added the metadata.
+  ret = LIBMTP_Get_File_To_Handler(device, dc->id, device_copy_put, dc,
+				   NULL, NULL);
+  pthread_mutex_lock(&dc->lock);
+  dc->received = ret;
+  dc->finished = 1;
+  pthread_cond_broadcast(&dc->changed);
+  pthread_mutex_unlock(&dc->lock);
+  return ret;
+}
 
-  return 0;
+static void *device_copy_main(void *arg)
+{
+  device_copy_t *dc = (device_copy_t *) arg;
+
+  device_copy_receive(dc->from, dc);
+  return NULL;
 }
 
 /**
- * This function sends a local file to an MTP device.
- * A filename and a set of metadata must be
- * given as input.
- * @param device a pointer to the device to send the track to.
- * @param path the filename of a local file which will be sent.
- * @param filedata a file metadata set to be written along with the file.
- *        After this call the field <code>filedata-&gt;item_id</code>
- *        will contain the new file ID. Other fields such
- *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
- *        or <code>filedata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this file in. If this is 0,
- *        the file will be stored in the root folder.
- *        <li><code>filedata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this file in. Setting this to 0 will store
- *        the file on the primary storage.
- *        </ul>
- * @param callback a progress indicator function or NULL to ignore.
- * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Send_File_From_File_Descriptor()
- * @see LIBMTP_Delete_Object()
+ * Internal function to stream one object from one device to another.
+ * The source side runs on the worker of the source device if it has
+ * one, or else on a thread of its own, while this thread sends.
+ * @return 0 on success, any other value means failure.
  */
-int LIBMTP_Send_File_From_File(LIBMTP_mtpdevice_t *device,
-			       char const * const path, LIBMTP_file_t * const filedata,
-			       LIBMTP_progressfunc_t const callback,
-			       void const * const data)
+static int device_copy_stream(LIBMTP_mtpdevice_t *from, uint32_t const id,
+			      LIBMTP_mtpdevice_t *to,
+			      LIBMTP_file_t * const filedata,
+			      LIBMTP_progressfunc_t const callback,
+			      void const * const data)
 {
-  int fd;
+  device_copy_t dc;
+  pthread_t thread;
   int ret;
 
-  // Sanity check
-  if (path == NULL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File(): Bad arguments, path was NULL.");
+  memset(&dc, 0, sizeof(dc));
+  dc.buf = (unsigned char *) malloc(DEVICE_COPY_BUFFER);
+  if (dc.buf == NULL) {
+    add_error_to_errorstack(to, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Copy_File_Between_Devices(): "
+			    "out of memory.");
     return -1;
   }
+  pthread_mutex_init(&dc.lock, NULL);
+  pthread_cond_init(&dc.changed, NULL);
+  dc.from = from;
+  dc.id = id;
 
-  // Open file
-#ifdef __WIN32__
-#ifdef USE_WINDOWS_IO_H
-  if ( (fd = _open(path, O_RDONLY|O_BINARY)) == -1 ) {
-#else
-  if ( (fd = open(path, O_RDONLY|O_BINARY)) == -1 ) {
-#endif
-#else
-  if ( (fd = open(path, O_RDONLY)) == -1) {
-#endif
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Send_File_From_File(): Could not open source file.");
-    return -1;
+  if (DEVICE_PRIVATE(from)->worker != NULL)
+    ret = LIBMTP_Submit_Work(from, device_copy_receive, NULL, &dc);
+  else
+    ret = pthread_create(&thread, NULL, device_copy_main, &dc);
+  if (ret != 0) {
+    add_error_to_errorstack(to, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Copy_File_Between_Devices(): "
+			    "could not start receiving.");
+  } else {
+    ret = LIBMTP_Send_File_From_Handler(to, device_copy_get, &dc, filedata,
+					callback, data);
+    // Stop the source side if it is still at it, then wait for it
+    pthread_mutex_lock(&dc.lock);
+    dc.cancel = 1;
+    pthread_cond_broadcast(&dc.changed);
+    while (!dc.finished)
+      pthread_cond_wait(&dc.changed, &dc.lock);
+    pthread_mutex_unlock(&dc.lock);
+    if (DEVICE_PRIVATE(from)->worker == NULL)
+      pthread_join(thread, NULL);
+    if (ret == 0 && dc.received != 0) {
+      add_error_to_errorstack(to, LIBMTP_ERROR_GENERAL,
+			      "LIBMTP_Copy_File_Between_Devices(): "
+			      "could not receive the object.");
+      ret = -1;
+    }
   }
 
-  ret = LIBMTP_Send_File_From_File_Descriptor(device, fd, filedata, callback, data);
-
-  // Close file.
-#ifdef USE_WINDOWS_IO_H
-  _close(fd);
+  pthread_cond_destroy(&dc.changed);
+  pthread_mutex_destroy(&dc.lock);
+  free(dc.buf);
+  return ret;
+}
 #else
-  close(fd);
-#endif
+/**
+ * Without threads the two transfers cannot overlap, so the object
+ * goes through a temporary file instead.
+ */
+static int device_copy_stream(LIBMTP_mtpdevice_t *from, uint32_t const id,
+			      LIBMTP_mtpdevice_t *to,
+			      LIBMTP_file_t * const filedata,
+			      LIBMTP_progressfunc_t const callback,
+			      void const * const data)
+{
+  FILE *tmp = tmpfile();
+  int ret;
 
+  if (tmp == NULL) {
+    add_error_to_errorstack(to, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Copy_File_Between_Devices(): "
+			    "could not create a temporary file.");
+    return -1;
+  }
+  ret = LIBMTP_Get_File_To_File_Descriptor(from, id, fileno(tmp), NULL, NULL);
+  if (ret == 0 && lseek(fileno(tmp), 0, SEEK_SET) == -1)
+    ret = -1;
+  if (ret == 0)
+    ret = LIBMTP_Send_File_From_File_Descriptor(to, fileno(tmp), filedata,
+						callback, data);
+  fclose(tmp);
   return ret;
 }
+#endif
 
 /**
- * This function sends a generic file from a file descriptor to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
+ * This copies a file from one device to another without storing it
+ * on the host: the object is received from the source device while it
+ * is being sent to the destination device, through a buffer of a fixed
+ * size, so the slower of the two devices sets the pace.
  *
- * This can potentially be used for sending in a stream of unknown
- * length. Send music files with
- * <code>LIBMTP_Send_Track_From_File_Descriptor()</code>
+ * The receive runs on a thread of its own, or as work submitted to the
+ * worker of the source device if it was opened with
+ * <code>LIBMTP_Open_Raw_Device_Worker()</code>. The send runs on the
+ * calling thread, which must be inside work submitted to the
+ * destination device if that one has a worker. Errors of the receive
+ * are put on the error stack of the source device.
  *
- * @param device a pointer to the device to send the file to.
- * @param fd the filedescriptor for a local file which will be sent.
- * @param filedata a file metadata set to be written along with the file.
- *        After this call the field <code>filedata-&gt;item_id</code>
- *        will contain the new file ID. Other fields such
- *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
- *        or <code>filedata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this file in. If this is 0,
- *        the file will be stored in the root folder.
- *        <li><code>filedata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this file in. Setting this to 0 will store
- *        the file on the primary storage.
- *        </ul>
+ * @param from a pointer to the device to copy the file from.
+ * @param id the file to copy.
+ * @param to a pointer to the device to copy the file to, which must
+ *        not be the same device, use <code>LIBMTP_Copy_Object()</code>
+ *        for that.
+ * @param filedata where to put the file, as for
+ *        <code>LIBMTP_Send_File_From_File()</code>. The size and
+ *        filetype are taken from the source file, and so is the name
+ *        unless one is set. The new object ID is set in here on
+ *        success.
  * @param callback a progress indicator function or NULL to ignore.
  * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
+ *        the <code>progress</code> function.
  * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Send_File_From_File()
- * @see LIBMTP_Send_Track_From_File_Descriptor()
- * @see LIBMTP_Delete_Object()
+ *         failure.
+ * @see LIBMTP_Copy_Folder_Between_Devices()
  */
-int LIBMTP_Send_File_From_File_Descriptor(LIBMTP_mtpdevice_t *device,
-			 int const fd, LIBMTP_file_t * const filedata,
-                         LIBMTP_progressfunc_t const callback,
-			 void const * const data)
+int LIBMTP_Copy_File_Between_Devices(LIBMTP_mtpdevice_t *from,
+				     uint32_t const id,
+				     LIBMTP_mtpdevice_t *to,
+				     LIBMTP_file_t * const filedata,
+				     LIBMTP_progressfunc_t const callback,
+				     void const * const data)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_file_t *newfilemeta;
-  int oldtimeout;
-  int timeout;
+  LIBMTP_file_t *source;
 
-  if (send_file_object_info(device, filedata))
-  {
-    // no need to output an error since send_file_object_info will already have done so
+  if (from == to) {
+    add_error_to_errorstack(to, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Copy_File_Between_Devices(): "
+			    "source and destination are the same device.");
+    return -1;
+  }
+  source = LIBMTP_Get_Filemetadata(from, id);
+  if (source == NULL) {
+    add_error_to_errorstack(to, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Copy_File_Between_Devices(): "
+			    "could not get the source file.");
+    return -1;
+  }
+  if (source->filetype == LIBMTP_FILETYPE_FOLDER) {
+    LIBMTP_destroy_file_t(source);
+    add_error_to_errorstack(to, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Copy_File_Between_Devices(): "
+			    "use LIBMTP_Copy_Folder_Between_Devices() "
+			    "for folders.");
     return -1;
   }
+  filedata->filesize = source->filesize;
+  filedata->filetype = source->filetype;
+  if (filedata->filename == NULL) {
+    filedata->filename = source->filename;
+    source->filename = NULL;
+  }
+  LIBMTP_destroy_file_t(source);
 
-  // Callbacks
-  ptp_usb->callback_active = 1;
-  // The callback will deactivate itself after this amount of data has been sent
-  // One BULK header for the request, one for the data phase. No parameters to the request.
-  ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
-  ptp_usb->current_transfer_complete = 0;
-  ptp_usb->current_transfer_callback = callback;
-  ptp_usb->current_transfer_callback_data = data;
+  return device_copy_stream(from, id, to, filedata, callback, data);
+}
 
-  /*
-   * We might need to increase the timeout here, files can be pretty
-   * large. Take the default timeout and add the calculated time for
-   * this transfer
-   */
-  get_usb_device_timeout(ptp_usb, &oldtimeout);
-  timeout = oldtimeout +
-    (ptp_usb->current_transfer_total / guess_usb_speed(ptp_usb)) * 1000;
-  set_usb_device_timeout(ptp_usb, timeout);
+/**
+ * One object of a tree copied with
+ * <code>LIBMTP_Copy_Folder_Between_Devices()</code>.
+ */
+typedef struct {
+  uint32_t id;
+  uint32_t parent_id;
+  char *filename;
+  LIBMTP_filetype_t filetype;
+} device_copy_entry_t;
+
+static int compare_device_copy_parent(const void *a, const void *b)
+{
+  device_copy_entry_t const *x = (device_copy_entry_t const *) a;
+  device_copy_entry_t const *y = (device_copy_entry_t const *) b;
 
-  ret = ptp_sendobject_fromfd(params, fd, filedata->filesize);
+  return (x->parent_id > y->parent_id) - (x->parent_id < y->parent_id);
+}
 
-  ptp_usb->callback_active = 0;
-  ptp_usb->current_transfer_callback = NULL;
-  ptp_usb->current_transfer_callback_data = NULL;
-  set_usb_device_timeout(ptp_usb, oldtimeout);
+/**
+ * Internal function to copy the contents of a folder of the source
+ * device into a folder of the destination, and on into subfolders.
+ * Devices have been seen to report folders inside themselves, so each
+ * folder is descended into once at most.
+ * @param entries all objects of the source, in order of parent.
+ * @param visited the folders descended into so far, in order, with
+ *        room for all folders of <code>entries</code>.
+ * @param nrofvisited the number of folders in <code>visited</code>.
+ * @return the number of objects that could not be copied.
+ */
+static int copy_folder_contents(LIBMTP_mtpdevice_t *from,
+				device_copy_entry_t const *entries,
+				unsigned int const n,
+				uint32_t const folder_id,
+				LIBMTP_mtpdevice_t *to,
+				uint32_t const parent_id,
+				uint32_t const storage_id,
+				LIBMTP_progressfunc_t const callback,
+				void const * const data,
+				uint32_t *visited,
+				unsigned int *nrofvisited)
+{
+  unsigned int lo = 0, hi = *nrofvisited;
+  int failed = 0;
 
-  if (ret == PTP_ERROR_CANCEL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_File_Descriptor(): Cancelled transfer.");
-    return -1;
-  }
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_From_File_Descriptor(): "
-				"Could not send object.");
-    return -1;
+  // Mark the folder as visited, or leave it if it was already
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+
+    if (visited[mid] < folder_id)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  if (lo < *nrofvisited && visited[lo] == folder_id)
+    return 0;
+  memmove(&visited[lo + 1], &visited[lo],
+	  (*nrofvisited - lo) * sizeof(uint32_t));
+  visited[lo] = folder_id;
+  (*nrofvisited)++;
 
-  add_object_to_cache(device, filedata->item_id);
+  lo = 0;
+  hi = n;
 
-  /*
-   * Get the device-assigned parent_id from the cache.
-   * The operation that adds it to the cache will
-   * look it up from the device, so we get the new
-   * parent_id from the cache.
-   */
-  newfilemeta = LIBMTP_Get_Filemetadata(device, filedata->item_id);
-  if (newfilemeta != NULL) {
-    filedata->parent_id = newfilemeta->parent_id;
-    filedata->storage_id = newfilemeta->storage_id;
-    LIBMTP_destroy_file_t(newfilemeta);
-  } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_File_From_File_Descriptor(): "
-			    "Could not retrieve updated metadata.");
-    return -1;
+  // The first child of the folder
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+
+    if (entries[mid].parent_id < folder_id)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
+  for (; lo < n && entries[lo].parent_id == folder_id; lo++) {
+    device_copy_entry_t const *e = &entries[lo];
 
-  return 0;
+    // A folder that is its own parent
+    if (e->id == folder_id)
+      continue;
+    if (e->filetype == LIBMTP_FILETYPE_FOLDER) {
+      char *name = strdup(e->filename ? e->filename : "");
+      uint32_t newid = 0;
+
+      if (name != NULL)
+	newid = LIBMTP_Create_Folder(to, name, parent_id, storage_id);
+      free(name);
+      if (newid == 0)
+	failed++;
+      else
+	failed += copy_folder_contents(from, entries, n, e->id, to, newid,
+				       storage_id, callback, data,
+				       visited, nrofvisited);
+    } else {
+      LIBMTP_file_t *file = LIBMTP_new_file_t();
+
+      file->parent_id = parent_id;
+      file->storage_id = storage_id;
+      if (e->filename != NULL)
+	file->filename = strdup(e->filename);
+      if (LIBMTP_Copy_File_Between_Devices(from, e->id, to, file,
+					   callback, data) != 0)
+	failed++;
+      LIBMTP_destroy_file_t(file);
+    }
+  }
+  return failed;
 }
 
 /**
- * This function sends a generic file from a handler function to an
- * MTP device. A filename and a set of metadata must be
- * given as input.
- *
- * This can potentially be used for sending in a stream of unknown
- * length. Send music files with
- * <code>LIBMTP_Send_Track_From_Handler()</code>
+ * This copies a folder with all files and folders in it from one
+ * device to another with <code>LIBMTP_Copy_File_Between_Devices()</code>.
+ * The tree is taken from the object cache of the source device in one
+ * go, so only the file data is asked of the source while copying.
+ * Folders and files that cannot be copied do not stop the copy.
  *
- * @param device a pointer to the device to send the file to.
- * @param get_func the function to call to get data to write
- * @param priv a user-defined pointer that is passed along to
- *        <code>get_func</code>. If not used, this is set to NULL.
- * @param filedata a file metadata set to be written along with the file.
- *        After this call the field <code>filedata-&gt;item_id</code>
- *        will contain the new file ID. Other fields such
- *        as the <code>filedata-&gt;filename</code>, <code>filedata-&gt;parent_id</code>
- *        or <code>filedata-&gt;storage_id</code> may also change during this
- *        operation due to device restrictions, so do not rely on the
- *        contents of this struct to be preserved in any way.
- *        <ul>
- *        <li><code>filedata-&gt;parent_id</code> should be set to the parent
- *        (e.g. folder) to store this file in. If this is 0,
- *        the file will be stored in the root folder.
- *        <li><code>filedata-&gt;storage_id</code> should be set to the
- *        desired storage (e.g. memory card or whatever your device
- *        presents) to store this file in. Setting this to 0 will store
- *        the file on the primary storage.
- *        </ul>
- * @param callback a progress indicator function or NULL to ignore.
+ * @param from a pointer to the device to copy the folder from.
+ * @param folder_id the folder to copy.
+ * @param to a pointer to the device to copy the folder to.
+ * @param parent_id the folder to copy it into, 0 for the root.
+ * @param storage_id the storage to copy it to, 0 to let the device
+ *        choose.
+ * @param callback a progress indicator function called for each file,
+ *        or NULL to ignore.
  * @param data a user-defined pointer that is passed along to
- *             the <code>progress</code> function in order to
- *             pass along some user defined data to the progress
- *             updates. If not used, set this to NULL.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
- * @see LIBMTP_Send_File_From_File()
- * @see LIBMTP_Send_Track_From_File_Descriptor()
- * @see LIBMTP_Delete_Object()
+ *        the <code>progress</code> function.
+ * @return 0 if all of the folder was copied, the number of objects
+ *         that could not be copied otherwise, or -1 if the folder
+ *         itself could not be copied.
+ * @see LIBMTP_Copy_File_Between_Devices()
  */
-int LIBMTP_Send_File_From_Handler(LIBMTP_mtpdevice_t *device,
-			 MTPDataGetFunc get_func, void * priv, LIBMTP_file_t * const filedata,
-       LIBMTP_progressfunc_t const callback, void const * const data)
+int LIBMTP_Copy_Folder_Between_Devices(LIBMTP_mtpdevice_t *from,
+				       uint32_t const folder_id,
+				       LIBMTP_mtpdevice_t *to,
+				       uint32_t const parent_id,
+				       uint32_t const storage_id,
+				       LIBMTP_progressfunc_t const callback,
+				       void const * const data)
+{
+  LIBMTP_object_iterator_t *it;
+  LIBMTP_object_view_t const *view;
+  device_copy_entry_t *entries = NULL;
+  device_copy_entry_t *tmp;
+  unsigned int n = 0, alloced = 0, i;
+  uint32_t *visited = NULL;
+  unsigned int nrofvisited = 0, nroffolders = 1;
+  char *name = NULL;
+  uint32_t newid;
+  int ret = -1;
+
+  if (from == to) {
+    add_error_to_errorstack(to, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Copy_Folder_Between_Devices(): "
+			    "source and destination are the same device.");
+    return -1;
+  }
+  it = LIBMTP_Begin_Object_Iteration(from, 0, LIBMTP_ITERATE_ALL, 0);
+  if (it == NULL)
+    return -1;
+  while ((view = LIBMTP_Next_Object(it)) != NULL) {
+    if (view->item_id == folder_id) {
+      if (view->filetype == LIBMTP_FILETYPE_FOLDER && view->filename != NULL)
+	name = strdup(view->filename);
+      continue;
+    }
+    if (n == alloced) {
+      alloced = alloced ? alloced * 2 : 64;
+      tmp = (device_copy_entry_t *)
+	realloc(entries, alloced * sizeof(device_copy_entry_t));
+      if (tmp == NULL)
+	break;
+      entries = tmp;
+    }
+    entries[n].id = view->item_id;
+    entries[n].parent_id = view->parent_id;
+    entries[n].filename = view->filename ? strdup(view->filename) : NULL;
+    entries[n].filetype = view->filetype;
+    if (view->filetype == LIBMTP_FILETYPE_FOLDER)
+      nroffolders++;
+    n++;
+  }
+  LIBMTP_End_Object_Iteration(it);
+  if (view == NULL)
+    visited = (uint32_t *) malloc(nroffolders * sizeof(uint32_t));
+
+  if (view != NULL || visited == NULL) {
+    add_error_to_errorstack(to, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Copy_Folder_Between_Devices(): "
+			    "out of memory.");
+  } else if (name == NULL) {
+    add_error_to_errorstack(to, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Copy_Folder_Between_Devices(): "
+			    "no such folder on the source device.");
+  } else {
+    newid = LIBMTP_Create_Folder(to, name, parent_id, storage_id);
+    if (newid != 0) {
+      qsort(entries, n, sizeof(device_copy_entry_t),
+	    compare_device_copy_parent);
+      ret = copy_folder_contents(from, entries, n, folder_id, to, newid,
+				 storage_id, callback, data,
+				 visited, &nrofvisited);
+    }
+  }
+
+  for (i = 0; i < n; i++)
+    free(entries[i].filename);
+  free(entries);
+  free(visited);
+  free(name);
+  return ret;
+}
+
+/**
+ * The largest number of renames sent in one object property list, so
+ * that a list the device turns down costs few renames one by one.
+ */
+#define BATCH_RENAMES 127
+
+/**
+ * Internal function to issue one delete, move or copy of a batch. The
+ * cache is left alone, LIBMTP_Run_Batch() applies all changes at the end.
+ * @param params the PTP parameters of the device.
+ * @param op the operation to issue.
+ * @return the PTP response code.
+ */
+static uint16_t run_batch_operation(PTPParams *params,
+				    LIBMTP_batch_operation_t *op)
 {
+  PTPContainer ptp;
   uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  LIBMTP_file_t *newfilemeta;
 
-  if (send_file_object_info(device, filedata))
-  {
-    // no need to output an error since send_file_object_info will already have done so
-    return -1;
+  memset(&ptp, 0, sizeof(ptp));
+  ptp.Param1 = op->object_id;
+  switch (op->op) {
+  case LIBMTP_BATCH_DELETE:
+    ptp.Code = PTP_OC_DeleteObject;
+    ptp.Nparam = 2;
+    break;
+  case LIBMTP_BATCH_MOVE:
+    ptp.Code = PTP_OC_MoveObject;
+    ptp.Nparam = 3;
+    ptp.Param2 = op->storage_id;
+    ptp.Param3 = op->parent_id;
+    break;
+  case LIBMTP_BATCH_COPY:
+    ptp.Code = PTP_OC_CopyObject;
+    ptp.Nparam = 3;
+    ptp.Param2 = op->storage_id;
+    ptp.Param3 = op->parent_id;
+    break;
+  default:
+    return PTP_RC_ParameterNotSupported;
   }
 
-  // Callbacks
-  ptp_usb->callback_active = 1;
-  // The callback will deactivate itself after this amount of data has been sent
-  // One BULK header for the request, one for the data phase. No parameters to the request.
-  ptp_usb->current_transfer_total = filedata->filesize+PTP_USB_BULK_HDR_LEN*2;
-  ptp_usb->current_transfer_complete = 0;
-  ptp_usb->current_transfer_callback = callback;
-  ptp_usb->current_transfer_callback_data = data;
+  ret = ptp_transaction_new(params, &ptp, PTP_DP_NODATA, 0, NULL);
+  // The response to CopyObject carries the handle of the new object
+  if (ret == PTP_RC_OK && op->op == LIBMTP_BATCH_COPY)
+    op->new_id = ptp.Param1;
+  return ret;
+}
 
-  MTPDataHandler mtp_handler;
-  mtp_handler.getfunc = get_func;
-  mtp_handler.putfunc = NULL;
-  mtp_handler.priv = priv;
+/**
+ * Internal function to check one rename of a batch the same way
+ * set_object_filename() does.
+ * @param device a pointer to the device.
+ * @param op the rename to check.
+ * @param newname the name to set is returned here, NULL on failure.
+ * @return PTP_RC_OK or the reason the object cannot be renamed.
+ */
+static uint16_t prepare_batch_rename(LIBMTP_mtpdevice_t *device,
+				     LIBMTP_batch_operation_t *op,
+				     char **newname)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPObjectPropDesc opd;
+  PTPObject *ob;
+  uint16_t ret;
+  uint8_t settable;
 
-  PTPDataHandler handler;
-  handler.getfunc = get_func_wrapper;
-  handler.putfunc = NULL;
-  handler.priv = &mtp_handler;
+  *newname = NULL;
+  if (op->name == NULL)
+    return PTP_RC_InvalidParameter;
+  ret = ptp_object_want(params, op->object_id, PTPOBJECT_OBJECTINFO_LOADED, &ob);
+  if (ret != PTP_RC_OK)
+    return ret;
+  // Descriptions are cached per format, so only the first one costs
+  ret = ptp_mtp_getobjectpropdesc(params, PTP_OPC_ObjectFileName,
+				  ob->oi.ObjectFormat, &opd);
+  if (ret != PTP_RC_OK)
+    return ret;
+  settable = opd.GetSet;
+  ptp_free_objectpropdesc(&opd);
+  if (!settable)
+    return PTP_RC_ObjectWriteProtected;
 
-  ret = ptp_sendobject_from_handler(params, &handler, filedata->filesize);
+  *newname = strdup(op->name);
+  if (*newname == NULL)
+    return PTP_RC_GeneralError;
+  if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
+    strip_7bit_from_utf8(*newname);
+  }
+  return PTP_RC_OK;
+}
 
-  ptp_usb->callback_active = 0;
-  ptp_usb->current_transfer_callback = NULL;
-  ptp_usb->current_transfer_callback_data = NULL;
+/**
+ * Internal function to run a sequence of renames of a batch. They go
+ * out as a single object property list where the device takes one,
+ * falling back to one property at a time so that every rename gets
+ * its own result.
+ * @param device a pointer to the device.
+ * @param ops the renames, at most BATCH_RENAMES of them.
+ * @param names the names set are returned here, NULL where a rename
+ *        failed.
+ * @param n the number of renames.
+ */
+static void run_batch_renames(LIBMTP_mtpdevice_t *device,
+			      LIBMTP_batch_operation_t *ops,
+			      char **names, unsigned int n)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
+  PTPPropertyValue propval;
+  unsigned int i;
+  uint16_t listret = PTP_RC_OperationNotSupported;
+  uint16_t ret;
 
-  if (ret == PTP_ERROR_CANCEL) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_CANCELLED, "LIBMTP_Send_File_From_Handler(): Cancelled transfer.");
-    return -1;
+  for (i = 0; i < n; i++) {
+    ops[i].result = prepare_batch_rename(device, &ops[i], &names[i]);
   }
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Send_File_From_Handler(): "
-				"Could not send object.");
-    return -1;
+
+  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
+      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
+    MTPProperties *props = NULL;
+    MTPProperties *prop = NULL;
+    int nrofprops = 0;
+
+    for (i = 0; i < n; i++) {
+      if (names[i] == NULL)
+	continue;
+      prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
+      if (prop == NULL)
+	break;
+      prop->ObjectHandle = ops[i].object_id;
+      prop->property = PTP_OPC_ObjectFileName;
+      prop->datatype = PTP_DTC_STR;
+      prop->propval.str = strdup(names[i]);
+    }
+    if (nrofprops == 0)
+      return;
+    listret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+    ptp_destroy_object_prop_list(props, nrofprops);
+    if (listret == PTP_RC_OK && prop != NULL)
+      return;
+    // The response does not tell which entry failed, so go one by one
+  }
+
+  for (i = 0; i < n; i++) {
+    if (names[i] == NULL)
+      continue;
+    ret = (listret != PTP_RC_OK) ? listret : PTP_RC_OperationNotSupported;
+    if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjectPropValue)) {
+      propval.str = names[i];
+      ret = ptp_mtp_setobjectpropvalue(params, ops[i].object_id,
+				       PTP_OPC_ObjectFileName,
+				       &propval, PTP_DTC_STR);
+    }
+    if (ret != PTP_RC_OK) {
+      ops[i].result = ret;
+      free(names[i]);
+      names[i] = NULL;
+    }
   }
+}
 
-  add_object_to_cache(device, filedata->item_id);
+/**
+ * Internal function to apply a successful batch operation to a cached
+ * object.
+ * @param params the PTP parameters holding the cache.
+ * @param ob the cached object.
+ * @param op the operation that went through.
+ * @param name the new filename for a rename.
+ */
+static void update_batch_cached_object(PTPParams *params, PTPObject *ob,
+				       LIBMTP_batch_operation_t const *op,
+				       char const *name)
+{
+  unsigned int i;
 
-  /*
-   * Get the device-assined parent_id from the cache.
-   * The operation that adds it to the cache will
-   * look it up from the device, so we get the new
-   * parent_id from the cache.
-   */
-  newfilemeta = LIBMTP_Get_Filemetadata(device, filedata->item_id);
-  if (newfilemeta != NULL) {
-    filedata->parent_id = newfilemeta->parent_id;
-    filedata->storage_id = newfilemeta->storage_id;
-    LIBMTP_destroy_file_t(newfilemeta);
+  if (op->op == LIBMTP_BATCH_MOVE) {
+    ob->oi.StorageID = op->storage_id;
+    ob->oi.ParentObject = op->parent_id;
+    ptp_objects_changed(params);
   } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
-			    "LIBMTP_Send_File_From_Handler(): "
-			    "Could not retrieve updated metadata.");
-    return -1;
+    ob->oi.Filename = ptp_cache_strdup(params, name);
   }
+  for (i = 0; i < ob->nrofmtpprops; i++) {
+    MTPProperties *prop = &ob->mtpprops[i];
 
-  return 0;
+    if (op->op == LIBMTP_BATCH_MOVE && prop->property == PTP_OPC_StorageID) {
+      prop->propval.u32 = op->storage_id;
+    } else if (op->op == LIBMTP_BATCH_MOVE && prop->property == PTP_OPC_ParentObject) {
+      prop->propval.u32 = op->parent_id;
+    } else if (op->op == LIBMTP_BATCH_RENAME && prop->property == PTP_OPC_ObjectFileName) {
+      prop->propval.str = ob->oi.Filename;
+    }
+  }
 }
 
 /**
- * This function sends the file object info, ready for sendobject
- * @param device a pointer to the device to send the file to.
- * @param filedata a file metadata set to be written along with the file.
- * @return 0 if the transfer was successful, any other value means
- *           failure.
+ * This function runs a batch of deletes, moves, copies and renames
+ * back to back. The object cache is updated once after the last
+ * operation instead of after each one, and failures are not put on the
+ * error stack: every operation reports its own PTP response code in
+ * its <code>result</code> field, and copies return the new object in
+ * <code>new_id</code>.
+ *
+ * Consecutive renames are sent as one object property list where the
+ * device supports that. Operations run in array order, and an
+ * operation that fails does not stop the ones after it.
+ *
+ * @param device a pointer to the device holding the objects.
+ * @param ops the operations to run, results are filled in here.
+ * @param n the number of operations.
+ * @return 0 if all operations succeeded, the number of failed
+ *         operations otherwise, or -1 if the batch could not be run.
+ * @see LIBMTP_Delete_Object()
+ * @see LIBMTP_Move_Object()
+ * @see LIBMTP_Copy_Object()
  */
-static int send_file_object_info(LIBMTP_mtpdevice_t *device, LIBMTP_file_t *filedata)
+int LIBMTP_Run_Batch(LIBMTP_mtpdevice_t *device,
+		     LIBMTP_batch_operation_t *ops,
+		     unsigned int const n)
 {
   PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint32_t store;
-  int use_primary_storage = 1;
-  uint16_t of = map_libmtp_type_to_ptp_type(filedata->filetype);
-  LIBMTP_devicestorage_t *storage;
-  uint32_t localph = filedata->parent_id;
-  uint16_t ret;
-  unsigned int i;
-
-#if 0
-  // Sanity check: no zerolength files on some devices?
-  // If the zerolength files cause problems on some devices,
-  // then add a bug flag for this.
-  if (filedata->filesize == 0) {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "send_file_object_info(): "
-			    "File of zero size.");
+  PTPObject *ob;
+  char **names;
+  uint32_t *deleted;
+  unsigned int i, j;
+  unsigned int nrofdeleted = 0;
+  int failed = 0;
+  int changed = 0;
+
+  if (n == 0)
+    return 0;
+  names = calloc(n, sizeof(char *));
+  deleted = malloc(n * sizeof(uint32_t));
+  if (names == NULL || deleted == NULL) {
+    free(names);
+    free(deleted);
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Run_Batch(): could not allocate memory.");
     return -1;
   }
-#endif
-  if (filedata->storage_id != 0) {
-    store = filedata->storage_id;
-  } else {
-    store = get_suggested_storage_id(device, filedata->filesize, localph);
-  }
 
-  // Detect if something non-primary is in use.
-  storage = device->storage;
-  if (storage != NULL && store != storage->id) {
-    use_primary_storage = 0;
+  for (i = 0; i < n; i = j) {
+    ops[i].new_id = 0;
+    if (ops[i].op != LIBMTP_BATCH_RENAME) {
+      ops[i].result = run_batch_operation(params, &ops[i]);
+      j = i + 1;
+      continue;
+    }
+    for (j = i + 1; j < n && j - i < BATCH_RENAMES &&
+	   ops[j].op == LIBMTP_BATCH_RENAME; j++) {
+      ops[j].new_id = 0;
+    }
+    run_batch_renames(device, &ops[i], &names[i], j - i);
   }
 
-  /*
-   * If no destination folder was given, look up a default
-   * folder if possible. Perhaps there is some way of retrieveing
-   * the default folder for different forms of content, what
-   * do I know, we use a fixed list in lack of any better method.
-   * Some devices obviously need to have their files in certain
-   * folders in order to find/display them at all (hello Creative),
-   * so we have to have a method for this. We only do this if the
-   * primary storage is in use.
-   */
-
-  if (localph == 0 && use_primary_storage) {
-    if (LIBMTP_FILETYPE_IS_AUDIO(filedata->filetype)) {
-      localph = device->default_music_folder;
-    } else if (LIBMTP_FILETYPE_IS_VIDEO(filedata->filetype)) {
-      localph = device->default_video_folder;
-    } else if (of == PTP_OFC_EXIF_JPEG ||
-	       of == PTP_OFC_JP2 ||
-	       of == PTP_OFC_JPX ||
-	       of == PTP_OFC_JFIF ||
-	       of == PTP_OFC_TIFF ||
-	       of == PTP_OFC_TIFF_IT ||
-	       of == PTP_OFC_BMP ||
-	       of == PTP_OFC_GIF ||
-	       of == PTP_OFC_PICT ||
-	       of == PTP_OFC_PNG ||
-	       of == PTP_OFC_MTP_WindowsImageFormat) {
-      localph = device->default_picture_folder;
-    } else if (of == PTP_OFC_MTP_vCalendar1 ||
-	       of == PTP_OFC_MTP_vCalendar2 ||
-	       of == PTP_OFC_MTP_UndefinedContact ||
-	       of == PTP_OFC_MTP_vCard2 ||
-	       of == PTP_OFC_MTP_vCard3 ||
-	       of == PTP_OFC_MTP_UndefinedCalendarItem) {
-      localph = device->default_organizer_folder;
-    } else if (of == PTP_OFC_Text) {
-      localph = device->default_text_folder;
+  // Now bring the cache up to date in one go
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  for (i = 0; i < n; i++) {
+    if (ops[i].result != PTP_RC_OK) {
+      failed++;
+      continue;
+    }
+    if (ops[i].op != LIBMTP_BATCH_RENAME)
+      changed = 1;
+    switch (ops[i].op) {
+    case LIBMTP_BATCH_DELETE:
+      deleted[nrofdeleted++] = ops[i].object_id;
+      break;
+    case LIBMTP_BATCH_COPY:
+      if (ops[i].new_id != 0)
+	ptp_add_object_to_cache(params, ops[i].new_id);
+      break;
+    case LIBMTP_BATCH_MOVE:
+    case LIBMTP_BATCH_RENAME:
+      if (ptp_object_find(params, ops[i].object_id, &ob) == PTP_RC_OK) {
+	update_batch_cached_object(params, ob, &ops[i], names[i]);
+	if (ops[i].op == LIBMTP_BATCH_RENAME)
+	  ptp_object_name_changed(params, ob);
+      }
+      break;
     }
   }
+  ptp_remove_objects_from_cache(params, deleted, nrofdeleted);
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  // Sizes are not at hand here, the next free space check asks
+  if (changed)
+    invalidate_freespace(device, 0xffffffffU);
 
-  // Here we wire the type to unknown on bugged, but
-  // Ogg or FLAC-supportive devices.
-  if (FLAG_OGG_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_OGG) {
-    of = PTP_OFC_Undefined;
-  }
-  if (FLAG_FLAC_IS_UNKNOWN(ptp_usb) && of == PTP_OFC_MTP_FLAC) {
-    of = PTP_OFC_Undefined;
+  for (i = 0; i < n; i++) {
+    free(names[i]);
   }
+  free(names);
+  free(deleted);
+  return failed;
+}
 
-  if (ptp_operation_issupported(params, PTP_OC_MTP_SendObjectPropList) &&
-      !FLAG_BROKEN_SEND_OBJECT_PROPLIST(ptp_usb)) {
-    /*
-     * MTP enhanched does it this way (from a sniff):
-     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
-     *    20 00 00 00 01 00 08 98 1B 00 00 00 01 00 01 00
-     *    FF FF FF FF 00 30 00 00 00 00 00 00 12 5E 00 00
-     *    Length: 0x00000020
-     *    Type:   0x0001 PTP_USB_CONTAINER_COMMAND
-     *    Code:   0x9808
-     *    Transaction ID: 0x0000001B
-     *    Param1: 0x00010001 <- store
-     *    Param2: 0xffffffff <- parent handle (-1 ?)
-     *    Param3: 0x00003000 <- file type PTP_OFC_Undefined - we don't know about PDF files
-     *    Param4: 0x00000000 <- file length MSB (-0x0c header len)
-     *    Param5: 0x00005e12 <- file length LSB (-0x0c header len)
-     *
-     * -> PTP_OC_MTP_SendObjectPropList (0x9808):
-     *    46 00 00 00 02 00 08 98 1B 00 00 00 03 00 00 00
-     *    00 00 00 00 07 DC FF FF 0D 4B 00 53 00 30 00 36 - dc07 = file name
-     *    00 30 00 33 00 30 00 36 00 2E 00 70 00 64 00 66
-     *    00 00 00 00 00 00 00 03 DC 04 00 00 00 00 00 00 - dc03 = protection status
-     *    00 4F DC 02 00 01                               - dc4f = non consumable
-     *    Length: 0x00000046
-     *    Type:   0x0002 PTP_USB_CONTAINER_DATA
-     *    Code:   0x9808
-     *    Transaction ID: 0x0000001B
-     *    Metadata....
-     *    0x00000003 <- Number of metadata items
-     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
-     *    0xdc07     <- metadata type: file name
-     *    0xffff     <- metadata type: string
-     *    0x0d       <- number of (uint16_t) characters
-     *    4b 53 30 36 30 33 30 36 2e 50 64 66 00 "KS060306.pdf", null terminated
-     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
-     *    0xdc03     <- metadata type: protection status
-     *    0x0004     <- metadata type: uint16_t
-     *    0x0000     <- not protected
-     *    0x00000000 <- Object handle, set to 0x00000000 since it is unknown!
-     *    0xdc4f     <- non consumable
-     *    0x0002     <- metadata type: uint8_t
-     *    0x01       <- non-consumable (this device cannot display PDF)
-     *
-     * <- Read 0x18 bytes back
-     *    18 00 00 00 03 00 01 20 1B 00 00 00 01 00 01 00
-     *    00 00 00 00 01 40 00 00
-     *    Length: 0x000000018
-     *    Type:   0x0003 PTP_USB_CONTAINER_RESPONSE
-     *    Code:   0x2001 PTP_OK
-     *    Transaction ID: 0x0000001B
-     *    Param1: 0x00010001 <- store
-     *    Param2: 0x00000000 <- parent handle
-     *    Param3: 0x00004001 <- new file/object ID
-     *
-     * -> PTP_OC_SendObject (0x100d)
-     *    0C 00 00 00 01 00 0D 10 1C 00 00 00
-     * -> ... all the bytes ...
-     * <- Read 0x0c bytes back
-     *    0C 00 00 00 03 00 01 20 1C 00 00 00
-     *    ... Then update metadata one-by one, actually (instead of sending it first!) ...
-     */
-    MTPProperties *props = NULL;
-    int nrofprops = 0;
-    MTPProperties *prop = NULL;
-    uint16_t *properties = NULL;
-    uint32_t propcnt = 0;
+/**
+ * The most threads that compare local directories with the object
+ * cache at once while a sync is planned.
+ */
+#define SYNC_PLAN_THREADS 4
 
-    // default parent handle
-    if (localph == 0)
-      localph = 0xFFFFFFFFU; // Set to -1
+/**
+ * Seconds a local file may be newer than its copy on the device before
+ * it counts as changed, FAT only keeps even seconds.
+ */
+#define SYNC_DATE_SLACK 2
 
-    // Must be 0x00000000U for new objects
-    filedata->item_id = 0x00000000U;
+/**
+ * One cached object of the synced storage. The planner keeps these in
+ * order of parent and filename.
+ */
+typedef struct {
+  uint32_t id;
+  uint32_t parent_id;
+  uint32_t storage_id;
+  char *filename;
+  uint64_t filesize;
+  time_t modificationdate;
+  int folder;
+} sync_entry_t;
 
-    ret = ptp_mtp_getobjectpropssupported(params, of, &propcnt, &properties);
+/**
+ * One entry of a local directory.
+ */
+typedef struct {
+  char *name;
+  uint64_t filesize;
+  time_t modificationdate;
+  int folder;
+} sync_local_t;
 
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+/**
+ * One difference found in a folder, turned into an action once all
+ * folders have been compared.
+ */
+typedef struct {
+  LIBMTP_sync_op_t op; // LIBMTP_SYNC_SEND or LIBMTP_SYNC_DELETE
+  char *name;
+  uint32_t object_id;
+  uint64_t filesize;
+  time_t modificationdate;
+  int folder; // a delete of a folder
+  int conflict; // a delete of an object in the way of a local one
+  int moved; // a move takes the place of this item
+} sync_item_t;
+
+typedef struct sync_folder_struct sync_folder_t;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], of, &opd);
-      if (ret != PTP_RC_OK) {
-	add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_ObjectFileName:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_ObjectFileName;
-	  prop->datatype = PTP_DTC_STR;
-	  if (filedata->filename != NULL) {
-	    prop->propval.str = strdup(filedata->filename);
-	    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-	      strip_7bit_from_utf8(prop->propval.str);
-	    }
-	  }
-	  break;
-	case PTP_OPC_ProtectionStatus:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_ProtectionStatus;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = 0x0000U; /* Not protected */
-	  break;
-	case PTP_OPC_NonConsumable:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_NonConsumable;
-	  prop->datatype = PTP_DTC_UINT8;
-	  prop->propval.u8 = 0x00; /* It is supported, then it is consumable */
-	  break;
-	case PTP_OPC_Name:
-	  prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	  prop->ObjectHandle = filedata->item_id;
-	  prop->property = PTP_OPC_Name;
-	  prop->datatype = PTP_DTC_STR;
-	  if (filedata->filename != NULL)
-	    prop->propval.str = strdup(filedata->filename);
-	  break;
-	case PTP_OPC_DateModified:
-	  // Tag with current time if that is supported
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    prop = ptp_get_new_object_prop_entry(&props,&nrofprops);
-	    prop->ObjectHandle = filedata->item_id;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
-	    filedata->modificationdate = time(NULL);
-	  }
-	  break;
-	}
-      }
-      ptp_free_objectpropdesc(&opd);
-    }
-    free(properties);
+/**
+ * One folder of the local directory tree, with the device folder it is
+ * compared with if there is one.
+ */
+struct sync_folder_struct {
+  char *path; // relative to the local directory, "" at the top
+  uint32_t folder_id;
+  int exists; // folder_id is the device folder
+  int action; // the action creating the folder otherwise
+  sync_folder_t *parent;
+  sync_item_t *items;
+  unsigned int nrofitems;
+  sync_folder_t **children;
+  unsigned int nrofchildren;
+  sync_folder_t *next; // in the queue of the planner
+};
+
+/**
+ * A sync being planned, the folders waiting to be compared are queued
+ * here for the planning threads.
+ */
+typedef struct {
+  sync_entry_t *entries;
+  unsigned int nrofentries;
+  char const *localdir;
+  int flags;
+  int error;
+  sync_folder_t *head;
+  sync_folder_t *tail;
+  unsigned int pending; // folders queued or being compared
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+} sync_planner_t;
+
+static int compare_sync_entries(const void *a, const void *b)
+{
+  sync_entry_t const *x = (sync_entry_t const *) a;
+  sync_entry_t const *y = (sync_entry_t const *) b;
+
+  if (x->parent_id != y->parent_id)
+    return (x->parent_id > y->parent_id) - (x->parent_id < y->parent_id);
+  return strcmp(x->filename, y->filename);
+}
+
+static int compare_sync_locals(const void *a, const void *b)
+{
+  return strcmp(((sync_local_t const *) a)->name,
+		((sync_local_t const *) b)->name);
+}
+
+/**
+ * Internal function to find the first cached child of a folder.
+ * @return the index of the child, or the number of entries if there
+ *         is none.
+ */
+static unsigned int sync_first_child(sync_entry_t const *entries,
+				     unsigned int const n,
+				     uint32_t const parent_id)
+{
+  unsigned int lo = 0, hi = n;
+
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+
+    if (entries[mid].parent_id < parent_id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * Internal function to put two parts of a path together.
+ */
+static char *sync_join(char const *dir, char const *name)
+{
+  size_t const dirlen = strlen(dir);
+  size_t const namelen = strlen(name);
+  char *path;
+
+  if (dirlen == 0)
+    return strdup(name);
+  path = (char *) malloc(dirlen + namelen + 2);
+  if (path == NULL)
+    return NULL;
+  memcpy(path, dir, dirlen);
+  path[dirlen] = '/';
+  memcpy(path + dirlen + 1, name, namelen + 1);
+  return path;
+}
 
-    ret = ptp_mtp_sendobjectproplist(params, &store, &localph, &filedata->item_id,
-				     of, filedata->filesize, props, nrofprops);
+static void sync_lock(sync_planner_t *pl)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_lock(&pl->lock);
+#endif
+}
 
-    /* Free property list */
-    ptp_destroy_object_prop_list(props, nrofprops);
+static void sync_unlock(sync_planner_t *pl)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_unlock(&pl->lock);
+#endif
+}
 
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "send_file_object_info():"
-				  "Could not send object property list.");
-      if (ret == PTP_RC_AccessDenied) {
-	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
-      }
-      return -1;
-    }
-  } else if (ptp_operation_issupported(params,PTP_OC_SendObjectInfo)) {
-    PTPObjectInfo new_file;
+static int sync_add_item(sync_folder_t *f, LIBMTP_sync_op_t const op,
+			 char const *name, uint32_t const object_id,
+			 uint64_t const filesize, time_t const date,
+			 int const folder, int const conflict)
+{
+  sync_item_t *tmp;
+  sync_item_t *item;
 
-    memset(&new_file, 0, sizeof(PTPObjectInfo));
+  tmp = (sync_item_t *) realloc(f->items,
+				(f->nrofitems + 1) * sizeof(sync_item_t));
+  if (tmp == NULL)
+    return -1;
+  f->items = tmp;
+  item = &f->items[f->nrofitems];
+  item->name = strdup(name);
+  if (item->name == NULL)
+    return -1;
+  item->op = op;
+  item->object_id = object_id;
+  item->filesize = filesize;
+  item->modificationdate = date;
+  item->folder = folder;
+  item->conflict = conflict;
+  item->moved = 0;
+  f->nrofitems++;
+  return 0;
+}
 
-    new_file.Filename = filedata->filename;
-    if (FLAG_ONLY_7BIT_FILENAMES(ptp_usb)) {
-      strip_7bit_from_utf8(new_file.Filename);
-    }
-    if (filedata->filesize > 0xFFFFFFFFL) {
-      // This is a kludge in the MTP standard for large files.
-      new_file.ObjectCompressedSize = (uint32_t) 0xFFFFFFFF;
-    } else {
-      new_file.ObjectCompressedSize = (uint32_t) filedata->filesize;
-    }
-    new_file.ObjectFormat = of;
-    new_file.StorageID = store;
-    new_file.ParentObject = localph;
-    new_file.ModificationDate = time(NULL);
+/**
+ * Internal function to add a subfolder to a folder and queue it for
+ * comparison.
+ */
+static int sync_add_child(sync_planner_t *pl, sync_folder_t *f,
+			  char const *name, int const exists,
+			  uint32_t const folder_id)
+{
+  sync_folder_t **tmp;
+  sync_folder_t *child;
 
-    // Create the object
-    ret = ptp_sendobjectinfo(params, &store, &localph, &filedata->item_id, &new_file);
+  tmp = (sync_folder_t **) realloc(f->children, (f->nrofchildren + 1) *
+				   sizeof(sync_folder_t *));
+  if (tmp == NULL)
+    return -1;
+  f->children = tmp;
+  child = (sync_folder_t *) calloc(1, sizeof(sync_folder_t));
+  if (child == NULL)
+    return -1;
+  child->path = sync_join(f->path, name);
+  if (child->path == NULL) {
+    free(child);
+    return -1;
+  }
+  child->exists = exists;
+  child->folder_id = folder_id;
+  child->action = -1;
+  child->parent = f;
+  f->children[f->nrofchildren++] = child;
 
-    if (ret != PTP_RC_OK) {
-      add_ptp_error_to_errorstack(device, ret, "send_file_object_info(): "
-				  "Could not send object info.");
-      if (ret == PTP_RC_AccessDenied) {
-	add_ptp_error_to_errorstack(device, ret, "ACCESS DENIED.");
+  sync_lock(pl);
+  if (pl->tail != NULL)
+    pl->tail->next = child;
+  else
+    pl->head = child;
+  pl->tail = child;
+  pl->pending++;
+#ifdef HAVE_PTHREAD_H
+  pthread_cond_signal(&pl->cond);
+#endif
+  sync_unlock(pl);
+  return 0;
+}
+
+/**
+ * Internal function to tell whether a local file differs from the
+ * file of the same name on the device. The device tags sent files with
+ * the time they were sent, so only a newer local file has changed.
+ */
+static int sync_file_changed(sync_planner_t const *pl,
+			     sync_local_t const *l, sync_entry_t const *e)
+{
+  if (l->filesize != e->filesize)
+    return 1;
+  if (pl->flags & LIBMTP_SYNC_SIZE_ONLY || e->modificationdate == 0)
+    return 0;
+  return l->modificationdate > e->modificationdate + SYNC_DATE_SLACK;
+}
+
+/**
+ * Internal function to read a local directory.
+ * @return 0 on success, -1 if the directory could not be read.
+ */
+static int sync_read_directory(sync_planner_t const *pl, char const *path,
+			       sync_local_t **local, unsigned int *n)
+{
+  char *dirpath;
+  DIR *dir;
+  struct dirent *de;
+  unsigned int alloced = 0;
+  int ret = 0;
+
+  *local = NULL;
+  *n = 0;
+  dirpath = path[0] ? sync_join(pl->localdir, path) : strdup(pl->localdir);
+  if (dirpath == NULL)
+    return -1;
+  dir = opendir(dirpath);
+  if (dir == NULL) {
+    free(dirpath);
+    return -1;
+  }
+  while ((de = readdir(dir)) != NULL) {
+    struct stat st;
+    char *full;
+
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    full = sync_join(dirpath, de->d_name);
+    if (full == NULL) {
+      ret = -1;
+      break;
+    }
+    // Entries that vanish meanwhile, sockets and the like are skipped
+    if (stat(full, &st) != 0 || (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))) {
+      free(full);
+      continue;
+    }
+    free(full);
+    if (*n == alloced) {
+      sync_local_t *tmp;
+
+      alloced = alloced ? alloced * 2 : 32;
+      tmp = (sync_local_t *) realloc(*local, alloced * sizeof(sync_local_t));
+      if (tmp == NULL) {
+	ret = -1;
+	break;
       }
-      return -1;
+      *local = tmp;
     }
-    // NOTE: the char* pointers inside new_file are not copies so don't
-    // try to destroy this objectinfo!
+    (*local)[*n].name = strdup(de->d_name);
+    if ((*local)[*n].name == NULL) {
+      ret = -1;
+      break;
+    }
+    (*local)[*n].folder = S_ISDIR(st.st_mode);
+    (*local)[*n].filesize = S_ISDIR(st.st_mode) ? 0 : (uint64_t) st.st_size;
+    (*local)[*n].modificationdate = st.st_mtime;
+    (*n)++;
+  }
+  closedir(dir);
+  free(dirpath);
+  if (ret == 0)
+    qsort(*local, *n, sizeof(sync_local_t), compare_sync_locals);
+  return ret;
+}
+
+/**
+ * Internal function to compare one local directory with the cached
+ * contents of its device folder. Both lists are in order of name, so
+ * they are merged in one pass; subfolders are queued as they are found.
+ * @return 0 on success, -1 on failure.
+ */
+static int plan_sync_folder(sync_planner_t *pl, sync_folder_t *f)
+{
+  sync_local_t *local;
+  unsigned int nrofl, li = 0;
+  unsigned int di, dend;
+  int const mirror = pl->flags & LIBMTP_SYNC_MIRROR;
+  int ret = 0;
+
+  if (sync_read_directory(pl, f->path, &local, &nrofl) != 0) {
+    for (li = 0; li < nrofl; li++)
+      free(local[li].name);
+    free(local);
+    return -1;
+  }
+  di = dend = pl->nrofentries;
+  if (f->exists) {
+    di = sync_first_child(pl->entries, pl->nrofentries, f->folder_id);
+    for (dend = di; dend < pl->nrofentries &&
+	   pl->entries[dend].parent_id == f->folder_id; dend++);
   }
 
-  // Now there IS an object with this parent handle.
-  filedata->parent_id = localph;
+  while (ret == 0 && (li < nrofl || di < dend)) {
+    sync_local_t const *l = li < nrofl ? &local[li] : NULL;
+    sync_entry_t const *e = di < dend ? &pl->entries[di] : NULL;
+    int cmp;
 
-  return 0;
+    if (l == NULL)
+      cmp = 1;
+    else if (e == NULL)
+      cmp = -1;
+    else
+      cmp = strcmp(l->name, e->filename);
+
+    if (cmp > 0) {
+      // Only on the device
+      if (mirror)
+	ret = sync_add_item(f, LIBMTP_SYNC_DELETE, e->filename, e->id,
+			    e->filesize, e->modificationdate, e->folder, 0);
+      di++;
+      continue;
+    }
+    if (cmp < 0) {
+      // Only in the local directory
+      e = NULL;
+    } else if (l->folder != e->folder) {
+      // Whatever is on the device is in the way
+      ret = sync_add_item(f, LIBMTP_SYNC_DELETE, e->filename, e->id,
+			  e->filesize, e->modificationdate, e->folder, 1);
+      if (ret != 0)
+	break;
+      e = NULL;
+    }
+    if (l->folder) {
+      ret = sync_add_child(pl, f, l->name, e != NULL, e ? e->id : 0);
+    } else if (e == NULL) {
+      ret = sync_add_item(f, LIBMTP_SYNC_SEND, l->name, 0, l->filesize,
+			  l->modificationdate, 0, 0);
+    } else if (sync_file_changed(pl, l, e)) {
+      ret = sync_add_item(f, LIBMTP_SYNC_SEND, l->name, e->id, l->filesize,
+			  l->modificationdate, 0, 0);
+    }
+    li++;
+    if (cmp == 0)
+      di++;
+  }
+
+  for (li = 0; li < nrofl; li++)
+    free(local[li].name);
+  free(local);
+  return ret;
 }
 
 /**
- * This function updates the MTP track object metadata on a
- * single file identified by an object ID.
- * @param device a pointer to the device to update the track
- *        metadata on.
- * @param metadata a track metadata set to be written to the file.
- *        notice that the <code>track_id</code> field of the
- *        metadata structure must be correct so that the
- *        function can update the right file. If some properties
- *        of this metadata are set to NULL (strings) or 0
- *        (numerical values) they will be discarded and the
- *        track will not be tagged with these blank values.
- * @return 0 on success, any other value means failure. If some
- *        or all of the properties fail to update we will still
- *        return success. On some devices (notably iRiver T30)
- *        properties that exist cannot be updated.
+ * Internal function run by each planning thread, and by the caller,
+ * comparing queued folders until none are left.
  */
-int LIBMTP_Update_Track_Metadata(LIBMTP_mtpdevice_t *device,
-				 LIBMTP_track_t const * const metadata)
+static void *sync_plan_worker(void *arg)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-  PTP_USB *ptp_usb = (PTP_USB*) device->usbinfo;
-  uint32_t i;
-  uint16_t *properties = NULL;
-  uint32_t propcnt = 0;
+  sync_planner_t *pl = (sync_planner_t *) arg;
+  sync_folder_t *f;
+  int skip;
+
+  for (;;) {
+    sync_lock(pl);
+#ifdef HAVE_PTHREAD_H
+    while (pl->head == NULL && pl->pending > 0)
+      pthread_cond_wait(&pl->cond, &pl->lock);
+#endif
+    f = pl->head;
+    if (f == NULL) {
+      sync_unlock(pl);
+      break;
+    }
+    pl->head = f->next;
+    if (pl->head == NULL)
+      pl->tail = NULL;
+    skip = pl->error;
+    sync_unlock(pl);
+
+    // After a failure the rest of the queue is only drained
+    if (!skip && plan_sync_folder(pl, f) != 0) {
+      sync_lock(pl);
+      pl->error = 1;
+      sync_unlock(pl);
+    }
 
-  // First see which properties can be set on this file format and apply accordingly
-  // i.e only try to update this metadata for object tags that exist on the current player.
-  ret = ptp_mtp_getobjectpropssupported(params, map_libmtp_type_to_ptp_type(metadata->filetype), &propcnt, &properties);
-  if (ret != PTP_RC_OK) {
-    // Just bail out for now, nothing is ever set.
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-			    "could not retrieve supported object properties.");
-    return -1;
+    sync_lock(pl);
+    pl->pending--;
+#ifdef HAVE_PTHREAD_H
+    if (pl->pending == 0)
+      pthread_cond_broadcast(&pl->cond);
+#endif
+    sync_unlock(pl);
   }
-  if (ptp_operation_issupported(params, PTP_OC_MTP_SetObjPropList) &&
-      !FLAG_BROKEN_SET_OBJECT_PROPLIST(ptp_usb)) {
-    MTPProperties *props = NULL;
-    MTPProperties *prop = NULL;
-    int nrofprops = 0;
+  return NULL;
+}
 
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+/**
+ * Internal function to compare all queued folders, on a few threads
+ * where there are some.
+ */
+static void sync_plan_folders(sync_planner_t *pl)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_t threads[SYNC_PLAN_THREADS - 1];
+  int nrofthreads = SYNC_PLAN_THREADS - 1;
+  int started = 0;
+  int i;
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_Name:
-	  if (metadata->title == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Name;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->title);
-	  break;
-	case PTP_OPC_AlbumName:
-	  if (metadata->album == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AlbumName;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->album);
-	  break;
-	case PTP_OPC_Artist:
-	  if (metadata->artist == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Artist;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->artist);
-	  break;
-	case PTP_OPC_Composer:
-	  if (metadata->composer == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Composer;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->composer);
-	  break;
-	case PTP_OPC_Genre:
-	  if (metadata->genre == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Genre;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->genre);
-	  break;
-	case PTP_OPC_Duration:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Duration;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->duration, &opd);
-	  break;
-	case PTP_OPC_Track:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Track;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->tracknumber, &opd);
-	  break;
-	case PTP_OPC_OriginalReleaseDate:
-	  if (metadata->date == NULL)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_OriginalReleaseDate;
-	  prop->datatype = PTP_DTC_STR;
-	  prop->propval.str = strdup(metadata->date);
-	  break;
-	case PTP_OPC_SampleRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_SampleRate;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->samplerate, &opd);
-	  break;
-	case PTP_OPC_NumberOfChannels:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_NumberOfChannels;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->nochannels, &opd);
-	  break;
-	case PTP_OPC_AudioWAVECodec:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AudioWAVECodec;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->wavecodec, &opd);
-	  break;
-	case PTP_OPC_AudioBitRate:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_AudioBitRate;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->bitrate, &opd);
-	  break;
-	case PTP_OPC_BitRateType:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_BitRateType;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->bitratetype, &opd);
-	  break;
-	case PTP_OPC_Rating:
-	  // TODO: shall this be set for rating 0?
-	  if (metadata->rating == 0)
-	    break;
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_Rating;
-	  prop->datatype = PTP_DTC_UINT16;
-	  prop->propval.u16 = adjust_u16(metadata->rating, &opd);
-	  break;
-	case PTP_OPC_UseCount:
-	  prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	  prop->ObjectHandle = metadata->item_id;
-	  prop->property = PTP_OPC_UseCount;
-	  prop->datatype = PTP_DTC_UINT32;
-	  prop->propval.u32 = adjust_u32(metadata->usecount, &opd);
-	  break;
-	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    // Tag with current time if that is supported
-	    prop = ptp_get_new_object_prop_entry(&props, &nrofprops);
-	    prop->ObjectHandle = metadata->item_id;
-	    prop->property = PTP_OPC_DateModified;
-	    prop->datatype = PTP_DTC_STR;
-	    prop->propval.str = get_iso8601_stamp();
-	  }
-	  break;
-	default:
-	  break;
+#ifdef _SC_NPROCESSORS_ONLN
+  {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus > 0 && cpus < SYNC_PLAN_THREADS)
+      nrofthreads = cpus - 1;
+  }
+#endif
+  for (i = 0; i < nrofthreads; i++) {
+    if (pthread_create(&threads[started], NULL, sync_plan_worker, pl) == 0)
+      started++;
+  }
+  sync_plan_worker(pl);
+  for (i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+#else
+  sync_plan_worker(pl);
+#endif
+}
+
+static void free_sync_folder(sync_folder_t *f)
+{
+  unsigned int i;
+
+  for (i = 0; i < f->nrofitems; i++)
+    free(f->items[i].name);
+  free(f->items);
+  free(f->children);
+  free(f->path);
+  free(f);
+}
+
+/**
+ * Internal function to append an action to a plan.
+ * @param path the path of the action, taken over by the plan.
+ * @return the index of the action, or -1 on failure.
+ */
+static int sync_add_action(LIBMTP_sync_plan_t *plan, unsigned int *alloced,
+			   LIBMTP_sync_op_t const op, char *path,
+			   uint32_t const object_id,
+			   sync_folder_t const *parent, uint64_t const filesize,
+			   time_t const date)
+{
+  LIBMTP_sync_action_t *a;
+
+  if (path == NULL)
+    return -1;
+  if (plan->nrofactions == *alloced) {
+    LIBMTP_sync_action_t *tmp;
+    unsigned int const n = *alloced ? *alloced * 2 : 32;
+
+    tmp = (LIBMTP_sync_action_t *)
+      realloc(plan->actions, n * sizeof(LIBMTP_sync_action_t));
+    if (tmp == NULL) {
+      free(path);
+      return -1;
+    }
+    plan->actions = tmp;
+    *alloced = n;
+  }
+  a = &plan->actions[plan->nrofactions];
+  memset(a, 0, sizeof(LIBMTP_sync_action_t));
+  a->op = op;
+  a->path = path;
+  a->object_id = object_id;
+  a->parent = -1;
+  if (parent != NULL) {
+    if (parent->exists)
+      a->parent_id = parent->folder_id;
+    else
+      a->parent = parent->action;
+  }
+  a->filesize = filesize;
+  a->modificationdate = date;
+  a->filetype = op == LIBMTP_SYNC_CREATE_FOLDER ?
+    LIBMTP_FILETYPE_FOLDER : LIBMTP_FILETYPE_UNKNOWN;
+  a->result = -1;
+  return plan->nrofactions++;
+}
+
+/**
+ * A file to be sent, a move may take its place.
+ */
+typedef struct {
+  sync_folder_t *folder;
+  sync_item_t *item;
+} sync_send_t;
+
+static int compare_sync_sends(const void *a, const void *b)
+{
+  sync_item_t const *x = ((sync_send_t const *) a)->item;
+  sync_item_t const *y = ((sync_send_t const *) b)->item;
+  int const cmp = strcmp(x->name, y->name);
+
+  if (cmp != 0)
+    return cmp;
+  return (x->filesize > y->filesize) - (x->filesize < y->filesize);
+}
+
+/**
+ * Internal function to turn a delete of a file, or of a file in a
+ * deleted folder, into a move if the same file is to be sent elsewhere.
+ * @param item the delete of the file itself, or NULL.
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_find_move(sync_planner_t const *pl, LIBMTP_sync_plan_t *plan,
+			  unsigned int *alloced, sync_send_t *sends,
+			  unsigned int const nrofsends, sync_entry_t const *e,
+			  sync_item_t *item)
+{
+  sync_send_t key;
+  sync_item_t keyitem;
+  unsigned int lo = 0, hi = nrofsends;
+
+  keyitem.name = e->filename;
+  keyitem.filesize = e->filesize;
+  key.item = &keyitem;
+  while (lo < hi) {
+    unsigned int mid = lo + (hi - lo) / 2;
+
+    if (compare_sync_sends(&sends[mid], &key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (; lo < nrofsends && compare_sync_sends(&sends[lo], &key) == 0; lo++) {
+    sync_item_t *send = sends[lo].item;
+
+    if (send->moved)
+      continue;
+    if (!(pl->flags & LIBMTP_SYNC_SIZE_ONLY) && e->modificationdate != 0 &&
+	send->modificationdate > e->modificationdate + SYNC_DATE_SLACK)
+      continue;
+    if (sync_add_action(plan, alloced, LIBMTP_SYNC_MOVE,
+			sync_join(sends[lo].folder->path, send->name), e->id,
+			sends[lo].folder, send->filesize,
+			send->modificationdate) < 0)
+      return -1;
+    send->moved = 1;
+    if (item != NULL)
+      item->moved = 1;
+    break;
+  }
+  return 0;
+}
+
+/**
+ * Internal function to look for moves among the deletes of a plan.
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_find_moves(sync_planner_t const *pl, LIBMTP_sync_plan_t *plan,
+			   unsigned int *alloced, sync_folder_t **folders,
+			   unsigned int const nroffolders)
+{
+  sync_send_t *sends = NULL;
+  unsigned int nrofsends = 0;
+  uint32_t *stack = NULL;
+  unsigned int i, j;
+  int ret = 0;
+
+  for (i = 0; i < nroffolders; i++)
+    for (j = 0; j < folders[i]->nrofitems; j++)
+      if (folders[i]->items[j].op == LIBMTP_SYNC_SEND &&
+	  folders[i]->items[j].object_id == 0)
+	nrofsends++;
+  if (nrofsends == 0)
+    return 0;
+  sends = (sync_send_t *) malloc(nrofsends * sizeof(sync_send_t));
+  stack = (uint32_t *) malloc((pl->nrofentries + 1) * sizeof(uint32_t));
+  if (sends == NULL || stack == NULL) {
+    free(sends);
+    free(stack);
+    return -1;
+  }
+  nrofsends = 0;
+  for (i = 0; i < nroffolders; i++)
+    for (j = 0; j < folders[i]->nrofitems; j++)
+      if (folders[i]->items[j].op == LIBMTP_SYNC_SEND &&
+	  folders[i]->items[j].object_id == 0) {
+	sends[nrofsends].folder = folders[i];
+	sends[nrofsends].item = &folders[i]->items[j];
+	nrofsends++;
+      }
+  qsort(sends, nrofsends, sizeof(sync_send_t), compare_sync_sends);
+
+  for (i = 0; ret == 0 && i < nroffolders; i++) {
+    for (j = 0; ret == 0 && j < folders[i]->nrofitems; j++) {
+      sync_item_t *item = &folders[i]->items[j];
+      unsigned int depth = 0;
+
+      // Objects in the way are deleted before anything else is done
+      if (item->op != LIBMTP_SYNC_DELETE || item->conflict)
+	continue;
+      if (!item->folder) {
+	sync_entry_t e;
+
+	e.id = item->object_id;
+	e.filename = item->name;
+	e.filesize = item->filesize;
+	e.modificationdate = item->modificationdate;
+	ret = sync_find_move(pl, plan, alloced, sends, nrofsends, &e, item);
+	continue;
+      }
+      // The files of a deleted folder are moved out before it goes
+      stack[depth++] = item->object_id;
+      while (ret == 0 && depth > 0) {
+	uint32_t const parent = stack[--depth];
+	unsigned int k = sync_first_child(pl->entries, pl->nrofentries, parent);
+
+	for (; ret == 0 && k < pl->nrofentries &&
+	       pl->entries[k].parent_id == parent; k++) {
+	  if (pl->entries[k].folder)
+	    stack[depth++] = pl->entries[k].id;
+	  else
+	    ret = sync_find_move(pl, plan, alloced, sends, nrofsends,
+				 &pl->entries[k], NULL);
 	}
       }
-      ptp_free_objectpropdesc(&opd);
     }
+  }
+  free(sends);
+  free(stack);
+  return ret;
+}
 
-    // NOTE: File size is not updated, this should not change anyway.
-    // neither will we change the filename.
+/**
+ * Internal function to turn the compared folders into the actions of a
+ * plan: deletes of objects in the way first, then new folders parent
+ * first, moves, deletes and last the sends.
+ * @return 0 on success, -1 on failure.
+ */
+static int sync_build_plan(sync_planner_t const *pl, LIBMTP_sync_plan_t *plan,
+			   sync_folder_t **folders,
+			   unsigned int const nroffolders)
+{
+  unsigned int alloced = 0;
+  unsigned int i, j;
+  int pass;
 
-    ret = ptp_mtp_setobjectproplist(params, props, nrofprops);
+  for (i = 0; i < nroffolders; i++) {
+    sync_folder_t *f = folders[i];
 
-    ptp_destroy_object_prop_list(props, nrofprops);
+    for (j = 0; j < f->nrofitems; j++) {
+      sync_item_t const *item = &f->items[j];
 
-    if (ret != PTP_RC_OK) {
-      // TODO: return error of which property we couldn't set
-      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-			      "could not set object property list.");
-      free(properties);
-      return -1;
+      if (item->op == LIBMTP_SYNC_DELETE && item->conflict &&
+	  sync_add_action(plan, &alloced, LIBMTP_SYNC_DELETE,
+			  sync_join(f->path, item->name), item->object_id,
+			  NULL, item->filesize, item->modificationdate) < 0)
+	return -1;
     }
+  }
+  // Folders come parent first, the top folder exists
+  for (i = 1; i < nroffolders; i++) {
+    sync_folder_t *f = folders[i];
 
-  } else if (ptp_operation_issupported(params,PTP_OC_MTP_SetObjectPropValue)) {
-    for (i=0;i<propcnt;i++) {
-      PTPObjectPropDesc opd;
+    if (f->exists)
+      continue;
+    f->action = sync_add_action(plan, &alloced, LIBMTP_SYNC_CREATE_FOLDER,
+				strdup(f->path), 0, f->parent, 0, 0);
+    if (f->action < 0)
+      return -1;
+  }
+  if ((pl->flags & LIBMTP_SYNC_MIRROR) &&
+      (pl->flags & LIBMTP_SYNC_FIND_MOVES) &&
+      sync_find_moves(pl, plan, &alloced, folders, nroffolders) != 0)
+    return -1;
+  for (pass = 0; pass < 2; pass++) {
+    LIBMTP_sync_op_t const op = pass ? LIBMTP_SYNC_SEND : LIBMTP_SYNC_DELETE;
+
+    for (i = 0; i < nroffolders; i++) {
+      sync_folder_t *f = folders[i];
+
+      for (j = 0; j < f->nrofitems; j++) {
+	sync_item_t const *item = &f->items[j];
+
+	if (item->op != op || item->conflict || item->moved)
+	  continue;
+	if (sync_add_action(plan, &alloced, op, sync_join(f->path, item->name),
+			    item->object_id, op == LIBMTP_SYNC_SEND ? f : NULL,
+			    item->filesize, item->modificationdate) < 0)
+	  return -1;
+	if (op == LIBMTP_SYNC_SEND)
+	  plan->bytes += item->filesize;
+      }
+    }
+  }
+  return 0;
+}
 
-      ret = ptp_mtp_getobjectpropdesc(params, properties[i], map_libmtp_type_to_ptp_type(metadata->filetype), &opd);
-      if (ret != PTP_RC_OK) {
-	add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				"could not get property description.");
-      } else if (opd.GetSet) {
-	switch (properties[i]) {
-	case PTP_OPC_Name:
-	  // Update title
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Name, metadata->title);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track title.");
-	  }
-	  break;
-	case PTP_OPC_AlbumName:
-	  // Update album
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_AlbumName, metadata->album);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track album name.");
-	  }
-	  break;
-	case PTP_OPC_Artist:
-	  // Update artist
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Artist, metadata->artist);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track artist name.");
-	  }
-	  break;
-	case PTP_OPC_Composer:
-	  // Update composer
-	  ret = set_object_string(device, metadata->item_id, PTP_OPC_Composer, metadata->composer);
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set track composer name.");
-	  }
-	  break;
-	case PTP_OPC_Genre:
-	  // Update genre (but only if valid)
-	  if (metadata->genre) {
-	    ret = set_object_string(device, metadata->item_id, PTP_OPC_Genre, metadata->genre);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "update_abstract_list(): "
-				      "could not set genre.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_Duration:
-	  // Update duration
-	  if (metadata->duration != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_Duration, adjust_u32(metadata->duration, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set track duration.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_Track:
-	  // Update track number.
-	  if (metadata->tracknumber != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Track, adjust_u16(metadata->tracknumber, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set track tracknumber.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_OriginalReleaseDate:
-	  // Update creation datetime
-	  // The date can be zero, but some devices do not support setting zero
-	  // dates (and it seems that a zero date should never be set anyway)
-	  if (metadata->date) {
-	    ret = set_object_string(device, metadata->item_id, PTP_OPC_OriginalReleaseDate, metadata->date);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set track release date.");
-	    }
-	  }
-	  break;
-	  // These are, well not so important.
-	case PTP_OPC_SampleRate:
-	  // Update sample rate
-	  if (metadata->samplerate != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_SampleRate, adjust_u32(metadata->samplerate, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set samplerate.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_NumberOfChannels:
-	  // Update number of channels
-	  if (metadata->nochannels != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_NumberOfChannels, adjust_u16(metadata->nochannels, &opd));
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				    "could not set number of channels.");
-	  }
-	}
-	  break;
-	case PTP_OPC_AudioWAVECodec:
-	  // Update WAVE codec
-	  if (metadata->wavecodec != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioWAVECodec, adjust_u32(metadata->wavecodec, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set WAVE codec.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_AudioBitRate:
-	  // Update bitrate
-	  if (metadata->bitrate != 0) {
-	    ret = set_object_u32(device, metadata->item_id, PTP_OPC_AudioBitRate, adjust_u32(metadata->bitrate, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set bitrate.");
-	  }
-	  }
-	  break;
-	case PTP_OPC_BitRateType:
-	  // Update bitrate type
-	  if (metadata->bitratetype != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_BitRateType, adjust_u16(metadata->bitratetype, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set bitratetype.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_Rating:
-	  // Update user rating
-	  // TODO: shall this be set for rating 0?
-	  if (metadata->rating != 0) {
-	    ret = set_object_u16(device, metadata->item_id, PTP_OPC_Rating, adjust_u16(metadata->rating, &opd));
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set user rating.");
-	    }
-	  }
-	  break;
-	case PTP_OPC_UseCount:
-	  // Update use count, set even to zero if desired.
-	  ret = set_object_u32(device, metadata->item_id, PTP_OPC_UseCount, adjust_u32(metadata->usecount, &opd));
-	  if (ret != 0) {
-	    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				  "could not set use count.");
-	  }
-	  break;
-	case PTP_OPC_DateModified:
-	  if (!FLAG_CANNOT_HANDLE_DATEMODIFIED(ptp_usb)) {
-	    // Update modification time if supported
-	    char *tmpstamp = get_iso8601_stamp();
-	    ret = set_object_string(device, metadata->item_id, PTP_OPC_DateModified, tmpstamp);
-	    if (ret != 0) {
-	      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-				      "could not set modification date.");
-	    }
-	    free(tmpstamp);
-	  }
-	  break;
+/**
+ * This function plans what it takes to make a folder of a device match
+ * a local directory tree. Files and folders are compared by name, size
+ * and modification date in the object cache, so nothing is asked of the
+ * device; local directories are read in parallel where there are
+ * threads. A local file counts as changed if its size differs or it is
+ * newer than the file on the device.
+ *
+ * The plan creates the missing folders, sends new and changed files,
+ * and with <code>LIBMTP_SYNC_MIRROR</code> deletes what is no longer in
+ * the local directory. With <code>LIBMTP_SYNC_FIND_MOVES</code> as well,
+ * a file that is gone from one place and new in another with the same
+ * name and size is moved on the device instead of sent again. Objects in
+ * the way of a local file or directory of the other kind are always
+ * deleted.
+ *
+ * Nothing is changed until the plan is passed to
+ * <code>LIBMTP_Run_Sync_Plan()</code>, so it can be shown or edited
+ * first, for example to set the filetype of the files to send.
+ *
+ * @param device a pointer to the device to sync.
+ * @param localdir the local directory to sync from.
+ * @param storage_id the storage to sync, 0 for the storage of the folder
+ *        or the first storage.
+ * @param folder_id the folder to sync, 0 for the root of the storage.
+ * @param flags <code>LIBMTP_SYNC_MIRROR</code>,
+ *        <code>LIBMTP_SYNC_FIND_MOVES</code> and
+ *        <code>LIBMTP_SYNC_SIZE_ONLY</code> or'ed together, or 0.
+ * @return the plan, destroy it with <code>LIBMTP_destroy_sync_plan_t()</code>,
+ *         or NULL on failure.
+ * @see LIBMTP_Run_Sync_Plan()
+ */
+LIBMTP_sync_plan_t *LIBMTP_Plan_Sync(LIBMTP_mtpdevice_t *device,
+				     char const * const localdir,
+				     uint32_t const storage_id,
+				     uint32_t const folder_id,
+				     int const flags)
+{
+  LIBMTP_object_iterator_t *it;
+  LIBMTP_object_view_t const *view;
+  LIBMTP_sync_plan_t *plan = NULL;
+  sync_planner_t pl;
+  sync_folder_t *top;
+  sync_folder_t **folders = NULL;
+  unsigned int nroffolders = 0;
+  unsigned int alloced = 0, i, j;
+  uint32_t storage = storage_id;
+  int found = folder_id == 0;
+
+  if (localdir == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Plan_Sync(): no local directory.");
+    return NULL;
+  }
+  memset(&pl, 0, sizeof(pl));
+  pl.localdir = localdir;
+  pl.flags = flags;
 
-	  // NOTE: File size is not updated, this should not change anyway.
-	  // neither will we change the filename.
-	default:
-	  break;
-	}
+  // Take the tree from the cache in one go
+  it = LIBMTP_Begin_Object_Iteration(device, storage_id, LIBMTP_ITERATE_ALL, 0);
+  if (it == NULL)
+    return NULL;
+  while ((view = LIBMTP_Next_Object(it)) != NULL) {
+    sync_entry_t *e;
+
+    if (view->item_id == folder_id) {
+      found = view->filetype == LIBMTP_FILETYPE_FOLDER;
+      storage = view->storage_id;
+    }
+    if (pl.nrofentries == alloced) {
+      sync_entry_t *tmp;
+
+      alloced = alloced ? alloced * 2 : 256;
+      tmp = (sync_entry_t *) realloc(pl.entries, alloced * sizeof(sync_entry_t));
+      if (tmp == NULL)
+	break;
+      pl.entries = tmp;
+    }
+    e = &pl.entries[pl.nrofentries];
+    e->filename = strdup(view->filename ? view->filename : "");
+    if (e->filename == NULL)
+      break;
+    e->id = view->item_id;
+    e->parent_id = view->parent_id;
+    e->storage_id = view->storage_id;
+    e->filesize = view->filesize;
+    e->modificationdate = view->modificationdate;
+    e->folder = view->filetype == LIBMTP_FILETYPE_FOLDER;
+    pl.nrofentries++;
+  }
+  LIBMTP_End_Object_Iteration(it);
+
+  if (view != NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Plan_Sync(): out of memory.");
+    goto out;
+  }
+  if (!found) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Plan_Sync(): no such folder.");
+    goto out;
+  }
+  if (storage == 0) {
+    if (device->storage == NULL)
+      LIBMTP_Get_Storage(device, LIBMTP_STORAGE_SORTBY_NOTSORTED);
+    if (device->storage == NULL) {
+      add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			      "LIBMTP_Plan_Sync(): no storage to sync.");
+      goto out;
+    }
+    storage = device->storage->id;
+  }
+  // Objects in the root of other storages share parent 0, drop them
+  for (i = 0, j = 0; i < pl.nrofentries; i++) {
+    if (pl.entries[i].storage_id == storage)
+      pl.entries[j++] = pl.entries[i];
+    else
+      free(pl.entries[i].filename);
+  }
+  pl.nrofentries = j;
+  qsort(pl.entries, pl.nrofentries, sizeof(sync_entry_t), compare_sync_entries);
+
+  top = (sync_folder_t *) calloc(1, sizeof(sync_folder_t));
+  if (top == NULL || (top->path = strdup("")) == NULL) {
+    free(top);
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Plan_Sync(): out of memory.");
+    goto out;
+  }
+  top->folder_id = folder_id;
+  top->exists = 1;
+  top->action = -1;
+  pl.head = pl.tail = top;
+  pl.pending = 1;
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_init(&pl.lock, NULL);
+  pthread_cond_init(&pl.cond, NULL);
+#endif
+  sync_plan_folders(&pl);
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_destroy(&pl.lock);
+  pthread_cond_destroy(&pl.cond);
+#endif
+
+  // All folders, parents first, in the order of their names
+  alloced = 1;
+  nroffolders = 1;
+  folders = (sync_folder_t **) malloc(sizeof(sync_folder_t *));
+  if (folders == NULL) {
+    pl.error = 1;
+    free_sync_folder(top);
+    nroffolders = 0;
+  } else {
+    folders[0] = top;
+  }
+  for (i = 0; i < nroffolders; i++) {
+    sync_folder_t *f = folders[i];
+
+    if (nroffolders + f->nrofchildren > alloced) {
+      sync_folder_t **tmp;
+
+      while (nroffolders + f->nrofchildren > alloced)
+	alloced *= 2;
+      tmp = (sync_folder_t **) realloc(folders, alloced * sizeof(sync_folder_t *));
+      if (tmp == NULL) {
+	// The folders not reached are dropped
+	for (j = i; j < nroffolders; j++)
+	  folders[j]->nrofchildren = 0;
+	pl.error = 1;
+	break;
       }
-      ptp_free_objectpropdesc(&opd);
+      folders = tmp;
     }
+    for (j = 0; j < f->nrofchildren; j++)
+      folders[nroffolders++] = f->children[j];
+  }
+
+  if (pl.error) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Plan_Sync(): could not read "
+			    "the local directory.");
   } else {
-    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL, "LIBMTP_Update_Track_Metadata(): "
-                            "Your device doesn't seem to support any known way of setting metadata.");
-    free(properties);
-    return -1;
+    plan = (LIBMTP_sync_plan_t *) calloc(1, sizeof(LIBMTP_sync_plan_t));
+    if (plan != NULL) {
+      plan->localdir = strdup(localdir);
+      plan->storage_id = storage;
+      plan->folder_id = folder_id;
+    }
+    if (plan == NULL || plan->localdir == NULL ||
+	sync_build_plan(&pl, plan, folders, nroffolders) != 0) {
+      LIBMTP_destroy_sync_plan_t(plan);
+      plan = NULL;
+      add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			      "LIBMTP_Plan_Sync(): out of memory.");
+    }
   }
+  for (i = 0; i < nroffolders; i++)
+    free_sync_folder(folders[i]);
+  free(folders);
 
-  // update cached object properties if metadata cache exists
-  update_metadata_cache(device, metadata->item_id);
+ out:
+  for (i = 0; i < pl.nrofentries; i++)
+    free(pl.entries[i].filename);
+  free(pl.entries);
+  return plan;
+}
 
-  free(properties);
+/**
+ * Passes progress on to the callback of a sync and notes whether the
+ * callback cancelled.
+ */
+typedef struct {
+  LIBMTP_progressfunc_t callback;
+  void const *data;
+  int cancelled;
+} sync_progress_t;
 
+static int sync_progress(uint64_t const sent, uint64_t const total,
+			 void const * const data)
+{
+  sync_progress_t *p = (sync_progress_t *) data;
+
+  if (p->callback(sent, total, p->data) != 0) {
+    p->cancelled = 1;
+    return 1;
+  }
   return 0;
 }
 
 /**
- * This function deletes a single file, track, playlist, folder or
- * any other object off the MTP device, identified by the object ID.
- *
- * If you delete a folder, there is no guarantee that the device will
- * really delete all the files that were in that folder, rather it is
- * expected that they will not be deleted, and will turn up in object
- * listings with parent set to a non-existant object ID. The safe way
- * to do this is to recursively delete all files (and folders) contained
- * in the folder, then the folder itself.
- *
- * @param device a pointer to the device to delete the object from.
- * @param object_id the object to delete.
- * @return 0 on success, any other value means failure.
+ * Internal function to find the destination folder of an action once
+ * the actions before it have run.
+ * @return 0 on success, -1 if the folder could not be created.
  */
-int LIBMTP_Delete_Object(LIBMTP_mtpdevice_t *device,
-			 uint32_t object_id)
+static int sync_action_parent(LIBMTP_sync_plan_t const *plan,
+			      LIBMTP_sync_action_t const *a,
+			      uint32_t *parent_id)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-
-  ret = ptp_deleteobject(params, object_id, 0);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Delete_Object(): could not delete object.");
-    return -1;
+  if (a->parent < 0) {
+    *parent_id = a->parent_id;
+    return 0;
   }
-
+  if ((unsigned int) a->parent >= plan->nrofactions ||
+      plan->actions[a->parent].result != 0)
+    return -1;
+  *parent_id = plan->actions[a->parent].new_id;
   return 0;
 }
 
 /**
- * The function moves an object from one location on a device to another
- * location.
+ * This function runs a plan made by <code>LIBMTP_Plan_Sync()</code>.
+ * Runs of deletes and moves go to the device as one
+ * <code>LIBMTP_Run_Batch()</code> each, and files are sent with
+ * <code>LIBMTP_Send_File_From_File()</code>, so large files go through
+ * the pipelined bulk writes. A changed file is deleted on the device
+ * just before it is sent again.
  *
- * The semantics of moving a folder are not defined in the spec, but it
- * appears to do the right thing when tested (but devices that implement
- * this operation are rare).
- *
- * Note that moving an object may take a significant amount of time,
- * particularly if being moved between storages. MTP does not provide
- * any kind of progress mechanism, so the operation will simply block
- * for the duration.
+ * Every action reports in its <code>result</code> field whether it was
+ * done, and a folder that was created reports its ID in
+ * <code>new_id</code>, as does a file that was sent. An action that fails
+ * does not stop the ones after it, except that nothing is put into a
+ * folder that could not be created. If the progress callback cancels a
+ * transfer the rest of the plan is not run.
  *
- * @param device a pointer to the device where the object exists.
- * @param object_id the object to move.
- * @param storage_id the id of the destination storage.
- * @param parent_id the id of the destination parent object (folder).
- *	  If the destination is the root of the storage, pass '0'.
- * @return 0 on success, any other value means failure.
+ * @param device a pointer to the device the plan was made for.
+ * @param plan the plan to run.
+ * @param callback a progress indicator function called for each file
+ *        sent, or NULL to ignore.
+ * @param data a user-defined pointer that is passed along to
+ *        the <code>progress</code> function.
+ * @return 0 if the whole plan was run, the number of actions that
+ *         were not done otherwise, or -1 if the plan could not be run.
+ * @see LIBMTP_Plan_Sync()
  */
-int LIBMTP_Move_Object(LIBMTP_mtpdevice_t *device,
-		       uint32_t object_id,
-		       uint32_t storage_id,
-		       uint32_t parent_id)
+int LIBMTP_Run_Sync_Plan(LIBMTP_mtpdevice_t *device,
+			 LIBMTP_sync_plan_t * const plan,
+			 LIBMTP_progressfunc_t const callback,
+			 void const * const data)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
+  LIBMTP_batch_operation_t *ops;
+  unsigned int *opactions;
+  sync_progress_t progress;
+  unsigned int i, j, k;
+  int failed = 0;
 
-  ret = ptp_moveobject(params, object_id, storage_id, parent_id);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Move_Object(): could not move object.");
+  if (plan->nrofactions == 0)
+    return 0;
+  ops = (LIBMTP_batch_operation_t *)
+    malloc(plan->nrofactions * sizeof(LIBMTP_batch_operation_t));
+  opactions = (unsigned int *) malloc(plan->nrofactions * sizeof(unsigned int));
+  if (ops == NULL || opactions == NULL) {
+    free(ops);
+    free(opactions);
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Run_Sync_Plan(): out of memory.");
     return -1;
   }
+  progress.callback = callback;
+  progress.data = data;
+  progress.cancelled = 0;
+  for (i = 0; i < plan->nrofactions; i++) {
+    plan->actions[i].result = -1;
+    plan->actions[i].new_id = 0;
+  }
 
-  return 0;
+  for (i = 0; i < plan->nrofactions && !progress.cancelled; i = j) {
+    LIBMTP_sync_action_t *a = &plan->actions[i];
+    uint32_t parent_id;
+    char const *name;
+
+    if (a->op == LIBMTP_SYNC_DELETE || a->op == LIBMTP_SYNC_MOVE) {
+      unsigned int n = 0;
+
+      for (j = i; j < plan->nrofactions &&
+	     (plan->actions[j].op == LIBMTP_SYNC_DELETE ||
+	      plan->actions[j].op == LIBMTP_SYNC_MOVE); j++) {
+	LIBMTP_sync_action_t const *b = &plan->actions[j];
+
+	memset(&ops[n], 0, sizeof(LIBMTP_batch_operation_t));
+	ops[n].object_id = b->object_id;
+	if (b->op == LIBMTP_SYNC_DELETE) {
+	  ops[n].op = LIBMTP_BATCH_DELETE;
+	} else {
+	  ops[n].op = LIBMTP_BATCH_MOVE;
+	  ops[n].storage_id = plan->storage_id;
+	  if (sync_action_parent(plan, b, &ops[n].parent_id) != 0)
+	    continue;
+	}
+	opactions[n++] = j;
+      }
+      if (n > 0 && LIBMTP_Run_Batch(device, ops, n) >= 0) {
+	for (k = 0; k < n; k++) {
+	  if (ops[k].result == PTP_RC_OK) {
+	    plan->actions[opactions[k]].result = 0;
+	    if (ops[k].op == LIBMTP_BATCH_MOVE)
+	      plan->actions[opactions[k]].new_id = ops[k].object_id;
+	  }
+	}
+      }
+      continue;
+    }
+
+    j = i + 1;
+    if (sync_action_parent(plan, a, &parent_id) != 0)
+      continue;
+    name = strrchr(a->path, '/');
+    name = name ? name + 1 : a->path;
+    if (a->op == LIBMTP_SYNC_CREATE_FOLDER) {
+      char *folder = strdup(name);
+
+      if (folder != NULL)
+	a->new_id = LIBMTP_Create_Folder(device, folder, parent_id,
+					 plan->storage_id);
+      free(folder);
+      if (a->new_id != 0)
+	a->result = 0;
+    } else if (a->op == LIBMTP_SYNC_SEND) {
+      LIBMTP_file_t *file;
+      char *path;
+
+      if (a->object_id != 0 && LIBMTP_Delete_Object(device, a->object_id) != 0)
+	continue;
+      path = sync_join(plan->localdir, a->path);
+      file = LIBMTP_new_file_t();
+      if (path == NULL || file == NULL) {
+	free(path);
+	LIBMTP_destroy_file_t(file);
+	continue;
+      }
+      file->filename = strdup(name);
+      file->filesize = a->filesize;
+      file->filetype = a->filetype;
+      file->parent_id = parent_id;
+      file->storage_id = plan->storage_id;
+      if (LIBMTP_Send_File_From_File(device, path, file,
+				     callback ? sync_progress : NULL,
+				     &progress) == 0) {
+	a->result = 0;
+	a->new_id = file->item_id;
+      }
+      LIBMTP_destroy_file_t(file);
+      free(path);
+    }
+  }
+
+  for (i = 0; i < plan->nrofactions; i++) {
+    if (plan->actions[i].result != 0)
+      failed++;
+  }
+  free(ops);
+  free(opactions);
+  return failed;
 }
 
 /**
- * The function copies an object from one location on a device to another
- * location.
- *
- * The semantics of copying a folder are not defined in the spec, but it
- * appears to do the right thing when tested (but devices that implement
- * this operation are rare).
- *
- * Note that copying an object may take a significant amount of time.
- * MTP does not provide any kind of progress mechanism, so the operation
- * will simply block for the duration.
- *
- * @param device a pointer to the device where the object exists.
- * @param object_id the object to copy.
- * @param storage_id the id of the destination storage.
- * @param parent_id the id of the destination parent object (folder).
- *	  If the destination is the root of the storage, pass '0'.
- * @return 0 on success, any other value means failure.
+ * This destroys a plan made by <code>LIBMTP_Plan_Sync()</code>.
+ * @param plan the plan to destroy, may be NULL.
  */
-int LIBMTP_Copy_Object(LIBMTP_mtpdevice_t *device,
-		       uint32_t object_id,
-		       uint32_t storage_id,
-		       uint32_t parent_id)
+void LIBMTP_destroy_sync_plan_t(LIBMTP_sync_plan_t *plan)
 {
-  uint16_t ret;
-  PTPParams *params = (PTPParams *) device->params;
-
-  ret = ptp_copyobject(params, object_id, storage_id, parent_id);
-  if (ret != PTP_RC_OK) {
-    add_ptp_error_to_errorstack(device, ret, "LIBMTP_Copy_Object(): could not copy object.");
-    return -1;
-  }
+  unsigned int i;
 
-  return 0;
+  if (plan == NULL)
+    return;
+  for (i = 0; i < plan->nrofactions; i++)
+    free(plan->actions[i].path);
+  free(plan->actions);
+  free(plan->localdir);
+  free(plan);
 }
 
 /**
@@ -7276,37 +14111,58 @@ LIBMTP_folder_t *LIBMTP_Find_Folder(LIBMTP_folder_t *folderlist, uint32_t id)
   return ret;
 }
 
-/**
- * Function used to recursively get subfolders from params.
+/*
+ * Index entry used to find the children of a folder when building the
+ * folder tree: the folders are sorted by parent, and by their position
+ * in the object list within one parent.
  */
-static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_t parent)
+struct folder_index_struct {
+  uint32_t parent_id;
+  unsigned int pos;
+  LIBMTP_folder_t *folder;
+};
+
+static int compare_folder_index(const void *a, const void *b)
 {
-  LIBMTP_folder_t *retfolders = NULL;
-  LIBMTP_folder_t *children, *iter, *curr;
+  const folder_index_t *x = a;
+  const folder_index_t *y = b;
 
-  iter = list->sibling;
-  while(iter != list) {
-    if (iter->parent_id != parent) {
-      iter = iter->sibling;
-      continue;
-    }
+  if (x->parent_id != y->parent_id)
+    return x->parent_id < y->parent_id ? -1 : 1;
+  return x->pos < y->pos ? -1 : (x->pos > y->pos);
+}
 
-    /* We know that iter is a child of 'parent', therefore we can safely
-     * hold on to 'iter' locally since no one else will steal it
-     * from the 'list' as we recurse. */
-    children = get_subfolders_for_folder(list, iter->folder_id);
+/**
+ * Function used to recursively get subfolders from the folder index.
+ * Folders that are put into the tree have their index entry cleared.
+ */
+static LIBMTP_folder_t *get_subfolders_for_folder(folder_index_t *index,
+						  unsigned int n,
+						  uint32_t parent)
+{
+  LIBMTP_folder_t *retfolders = NULL;
+  unsigned int lo = 0, hi = n;
 
-    curr = iter;
-    iter = iter->sibling;
+  // Find the first child of parent
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
 
-    // Remove curr from the list.
-    curr->child->sibling = curr->sibling;
-    curr->sibling->child = curr->child;
+    if (index[mid].parent_id < parent)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (hi = lo; hi < n && index[hi].parent_id == parent; hi++)
+    ;
 
-    // Attach the children to curr.
-    curr->child = children;
+  // Prepend backwards, so that the siblings keep the object list order
+  while (hi-- > lo) {
+    LIBMTP_folder_t *curr = index[hi].folder;
 
-    // Put this folder into the list of siblings.
+    if (curr == NULL)
+      continue;
+    index[hi].folder = NULL;
+    curr->child = get_subfolders_for_folder(index, n, curr->folder_id);
     curr->sibling = retfolders;
     retfolders = curr;
   }
@@ -7326,33 +14182,37 @@ static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_
 						    uint32_t const storage)
 {
   PTPParams *params = (PTPParams *) device->params;
-  LIBMTP_folder_t head, *rv;
-  unsigned int i;
+  LIBMTP_folder_t *rv;
+  folder_index_t *index;
+  const PTPObjectColumns *cols;
+  unsigned int i, n = 0;
 
   // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  update_cache(device);
+  // Nothing may change the cache while walking it
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
 
   /*
-   * This creates a temporary list of the folders, this is in a
-   * reverse order and uses the Folder pointers that are already
-   * in the Folder structure. From this we can then build up the
-   * folder hierarchy with only looking at this temporary list,
-   * and removing the folders from this temporary list as we go.
-   * This significantly reduces the number of operations that we
-   * have to do in building the folder hierarchy. Also since the
-   * temp list is in reverse order, when we prepend to the sibling
-   * list things are in the same order as they were originally
-   * in the handle list.
+   * This collects the folders into an index sorted by parent, so
+   * that the children of each folder are found with a binary search
+   * instead of scanning all folders for every folder in the tree.
    */
-  head.sibling = &head;
-  head.child = &head;
+  index = malloc(params->nrofobjects * sizeof(folder_index_t));
+  if (index == NULL && params->nrofobjects != 0) {
+    // malloc failure or so.
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+    return NULL;
+  }
+  cols = ptp_object_columns(params);
   for (i = 0; i < params->nrofobjects; i++) {
     LIBMTP_folder_t *folder;
     PTPObject *ob;
 
-    ob = &params->objects[i];
+    // Only the folders are of interest, the columns find them quicker
+    if (cols != NULL && cols->format[i] != PTP_OFC_Association) {
+      continue;
+    }
+    ob = params->objects[i];
     if (ob->oi.ObjectFormat != PTP_OFC_Association) {
       continue;
     }
@@ -7377,6 +14237,10 @@ static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_
     folder = LIBMTP_new_folder_t();
     if (folder == NULL) {
       // malloc failure or so.
+      while (n > 0)
+	LIBMTP_destroy_folder_t(index[--n].folder);
+      free(index);
+      ptp_lock(params, PTP_UNLOCK_OBJECTS);
       return NULL;
     }
     folder->folder_id = ob->oid;
@@ -7384,39 +14248,40 @@ static LIBMTP_folder_t *get_subfolders_for_folder(LIBMTP_folder_t *list, uint32_
     folder->storage_id = ob->oi.StorageID;
     folder->name = (ob->oi.Filename) ? (char *)strdup(ob->oi.Filename) : NULL;
 
-    // pretend sibling says next, and child says prev.
-    folder->sibling = head.sibling;
-    folder->child = &head;
-    head.sibling->child = folder;
-    head.sibling = folder;
+    index[n].parent_id = folder->parent_id;
+    index[n].pos = n;
+    index[n].folder = folder;
+    n++;
   }
+  qsort(index, n, sizeof(folder_index_t), compare_folder_index);
 
   // We begin at the given root folder and get them all recursively
-  rv = get_subfolders_for_folder(&head, 0x00000000U);
+  rv = get_subfolders_for_folder(index, n, 0x00000000U);
 
   // Some buggy devices may have some files in the "root folder"
   // 0xffffffff so if 0x00000000 didn't return any folders,
   // look for children of the root 0xffffffffU
   if (rv == NULL) {
-    rv = get_subfolders_for_folder(&head, 0xffffffffU);
+    rv = get_subfolders_for_folder(index, n, 0xffffffffU);
     if (rv != NULL)
       LIBMTP_ERROR("Device have files in \"root folder\" 0xffffffffU - "
 		   "this is a firmware bug (but continuing)\n");
   }
 
-  // The temp list should be empty. Clean up any orphans just in case.
-  while(head.sibling != &head) {
-    LIBMTP_folder_t *curr = head.sibling;
+  // All folders should be in the tree now. Clean up any orphans just in case.
+  for (i = 0; i < n; i++) {
+    LIBMTP_folder_t *curr = index[i].folder;
 
+    if (curr == NULL)
+      continue;
     LIBMTP_INFO("Orphan folder with ID: 0x%08x name: \"%s\" encountered.\n",
 	   curr->folder_id,
 	   curr->name);
-    curr->sibling->child = curr->child;
-    curr->child->sibling = curr->sibling;
-    curr->child = NULL;
-    curr->sibling = NULL;
     LIBMTP_destroy_folder_t(curr);
   }
+  free(index);
+
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
 
   return rv;
 }
@@ -7552,23 +14417,284 @@ LIBMTP_playlist_t *LIBMTP_new_playlist_t(void)
 }
 
 /**
- * This destroys a playlist metadata structure and deallocates the memory
- * used by it, including any strings. Never use a track metadata
- * structure again after calling this function on it.
- * @param playlist the playlist metadata to destroy.
- * @see LIBMTP_new_playlist_t()
+ * This destroys a playlist metadata structure and deallocates the memory
+ * used by it, including any strings. Never use a track metadata
+ * structure again after calling this function on it.
+ * @param playlist the playlist metadata to destroy.
+ * @see LIBMTP_new_playlist_t()
+ */
+void LIBMTP_destroy_playlist_t(LIBMTP_playlist_t *playlist)
+{
+  if (playlist == NULL) {
+    return;
+  }
+  if (playlist->name != NULL)
+    free(playlist->name);
+  if (playlist->tracks != NULL)
+    free(playlist->tracks);
+  free(playlist);
+  return;
+}
+
+/**
+ * The object references of playlists and albums, and the tracks parsed
+ * out of .spl playlists, as last retrieved. Like the thumbnails, each
+ * entry remembers the size and modification date of its object so that
+ * the references of an object that changed are asked for again. The
+ * cache is guarded by the objects lock.
+ */
+typedef struct {
+  uint32_t id;
+  uint64_t objectsize;
+  time_t modified;
+  uint32_t *refs;
+  uint32_t nrofrefs;
+} references_entry_t;
+
+typedef struct {
+  references_entry_t *entries; /**< Sorted by id */
+  unsigned int nrofentries;
+  unsigned int alloced;
+} references_cache_t;
+
+/**
+ * Internal function to find the place of an object in the references
+ * cache.
+ * @return the index of its entry, or where it would be inserted.
+ */
+static unsigned int references_index(references_cache_t *rc,
+				     uint32_t const id)
+{
+  unsigned int lo = 0;
+  unsigned int hi = rc->nrofentries;
+
+  while (lo < hi) {
+    unsigned int mid = (lo + hi) / 2;
+
+    if (rc->entries[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static void references_drop(references_cache_t *rc, unsigned int const i)
+{
+  free(rc->entries[i].refs);
+  rc->nrofentries--;
+  memmove(&rc->entries[i], &rc->entries[i + 1],
+	  (rc->nrofentries - i) * sizeof(references_entry_t));
+}
+
+static void free_references_cache(LIBMTP_mtpdevice_t *device)
+{
+  references_cache_t *rc = (references_cache_t *) DEVICE_PRIVATE(device)->references;
+  unsigned int i;
+
+  if (rc == NULL)
+    return;
+  for (i = 0; i < rc->nrofentries; i++)
+    free(rc->entries[i].refs);
+  free(rc->entries);
+  free(rc);
+  DEVICE_PRIVATE(device)->references = NULL;
+}
+
+/**
+ * Internal function to look the references of an object up in the
+ * references cache. They are only handed out while the object in the
+ * object cache still has the size and modification date they were
+ * stored with.
+ * @param device the device the object is on.
+ * @param id the object.
+ * @param refs a copy of the references is returned here.
+ * @param nrofrefs the number of references is returned here.
+ * @return 1 if they were found, 0 if not.
+ */
+static int references_get(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			  uint32_t **refs, uint32_t *nrofrefs)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  references_cache_t *rc;
+  references_entry_t *e;
+  PTPObject *ob;
+  unsigned int i;
+  int found = 0;
+
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  rc = (references_cache_t *) DEVICE_PRIVATE(device)->references;
+  if (rc == NULL) {
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+    return 0;
+  }
+  i = references_index(rc, id);
+  if (i < rc->nrofentries && rc->entries[i].id == id) {
+    e = &rc->entries[i];
+    if (ptp_object_find(params, id, &ob) != PTP_RC_OK ||
+	!(ob->flags & PTPOBJECT_OBJECTINFO_LOADED) ||
+	ob->oi.ObjectCompressedSize != e->objectsize ||
+	ob->oi.ModificationDate != e->modified) {
+      references_drop(rc, i);
+    } else {
+      *refs = NULL;
+      if (e->nrofrefs != 0) {
+	*refs = (uint32_t *) malloc(e->nrofrefs * sizeof(uint32_t));
+      }
+      if (e->nrofrefs == 0 || *refs != NULL) {
+	if (e->nrofrefs != 0)
+	  memcpy(*refs, e->refs, e->nrofrefs * sizeof(uint32_t));
+	*nrofrefs = e->nrofrefs;
+	found = 1;
+      }
+    }
+  }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  return found;
+}
+
+/**
+ * Internal function to remember the references of an object. Nothing
+ * is kept for objects whose info is not in the object cache, as they
+ * could not be checked against it later.
+ * @param device the device the object is on.
+ * @param id the object.
+ * @param refs the references, which are copied.
+ * @param nrofrefs the number of references.
+ */
+static void references_put(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			   uint32_t const *refs, uint32_t const nrofrefs)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  references_cache_t *rc;
+  references_entry_t *e;
+  PTPObject *ob;
+  uint32_t *copy = NULL;
+  unsigned int i;
+
+  if (nrofrefs != 0) {
+    copy = (uint32_t *) malloc(nrofrefs * sizeof(uint32_t));
+    if (copy == NULL)
+      return;
+    memcpy(copy, refs, nrofrefs * sizeof(uint32_t));
+  }
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  if (ptp_object_find(params, id, &ob) != PTP_RC_OK ||
+      !(ob->flags & PTPOBJECT_OBJECTINFO_LOADED)) {
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+    references_forget(device, id);
+    free(copy);
+    return;
+  }
+  rc = (references_cache_t *) DEVICE_PRIVATE(device)->references;
+  if (rc == NULL) {
+    rc = (references_cache_t *) calloc(1, sizeof(references_cache_t));
+    DEVICE_PRIVATE(device)->references = rc;
+  }
+  if (rc == NULL) {
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+    free(copy);
+    return;
+  }
+  i = references_index(rc, id);
+  if (i < rc->nrofentries && rc->entries[i].id == id) {
+    free(rc->entries[i].refs);
+  } else {
+    if (rc->nrofentries == rc->alloced) {
+      unsigned int alloced = rc->alloced ? rc->alloced * 2 : 16;
+      references_entry_t *entries;
+
+      entries = (references_entry_t *)
+	realloc(rc->entries, alloced * sizeof(references_entry_t));
+      if (entries == NULL) {
+	ptp_lock(params, PTP_UNLOCK_OBJECTS);
+	free(copy);
+	return;
+      }
+      rc->entries = entries;
+      rc->alloced = alloced;
+    }
+    memmove(&rc->entries[i + 1], &rc->entries[i],
+	    (rc->nrofentries - i) * sizeof(references_entry_t));
+    rc->nrofentries++;
+  }
+  e = &rc->entries[i];
+  e->id = id;
+  e->objectsize = ob->oi.ObjectCompressedSize;
+  e->modified = ob->oi.ModificationDate;
+  e->refs = copy;
+  e->nrofrefs = nrofrefs;
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+}
+
+static void references_forget(LIBMTP_mtpdevice_t *device, uint32_t const id)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  references_cache_t *rc;
+  unsigned int i;
+
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  rc = (references_cache_t *) DEVICE_PRIVATE(device)->references;
+  if (rc != NULL) {
+    i = references_index(rc, id);
+    if (i < rc->nrofentries && rc->entries[i].id == id)
+      references_drop(rc, i);
+  }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+}
+
+/**
+ * Internal function to get the object references of a playlist or
+ * album, from the references cache if they have been retrieved before
+ * and the object did not change since.
+ * @param device the device the object is on.
+ * @param id the playlist or album.
+ * @param refs the references are returned here.
+ * @param nrofrefs the number of references is returned here.
+ * @return a PTP result code.
  */
-void LIBMTP_destroy_playlist_t(LIBMTP_playlist_t *playlist)
+static uint16_t get_object_references(LIBMTP_mtpdevice_t *device,
+				      uint32_t const id,
+				      uint32_t **refs, uint32_t *nrofrefs)
 {
-  if (playlist == NULL) {
+  PTPParams *params = (PTPParams *) device->params;
+  uint16_t ret;
+
+  if (references_get(device, id, refs, nrofrefs))
+    return PTP_RC_OK;
+  ret = ptp_mtp_getobjectreferences(params, id, refs, nrofrefs);
+  if (ret == PTP_RC_OK)
+    references_put(device, id, *refs, *nrofrefs);
+  return ret;
+}
+
+/**
+ * Internal function to convert a .spl playlist, the tracks of playlists
+ * that did not change since they were last read are taken from the
+ * references cache instead of reading the playlist file again.
+ * @param device the device the playlist is on.
+ * @param ob the .spl playlist object.
+ * @param pl the playlist to fill in.
+ */
+static void get_spl_playlist(LIBMTP_mtpdevice_t *device, PTPObject *ob,
+			     LIBMTP_playlist_t *pl)
+{
+  size_t len = strlen(ob->oi.Filename) - 4;
+
+  if (!references_get(device, ob->oid, &pl->tracks, &pl->no_tracks)) {
+    spl_to_playlist_t(device, &ob->oi, ob->oid, pl);
+    references_put(device, ob->oid, pl->tracks, pl->no_tracks);
     return;
   }
-  if (playlist->name != NULL)
-    free(playlist->name);
-  if (playlist->tracks != NULL)
-    free(playlist->tracks);
-  free(playlist);
-  return;
+  // Use the Filename as the playlist name, dropping the ".spl" extension
+  pl->name = (char *) malloc(len + 1);
+  if (pl->name != NULL) {
+    memcpy(pl->name, ob->oi.Filename, len);
+    pl->name[len] = '\0';
+  }
+  pl->playlist_id = ob->oid;
+  pl->parent_id = ob->oi.ParentObject;
+  pl->storage_id = ob->oi.StorageID;
 }
 
 /**
@@ -7593,16 +14719,16 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
   uint32_t i;
 
   // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  update_cache(device);
+  // Nothing may change the cache while walking it
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
 
   for (i = 0; i < params->nrofobjects; i++) {
     LIBMTP_playlist_t *pl;
     PTPObject *ob;
     uint16_t ret;
 
-    ob = &params->objects[i];
+    ob = params->objects[i];
 
     // Ignore stuff that isn't playlists
 
@@ -7611,7 +14737,7 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
     if ( REQ_SPL && is_spl_playlist(&ob->oi) ) {
       // Allocate a new playlist type
       pl = LIBMTP_new_playlist_t();
-      spl_to_playlist_t(device, &ob->oi, ob->oid, pl);
+      get_spl_playlist(device, ob, pl);
     }
     else if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioVideoPlaylist ) {
       continue;
@@ -7630,7 +14756,7 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
       pl->storage_id = ob->oi.StorageID;
 
       // Then get the track listing for this playlist
-      ret = ptp_mtp_getobjectreferences(params, pl->playlist_id, &pl->tracks, &pl->no_tracks);
+      ret = get_object_references(device, pl->playlist_id, &pl->tracks, &pl->no_tracks);
       if (ret != PTP_RC_OK) {
         add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist_List(): "
 				    "could not get object references.");
@@ -7650,6 +14776,7 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist_List(LIBMTP_mtpdevice_t *device)
 
     // Call callback here if we decide to add that possibility...
   }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
   return retlists;
 }
 
@@ -7671,9 +14798,7 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist(LIBMTP_mtpdevice_t *device, uint32_t cons
   uint16_t ret;
 
   // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0) {
-    flush_handles(device);
-  }
+  update_cache(device);
 
   ret = ptp_object_want (params, plid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK)
@@ -7684,7 +14809,7 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist(LIBMTP_mtpdevice_t *device, uint32_t cons
   if ( REQ_SPL && is_spl_playlist(&ob->oi) ) {
     // Allocate a new playlist type
     pl = LIBMTP_new_playlist_t();
-    spl_to_playlist_t(device, &ob->oi, ob->oid, pl);
+    get_spl_playlist(device, ob, pl);
     return pl;
   }
 
@@ -7705,7 +14830,7 @@ LIBMTP_playlist_t *LIBMTP_Get_Playlist(LIBMTP_mtpdevice_t *device, uint32_t cons
   pl->storage_id = ob->oi.StorageID;
 
   // Then get the track listing for this playlist
-  ret = ptp_mtp_getobjectreferences(params, pl->playlist_id, &pl->tracks, &pl->no_tracks);
+  ret = get_object_references(device, pl->playlist_id, &pl->tracks, &pl->no_tracks);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Playlist(): Could not get object references.");
     pl->tracks = NULL;
@@ -8051,6 +15176,7 @@ static int create_new_abstract_list(LIBMTP_mtpdevice_t *device,
   }
 
   add_object_to_cache(device, *newid);
+  references_put(device, *newid, tracks, no_tracks);
 
   return 0;
 }
@@ -8265,6 +15391,7 @@ static int update_abstract_list(LIBMTP_mtpdevice_t *device,
   free(properties);
 
   update_metadata_cache(device, objecthandle);
+  references_put(device, objecthandle, tracks, no_tracks);
 
   return 0;
 }
@@ -8487,7 +15614,7 @@ static void get_album_metadata(LIBMTP_mtpdevice_t *device,
    * If we have a cached, large set of metadata, then use it!
    */
   ret = ptp_object_want(params, alb->album_id, PTPOBJECT_MTPPROPLIST_LOADED, &ob);
-  if (ob->mtpprops) {
+  if (ob->mtpprops && (ob->flags & PTPOBJECT_MTPPROPLIST_LOADED)) {
     prop = ob->mtpprops;
     for (i=0;i<ob->nrofmtpprops;i++,prop++)
       pick_property_to_album_metadata(device, prop, alb);
@@ -8567,15 +15694,16 @@ LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, ui
   uint32_t i;
 
   // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0)
-    flush_handles(device);
+  update_cache(device);
+  // Nothing may change the cache while walking it
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
 
   for (i = 0; i < params->nrofobjects; i++) {
     LIBMTP_album_t *alb;
     PTPObject *ob;
     uint16_t ret;
 
-    ob = &params->objects[i];
+    ob = params->objects[i];
 
     // Ignore stuff that isn't an album
     if ( ob->oi.ObjectFormat != PTP_OFC_MTP_AbstractAudioAlbum )
@@ -8595,7 +15723,7 @@ LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, ui
     get_album_metadata(device, alb);
 
     // Then get the track listing for this album
-    ret = ptp_mtp_getobjectreferences(params, alb->album_id, &alb->tracks, &alb->no_tracks);
+    ret = get_object_references(device, alb->album_id, &alb->tracks, &alb->no_tracks);
     if (ret != PTP_RC_OK) {
       add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album_List(): Could not get object references.");
       alb->tracks = NULL;
@@ -8612,6 +15740,7 @@ LIBMTP_album_t *LIBMTP_Get_Album_List_For_Storage(LIBMTP_mtpdevice_t *device, ui
     }
 
   }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
   return retalbums;
 }
 
@@ -8630,8 +15759,7 @@ LIBMTP_album_t *LIBMTP_Get_Album(LIBMTP_mtpdevice_t *device, uint32_t const albi
   LIBMTP_album_t *alb;
 
   // Get all the handles if we haven't already done that
-  if (params->nrofobjects == 0)
-    flush_handles(device);
+  update_cache(device);
 
   ret = ptp_object_want(params, albid, PTPOBJECT_OBJECTINFO_LOADED, &ob);
   if (ret != PTP_RC_OK)
@@ -8651,7 +15779,7 @@ LIBMTP_album_t *LIBMTP_Get_Album(LIBMTP_mtpdevice_t *device, uint32_t const albi
   get_album_metadata(device, alb);
 
   // Then get the track listing for this album
-  ret = ptp_mtp_getobjectreferences(params, alb->album_id, &alb->tracks, &alb->no_tracks);
+  ret = get_object_references(device, alb->album_id, &alb->tracks, &alb->no_tracks);
   if (ret != PTP_RC_OK) {
     add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Album: Could not get object references.");
     alb->tracks = NULL;
@@ -9073,7 +16201,666 @@ int LIBMTP_Get_Representative_Sample(LIBMTP_mtpdevice_t *device,
 }
 
 /**
- * Retrieve the thumbnail for a file.
+ * The in-memory thumbnail cache of a device, least recently used
+ * thumbnails are dropped first. Each thumbnail remembers the size and
+ * modification date of its object, so that a thumbnail of an object
+ * that changed, or of a reused handle, is not handed out.
+ */
+typedef struct thumbnail_entry_struct thumbnail_entry_t;
+struct thumbnail_entry_struct {
+  uint32_t id;
+  uint32_t size;
+  uint64_t objectsize;
+  time_t modified;
+  unsigned char *data;
+  thumbnail_entry_t *prev; /**< Next more recently used */
+  thumbnail_entry_t *next; /**< Next less recently used */
+  thumbnail_entry_t *chain; /**< Next in the same hash bucket */
+};
+
+typedef struct {
+  uint32_t maxbytes;
+  uint64_t bytes;
+  unsigned int nrofentries;
+  unsigned int nrofbuckets; /**< A power of two, or 0 */
+  thumbnail_entry_t **buckets;
+  thumbnail_entry_t *first;
+  thumbnail_entry_t *last;
+} thumbnail_cache_t;
+
+// Thumbnail files in the cache directory, see thumbnail_file_get()
+#define THUMBNAIL_FILE_MAGIC "LIBMTPTN"
+// Anything larger is not a thumbnail and not kept
+#define THUMBNAIL_MAX_SIZE 0x1000000U
+
+typedef struct {
+  char magic[8];
+  uint32_t byteorder;
+  uint32_t size;
+  uint64_t objectsize;
+  int64_t modified;
+} thumbnail_file_header_t;
+
+/**
+ * A non-blocking thumbnail batch, the thumbnails are asked for one
+ * after the other from the completion of the previous one.
+ */
+typedef struct {
+  LIBMTP_mtpdevice_t *device;
+  LIBMTP_thumbnail_cb_fn thumb_cb;
+  LIBMTP_nonblocking_cb_fn cb;
+  void *user_data;
+  uint32_t *ids;
+  unsigned int n;
+  unsigned int next; /**< The thumbnail being fetched */
+  int failed;
+  PTPDataHandler handler;
+  unsigned char *data;
+  unsigned long size;
+  unsigned long alloced;
+} thumbnail_batch_t;
+
+/**
+ * Internal function to find what a thumbnail is checked against.
+ * @param params the PTP parameters of the device.
+ * @param id the object.
+ * @param objectsize the size of the object is returned here.
+ * @param modified its modification date is returned here.
+ * @return 1 if the object info is in the cache, 0 if not.
+ */
+static int thumbnail_stamp(PTPParams *params, uint32_t const id,
+			   uint64_t *objectsize, time_t *modified)
+{
+  PTPObject *ob;
+  int known = 0;
+
+  *objectsize = 0;
+  *modified = 0;
+  ptp_lock(params, PTP_LOCK_OBJECTS_READ);
+  if (ptp_object_find(params, id, &ob) == PTP_RC_OK &&
+      (ob->flags & PTPOBJECT_OBJECTINFO_LOADED)) {
+    *objectsize = ob->oi.ObjectCompressedSize;
+    *modified = ob->oi.ModificationDate;
+    known = 1;
+  }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  return known;
+}
+
+static thumbnail_entry_t **thumbnail_bucket(thumbnail_cache_t *tc,
+					    uint32_t const id)
+{
+  return &tc->buckets[(id ^ (id >> 13)) & (tc->nrofbuckets - 1)];
+}
+
+static void thumbnail_drop(thumbnail_cache_t *tc, thumbnail_entry_t *e)
+{
+  thumbnail_entry_t **pp = thumbnail_bucket(tc, e->id);
+
+  while (*pp != e)
+    pp = &(*pp)->chain;
+  *pp = e->chain;
+  if (e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    tc->first = e->next;
+  if (e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    tc->last = e->prev;
+  tc->bytes -= e->size;
+  tc->nrofentries--;
+  free(e->data);
+  free(e);
+}
+
+static void thumbnail_trim(thumbnail_cache_t *tc)
+{
+  while (tc->last != NULL && tc->bytes > tc->maxbytes)
+    thumbnail_drop(tc, tc->last);
+}
+
+static void free_thumbnail_cache(LIBMTP_mtpdevice_t *device)
+{
+  thumbnail_cache_t *tc = (thumbnail_cache_t *) DEVICE_PRIVATE(device)->thumbnails;
+
+  if (tc == NULL)
+    return;
+  tc->maxbytes = 0;
+  thumbnail_trim(tc);
+  free(tc->buckets);
+  free(tc);
+  DEVICE_PRIVATE(device)->thumbnails = NULL;
+}
+
+/**
+ * Internal function to look a thumbnail up in the memory cache and make
+ * it the most recently used.
+ * @return a copy of the thumbnail, or NULL if it is not there.
+ */
+static unsigned char *thumbnail_memory_get(LIBMTP_mtpdevice_t *device,
+					   uint32_t const id,
+					   int const known,
+					   uint64_t const objectsize,
+					   time_t const modified,
+					   unsigned int *size)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  thumbnail_cache_t *tc;
+  thumbnail_entry_t *e;
+  unsigned char *data = NULL;
+
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  tc = (thumbnail_cache_t *) DEVICE_PRIVATE(device)->thumbnails;
+  if (tc == NULL || tc->nrofbuckets == 0) {
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+    return NULL;
+  }
+  for (e = *thumbnail_bucket(tc, id); e != NULL; e = e->chain) {
+    if (e->id == id)
+      break;
+  }
+  if (e != NULL && known &&
+      (e->objectsize != objectsize || e->modified != modified)) {
+    thumbnail_drop(tc, e);
+    e = NULL;
+  }
+  if (e != NULL) {
+    if (e->prev != NULL) {
+      e->prev->next = e->next;
+      if (e->next != NULL)
+	e->next->prev = e->prev;
+      else
+	tc->last = e->prev;
+      e->prev = NULL;
+      e->next = tc->first;
+      tc->first->prev = e;
+      tc->first = e;
+    }
+    data = (unsigned char *) malloc(e->size ? e->size : 1);
+    if (data != NULL) {
+      memcpy(data, e->data, e->size);
+      *size = e->size;
+    }
+  }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+  return data;
+}
+
+static void thumbnail_memory_put(LIBMTP_mtpdevice_t *device,
+				 uint32_t const id,
+				 uint64_t const objectsize,
+				 time_t const modified,
+				 unsigned char const *data,
+				 unsigned int const size)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  thumbnail_cache_t *tc;
+  thumbnail_entry_t *e;
+  thumbnail_entry_t **pp;
+
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  tc = (thumbnail_cache_t *) DEVICE_PRIVATE(device)->thumbnails;
+  if (tc == NULL || size > tc->maxbytes) {
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+    return;
+  }
+  // Keep about one bucket per thumbnail
+  if (tc->nrofentries >= tc->nrofbuckets) {
+    unsigned int nrofbuckets = tc->nrofbuckets ? tc->nrofbuckets * 2 : 64;
+    thumbnail_entry_t **buckets;
+
+    buckets = (thumbnail_entry_t **)
+      calloc(nrofbuckets, sizeof(thumbnail_entry_t *));
+    if (buckets != NULL) {
+      free(tc->buckets);
+      tc->buckets = buckets;
+      tc->nrofbuckets = nrofbuckets;
+      for (e = tc->first; e != NULL; e = e->next) {
+	pp = thumbnail_bucket(tc, e->id);
+	e->chain = *pp;
+	*pp = e;
+      }
+    } else if (tc->nrofbuckets == 0) {
+      ptp_lock(params, PTP_UNLOCK_OBJECTS);
+      return;
+    }
+  }
+  for (e = *thumbnail_bucket(tc, id); e != NULL; e = e->chain) {
+    if (e->id == id) {
+      thumbnail_drop(tc, e);
+      break;
+    }
+  }
+  e = (thumbnail_entry_t *) calloc(1, sizeof(thumbnail_entry_t));
+  if (e != NULL)
+    e->data = (unsigned char *) malloc(size ? size : 1);
+  if (e == NULL || e->data == NULL) {
+    free(e);
+    ptp_lock(params, PTP_UNLOCK_OBJECTS);
+    return;
+  }
+  memcpy(e->data, data, size);
+  e->id = id;
+  e->size = size;
+  e->objectsize = objectsize;
+  e->modified = modified;
+  pp = thumbnail_bucket(tc, id);
+  e->chain = *pp;
+  *pp = e;
+  e->next = tc->first;
+  if (tc->first != NULL)
+    tc->first->prev = e;
+  else
+    tc->last = e;
+  tc->first = e;
+  tc->bytes += size;
+  tc->nrofentries++;
+  thumbnail_trim(tc);
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+}
+
+static char *thumbnail_file_path(LIBMTP_mtpdevice_t *device, uint32_t const id)
+{
+  char suffix[24];
+
+  sprintf(suffix, "-%08x.thumb", id);
+  return device_cache_path(device, g_thumbnail_cache_dir, suffix);
+}
+
+/**
+ * Internal function to read a thumbnail from the cache directory. The
+ * file is only used while it matches the object in the object cache.
+ * @return the thumbnail, or NULL if there is no usable file.
+ */
+static unsigned char *thumbnail_file_get(LIBMTP_mtpdevice_t *device,
+					 uint32_t const id,
+					 uint64_t const objectsize,
+					 time_t const modified,
+					 unsigned int *size)
+{
+  thumbnail_file_header_t header;
+  unsigned char *data = NULL;
+  char *path;
+  FILE *f;
+
+  path = thumbnail_file_path(device, id);
+  if (path == NULL)
+    return NULL;
+  f = fopen(path, "rb");
+  free(path);
+  if (f == NULL)
+    return NULL;
+  if (fread(&header, sizeof(header), 1, f) == 1 &&
+      !memcmp(header.magic, THUMBNAIL_FILE_MAGIC, sizeof(header.magic)) &&
+      header.byteorder == METADATA_CACHE_BYTEORDER &&
+      header.size <= THUMBNAIL_MAX_SIZE &&
+      header.objectsize == objectsize &&
+      header.modified == (int64_t) modified) {
+    data = (unsigned char *) malloc(header.size ? header.size : 1);
+    if (data != NULL && fread(data, 1, header.size, f) != header.size) {
+      free(data);
+      data = NULL;
+    }
+    *size = header.size;
+  }
+  fclose(f);
+  return data;
+}
+
+static void thumbnail_file_put(LIBMTP_mtpdevice_t *device,
+			       uint32_t const id,
+			       uint64_t const objectsize,
+			       time_t const modified,
+			       unsigned char const *data,
+			       unsigned int const size)
+{
+  thumbnail_file_header_t header;
+  char *path;
+  char *tmppath;
+  FILE *f;
+  int ok;
+
+  path = thumbnail_file_path(device, id);
+  if (path == NULL)
+    return;
+  tmppath = (char *) malloc(strlen(path) + sizeof(".tmp"));
+  if (tmppath == NULL) {
+    free(path);
+    return;
+  }
+  strcpy(tmppath, path);
+  strcat(tmppath, ".tmp");
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, THUMBNAIL_FILE_MAGIC, sizeof(header.magic));
+  header.byteorder = METADATA_CACHE_BYTEORDER;
+  header.size = size;
+  header.objectsize = objectsize;
+  header.modified = (int64_t) modified;
+  f = fopen(tmppath, "wb");
+  if (f != NULL) {
+    ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+      fwrite(data, 1, size, f) == size;
+    if (fclose(f) != 0)
+      ok = 0;
+    if (!ok || rename(tmppath, path) != 0)
+      unlink(tmppath);
+  }
+  free(tmppath);
+  free(path);
+}
+
+/**
+ * Internal function to look a thumbnail up in the memory cache and then
+ * in the cache directory, files are only used for objects in the
+ * object cache.
+ * @return a newly allocated thumbnail, or NULL if it has to be fetched.
+ */
+static unsigned char *lookup_thumbnail(LIBMTP_mtpdevice_t *device,
+				       uint32_t const id, unsigned int *size)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  unsigned char *data;
+  uint64_t objectsize;
+  time_t modified;
+  int known;
+
+  if (DEVICE_PRIVATE(device)->thumbnails == NULL && g_thumbnail_cache_dir == NULL)
+    return NULL;
+  known = thumbnail_stamp(params, id, &objectsize, &modified);
+  data = thumbnail_memory_get(device, id, known, objectsize, modified, size);
+  if (data != NULL || !known)
+    return data;
+  data = thumbnail_file_get(device, id, objectsize, modified, size);
+  if (data != NULL)
+    thumbnail_memory_put(device, id, objectsize, modified, data, *size);
+  return data;
+}
+
+static void store_thumbnail(LIBMTP_mtpdevice_t *device, uint32_t const id,
+			    unsigned char const *data, unsigned int const size)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  uint64_t objectsize;
+  time_t modified;
+  int known;
+
+  if ((DEVICE_PRIVATE(device)->thumbnails == NULL && g_thumbnail_cache_dir == NULL) ||
+      size > THUMBNAIL_MAX_SIZE)
+    return;
+  known = thumbnail_stamp(params, id, &objectsize, &modified);
+  thumbnail_memory_put(device, id, objectsize, modified, data, size);
+  if (known)
+    thumbnail_file_put(device, id, objectsize, modified, data, size);
+}
+
+/**
+ * This sets how much memory the thumbnails kept for a device may take
+ * up. <code>LIBMTP_Get_Thumbnail()</code> and the thumbnail batches
+ * answer from this cache before asking the device, and drop the least
+ * recently used thumbnails when it is full. The cache is empty and
+ * disabled when a device is opened.
+ * @param device a pointer to the device to keep thumbnails for.
+ * @param maxbytes the size of the cache in bytes, 0 to disable it
+ *        and drop all thumbnails in it.
+ * @see LIBMTP_Set_Thumbnail_Cache_Directory()
+ */
+void LIBMTP_Set_Thumbnail_Cache_Size(LIBMTP_mtpdevice_t *device,
+				     uint32_t const maxbytes)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  thumbnail_cache_t *tc;
+
+  ptp_lock(params, PTP_LOCK_OBJECTS_WRITE);
+  if (maxbytes == 0) {
+    free_thumbnail_cache(device);
+  } else {
+    tc = (thumbnail_cache_t *) DEVICE_PRIVATE(device)->thumbnails;
+    if (tc == NULL) {
+      tc = (thumbnail_cache_t *) calloc(1, sizeof(thumbnail_cache_t));
+      DEVICE_PRIVATE(device)->thumbnails = tc;
+    }
+    if (tc != NULL) {
+      tc->maxbytes = maxbytes;
+      thumbnail_trim(tc);
+    }
+  }
+  ptp_lock(params, PTP_UNLOCK_OBJECTS);
+}
+
+/**
+ * This sets the directory where thumbnails are kept across sessions,
+ * one file per thumbnail named after the serial number of the device
+ * and the object ID. A file is only used while the size and
+ * modification date of its object in the object cache are those the
+ * thumbnail was made of, so it is not used on uncached devices. The
+ * directory must exist, and it can be the one set with
+ * <code>LIBMTP_Set_Metadata_Cache_Directory()</code>, which keeps
+ * object IDs stable across sessions where the device allows it.
+ * @param path the directory to use, or NULL to stop using it, which is
+ *        the default.
+ * @see LIBMTP_Set_Thumbnail_Cache_Size()
+ */
+void LIBMTP_Set_Thumbnail_Cache_Directory(char const * const path)
+{
+  if (g_thumbnail_cache_dir != NULL)
+    free(g_thumbnail_cache_dir);
+  g_thumbnail_cache_dir = NULL;
+  if (path != NULL && path[0] != '\0')
+    g_thumbnail_cache_dir = strdup(path);
+}
+
+/**
+ * This retrieves the thumbnails of several objects, in the order given,
+ * and hands each one to a callback as soon as it is in. Thumbnails in
+ * the thumbnail cache are not asked for again.
+ * @param device a pointer to the device to get the thumbnails from.
+ * @param ids the object IDs to retrieve the thumbnails of.
+ * @param n the number of object IDs.
+ * @param cb called once for each object ID, in order.
+ * @param user_data arbitrary user data passed to the callback.
+ * @return 0 if all thumbnails were retrieved, the number of thumbnails
+ *         that could not be retrieved otherwise.
+ * @see LIBMTP_Get_Thumbnails_Nonblocking()
+ * @see LIBMTP_Set_Thumbnail_Cache_Size()
+ */
+int LIBMTP_Get_Thumbnails(LIBMTP_mtpdevice_t *device,
+			  uint32_t const * const ids, unsigned int const n,
+			  LIBMTP_thumbnail_cb_fn cb, void *user_data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  unsigned char *data;
+  unsigned int size;
+  unsigned int i;
+  uint16_t ret;
+  int failed = 0;
+
+  for (i = 0; i < n; i++) {
+    data = lookup_thumbnail(device, ids[i], &size);
+    if (data == NULL) {
+      ret = ptp_getthumb(params, ids[i], &data, &size);
+      if (ret == PTP_RC_OK) {
+	store_thumbnail(device, ids[i], data, size);
+      } else {
+	add_ptp_error_to_errorstack(device, ret, "LIBMTP_Get_Thumbnails(): "
+				    "could not get thumbnail.");
+	free(data);
+	data = NULL;
+      }
+    }
+    if (data == NULL)
+      failed++;
+    cb(device, ids[i], data ? 0 : -1, data, data ? size : 0, user_data);
+    free(data);
+  }
+  return failed;
+}
+
+static uint16_t thumbnail_batch_put(PTPParams *params, void *priv,
+				    unsigned long sendlen,
+				    unsigned char *data)
+{
+  thumbnail_batch_t *tb = (thumbnail_batch_t *) priv;
+
+  if (tb->size + sendlen > THUMBNAIL_MAX_SIZE)
+    return PTP_ERROR_IO;
+  if (tb->size + sendlen > tb->alloced) {
+    unsigned long alloced = tb->alloced ? tb->alloced * 2 : 16384;
+    unsigned char *p;
+
+    while (alloced < tb->size + sendlen)
+      alloced *= 2;
+    p = (unsigned char *) realloc(tb->data, alloced);
+    if (p == NULL)
+      return PTP_ERROR_IO;
+    tb->data = p;
+    tb->alloced = alloced;
+  }
+  memcpy(tb->data + tb->size, data, sendlen);
+  tb->size += sendlen;
+  return PTP_RC_OK;
+}
+
+static void thumbnail_batch_done(PTPParams *params, PTPContainer *resp,
+				 uint16_t ret, void *data);
+
+/**
+ * Internal function to move a non-blocking batch on: thumbnails in the
+ * cache are handed out right away, up to the first one that has to be
+ * asked for.
+ * @return 1 if a request is underway, 0 if the batch is over.
+ */
+static int thumbnail_batch_step(thumbnail_batch_t *tb)
+{
+  PTPParams *params = (PTPParams *) tb->device->params;
+  unsigned char *data;
+  unsigned int size;
+  uint16_t ret;
+
+  for (; tb->next < tb->n; tb->next++) {
+    uint32_t const id = tb->ids[tb->next];
+
+    data = lookup_thumbnail(tb->device, id, &size);
+    if (data != NULL) {
+      tb->thumb_cb(tb->device, id, 0, data, size, tb->user_data);
+      free(data);
+      continue;
+    }
+    tb->size = 0;
+    ret = ptp_getthumb_async(params, id, &tb->handler,
+			     thumbnail_batch_done, tb);
+    if (ret == PTP_RC_OK)
+      return 1;
+    add_ptp_error_to_errorstack(tb->device, ret,
+				"LIBMTP_Get_Thumbnails_Nonblocking(): "
+				"could not start the request.");
+    tb->failed++;
+    tb->thumb_cb(tb->device, id, -1, NULL, 0, tb->user_data);
+  }
+  return 0;
+}
+
+static void thumbnail_batch_end(thumbnail_batch_t *tb)
+{
+  tb->cb(tb->device, tb->failed, tb->user_data);
+  free(tb->data);
+  free(tb->ids);
+  free(tb);
+}
+
+static void thumbnail_batch_done(PTPParams *params, PTPContainer *resp,
+				 uint16_t ret, void *data)
+{
+  thumbnail_batch_t *tb = (thumbnail_batch_t *) data;
+  uint32_t const id = tb->ids[tb->next];
+
+  if (nonblocking_result(tb->device, ret,
+			 "LIBMTP_Get_Thumbnails_Nonblocking(): "
+			 "could not get thumbnail.") == 0) {
+    store_thumbnail(tb->device, id, tb->data, tb->size);
+    tb->thumb_cb(tb->device, id, 0, tb->data, tb->size, tb->user_data);
+  } else {
+    tb->failed++;
+    tb->thumb_cb(tb->device, id, -1, NULL, 0, tb->user_data);
+  }
+  tb->next++;
+  if (!thumbnail_batch_step(tb))
+    thumbnail_batch_end(tb);
+}
+
+/**
+ * This retrieves the thumbnails of several objects like
+ * <code>LIBMTP_Get_Thumbnails()</code>, but without blocking. Each
+ * request is started as soon as the previous thumbnail is in, and the
+ * callbacks are called from within
+ * <code>LIBMTP_Handle_Events_Timeout_Completed()</code>, so a gallery
+ * can fill itself from the event loop of the application.
+ * Thumbnails that are in the thumbnail cache are handed out without
+ * asking the device, the ones before the first that has to be asked
+ * for already from within this call.
+ *
+ * Only one non-blocking operation at a time can be underway on a
+ * device, and no other calls on the device may be made until the
+ * final callback has been called. This works with libusb-1.0 only,
+ * and not on devices opened with
+ * <code>LIBMTP_Open_Raw_Device_Worker()</code>.
+ *
+ * @param device a pointer to the device to get the thumbnails from.
+ * @param ids the object IDs to retrieve the thumbnails of, they are
+ *        copied.
+ * @param n the number of object IDs.
+ * @param thumb_cb called once for each object ID, in order.
+ * @param cb called when the batch is over, with 0 if all thumbnails
+ *        were retrieved or the number of those that were not.
+ * @param user_data arbitrary user data passed to both callbacks.
+ * @return 0 on success, any other value means that the batch was not
+ *         started and the callbacks will not be called.
+ * @see LIBMTP_Get_Pollfds()
+ */
+int LIBMTP_Get_Thumbnails_Nonblocking(LIBMTP_mtpdevice_t *device,
+				      uint32_t const * const ids,
+				      unsigned int const n,
+				      LIBMTP_thumbnail_cb_fn thumb_cb,
+				      LIBMTP_nonblocking_cb_fn cb,
+				      void *user_data)
+{
+  PTPParams *params = (PTPParams *) device->params;
+  thumbnail_batch_t *tb;
+
+  if (params->transaction_async_func == NULL) {
+    add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
+			    "LIBMTP_Get_Thumbnails_Nonblocking(): "
+			    "device has no non-blocking transactions.");
+    return -1;
+  }
+  tb = (thumbnail_batch_t *) calloc(1, sizeof(thumbnail_batch_t));
+  if (tb != NULL)
+    tb->ids = (uint32_t *) malloc(n ? n * sizeof(uint32_t) : 1);
+  if (tb == NULL || tb->ids == NULL) {
+    free(tb);
+    add_error_to_errorstack(device, LIBMTP_ERROR_MEMORY_ALLOCATION,
+			    "LIBMTP_Get_Thumbnails_Nonblocking(): "
+			    "out of memory.");
+    return -1;
+  }
+  memcpy(tb->ids, ids, n * sizeof(uint32_t));
+  tb->n = n;
+  tb->device = device;
+  tb->thumb_cb = thumb_cb;
+  tb->cb = cb;
+  tb->user_data = user_data;
+  tb->handler.getfunc = NULL;
+  tb->handler.putfunc = thumbnail_batch_put;
+  tb->handler.getbuffunc = NULL;
+  tb->handler.priv = tb;
+  if (!thumbnail_batch_step(tb))
+    thumbnail_batch_end(tb);
+  return 0;
+}
+
+/**
+ * Retrieve the thumbnail for a file. It comes from the thumbnail cache
+ * when it is there, see <code>LIBMTP_Set_Thumbnail_Cache_Size()</code>.
  * @param device a pointer to the device to get the thumbnail from.
  * @param id the object ID of the file to retrieve the thumbnail for.
  * @return 0 on success, any other value means failure.
@@ -9084,13 +16871,53 @@ int LIBMTP_Get_Thumbnail(LIBMTP_mtpdevice_t *device, uint32_t const id,
   PTPParams *params = (PTPParams *) device->params;
   uint16_t ret;
 
+  *data = lookup_thumbnail(device, id, size);
+  if (*data != NULL)
+    return 0;
   ret = ptp_getthumb(params, id, data, size);
-  if (ret == PTP_RC_OK)
+  if (ret == PTP_RC_OK) {
+      store_thumbnail(device, id, *data, *size);
       return 0;
+  }
   return -1;
 }
 
 
+/**
+ * Internal function to clamp a partial object read of
+ * <code>maxbytes</code> at <code>offset</code> so that it does not
+ * run past the end of the object or trip up the device.
+ * @param params the PTP parameters of the device.
+ * @param offset where the read starts, less than the file size.
+ * @param maxbytes how much the caller asked for.
+ * @param filesize the size of the object.
+ * @return how much to ask the device for.
+ */
+static uint32_t partial_object_length(PTPParams *params, uint64_t const offset,
+				      uint32_t maxbytes, uint64_t const filesize)
+{
+  if (offset + maxbytes > filesize) {
+    maxbytes = filesize - offset;
+  }
+
+  /* The MTP stack of Samsung Galaxy devices has a mysterious bug in
+   * GetPartialObject. When GetPartialObject is invoked to read the
+   * last bytes of a file and the amount of data to read is such that
+   * the last USB packet sent in the reply matches exactly the USB 2.0
+   * packet size, then the Samsung Galaxy device hangs, resulting in a
+   * timeout error.
+   * As a workaround, we read one less byte instead of reaching the
+   * end of the file, forcing the caller to perform an additional read
+   * to get the last byte (i.e. the final read that would fail is
+   * replaced with two partial reads that succeed).
+   */
+  if ((params->device_flags & DEVICE_FLAG_SAMSUNG_OFFSET_BUG) &&
+      (maxbytes % PTP_USB_BULK_HS_MAX_PACKET_LEN_READ) == (PTP_USB_BULK_HS_MAX_PACKET_LEN_READ - PTP_USB_BULK_HDR_LEN)) {
+    maxbytes--;
+  }
+  return maxbytes;
+}
+
 int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
                             uint64_t offset, uint32_t maxbytes,
                             unsigned char **data, unsigned int *size)
@@ -9112,29 +16939,11 @@ int LIBMTP_GetPartialObject(LIBMTP_mtpdevice_t *device, uint32_t const id,
     LIBMTP_destroy_file_t (mtpfile);
     return 0;
   }
-  if (offset + maxbytes > mtpfile->filesize) {
-    maxbytes = mtpfile->filesize - offset;
-  }
+  maxbytes = partial_object_length(params, offset, maxbytes, mtpfile->filesize);
 
   /* do not need it anymore */
   LIBMTP_destroy_file_t (mtpfile);
 
-  /* The MTP stack of Samsung Galaxy devices has a mysterious bug in
-   * GetPartialObject. When GetPartialObject is invoked to read the
-   * last bytes of a file and the amount of data to read is such that
-   * the last USB packet sent in the reply matches exactly the USB 2.0
-   * packet size, then the Samsung Galaxy device hangs, resulting in a
-   * timeout error.
-   * As a workaround, we read one less byte instead of reaching the
-   * end of the file, forcing the caller to perform an additional read
-   * to get the last byte (i.e. the final read that would fail is
-   * replaced with two partial reads that succeed).
-   */
-  if ((params->device_flags & DEVICE_FLAG_SAMSUNG_OFFSET_BUG) &&
-      (maxbytes % PTP_USB_BULK_HS_MAX_PACKET_LEN_READ) == (PTP_USB_BULK_HS_MAX_PACKET_LEN_READ - PTP_USB_BULK_HDR_LEN)) {
-    maxbytes--;
-  }
-
   if (!ptp_operation_issupported(params, PTP_OC_ANDROID_GetPartialObject64)) {
     if  (!ptp_operation_issupported(params, PTP_OC_GetPartialObject)) {
       add_error_to_errorstack(device, LIBMTP_ERROR_GENERAL,
@@ -9263,14 +17072,6 @@ int LIBMTP_Update_Album(LIBMTP_mtpdevice_t *device,
 			      metadata->no_tracks);
 }
 
-/**
- * Dummy function needed to interface to upstream
- * ptp.c/ptp.h files.
- */
-void ptp_nikon_getptpipguid (unsigned char* guid) {
-  return;
-}
-
 /**
  * Add an object to cache.
  * @param device the device which may have a cache to which the object should be added.
@@ -590,6 +590,23 @@ int LIBMTP_Check_Specific_Device(int busno, int devno)
   return 0;
 }
 
+/**
+ * Hotplug needs libusb 1.0, see
+ * <code>LIBMTP_Register_Hotplug_Callback()</code> in libusb1-glue.c.
+ */
+LIBMTP_error_number_t LIBMTP_Register_Hotplug_Callback(LIBMTP_hotplug_cb_fn cb,
+						      void *user_data,
+						      int *handle)
+{
+  /* Unsupported */
+  return LIBMTP_ERROR_USB_LAYER;
+}
+
+void LIBMTP_Deregister_Hotplug_Callback(int handle)
+{
+  /* Unsupported */
+}
+
 /**
  * Detect the raw MTP device descriptors and return a list of
  * of the devices found.
@@ -813,6 +830,21 @@ libusb_glue_error (PTPParams *params, const char *format, ...)
 #define CONTEXT_BLOCK_SIZE_2  0x200
 #define CONTEXT_BLOCK_SIZE    CONTEXT_BLOCK_SIZE_1+CONTEXT_BLOCK_SIZE_2
 
+/* Counts a bulk transfer on the data endpoints in the device statistics. */
+static void
+ptp_usb_count_bulk (PTP_USB *ptp_usb, int const in, unsigned long bytes)
+{
+  PTPParams *params = ptp_usb->params;
+
+  if (params == NULL)
+    return;
+  params->stats.bulk_transfers++;
+  if (in)
+    params->stats.bytes_in += bytes;
+  else
+    params->stats.bytes_out += bytes;
+}
+
 static short
 ptp_read_func (
 	unsigned long size, PTPDataHandler *handler,void *data,
@@ -889,6 +921,7 @@ ptp_read_func (
     if (result < 0) {
       return PTP_ERROR_IO;
     }
+    ptp_usb_count_bulk(ptp_usb, 1, result);
 
     LIBMTP_USB_DEBUG("<==USB IN\n");
     if (result == 0)
@@ -1002,6 +1035,7 @@ ptp_write_func (
 	    if (result < 0) {
 	      return PTP_ERROR_IO;
 	    }
+	    ptp_usb_count_bulk(ptp_usb, 0, result);
 	    // check for result == 0 perhaps too.
 	    // Increase counters
 	    ptp_usb->current_transfer_complete += result;
@@ -1082,8 +1116,23 @@ memory_putfunc(PTPParams* params, void* private,
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
 
 	if (priv->curoff + sendlen > priv->size) {
-		priv->data = realloc (priv->data, priv->curoff+sendlen);
-		priv->size = priv->curoff + sendlen;
+		unsigned long newsize = priv->size * 2;
+		unsigned char *newdata;
+
+		if (newsize < priv->curoff + sendlen)
+			newsize = priv->curoff + sendlen;
+		/* Allocate the whole data phase at once if we know its length
+		 * and it is what the caller expects */
+		if (params && params->data_phase_length > newsize &&
+		    params->data_phase_length <= ULONG_MAX &&
+		    (params->data_phase_expected == 0 ||
+		     params->data_phase_length == params->data_phase_expected))
+			newsize = params->data_phase_length;
+		newdata = realloc (priv->data, newsize);
+		if (!newdata)
+			return PTP_RC_GeneralError;
+		priv->data = newdata;
+		priv->size = newsize;
 	}
 	memcpy (priv->data + priv->curoff, data, sendlen);
 	priv->curoff += sendlen;
@@ -1098,6 +1147,7 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler) {
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = NULL;
 	priv->size = 0;
 	priv->curoff = 0;
@@ -1118,6 +1168,7 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = data;
 	priv->size = len;
 	priv->curoff = 0;
@@ -1140,7 +1191,7 @@ ptp_exit_recv_memory_handler (PTPDataHandler *handler,
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)handler->priv;
 	*data = priv->data;
-	*size = priv->size;
+	*size = priv->curoff;
 	free (priv);
 	return PTP_RC_OK;
 }
@@ -1294,6 +1345,21 @@ static uint16_t ptp_usb_getpacket(PTPParams *params,
 	return ret;
 }
 
+/*
+ * Tell the data handler how long the data phase announced by the
+ * container header is, so it can allocate it in one go.
+ */
+static void
+ptp_usb_announce_data_length(PTPParams *params, PTPUSBBulkContainer *usbdata)
+{
+	uint32_t length = dtoh32(usbdata->length);
+
+	if (length > PTP_USB_BULK_HDR_LEN && length != 0xffffffff)
+		params->data_phase_length = length - PTP_USB_BULK_HDR_LEN;
+	else
+		params->data_phase_length = 0;
+}
+
 uint16_t
 ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 {
@@ -1342,10 +1408,12 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 		}
 		if (rlen == ptp_usb->inep_maxpacket) {
 		  /* Copy first part of data to 'data' */
+		  ptp_usb_announce_data_length(params, &usbdata);
 		  putfunc_ret =
 		    handler->putfunc(
 				     params, handler->priv, rlen - PTP_USB_BULK_HDR_LEN, usbdata.payload.data
 				     );
+		  params->data_phase_length = 0;
 		  if (putfunc_ret != PTP_RC_OK)
 		    return putfunc_ret;
 
@@ -1415,11 +1483,13 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 			params->split_header_data = 1;
 
 		/* Copy first part of data to 'data' */
+		ptp_usb_announce_data_length(params, &usbdata);
 		putfunc_ret =
 		  handler->putfunc(
 				   params, handler->priv, rlen - PTP_USB_BULK_HDR_LEN,
 				   usbdata.payload.data
 				   );
+		params->data_phase_length = 0;
 		if (putfunc_ret != PTP_RC_OK)
 		  return putfunc_ret;
 
@@ -1630,11 +1700,40 @@ ptp_usb_event_async (PTPParams* params, PTPEventCbFn cb, void *user_data) {
 	return PTP_ERROR_CANCEL;
 }
 
+uint16_t
+ptp_usb_event_listen_start (PTPParams *params) {
+	/* Unsupported */
+	return PTP_RC_OperationNotSupported;
+}
+
+void
+ptp_usb_event_listen_stop (PTPParams *params) {
+	/* Unsupported */
+}
+
+int
+ptp_usb_event_listen_get (PTPParams *params, PTPContainer *event, unsigned int *lost) {
+	/* Unsupported */
+	return -1;
+}
+
 int LIBMTP_Handle_Events_Timeout_Completed(struct timeval *tv, int *completed) {
 	/* Unsupported */
 	return -12;
 }
 
+int LIBMTP_Get_Pollfds(LIBMTP_pollfd_t **fds, int *numfds) {
+	/* Unsupported */
+	*fds = NULL;
+	*numfds = 0;
+	return -1;
+}
+
+int LIBMTP_Get_Next_Timeout(struct timeval *tv) {
+	/* Unsupported */
+	return -1;
+}
+
 uint16_t
 ptp_usb_control_cancel_request (PTPParams *params, uint32_t transactionid) {
 	PTP_USB *ptp_usb = (PTP_USB *)(params->data);
@@ -1952,11 +2051,14 @@ static int find_interface_and_endpoints(struct usb_device *dev,
  * This function assigns params and usbinfo given a raw device
  * as input.
  * @param device the device to be assigned.
+ * @param private_context ignored, this backend has no per-device
+ *        state to keep apart.
  * @param usbinfo a pointer to the new usbinfo.
  * @return an error code.
  */
 LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 					   PTPParams *params,
+					   int const private_context,
 					   void **usbinfo)
 {
   PTP_USB *ptp_usb;
@@ -2029,6 +2131,9 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
   /* Copy USB version number */
   ptp_usb->bcdusb = libusb_device->descriptor.bcdUSB;
 
+  /* This backend has no pipelining, see set_usb_device_transfer_queue() */
+  set_usb_device_transfer_queue(ptp_usb, 1, CONTEXT_BLOCK_SIZE);
+
   /* Attempt to initialize this device */
   if (init_ptp_usb(params, ptp_usb, libusb_device) < 0) {
     LIBMTP_ERROR("LIBMTP PANIC: Unable to initialize device\n");
@@ -2096,6 +2201,24 @@ void get_usb_device_timeout(PTP_USB *ptp_usb, int *timeout)
   *timeout = ptp_usb->timeout;
 }
 
+/*
+ * Bulk transfers are done synchronously in CONTEXT_BLOCK_SIZE blocks
+ * by this backend, so the transfer queue cannot be tuned here.
+ */
+void set_usb_device_transfer_queue(PTP_USB *ptp_usb, int depth,
+				   unsigned long blocksize)
+{
+  ptp_usb->transfer_queue_depth = 1;
+  ptp_usb->transfer_block_size = CONTEXT_BLOCK_SIZE;
+}
+
+void get_usb_device_transfer_queue(PTP_USB *ptp_usb, int *depth,
+				   unsigned long *blocksize)
+{
+  *depth = ptp_usb->transfer_queue_depth;
+  *blocksize = ptp_usb->transfer_block_size;
+}
+
 int guess_usb_speed(PTP_USB *ptp_usb)
 {
   int bytes_per_second;
@@ -83,7 +83,13 @@ typedef struct _PTP_USB PTP_USB;
 struct _PTP_USB {
   PTPParams *params;
 #ifdef HAVE_LIBUSB1
+  /** Context of this device only, or NULL for the default context */
+  libusb_context* context;
   libusb_device_handle* handle;
+  /** Non-blocking transaction underway, if any */
+  struct ptp_usb_async *async;
+  /** Persistent listener on the interrupt endpoint, if started */
+  struct ptp_usb_event_listener *listener;
 #endif
 #ifdef HAVE_LIBUSB0
   usb_dev_handle* handle;
@@ -102,13 +108,29 @@ struct _PTP_USB {
   /** File transfer callbacks and counters */
   int callback_active;
   int timeout;
+  /** Timeout policy, see LIBMTP_Set_Timeout_Policy() */
+  int long_timeout;
+  int stall_timeout;
+  int cancel_timeout;
+  uint32_t min_throughput;
+  /** Measured throughput of the larger data phases, bytes per second */
+  uint64_t throughput;
   uint16_t bcdusb;
   uint64_t current_transfer_total;
   uint64_t current_transfer_complete;
   LIBMTP_progressfunc_t current_transfer_callback;
   void const * current_transfer_callback_data;
+  /** Bulk transfer pipelining: transfers kept in flight and their size */
+  int transfer_queue_depth;
+  unsigned long transfer_block_size;
+  /** Send from mapped files / pinned buffers without copying */
+  int zerocopy_send;
   /** Any special device flags, only used internally */
   LIBMTP_raw_device_t rawdevice;
+  /** Simulated device serving the transport instead of the bus, or NULL */
+  void *simulation;
+  /** Reached over PTP/IP instead of the bus */
+  int ptpip;
 };
 
 void dump_usbinfo(PTP_USB *ptp_usb);
@@ -116,9 +138,14 @@ const char *get_playlist_extension(PTP_USB *ptp_usb);
 void close_device(PTP_USB *ptp_usb, PTPParams *params);
 LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 					   PTPParams *params,
+					   int const private_context,
 					   void **usbinfo);
 void set_usb_device_timeout(PTP_USB *ptp_usb, int timeout);
 void get_usb_device_timeout(PTP_USB *ptp_usb, int *timeout);
+void set_usb_device_transfer_queue(PTP_USB *ptp_usb, int depth,
+				   unsigned long blocksize);
+void get_usb_device_transfer_queue(PTP_USB *ptp_usb, int *depth,
+				   unsigned long *blocksize);
 int guess_usb_speed(PTP_USB *ptp_usb);
 
 /* Flag check macros */
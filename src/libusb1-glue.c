@@ -41,6 +41,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 #include "ptp-pack.c"
 
@@ -55,6 +59,10 @@
 #define USB_START_TIMEOUT 5000
 #define USB_TIMEOUT_DEFAULT     20000
 #define USB_TIMEOUT_LONG        60000
+/* How long the data of a cancelled read may take to drain, like windows */
+#define USB_CANCEL_TIMEOUT      300
+/* Data phases shorter than this tell latency rather than throughput */
+#define USB_THROUGHPUT_SAMPLE   (1024 * 1024)
 static inline int get_timeout(PTP_USB* ptp_usb)
 {
   if (FLAG_LONG_TIMEOUT(ptp_usb)) {
@@ -84,6 +92,32 @@ struct ptp_event_cb_data {
   PTPParams *params;
 };
 
+/*
+ * Interrupt transfers kept submitted by the event listener, so that
+ * the device can send the next event while one is handled, and the
+ * number of events it queues for the reader.
+ */
+#define PTP_USB_EVENT_TRANSFERS	4
+#define PTP_USB_EVENT_RING	64
+
+struct ptp_usb_event_entry {
+  PTPContainer event;
+  unsigned int lost; /**< If not 0, a gap of this many dropped events */
+};
+
+struct ptp_usb_event_listener {
+  PTPParams *params;
+  struct libusb_transfer *transfers[PTP_USB_EVENT_TRANSFERS];
+  PTPUSBEventContainer buffers[PTP_USB_EVENT_TRANSFERS];
+  int submitted; /**< Transfers that libusb still has */
+  int stopping;
+  uint16_t status; /**< Why the listener ended, PTP_RC_OK while it runs */
+  /** Ring of events, the last slot is kept for a gap */
+  struct ptp_usb_event_entry ring[PTP_USB_EVENT_RING];
+  unsigned int first;
+  unsigned int count;
+};
+
 static const LIBMTP_device_entry_t mtp_device_table[] = {
 /* We include an .h file which is shared between us and libgphoto2 */
 #include "music-players.h"
@@ -91,6 +125,103 @@ static const LIBMTP_device_entry_t mtp_device_table[] = {
 static const int mtp_device_table_size =
   sizeof(mtp_device_table) / sizeof(LIBMTP_device_entry_t);
 
+/*
+ * Hash index into mtp_device_table by VID/PID, built by init_usb().
+ * The slots hold the table index + 1, so that 0 is an empty slot.
+ */
+static unsigned int *device_hash = NULL;
+static unsigned int device_hash_bits = 0;
+
+/*
+ * Results of probe_device_descriptor() on devices that are not in
+ * mtp_device_table, so that each one is only opened once while it
+ * stays plugged in. The key includes the device address, which
+ * changes whenever the device is enumerated again.
+ */
+#define PROBE_CACHE_MAX_PORTS 7
+typedef struct probe_cache_struct probe_cache_t;
+struct probe_cache_struct {
+  uint8_t bus;
+  uint8_t address;
+  uint8_t ports[PROBE_CACHE_MAX_PORTS];
+  int nports;
+  uint16_t vendor_id;
+  uint16_t product_id;
+  int is_mtp;
+  int seen; /**< Found on the bus since the last expire_probe_cache() */
+  probe_cache_t *next;
+};
+static probe_cache_t *probe_cache = NULL;
+
+/*
+ * A hotplug registration. libusb calls back from inside its event
+ * handling where probing the device is not allowed, so the events are
+ * queued there and delivered by run_hotplug_events().
+ */
+typedef struct hotplug_device_struct hotplug_device_t;
+struct hotplug_device_struct {
+  libusb_device *device; /**< Holds a reference */
+  LIBMTP_hotplug_event_t event;
+  LIBMTP_raw_device_t rawdevice; /**< Only for reported devices */
+  hotplug_device_t *next;
+};
+typedef struct hotplug_struct hotplug_t;
+struct hotplug_struct {
+  int handle;
+  LIBMTP_hotplug_cb_fn cb;
+  void *user_data;
+  hotplug_device_t *pending; /**< Events not delivered yet, oldest first */
+  hotplug_device_t *present; /**< MTP devices reported as arrived */
+  hotplug_t *next;
+};
+static hotplug_t *hotplugs = NULL;
+
+/*
+ * The lists above are used from every thread that detects or opens
+ * devices, and the pending hotplug events from inside libusb's event
+ * handling, which may be running a transfer of another thread.
+ */
+#define GLUE_LOCK_PROBE_CACHE 0
+#define GLUE_LOCK_HOTPLUG_QUEUE 1 /**< The pending events only */
+#define GLUE_LOCK_HOTPLUGS 2 /**< The registrations and their devices */
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t probe_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t hotplug_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+// Recursive, a hotplug callback may register another one
+static pthread_mutex_t hotplugs_lock;
+static pthread_once_t hotplugs_lock_once = PTHREAD_ONCE_INIT;
+
+static void init_hotplugs_lock(void)
+{
+  pthread_mutexattr_t attr;
+
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&hotplugs_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+}
+#endif
+
+static void lock_glue(int const which, int const lock)
+{
+#ifdef HAVE_PTHREAD_H
+  pthread_mutex_t *mutex;
+
+  if (which == GLUE_LOCK_PROBE_CACHE) {
+    mutex = &probe_cache_lock;
+  } else if (which == GLUE_LOCK_HOTPLUG_QUEUE) {
+    mutex = &hotplug_queue_lock;
+  } else {
+    pthread_once(&hotplugs_lock_once, init_hotplugs_lock);
+    mutex = &hotplugs_lock;
+  }
+  if (lock)
+    pthread_mutex_lock(mutex);
+  else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
 // Local functions
 static LIBMTP_error_number_t init_usb();
 static void close_usb(PTP_USB* ptp_usb);
@@ -112,8 +243,12 @@ static short ptp_read_func (unsigned long,
 		PTPDataHandler*, void *data, unsigned long*, int);
 static short ptp_read_cancel_func (PTPParams* params,
 		uint32_t transactionid);
+static uint16_t ptp_usb_recover (PTPParams* params, uint16_t error);
 static int usb_get_endpoint_status(PTP_USB* ptp_usb,
 		int ep, uint16_t* status);
+static unsigned long default_block_size(PTP_USB *ptp_usb,
+		libusb_device *dev);
+static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile);
 
 /**
  * Get a list of the supported USB devices.
@@ -142,6 +277,164 @@ int LIBMTP_Get_Supported_Devices_List(LIBMTP_device_entry_t ** const devices,
 }
 
 
+static unsigned int device_hash_slot(uint16_t const vendor_id,
+				     uint16_t const product_id)
+{
+  uint32_t const key = ((uint32_t) vendor_id << 16) | product_id;
+
+  // Multiplicative hashing, the top bits are the best mixed
+  return (key * 2654435761U) >> (32 - device_hash_bits);
+}
+
+/**
+ * Builds the VID/PID index of mtp_device_table. Should this fail,
+ * find_device_entry() falls back to scanning the table.
+ */
+static void build_device_hash(void)
+{
+  unsigned int size;
+  unsigned int mask;
+  int i;
+
+  device_hash_bits = 1;
+  while ((1U << device_hash_bits) < 2 * (unsigned int) mtp_device_table_size)
+    device_hash_bits++;
+  size = 1U << device_hash_bits;
+  mask = size - 1;
+  device_hash = (unsigned int *) calloc(size, sizeof(unsigned int));
+  if (device_hash == NULL)
+    return;
+  for (i = 0; i < mtp_device_table_size; i++) {
+    unsigned int slot = device_hash_slot(mtp_device_table[i].vendor_id,
+					 mtp_device_table[i].product_id);
+
+    // Open addressing; for duplicate entries the first one wins
+    while (device_hash[slot] != 0) {
+      LIBMTP_device_entry_t const *entry =
+	&mtp_device_table[device_hash[slot] - 1];
+
+      if (entry->vendor_id == mtp_device_table[i].vendor_id &&
+	  entry->product_id == mtp_device_table[i].product_id)
+	break;
+      slot = (slot + 1) & mask;
+    }
+    if (device_hash[slot] == 0)
+      device_hash[slot] = i + 1;
+  }
+}
+
+/**
+ * Looks a device up in the table of known devices.
+ * @param vendor_id the USB vendor ID of the device.
+ * @param product_id the USB product ID of the device.
+ * @return the entry for the device or NULL if it is not known.
+ */
+static LIBMTP_device_entry_t const *find_device_entry(uint16_t const vendor_id,
+						      uint16_t const product_id)
+{
+  unsigned int slot;
+  int i;
+
+  if (device_hash == NULL) {
+    for (i = 0; i < mtp_device_table_size; i++) {
+      if (mtp_device_table[i].vendor_id == vendor_id &&
+	  mtp_device_table[i].product_id == product_id)
+	return &mtp_device_table[i];
+    }
+    return NULL;
+  }
+  slot = device_hash_slot(vendor_id, product_id);
+  while (device_hash[slot] != 0) {
+    LIBMTP_device_entry_t const *entry = &mtp_device_table[device_hash[slot] - 1];
+
+    if (entry->vendor_id == vendor_id && entry->product_id == product_id)
+      return entry;
+    slot = (slot + 1) & ((1U << device_hash_bits) - 1);
+  }
+  return NULL;
+}
+
+/**
+ * probe_device_descriptor() for detection, remembering the result for
+ * as long as the device stays on the same port with the same address.
+ * Only definite results are remembered, a device that could not be
+ * opened for instance is probed again the next time.
+ * @param dev a device struct from libusb.
+ * @param desc the device descriptor of dev.
+ * @return 1 if the device is MTP compliant, 0 if not.
+ */
+static int probe_device_descriptor_cached(libusb_device *dev,
+					  struct libusb_device_descriptor *desc)
+{
+  probe_cache_t key;
+  probe_cache_t *entry;
+
+  memset(&key, 0, sizeof(key));
+  key.bus = libusb_get_bus_number(dev);
+  key.address = libusb_get_device_address(dev);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+  key.nports = libusb_get_port_numbers(dev, key.ports, PROBE_CACHE_MAX_PORTS);
+  if (key.nports < 0)
+    key.nports = 0;
+#endif
+  key.vendor_id = desc->idVendor;
+  key.product_id = desc->idProduct;
+
+  // Held while probing, so that a device is not opened twice at once
+  lock_glue(GLUE_LOCK_PROBE_CACHE, 1);
+  for (entry = probe_cache; entry != NULL; entry = entry->next) {
+    if (entry->bus == key.bus &&
+	entry->address == key.address &&
+	entry->nports == key.nports &&
+	!memcmp(entry->ports, key.ports, key.nports) &&
+	entry->vendor_id == key.vendor_id &&
+	entry->product_id == key.product_id) {
+      entry->seen = 1;
+      key.is_mtp = entry->is_mtp;
+      lock_glue(GLUE_LOCK_PROBE_CACHE, 0);
+      return key.is_mtp;
+    }
+  }
+
+  key.is_mtp = probe_device_descriptor(dev, NULL);
+  if (key.is_mtp < 0) {
+    lock_glue(GLUE_LOCK_PROBE_CACHE, 0);
+    return 0;
+  }
+  entry = (probe_cache_t *) malloc(sizeof(probe_cache_t));
+  if (entry != NULL) {
+    memcpy(entry, &key, sizeof(probe_cache_t));
+    entry->seen = 1;
+    entry->next = probe_cache;
+    probe_cache = entry;
+  }
+  lock_glue(GLUE_LOCK_PROBE_CACHE, 0);
+  return key.is_mtp;
+}
+
+/**
+ * Forgets the probe results of devices that were not found on the
+ * bus since the last call, i.e. that have been unplugged.
+ */
+static void expire_probe_cache(void)
+{
+  probe_cache_t **prev = &probe_cache;
+
+  lock_glue(GLUE_LOCK_PROBE_CACHE, 1);
+  while (*prev != NULL) {
+    probe_cache_t *entry = *prev;
+
+    if (!entry->seen) {
+      *prev = entry->next;
+      free(entry);
+    } else {
+      entry->seen = 0;
+      prev = &entry->next;
+    }
+  }
+  lock_glue(GLUE_LOCK_PROBE_CACHE, 0);
+}
+
 static LIBMTP_error_number_t init_usb()
 {
   static int libusb1_initialized = 0;
@@ -159,12 +452,23 @@ static LIBMTP_error_number_t init_usb()
   }
 
   libusb1_initialized = 1;
+  build_device_hash();
 
   if ((LIBMTP_debug & LIBMTP_DEBUG_USB) != 0)
     libusb_set_debug(NULL,9);
   return LIBMTP_ERROR_NONE;
 }
 
+/**
+ * Releases a context made by configure_usb_device() for a single
+ * device. NULL stands for the shared default context, which is kept.
+ */
+static void exit_usb_context(libusb_context *context)
+{
+  if (context != NULL)
+    libusb_exit(context);
+}
+
 /**
  * Small recursive function to append a new usb_device to the linked
  * list of USB MTP devices
@@ -232,7 +536,8 @@ static void free_mtpdevice_list(mtpdevice_list_t *devlist)
  * @param dev a device struct from libusb.
  * @param dumpfile set to non-NULL to make the descriptors dump out
  *        to this file in human-readable hex so we can scruitinze them.
- * @return 1 if the device is MTP compliant, 0 if not.
+ * @return 1 if the device is MTP compliant, 0 if not, -1 if that could
+ *         not be told, e.g. because the device could not be opened.
  */
 static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile)
 {
@@ -242,10 +547,12 @@ static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile)
   int ret;
   /* This is to indicate if we find some vendor interface */
   int found_vendor_spec_interface = 0;
+  /* Set if some configuration could not be read */
+  int incomplete = 0;
   struct libusb_device_descriptor desc;
 
   ret = libusb_get_device_descriptor (dev, &desc);
-  if (ret != LIBUSB_SUCCESS) return 0;
+  if (ret != LIBUSB_SUCCESS) return -1;
   /*
    * Don't examine devices that are not likely to
    * contain any MTP interface, update this the day
@@ -269,8 +576,8 @@ static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile)
    */
   ret = libusb_open(dev, &devh);
   if (ret != LIBUSB_SUCCESS) {
-    /* Could not open this device */
-    return 0;
+    /* Could not open this device, maybe busy or no permission yet */
+    return -1;
   }
 
   /*
@@ -286,6 +593,7 @@ static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile)
      ret = libusb_get_config_descriptor (dev, i, &config);
      if (ret != LIBUSB_SUCCESS) {
        LIBMTP_INFO("configdescriptor %d get failed with ret %d in probe_device_descriptor yet dev->descriptor.bNumConfigurations > 0\n", i, ret);
+       incomplete = 1;
        continue;
      }
 
@@ -390,13 +698,13 @@ static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile)
     /*
      * If something failed we're probably stalled to we need
      * to clear the stall off the endpoint and say this is not
-     * MTP.
+     * MTP. Only a stall is an answer though.
      */
     if (ret < 0) {
       /* EP0 is the default control endpoint */
       libusb_clear_halt (devh, 0);
       libusb_close(devh);
-      return 0;
+      return ret == LIBUSB_ERROR_PIPE ? 0 : -1;
     }
 
     // Dump it, if requested
@@ -440,7 +748,7 @@ static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile)
       /* TODO: If there was an error, flag it and let the user know somehow */
       /* if(ret == -1) {} */
       libusb_close(devh);
-      return 0;
+      return (ret < 0 && ret != LIBUSB_ERROR_PIPE) ? -1 : 0;
     }
 
     /* Check if device is MTP or if it is something like a USB Mass Storage
@@ -496,7 +804,7 @@ static int probe_device_descriptor(libusb_device *dev, FILE *dumpfile)
 
   /* Close the USB device handle */
   libusb_close(devh);
-  return 0;
+  return incomplete ? -1 : 0;
 }
 
 /**
@@ -532,26 +840,17 @@ static LIBMTP_error_number_t get_mtp_usb_device_list(mtpdevice_list_t ** mtp_dev
       if (ret != LIBUSB_SUCCESS) continue;
 
       if (desc.bDeviceClass != LIBUSB_CLASS_HUB) {
-	int i;
-        int found = 0;
-
 	// First check if we know about the device already.
 	// Devices well known to us will not have their descriptors
 	// probed, it caused problems with some devices.
-        for(i = 0; i < mtp_device_table_size; i++) {
-          if(desc.idVendor == mtp_device_table[i].vendor_id &&
-            desc.idProduct == mtp_device_table[i].product_id) {
-            /* Append this usb device to the MTP device list */
-            *mtp_device_list = append_to_mtpdevice_list(*mtp_device_list,
-							dev,
-							libusb_get_bus_number(dev));
-            found = 1;
-            break;
-          }
-        }
-	// If we didn't know it, try probing the "OS Descriptor".
-        if (!found) {
-          if (probe_device_descriptor(dev, NULL)) {
+        if (find_device_entry(desc.idVendor, desc.idProduct) != NULL) {
+          /* Append this usb device to the MTP device list */
+          *mtp_device_list = append_to_mtpdevice_list(*mtp_device_list,
+						      dev,
+						      libusb_get_bus_number(dev));
+        } else {
+	  // If we didn't know it, try probing the "OS Descriptor".
+          if (probe_device_descriptor_cached(dev, &desc)) {
             /* Append this usb device to the MTP USB Device List */
             *mtp_device_list = append_to_mtpdevice_list(*mtp_device_list,
 							dev,
@@ -573,6 +872,7 @@ static LIBMTP_error_number_t get_mtp_usb_device_list(mtpdevice_list_t ** mtp_dev
       }
     }
     libusb_free_device_list (devs, 0);
+    expire_probe_cache();
 
   /* If nothing was found we end up here. */
   if(*mtp_device_list == NULL) {
@@ -594,6 +894,7 @@ int LIBMTP_Check_Specific_Device(int busno, int devno)
   ssize_t nrofdevs;
   libusb_device **devs = NULL;
   int i;
+  int ret = 0;
   LIBMTP_error_number_t init_usb_ret;
 
   init_usb_ret = init_usb();
@@ -602,14 +903,63 @@ int LIBMTP_Check_Specific_Device(int busno, int devno)
 
   nrofdevs = libusb_get_device_list (NULL, &devs);
   for (i = 0; i < nrofdevs ; i++ ) {
+    struct libusb_device_descriptor desc;
+
     if (libusb_get_bus_number(devs[i]) != busno)
 	continue;
     if (libusb_get_device_address(devs[i]) != devno)
 	continue;
-    if (probe_device_descriptor(devs[i], NULL))
-	return 1;
+    if (libusb_get_device_descriptor(devs[i], &desc) != LIBUSB_SUCCESS)
+	continue;
+    if (probe_device_descriptor_cached(devs[i], &desc)) {
+	ret = 1;
+	break;
+    }
   }
-  return 0;
+  libusb_free_device_list (devs, 0);
+  return ret;
+}
+
+/**
+ * Fills in a raw device from a libusb device that has been found
+ * to be an MTP device.
+ * @param rawdevice the raw device to fill in.
+ * @param dev the libusb device.
+ * @param index the number of the device in the log messages.
+ */
+static void fill_raw_device(LIBMTP_raw_device_t *rawdevice,
+			    libusb_device *dev, int const index)
+{
+  LIBMTP_device_entry_t const *entry;
+  struct libusb_device_descriptor desc;
+
+  libusb_get_device_descriptor (dev, &desc);
+  // Assign default device info
+  rawdevice->device_entry.vendor = NULL;
+  rawdevice->device_entry.vendor_id = desc.idVendor;
+  rawdevice->device_entry.product = NULL;
+  rawdevice->device_entry.product_id = desc.idProduct;
+  rawdevice->device_entry.device_flags = 0x00000000U;
+  // See if we can locate some additional vendor info and device flags
+  entry = find_device_entry(desc.idVendor, desc.idProduct);
+  if (entry != NULL) {
+    rawdevice->device_entry.vendor = entry->vendor;
+    rawdevice->device_entry.product = entry->product;
+    rawdevice->device_entry.device_flags = entry->device_flags;
+
+    // This device is known to the developers
+    LIBMTP_INFO("Device %d (VID=%04x and PID=%04x) is a %s %s.\n",
+		index,
+		desc.idVendor,
+		desc.idProduct,
+		entry->vendor,
+		entry->product);
+  } else {
+    device_unknown(index, desc.idVendor, desc.idProduct);
+  }
+  // Save the location on the bus
+  rawdevice->bus_location = libusb_get_bus_number (dev);
+  rawdevice->devnum = libusb_get_device_address (dev);
 }
 
 /**
@@ -635,7 +985,7 @@ LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices,
   LIBMTP_error_number_t ret;
   LIBMTP_raw_device_t *retdevs;
   int devs = 0;
-  int i, j;
+  int i;
 
   ret = get_mtp_usb_device_list(&devlist);
   if (ret == LIBMTP_ERROR_NO_DEVICE_ATTACHED) {
@@ -670,41 +1020,7 @@ LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices,
   dev = devlist;
   i = 0;
   while (dev != NULL) {
-    int device_known = 0;
-    struct libusb_device_descriptor desc;
-
-    libusb_get_device_descriptor (dev->device, &desc);
-    // Assign default device info
-    retdevs[i].device_entry.vendor = NULL;
-    retdevs[i].device_entry.vendor_id = desc.idVendor;
-    retdevs[i].device_entry.product = NULL;
-    retdevs[i].device_entry.product_id = desc.idProduct;
-    retdevs[i].device_entry.device_flags = 0x00000000U;
-    // See if we can locate some additional vendor info and device flags
-    for(j = 0; j < mtp_device_table_size; j++) {
-      if(desc.idVendor == mtp_device_table[j].vendor_id &&
-	 desc.idProduct == mtp_device_table[j].product_id) {
-	device_known = 1;
-	retdevs[i].device_entry.vendor = mtp_device_table[j].vendor;
-	retdevs[i].device_entry.product = mtp_device_table[j].product;
-	retdevs[i].device_entry.device_flags = mtp_device_table[j].device_flags;
-
-	// This device is known to the developers
-	LIBMTP_INFO("Device %d (VID=%04x and PID=%04x) is a %s %s.\n",
-		i,
-		desc.idVendor,
-		desc.idProduct,
-		mtp_device_table[j].vendor,
-		mtp_device_table[j].product);
-	break;
-      }
-    }
-    if (!device_known) {
-      device_unknown(i, desc.idVendor, desc.idProduct);
-    }
-    // Save the location on the bus
-    retdevs[i].bus_location = libusb_get_bus_number (dev->device);
-    retdevs[i].devnum = libusb_get_device_address (dev->device);
+    fill_raw_device(&retdevs[i], dev->device, i);
     i++;
     dev = dev->next;
   }
@@ -714,6 +1030,225 @@ LIBMTP_error_number_t LIBMTP_Detect_Raw_Devices(LIBMTP_raw_device_t ** devices,
   return LIBMTP_ERROR_NONE;
 }
 
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+static int hotplug_callback(libusb_context *context, libusb_device *dev,
+			    libusb_hotplug_event event, void *user_data)
+{
+  hotplug_t *hotplug = (hotplug_t *) user_data;
+  hotplug_device_t *queued;
+  hotplug_device_t **last;
+
+  queued = (hotplug_device_t *) malloc(sizeof(hotplug_device_t));
+  if (queued == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: out of memory for a hotplug event\n");
+    return 0;
+  }
+  memset(queued, 0, sizeof(hotplug_device_t));
+  queued->device = libusb_ref_device(dev);
+  queued->event = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) ?
+    LIBMTP_HOTPLUG_DEVICE_ARRIVED : LIBMTP_HOTPLUG_DEVICE_LEFT;
+  lock_glue(GLUE_LOCK_HOTPLUG_QUEUE, 1);
+  last = &hotplug->pending;
+  while (*last != NULL)
+    last = &(*last)->next;
+  *last = queued;
+  lock_glue(GLUE_LOCK_HOTPLUG_QUEUE, 0);
+  return 0;
+}
+#endif
+
+/**
+ * Handles one queued hotplug event: arriving devices are checked the
+ * same way as by LIBMTP_Detect_Raw_Devices() and only MTP devices are
+ * reported, as is their leaving.
+ */
+static void run_hotplug_event(hotplug_t *hotplug, hotplug_device_t *queued)
+{
+  hotplug_device_t **prev;
+  struct libusb_device_descriptor desc;
+  int count = 0;
+
+  if (queued->event == LIBMTP_HOTPLUG_DEVICE_LEFT) {
+    for (prev = &hotplug->present; *prev != NULL; prev = &(*prev)->next) {
+      hotplug_device_t *present = *prev;
+
+      if (present->device == queued->device) {
+	*prev = present->next;
+	hotplug->cb(LIBMTP_HOTPLUG_DEVICE_LEFT, &present->rawdevice,
+		    hotplug->user_data);
+	libusb_unref_device(present->device);
+	free(present);
+	break;
+      }
+    }
+    libusb_unref_device(queued->device);
+    free(queued);
+    return;
+  }
+
+  if (libusb_get_device_descriptor(queued->device, &desc) != LIBUSB_SUCCESS ||
+      desc.bDeviceClass == LIBUSB_CLASS_HUB ||
+      (find_device_entry(desc.idVendor, desc.idProduct) == NULL &&
+       !probe_device_descriptor_cached(queued->device, &desc))) {
+    libusb_unref_device(queued->device);
+    free(queued);
+    return;
+  }
+  for (prev = &hotplug->present; *prev != NULL; prev = &(*prev)->next)
+    count++;
+  fill_raw_device(&queued->rawdevice, queued->device, count);
+  queued->next = NULL;
+  *prev = queued;
+  hotplug->cb(LIBMTP_HOTPLUG_DEVICE_ARRIVED, &queued->rawdevice,
+	      hotplug->user_data);
+}
+
+/**
+ * Delivers the hotplug events queued since the last call. The queue
+ * is only locked to take an event off it, libusb may be waiting to
+ * add one while the device is probed.
+ */
+static void run_hotplug_events(void)
+{
+  hotplug_t *hotplug;
+
+  lock_glue(GLUE_LOCK_HOTPLUGS, 1);
+  for (hotplug = hotplugs; hotplug != NULL; hotplug = hotplug->next) {
+    while (1) {
+      hotplug_device_t *queued;
+
+      lock_glue(GLUE_LOCK_HOTPLUG_QUEUE, 1);
+      queued = hotplug->pending;
+      if (queued != NULL)
+	hotplug->pending = queued->next;
+      lock_glue(GLUE_LOCK_HOTPLUG_QUEUE, 0);
+      if (queued == NULL)
+	break;
+      run_hotplug_event(hotplug, queued);
+    }
+  }
+  lock_glue(GLUE_LOCK_HOTPLUGS, 0);
+}
+
+static void free_hotplug_devices(hotplug_device_t *list)
+{
+  while (list != NULL) {
+    hotplug_device_t *tmp = list;
+
+    list = list->next;
+    libusb_unref_device(tmp->device);
+    free(tmp);
+  }
+}
+
+/**
+ * This registers a function to be called when MTP devices are plugged
+ * in or removed, as an alternative to polling
+ * <code>LIBMTP_Detect_Raw_Devices()</code>. Only arriving devices are
+ * examined, so the cost does not grow with the number of devices on
+ * the bus.
+ *
+ * The devices already present are reported as arrived before this
+ * returns. Later events are reported from inside
+ * <code>LIBMTP_Handle_Events_Timeout_Completed()</code>, which has to
+ * be called regularly for this. A device is reported as having left
+ * only if it was reported as arrived. The raw device passed to the
+ * callback is only valid during the call, copy it if it is to be
+ * opened later.
+ *
+ * @param cb the function to call for each event.
+ * @param user_data passed on to the callback.
+ * @param handle will hold a handle for
+ *        <code>LIBMTP_Deregister_Hotplug_Callback()</code>.
+ * @return 0 on success, LIBMTP_ERROR_USB_LAYER if the USB library or
+ *         the platform does not support hotplug, any other value
+ *         means failure.
+ */
+LIBMTP_error_number_t LIBMTP_Register_Hotplug_Callback(LIBMTP_hotplug_cb_fn cb,
+						      void *user_data,
+						      int *handle)
+{
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+  LIBMTP_error_number_t init_usb_ret;
+  libusb_hotplug_callback_handle libusb_handle;
+  hotplug_t *hotplug;
+
+  init_usb_ret = init_usb();
+  if (init_usb_ret != LIBMTP_ERROR_NONE)
+    return init_usb_ret;
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+    LIBMTP_ERROR("LIBMTP_Register_Hotplug_Callback(): "
+		 "hotplug is not supported on this platform\n");
+    return LIBMTP_ERROR_USB_LAYER;
+  }
+  hotplug = (hotplug_t *) malloc(sizeof(hotplug_t));
+  if (hotplug == NULL)
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  memset(hotplug, 0, sizeof(hotplug_t));
+  hotplug->cb = cb;
+  hotplug->user_data = user_data;
+  if (libusb_hotplug_register_callback(NULL,
+				       LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+				       LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+				       LIBUSB_HOTPLUG_ENUMERATE,
+				       LIBUSB_HOTPLUG_MATCH_ANY,
+				       LIBUSB_HOTPLUG_MATCH_ANY,
+				       LIBUSB_HOTPLUG_MATCH_ANY,
+				       hotplug_callback, hotplug,
+				       &libusb_handle) != LIBUSB_SUCCESS) {
+    LIBMTP_ERROR("LIBMTP_Register_Hotplug_Callback(): "
+		 "could not register with libusb\n");
+    free_hotplug_devices(hotplug->pending);
+    free(hotplug);
+    return LIBMTP_ERROR_USB_LAYER;
+  }
+  hotplug->handle = libusb_handle;
+  lock_glue(GLUE_LOCK_HOTPLUGS, 1);
+  hotplug->next = hotplugs;
+  hotplugs = hotplug;
+  lock_glue(GLUE_LOCK_HOTPLUGS, 0);
+  *handle = libusb_handle;
+  // Report the devices that were already plugged in
+  run_hotplug_events();
+  return LIBMTP_ERROR_NONE;
+#else
+  LIBMTP_ERROR("LIBMTP_Register_Hotplug_Callback(): "
+	       "libusb is too old for hotplug\n");
+  return LIBMTP_ERROR_USB_LAYER;
+#endif
+}
+
+/**
+ * This stops the calls to a function registered with
+ * <code>LIBMTP_Register_Hotplug_Callback()</code>. No leave events
+ * are reported for the devices still plugged in. This must not be
+ * called from inside the callback itself.
+ * @param handle the handle from the registration.
+ */
+void LIBMTP_Deregister_Hotplug_Callback(int handle)
+{
+  hotplug_t **prev;
+
+  lock_glue(GLUE_LOCK_HOTPLUGS, 1);
+  for (prev = &hotplugs; *prev != NULL; prev = &(*prev)->next) {
+    hotplug_t *hotplug = *prev;
+
+    if (hotplug->handle == handle) {
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+      libusb_hotplug_deregister_callback(NULL, handle);
+#endif
+      *prev = hotplug->next;
+      lock_glue(GLUE_LOCK_HOTPLUG_QUEUE, 1);
+      free_hotplug_devices(hotplug->pending);
+      lock_glue(GLUE_LOCK_HOTPLUG_QUEUE, 0);
+      free_hotplug_devices(hotplug->present);
+      free(hotplug);
+      break;
+    }
+  }
+  lock_glue(GLUE_LOCK_HOTPLUGS, 0);
+}
+
 /**
  * This routine just dumps out low-level
  * USB information about the current device.
@@ -831,6 +1366,535 @@ libusb_glue_error (PTPParams *params, const char *format, ...)
 #define CONTEXT_BLOCK_SIZE_1	0x3e00
 #define CONTEXT_BLOCK_SIZE_2  0x200
 #define CONTEXT_BLOCK_SIZE    CONTEXT_BLOCK_SIZE_1+CONTEXT_BLOCK_SIZE_2
+
+/*
+ * Large transfers are pipelined: up to transfer_queue_depth bulk
+ * transfers of transfer_block_size bytes each are kept submitted so
+ * that the bus does not idle while we hand a finished block to the
+ * data handler. Transfers are always retired in submission order from
+ * the calling thread, so handler callbacks and the progress callback
+ * are never invoked from inside libusb.
+ */
+#define USB_TRANSFER_QUEUE_DEPTH	4
+#define USB_TRANSFER_QUEUE_MAX		64
+
+/*
+ * Default transfer block sizes by the speed the device is connected
+ * at. Full speed devices keep CONTEXT_BLOCK_SIZE, faster buses move a
+ * lot more per transfer before the per-transfer overhead stops
+ * mattering.
+ */
+#define USB_HIGH_SPEED_BLOCK_SIZE	0x40000
+#define USB_SUPER_SPEED_BLOCK_SIZE	0x100000
+
+/*
+ * Devices that need a block size other than the speed default, for
+ * example firmware that cannot take large transfers. This is kept apart
+ * from music-players.h, since that is shared with libgphoto2 and its
+ * entries have a fixed layout.
+ */
+static const struct {
+  uint16_t vendor_id;
+  uint16_t product_id;
+  unsigned long blocksize;
+} mtp_block_size_table[] = {
+  { 0x0000, 0x0000, 0 }
+};
+
+/* libusb_dev_mem_alloc() appeared in libusb 1.0.21 */
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+#define HAVE_LIBUSB_DEV_MEM 1
+#endif
+
+struct ptp_usb_xfer {
+  struct libusb_transfer *transfer;
+  unsigned char *buffer;
+  unsigned long buflen;
+  int pinned;
+  unsigned long length;
+  int terminator;
+  int submitted;
+  int completed;
+};
+
+static void
+ptp_usb_xfer_cb (struct libusb_transfer *t)
+{
+  struct ptp_usb_xfer *xfer = (struct ptp_usb_xfer *) t->user_data;
+
+  xfer->completed = 1;
+}
+
+static void
+ptp_usb_xfer_ring_free (PTP_USB *ptp_usb, struct ptp_usb_xfer *ring, int depth)
+{
+  int i;
+
+  for (i = 0; i < depth; i++) {
+    if (ring[i].transfer != NULL)
+      libusb_free_transfer(ring[i].transfer);
+#ifdef HAVE_LIBUSB_DEV_MEM
+    if (ring[i].pinned) {
+      libusb_dev_mem_free(ptp_usb->handle, ring[i].buffer, ring[i].buflen);
+      continue;
+    }
+#endif
+    free(ring[i].buffer);
+  }
+  free(ring);
+}
+
+static struct ptp_usb_xfer *
+ptp_usb_xfer_ring_alloc (int depth)
+{
+  struct ptp_usb_xfer *ring;
+  int i;
+
+  ring = calloc(depth, sizeof(struct ptp_usb_xfer));
+  if (ring == NULL)
+    return NULL;
+  for (i = 0; i < depth; i++) {
+    ring[i].transfer = libusb_alloc_transfer(0);
+    if (ring[i].transfer == NULL) {
+      ptp_usb_xfer_ring_free(NULL, ring, depth);
+      return NULL;
+    }
+  }
+  return ring;
+}
+
+/*
+ * Where the next transfer of a slot goes: straight into (or out of)
+ * the handler's own memory if it offers that, else the slot's bounce
+ * buffer, which is only allocated when first needed. With pinned set
+ * the bounce buffer comes from the kernel's DMA-able memory if it can
+ * provide that, so usbfs does not have to copy it either.
+ */
+static unsigned char *
+ptp_usb_xfer_buffer (PTP_USB *ptp_usb, struct ptp_usb_xfer *xfer,
+		     PTPDataHandler *handler, unsigned long ahead,
+		     unsigned long len, unsigned long bufsize, int pinned)
+{
+  unsigned char *direct = NULL;
+
+  if (handler && handler->getbuffunc)
+    direct = handler->getbuffunc(NULL, handler->priv, ahead, len);
+  if (direct)
+    return direct;
+  if (xfer->buffer != NULL)
+    return xfer->buffer;
+#ifdef HAVE_LIBUSB_DEV_MEM
+  if (pinned) {
+    xfer->buffer = libusb_dev_mem_alloc(ptp_usb->handle, bufsize);
+    if (xfer->buffer != NULL) {
+      xfer->buflen = bufsize;
+      xfer->pinned = 1;
+      return xfer->buffer;
+    }
+  }
+#endif
+  xfer->buffer = malloc(bufsize);
+  xfer->buflen = bufsize;
+  return xfer->buffer;
+}
+
+/* Drive libusb until this particular transfer has called back */
+static void
+ptp_usb_xfer_wait (PTP_USB *ptp_usb, struct ptp_usb_xfer *xfer)
+{
+  while (!xfer->completed) {
+    int ret = libusb_handle_events_completed(ptp_usb->context,
+					     &xfer->completed);
+
+    if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+      LIBMTP_ERROR("LIBMTP error handling USB events: %d\n", ret);
+  }
+  xfer->submitted = 0;
+}
+
+/* Cancel everything still in flight and wait for it to be given back */
+static void
+ptp_usb_xfer_cancel (PTP_USB *ptp_usb, struct ptp_usb_xfer *ring, int depth)
+{
+  int i;
+
+  for (i = 0; i < depth; i++)
+    if (ring[i].submitted && !ring[i].completed)
+      libusb_cancel_transfer(ring[i].transfer);
+  for (i = 0; i < depth; i++)
+    if (ring[i].submitted)
+      ptp_usb_xfer_wait(ptp_usb, &ring[i]);
+}
+
+static uint16_t
+ptp_usb_xfer_status (struct libusb_transfer *t)
+{
+  switch (t->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    return PTP_RC_OK;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    return PTP_ERROR_TIMEOUT;
+  default:
+    return PTP_ERROR_IO;
+  }
+}
+
+/*
+ * The block size used for bulk transfers on this device. The iRiver
+ * block alternation below is defined in terms of CONTEXT_BLOCK_SIZE,
+ * so those devices always use that.
+ */
+static unsigned long
+ptp_usb_block_size (PTP_USB *ptp_usb)
+{
+  uint16_t vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+
+  if (vendor_id == 0x4102 || vendor_id == 0x1006 ||
+      ptp_usb->transfer_block_size == 0)
+    return CONTEXT_BLOCK_SIZE;
+  return ptp_usb->transfer_block_size;
+}
+
+/*
+ * Size of the next bulk read given the bytes remaining, the offset
+ * into the read and the size of the previous read. Sets *terminator
+ * if we asked for one extra byte to avoid a zero read.
+ */
+static unsigned long
+ptp_read_block_size (PTP_USB *ptp_usb, unsigned long remaining,
+		     unsigned long offset, unsigned long prev,
+		     unsigned long blocksize, int readzero,
+		     int *terminator)
+{
+  uint16_t ptp_dev_vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+  unsigned long context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
+  unsigned long context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
+  unsigned long toread;
+
+  *terminator = 0;
+  // check equal to condition here
+  if (remaining < blocksize) {
+    // this is the last packet
+    toread = remaining;
+    // this is equivalent to zero read for these devices
+    if (readzero && FLAG_NO_ZERO_READS(ptp_usb) && (toread % ptp_usb->inep_maxpacket) == 0) {
+      toread += 1;
+      *terminator = 1;
+    }
+    return toread;
+  }
+  if (ptp_dev_vendor_id == 0x4102 || ptp_dev_vendor_id == 0x1006) {
+    //"iRiver" device special handling
+    if (ptp_usb->inep_maxpacket == 0x400) {
+      context_block_size_1 = CONTEXT_BLOCK_SIZE_1 - 0x200;
+      context_block_size_2 = CONTEXT_BLOCK_SIZE_2 + 0x200;
+    }
+    if (offset == 0)
+      // we are first packet, but not last packet
+      return context_block_size_1;
+    else if (prev == context_block_size_1)
+      return context_block_size_2;
+    else if (prev == context_block_size_2)
+      return context_block_size_1;
+    LIBMTP_INFO("unexpected toread size 0x%04x, 0x%04x remaining bytes\n",
+		(unsigned int) prev, (unsigned int) remaining);
+    return prev;
+  }
+  return blocksize;
+}
+
+/*
+ * Account for bytes that went over the bus and call the progress
+ * callback, which may ask us to cancel.
+ */
+static short
+ptp_usb_progress (PTP_USB *ptp_usb, unsigned long bytes)
+{
+  int ret;
+
+  // Increase counters, call callback
+  if (ptp_usb->callback_active) {
+    ptp_usb->current_transfer_complete += bytes;
+    if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+      // send last update and disable callback.
+      ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
+      ptp_usb->callback_active = 0;
+    }
+    if (ptp_usb->current_transfer_callback != NULL) {
+      ret = ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
+                                               ptp_usb->current_transfer_total,
+                                               ptp_usb->current_transfer_callback_data);
+      if (ret != 0)
+        return PTP_ERROR_CANCEL;
+    }
+  }
+  return PTP_RC_OK;
+}
+
+/*
+ * Hand a block that was read in to the data handler and update the
+ * progress counters.
+ */
+static short
+ptp_read_deliver (PTP_USB *ptp_usb, PTPDataHandler *handler,
+		  unsigned char *bytes, unsigned long xread)
+{
+  if (handler) {
+    uint16_t handler_ret = handler->putfunc(NULL, handler->priv, xread, bytes);
+    if (handler_ret != PTP_RC_OK) {
+      LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
+                   "Not enough memory or temp/destination free space?");
+      return PTP_ERROR_CANCEL;
+    }
+  }
+
+  if (ptp_usb_progress(ptp_usb, xread) != PTP_RC_OK) {
+    LIBMTP_USB_DEBUG("ptp_read_func cancelled by user callback\n");
+    return PTP_ERROR_CANCEL;
+  }
+  return PTP_RC_OK;
+}
+
+/* Counts a bulk transfer on the data endpoints in the device statistics. */
+static void
+ptp_usb_count_bulk (PTP_USB *ptp_usb, int const in, unsigned long bytes)
+{
+  PTPParams *params = ptp_usb->params;
+
+  if (params == NULL)
+    return;
+  ptp_lock(params, PTP_LOCK_STATS);
+  params->stats.bulk_transfers++;
+  if (in)
+    params->stats.bytes_in += bytes;
+  else
+    params->stats.bytes_out += bytes;
+  ptp_lock(params, PTP_UNLOCK_STATS);
+}
+
+static uint64_t
+ptp_usb_time_us (void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * Fold a data phase of some bytes that took from start until now into
+ * the measured throughput that the transfer timeouts go by.
+ */
+static void
+ptp_usb_note_throughput (PTP_USB *ptp_usb, unsigned long bytes,
+			 uint64_t start)
+{
+  uint64_t usecs = ptp_usb_time_us() - start;
+  uint64_t rate;
+
+  if (bytes < USB_THROUGHPUT_SAMPLE || usecs == 0)
+    return;
+  rate = (uint64_t) bytes * 1000000 / usecs;
+  if (ptp_usb->throughput == 0)
+    ptp_usb->throughput = rate;
+  else
+    ptp_usb->throughput = (ptp_usb->throughput * 3 + rate) / 4;
+}
+
+/*
+ * The timeout of a bulk transfer of len bytes that carries on a data
+ * phase: the device has started already, so it gets the stall timeout
+ * plus the time the transfer takes at the lowest throughput we expect,
+ * which is a quarter of the measured one if that is higher than the
+ * floor of the policy. Never more than the timeout of a request, and
+ * just that when the policy has no stall timeout.
+ */
+static int
+ptp_usb_transfer_timeout (PTP_USB *ptp_usb, unsigned long len)
+{
+  uint64_t rate = ptp_usb->min_throughput;
+  uint64_t timeout;
+
+  if (ptp_usb->stall_timeout <= 0)
+    return ptp_usb->timeout;
+  if (ptp_usb->throughput / 4 > rate)
+    rate = ptp_usb->throughput / 4;
+  if (rate == 0)
+    return ptp_usb->timeout;
+  timeout = ptp_usb->stall_timeout + (uint64_t) len * 1000 / rate;
+  if (timeout > (uint64_t) ptp_usb->timeout)
+    return ptp_usb->timeout;
+  return (int) timeout;
+}
+
+/* there might be a zero packet waiting for us... */
+static void
+ptp_read_zero_packet (PTP_USB *ptp_usb, unsigned long curread, int readzero)
+{
+  unsigned char temp;
+  int zeroresult = 0, xread;
+
+  if (!readzero ||
+      FLAG_NO_ZERO_READS(ptp_usb) ||
+      curread % ptp_usb->inep_maxpacket != 0)
+    return;
+
+  LIBMTP_USB_DEBUG("<==USB IN\n");
+  LIBMTP_USB_DEBUG("Zero Read\n");
+
+  zeroresult = USB_BULK_READ(ptp_usb->handle,
+                             ptp_usb->inep,
+                             &temp,
+                             0,
+                             &xread,
+                             ptp_usb->timeout);
+  ptp_usb_count_bulk(ptp_usb, 1, 0);
+  if (zeroresult != LIBUSB_SUCCESS)
+    LIBMTP_INFO("LIBMTP panic: unable to read in zero packet, response 0x%04x", zeroresult);
+}
+
+/*
+ * Anything the device sent after a short read belongs to the next
+ * phase (the response) and is kept for ptp_usb_getpacket().
+ */
+static int
+ptp_read_stash_surplus (PTP_USB *ptp_usb, unsigned char *bytes,
+			unsigned long len)
+{
+  PTPParams *params = ptp_usb->params;
+  uint8_t *packet;
+
+  if (len == 0)
+    return 0;
+  if (params->response_packet_size + len > sizeof(PTPUSBBulkContainer)) {
+    LIBMTP_INFO("LIBMTP discarding %lu bytes of surplus data after short read\n", len);
+    return 0;
+  }
+  packet = realloc(params->response_packet, params->response_packet_size + len);
+  if (packet == NULL)
+    return 0;
+  memcpy(packet + params->response_packet_size, bytes, len);
+  params->response_packet = packet;
+  params->response_packet_size += len;
+  return 1;
+}
+
+/*
+ * The pipelined version of ptp_read_func(), see above.
+ */
+static short
+ptp_read_func_async (
+	unsigned long size, PTPDataHandler *handler, PTP_USB *ptp_usb,
+	unsigned long *readbytes,
+	int readzero,
+	unsigned long blocksize
+) {
+  struct ptp_usb_xfer *ring;
+  int depth = ptp_usb->transfer_queue_depth;
+  int head = 0;
+  int inflight = 0;
+  int shortread = 0;
+  int stashed = 0;
+  unsigned long submitted = 0;
+  unsigned long toread = 0;
+  unsigned long curread = 0;
+  short ret = PTP_RC_OK;
+  int i;
+
+  ring = ptp_usb_xfer_ring_alloc(depth);
+  if (ring == NULL)
+    return PTP_ERROR_IO;
+
+  while (1) {
+    struct ptp_usb_xfer *xfer;
+    unsigned char *buffer;
+    unsigned long xread;
+
+    // Keep the queue full
+    while (!shortread && inflight < depth && submitted < size) {
+      xfer = &ring[(head + inflight) % depth];
+      toread = ptp_read_block_size(ptp_usb, size - submitted, submitted,
+				   toread, blocksize, readzero,
+				   &xfer->terminator);
+      LIBMTP_USB_DEBUG("Queueing read of 0x%04lx bytes\n", toread);
+      // The last block may carry one extra terminator byte
+      buffer = ptp_usb_xfer_buffer(ptp_usb, xfer, handler,
+				   submitted - curread, toread,
+				   blocksize + 1, 0);
+      if (buffer == NULL) {
+	ret = PTP_ERROR_IO;
+	break;
+      }
+      libusb_fill_bulk_transfer(xfer->transfer, ptp_usb->handle,
+				ptp_usb->inep, buffer, toread,
+				ptp_usb_xfer_cb, xfer,
+				ptp_usb_transfer_timeout(ptp_usb, toread));
+      xfer->length = toread;
+      xfer->completed = 0;
+      if (libusb_submit_transfer(xfer->transfer) != LIBUSB_SUCCESS) {
+	ret = PTP_ERROR_IO;
+	break;
+      }
+      xfer->submitted = 1;
+      inflight++;
+      submitted += toread - xfer->terminator;
+    }
+    if (ret != PTP_RC_OK || inflight == 0)
+      break;
+
+    xfer = &ring[head];
+    ptp_usb_xfer_wait(ptp_usb, xfer);
+    head = (head + 1) % depth;
+    inflight--;
+
+    ret = ptp_usb_xfer_status(xfer->transfer);
+    if (ret != PTP_RC_OK)
+      break;
+    xread = xfer->transfer->actual_length;
+    ptp_usb_count_bulk(ptp_usb, 1, xread);
+
+    LIBMTP_USB_DEBUG("<==USB IN\n");
+    if (xread == 0)
+      LIBMTP_USB_DEBUG("Zero Read\n");
+    else
+      LIBMTP_USB_DATA(xfer->transfer->buffer, xread, 16);
+
+    if (xread < xfer->length) /* short reads are common */
+      shortread = 1;
+    // want to discard extra byte
+    if (xfer->terminator && xread == xfer->length) {
+      LIBMTP_USB_DEBUG("<==USB IN\nDiscarding extra byte\n");
+      xread--;
+    }
+
+    ret = ptp_read_deliver(ptp_usb, handler, xfer->transfer->buffer, xread);
+    if (ret != PTP_RC_OK)
+      break;
+    curread += xread;
+  }
+
+  if (inflight > 0) {
+    ptp_usb_xfer_cancel(ptp_usb, ring, depth);
+    if (ret == PTP_RC_OK) {
+      // Pick up whatever arrived behind the short read, in order
+      for (i = 0; i < inflight; i++) {
+	struct ptp_usb_xfer *xfer = &ring[(head + i) % depth];
+	stashed |= ptp_read_stash_surplus(ptp_usb, xfer->transfer->buffer,
+					  xfer->transfer->actual_length);
+      }
+    }
+  }
+  ptp_usb_xfer_ring_free(ptp_usb, ring, depth);
+  if (ret != PTP_RC_OK)
+    return ret;
+
+  if (readbytes)
+    *readbytes = curread;
+  if (!stashed)
+    ptp_read_zero_packet(ptp_usb, curread, readzero);
+  return PTP_RC_OK;
+}
+
 static short
 ptp_read_func (
 	unsigned long size, PTPDataHandler *handler,void *data,
@@ -840,83 +1904,70 @@ ptp_read_func (
   PTP_USB *ptp_usb = (PTP_USB *)data;
   unsigned long toread = 0;
   int ret = 0;
-  uint16_t handler_ret = 0;
   int xread;
   unsigned long curread = 0;
-  unsigned char *bytes;
+  unsigned char *bytes = NULL;
+  unsigned char *dest;
   int expect_terminator_byte = 0;
-  unsigned long usb_inep_maxpacket_size;
-  unsigned long context_block_size_1;
-  unsigned long context_block_size_2;
-  uint16_t ptp_dev_vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
-
-  //"iRiver" device special handling
-  if (ptp_dev_vendor_id == 0x4102 || ptp_dev_vendor_id == 0x1006) {
-	  usb_inep_maxpacket_size = ptp_usb->inep_maxpacket;
-	  if (usb_inep_maxpacket_size == 0x400) {
-		  context_block_size_1 = CONTEXT_BLOCK_SIZE_1 - 0x200;
-		  context_block_size_2 = CONTEXT_BLOCK_SIZE_2 + 0x200;
-	  }
-	  else {
-		  context_block_size_1 = CONTEXT_BLOCK_SIZE_1;
-		  context_block_size_2 = CONTEXT_BLOCK_SIZE_2;
-	  }
+  unsigned long blocksize = ptp_usb_block_size(ptp_usb);
+  uint64_t start = ptp_usb_time_us();
+  // A single packet may be the first the device sends at all
+  int stream = size > (unsigned long) ptp_usb->inep_maxpacket;
+
+  if (ptp_usb->transfer_queue_depth > 1 && size > blocksize) {
+    ret = ptp_read_func_async(size, handler, ptp_usb, readbytes,
+			      readzero, blocksize);
+    if (ret == PTP_RC_OK && readbytes)
+      ptp_usb_note_throughput(ptp_usb, *readbytes, start);
+    return ret;
   }
-  // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
+
   while (curread < size) {
     LIBMTP_USB_DEBUG("Remaining size to read: 0x%04lx bytes\n", size - curread);
 
-    // check equal to condition here
-    if (size - curread < CONTEXT_BLOCK_SIZE)
-    {
-      // this is the last packet
-      toread = size - curread;
-      // this is equivalent to zero read for these devices
-      if (readzero && FLAG_NO_ZERO_READS(ptp_usb) && (toread % ptp_usb->inep_maxpacket) == 0) {
-        toread += 1;
-        expect_terminator_byte = 1;
-      }
-    }
-    else if (ptp_dev_vendor_id == 0x4102 || ptp_dev_vendor_id == 0x1006) {
-	    //"iRiver" device special handling
-	    if (curread == 0)
-		    // we are first packet, but not last packet
-		    toread = context_block_size_1;
-	    else if (toread == context_block_size_1)
-		    toread = context_block_size_2;
-	    else if (toread == context_block_size_2)
-		    toread = context_block_size_1;
-	    else
-		    LIBMTP_INFO("unexpected toread size 0x%04x, 0x%04x remaining bytes\n",
-				(unsigned int) toread, (unsigned int) (size-curread));
-    }
-    else
-	    toread = CONTEXT_BLOCK_SIZE;
+    toread = ptp_read_block_size(ptp_usb, size - curread, curread, toread,
+				 blocksize, readzero, &expect_terminator_byte);
 
     LIBMTP_USB_DEBUG("Reading in 0x%04lx bytes\n", toread);
 
+    // Read straight into the destination if the handler allows it
+    dest = NULL;
+    if (handler && handler->getbuffunc)
+      dest = handler->getbuffunc(NULL, handler->priv, 0, toread);
+    if (dest == NULL) {
+      // This is the largest block we'll need to read in.
+      if (bytes == NULL)
+        bytes = malloc(blocksize + 1);
+      if (bytes == NULL)
+        return PTP_ERROR_IO;
+      dest = bytes;
+    }
+
     ret = USB_BULK_READ(ptp_usb->handle,
                         ptp_usb->inep,
-                        bytes,
+                        dest,
                         toread,
                         &xread,
+                        stream ? ptp_usb_transfer_timeout(ptp_usb, toread) :
                         ptp_usb->timeout);
 
     LIBMTP_USB_DEBUG("Result of read: 0x%04x (%d bytes)\n", ret, xread);
 
     if (ret == LIBUSB_ERROR_TIMEOUT) {
+      free (bytes);
       return PTP_ERROR_TIMEOUT;
     }
     else if (ret != LIBUSB_SUCCESS){
+      free (bytes);
       return PTP_ERROR_IO;
     }
+    ptp_usb_count_bulk(ptp_usb, 1, xread);
 
     LIBMTP_USB_DEBUG("<==USB IN\n");
     if (xread == 0)
       LIBMTP_USB_DEBUG("Zero Read\n");
     else
-      LIBMTP_USB_DATA(bytes, xread, 16);
+      LIBMTP_USB_DATA(dest, xread, 16);
 
     // want to discard extra byte
     if (expect_terminator_byte && xread == toread)
@@ -925,39 +1976,13 @@ ptp_read_func (
       xread--;
     }
 
-    if (handler) {
-        handler_ret = handler->putfunc(NULL, handler->priv, xread, bytes);
-        if (handler_ret != PTP_RC_OK) {
-            LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler."
-                         "Not enough memory or temp/destination free space?");
-            free (bytes);
-            return PTP_ERROR_CANCEL;
-        }
+    ret = ptp_read_deliver(ptp_usb, handler, dest, xread);
+    if (ret != PTP_RC_OK) {
+      free (bytes);
+      return ret;
     }
-
-    if (ptp_usb->callback_active)
-        ptp_usb->current_transfer_complete += xread;
     curread += xread;
 
-    // Increase counters, call callback
-    if (ptp_usb->callback_active) {
-      if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
-        // send last update and disable callback.
-        ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
-        ptp_usb->callback_active = 0;
-      }
-      if (ptp_usb->current_transfer_callback != NULL) {
-        ret = ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
-                                                 ptp_usb->current_transfer_total,
-                                                 ptp_usb->current_transfer_callback_data);
-        if (ret != 0) {
-          LIBMTP_USB_DEBUG("ptp_read_func cancelled by user callback\n");
-          free (bytes);
-          return PTP_ERROR_CANCEL;
-        }
-      }
-    }
-
     if (xread < toread) /* short reads are common */
       break;
   }
@@ -966,25 +1991,8 @@ ptp_read_func (
     *readbytes = curread;
   free (bytes);
 
-  // there might be a zero packet waiting for us...
-  if (readzero &&
-    !FLAG_NO_ZERO_READS(ptp_usb) &&
-    curread % ptp_usb->inep_maxpacket == 0) {
-    unsigned char temp;
-    int zeroresult = 0, xread;
-
-    LIBMTP_USB_DEBUG("<==USB IN\n");
-    LIBMTP_USB_DEBUG("Zero Read\n");
-
-    zeroresult = USB_BULK_READ(ptp_usb->handle,
-                               ptp_usb->inep,
-                               &temp,
-                               0,
-                               &xread,
-                               ptp_usb->timeout);
-    if (zeroresult != LIBUSB_SUCCESS)
-      LIBMTP_INFO("LIBMTP panic: unable to read in zero packet, response 0x%04x", zeroresult);
-  }
+  ptp_read_zero_packet(ptp_usb, curread, readzero);
+  ptp_usb_note_throughput(ptp_usb, curread, start);
 
   return PTP_RC_OK;
 }
@@ -993,7 +2001,8 @@ ptp_read_func (
  * When cancelling a read from device.
  * The device can take time to really stop sending in data, so we have to
  * read and discard it.
- * Stop when we encounter a timeout (so no more data in after 300ms).
+ * Stop when we encounter a timeout (so no more data in after the cancel
+ * timeout of the policy, 300ms unless told otherwise).
  * Corner case: Lets imagine that the cancel will arrive just for the last bytes
  * of a file, and so that the transfer would still complete. The current code
  * will also discard the "reply status" frame. That makes sense because from
@@ -1017,7 +2026,8 @@ ptp_read_cancel_func (
 
   ptp_usb->callback_active = 0;
   /* Set a timeout similar to the one of windows in such a case: 300ms */
-  set_usb_device_timeout(ptp_usb, 300);
+  set_usb_device_timeout(ptp_usb, ptp_usb->cancel_timeout > 0 ?
+			 ptp_usb->cancel_timeout : USB_CANCEL_TIMEOUT);
 
   params->cancelreq_func(params, transactionid);
 
@@ -1049,7 +2059,186 @@ ptp_read_cancel_func (
   set_usb_device_timeout(ptp_usb, oldtimeout);
 
 
-  return PTP_ERROR_CANCEL;
+  return PTP_ERROR_CANCEL;
+}
+
+/*
+ * Get back in step with the device after a transaction failed on the
+ * bus, before ptp_transaction_new() retries it: the transaction is
+ * cancelled like a read, whatever the device still sends for it is
+ * dropped and stalls are cleared. A device that is gone can not be
+ * recovered, so the retries stop right away.
+ */
+static uint16_t
+ptp_usb_recover (PTPParams* params, uint16_t error)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  uint16_t status;
+
+  if (usb_get_endpoint_status(ptp_usb, ptp_usb->inep, &status) ==
+      LIBUSB_ERROR_NO_DEVICE) {
+    libusb_glue_error(params, "ptp_usb_recover: the device is gone");
+    return PTP_ERROR_IO;
+  }
+  libusb_glue_debug(params, "ptp_usb_recover: recovering from error 0x%04x",
+		    error);
+  ptp_read_cancel_func(params, params->transaction_id - 1);
+  clear_stall(ptp_usb);
+  // Whatever was buffered belongs to the failed transaction
+  free(params->response_packet);
+  params->response_packet = NULL;
+  params->response_packet_size = 0;
+  return PTP_RC_OK;
+}
+
+/*
+ * Write the trailing zero-length packet if this was the last transfer
+ * and it ended on a packet boundary.
+ */
+static int
+ptp_write_zero_packet (PTP_USB *ptp_usb, unsigned long towrite)
+{
+  int xwritten;
+  int ret;
+
+  if (ptp_usb->current_transfer_complete < ptp_usb->current_transfer_total ||
+      (towrite % ptp_usb->outep_maxpacket) != 0)
+    return LIBUSB_SUCCESS;
+
+  LIBMTP_USB_DEBUG("USB OUT==>\n");
+  LIBMTP_USB_DEBUG("Zero Write\n");
+
+  ret = USB_BULK_WRITE(ptp_usb->handle,
+		       ptp_usb->outep,
+		       (unsigned char *) "x",
+		       0,
+		       &xwritten,
+		       ptp_usb->timeout);
+  ptp_usb_count_bulk(ptp_usb, 0, 0);
+  return ret;
+}
+
+/*
+ * Size of the next bulk write given the bytes remaining.
+ */
+static unsigned long
+ptp_write_block_size (PTP_USB *ptp_usb, unsigned long remaining,
+		      unsigned long blocksize)
+{
+  unsigned long towrite = remaining;
+
+  if (towrite > blocksize) {
+    towrite = blocksize;
+  } else {
+    // This magic makes packets the same size that WMP send them.
+    if (towrite > ptp_usb->outep_maxpacket && towrite % ptp_usb->outep_maxpacket != 0) {
+      towrite -= towrite % ptp_usb->outep_maxpacket;
+    }
+  }
+  return towrite;
+}
+
+/*
+ * The pipelined version of ptp_write_func(): the next blocks are
+ * fetched from the handler while the earlier ones are still going out
+ * on the bus.
+ */
+static short
+ptp_write_func_async (
+        unsigned long   size,
+        PTPDataHandler  *handler,
+        PTP_USB         *ptp_usb,
+        unsigned long   *written,
+        unsigned long   blocksize
+) {
+  struct ptp_usb_xfer *ring;
+  int depth = ptp_usb->transfer_queue_depth;
+  int head = 0;
+  int inflight = 0;
+  int ret = PTP_RC_OK;
+  unsigned long queued = 0;
+  unsigned long curwrite = 0;
+  unsigned long towrite = 0;
+
+  ring = ptp_usb_xfer_ring_alloc(depth);
+  if (ring == NULL)
+    return PTP_ERROR_IO;
+
+  while (1) {
+    struct ptp_usb_xfer *xfer;
+    unsigned char *buffer;
+
+    // Fill and queue buffers while the bus is busy with earlier ones
+    while (inflight < depth && queued < size) {
+      xfer = &ring[(head + inflight) % depth];
+      towrite = ptp_write_block_size(ptp_usb, size - queued, blocksize);
+      buffer = ptp_usb_xfer_buffer(ptp_usb, xfer, handler, 0, towrite,
+				   blocksize, ptp_usb->zerocopy_send);
+      if (buffer == NULL) {
+	ret = PTP_ERROR_IO;
+	break;
+      }
+      ret = handler->getfunc(NULL, handler->priv, towrite, buffer, &towrite);
+      if (ret != PTP_RC_OK)
+	break;
+      if (towrite == 0) {
+	ret = PTP_ERROR_IO;
+	break;
+      }
+      libusb_fill_bulk_transfer(xfer->transfer, ptp_usb->handle,
+				ptp_usb->outep, buffer, towrite,
+				ptp_usb_xfer_cb, xfer,
+				ptp_usb_transfer_timeout(ptp_usb, towrite));
+      xfer->length = towrite;
+      xfer->completed = 0;
+      if (libusb_submit_transfer(xfer->transfer) != LIBUSB_SUCCESS) {
+	ret = PTP_ERROR_IO;
+	break;
+      }
+      xfer->submitted = 1;
+      inflight++;
+      queued += towrite;
+    }
+    if (ret != PTP_RC_OK || inflight == 0)
+      break;
+
+    xfer = &ring[head];
+    ptp_usb_xfer_wait(ptp_usb, xfer);
+    head = (head + 1) % depth;
+    inflight--;
+
+    LIBMTP_USB_DEBUG("USB OUT==>\n");
+    ret = ptp_usb_xfer_status(xfer->transfer);
+    if (ret != PTP_RC_OK)
+      break;
+    ptp_usb_count_bulk(ptp_usb, 0, xfer->transfer->actual_length);
+    // Later blocks are queued already, so we cannot resend a tail
+    if (xfer->transfer->actual_length != xfer->length) {
+      ret = PTP_ERROR_IO;
+      break;
+    }
+    LIBMTP_USB_DATA(xfer->transfer->buffer, xfer->length, 16);
+    if (!ptp_usb->callback_active)
+      ptp_usb->current_transfer_complete += xfer->length;
+    curwrite += xfer->length;
+    ret = ptp_usb_progress(ptp_usb, xfer->length);
+    if (ret != PTP_RC_OK)
+      break;
+  }
+
+  if (inflight > 0)
+    ptp_usb_xfer_cancel(ptp_usb, ring, depth);
+  ptp_usb_xfer_ring_free(ptp_usb, ring, depth);
+  if (written) {
+    *written = curwrite;
+  }
+  if (ret != PTP_RC_OK)
+    return ret;
+
+  // If this is the last transfer send a zero write if required
+  if (ptp_write_zero_packet(ptp_usb, towrite) != LIBUSB_SUCCESS)
+    return PTP_ERROR_IO;
+  return PTP_RC_OK;
 }
 
 static short
@@ -1063,27 +2252,41 @@ ptp_write_func (
   unsigned long towrite = 0;
   int ret = 0;
   unsigned long curwrite = 0;
-  unsigned char *bytes;
-
-  // This is the largest block we'll need to read in.
-  bytes = malloc(CONTEXT_BLOCK_SIZE);
-  if (!bytes) {
-    return PTP_ERROR_IO;
+  unsigned char *bytes = NULL;
+  unsigned char *src;
+  unsigned long blocksize = ptp_usb_block_size(ptp_usb);
+  uint64_t start = ptp_usb_time_us();
+  int stream = size > (unsigned long) ptp_usb->outep_maxpacket;
+
+  if (ptp_usb->transfer_queue_depth > 1 && size > blocksize) {
+    unsigned long curwritten = 0;
+
+    ret = ptp_write_func_async(size, handler, ptp_usb, &curwritten, blocksize);
+    if (written)
+      *written = curwritten;
+    if (ret == PTP_RC_OK)
+      ptp_usb_note_throughput(ptp_usb, curwritten, start);
+    return ret;
   }
+
   while (curwrite < size) {
     unsigned long usbwritten = 0;
     int xwritten = 0;
 
-    towrite = size-curwrite;
-    if (towrite > CONTEXT_BLOCK_SIZE) {
-      towrite = CONTEXT_BLOCK_SIZE;
-    } else {
-      // This magic makes packets the same size that WMP send them.
-      if (towrite > ptp_usb->outep_maxpacket && towrite % ptp_usb->outep_maxpacket != 0) {
-        towrite -= towrite % ptp_usb->outep_maxpacket;
-      }
+    towrite = ptp_write_block_size(ptp_usb, size-curwrite, blocksize);
+    // Send straight from the handler's memory if it allows it
+    src = NULL;
+    if (handler->getbuffunc)
+      src = handler->getbuffunc(NULL, handler->priv, 0, towrite);
+    if (src == NULL) {
+      // This is the largest block we'll need to read in.
+      if (bytes == NULL)
+        bytes = malloc(blocksize);
+      if (bytes == NULL)
+        return PTP_ERROR_IO;
+      src = bytes;
     }
-    int getfunc_ret = handler->getfunc(NULL, handler->priv,towrite,bytes,&towrite);
+    int getfunc_ret = handler->getfunc(NULL, handler->priv,towrite,src,&towrite);
     if (getfunc_ret != PTP_RC_OK) {
       free(bytes);
       return getfunc_ret;
@@ -1091,9 +2294,10 @@ ptp_write_func (
     while (usbwritten < towrite) {
 	    ret = USB_BULK_WRITE(ptp_usb->handle,
 				    ptp_usb->outep,
-				    bytes+usbwritten,
+				    src+usbwritten,
 				    towrite-usbwritten,
                                     &xwritten,
+				    stream ? ptp_usb_transfer_timeout(ptp_usb, towrite-usbwritten) :
 				    ptp_usb->timeout);
 
 	    LIBMTP_USB_DEBUG("USB OUT==>\n");
@@ -1102,7 +2306,8 @@ ptp_write_func (
               free(bytes);
 	      return PTP_ERROR_IO;
 	    }
-	    LIBMTP_USB_DATA(bytes+usbwritten, xwritten, 16);
+	    ptp_usb_count_bulk(ptp_usb, 0, xwritten);
+	    LIBMTP_USB_DATA(src+usbwritten, xwritten, 16);
 	    // check for result == 0 perhaps too.
 	    // Increase counters
 	    ptp_usb->current_transfer_complete += xwritten;
@@ -1136,24 +2341,11 @@ ptp_write_func (
   }
 
   // If this is the last transfer send a zero write if required
-  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
-    if ((towrite % ptp_usb->outep_maxpacket) == 0) {
-      int xwritten;
-
-      LIBMTP_USB_DEBUG("USB OUT==>\n");
-      LIBMTP_USB_DEBUG("Zero Write\n");
-
-      ret =USB_BULK_WRITE(ptp_usb->handle,
-			    ptp_usb->outep,
-			    (unsigned char *) "x",
-			    0,
-                            &xwritten,
-			    ptp_usb->timeout);
-    }
-  }
+  ret = ptp_write_zero_packet(ptp_usb, towrite);
 
   if (ret != LIBUSB_SUCCESS)
     return PTP_ERROR_IO;
+  ptp_usb_note_throughput(ptp_usb, curwrite, start);
   return PTP_RC_OK;
 }
 
@@ -1186,8 +2378,23 @@ memory_putfunc(PTPParams* params, void* private,
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
 
 	if (priv->curoff + sendlen > priv->size) {
-		priv->data = realloc (priv->data, priv->curoff+sendlen);
-		priv->size = priv->curoff + sendlen;
+		unsigned long newsize = priv->size * 2;
+		unsigned char *newdata;
+
+		if (newsize < priv->curoff + sendlen)
+			newsize = priv->curoff + sendlen;
+		/* Allocate the whole data phase at once if we know its length
+		 * and it is what the caller expects */
+		if (params && params->data_phase_length > newsize &&
+		    params->data_phase_length <= ULONG_MAX &&
+		    (params->data_phase_expected == 0 ||
+		     params->data_phase_length == params->data_phase_expected))
+			newsize = params->data_phase_length;
+		newdata = realloc (priv->data, newsize);
+		if (!newdata)
+			return PTP_RC_GeneralError;
+		priv->data = newdata;
+		priv->size = newsize;
 	}
 	memcpy (priv->data + priv->curoff, data, sendlen);
 	priv->curoff += sendlen;
@@ -1202,6 +2409,7 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler) {
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = NULL;
 	priv->size = 0;
 	priv->curoff = 0;
@@ -1222,6 +2430,7 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = data;
 	priv->size = len;
 	priv->curoff = 0;
@@ -1244,7 +2453,7 @@ ptp_exit_recv_memory_handler (PTPDataHandler *handler,
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)handler->priv;
 	*data = priv->data;
-	*size = priv->size;
+	*size = priv->curoff;
 	free (priv);
 	return PTP_RC_OK;
 }
@@ -1398,6 +2607,21 @@ static uint16_t ptp_usb_getpacket(PTPParams *params,
 	return ret;
 }
 
+/*
+ * Tell the data handler how long the data phase announced by the
+ * container header is, so it can allocate it in one go.
+ */
+static void
+ptp_usb_announce_data_length(PTPParams *params, PTPUSBBulkContainer *usbdata)
+{
+	uint32_t length = dtoh32(usbdata->length);
+
+	if (length > PTP_USB_BULK_HDR_LEN && length != 0xffffffff)
+		params->data_phase_length = length - PTP_USB_BULK_HDR_LEN;
+	else
+		params->data_phase_length = 0;
+}
+
 uint16_t
 ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 {
@@ -1446,10 +2670,12 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 		}
 		if (rlen == ptp_usb->inep_maxpacket) {
 		  /* Copy first part of data to 'data' */
+		  ptp_usb_announce_data_length(params, &usbdata);
 		  putfunc_ret =
 		    handler->putfunc(
 				     params, handler->priv, rlen - PTP_USB_BULK_HDR_LEN, usbdata.payload.data
 				     );
+		  params->data_phase_length = 0;
 		if (putfunc_ret != PTP_RC_OK)
 			return ptp_read_cancel_func(params, ptp->Transaction_ID);
 
@@ -1519,11 +2745,13 @@ ptp_usb_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
 			params->split_header_data = 1;
 
 		/* Copy first part of data to 'data' */
+		ptp_usb_announce_data_length(params, &usbdata);
 		putfunc_ret =
 		  handler->putfunc(
 				   params, handler->priv, rlen - PTP_USB_BULK_HDR_LEN,
 				   usbdata.payload.data
 				   );
+		params->data_phase_length = 0;
 		if (putfunc_ret != PTP_RC_OK)
 			return ptp_read_cancel_func(params, ptp->Transaction_ID);
 
@@ -1646,6 +2874,419 @@ ptp_usb_getresp (PTPParams* params, PTPContainer* resp)
 	return ret;
 }
 
+/*
+ * Non-blocking transactions. A single libusb transfer carries the
+ * request, then the data phase one block at a time, then the response,
+ * and each completion submits the next step. The transaction thus runs
+ * entirely from libusb event handling in the default context, see
+ * LIBMTP_Handle_Events_Timeout_Completed(). The quirks handled are the
+ * ones in the blocking path that do not need a blocking read: split
+ * header devices, zero packets and stale or mangled responses.
+ */
+#define PTP_USB_ASYNC_REQUEST	0
+#define PTP_USB_ASYNC_DATA_OUT	1
+#define PTP_USB_ASYNC_DATA_IN	2
+#define PTP_USB_ASYNC_RESPONSE	3
+/* Short or stale response packets skipped before giving up */
+#define PTP_USB_ASYNC_RESPONSE_TRIES	3
+
+struct ptp_usb_async {
+  PTPParams *params;
+  PTPContainer ptp; /**< The request, and the response in the end */
+  uint16_t flags;
+  uint64_t sendlen;
+  PTPDataHandler *handler;
+  PTPTransactionDoneFunc done;
+  void *data;
+  int phase;
+  struct libusb_transfer *transfer;
+  unsigned char *buffer;
+  unsigned long buflen;
+  uint64_t total; /**< Length of the data container, 0 until known */
+  uint64_t moved; /**< Bytes of the data container moved so far */
+  int zero_sent;
+  int tries;
+  uint16_t ret; /**< Set if the data handler failed */
+  unsigned char surplus[sizeof(PTPUSBBulkContainer)];
+  unsigned long surpluslen; /**< Response read along with the data */
+};
+
+static void
+ptp_usb_async_finish (PTP_USB *ptp_usb, uint16_t ret)
+{
+  struct ptp_usb_async *as = ptp_usb->async;
+
+  ptp_usb->async = NULL;
+  libusb_free_transfer(as->transfer);
+  free(as->buffer);
+  as->done(as->params, &as->ptp, ret, as->data);
+  free(as);
+}
+
+static void ptp_usb_async_cb (struct libusb_transfer *t);
+
+static uint16_t
+ptp_usb_async_submit (PTP_USB *ptp_usb, int const out, unsigned long len)
+{
+  struct ptp_usb_async *as = ptp_usb->async;
+
+  libusb_fill_bulk_transfer(as->transfer, ptp_usb->handle,
+			    out ? ptp_usb->outep : ptp_usb->inep,
+			    as->buffer, len, ptp_usb_async_cb, ptp_usb,
+			    ptp_usb->timeout);
+  if (libusb_submit_transfer(as->transfer) != 0)
+    return PTP_ERROR_IO;
+  return PTP_RC_OK;
+}
+
+/* Fills the buffer from the data handler and sends it */
+static uint16_t
+ptp_usb_async_send_block (PTP_USB *ptp_usb, unsigned long offset,
+			  unsigned long len)
+{
+  struct ptp_usb_async *as = ptp_usb->async;
+  unsigned long gotlen = 0;
+  uint16_t ret;
+
+  if (len > offset) {
+    ret = as->handler->getfunc(as->params, as->handler->priv, len - offset,
+			       as->buffer + offset, &gotlen);
+    if (ret != PTP_RC_OK)
+      return PTP_ERROR_CANCEL;
+    if (gotlen != len - offset)
+      return PTP_ERROR_IO;
+  }
+  return ptp_usb_async_submit(ptp_usb, 1, len);
+}
+
+static uint16_t
+ptp_usb_async_start_data_out (PTP_USB *ptp_usb)
+{
+  struct ptp_usb_async *as = ptp_usb->async;
+  PTPParams *params = as->params;
+  PTPUSBBulkContainer *usbdata = (PTPUSBBulkContainer *) as->buffer;
+  unsigned long len;
+
+  as->phase = PTP_USB_ASYNC_DATA_OUT;
+  as->total = PTP_USB_BULK_HDR_LEN + as->sendlen;
+  as->moved = 0;
+  usbdata->length = htod32(as->total > 0xffffffffU ?
+			   0xffffffffU : (uint32_t) as->total);
+  usbdata->type = htod16(PTP_USB_CONTAINER_DATA);
+  usbdata->code = htod16(as->ptp.Code);
+  usbdata->trans_id = htod32(as->ptp.Transaction_ID);
+  if (params->split_header_data)
+    len = PTP_USB_BULK_HDR_LEN;
+  else
+    len = as->total < as->buflen ? as->total : as->buflen;
+  return ptp_usb_async_send_block(ptp_usb, PTP_USB_BULK_HDR_LEN, len);
+}
+
+static uint16_t
+ptp_usb_async_start_response (PTP_USB *ptp_usb)
+{
+  struct ptp_usb_async *as = ptp_usb->async;
+
+  as->phase = PTP_USB_ASYNC_RESPONSE;
+  as->tries = PTP_USB_ASYNC_RESPONSE_TRIES;
+  return ptp_usb_async_submit(ptp_usb, 0, sizeof(PTPUSBBulkContainer));
+}
+
+/*
+ * Takes a response container apart. Returns 1 if it was not the one
+ * we wait for and another one should be read.
+ */
+static int
+ptp_usb_async_response (PTP_USB *ptp_usb, unsigned char *bytes,
+			unsigned long len, uint16_t *ret)
+{
+  struct ptp_usb_async *as = ptp_usb->async;
+  PTPParams *params = as->params;
+  PTPUSBBulkContainer usbresp;
+  uint32_t trans_id;
+
+  memset(&usbresp, 0, sizeof(usbresp));
+  memcpy(&usbresp, bytes, len < sizeof(usbresp) ? len : sizeof(usbresp));
+  // Zero packets and the Samsung YP-U3 short junk come before the response
+  if (len < PTP_USB_BULK_HDR_LEN) {
+    *ret = PTP_ERROR_IO;
+    return as->tries-- > 0;
+  }
+  if (dtoh16(usbresp.type) != PTP_USB_CONTAINER_RESPONSE) {
+    *ret = PTP_ERROR_RESP_EXPECTED;
+    return as->tries-- > 0;
+  }
+  trans_id = dtoh32(usbresp.trans_id);
+  if (trans_id != as->ptp.Transaction_ID) {
+    if (FLAG_IGNORE_HEADER_ERRORS(ptp_usb)) {
+      libusb_glue_debug (params, "ptp_usb_transaction_async: detected a broken "
+			 "PTP header, transaction ID insane, expect "
+			 "problems! (But continuing)");
+      trans_id = as->ptp.Transaction_ID;
+    } else if (trans_id < as->ptp.Transaction_ID && as->tries-- > 0) {
+      // An old reply
+      return 1;
+    } else {
+      *ret = PTP_ERROR_BADPARAM;
+      return 0;
+    }
+  }
+  as->ptp.Code = dtoh16(usbresp.code);
+  as->ptp.SessionID = params->session_id;
+  as->ptp.Transaction_ID = trans_id;
+  as->ptp.Param1 = dtoh32(usbresp.payload.params.param1);
+  as->ptp.Param2 = dtoh32(usbresp.payload.params.param2);
+  as->ptp.Param3 = dtoh32(usbresp.payload.params.param3);
+  as->ptp.Param4 = dtoh32(usbresp.payload.params.param4);
+  as->ptp.Param5 = dtoh32(usbresp.payload.params.param5);
+  *ret = as->ret != PTP_RC_OK ? as->ret : as->ptp.Code;
+  return 0;
+}
+
+/* Handles a read of the data phase */
+static uint16_t
+ptp_usb_async_data_in (PTP_USB *ptp_usb, struct libusb_transfer *t)
+{
+  struct ptp_usb_async *as = ptp_usb->async;
+  PTPParams *params = as->params;
+  unsigned char *bytes = as->buffer;
+  unsigned long len = t->actual_length;
+  unsigned long next;
+  uint16_t ret;
+
+  if (as->total == 0) {
+    PTPUSBBulkContainer *usbdata = (PTPUSBBulkContainer *) bytes;
+
+    if (len == 0 && as->tries-- > 0)
+      return ptp_usb_async_submit(ptp_usb, 0, as->buflen);
+    if (len < PTP_USB_BULK_HDR_LEN)
+      return PTP_ERROR_IO;
+    if (dtoh16(usbdata->type) == PTP_USB_CONTAINER_RESPONSE) {
+      // No data after all, most likely an error
+      as->tries = 0;
+      (void) ptp_usb_async_response(ptp_usb, bytes, len, &ret);
+      ptp_usb_async_finish(ptp_usb, ret);
+      return PTP_RC_OK;
+    }
+    if (dtoh16(usbdata->type) != PTP_USB_CONTAINER_DATA)
+      return PTP_ERROR_DATA_EXPECTED;
+    if (dtoh16(usbdata->code) != as->ptp.Code &&
+	!FLAG_IGNORE_HEADER_ERRORS(ptp_usb)) {
+      ret = dtoh16(usbdata->code);
+      if (ret < PTP_RC_Undefined || ret > PTP_RC_SpecificationOfDestinationUnsupported)
+	ret = PTP_ERROR_IO;
+      return ret;
+    }
+    as->total = dtoh32(usbdata->length);
+    // The kludge for containers of 4GB and more: read to a short packet
+    if (as->total == 0xffffffffU)
+      as->total = UINT64_MAX;
+    if (as->total > PTP_USB_BULK_HDR_LEN && len == PTP_USB_BULK_HDR_LEN)
+      params->split_header_data = 1;
+    ptp_usb_announce_data_length(params, usbdata);
+    bytes += PTP_USB_BULK_HDR_LEN;
+    len -= PTP_USB_BULK_HDR_LEN;
+    as->moved = PTP_USB_BULK_HDR_LEN;
+  }
+  if (as->total != UINT64_MAX && len > as->total - as->moved) {
+    unsigned long surplus = len - (as->total - as->moved);
+
+    if (surplus >= PTP_USB_BULK_HDR_LEN && surplus <= sizeof(as->surplus)) {
+      memcpy(as->surplus, bytes + len - surplus, surplus);
+      as->surpluslen = surplus;
+    }
+    len -= surplus;
+  }
+  if (len > 0 && as->ret == PTP_RC_OK &&
+      as->handler->putfunc(params, as->handler->priv, len, bytes) != PTP_RC_OK) {
+    LIBMTP_ERROR("LIBMTP error writing to fd or memory by handler.\n");
+    // Read the rest anyway, the device cannot be stopped without blocking
+    as->ret = PTP_ERROR_CANCEL;
+  }
+  params->data_phase_length = 0;
+  as->moved += len;
+
+  if (as->total == UINT64_MAX) {
+    if (t->actual_length == t->length) {
+      return ptp_usb_async_submit(ptp_usb, 0, as->buflen);
+    }
+  } else if (as->moved < as->total) {
+    next = (unsigned long) (as->total - as->moved < as->buflen ?
+			    as->total - as->moved : as->buflen);
+    // Whole packets, so that the transfer does not overflow
+    if (next % ptp_usb->inep_maxpacket)
+      next += ptp_usb->inep_maxpacket - next % ptp_usb->inep_maxpacket;
+    if (next > as->buflen)
+      next = as->buflen - as->buflen % ptp_usb->inep_maxpacket;
+    return ptp_usb_async_submit(ptp_usb, 0, next);
+  }
+  if (as->surpluslen > 0) {
+    as->phase = PTP_USB_ASYNC_RESPONSE;
+    as->tries = 0;
+    (void) ptp_usb_async_response(ptp_usb, as->surplus, as->surpluslen, &ret);
+    ptp_usb_async_finish(ptp_usb, ret);
+    return PTP_RC_OK;
+  }
+  return ptp_usb_async_start_response(ptp_usb);
+}
+
+static void
+ptp_usb_async_cb (struct libusb_transfer *t)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) t->user_data;
+  struct ptp_usb_async *as = ptp_usb->async;
+  unsigned long len;
+  uint16_t ret = PTP_RC_OK;
+
+  if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+    ptp_usb_async_finish(ptp_usb, t->status == LIBUSB_TRANSFER_CANCELLED ?
+			 PTP_ERROR_CANCEL : ptp_usb_xfer_status(t));
+    return;
+  }
+  ptp_usb_count_bulk(ptp_usb, t->endpoint == ptp_usb->inep, t->actual_length);
+  switch (as->phase) {
+  case PTP_USB_ASYNC_REQUEST:
+    if (t->actual_length != t->length) {
+      ret = PTP_ERROR_IO;
+    } else if ((as->flags & PTP_DP_DATA_MASK) == PTP_DP_SENDDATA) {
+      ret = ptp_usb_async_start_data_out(ptp_usb);
+    } else if ((as->flags & PTP_DP_DATA_MASK) == PTP_DP_GETDATA) {
+      as->phase = PTP_USB_ASYNC_DATA_IN;
+      as->tries = 1;
+      ret = ptp_usb_async_submit(ptp_usb, 0, as->buflen);
+    } else {
+      ret = ptp_usb_async_start_response(ptp_usb);
+    }
+    break;
+  case PTP_USB_ASYNC_DATA_OUT:
+    if (t->actual_length != t->length) {
+      ret = PTP_ERROR_IO;
+      break;
+    }
+    as->moved += t->actual_length;
+    if (as->moved < as->total) {
+      len = (unsigned long) (as->total - as->moved < as->buflen ?
+			     as->total - as->moved : as->buflen);
+      ret = ptp_usb_async_send_block(ptp_usb, 0, len);
+    } else if (!as->zero_sent && (as->total % ptp_usb->outep_maxpacket) == 0) {
+      as->zero_sent = 1;
+      ret = ptp_usb_async_submit(ptp_usb, 1, 0);
+    } else {
+      ret = ptp_usb_async_start_response(ptp_usb);
+    }
+    break;
+  case PTP_USB_ASYNC_DATA_IN:
+    ret = ptp_usb_async_data_in(ptp_usb, t);
+    break;
+  case PTP_USB_ASYNC_RESPONSE:
+    if (ptp_usb_async_response(ptp_usb, as->buffer, t->actual_length, &ret)) {
+      ret = ptp_usb_async_submit(ptp_usb, 0, sizeof(PTPUSBBulkContainer));
+      break;
+    }
+    ptp_usb_async_finish(ptp_usb, ret);
+    return;
+  }
+  if (ret != PTP_RC_OK && ptp_usb->async != NULL)
+    ptp_usb_async_finish(ptp_usb, ret);
+}
+
+/*
+ * The non-blocking transaction of PTPParams, see ptp_transaction_async().
+ * Devices with a context of their own are not served by
+ * LIBMTP_Handle_Events_Timeout_Completed() and cannot do these.
+ */
+static uint16_t
+ptp_usb_transaction_async (PTPParams* params, PTPContainer* ptp,
+			   uint16_t flags, uint64_t sendlen,
+			   PTPDataHandler *handler,
+			   PTPTransactionDoneFunc done, void *data)
+{
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  struct ptp_usb_async *as;
+  PTPUSBBulkContainer *usbreq;
+  unsigned long len;
+  uint16_t ret;
+
+  if (ptp_usb->context != NULL)
+    return PTP_RC_OperationNotSupported;
+  if (ptp_usb->async != NULL || params->response_packet_size > 0)
+    return PTP_RC_DeviceBusy;
+  if ((flags & PTP_DP_DATA_MASK) != PTP_DP_NODATA && handler == NULL)
+    return PTP_ERROR_BADPARAM;
+
+  as = (struct ptp_usb_async *) calloc(1, sizeof(struct ptp_usb_async));
+  if (as == NULL)
+    return PTP_RC_GeneralError;
+  as->params = params;
+  as->ptp = *ptp;
+  as->flags = flags;
+  as->sendlen = sendlen;
+  as->handler = handler;
+  as->done = done;
+  as->data = data;
+  as->phase = PTP_USB_ASYNC_REQUEST;
+  as->ret = PTP_RC_OK;
+  as->buflen = ptp_usb_block_size(ptp_usb);
+  if (as->buflen < sizeof(PTPUSBBulkContainer))
+    as->buflen = sizeof(PTPUSBBulkContainer);
+  as->buffer = malloc(as->buflen);
+  as->transfer = libusb_alloc_transfer(0);
+  if (as->buffer == NULL || as->transfer == NULL) {
+    if (as->transfer != NULL)
+      libusb_free_transfer(as->transfer);
+    free(as->buffer);
+    free(as);
+    return PTP_RC_GeneralError;
+  }
+
+  LIBMTP_USB_DEBUG("REQUEST (async): 0x%04x, %s\n", ptp->Code,
+		   ptp_get_opcode_name(params, ptp->Code));
+  usbreq = (PTPUSBBulkContainer *) as->buffer;
+  len = PTP_USB_BULK_REQ_LEN - (sizeof(uint32_t) * (5 - ptp->Nparam));
+  usbreq->length = htod32(len);
+  usbreq->type = htod16(PTP_USB_CONTAINER_COMMAND);
+  usbreq->code = htod16(ptp->Code);
+  usbreq->trans_id = htod32(ptp->Transaction_ID);
+  usbreq->payload.params.param1 = htod32(ptp->Param1);
+  usbreq->payload.params.param2 = htod32(ptp->Param2);
+  usbreq->payload.params.param3 = htod32(ptp->Param3);
+  usbreq->payload.params.param4 = htod32(ptp->Param4);
+  usbreq->payload.params.param5 = htod32(ptp->Param5);
+
+  ptp_usb->async = as;
+  ret = ptp_usb_async_submit(ptp_usb, 1, len);
+  if (ret != PTP_RC_OK) {
+    ptp_usb->async = NULL;
+    libusb_free_transfer(as->transfer);
+    free(as->buffer);
+    free(as);
+  }
+  return ret;
+}
+
+/*
+ * Gives up on a non-blocking transaction that is still underway,
+ * calling it back with PTP_ERROR_CANCEL.
+ */
+static void
+ptp_usb_async_abort (PTP_USB *ptp_usb)
+{
+  struct ptp_usb_async *as = ptp_usb->async;
+
+  if (as == NULL)
+    return;
+  if (libusb_cancel_transfer(as->transfer) != 0) {
+    ptp_usb_async_finish(ptp_usb, PTP_ERROR_CANCEL);
+    return;
+  }
+  while (ptp_usb->async == as) {
+    int ret = libusb_handle_events(NULL);
+
+    if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+      break;
+  }
+}
+
 /* Event handling functions */
 
 /* PTP Events wait for or check mode */
@@ -1666,6 +3307,9 @@ ptp_usb_event (PTPParams* params, PTPContainer* event, int wait)
 	if ((params==NULL) || (event==NULL))
 		return PTP_ERROR_BADPARAM;
 	ptp_usb = (PTP_USB *)(params->data);
+	/* The events go to the listener, see ptp_usb_event_listen_get() */
+	if (ptp_usb->listener != NULL)
+		return PTP_RC_DeviceBusy;
 
 	ret = PTP_RC_OK;
 	switch(wait) {
@@ -1800,6 +3444,10 @@ ptp_usb_event_async (PTPParams* params, PTPEventCbFn cb, void *user_data) {
 	if (params == NULL) {
 		return PTP_ERROR_BADPARAM;
 	}
+	/* The listener has the interrupt endpoint */
+	if (((PTP_USB *)(params->data))->listener != NULL) {
+		return PTP_RC_DeviceBusy;
+	}
 
         usbevent = calloc(1, sizeof(*usbevent));
         if (usbevent == NULL) {
@@ -1833,13 +3481,286 @@ ptp_usb_event_async (PTPParams* params, PTPEventCbFn cb, void *user_data) {
 	return ret == 0 ? PTP_RC_OK : PTP_ERROR_IO;
 }
 
+/* Adds an event to the ring of the listener, or counts it as dropped */
+static void
+ptp_usb_listener_queue (struct ptp_usb_event_listener *l, PTPContainer *event)
+{
+	PTPParams *params = l->params;
+	struct ptp_usb_event_entry *e;
+
+	ptp_lock (params, PTP_LOCK_EVENTS);
+	if (l->count == PTP_USB_EVENT_RING) {
+		/* Full, and the last entry is a gap already */
+		l->ring[(l->first + l->count - 1) % PTP_USB_EVENT_RING].lost++;
+	} else {
+		e = &l->ring[(l->first + l->count) % PTP_USB_EVENT_RING];
+		if (l->count == PTP_USB_EVENT_RING - 1) {
+			memset (e, 0, sizeof(*e));
+			e->lost = 1;
+		} else {
+			e->event = *event;
+			e->lost = 0;
+		}
+		l->count++;
+	}
+	ptp_lock (params, PTP_UNLOCK_EVENTS);
+}
+
+static void
+ptp_usb_listener_cb (struct libusb_transfer *t) {
+	struct ptp_usb_event_listener *l = t->user_data;
+	PTPParams *params = l->params;
+	PTPUSBEventContainer *usbevent = (void *)t->buffer;
+	PTPContainer event = {0,};
+
+	switch (t->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		if (t->actual_length < 8) {
+			/* Zero packets and junk, wait for the next one */
+			break;
+		}
+		event.Code=dtoh16(usbevent->code);
+		event.SessionID=params->session_id;
+		event.Transaction_ID=dtoh32(usbevent->trans_id);
+		event.Param1=dtoh32(usbevent->param1);
+		event.Param2=dtoh32(usbevent->param2);
+		event.Param3=dtoh32(usbevent->param3);
+		ptp_usb_listener_queue (l, &event);
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		l->submitted--;
+		return;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		l->status = PTP_ERROR_NODEVICE;
+		l->submitted--;
+		return;
+	default:
+		libusb_glue_error (params,
+			"PTP: event listener stopped by an error 0x%02x\n",
+			t->status);
+		l->status = ptp_usb_xfer_status (t);
+		l->submitted--;
+		return;
+	}
+	if (l->stopping || libusb_submit_transfer (t) != 0) {
+		if (!l->stopping)
+			l->status = PTP_ERROR_IO;
+		l->submitted--;
+	}
+}
+
+/**
+ * ptp_usb_event_listen_start:
+ * params:	PTPParams*
+ *
+ * Starts listening on the interrupt endpoint for good, with a few
+ * transfers always submitted so that no event is missed while another
+ * one is handled. The events are queued as they come in, from
+ * LIBMTP_Handle_Events_Timeout_Completed(), and read with
+ * ptp_usb_event_listen_get(). The blocking and one-shot event reads
+ * do not work while the listener runs.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_usb_event_listen_start (PTPParams *params) {
+	PTP_USB *ptp_usb = (PTP_USB *)(params->data);
+	struct ptp_usb_event_listener *l;
+	int i;
+
+	if (ptp_usb->listener != NULL)
+		return PTP_RC_OK;
+	/* Only the default context is handled for the application */
+	if (ptp_usb->context != NULL || ptp_usb->intep == 0)
+		return PTP_RC_OperationNotSupported;
+	l = calloc (1, sizeof(*l));
+	if (l == NULL)
+		return PTP_RC_GeneralError;
+	l->params = params;
+	l->status = PTP_RC_OK;
+	for (i = 0; i < PTP_USB_EVENT_TRANSFERS; i++) {
+		l->transfers[i] = libusb_alloc_transfer (0);
+		if (l->transfers[i] == NULL)
+			break;
+		libusb_fill_interrupt_transfer (l->transfers[i], ptp_usb->handle,
+			ptp_usb->intep, (unsigned char *)&l->buffers[i],
+			sizeof(l->buffers[i]), ptp_usb_listener_cb, l, 0);
+		if (libusb_submit_transfer (l->transfers[i]) != 0) {
+			libusb_free_transfer (l->transfers[i]);
+			l->transfers[i] = NULL;
+			break;
+		}
+		l->submitted++;
+	}
+	ptp_usb->listener = l;
+	if (i < PTP_USB_EVENT_TRANSFERS) {
+		ptp_usb_event_listen_stop (params);
+		return PTP_ERROR_IO;
+	}
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_usb_event_listen_stop:
+ * params:	PTPParams*
+ *
+ * Stops the listener, dropping any events that were not read yet.
+ * This handles events until libusb has given back all transfers.
+ **/
+void
+ptp_usb_event_listen_stop (PTPParams *params) {
+	PTP_USB *ptp_usb = (PTP_USB *)(params->data);
+	struct ptp_usb_event_listener *l = ptp_usb->listener;
+	int i;
+
+	if (l == NULL)
+		return;
+	l->stopping = 1;
+	for (i = 0; i < PTP_USB_EVENT_TRANSFERS; i++) {
+		if (l->transfers[i] != NULL)
+			libusb_cancel_transfer (l->transfers[i]);
+	}
+	while (l->submitted > 0) {
+		int ret = libusb_handle_events (NULL);
+
+		if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED)
+			break;
+	}
+	ptp_usb->listener = NULL;
+	/* A transfer libusb did not give back is leaked rather than freed */
+	if (l->submitted > 0)
+		return;
+	for (i = 0; i < PTP_USB_EVENT_TRANSFERS; i++) {
+		if (l->transfers[i] != NULL)
+			libusb_free_transfer (l->transfers[i]);
+	}
+	free (l);
+}
+
+/**
+ * ptp_usb_event_listen_get:
+ * params:	PTPParams*
+ *		PTPContainer* event	- the event taken off the queue
+ *		unsigned int* lost	- 0, or the number of events dropped
+ *
+ * Takes the oldest entry off the queue of the listener. That is either
+ * an event, or a gap where the queue was full and *lost events were
+ * dropped.
+ *
+ * Return values: 1 if an entry was taken, 0 if the queue is empty,
+ * -1 if it is empty and the listener has ended or is not running.
+ **/
+int
+ptp_usb_event_listen_get (PTPParams *params, PTPContainer *event, unsigned int *lost) {
+	PTP_USB *ptp_usb = (PTP_USB *)(params->data);
+	struct ptp_usb_event_listener *l = ptp_usb->listener;
+	struct ptp_usb_event_entry *e;
+	int ret = 0;
+
+	if (l == NULL)
+		return -1;
+	ptp_lock (params, PTP_LOCK_EVENTS);
+	if (l->count > 0) {
+		e = &l->ring[l->first];
+		*event = e->event;
+		*lost = e->lost;
+		l->first = (l->first + 1) % PTP_USB_EVENT_RING;
+		l->count--;
+		ret = 1;
+	} else if (l->submitted == 0) {
+		ret = -1;
+	}
+	ptp_lock (params, PTP_UNLOCK_EVENTS);
+	return ret;
+}
+
 /**
  * Trivial wrapper around the most generic libusb method for polling for events.
  * Can be used to drive asynchronous event detection.
  */
 int LIBMTP_Handle_Events_Timeout_Completed(struct timeval *tv, int *completed) {
-	/* Pass NULL for context as libmtp always uses the default context */
-	return libusb_handle_events_timeout_completed(NULL, tv, completed);
+	/*
+	 * Pass NULL for the default context; devices opened with a worker
+	 * have a context of their own and are not served here.
+	 */
+	int ret;
+
+	ret = libusb_handle_events_timeout_completed(NULL, tv, completed);
+	run_hotplug_events();
+	return ret;
+}
+
+/**
+ * This function returns the file descriptors that have to be polled
+ * to drive asynchronous events, hotplug and non-blocking transfers
+ * from an event loop of the application. Whenever one of them is
+ * ready, or the timeout from <code>LIBMTP_Get_Next_Timeout()</code>
+ * has passed, call <code>LIBMTP_Handle_Events_Timeout_Completed()</code>
+ * with a zero timeval. The set of descriptors may change when devices
+ * are opened or closed, so fetch it again after that.
+ *
+ * @param fds a pointer to a variable that will hold the array of
+ *        descriptors on return. Free it with <code>free()</code>.
+ * @param numfds a pointer to a variable that will hold the number of
+ *        descriptors on return.
+ * @return 0 on success, any other value means failure.
+ */
+int LIBMTP_Get_Pollfds(LIBMTP_pollfd_t **fds, int *numfds)
+{
+  const struct libusb_pollfd **usbfds;
+  LIBMTP_pollfd_t *retfds;
+  int n = 0;
+  int i;
+
+  *fds = NULL;
+  *numfds = 0;
+  usbfds = libusb_get_pollfds(NULL);
+  if (usbfds == NULL) {
+    LIBMTP_ERROR("LIBMTP_Get_Pollfds(): the USB library cannot be polled.\n");
+    return -1;
+  }
+  while (usbfds[n] != NULL)
+    n++;
+  retfds = (LIBMTP_pollfd_t *) malloc((n > 0 ? n : 1) * sizeof(LIBMTP_pollfd_t));
+  if (retfds == NULL) {
+    LIBMTP_ERROR("LIBMTP_Get_Pollfds(): out of memory.\n");
+  } else {
+    for (i = 0; i < n; i++) {
+      retfds[i].fd = usbfds[i]->fd;
+      retfds[i].events = usbfds[i]->events;
+    }
+  }
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000104)
+  libusb_free_pollfds(usbfds);
+#else
+  free((void *) usbfds);
+#endif
+  if (retfds == NULL)
+    return -1;
+  *fds = retfds;
+  *numfds = n;
+  return 0;
+}
+
+/**
+ * This function tells when
+ * <code>LIBMTP_Handle_Events_Timeout_Completed()</code> has to be
+ * called at the latest, even if none of the descriptors from
+ * <code>LIBMTP_Get_Pollfds()</code> became ready, so that transfer
+ * timeouts are handled.
+ *
+ * @param tv a pointer to a timeval that will hold the time left on
+ *        return, if there is a timeout pending.
+ * @return 1 if there is a timeout pending and it was put in tv, 0 if
+ *         there is none, any negative value means failure.
+ */
+int LIBMTP_Get_Next_Timeout(struct timeval *tv)
+{
+  int ret = libusb_get_next_timeout(NULL, tv);
+
+  return ret < 0 ? -1 : ret;
 }
 
 uint16_t
@@ -1902,8 +3823,11 @@ static int init_ptp_usb(PTPParams* params, PTP_USB* ptp_usb, libusb_device* dev)
   params->getdata_func=ptp_usb_getdata;
   params->cancelreq_func=ptp_usb_control_cancel_request;
   params->devstatreq_func=ptp_usb_control_device_status_request;
+  params->transaction_async_func=ptp_usb_transaction_async;
+  params->recover_func=ptp_usb_recover;
   params->data=ptp_usb;
   params->transaction_id=0;
+  ptp_usb->params = params;
   /*
    * This is hardcoded here since we have no devices whatsoever that are BE.
    * Change this the day we run into our first BE device (if ever).
@@ -2057,6 +3981,10 @@ static void clear_stall(PTP_USB* ptp_usb)
     ret = libusb_clear_halt (ptp_usb->handle, ptp_usb->inep);
     if (ret != LIBUSB_SUCCESS) {
       perror ("usb_clear_stall_feature()");
+    } else if (ptp_usb->params != NULL) {
+      ptp_lock(ptp_usb->params, PTP_LOCK_STATS);
+      ptp_usb->params->stats.stalls_cleared++;
+      ptp_lock(ptp_usb->params, PTP_UNLOCK_STATS);
     }
   }
 
@@ -2070,6 +3998,10 @@ static void clear_stall(PTP_USB* ptp_usb)
     ret = libusb_clear_halt(ptp_usb->handle, ptp_usb->outep);
     if (ret != LIBUSB_SUCCESS) {
       perror("usb_clear_stall_feature()");
+    } else if (ptp_usb->params != NULL) {
+      ptp_lock(ptp_usb->params, PTP_LOCK_STATS);
+      ptp_usb->params->stats.stalls_cleared++;
+      ptp_lock(ptp_usb->params, PTP_UNLOCK_STATS);
     }
   }
 
@@ -2197,14 +4129,19 @@ static int find_interface_and_endpoints(libusb_device *dev,
  * This function assigns params and usbinfo given a raw device
  * as input.
  * @param device the device to be assigned.
+ * @param private_context give the device a libusb context of its own
+ *        instead of the default one, so that it can be driven from a
+ *        thread of its own.
  * @param usbinfo a pointer to the new usbinfo.
  * @return an error code.
  */
 LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 					   PTPParams *params,
+					   int const private_context,
 					   void **usbinfo)
 {
   PTP_USB *ptp_usb;
+  libusb_context *context = NULL;
   libusb_device *ldevice;
   uint16_t ret = 0;
   int err, found = 0, i;
@@ -2214,11 +4151,21 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
   LIBMTP_error_number_t init_usb_ret;
 
   /* See if we can find this raw device again... */
-  init_usb_ret = init_usb();
-  if (init_usb_ret != LIBMTP_ERROR_NONE)
-    return init_usb_ret;
+  if (private_context) {
+    /* ...in a context of its own, so it needs no locking against others */
+    if (libusb_init(&context) < 0) {
+      LIBMTP_ERROR("Libusb1 init failed\n");
+      return LIBMTP_ERROR_USB_LAYER;
+    }
+    if ((LIBMTP_debug & LIBMTP_DEBUG_USB) != 0)
+      libusb_set_debug(context,9);
+  } else {
+    init_usb_ret = init_usb();
+    if (init_usb_ret != LIBMTP_ERROR_NONE)
+      return init_usb_ret;
+  }
 
-  nrofdevs = libusb_get_device_list(NULL, &devs);
+  nrofdevs = libusb_get_device_list(context, &devs);
   for (i = 0; i < nrofdevs ; i++) {
     if (libusb_get_bus_number(devs[i]) != device->bus_location)
       continue;
@@ -2238,6 +4185,7 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
   /* Device has gone since detecting raw devices! */
   if (!found) {
     libusb_free_device_list (devs, 0);
+    exit_usb_context(context);
     return LIBMTP_ERROR_NO_DEVICE_ATTACHED;
   }
 
@@ -2245,6 +4193,7 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
   ptp_usb = (PTP_USB *) malloc(sizeof(PTP_USB));
   if (ptp_usb == NULL) {
     libusb_free_device_list (devs, 0);
+    exit_usb_context(context);
     return LIBMTP_ERROR_MEMORY_ALLOCATION;
   }
   /* Start with a blank slate (includes setting device_flags to 0) */
@@ -2252,6 +4201,7 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 
   /* Copy the raw device */
   memcpy(&ptp_usb->rawdevice, device, sizeof(LIBMTP_raw_device_t));
+  ptp_usb->context = context;
 
   /*
    * Some devices must have their "OS Descriptor" massaged in order
@@ -2275,6 +4225,7 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 
   if (err) {
     libusb_free_device_list (devs, 0);
+    exit_usb_context(context);
     free (ptp_usb);
     LIBMTP_ERROR("LIBMTP PANIC: Unable to find interface & endpoints of device\n");
     return LIBMTP_ERROR_CONNECTING;
@@ -2283,11 +4234,16 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
   /* Copy USB version number */
   ptp_usb->bcdusb = desc.bcdUSB;
 
+  /* Default bulk transfer pipelining */
+  set_usb_device_transfer_queue(ptp_usb, USB_TRANSFER_QUEUE_DEPTH,
+				default_block_size(ptp_usb, ldevice));
+
   /* Attempt to initialize this device */
   if (init_ptp_usb(params, ptp_usb, ldevice) < 0) {
     free (ptp_usb);
     LIBMTP_ERROR("LIBMTP PANIC: Unable to initialize device\n");
     libusb_free_device_list (devs, 0);
+    exit_usb_context(context);
     return LIBMTP_ERROR_CONNECTING;
   }
 
@@ -2306,6 +4262,7 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
     if(init_ptp_usb(params, ptp_usb, ldevice) <0) {
       LIBMTP_ERROR("LIBMTP PANIC: Could not init USB on second attempt\n");
       libusb_free_device_list (devs, 0);
+      exit_usb_context(context);
       free (ptp_usb);
       return LIBMTP_ERROR_CONNECTING;
     }
@@ -2315,6 +4272,7 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
     if ((ret = ptp_opensession(params, 1)) == PTP_ERROR_IO) {
       LIBMTP_ERROR("LIBMTP PANIC: failed to open session on second attempt\n");
       libusb_free_device_list (devs, 0);
+      exit_usb_context(context);
       free (ptp_usb);
       return LIBMTP_ERROR_CONNECTING;
     }
@@ -2333,6 +4291,7 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 	    ret);
     libusb_release_interface(ptp_usb->handle, ptp_usb->interface);
     libusb_free_device_list (devs, 0);
+    exit_usb_context(context);
     free (ptp_usb);
     return LIBMTP_ERROR_CONNECTING;
   }
@@ -2347,11 +4306,41 @@ LIBMTP_error_number_t configure_usb_device(LIBMTP_raw_device_t *device,
 }
 
 
+/*
+ * The bulk transfer block size a device starts out with: its entry in
+ * mtp_block_size_table if it has one, otherwise what suits the speed
+ * it is connected at. The iRiver block alternation always uses
+ * CONTEXT_BLOCK_SIZE, see ptp_usb_block_size().
+ */
+static unsigned long default_block_size(PTP_USB *ptp_usb, libusb_device *dev)
+{
+  uint16_t vendor_id = ptp_usb->rawdevice.device_entry.vendor_id;
+  uint16_t product_id = ptp_usb->rawdevice.device_entry.product_id;
+  int speed;
+  int i;
+
+  for (i = 0; mtp_block_size_table[i].blocksize != 0; i++) {
+    if (mtp_block_size_table[i].vendor_id == vendor_id &&
+	mtp_block_size_table[i].product_id == product_id)
+      return mtp_block_size_table[i].blocksize;
+  }
+  speed = libusb_get_device_speed(dev);
+  if (speed >= LIBUSB_SPEED_SUPER)
+    return USB_SUPER_SPEED_BLOCK_SIZE;
+  if (speed == LIBUSB_SPEED_HIGH)
+    return USB_HIGH_SPEED_BLOCK_SIZE;
+  return CONTEXT_BLOCK_SIZE;
+}
+
 void close_device (PTP_USB *ptp_usb, PTPParams *params)
 {
+  ptp_usb_event_listen_stop(params);
+  ptp_usb_async_abort(ptp_usb);
   if (ptp_closesession(params)!=PTP_RC_OK)
     LIBMTP_ERROR("ERROR: Could not close session!\n");
   close_usb(ptp_usb);
+  exit_usb_context(ptp_usb->context);
+  ptp_usb->context = NULL;
 }
 
 void set_usb_device_timeout(PTP_USB *ptp_usb, int timeout)
@@ -2364,6 +4353,38 @@ void get_usb_device_timeout(PTP_USB *ptp_usb, int *timeout)
   *timeout = ptp_usb->timeout;
 }
 
+/*
+ * Set how many bulk transfers are kept in flight and how large each
+ * of them is. The block size is rounded down to a whole number of
+ * packets on both endpoints, since only the last transfer of a data
+ * phase may be short.
+ */
+void set_usb_device_transfer_queue(PTP_USB *ptp_usb, int depth,
+				   unsigned long blocksize)
+{
+  unsigned long packet = ptp_usb->inep_maxpacket;
+
+  if (ptp_usb->outep_maxpacket > packet)
+    packet = ptp_usb->outep_maxpacket;
+  if (depth < 1)
+    depth = 1;
+  if (depth > USB_TRANSFER_QUEUE_MAX)
+    depth = USB_TRANSFER_QUEUE_MAX;
+  if (packet > 0)
+    blocksize -= blocksize % packet;
+  if (blocksize == 0)
+    blocksize = CONTEXT_BLOCK_SIZE;
+  ptp_usb->transfer_queue_depth = depth;
+  ptp_usb->transfer_block_size = blocksize;
+}
+
+void get_usb_device_transfer_queue(PTP_USB *ptp_usb, int *depth,
+				   unsigned long *blocksize)
+{
+  *depth = ptp_usb->transfer_queue_depth;
+  *blocksize = ptp_usb->transfer_block_size;
+}
+
 int guess_usb_speed(PTP_USB *ptp_usb)
 {
   int bytes_per_second;
@@ -80,6 +80,19 @@ static unsigned char *MTPZ_MODULUS;
 static unsigned char *MTPZ_PRIVATE_KEY;
 static char *MTPZ_CERTIFICATES;
 
+/* MTPZ RSA */
+
+typedef struct mtpz_rsa_struct
+{
+	gcry_sexp_t privkey;
+	gcry_sexp_t pubkey;
+} mtpz_rsa_t;
+
+mtpz_rsa_t *mtpz_rsa_init(const unsigned char *modulus, const unsigned char *priv_key, const unsigned char *pub_exp);
+void mtpz_rsa_free(mtpz_rsa_t *);
+int mtpz_rsa_decrypt(int flen, unsigned char *from, int tlen, unsigned char *to, mtpz_rsa_t *rsa);
+int mtpz_rsa_sign(int flen, unsigned char *from, int tlen, unsigned char *to, mtpz_rsa_t *rsa);
+
 // Strip the trailing newline from fgets().
 static char *fgets_strip(char * str, int num, FILE * stream)
 {
@@ -114,10 +127,24 @@ static char *hex_to_bytes(char *hex, size_t len)
 	return bytes;
 }
 
+/*
+ * The file and the RSA key built from it are the same for every device,
+ * so they are loaded once per process: later calls return the first
+ * result. 0 means not tried yet, 1 loaded and -1 failed.
+ */
+static int mtpz_loaded = 0;
+static mtpz_rsa_t *mtpz_rsa = NULL;
+
 int mtpz_loaddata()
 {
-	char *home = getenv("HOME");
+	char *home;
 	int ret = -1;
+
+	if (mtpz_loaded != 0)
+		return (mtpz_loaded > 0) ? 0 : -1;
+	mtpz_loaded = -1;
+
+	home = getenv("HOME");
 	if (!home)
 	{
 		LIBMTP_ERROR("Unable to determine user's home directory, MTPZ disabled.\n");
@@ -185,25 +212,24 @@ int mtpz_loaddata()
 		LIBMTP_ERROR("Unable to parse MTPZ certificates from ~/.mtpz-data, MTPZ disabled.\n");
 		goto cleanup;
 	}
+	free(hexenckey);
+	free(hexcerts);
+
+	// Build the key once, every handshake signs and decrypts with it
+	mtpz_rsa = mtpz_rsa_init(MTPZ_MODULUS, MTPZ_PRIVATE_KEY, MTPZ_PUBLIC_EXPONENT);
+	if (!mtpz_rsa)
+	{
+		LIBMTP_ERROR("Unable to set up the MTPZ RSA key from ~/.mtpz-data, MTPZ disabled.\n");
+		goto cleanup;
+	}
+
 	// If all done without errors, drop the fail
+	mtpz_loaded = 1;
 	ret = 0;
 cleanup:
 	fclose(fdata);
 	return ret;
 }
-/* MTPZ RSA */
-
-typedef struct mtpz_rsa_struct
-{
-	gcry_sexp_t privkey;
-	gcry_sexp_t pubkey;
-} mtpz_rsa_t;
-
-mtpz_rsa_t *mtpz_rsa_init(const unsigned char *modulus, const unsigned char *priv_key, const unsigned char *pub_exp);
-void mtpz_rsa_free(mtpz_rsa_t *);
-int mtpz_rsa_decrypt(int flen, unsigned char *from, int tlen, unsigned char *to, mtpz_rsa_t *rsa);
-int mtpz_rsa_sign(int flen, unsigned char *from, int tlen, unsigned char *to, mtpz_rsa_t *rsa);
-
 /* MTPZ hashing */
 
 #define MTPZ_HASHSTATE_84 5
@@ -218,6 +244,7 @@ static char *mtpz_hash_custom6A5DC(char *, char *, int, int);
 static void mtpz_hash_compute_hash(char *, char *, int);
 static unsigned int mtpz_hash_f(int s, unsigned int x, unsigned int y, unsigned int z);
 static unsigned int mtpz_hash_rotate_left(unsigned int x, int n);
+static void mtpz_hash_sha1(char *, char *, int, char *);
 
 /* MTPZ encryption */
 
@@ -252,6 +279,9 @@ void mtpz_encryption_inv_mix_columns(unsigned char *expanded, int offset, int ro
 void mtpz_encryption_decrypt_custom(unsigned char *data, unsigned char *seed, unsigned char *expanded);
 void mtpz_encryption_encrypt_custom(unsigned char *data, unsigned char *seed, unsigned char *expanded);
 void mtpz_encryption_encrypt_mac(unsigned char *hash, unsigned int hash_length, unsigned char *seed, unsigned int seed_len, unsigned char *out);
+static int mtpz_encryption_gcrypt(unsigned char *key, unsigned int key_len, unsigned char *data, unsigned int data_len, int mode, char encrypt);
+
+static int mtpz_gcrypt_ready(void);
 
 
 static inline uint32_t mtpz_bswap32(uint32_t x)
@@ -267,6 +297,26 @@ static inline uint32_t mtpz_bswap32(uint32_t x)
 }
 
 
+/*
+ * libgcrypt is linked for the RSA part of the handshake anyway, and its
+ * SHA-1 and AES pick AES-NI and the like at runtime. The hash and cipher
+ * below are the reference, used whenever libgcrypt turns a request down.
+ */
+static int mtpz_gcrypt_ready(void)
+{
+	static int ready = 0;
+
+	if (!ready)
+	{
+		if (!gcry_control(GCRYCTL_INITIALIZATION_FINISHED_P))
+			gcry_check_version(NULL);
+		ready = 1;
+	}
+
+	return ready;
+}
+
+
 /* MTPZ RSA implementation */
 mtpz_rsa_t *mtpz_rsa_init(const unsigned char *str_modulus, const unsigned char *str_privkey, const unsigned char *str_pubexp)
 {
@@ -274,19 +324,28 @@ mtpz_rsa_t *mtpz_rsa_init(const unsigned char *str_modulus, const unsigned char
 	if (rsa == NULL)
 		return NULL;
 
-	gcry_mpi_t mpi_modulus, mpi_privkey, mpi_pubexp;
+	gcry_mpi_t mpi_modulus = NULL, mpi_privkey = NULL, mpi_pubexp = NULL;
+	gcry_error_t err = 0;
 
-	gcry_mpi_scan(&mpi_modulus, GCRYMPI_FMT_HEX, str_modulus, 0, NULL);
-	gcry_mpi_scan(&mpi_privkey, GCRYMPI_FMT_HEX, str_privkey, 0, NULL);
-	gcry_mpi_scan(&mpi_pubexp, GCRYMPI_FMT_HEX, str_pubexp, 0, NULL);
+	err |= gcry_mpi_scan(&mpi_modulus, GCRYMPI_FMT_HEX, str_modulus, 0, NULL);
+	err |= gcry_mpi_scan(&mpi_privkey, GCRYMPI_FMT_HEX, str_privkey, 0, NULL);
+	err |= gcry_mpi_scan(&mpi_pubexp, GCRYMPI_FMT_HEX, str_pubexp, 0, NULL);
 
-	gcry_sexp_build(&rsa->privkey, NULL, "(private-key (rsa (n %m) (e %m) (d %m)))", mpi_modulus, mpi_pubexp, mpi_privkey);
-	gcry_sexp_build(&rsa->pubkey, NULL, "(public-key (rsa (n %m) (e %m)))", mpi_modulus, mpi_pubexp);
+	if (!err)
+		err |= gcry_sexp_build(&rsa->privkey, NULL, "(private-key (rsa (n %m) (e %m) (d %m)))", mpi_modulus, mpi_pubexp, mpi_privkey);
+	if (!err)
+		err |= gcry_sexp_build(&rsa->pubkey, NULL, "(public-key (rsa (n %m) (e %m)))", mpi_modulus, mpi_pubexp);
 
 	gcry_mpi_release(mpi_modulus);
 	gcry_mpi_release(mpi_privkey);
 	gcry_mpi_release(mpi_pubexp);
 
+	if (err)
+	{
+		mtpz_rsa_free(rsa);
+		return NULL;
+	}
+
 	return rsa;
 }
 
@@ -294,6 +353,7 @@ void mtpz_rsa_free(mtpz_rsa_t *rsa)
 {
 	gcry_sexp_release(rsa->privkey);
 	gcry_sexp_release(rsa->pubkey);
+	free(rsa);
 }
 
 int mtpz_rsa_decrypt(int flen, unsigned char *from, int tlen, unsigned char *to, mtpz_rsa_t *rsa)
@@ -468,9 +528,7 @@ char *mtpz_hash_custom6A5DC(char *state, char *msg, int len, int a4)
 		k = MTPZ_SWAP(i);
 		*(int *)(v5 + len) = k;
 
-		mtpz_hash_reset_state(state);
-		mtpz_hash_transform_hash(state, v5, len + 4);
-		mtpz_hash_finalize_hash(state, v13 + i * 20);
+		mtpz_hash_sha1(state, v5, len + 4, v13 + i * 20);
 	}
 
 	free(v5); v5 = NULL;
@@ -547,6 +605,20 @@ unsigned int mtpz_hash_rotate_left(unsigned int x, int n)
 	return (x << n) | (x >> (32 - n));
 }
 
+// out has at least 20 bytes of space, state is only used by the fallback
+void mtpz_hash_sha1(char *state, char *msg, int len, char *out)
+{
+	if (mtpz_gcrypt_ready() && gcry_md_test_algo(GCRY_MD_SHA1) == 0)
+	{
+		gcry_md_hash_buffer(GCRY_MD_SHA1, out, msg, len);
+		return;
+	}
+
+	mtpz_hash_reset_state(state);
+	mtpz_hash_transform_hash(state, msg, len);
+	mtpz_hash_finalize_hash(state, out);
+}
+
 /* MTPZ encryption implementation */
 
 void mtpz_encryption_cipher(unsigned char *data, unsigned int len, char encrypt)
@@ -555,6 +627,9 @@ void mtpz_encryption_cipher(unsigned char *data, unsigned int len, char encrypt)
 
 	int offset = 0, count = len;
 
+	if (mtpz_encryption_gcrypt(MTPZ_ENCRYPTION_KEY, 16, data, len, GCRY_CIPHER_MODE_ECB, encrypt) == 0)
+		return;
+
 	if ((count & 0x0F) == 0)
 	{
 		int exp_len = 0;
@@ -574,11 +649,17 @@ void mtpz_encryption_cipher(unsigned char *data, unsigned int len, char encrypt)
 			}
 			while (count != 0);
 		}
+
+		free(expanded);
 	}
 }
 
 void mtpz_encryption_cipher_advanced(unsigned char *key, unsigned int key_len, unsigned char *data, unsigned int data_len, char encrypt)
 {
+	// CBC with a zero IV
+	if (mtpz_encryption_gcrypt(key, key_len, data, data_len, GCRY_CIPHER_MODE_CBC, encrypt) == 0)
+		return;
+
 	int len = (key_len == 16) ? 10 :
 			  (key_len == 24) ? 12 : 32;
 	int exp_len;
@@ -950,11 +1031,6 @@ void mtpz_encryption_encrypt_mac(unsigned char *hash, unsigned int hash_length,
 	}
 
 	{
-		int len = 	(hash_length == 16) ? 10 :
-					(hash_length == 24) ? 12 : 32;
-		int exp_len;
-		unsigned char *expanded = mtpz_encryption_expand_key(hash, hash_length, len, &exp_len);
-
 		unsigned char *actual_seed = (unsigned char *)malloc(16);
 		memset(actual_seed, 0, 16);
 
@@ -979,9 +1055,18 @@ void mtpz_encryption_encrypt_mac(unsigned char *hash, unsigned int hash_length,
 				actual_seed[i] ^= loop2[i];
 		}
 
-		mtpz_encryption_encrypt_custom(out, actual_seed, expanded);
+		memcpy(out, actual_seed, 16);
+		if (mtpz_encryption_gcrypt(hash, hash_length, out, 16, GCRY_CIPHER_MODE_ECB, 1) != 0)
+		{
+			int len = 	(hash_length == 16) ? 10 :
+						(hash_length == 24) ? 12 : 32;
+			int exp_len;
+			unsigned char *expanded = mtpz_encryption_expand_key(hash, hash_length, len, &exp_len);
+
+			mtpz_encryption_encrypt_custom(out, actual_seed, expanded);
+			free(expanded);
+		}
 
-		free(expanded);
 		free(actual_seed);
 	}
 
@@ -989,6 +1074,42 @@ void mtpz_encryption_encrypt_mac(unsigned char *hash, unsigned int hash_length,
 	free(loop2);
 }
 
+/*
+ * Runs AES-128 over data in place through libgcrypt, returns 0 on success
+ * and -1 when the caller has to fall back to the reference cipher. Only
+ * 16 byte keys are handed over: the reference always runs 10 rounds.
+ */
+int mtpz_encryption_gcrypt(unsigned char *key, unsigned int key_len, unsigned char *data, unsigned int data_len, int mode, char encrypt)
+{
+	unsigned char iv[16];
+	gcry_cipher_hd_t hd;
+	gcry_error_t err;
+
+	if (key_len != 16 || (data_len & 0x0F) != 0 || !mtpz_gcrypt_ready())
+		return -1;
+
+	if (gcry_cipher_open(&hd, GCRY_CIPHER_AES128, mode, 0) != 0)
+		return -1;
+
+	err = gcry_cipher_setkey(hd, key, key_len);
+	if (err == 0 && mode == GCRY_CIPHER_MODE_CBC)
+	{
+		memset(iv, 0, sizeof(iv));
+		err = gcry_cipher_setiv(hd, iv, sizeof(iv));
+	}
+	if (err == 0)
+	{
+		if (encrypt)
+			err = gcry_cipher_encrypt(hd, data, data_len, NULL, 0);
+		else
+			err = gcry_cipher_decrypt(hd, data, data_len, NULL, 0);
+	}
+
+	gcry_cipher_close(hd);
+
+	return (err == 0) ? 0 : -1;
+}
+
 
 /* ENCRYPTION CONSTANTS */
 /*
@@ -1546,8 +1667,7 @@ ptp_mtpz_validatehandshakeresponse (PTPParams* params, unsigned char *random, un
 	char *msg_dec = (char *)malloc(128);
 	memset(msg_dec, 0, 128);
 
-	mtpz_rsa_t *rsa = mtpz_rsa_init(MTPZ_MODULUS, MTPZ_PRIVATE_KEY, MTPZ_PUBLIC_EXPONENT);
-	if (!rsa)
+	if (!mtpz_rsa)
 	{
 		LIBMTP_INFO ("(MTPZ) Failure - could not instantiate RSA object.\n");
 		free(message);
@@ -1555,19 +1675,15 @@ ptp_mtpz_validatehandshakeresponse (PTPParams* params, unsigned char *random, un
 		return -1;
 	}
 
-	if (mtpz_rsa_decrypt(128, (unsigned char *)message, 128, (unsigned char *)msg_dec, rsa) == 0)
+	if (mtpz_rsa_decrypt(128, (unsigned char *)message, 128, (unsigned char *)msg_dec, mtpz_rsa) == 0)
 	{
 		LIBMTP_INFO ("(MTPZ) Failure - could not perform RSA decryption.\n");
 
 		free(message);
 		free(msg_dec);
-		mtpz_rsa_free(rsa);
 		return -1;
 	}
 
-	mtpz_rsa_free(rsa);
-	rsa = NULL;
-
 	char *state = mtpz_hash_init_state();
 	char *hash_key = (char *)malloc(16);
 	char *v10 = mtpz_hash_custom6A5DC(state, msg_dec + 21, 107, 20);
@@ -1707,13 +1823,8 @@ ptp_mtpz_makeapplicationcertificatemessage (unsigned int *out_len, unsigned char
 	char *hash = (char *)malloc(20); memset(hash, 0, 20);
 	char *odata = (char *)malloc(128); memset(odata, 0, 128);
 
-	mtpz_hash_reset_state(state);
-	mtpz_hash_transform_hash(state, (char *)acm + 2, (target - acm - 2));
-	mtpz_hash_finalize_hash(state, v16 + 8);
-
-	mtpz_hash_reset_state(state);
-	mtpz_hash_transform_hash(state, v16, 28);
-	mtpz_hash_finalize_hash(state, hash);
+	mtpz_hash_sha1(state, (char *)acm + 2, (target - acm - 2), v16 + 8);
+	mtpz_hash_sha1(state, v16, 28, hash);
 
 	char *v17 = mtpz_hash_custom6A5DC(state, hash, 20, 107);
 
@@ -1738,8 +1849,7 @@ ptp_mtpz_makeapplicationcertificatemessage (unsigned int *out_len, unsigned char
 	free(hash); hash = NULL;
 
 	// Take care of some RSA jazz.
-	mtpz_rsa_t *rsa = mtpz_rsa_init(MTPZ_MODULUS, MTPZ_PRIVATE_KEY, MTPZ_PUBLIC_EXPONENT);
-	if (!rsa)
+	if (!mtpz_rsa)
 	{
 		LIBMTP_INFO("(MTPZ) Failure - could not instantiate RSA object.\n");
 		*out_len = 0;
@@ -1749,10 +1859,9 @@ ptp_mtpz_makeapplicationcertificatemessage (unsigned int *out_len, unsigned char
 
 	char *signature = (char *)malloc(128);
 	memset(signature, 0, 128);
-	mtpz_rsa_sign(128, (unsigned char *)odata, 128, (unsigned char *)signature, rsa);
+	mtpz_rsa_sign(128, (unsigned char *)odata, 128, (unsigned char *)signature, mtpz_rsa);
 
 	// Free some more things.
-	mtpz_rsa_free(rsa); rsa = NULL;
 	free(odata); odata = NULL;
 
 	// Write the signature + bytes.
@@ -69,13 +69,11 @@ static void write_from_spl_text_t(LIBMTP_mtpdevice_t *device, const int fd, text
 static void free_spl_text_t(text_t* p);
 static void print_spl_text_t(text_t* p);
 static uint32_t trackno_spl_text_t(text_t* p);
-static void tracks_from_spl_text_t(text_t* p, uint32_t* tracks, LIBMTP_folder_t* folders, LIBMTP_file_t* files);
-static void spl_text_t_from_tracks(text_t** p, uint32_t* tracks, const uint32_t trackno, const uint32_t ver_major, const uint32_t ver_minor, char* dnse, LIBMTP_folder_t* folders, LIBMTP_file_t* files);
+static void tracks_from_spl_text_t(PTPParams *params, const uint32_t storage, text_t* p, uint32_t* tracks);
+static void spl_text_t_from_tracks(PTPParams *params, text_t** p, uint32_t* tracks, const uint32_t trackno, const uint32_t ver_major, const uint32_t ver_minor, char* dnse);
 
-static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folders, LIBMTP_file_t* files); // TODO add file/dir cached args
-static void discover_filepath_from_id(char** p, uint32_t track, LIBMTP_folder_t* folders, LIBMTP_file_t* files);
-static void find_folder_name(LIBMTP_folder_t* folders, uint32_t* id, char** name);
-static uint32_t find_folder_id(LIBMTP_folder_t* folders, uint32_t parent, char* name);
+static uint32_t discover_id_from_filepath(PTPParams *params, const uint32_t storage, const char* s);
+static void discover_filepath_from_id(PTPParams *params, char** p, uint32_t track);
 
 static void append_text_t(text_t** t, char* s);
 
@@ -152,17 +150,12 @@ void spl_to_playlist_t(LIBMTP_mtpdevice_t* device, PTPObjectInfo *oi,
   text_t* p = read_into_spl_text_t(device, fd);
   close(fd);
 
-  // FIXME cache these somewhere else so we don't keep calling this!
-  LIBMTP_folder_t *folders;
-  LIBMTP_file_t *files;
-  folders = LIBMTP_Get_Folder_List(device);
-  files = LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
-
-  // convert the playlist listing to track ids
+  // convert the playlist listing to track ids, the paths are
+  // looked up in the object cache
   pl->no_tracks = trackno_spl_text_t(p);
   LIBMTP_PLST_DEBUG("%u track%s found\n", pl->no_tracks, pl->no_tracks==1?"":"s");
   pl->tracks = malloc(sizeof(uint32_t)*(pl->no_tracks));
-  tracks_from_spl_text_t(p, pl->tracks, folders, files);
+  tracks_from_spl_text_t((PTPParams *) device->params, oi->StorageID, p, pl->tracks);
 
   free_spl_text_t(p);
 
@@ -183,10 +176,6 @@ int playlist_t_to_spl(LIBMTP_mtpdevice_t *device,
                       LIBMTP_playlist_t * const pl)
 {
   text_t* t;
-  LIBMTP_folder_t *folders;
-  LIBMTP_file_t *files;
-  folders = LIBMTP_Get_Folder_List(device);
-  files = LIBMTP_Get_Filelisting_With_Callback(device, NULL, NULL);
 
   char tmpname[] = "/tmp/mtp-spl2pl-XXXXXX"; // must be a var since mkstemp modifies it
 
@@ -213,7 +202,7 @@ int playlist_t_to_spl(LIBMTP_mtpdevice_t *device,
   LIBMTP_PLST_DEBUG(".spl version %d.%02d\n", ver_major, ver_minor);
 
   // create the text for the playlist
-  spl_text_t_from_tracks(&t, pl->tracks, pl->no_tracks, ver_major, ver_minor, NULL, folders, files);
+  spl_text_t_from_tracks((PTPParams *) device->params, &t, pl->tracks, pl->no_tracks, ver_major, ver_minor, NULL);
   write_from_spl_text_t(device, fd, t);
   free_spl_text_t(t); // done with the text
 
@@ -550,23 +539,23 @@ static uint32_t trackno_spl_text_t(text_t* p) {
  * Find the track ids for this playlist's files.
  * (ie: \Music\song.mp3 -> 12345)
  *
+ * @param params the PTP parameters of the device
+ * @param storage the storage the paths are on, 0 for any
  * @param p the text to search
  * @param tracks returned list of track id's for the playlist_t, must be large
  *               enough to accomodate all the tracks as reported by
  *               trackno_spl_text_t()
- * @param folders the folders list for the device
- * @param fiels the files list for the device
  * @see spl_to_playlist_t()
  */
-static void tracks_from_spl_text_t(text_t* p,
-                                   uint32_t* tracks,
-                                   LIBMTP_folder_t* folders,
-                                   LIBMTP_file_t* files)
+static void tracks_from_spl_text_t(PTPParams *params,
+                                   const uint32_t storage,
+                                   text_t* p,
+                                   uint32_t* tracks)
 {
   uint32_t c = 0;
   while(p != NULL) {
     if(p->text[0] == '\\' ) {
-      tracks[c] = discover_id_from_filepath(p->text, folders, files);
+      tracks[c] = discover_id_from_filepath(params, storage, p->text);
       LIBMTP_PLST_DEBUG("track %d = %s (%u)\n", c+1, p->text, tracks[c]);
       c++;
     }
@@ -579,20 +568,18 @@ static void tracks_from_spl_text_t(text_t* p,
  * Find the track names (including path) for this playlist's track ids.
  * (ie: 12345 -> \Music\song.mp3)
  *
+ * @param params the PTP parameters of the device
  * @param p the text to search
  * @param tracks list of track id's to look up
- * @param folders the folders list for the device
- * @param fiels the files list for the device
  * @see playlist_t_to_spl()
  */
-static void spl_text_t_from_tracks(text_t** p,
+static void spl_text_t_from_tracks(PTPParams *params,
+                                   text_t** p,
                                    uint32_t* tracks,
                                    const uint32_t trackno,
                                    const uint32_t ver_major,
                                    const uint32_t ver_minor,
-                                   char* dnse,
-                                   LIBMTP_folder_t* folders,
-                                   LIBMTP_file_t* files)
+                                   char* dnse)
 {
 
   // HEADER
@@ -610,7 +597,7 @@ static void spl_text_t_from_tracks(text_t** p,
   unsigned int i;
   char* f;
   for(i=0;i<trackno;i++) {
-    discover_filepath_from_id(&f, tracks[i], folders, files);
+    discover_filepath_from_id(params, &f, tracks[i]);
 
     if(f != NULL) {
       append_text_t(&c, f);
@@ -649,59 +636,48 @@ static void spl_text_t_from_tracks(text_t** p,
  * Find the track names (including path) given a fileid
  * (ie: 12345 -> \Music\song.mp3)
  *
+ * @param params the PTP parameters of the device
  * @param p returns the file path (ie: \Music\song.mp3),
  *          (*p) == NULL if the look up fails
  * @param track track id to look up
- * @param folders the folders list for the device
- * @param files the files list for the device
  * @see spl_text_t_from_tracks()
  */
 
 // returns p = NULL on failure, else the filepath to the track including track name, allocated as a correct length string
-static void discover_filepath_from_id(char** p,
-                                      uint32_t track,
-                                      LIBMTP_folder_t* folders,
-                                      LIBMTP_file_t* files)
+static void discover_filepath_from_id(PTPParams *params,
+                                      char** p,
+                                      uint32_t track)
 {
   // fill in a string from the right side since we don't know the root till the end
   const int M = 1024;
   char w[M];
   char* iw = w + M; // iterator on w
+  uint32_t id = track;
+  PTPObject *ob;
+  size_t len;
 
   // in case of failure return NULL string
   *p = NULL;
 
-
-  // find the right file
-  while(files != NULL && files->item_id != track) {
-    files = files->next;
-  }
-  // if we didn't find a matching file, abort
-  if(files == NULL)
-    return;
-
-  // stuff the filename into our string
-  // FIXME: check for string overflow before it occurs
-  iw = iw - (strlen(files->filename) +1); // leave room for '\0' at the end
-  strcpy(iw,files->filename);
-
-  // next follow the directories to the root
-  // prepending folders to the path as we go
-  uint32_t id = files->parent_id;
-  char* f = NULL;
+  // follow the object and its folders up to the root in the object
+  // cache, prepending each name to the path as we go
+  iw--;
+  iw[0] = '\0';
   while(id != 0) {
-    find_folder_name(folders, &id, &f);
-    if(f == NULL) return; // fail if the next part of the path couldn't be found
-    iw = iw - (strlen(f) +1);
-    // FIXME: check for string overflow before it occurs
-    strcpy(iw, f);
-    iw[strlen(f)] = '\\';
-    free(f);
+    if(ptp_object_want(params, id, PTPOBJECT_OBJECTINFO_LOADED, &ob) != PTP_RC_OK ||
+       ob->oi.Filename == NULL)
+      return; // fail if the next part of the path couldn't be found
+    len = strlen(ob->oi.Filename);
+    if(len + 1 > (size_t) (iw - w))
+      return; // the path does not fit
+    iw = iw - len;
+    memcpy(iw, ob->oi.Filename, len);
+    iw--;
+    iw[0] = '\\';
+    id = ob->oi.ParentObject;
   }
-
-  // prepend a slash
-  iw--;
-  iw[0] = '\\';
+  if(iw[0] != '\\')
+    return; // track 0 is no file
 
   // now allocate a string of the right length to be returned
   *p = strdup(iw);
@@ -712,123 +688,49 @@ static void discover_filepath_from_id(char** p,
  * Find the track id given a track's name (including path)
  * (ie: \Music\song.mp3 -> 12345)
  *
+ * Each part of the path is looked up among the children of the folder
+ * found so far with the filename index of the object cache.
+ *
+ * @param params the PTP parameters of the device
+ * @param storage the storage the path is on, 0 for any
  * @param s file path to look up (ie: \Music\song.mp3),
  *          (*p) == NULL if the look up fails
- * @param folders the folders list for the device
- * @param files the files list for the device
  * @return track id, 0 means failure
  * @see tracks_from_spl_text_t()
  */
-static uint32_t discover_id_from_filepath(const char* s, LIBMTP_folder_t* folders, LIBMTP_file_t* files)
+static uint32_t discover_id_from_filepath(PTPParams *params, const uint32_t storage, const char* s)
 {
   // abort if this isn't a path
   if(s[0] != '\\')
     return 0;
 
-  unsigned int i;
   uint32_t id = 0;
   char* sc = strdup(s);
-  char* sci = sc +1; // iterator
-  // skip leading slash in path
-
-  // convert all \ to \0
-  size_t len = strlen(s);
-  for(i=0;i<len;i++) {
-    if(sc[i] == '\\') {
-      sc[i] = '\0';
-    }
-  }
+  char* sci = sc +1; // iterator, skip leading slash in path
+  char* next;
 
-  // now for each part of the string, find the id
-  while(sci != sc + len +1) {
-    // if its the last part of the string, its the filename
-    if(sci + strlen(sci) == sc + len) {
-
-      while(files != NULL) {
-        // check parent matches id and name matches sci
-        if( (files->parent_id == id) &&
-            (strcmp(files->filename, sci) == 0) ) { // found it!
-          id = files->item_id;
-          break;
-        }
-        files = files->next;
-      }
-    }
-    else { // otherwise its part of the directory path
-      id = find_folder_id(folders, id, sci);
-    }
+  if(sc == NULL)
+    return 0;
 
+  // now for each part of the string, find the id
+  while(sci != NULL) {
+    next = strchr(sci, '\\');
+    if(next != NULL)
+      *next++ = '\0';
+    id = ptp_object_find_child(params, storage, id, sci);
+    if(id == 0)
+      break;
     // move to next folder/file
-    sci += strlen(sci) +1;
+    sci = next;
   }
 
   // release our copied string
   free(sc);
 
-  // FIXME check that we actually have a file
-
   return id;
 }
 
 
-
-/**
- * Find the folder name given the folder's id.
- *
- * @param folders the folders list for the device
- * @param id the folder_id to look up, returns the folder's parent folder_id
- * @param name returns the name of the folder or NULL on failure
- * @see discover_filepath_from_id()
- */
-static void find_folder_name(LIBMTP_folder_t* folders, uint32_t* id, char** name)
-{
-
-  // FIXME this function is exactly LIBMTP_Find_Folder
-
-  LIBMTP_folder_t* f = LIBMTP_Find_Folder(folders, *id);
-  if(f == NULL) {
-    *name = NULL;
-  }
-  else { // found it!
-    *name = strdup(f->name);
-    *id = f->parent_id;
-  }
-}
-
-
-/**
- * Find the folder id given the folder's name and parent id.
- *
- * @param folders the folders list for the device
- * @param parent the folder's parent's id
- * @param name the name of the folder
- * @return the folder_id or 0 on failure
- * @see discover_filepath_from_id()
- */
-static uint32_t find_folder_id(LIBMTP_folder_t* folders, uint32_t parent, char* name) {
-
-  if(folders == NULL)
-    return 0;
-
-  // found it!
-  else if( (folders->parent_id == parent) &&
-           (strcmp(folders->name, name) == 0) )
-    return folders->folder_id;
-
-  // no luck so far, search both siblings and children
-  else {
-    uint32_t id = 0;
-
-    if(folders->sibling != NULL)
-      id = find_folder_id(folders->sibling, parent, name);
-    if( (id == 0) && (folders->child != NULL) )
-      id = find_folder_id(folders->child, parent, name);
-
-    return id;
-  }
-}
-
-
 /**
  * Append a string to a linked-list of strings.
  *
@@ -125,6 +125,56 @@ dtoh64ap (PTPParams *params, const unsigned char *a)
 #define dtoh32(x)	dtoh32p(params,x)
 #define dtoh64(x)	dtoh64p(params,x)
 
+/*
+ * Loops over many values look at the byte order once, and take it from
+ * a local the compiler can hoist out, not from params.
+ */
+#define dtoh16a_bo(le,a)	((le)?le16atoh(a):be16atoh(a))
+#define dtoh32a_bo(le,a)	((le)?le32atoh(a):be32atoh(a))
+
+/*
+ * Whole arrays of 16, 32 and 64 bit values. Data in the byte order of
+ * the host is copied as it is, data in the other one swapped in a loop
+ * of its own.
+ */
+#ifdef WORDS_BIGENDIAN
+#define PTP_DL_HOST		PTP_DL_BE
+#define ptp_swap16a(a)		le16atoh(a)
+#define ptp_swap32a(a)		le32atoh(a)
+#define ptp_swap64a(a)		le64atoh(a)
+#else
+#define PTP_DL_HOST		PTP_DL_LE
+#define ptp_swap16a(a)		be16atoh(a)
+#define ptp_swap32a(a)		be32atoh(a)
+#define ptp_swap64a(a)		be64atoh(a)
+#endif
+
+static inline void
+ptp_unpack_u16s (PTPParams *params, uint16_t *dst, const unsigned char *src, uint32_t n)
+{
+	uint32_t	i;
+
+	if (params->byteorder == PTP_DL_HOST) {
+		memcpy (dst, src, n*sizeof(uint16_t));
+		return;
+	}
+	for (i=0;i<n;i++)
+		dst[i] = ptp_swap16a(&src[i*sizeof(uint16_t)]);
+}
+
+static inline void
+ptp_unpack_u32s (PTPParams *params, uint32_t *dst, const unsigned char *src, uint32_t n)
+{
+	uint32_t	i;
+
+	if (params->byteorder == PTP_DL_HOST) {
+		memcpy (dst, src, n*sizeof(uint32_t));
+		return;
+	}
+	for (i=0;i<n;i++)
+		dst[i] = ptp_swap32a(&src[i*sizeof(uint32_t)]);
+}
+
 
 /*
  * PTP strings ... if the size field is:
@@ -135,17 +185,14 @@ dtoh64ap (PTPParams *params, const unsigned char *a)
  * len - in ptp string characters currently
  */
 static inline int
-ptp_unpack_string(PTPParams *params, unsigned char* data, uint32_t offset, uint32_t total, uint8_t *len, char **retstr)
+ptp_unpack_string_local(PTPParams *params, unsigned char* data, uint32_t offset, uint32_t total, uint8_t *len, char *loclstr, size_t *loclen)
 {
 	uint8_t length;
 	uint16_t string[PTP_MAXSTRLEN+1];
-	/* allow for UTF-8: max of 3 bytes per UCS-2 char, plus final null */
-	char loclstr[PTP_MAXSTRLEN*3+1];
 	size_t nconv, srclen, destlen;
 	char *src, *dest;
 
 	*len = 0;
-	*retstr = NULL;
 
 	if (offset + 1 > total)
 		return 0;
@@ -153,7 +200,8 @@ ptp_unpack_string(PTPParams *params, unsigned char* data, uint32_t offset, uint3
 	length = dtoh8a(&data[offset]);	/* PTP_MAXSTRLEN == 255, 8 bit len */
 	if (length == 0) {		/* nothing to do? */
 		*len = 0;
-		*retstr = strdup("");	/* return an empty string, not NULL */
+		loclstr[0] = '\0';	/* return an empty string, not NULL */
+		*loclen = 0;
 		return 1;
 	}
 
@@ -162,6 +210,15 @@ ptp_unpack_string(PTPParams *params, unsigned char* data, uint32_t offset, uint3
 
 	*len = length;
 
+	/*
+	 * The locale of libmtp is always UTF-8 (see the iconv_open() of
+	 * cd_ucs2_to_locale), which is quicker done without iconv(3).
+	 */
+	if (params->byteorder == PTP_DL_LE) {
+		*loclen = ptp_utf16le_to_utf8(&data[offset+1], length, loclstr);
+		return 1;
+	}
+
 	/* copy to string[] to ensure correct alignment for iconv(3) */
 	memcpy(string, &data[offset+1], length * sizeof(string[0]));
 	string[length] = 0x0000U;   /* be paranoid!  add a terminator. */
@@ -171,7 +228,7 @@ ptp_unpack_string(PTPParams *params, unsigned char* data, uint32_t offset, uint3
 	src = (char *)string;
 	srclen = length * sizeof(string[0]);
 	dest = loclstr;
-	destlen = sizeof(loclstr)-1;
+	destlen = PTP_MAXSTRLEN*3;
 	nconv = (size_t)-1;
 #if defined(HAVE_ICONV) && defined(HAVE_LANGINFO_H)
 	if (params->cd_ucs2_to_locale != (iconv_t)-1)
@@ -189,8 +246,24 @@ ptp_unpack_string(PTPParams *params, unsigned char* data, uint32_t offset, uint3
 		dest = loclstr+length;
 	}
 	*dest = '\0';
-	loclstr[sizeof(loclstr)-1] = '\0';   /* be safe? */
-	*retstr = strdup(loclstr);
+	loclstr[PTP_MAXSTRLEN*3] = '\0';   /* be safe? */
+	*loclen = strlen(loclstr);
+	return 1;
+}
+
+static inline int
+ptp_unpack_string(PTPParams *params, unsigned char* data, uint32_t offset, uint32_t total, uint8_t *len, char **retstr)
+{
+	/* allow for UTF-8: max of 3 bytes per UCS-2 char, plus final null */
+	char loclstr[PTP_MAXSTRLEN*3+1];
+	size_t loclen;
+
+	*retstr = NULL;
+	if (!ptp_unpack_string_local(params, data, offset, total, len, loclstr, &loclen))
+		return 0;
+	*retstr = malloc(loclen+1);
+	if (*retstr)
+		memcpy(*retstr, loclstr, loclen+1);
 	return 1;
 }
 
@@ -282,7 +355,7 @@ ptp_get_packed_stringcopy(PTPParams *params, char *string, uint32_t *packed_size
 static inline uint32_t
 ptp_unpack_uint32_t_array(PTPParams *params, unsigned char* data, unsigned int offset, unsigned int datalen, uint32_t **array)
 {
-	uint32_t n, i=0;
+	uint32_t n;
 
 	if (!data)
 		return 0;
@@ -308,8 +381,7 @@ ptp_unpack_uint32_t_array(PTPParams *params, unsigned char* data, unsigned int o
 	*array = malloc (n*sizeof(uint32_t));
 	if (!*array)
 		return 0;
-	for (i=0;i<n;i++)
-		(*array)[i]=dtoh32a(&data[offset+(sizeof(uint32_t)*(i+1))]);
+	ptp_unpack_u32s (params, *array, &data[offset+sizeof(uint32_t)], n);
 	return n;
 }
 
@@ -330,7 +402,7 @@ ptp_pack_uint32_t_array(PTPParams *params, uint32_t *array, uint32_t arraylen, u
 static inline uint32_t
 ptp_unpack_uint16_t_array(PTPParams *params, unsigned char* data, unsigned int offset, unsigned int datalen, uint16_t **array)
 {
-	uint32_t n, i=0;
+	uint32_t n;
 
 	if (!data)
 		return 0;
@@ -353,8 +425,7 @@ ptp_unpack_uint16_t_array(PTPParams *params, unsigned char* data, unsigned int o
 	*array = malloc (n*sizeof(uint16_t));
 	if (!*array)
 		return 0;
-	for (i=0;i<n;i++)
-		(*array)[i]=dtoh16a(&data[offset+(sizeof(uint16_t)*(i+2))]);
+	ptp_unpack_u16s (params, *array, &data[offset+sizeof(uint32_t)], n);
 	return n;
 }
 
@@ -557,6 +628,41 @@ ptp_unpack_OH (PTPParams *params, unsigned char* data, PTPObjectHandles *oh, uns
 	}
 }
 
+/*
+ * Like ptp_unpack_OH(), but the handles are decoded where they are, in
+ * the malloc()ed data, which then becomes oh->Handler. On success
+ * *data is NULL, otherwise it stays with the caller. The handles move
+ * down over the count in front of them, so that the array starts where
+ * the block does, and are swapped on the way if they need to be.
+ */
+static inline void
+ptp_unpack_OH_inplace (PTPParams *params, unsigned char **data, PTPObjectHandles *oh, unsigned int len)
+{
+	unsigned char	*d = *data;
+	uint32_t	*handles;
+	uint32_t	n, i;
+
+	oh->n = 0;
+	oh->Handler = NULL;
+	if (!d || len < sizeof(uint32_t))
+		return;
+	n = dtoh32a(d);
+	if (!n || n > (len - sizeof(uint32_t))/sizeof(uint32_t)) {
+		if (n)
+			ptp_debug (params ,"array runs over datalen bufferend (%u handles in %u bytes)", n, len);
+		return;
+	}
+	handles = (uint32_t*)d;
+	if (params->byteorder == PTP_DL_HOST)
+		memmove (handles, d + sizeof(uint32_t), n*sizeof(uint32_t));
+	else
+		for (i=0;i<n;i++)
+			handles[i] = ptp_swap32a(&d[(i+1)*sizeof(uint32_t)]);
+	oh->n = n;
+	oh->Handler = handles;
+	*data = NULL;
+}
+
 /* StoreIDs array pack/unpack */
 
 #define PTP_sids			 0
@@ -809,7 +915,8 @@ ptp_unpack_OI (PTPParams *params, unsigned char* data, PTPObjectInfo *oi, unsign
 	*offset += sizeof(target);		\
 }
 
-#define RARR(val,member,func)	{			\
+/* The elements are checked to fit up front, so the loops just convert */
+#define RARR(val,member,lefunc,befunc)	{		\
 	unsigned int n,j;				\
 	if (total - *offset < sizeof(uint32_t))		\
 		return 0;				\
@@ -818,13 +925,18 @@ ptp_unpack_OI (PTPParams *params, unsigned char* data, PTPObjectInfo *oi, unsign
 							\
 	if (n >= UINT_MAX/sizeof(val->a.v[0]))		\
 		return 0;				\
-	if (n > (total - (*offset))/sizeof(val->a.v[0]))\
+	if (n > (total - (*offset))/sizeof(val->a.v[0].member))\
 		return 0;				\
 	val->a.count = n;				\
 	val->a.v = malloc(sizeof(val->a.v[0])*n);	\
 	if (!val->a.v) return 0;			\
-	for (j=0;j<n;j++)				\
-		CTVAL(val->a.v[j].member, func);	\
+	if (params->byteorder == PTP_DL_LE)		\
+		for (j=0;j<n;j++)			\
+			val->a.v[j].member = lefunc(&data[*offset+j*sizeof(val->a.v[0].member)]);\
+	else						\
+		for (j=0;j<n;j++)			\
+			val->a.v[j].member = befunc(&data[*offset+j*sizeof(val->a.v[0].member)]);\
+	*offset += n*sizeof(val->a.v[0].member);	\
 }
 
 static inline unsigned int
@@ -873,28 +985,28 @@ ptp_unpack_DPV (
 
 
 	case PTP_DTC_AINT8:
-		RARR(value,i8,dtoh8a);
+		RARR(value,i8,dtoh8a,dtoh8a);
 		break;
 	case PTP_DTC_AUINT8:
-		RARR(value,u8,dtoh8a);
+		RARR(value,u8,dtoh8a,dtoh8a);
 		break;
 	case PTP_DTC_AUINT16:
-		RARR(value,u16,dtoh16a);
+		RARR(value,u16,le16atoh,be16atoh);
 		break;
 	case PTP_DTC_AINT16:
-		RARR(value,i16,dtoh16a);
+		RARR(value,i16,le16atoh,be16atoh);
 		break;
 	case PTP_DTC_AUINT32:
-		RARR(value,u32,dtoh32a);
+		RARR(value,u32,le32atoh,be32atoh);
 		break;
 	case PTP_DTC_AINT32:
-		RARR(value,i32,dtoh32a);
+		RARR(value,i32,le32atoh,be32atoh);
 		break;
 	case PTP_DTC_AUINT64:
-		RARR(value,u64,dtoh64a);
+		RARR(value,u64,le64atoh,be64atoh);
 		break;
 	case PTP_DTC_AINT64:
-		RARR(value,i64,dtoh64a);
+		RARR(value,i64,le64atoh,be64atoh);
 		break;
 	/* XXX: other int types are unimplemented */
 	/* XXX: other int arrays are unimplemented also */
@@ -1385,60 +1497,52 @@ ptp_pack_DPV (PTPParams *params, PTPPropertyValue* value, unsigned char** dpvptr
 	return size;
 }
 
-#define MAX_MTP_PROPS 127
+/*
+ * The list takes any number of properties, each value is packed into
+ * its place in one buffer. Returns 0 if out of memory.
+ */
 static inline uint32_t
 ptp_pack_OPL (PTPParams *params, MTPProperties *props, int nrofprops, unsigned char** opldataptr)
 {
-	unsigned char* opldata;
-	MTPProperties *propitr;
-	unsigned char *packedprops[MAX_MTP_PROPS];
-	uint32_t packedpropslens[MAX_MTP_PROPS];
-	uint32_t packedobjecthandles[MAX_MTP_PROPS];
-	uint16_t packedpropsids[MAX_MTP_PROPS];
-	uint16_t packedpropstypes[MAX_MTP_PROPS];
-	uint32_t totalsize = 0;
-	uint32_t bufp = 0;
-	uint32_t noitems = 0;
-	uint32_t i;
-
+	unsigned char*	opldata;
+	unsigned char*	dpv;
+	uint32_t	totalsize;
+	uint32_t	bufp = 0;
+	uint32_t	dpvlen;
+	int		i;
+
+	*opldataptr = NULL;
 	totalsize = sizeof(uint32_t); /* 4 bytes to store the number of elements */
-	propitr = props;
-	while (nrofprops-- && noitems < MAX_MTP_PROPS) {
-		/* Object Handle */
-		packedobjecthandles[noitems]=propitr->ObjectHandle;
-		totalsize += sizeof(uint32_t); /* Object ID */
-		/* Metadata type */
-		packedpropsids[noitems]=propitr->property;
-		totalsize += sizeof(uint16_t);
-		/* Data type */
-		packedpropstypes[noitems]= propitr->datatype;
-		totalsize += sizeof(uint16_t);
-		/* Add each property to be sent. */
-	        packedpropslens[noitems] = ptp_pack_DPV (params, &propitr->propval, &packedprops[noitems], propitr->datatype);
-		totalsize += packedpropslens[noitems];
-		noitems ++;
-		propitr ++;
-	}
-
-	/* Allocate memory for the packed property list */
 	opldata = malloc(totalsize);
-
-	htod32a(&opldata[bufp],noitems);
+	if (!opldata)
+		return 0;
+	htod32a(&opldata[bufp],nrofprops);
 	bufp += 4;
 
-	/* Copy into a nice packed list */
-	for (i = 0; i < noitems; i++) {
-		/* Object ID */
-		htod32a(&opldata[bufp],packedobjecthandles[i]);
+	for (i = 0; i < nrofprops; i++) {
+		unsigned char	*newdata;
+
+		dpv = NULL;
+		dpvlen = ptp_pack_DPV (params, &props[i].propval, &dpv, props[i].datatype);
+		/* Object ID, metadata type and data type, then the value */
+		totalsize += sizeof(uint32_t) + 2*sizeof(uint16_t) + dpvlen;
+		newdata = realloc(opldata, totalsize);
+		if (!newdata) {
+			free(dpv);
+			free(opldata);
+			return 0;
+		}
+		opldata = newdata;
+		htod32a(&opldata[bufp],props[i].ObjectHandle);
 		bufp += sizeof(uint32_t);
-		htod16a(&opldata[bufp],packedpropsids[i]);
+		htod16a(&opldata[bufp],props[i].property);
 		bufp += sizeof(uint16_t);
-		htod16a(&opldata[bufp],packedpropstypes[i]);
+		htod16a(&opldata[bufp],props[i].datatype);
 		bufp += sizeof(uint16_t);
-		/* The copy the actual property */
-		memcpy(&opldata[bufp], packedprops[i], packedpropslens[i]);
-		bufp += packedpropslens[i];
-		free(packedprops[i]);
+		if (dpvlen)
+			memcpy(&opldata[bufp], dpv, dpvlen);
+		bufp += dpvlen;
+		free(dpv);
 	}
 	*opldataptr = opldata;
 	return totalsize;
@@ -1458,6 +1562,7 @@ ptp_unpack_OPL (PTPParams *params, unsigned char* data, MTPProperties **pprops,
 	uint32_t prop_count;
 	MTPProperties *props = NULL;
 	unsigned int offset = 0, i;
+	int le;
 
 	if (len < sizeof(uint32_t)) {
 		ptp_debug (params ,"must have at least 4 bytes data, not %d", len);
@@ -1479,6 +1584,7 @@ ptp_unpack_OPL (PTPParams *params, unsigned char* data, MTPProperties **pprops,
 	len -= sizeof(uint32_t);
 	props = malloc(prop_count * sizeof(MTPProperties));
 	if (!props) return 0;
+	le = (params->byteorder == PTP_DL_LE);
 	for (i = 0; i < prop_count; i++) {
 		if (len <= (sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint16_t))) {
 			ptp_debug (params ,"short MTP Object Property List at property %d (of %d)", i, prop_count);
@@ -1490,15 +1596,15 @@ ptp_unpack_OPL (PTPParams *params, unsigned char* data, MTPProperties **pprops,
 		}
 
 
-		props[i].ObjectHandle = dtoh32a(data);
+		props[i].ObjectHandle = dtoh32a_bo(le, data);
 		data += sizeof(uint32_t);
 		len -= sizeof(uint32_t);
 
-		props[i].property = dtoh16a(data);
+		props[i].property = dtoh16a_bo(le, data);
 		data += sizeof(uint16_t);
 		len -= sizeof(uint16_t);
 
-		props[i].datatype = dtoh16a(data);
+		props[i].datatype = dtoh16a_bo(le, data);
 		data += sizeof(uint16_t);
 		len -= sizeof(uint16_t);
 
@@ -1517,6 +1623,78 @@ ptp_unpack_OPL (PTPParams *params, unsigned char* data, MTPProperties **pprops,
 	return prop_count;
 }
 
+/*
+ * Work out how many bytes the packed value of the given datatype at
+ * data occupies, without unpacking it. Used by the streaming OPL
+ * reader to know how much of a record it still has to wait for.
+ * Returns 1 if *size is the full size, 0 if *size is only the number
+ * of bytes needed before the full size can be told, and -1 for
+ * datatypes ptp_unpack_DPV() cannot handle.
+ */
+static inline int
+ptp_DPV_size (PTPParams *params, unsigned char* data, unsigned int len, uint16_t datatype, unsigned int *size)
+{
+	unsigned int elsize;
+	uint32_t n;
+
+	switch (datatype) {
+	case PTP_DTC_INT8:
+	case PTP_DTC_UINT8:
+		*size = 1;
+		return 1;
+	case PTP_DTC_INT16:
+	case PTP_DTC_UINT16:
+		*size = 2;
+		return 1;
+	case PTP_DTC_INT32:
+	case PTP_DTC_UINT32:
+		*size = 4;
+		return 1;
+	case PTP_DTC_INT64:
+	case PTP_DTC_UINT64:
+		*size = 8;
+		return 1;
+	case PTP_DTC_INT128:
+	case PTP_DTC_UINT128:
+		*size = 16;
+		return 1;
+	case PTP_DTC_AINT8:
+	case PTP_DTC_AUINT8:
+		elsize = 1;
+		break;
+	case PTP_DTC_AINT16:
+	case PTP_DTC_AUINT16:
+		elsize = 2;
+		break;
+	case PTP_DTC_AINT32:
+	case PTP_DTC_AUINT32:
+		elsize = 4;
+		break;
+	case PTP_DTC_AINT64:
+	case PTP_DTC_AUINT64:
+		elsize = 8;
+		break;
+	case PTP_DTC_STR:
+		if (len < 1) {
+			*size = 1;
+			return 0;
+		}
+		*size = 1 + dtoh8a(data)*2;
+		return 1;
+	default:
+		return -1;
+	}
+	if (len < sizeof(uint32_t)) {
+		*size = sizeof(uint32_t);
+		return 0;
+	}
+	n = dtoh32a(data);
+	if (n >= (UINT_MAX - sizeof(uint32_t))/elsize)
+		return -1;
+	*size = sizeof(uint32_t) + n*elsize;
+	return 1;
+}
+
 /*
     PTP USB Event container unpack
     Copyright (c) 2003 Nikolai Kopanygin
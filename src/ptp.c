@@ -85,6 +85,7 @@ static uint16_t ptp_exit_recv_memory_handler (PTPDataHandler*,unsigned char**,un
 static uint16_t ptp_init_recv_memory_handler(PTPDataHandler*);
 static uint16_t ptp_init_send_memory_handler(PTPDataHandler*,unsigned char*,unsigned long len);
 static uint16_t ptp_exit_send_memory_handler (PTPDataHandler *handler);
+static int ptp_rewind_memory_handler (PTPDataHandler *handler);
 
 void
 ptp_debug (PTPParams *params, const char *format, ...)
@@ -120,6 +121,70 @@ ptp_error (PTPParams *params, const char *format, ...)
         va_end (args);
 }
 
+/*
+ * Converts up to n UTF-16LE code units at src to UTF-8 at dst, which
+ * must have room for 3*n+1 bytes, stopping at a 0 code unit. Surrogate
+ * pairs become one 4 byte sequence, unpaired surrogates U+FFFD.
+ * Returns the number of bytes written, not counting the terminator.
+ * Not part of ptp-pack.c, which the USB glue includes as well.
+ *
+ * Almost all file names are plain ASCII, so the units are looked at
+ * four at a time first and copied right away while they are.
+ */
+size_t
+ptp_utf16le_to_utf8 (const unsigned char *src, unsigned int n, char *dst)
+{
+	/* the bits that must be clear in four ASCII units, in memory order */
+	static const unsigned char notascii[8] = { 0x80, 0xff, 0x80, 0xff, 0x80, 0xff, 0x80, 0xff };
+	uint64_t	mask, w;
+	char		*d = dst;
+	unsigned int	i = 0, c, c2;
+
+	memcpy(&mask, notascii, sizeof(mask));
+	while (i + 4 <= n) {
+		memcpy(&w, &src[2*i], sizeof(w));
+		if (w & mask)
+			break;
+		d[0] = src[2*i]; d[1] = src[2*i+2]; d[2] = src[2*i+4]; d[3] = src[2*i+6];
+		if (!d[0] || !d[1] || !d[2] || !d[3])
+			break;	/* the terminator is found below */
+		d += 4;
+		i += 4;
+	}
+	for (; i < n; i++) {
+		c = src[2*i] | (src[2*i+1] << 8);
+		if (c == 0)
+			break;
+		if (c < 0x80) {
+			*d++ = c;
+			continue;
+		}
+		if (c < 0x800) {
+			*d++ = 0xc0 | (c >> 6);
+			*d++ = 0x80 | (c & 0x3f);
+			continue;
+		}
+		if (c >= 0xd800 && c < 0xe000) {
+			c2 = (i + 1 < n) ? (src[2*i+2] | (src[2*i+3] << 8)) : 0;
+			if (c < 0xdc00 && c2 >= 0xdc00 && c2 < 0xe000) {
+				c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+				*d++ = 0xf0 | (c >> 18);
+				*d++ = 0x80 | ((c >> 12) & 0x3f);
+				*d++ = 0x80 | ((c >> 6) & 0x3f);
+				*d++ = 0x80 | (c & 0x3f);
+				i++;
+				continue;
+			}
+			c = 0xfffd;
+		}
+		*d++ = 0xe0 | (c >> 12);
+		*d++ = 0x80 | ((c >> 6) & 0x3f);
+		*d++ = 0x80 | (c & 0x3f);
+	}
+	*d = '\0';
+	return d - dst;
+}
+
 /* Pack / unpack functions */
 
 #include "ptp-pack.c"
@@ -154,17 +219,14 @@ ptp_error (PTPParams *params, const char *format, ...)
  * Upon success PTPContainer* ptp contains PTP Response Phase container with
  * all fields filled in.
  **/
-uint16_t
-ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
+static uint16_t
+ptp_transaction_run (PTPParams* params, PTPContainer* ptp,
 		     uint16_t flags, uint64_t sendlen,
 		     PTPDataHandler *handler
 ) {
 	int 		tries;
 	uint16_t	cmd;
 
-	if ((params==NULL) || (ptp==NULL))
-		return PTP_ERROR_BADPARAM;
-
 	cmd = ptp->Code;
 	ptp->Transaction_ID=params->transaction_id++;
 	ptp->SessionID=params->session_id;
@@ -233,6 +295,470 @@ ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
 	return ptp->Code;
 }
 
+static uint64_t
+ptp_time_us (void)
+{
+	struct timeval	tv;
+
+	gettimeofday (&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+/* The statistics of an opcode, added in order if it is new. */
+static PTPOpcodeStats *
+ptp_opcode_stats (PTPParams *params, uint16_t opcode)
+{
+	PTPStats	*stats = &params->stats;
+	PTPOpcodeStats	*newops;
+	unsigned int	lo = 0, hi = stats->nrofopcodes;
+
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+
+		if (stats->opcodes[mid].opcode == opcode)
+			return &stats->opcodes[mid];
+		if (stats->opcodes[mid].opcode < opcode)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	newops = realloc (stats->opcodes, sizeof(PTPOpcodeStats)*(stats->nrofopcodes+1));
+	if (!newops)
+		return NULL;
+	stats->opcodes = newops;
+	memmove (&newops[lo+1], &newops[lo], sizeof(PTPOpcodeStats)*(stats->nrofopcodes-lo));
+	memset (&newops[lo], 0, sizeof(PTPOpcodeStats));
+	newops[lo].opcode = opcode;
+	stats->nrofopcodes++;
+	return &newops[lo];
+}
+
+static void
+ptp_record_transaction (PTPParams *params, uint16_t opcode, uint16_t ret,
+			uint64_t usecs, uint64_t bytes_in, uint64_t bytes_out)
+{
+	PTPOpcodeStats	*ops;
+	unsigned int	bucket = 0;
+
+	ptp_lock (params, PTP_LOCK_STATS);
+	params->stats.transactions++;
+	if (ret == PTP_ERROR_TIMEOUT)
+		params->stats.timeouts++;
+	ops = ptp_opcode_stats (params, opcode);
+	if (!ops)
+		goto out;
+	ops->transactions++;
+	if (ret != PTP_RC_OK)
+		ops->errors++;
+	/* a reset during the transaction took the bytes back to 0 */
+	if (params->stats.bytes_in >= bytes_in)
+		ops->bytes_in += params->stats.bytes_in - bytes_in;
+	if (params->stats.bytes_out >= bytes_out)
+		ops->bytes_out += params->stats.bytes_out - bytes_out;
+	ops->total_us += usecs;
+	while (bucket < PTP_STATS_LATENCY_BUCKETS-1 && (usecs >> (bucket+1)))
+		bucket++;
+	ops->latency[bucket]++;
+out:
+	ptp_lock (params, PTP_UNLOCK_STATS);
+}
+
+/**
+ * ptp_reset_stats:
+ * params:	PTPParams*
+ *
+ * Clears the transaction statistics of the device.
+ **/
+void
+ptp_reset_stats (PTPParams* params)
+{
+	ptp_lock (params, PTP_LOCK_STATS);
+	free (params->stats.opcodes);
+	memset (&params->stats, 0, sizeof(params->stats));
+	ptp_lock (params, PTP_UNLOCK_STATS);
+}
+
+/* A data handler wrapped so that params->data_func sees the data */
+typedef struct {
+	PTPParams	*params;
+	PTPDataHandler	*handler;
+	PTPDataHandler	watched;
+} PTPDataWatch;
+
+static uint16_t
+ptp_watch_getfunc (PTPParams* params, void* priv, unsigned long wantlen,
+		   unsigned char *data, unsigned long *gotlen)
+{
+	PTPDataWatch	*w = (PTPDataWatch*)priv;
+	uint16_t	ret;
+
+	ret = w->handler->getfunc (params, w->handler->priv, wantlen, data, gotlen);
+	if (ret == PTP_RC_OK && *gotlen)
+		w->params->data_func (w->params, w->params->data_data,
+				      PTP_DATA_BLOCK, NULL, 0, data, *gotlen);
+	return ret;
+}
+
+static uint16_t
+ptp_watch_putfunc (PTPParams* params, void* priv, unsigned long sendlen,
+		   unsigned char *data)
+{
+	PTPDataWatch	*w = (PTPDataWatch*)priv;
+	uint16_t	ret;
+
+	ret = w->handler->putfunc (params, w->handler->priv, sendlen, data);
+	if (ret == PTP_RC_OK && sendlen)
+		w->params->data_func (w->params, w->params->data_data,
+				      PTP_DATA_BLOCK, NULL, 0, data, sendlen);
+	return ret;
+}
+
+static unsigned char *
+ptp_watch_getbuffunc (PTPParams* params, void* priv, unsigned long ahead,
+		      unsigned long wantlen)
+{
+	PTPDataWatch	*w = (PTPDataWatch*)priv;
+
+	return w->handler->getbuffunc (params, w->handler->priv, ahead, wantlen);
+}
+
+/* Returns the handler to use for the data phase of ptp */
+static PTPDataHandler *
+ptp_watch_handler (PTPParams* params, PTPContainer* ptp, uint16_t flags,
+		   PTPDataHandler *handler, PTPDataWatch *w)
+{
+	if (!params->data_func || !handler ||
+	    (flags & PTP_DP_DATA_MASK) == PTP_DP_NODATA ||
+	    !params->data_func (params, params->data_data, PTP_DATA_BEGIN,
+				ptp, 0, NULL, 0))
+		return handler;
+	w->params = params;
+	w->handler = handler;
+	w->watched.getfunc = handler->getfunc ? ptp_watch_getfunc : NULL;
+	w->watched.putfunc = handler->putfunc ? ptp_watch_putfunc : NULL;
+	w->watched.getbuffunc = handler->getbuffunc ? ptp_watch_getbuffunc : NULL;
+	w->watched.priv = w;
+	return &w->watched;
+}
+
+/* Errors of the transport rather than answers of the device */
+static int
+ptp_transport_error (uint16_t ret)
+{
+	switch (ret) {
+	case PTP_ERROR_IO:
+	case PTP_ERROR_TIMEOUT:
+	case PTP_ERROR_DATA_EXPECTED:
+	case PTP_ERROR_RESP_EXPECTED:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Operations that only read, so they can be done again after a failure */
+static int
+ptp_operation_idempotent (uint16_t opcode)
+{
+	switch (opcode) {
+	case PTP_OC_GetDeviceInfo:
+	case PTP_OC_GetStorageIDs:
+	case PTP_OC_GetStorageInfo:
+	case PTP_OC_GetNumObjects:
+	case PTP_OC_GetObjectHandles:
+	case PTP_OC_GetObjectInfo:
+	case PTP_OC_GetObject:
+	case PTP_OC_GetThumb:
+	case PTP_OC_GetDevicePropDesc:
+	case PTP_OC_GetDevicePropValue:
+	case PTP_OC_GetPartialObject:
+	case PTP_OC_MTP_GetObjectPropsSupported:
+	case PTP_OC_MTP_GetObjectPropDesc:
+	case PTP_OC_MTP_GetObjectPropValue:
+	case PTP_OC_MTP_GetObjPropList:
+	case PTP_OC_MTP_GetObjectReferences:
+	case PTP_OC_ANDROID_GetPartialObject64:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* A data handler wrapped so that a retry knows whether data got through */
+typedef struct {
+	PTPDataHandler	*handler;
+	unsigned long	delivered;
+	PTPDataHandler	counted;
+} PTPDataCount;
+
+static uint16_t
+ptp_count_putfunc (PTPParams* params, void* priv, unsigned long sendlen,
+		   unsigned char *data)
+{
+	PTPDataCount	*c = (PTPDataCount*)priv;
+	uint16_t	ret;
+
+	ret = c->handler->putfunc (params, c->handler->priv, sendlen, data);
+	if (ret == PTP_RC_OK)
+		c->delivered += sendlen;
+	return ret;
+}
+
+static unsigned char *
+ptp_count_getbuffunc (PTPParams* params, void* priv, unsigned long ahead,
+		      unsigned long wantlen)
+{
+	PTPDataCount	*c = (PTPDataCount*)priv;
+
+	return c->handler->getbuffunc (params, c->handler->priv, ahead, wantlen);
+}
+
+/* Whether a failed transaction can be done again: the transport has to
+ * know how to recover, and the data handler mustn't have seen data yet
+ * unless it can start over */
+static int
+ptp_retry_possible (PTPParams* params, uint16_t opcode, uint16_t flags,
+		    PTPDataCount *count)
+{
+	if (!params->recover_func || !ptp_operation_idempotent (opcode))
+		return 0;
+	if ((flags & PTP_DP_DATA_MASK) != PTP_DP_GETDATA || !count->delivered)
+		return 1;
+	if (!ptp_rewind_memory_handler (count->handler))
+		return 0;
+	count->delivered = 0;
+	return 1;
+}
+
+/* Whether a transaction of ptp_transaction_async() is still underway */
+static int
+ptp_transaction_pending (PTPParams* params)
+{
+	int	pending;
+
+	ptp_lock (params, PTP_LOCK_EVENTS);
+	pending = params->transaction_pending;
+	ptp_lock (params, PTP_UNLOCK_EVENTS);
+	return pending;
+}
+
+static void
+ptp_set_transaction_pending (PTPParams* params, int pending)
+{
+	ptp_lock (params, PTP_LOCK_EVENTS);
+	params->transaction_pending = pending;
+	ptp_lock (params, PTP_UNLOCK_EVENTS);
+}
+
+/*
+ * An idempotent operation that fails in the transport is done again, up
+ * to params->retries times, each time after params->recover_func got
+ * the transport back in step and an exponentially growing delay. Too
+ * many failures in a row, or one the transport can't recover from,
+ * mark the link dead and fail all later transactions at once.
+ */
+uint16_t
+ptp_transaction_new (PTPParams* params, PTPContainer* ptp,
+		     uint16_t flags, uint64_t sendlen,
+		     PTPDataHandler *handler
+) {
+	uint16_t	ret, opcode;
+	uint64_t	start, usecs, bytes_in, bytes_out;
+	PTPContainer	request;
+	PTPDataCount	count;
+	PTPDataWatch	watch;
+	PTPDataHandler	*counted = handler, *watched;
+	unsigned int	tries = 0, delay;
+
+	if ((params==NULL) || (ptp==NULL))
+		return PTP_ERROR_BADPARAM;
+
+	/* one transaction at a time, the transaction ID tells them apart */
+	ptp_lock (params, PTP_LOCK_TRANSACTION);
+	if (params->link_dead) {
+		ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+		return PTP_ERROR_IO;
+	}
+	if (ptp_transaction_pending (params)) {
+		ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+		return PTP_RC_DeviceBusy;
+	}
+	/* ptp holds the response afterwards, a retry starts from request */
+	opcode = ptp->Code;
+	request = *ptp;
+	delay = params->retry_delay;
+	count.handler = handler;
+	count.delivered = 0;
+	if (handler && handler->putfunc &&
+	    (flags & PTP_DP_DATA_MASK) == PTP_DP_GETDATA) {
+		count.counted.getfunc = NULL;
+		count.counted.putfunc = ptp_count_putfunc;
+		count.counted.getbuffunc = handler->getbuffunc ? ptp_count_getbuffunc : NULL;
+		count.counted.priv = &count;
+		counted = &count.counted;
+	}
+	while (1) {
+		if (params->transaction_func)
+			params->transaction_func (params, params->transaction_data, opcode, 0, 0, 0);
+		ptp_lock (params, PTP_LOCK_STATS);
+		bytes_in = params->stats.bytes_in;
+		bytes_out = params->stats.bytes_out;
+		ptp_lock (params, PTP_UNLOCK_STATS);
+		start = ptp_time_us ();
+		watched = ptp_watch_handler (params, ptp, flags, counted, &watch);
+		ret = ptp_transaction_run (params, ptp, flags, sendlen, watched);
+		if (watched != counted)
+			params->data_func (params, params->data_data, PTP_DATA_END,
+					   ptp, ret, NULL, 0);
+		usecs = ptp_time_us () - start;
+		ptp_record_transaction (params, opcode, ret, usecs, bytes_in, bytes_out);
+		if (params->transaction_func)
+			params->transaction_func (params, params->transaction_data, opcode, 1, ret, usecs);
+		if (!ptp_transport_error (ret)) {
+			params->failures = 0;
+			break;
+		}
+		params->failures++;
+		if (params->max_failures && params->failures >= params->max_failures) {
+			ptp_error (params, "PTP: %u transport failures in a row, giving up on the device",
+				   params->failures);
+			params->link_dead = 1;
+			break;
+		}
+		if (tries >= params->retries ||
+		    !ptp_retry_possible (params, opcode, flags, &count))
+			break;
+		if (params->recover_func (params, ret) != PTP_RC_OK) {
+			ptp_error (params, "PTP: could not recover from error 0x%04x, giving up on the device",
+				   ret);
+			params->link_dead = 1;
+			break;
+		}
+		tries++;
+		ptp_lock (params, PTP_LOCK_STATS);
+		params->stats.retries++;
+		ptp_lock (params, PTP_UNLOCK_STATS);
+		ptp_debug (params, "PTP: 0x%04x failed with 0x%04x, retry %u in %u ms",
+			   opcode, ret, tries, delay);
+		usleep (delay * 1000);
+		delay *= 2;
+		if (delay > params->retry_delay_max)
+			delay = params->retry_delay_max;
+		*ptp = request;
+	}
+	ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+	return ret;
+}
+
+/* What ptp_transaction_async() keeps until the transaction is done */
+typedef struct {
+	PTPTransactionDoneFunc	done;
+	void			*data;
+	uint16_t		opcode;
+	uint64_t		start, bytes_in, bytes_out;
+	PTPDataWatch		watch;
+	int			watching;
+} PTPAsyncTransaction;
+
+static void
+ptp_transaction_async_done (PTPParams* params, PTPContainer* resp,
+			    uint16_t ret, void *data)
+{
+	PTPAsyncTransaction	*at = (PTPAsyncTransaction*)data;
+	uint64_t		usecs = ptp_time_us () - at->start;
+
+	if (at->watching)
+		params->data_func (params, params->data_data, PTP_DATA_END,
+				   resp, ret, NULL, 0);
+	ptp_record_transaction (params, at->opcode, ret, usecs, at->bytes_in, at->bytes_out);
+	if (params->transaction_func)
+		params->transaction_func (params, params->transaction_data, at->opcode, 1, ret, usecs);
+	/* done may well start the next one */
+	ptp_set_transaction_pending (params, 0);
+	at->done (params, resp, ret, at->data);
+	free (at);
+}
+
+/**
+ * ptp_transaction_async:
+ * params:	PTPParams*
+ * 		PTPContainer* ptp	- general ptp container
+ * 		uint16_t flags		- lower 8 bits - data phase description
+ * 		uint64_t sendlen	- senddata phase data length
+ * 		PTPDataHandler*		- data phase source or sink
+ * 		PTPTransactionDoneFunc	- called with the response
+ * 		void* data		- passed on to done
+ *
+ * Starts a transaction like ptp_transaction_new() without waiting for
+ * it. The data layer calls done once the response is in, from its own
+ * event handling; the handler has to stay valid until then. Only one
+ * such transaction can be underway, and until done is called other
+ * transactions, blocking or not, fail with PTP_RC_DeviceBusy.
+ *
+ * Return values: Some PTP_RC_* code. If it is not PTP_RC_OK the
+ * transaction was not started and done is not called.
+ **/
+uint16_t
+ptp_transaction_async (PTPParams* params, PTPContainer* ptp,
+		       uint16_t flags, uint64_t sendlen,
+		       PTPDataHandler *handler,
+		       PTPTransactionDoneFunc done, void *data
+) {
+	PTPAsyncTransaction	*at;
+	PTPDataHandler		*watched;
+	uint16_t		ret;
+
+	if ((params==NULL) || (ptp==NULL) || (done==NULL))
+		return PTP_ERROR_BADPARAM;
+	if (!params->transaction_async_func)
+		return PTP_RC_OperationNotSupported;
+	at = calloc (1, sizeof(PTPAsyncTransaction));
+	if (!at)
+		return PTP_RC_GeneralError;
+	at->done = done;
+	at->data = data;
+	at->opcode = ptp->Code;
+
+	ptp_lock (params, PTP_LOCK_TRANSACTION);
+	if (params->link_dead) {
+		ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+		free (at);
+		return PTP_ERROR_IO;
+	}
+	if (ptp_transaction_pending (params)) {
+		ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+		free (at);
+		return PTP_RC_DeviceBusy;
+	}
+	if (params->transaction_func)
+		params->transaction_func (params, params->transaction_data, at->opcode, 0, 0, 0);
+	ptp_lock (params, PTP_LOCK_STATS);
+	at->bytes_in = params->stats.bytes_in;
+	at->bytes_out = params->stats.bytes_out;
+	ptp_lock (params, PTP_UNLOCK_STATS);
+	at->start = ptp_time_us ();
+	ptp->Transaction_ID=params->transaction_id++;
+	ptp->SessionID=params->session_id;
+	watched = ptp_watch_handler (params, ptp, flags, handler, &at->watch);
+	at->watching = (watched != handler);
+	/* set first, done can come on another thread before this returns */
+	ptp_set_transaction_pending (params, 1);
+	ret = params->transaction_async_func (params, ptp, flags, sendlen, watched,
+					      ptp_transaction_async_done, at);
+	if (ret != PTP_RC_OK) {
+		ptp_set_transaction_pending (params, 0);
+		if (at->watching)
+			params->data_func (params, params->data_data, PTP_DATA_END,
+					   ptp, ret, NULL, 0);
+		params->transaction_id--;
+		if (params->transaction_func)
+			params->transaction_func (params, params->transaction_data, at->opcode, 1, ret, 0);
+		free (at);
+	}
+	ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+	return ret;
+}
+
 /* memory data get/put handler */
 typedef struct {
 	unsigned char	*data;
@@ -262,10 +788,23 @@ memory_putfunc(PTPParams* params, void* private,
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)private;
 
 	if (priv->curoff + sendlen > priv->size) {
-		priv->data = realloc (priv->data, priv->curoff+sendlen);
-		if (!priv->data)
+		unsigned long newsize = priv->size * 2;
+		unsigned char *newdata;
+
+		if (newsize < priv->curoff + sendlen)
+			newsize = priv->curoff + sendlen;
+		/* Allocate the whole data phase at once if we know its length
+		 * and it is what the caller expects */
+		if (params && params->data_phase_length > newsize &&
+		    params->data_phase_length <= ULONG_MAX &&
+		    (params->data_phase_expected == 0 ||
+		     params->data_phase_length == params->data_phase_expected))
+			newsize = params->data_phase_length;
+		newdata = realloc (priv->data, newsize);
+		if (!newdata)
 			return PTP_RC_GeneralError;
-		priv->size = priv->curoff + sendlen;
+		priv->data = newdata;
+		priv->size = newsize;
 	}
 	memcpy (priv->data + priv->curoff, data, sendlen);
 	priv->curoff += sendlen;
@@ -283,6 +822,7 @@ ptp_init_recv_memory_handler(PTPDataHandler *handler)
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = NULL;
 	priv->size = 0;
 	priv->curoff = 0;
@@ -303,12 +843,23 @@ ptp_init_send_memory_handler(PTPDataHandler *handler,
 	handler->priv = priv;
 	handler->getfunc = memory_getfunc;
 	handler->putfunc = memory_putfunc;
+	handler->getbuffunc = NULL;
 	priv->data = data;
 	priv->size = len;
 	priv->curoff = 0;
 	return PTP_RC_OK;
 }
 
+/* start a memory handler over, returns 0 if it is none */
+static int
+ptp_rewind_memory_handler (PTPDataHandler *handler)
+{
+	if (handler->putfunc != memory_putfunc)
+		return 0;
+	((PTPMemHandlerPrivate*)handler->priv)->curoff = 0;
+	return 1;
+}
+
 /* free private struct + data */
 static uint16_t
 ptp_exit_send_memory_handler (PTPDataHandler *handler)
@@ -326,7 +877,7 @@ ptp_exit_recv_memory_handler (PTPDataHandler *handler,
 ) {
 	PTPMemHandlerPrivate* priv = (PTPMemHandlerPrivate*)handler->priv;
 	*data = priv->data;
-	*size = priv->size;
+	*size = priv->curoff;
 	free (priv);
 	return PTP_RC_OK;
 }
@@ -375,6 +926,7 @@ ptp_init_fd_handler(PTPDataHandler *handler, int fd)
 	handler->priv = priv;
 	handler->getfunc = fd_getfunc;
 	handler->putfunc = fd_putfunc;
+	handler->getbuffunc = NULL;
 	priv->fd = fd;
 	return PTP_RC_OK;
 }
@@ -1376,6 +1928,7 @@ ptp_opensession (PTPParams* params, uint32_t session)
 	/* zero out response packet buffer */
 	params->response_packet = NULL;
 	params->response_packet_size = 0;
+	params->data_phase_length = 0;
 	/* no split headers */
 	params->split_header_data = 0;
 
@@ -1490,9 +2043,7 @@ ptp_free_params (PTPParams *params)
 
 	free (params->cameraname);
 	free (params->wifi_profiles);
-	for (i=0;i<params->nrofobjects;i++)
-		ptp_free_object (&params->objects[i]);
-	free (params->objects);
+	ptp_free_objects (params);
 	free (params->storageids.Storage);
 	free (params->events);
 	for (i=0;i<params->nrofcanon_props;i++) {
@@ -1506,6 +2057,12 @@ ptp_free_params (PTPParams *params)
 		ptp_free_devicepropdesc (&params->deviceproperties[i].desc);
 	free (params->deviceproperties);
 
+	for (i=0;i<params->nrofobjectpropcache;i++)
+		free (params->objectpropcache[i].data);
+	free (params->objectpropcache);
+	free (params->objecttiergroups);
+	free (params->stats.opcodes);
+
 	ptp_free_DI (&params->deviceinfo);
 }
 
@@ -1592,7 +2149,8 @@ ptp_getobjecthandles (PTPParams* params, uint32_t storage,
 	PTP_CNT_INIT(ptp, PTP_OC_GetObjectHandles, storage, objectformatcode, associationOH);
 	ret=ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &size);
 	if (ret == PTP_RC_OK) {
-		ptp_unpack_OH(params, data, objecthandles, size);
+		/* the response buffer becomes the handle array */
+		ptp_unpack_OH_inplace(params, &data, objecthandles, size);
 	} else {
 		if (	(storage == 0xffffffff) &&
 			(objectformatcode == 0) &&
@@ -1807,6 +2365,28 @@ ptp_getobject_to_handler (PTPParams* params, uint32_t handle, PTPDataHandler *ha
 	return ptp_transaction_new(params, &ptp, PTP_DP_GETDATA, 0, handler);
 }
 
+/**
+ * ptp_getobject_to_handler_async:
+ * params:	PTPParams*
+ *		handle			- Object handle
+ *		PTPDataHandler*		- pointer datahandler
+ *		PTPTransactionDoneFunc	- called when the object is in
+ *		void* data		- passed on to done
+ *
+ * Non-blocking ptp_getobject_to_handler(), see ptp_transaction_async().
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_getobject_to_handler_async (PTPParams* params, uint32_t handle, PTPDataHandler *handler,
+				PTPTransactionDoneFunc done, void *data)
+{
+	PTPContainer ptp;
+
+	PTP_CNT_INIT(ptp, PTP_OC_GetObject, handle);
+	return ptp_transaction_async(params, &ptp, PTP_DP_GETDATA, 0, handler, done, data);
+}
+
 /**
  * ptp_getobject_tofd:
  * params:	PTPParams*
@@ -1926,6 +2506,28 @@ ptp_getthumb (PTPParams* params, uint32_t handle, unsigned char** object, unsign
 	return ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, object, len);
 }
 
+/**
+ * ptp_getthumb_async:
+ * params:	PTPParams*
+ *		handle			- Object handle
+ *		handler			- data sink of the thumbnail
+ *		done			- called with the response
+ *		data			- passed on to done
+ *
+ * Non-blocking GetThumb into a data handler, see ptp_transaction_async().
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_getthumb_async (PTPParams* params, uint32_t handle, PTPDataHandler *handler,
+		    PTPTransactionDoneFunc done, void *data)
+{
+	PTPContainer ptp;
+
+	PTP_CNT_INIT(ptp, PTP_OC_GetThumb, handle);
+	return ptp_transaction_async(params, &ptp, PTP_DP_GETDATA, 0, handler, done, data);
+}
+
 /**
  * ptp_nikon_getlargethumb:
  * params:	PTPParams*
@@ -2086,6 +2688,74 @@ ptp_sendobjectinfo (PTPParams* params, uint32_t* store,
 	return ret;
 }
 
+/* The packed ObjectInfo of ptp_sendobjectinfo_async() while it is sent */
+typedef struct {
+	PTPTransactionDoneFunc	done;
+	void			*data;
+	unsigned char		*oidata;
+	PTPDataHandler		handler;
+} PTPAsyncObjectInfo;
+
+static void
+ptp_sendobjectinfo_async_done (PTPParams* params, PTPContainer* resp,
+			       uint16_t ret, void *data)
+{
+	PTPAsyncObjectInfo	*ao = (PTPAsyncObjectInfo*)data;
+
+	ptp_exit_send_memory_handler (&ao->handler);
+	free (ao->oidata);
+	ao->done (params, resp, ret, ao->data);
+	free (ao);
+}
+
+/**
+ * ptp_sendobjectinfo_async:
+ * params:	PTPParams*
+ *		uint32_t store		- destination StorageID on Responder
+ *		uint32_t parenthandle	- Parent ObjectHandle on responder
+ * 		PTPObjectInfo* objectinfo- ObjectInfo that is to be sent
+ *		PTPTransactionDoneFunc	- called with the response
+ *		void* data		- passed on to done
+ *
+ * Non-blocking ptp_sendobjectinfo(), see ptp_transaction_async(). The
+ * ObjectInfo is packed right away; the response passed to done holds
+ * the StorageID, parent ObjectHandle and new ObjectHandle in Param1-3.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_sendobjectinfo_async (PTPParams* params, uint32_t store,
+			  uint32_t parenthandle, PTPObjectInfo* objectinfo,
+			  PTPTransactionDoneFunc done, void *data)
+{
+	PTPContainer		ptp;
+	PTPAsyncObjectInfo	*ao;
+	uint32_t		size;
+	uint16_t		ret;
+
+	ao = calloc (1, sizeof(PTPAsyncObjectInfo));
+	if (!ao)
+		return PTP_RC_GeneralError;
+	ao->done = done;
+	ao->data = data;
+	size = ptp_pack_OI(params, objectinfo, &ao->oidata);
+	ret = ptp_init_send_memory_handler (&ao->handler, ao->oidata, size);
+	if (ret != PTP_RC_OK) {
+		free (ao->oidata);
+		free (ao);
+		return ret;
+	}
+	PTP_CNT_INIT(ptp, PTP_OC_SendObjectInfo, store, parenthandle);
+	ret = ptp_transaction_async(params, &ptp, PTP_DP_SENDDATA, size, &ao->handler,
+				    ptp_sendobjectinfo_async_done, ao);
+	if (ret != PTP_RC_OK) {
+		ptp_exit_send_memory_handler (&ao->handler);
+		free (ao->oidata);
+		free (ao);
+	}
+	return ret;
+}
+
 /**
  * ptp_sendobject:
  * params:	PTPParams*
@@ -2126,6 +2796,28 @@ ptp_sendobject_from_handler (PTPParams* params, PTPDataHandler *handler, uint64_
 	return ptp_transaction_new(params, &ptp, PTP_DP_SENDDATA, size, handler);
 }
 
+/**
+ * ptp_sendobject_from_handler_async:
+ * params:	PTPParams*
+ *		PTPDataHandler*         - where the object is read from
+ *              uint64_t size           - File/object size
+ *		PTPTransactionDoneFunc	- called when the object is sent
+ *		void* data		- passed on to done
+ *
+ * Non-blocking ptp_sendobject_from_handler(), see ptp_transaction_async().
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_sendobject_from_handler_async (PTPParams* params, PTPDataHandler *handler, uint64_t size,
+				   PTPTransactionDoneFunc done, void *data)
+{
+	PTPContainer ptp;
+
+	PTP_CNT_INIT(ptp, PTP_OC_SendObject);
+	return ptp_transaction_async(params, &ptp, PTP_DP_SENDDATA, size, handler, done, data);
+}
+
 
 /**
  * ptp_sendobject_fromfd:
@@ -2643,7 +3335,7 @@ ptp_add_event (PTPParams *params, PTPContainer *evt)
 /* FIXME: incomplete ... needs storage mode retrieval support too (storage == 0xffffffff) */
 static uint16_t
 ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
-	unsigned int	k, i, j, last, changed;
+	unsigned int	k, i;
 	PTPCANONFolderEntry *tmp = NULL;
 	unsigned int	nroftmp = 0;
 	uint16_t	ret;
@@ -2667,7 +3359,6 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 		storageids.Storage = malloc(sizeof(storageids.Storage[0]));
 		storageids.Storage[0] = storage;
 	}
-	last = changed = 0;
 
 	for (k=0;k<storageids.n;k++) {
 		if ((storageids.Storage[k] & 0xffff) == 0) {
@@ -2685,58 +3376,40 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 		}
 		/* convert read entries into objectinfos */
 		for (i=0;i<nroftmp;i++) {
-			PTPObject	*newobs;
-
-			ob = NULL;
-			for (j=0;j<params->nrofobjects;j++) {
-				if (params->objects[(last+j)%params->nrofobjects].oid == tmp[i].ObjectHandle)  {
-					ob = &params->objects[(last+j)%params->nrofobjects];
-					break;
-				}
-			}
-			if (j == params->nrofobjects) {
-				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d,j=%d)", tmp[i].ObjectHandle, params->nrofobjects,j);
-				newobs = realloc (params->objects,sizeof(PTPObject)*(params->nrofobjects+1));
-				if (!newobs) {
+			if (ptp_object_find (params, tmp[i].ObjectHandle, &ob) != PTP_RC_OK) {
+				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d)", tmp[i].ObjectHandle, params->nrofobjects);
+				if (ptp_object_find_or_insert (params, tmp[i].ObjectHandle, &ob) != PTP_RC_OK) {
 					free (tmp);
 					free (storageids.Storage);
 					return PTP_RC_GeneralError;
 				}
-				params->objects = newobs;
-				memset (&params->objects[params->nrofobjects],0,sizeof(params->objects[params->nrofobjects]));
-				params->objects[params->nrofobjects].oid   = tmp[i].ObjectHandle;
-				params->objects[params->nrofobjects].flags = 0;
 
-				params->objects[params->nrofobjects].oi.StorageID = storageids.Storage[k];
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_STORAGEID_LOADED;
+				ob->oi.StorageID = storageids.Storage[k];
+				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 				if (handle == 0xffffffff)
-					params->objects[params->nrofobjects].oi.ParentObject = 0;
+					ob->oi.ParentObject = 0;
 				else
-					params->objects[params->nrofobjects].oi.ParentObject = handle;
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
-				params->objects[params->nrofobjects].oi.Filename = strdup(tmp[i].Filename);
-				params->objects[params->nrofobjects].oi.ObjectFormat = tmp[i].ObjectFormatCode;
+					ob->oi.ParentObject = handle;
+				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+				ob->oi.Filename = ptp_cache_strdup(params, tmp[i].Filename);
+				ptp_object_name_changed (params, ob);
+				ob->oi.ObjectFormat = tmp[i].ObjectFormatCode;
 
 				ptp_debug (params, "   flags %x", tmp[i].Flags);
 				if (tmp[i].Flags & 0x1)
-					params->objects[params->nrofobjects].oi.ProtectionStatus = PTP_PS_ReadOnly;
+					ob->oi.ProtectionStatus = PTP_PS_ReadOnly;
 				else
-					params->objects[params->nrofobjects].oi.ProtectionStatus = PTP_PS_NoProtection;
-				params->objects[params->nrofobjects].canon_flags = tmp[i].Flags;
-				params->objects[params->nrofobjects].oi.ObjectCompressedSize = tmp[i].ObjectSize;
-				params->objects[params->nrofobjects].oi.CaptureDate = tmp[i].Time;
-				params->objects[params->nrofobjects].oi.ModificationDate = tmp[i].Time;
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_OBJECTINFO_LOADED;
-
-				/*debug_objectinfo(params, tmp[i].ObjectHandle, &params->objects[params->nrofobjects].oi);*/
-				last = params->nrofobjects;
-				params->nrofobjects++;
-				changed = 1;
+					ob->oi.ProtectionStatus = PTP_PS_NoProtection;
+				ob->canon_flags = tmp[i].Flags;
+				ob->oi.ObjectCompressedSize = tmp[i].ObjectSize;
+				ob->oi.CaptureDate = tmp[i].Time;
+				ob->oi.ModificationDate = tmp[i].Time;
+				ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
+
+				/*debug_objectinfo(params, tmp[i].ObjectHandle, &ob->oi);*/
 			} else {
-				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d,j=%d)", tmp[i].ObjectHandle, params->nrofobjects,j);
-				ob = &params->objects[(last+j)%params->nrofobjects];
-				/* for speeding up search */
-				last = (last+j)%params->nrofobjects;
+				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d)", tmp[i].ObjectHandle, params->nrofobjects);
+				ptp_objects_changed (params);
 				if (handle != PTP_HANDLER_SPECIAL) {
 					ob->oi.ParentObject = handle;
 					ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
@@ -2749,9 +3422,7 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 		}
 		free (tmp);
 	}
-	if (changed) ptp_objects_sort (params);
 
-	/* Do not cache ob, it might be reallocated and have a new address */
 	if (handle != 0xffffffff) {
 		ret = ptp_object_want (params, handle, PTPOBJECT_OBJECTINFO_LOADED, &ob);
 		if (ret == PTP_RC_OK)
@@ -2761,12 +3432,11 @@ ptp_list_folder_eos (PTPParams *params, uint32_t storage, uint32_t handle) {
 	return PTP_RC_OK;
 }
 
-uint16_t
-ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle) {
-	unsigned int		i, changed, last;
+static uint16_t
+ptp_list_folder_nolock (PTPParams *params, uint32_t storage, uint32_t handle) {
+	unsigned int		i;
 	uint16_t		ret;
 	uint32_t		xhandle = handle;
-	PTPObject		*newobs;
 	PTPObjectHandles	handles;
 
 	ptp_debug (params, "(storage=0x%08x, handle=0x%08x)", storage, handle);
@@ -2809,37 +3479,16 @@ ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle) {
 		if (ret != PTP_RC_OK || !numoifs)
 			goto fallback;
 
-		last = changed = 0;
 		for (i=0;i<numoifs;i++) {
 			PTPObject	*ob;
-			unsigned int	j;
 
-			ob = NULL;
-			for (j=0;j<params->nrofobjects;j++) {
-				if (params->objects[(last+j)%params->nrofobjects].oid == oifs[i].ObjectHandle)  {
-					ob = &params->objects[(last+j)%params->nrofobjects];
-					break;
-				}
-			}
-			if (j == params->nrofobjects) {
-				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d,j=%d)", oifs[i].ObjectHandle, params->nrofobjects,j);
-				newobs = realloc (params->objects,sizeof(PTPObject)*(params->nrofobjects+1));
-				if (!newobs) {
-					free (oifs);
-					return PTP_RC_GeneralError;
-				}
-				params->objects = newobs;
-				memset (&params->objects[params->nrofobjects],0,sizeof(params->objects[params->nrofobjects]));
-				params->objects[params->nrofobjects].oid = oifs[i].ObjectHandle;
-				params->objects[params->nrofobjects].flags = 0;
-				ob = &params->objects[params->nrofobjects];
-				params->nrofobjects++;
-				changed = 1;
-			} else {
-				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d,j=%d)", oifs[i].ObjectHandle, params->nrofobjects,j);
-				ob = &params->objects[(last+j)%params->nrofobjects];
-				/* for speeding up search */
-				last = (last+j)%params->nrofobjects;
+			if (ptp_object_find (params, oifs[i].ObjectHandle, &ob) != PTP_RC_OK)
+				ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d)", oifs[i].ObjectHandle, params->nrofobjects);
+			else
+				ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d)", oifs[i].ObjectHandle, params->nrofobjects);
+			if (ptp_object_find_or_insert (params, oifs[i].ObjectHandle, &ob) != PTP_RC_OK) {
+				free (oifs);
+				return PTP_RC_GeneralError;
 			}
 
 			ob->oi.StorageID 		= oifs[i].StorageID;
@@ -2857,13 +3506,14 @@ ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle) {
 			ob->oi.AssociationType		= oifs[i].AssociationType;
 			ob->oi.AssociationDesc		= oifs[i].AssociationDesc;
 			ob->oi.SequenceNumber		= oifs[i].SequenceNumber;
-			ob->oi.Filename			= oifs[i].Filename; /* hand over memory ownership */
+			ob->oi.Filename			= ptp_cache_strdup (params, oifs[i].Filename);
+			free (oifs[i].Filename);
+			ptp_object_name_changed (params, ob);
 			ob->oi.ModificationDate		= oifs[i].ModificationDate;
 			/* FIXME: most of it ... but not the image sizes */
 			ob->flags			|= PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED;
 		}
 		free (oifs);
-		if (changed) ptp_objects_sort (params);
 		return PTP_RC_OK;
 	}
 fallback:
@@ -2883,48 +3533,33 @@ fallback:
 	}
 	if (ret != PTP_RC_OK)
 		return ret;
-	last = changed = 0;
 	for (i=0;i<handles.n;i++) {
 		PTPObject	*ob;
-		unsigned int	j;
 
-		ob = NULL;
-		for (j=0;j<params->nrofobjects;j++) {
-			if (params->objects[(last+j)%params->nrofobjects].oid == handles.Handler[i])  {
-				ob = &params->objects[(last+j)%params->nrofobjects];
-				break;
+		if (ptp_object_find (params, handles.Handler[i], &ob) != PTP_RC_OK) {
+			ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d)", handles.Handler[i], params->nrofobjects);
+			if (ptp_object_find_or_insert (params, handles.Handler[i], &ob) != PTP_RC_OK) {
+				free (handles.Handler);
+				return PTP_RC_GeneralError;
 			}
-		}
-		if (j == params->nrofobjects) {
-			ptp_debug (params, "adding new objectid 0x%08x (nrofobs=%d,j=%d)", handles.Handler[i], params->nrofobjects,j);
-			newobs = realloc (params->objects,sizeof(PTPObject)*(params->nrofobjects+1));
-			if (!newobs) return PTP_RC_GeneralError;
-			params->objects = newobs;
-			memset (&params->objects[params->nrofobjects],0,sizeof(params->objects[params->nrofobjects]));
-			params->objects[params->nrofobjects].oid = handles.Handler[i];
-			params->objects[params->nrofobjects].flags = 0;
 			/* root directory list files might return all files, so avoid tagging it */
 			if (handle != PTP_HANDLER_SPECIAL && handle) {
 				ptp_debug (params, "  parenthandle 0x%08x", handle);
 				if (handles.Handler[i] == handle) { /* EOS bug where oid == parent(oid) */
-					params->objects[params->nrofobjects].oi.ParentObject = 0;
+					ob->oi.ParentObject = 0;
 				} else {
-					params->objects[params->nrofobjects].oi.ParentObject = handle;
+					ob->oi.ParentObject = handle;
 				}
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
 			}
 			if (storage != PTP_HANDLER_SPECIAL) {
 				ptp_debug (params, "  storage 0x%08x", storage);
-				params->objects[params->nrofobjects].oi.StorageID = storage;
-				params->objects[params->nrofobjects].flags |= PTPOBJECT_STORAGEID_LOADED;
+				ob->oi.StorageID = storage;
+				ob->flags |= PTPOBJECT_STORAGEID_LOADED;
 			}
-			params->nrofobjects++;
-			changed = 1;
 		} else {
-			ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d,j=%d)", handles.Handler[i], params->nrofobjects,j);
-			ob = &params->objects[(last+j)%params->nrofobjects];
-			/* for speeding up search */
-			last = (last+j)%params->nrofobjects;
+			ptp_debug (params, "adding old objectid 0x%08x (nrofobs=%d)", handles.Handler[i], params->nrofobjects);
+			ptp_objects_changed (params);
 			if (handle != PTP_HANDLER_SPECIAL) {
 				ob->oi.ParentObject = handle;
 				ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
@@ -2936,10 +3571,19 @@ fallback:
 		}
 	}
 	free (handles.Handler);
-	if (changed) ptp_objects_sort (params);
 	return PTP_RC_OK;
 }
 
+uint16_t
+ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle) {
+	uint16_t	ret;
+
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	ret = ptp_list_folder_nolock (params, storage, handle);
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	return ret;
+}
+
 
 static void
 handle_event_internal (PTPParams *params, PTPContainer *event)
@@ -2959,8 +3603,6 @@ handle_event_internal (PTPParams *params, PTPContainer *event)
 	}
 	case PTP_EC_StoreAdded:
 	case PTP_EC_StoreRemoved: {
-		unsigned int i;
-
 		/* FIXME: if we just remove 1 out of many storages, we do not need to invalidate/reload the entire tree? */
 
 		/* refetch storage IDs and also invalidate whole object tree */
@@ -2971,11 +3613,7 @@ handle_event_internal (PTPParams *params, PTPContainer *event)
 
 		/* free object storage as it might be associated with the storage ids */
 		/* FIXME: enhance and just delete the ones from the storage */
-		for (i=0;i<params->nrofobjects;i++)
-			ptp_free_object (&params->objects[i]);
-		free (params->objects);
-		params->objects 		= NULL;
-		params->nrofobjects 		= 0;
+		ptp_free_objects (params);
 
 		params->storagechanged		= 1;
 		/* mirror what we do in camera_init, fetch root directory entries. */
@@ -4746,6 +5384,91 @@ ptp_nikon_writewifiprofile (PTPParams* params, PTPNIKONWifiProfile* profile)
 	return ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
 }
 
+/*
+ * The object properties a format supports and their descriptions do not
+ * change while the device is connected, yet the library asks for them
+ * for nearly every object it reads or writes. The raw answers are kept
+ * per (format, property) and unpacked again on each call, so callers
+ * still own what they get back. An entry and its data stay until the
+ * session ends, so the data can be unpacked without holding a lock.
+ */
+static int
+ptp_mtp_objectpropcache_find (PTPParams* params, uint16_t opc, uint16_t ofc,
+	unsigned char **data, unsigned int *size
+) {
+	PTPObjectPropCache	*cache;
+	unsigned int		i;
+	int			found = 0;
+
+	ptp_lock (params, PTP_LOCK_PROPCACHE);
+	for (i=0;i<params->nrofobjectpropcache;i++) {
+		cache = &params->objectpropcache[i];
+		if ((cache->ofc == ofc) && (cache->opc == opc)) {
+			*data = cache->data;
+			*size = cache->size;
+			found = 1;
+			break;
+		}
+	}
+	ptp_lock (params, PTP_UNLOCK_PROPCACHE);
+	return found;
+}
+
+static uint16_t
+ptp_mtp_objectpropcache_get (PTPParams* params, uint16_t opc, uint16_t ofc,
+	unsigned char **data, unsigned int *size
+) {
+	PTPContainer		ptp;
+	PTPObjectPropCache	*cache;
+	unsigned char		*xdata = NULL;
+	unsigned int		xsize = 0;
+	unsigned int		i;
+	uint16_t		ret;
+
+	if (ptp_mtp_objectpropcache_find (params, opc, ofc, data, size))
+		return PTP_RC_OK;
+
+	/* only a miss talks to the device; another thread may have asked
+	 * for the same answer while we waited for our turn */
+	ptp_lock (params, PTP_LOCK_TRANSACTION);
+	if (ptp_mtp_objectpropcache_find (params, opc, ofc, data, size)) {
+		ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+		return PTP_RC_OK;
+	}
+	if (opc) {
+		PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropDesc, opc, ofc);
+	} else {
+		PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropsSupported, ofc);
+	}
+	ret = ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &xdata, &xsize);
+	if (ret != PTP_RC_OK) {
+		ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+		return ret;
+	}
+
+	ptp_lock (params, PTP_LOCK_PROPCACHE);
+	i = params->nrofobjectpropcache;
+	cache = realloc(params->objectpropcache,(i+1)*sizeof(params->objectpropcache[0]));
+	if (!cache) {
+		ptp_lock (params, PTP_UNLOCK_PROPCACHE);
+		ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+		free (xdata);
+		return PTP_RC_GeneralError;
+	}
+	params->objectpropcache = cache;
+	params->nrofobjectpropcache++;
+	cache = &params->objectpropcache[i];
+	cache->ofc = ofc;
+	cache->opc = opc;
+	cache->data = xdata;
+	cache->size = xsize;
+	ptp_lock (params, PTP_UNLOCK_PROPCACHE);
+	ptp_lock (params, PTP_UNLOCK_TRANSACTION);
+	*data = xdata;
+	*size = xsize;
+	return PTP_RC_OK;
+}
+
 /**
  * ptp_mtp_getobjectpropssupported:
  *
@@ -4756,6 +5479,8 @@ ptp_nikon_writewifiprofile (PTPParams* params, PTPNIKONWifiProfile* profile)
  *	unsigned int *propnum	- number of elements in returned array
  *	uint16_t *props		- array of supported properties
  *
+ * The answer is cached for the rest of the session.
+ *
  * Return values: Some PTP_RC_* code.
  *
  **/
@@ -4763,16 +5488,17 @@ uint16_t
 ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc,
 		 uint32_t *propnum, uint16_t **props
 ) {
-	PTPContainer	ptp;
 	unsigned char	*data = NULL;
 	unsigned int	xsize = 0;
 
-        PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropsSupported, ofc);
-	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &xsize));
-	if (!data) return PTP_RC_GeneralError;
-	*propnum=ptp_unpack_uint16_t_array (params, data, 0, xsize, props);
-	free(data);
-	return PTP_RC_OK;
+	uint16_t	ret;
+
+	ret = ptp_mtp_objectpropcache_get(params, 0, ofc, &data, &xsize);
+	if ((ret == PTP_RC_OK) && !data)
+		ret = PTP_RC_GeneralError;
+	if (ret == PTP_RC_OK)
+		*propnum=ptp_unpack_uint16_t_array (params, data, 0, xsize, props);
+	return ret;
 }
 
 /**
@@ -4784,6 +5510,8 @@ ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc,
  *	uint16_t opc	- object property code
  *	uint16_t ofc	- object format code
  *
+ * The answer is cached for the rest of the session.
+ *
  * Return values: Some PTP_RC_* code.
  *
  **/
@@ -4791,15 +5519,15 @@ uint16_t
 ptp_mtp_getobjectpropdesc (
 	PTPParams* params, uint16_t opc, uint16_t ofc, PTPObjectPropDesc *opd
 ) {
-	PTPContainer	ptp;
 	unsigned char	*data = NULL;
-	unsigned int	size;
+	unsigned int	size = 0;
 
-        PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjectPropDesc, opc, ofc);
-        CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, &data, &size));
-	ptp_unpack_OPD (params, data, opd, size);
-	free(data);
-	return PTP_RC_OK;
+	uint16_t	ret;
+
+	ret = ptp_mtp_objectpropcache_get(params, opc, ofc, &data, &size);
+	if (ret == PTP_RC_OK)
+		ptp_unpack_OPD (params, data, opd, size);
+	return ret;
 }
 
 /**
@@ -4939,6 +5667,631 @@ ptp_mtp_getobjectproplist_single (PTPParams* params, uint32_t handle, MTPPropert
 	return ptp_mtp_getobjectproplist_level(params, handle, 0, props, nrofprops);
 }
 
+/*
+ * Memory of the object cache.
+ *
+ * The cached objects and everything they point to, that is their
+ * filename and keywords, their property lists and the strings and
+ * arrays in those, are carved out of large chunks. ptp_free_objects()
+ * gives back all chunks at once. Blocks that are replaced before that,
+ * like the property lists of a folder that is listed again, are handed
+ * to ptp_cache_free(), which keeps them on a free list per size for
+ * the next allocation of that size, or frees a block that got a chunk
+ * of its own. Objects removed from the cache are kept for reuse.
+ */
+struct _PTPArenaChunk {
+	struct _PTPArenaChunk	*next;
+	size_t			used;
+	size_t			size;
+};
+
+#define PTP_ARENA_CHUNKSIZE	(64*1024)
+#define PTP_ARENA_ALIGN		sizeof(uint64_t)
+#define PTP_ARENA_ROUND(x)	(((x) + PTP_ARENA_ALIGN - 1) & ~(PTP_ARENA_ALIGN - 1))
+#define PTP_ARENA_HEADER	PTP_ARENA_ROUND(sizeof(struct _PTPArenaChunk))
+#define PTP_ARENA_FREELISTS	(PTP_ARENA_CHUNKSIZE/4/PTP_ARENA_ALIGN)
+
+/* Allocate memory that belongs to the object cache, see above. */
+void *
+ptp_cache_alloc (PTPParams *params, size_t size)
+{
+	struct _PTPArenaChunk	*chunk = params->objectarena, *newchunk;
+	size_t			chunksize = PTP_ARENA_CHUNKSIZE;
+
+	size = PTP_ARENA_ROUND(size);
+	if (size && size <= PTP_ARENA_CHUNKSIZE/4 && params->objectarena_free &&
+	    params->objectarena_free[size/PTP_ARENA_ALIGN-1]) {
+		void	*block = params->objectarena_free[size/PTP_ARENA_ALIGN-1];
+
+		params->objectarena_free[size/PTP_ARENA_ALIGN-1] = *(void **)block;
+		return block;
+	}
+	if (chunk && chunk->size - chunk->used >= size) {
+		chunk->used += size;
+		return (char *)chunk + PTP_ARENA_HEADER + chunk->used - size;
+	}
+	/* big ones get a chunk of their own and leave the current one open */
+	if (size > PTP_ARENA_CHUNKSIZE/4)
+		chunksize = size;
+	newchunk = malloc (PTP_ARENA_HEADER + chunksize);
+	if (!newchunk)
+		return NULL;
+	newchunk->size = chunksize;
+	newchunk->used = size;
+	if (chunk && chunksize == size) {
+		newchunk->next = chunk->next;
+		chunk->next = newchunk;
+	} else {
+		newchunk->next = chunk;
+		params->objectarena = newchunk;
+	}
+	return (char *)newchunk + PTP_ARENA_HEADER;
+}
+
+/* Give back a block of the object cache, size is what was asked for. */
+void
+ptp_cache_free (PTPParams *params, void *ptr, size_t size)
+{
+	struct _PTPArenaChunk	*chunk, **pchunk;
+
+	size = PTP_ARENA_ROUND(size);
+	if (!ptr || !size)
+		return;
+	if (size > PTP_ARENA_CHUNKSIZE/4) {
+		/* if it has a chunk of its own, that goes */
+		for (pchunk = &params->objectarena; (chunk = *pchunk); pchunk = &chunk->next) {
+			if ((char *)chunk + PTP_ARENA_HEADER == ptr && chunk->size == size) {
+				*pchunk = chunk->next;
+				free (chunk);
+				return;
+			}
+		}
+		return;
+	}
+	if (!params->objectarena_free) {
+		params->objectarena_free = calloc (PTP_ARENA_FREELISTS, sizeof(void *));
+		if (!params->objectarena_free)
+			return;
+	}
+	*(void **)ptr = params->objectarena_free[size/PTP_ARENA_ALIGN-1];
+	params->objectarena_free[size/PTP_ARENA_ALIGN-1] = ptr;
+}
+
+/*
+ * Give back the property list of a cached object. The filename and
+ * keywords may be strings of the list, those stay.
+ */
+void
+ptp_object_free_props (PTPParams *params, PTPObject *ob)
+{
+	MTPProperties	*prop;
+	unsigned int	i;
+
+	for (i=0,prop=ob->mtpprops;i<ob->nrofmtpprops;i++,prop++) {
+		if (prop->datatype == PTP_DTC_STR) {
+			if (prop->propval.str && prop->propval.str != ob->oi.Filename &&
+			    prop->propval.str != ob->oi.Keywords)
+				ptp_cache_free (params, prop->propval.str, strlen (prop->propval.str)+1);
+		} else if ((prop->datatype & PTP_DTC_ARRAY_MASK) && prop->propval.a.v) {
+			ptp_cache_free (params, prop->propval.a.v,
+					prop->propval.a.count*sizeof(PTPPropertyValue));
+		}
+	}
+	ptp_cache_free (params, ob->mtpprops, ob->nrofmtpprops*sizeof(MTPProperties));
+	ob->mtpprops = NULL;
+	ob->nrofmtpprops = 0;
+}
+
+/* Set the filename of a cached object, giving back the old one. */
+static void
+ptp_object_set_filename (PTPParams *params, PTPObject *ob, char *filename)
+{
+	unsigned int	i;
+
+	if (ob->oi.Filename && ob->oi.Filename != ob->oi.Keywords) {
+		/* unless it is a string of the property list as well */
+		for (i=0;i<ob->nrofmtpprops;i++)
+			if (ob->mtpprops[i].datatype == PTP_DTC_STR &&
+			    ob->mtpprops[i].propval.str == ob->oi.Filename)
+				break;
+		if (i == ob->nrofmtpprops)
+			ptp_cache_free (params, ob->oi.Filename, strlen (ob->oi.Filename)+1);
+	}
+	ob->oi.Filename = filename;
+}
+
+char *
+ptp_cache_strdup (PTPParams *params, const char *str)
+{
+	size_t	len;
+	char	*copy;
+
+	if (!str)
+		return NULL;
+	len = strlen (str) + 1;
+	copy = ptp_cache_alloc (params, len);
+	if (copy)
+		memcpy (copy, str, len);
+	return copy;
+}
+
+/* Move a malloc()ed string into the object cache. */
+static char *
+ptp_cache_take_string (PTPParams *params, char *str)
+{
+	char	*copy = ptp_cache_strdup (params, str);
+
+	free (str);
+	return copy;
+}
+
+/* Move the values of a property that were malloc()ed into the object cache. */
+static void
+ptp_cache_take_prop (PTPParams *params, MTPProperties *prop)
+{
+	PTPPropertyValue	*v;
+
+	if (prop->datatype == PTP_DTC_STR) {
+		prop->propval.str = ptp_cache_take_string (params, prop->propval.str);
+		return;
+	}
+	if (!(prop->datatype & PTP_DTC_ARRAY_MASK) || !prop->propval.a.v)
+		return;
+	v = ptp_cache_alloc (params, prop->propval.a.count*sizeof(PTPPropertyValue));
+	if (v)
+		memcpy (v, prop->propval.a.v, prop->propval.a.count*sizeof(PTPPropertyValue));
+	else
+		prop->propval.a.count = 0;
+	free (prop->propval.a.v);
+	prop->propval.a.v = v;
+}
+
+/* Move a malloc()ed property list into the object cache. */
+static MTPProperties *
+ptp_cache_take_props (PTPParams *params, MTPProperties *props, int nrofprops)
+{
+	MTPProperties	*newprops;
+	int		i;
+
+	newprops = ptp_cache_alloc (params, nrofprops*sizeof(MTPProperties));
+	if (!newprops) {
+		ptp_destroy_object_prop_list (props, nrofprops);
+		return NULL;
+	}
+	for (i=0;i<nrofprops;i++) {
+		newprops[i] = props[i];
+		ptp_cache_take_prop (params, &newprops[i]);
+	}
+	free (props);
+	return newprops;
+}
+
+/*
+ * Streaming GetObjPropList decoder.
+ *
+ * ptp_mtp_getobjectproplist() collects the whole data phase, unpacks it
+ * into one MTPProperties array and sorts that, so a listing of a full
+ * device needs several times the memory of the resulting cache. This
+ * data handler decodes each property record as the bytes arrive and
+ * files it under its object right away. Only a record split between
+ * two reads is copied aside, and an object's property list is
+ * allocated once at its final size when the device moves on to the
+ * next object.
+ */
+typedef struct {
+	uint32_t	count;		/* records announced by the device */
+	uint32_t	done;		/* records decoded so far */
+	int		started;	/* record count has been read */
+	int		broken;		/* undecodable data, ignore the rest */
+	unsigned char	*pending;	/* record split across reads */
+	unsigned int	pendlen;
+	unsigned int	pendalloc;
+	unsigned int	need;		/* bytes the pending record needs */
+	PTPObject	*ob;		/* object currently being filled */
+	MTPProperties	*props;		/* its non-core properties so far */
+	unsigned int	nrofprops;
+	unsigned int	propsalloc;
+	unsigned int	nrofobjects;
+	PTPParams	*params;	/* for the reads that come without */
+} PTPOPLStream;
+
+static uint16_t
+ptp_opl_stream_flush (PTPParams *params, PTPOPLStream *st)
+{
+	PTPObject	*ob = st->ob;
+
+	if (!ob)
+		return PTP_RC_OK;
+	if (st->nrofprops) {
+		MTPProperties *newprops;
+
+		/* only has to copy if the device split up an object */
+		newprops = ptp_cache_alloc (params,
+			(ob->nrofmtpprops+st->nrofprops)*sizeof(MTPProperties));
+		if (!newprops)
+			return PTP_RC_GeneralError;
+		if (ob->nrofmtpprops)
+			memcpy (newprops, ob->mtpprops,
+				ob->nrofmtpprops*sizeof(MTPProperties));
+		memcpy (&newprops[ob->nrofmtpprops], st->props,
+			st->nrofprops*sizeof(MTPProperties));
+		ptp_cache_free (params, ob->mtpprops, ob->nrofmtpprops*sizeof(MTPProperties));
+		ob->mtpprops = newprops;
+		ob->nrofmtpprops += st->nrofprops;
+		st->nrofprops = 0;
+	}
+	/* we asked for all properties, so this is all there is */
+	ob->flags |= PTPOBJECT_ALLPROPS_LOADED;
+	if (!ob->oi.Filename) {
+		/* I have one such file on my Creative (Marcus) */
+		ob->oi.Filename = ptp_cache_strdup (params, "<null>");
+	}
+	ptp_object_name_changed (params, ob);
+	ob->flags |= PTPOBJECT_OBJECTINFO_LOADED;
+	st->ob = NULL;
+	return PTP_RC_OK;
+}
+
+static uint16_t
+ptp_opl_stream_add (PTPParams *params, PTPOPLStream *st, MTPProperties *prop)
+{
+	PTPObject	*ob;
+
+	if (!st->ob || st->ob->oid != prop->ObjectHandle) {
+		CHECK_PTP_RC(ptp_opl_stream_flush (params, st));
+		CHECK_PTP_RC(ptp_object_find_or_insert (params, prop->ObjectHandle, &st->ob));
+		st->nrofobjects++;
+	}
+	ob = st->ob;
+
+	switch (prop->property) {
+	case PTP_OPC_ParentObject:
+		ob->oi.ParentObject = prop->propval.u32;
+		ob->flags |= PTPOBJECT_PARENTOBJECT_LOADED;
+		return PTP_RC_OK;
+	case PTP_OPC_ObjectFormat:
+		ob->oi.ObjectFormat = prop->propval.u16;
+		return PTP_RC_OK;
+	case PTP_OPC_ObjectSize:
+		if (prop->datatype == PTP_DTC_UINT64)
+			ob->oi.ObjectCompressedSize = prop->propval.u64;
+		else if (prop->datatype == PTP_DTC_UINT32)
+			ob->oi.ObjectCompressedSize = prop->propval.u32;
+		ob->flags |= PTPOBJECT_OBJECTSIZE_LOADED;
+		return PTP_RC_OK;
+	case PTP_OPC_StorageID:
+		ob->oi.StorageID = prop->propval.u32;
+		ob->flags |= PTPOBJECT_STORAGEID_LOADED;
+		return PTP_RC_OK;
+	case PTP_OPC_ObjectFileName:
+		if (prop->datatype == PTP_DTC_STR && prop->propval.str) {
+			ptp_object_set_filename (params, ob, prop->propval.str);
+			return PTP_RC_OK;
+		}
+		break;
+	/* the dates are kept in the proplist as well */
+	case PTP_OPC_DateCreated:
+		if (prop->datatype == PTP_DTC_STR)
+			ob->oi.CaptureDate = ptp_unpack_PTPTIME(prop->propval.str);
+		break;
+	case PTP_OPC_DateModified:
+		if (prop->datatype == PTP_DTC_STR)
+			ob->oi.ModificationDate = ptp_unpack_PTPTIME(prop->propval.str);
+		break;
+	default:
+		break;
+	}
+
+	/* everything else goes into the per-object proplist */
+	if (st->nrofprops == st->propsalloc) {
+		unsigned int	newalloc = st->propsalloc ? st->propsalloc*2 : 16;
+		MTPProperties	*newprops;
+
+		newprops = realloc (st->props, newalloc*sizeof(MTPProperties));
+		if (!newprops)
+			return PTP_RC_GeneralError;
+		st->props = newprops;
+		st->propsalloc = newalloc;
+	}
+	st->props[st->nrofprops++] = *prop;
+	return PTP_RC_OK;
+}
+
+/*
+ * Decode as many complete records as there are at data. *used is set
+ * to the bytes consumed, and st->need to the size of the record that
+ * did not fit if there is one.
+ */
+static uint16_t
+ptp_opl_stream_parse (PTPParams *params, PTPOPLStream *st,
+	unsigned char *data, unsigned int len, unsigned int *used
+) {
+	unsigned int	off = 0;
+	int const	le = (params->byteorder == PTP_DL_LE);
+
+	if (!st->started) {
+		if (len < sizeof(uint32_t)) {
+			st->need = sizeof(uint32_t);
+			*used = 0;
+			return PTP_RC_OK;
+		}
+		st->count = dtoh32a(data);
+		st->started = 1;
+		off = sizeof(uint32_t);
+		ptp_debug (params ,"Streaming MTP OPL (prop_count %d)", st->count);
+	}
+	while (st->done < st->count) {
+		MTPProperties	prop;
+		unsigned int	size = 0, offset = 0;
+		int		known;
+		uint16_t	ret;
+
+		if (len - off < 8) {
+			st->need = 8;
+			break;
+		}
+		prop.ObjectHandle = dtoh32a_bo(le, &data[off]);
+		prop.property = dtoh16a_bo(le, &data[off+4]);
+		prop.datatype = dtoh16a_bo(le, &data[off+6]);
+		known = ptp_DPV_size (params, &data[off+8], len-off-8, prop.datatype, &size);
+		if (known < 0 || size > UINT_MAX - 8) {
+			ptp_debug (params ,"cannot unpack datatype 0x%04x of property %d", prop.datatype, st->done);
+			st->broken = 1;
+			break;
+		}
+		if (!known || len - off - 8 < size) {
+			st->need = 8 + size;
+			break;
+		}
+		if (prop.datatype == PTP_DTC_STR) {
+			/* straight into the cache, there are lots of these */
+			char	str[PTP_MAXSTRLEN*3+1];
+			size_t	slen;
+			uint8_t	len;
+
+			if (!ptp_unpack_string_local (params, &data[off+8], 0, size, &len, str, &slen)) {
+				ptp_debug (params ,"unpacking string of property %d encountered insufficient buffer. attack?", st->done);
+				st->broken = 1;
+				break;
+			}
+			prop.propval.str = ptp_cache_alloc (params, slen+1);
+			if (!prop.propval.str) {
+				*used = off;
+				return PTP_RC_GeneralError;
+			}
+			memcpy (prop.propval.str, str, slen+1);
+		} else {
+			if (!ptp_unpack_DPV (params, &data[off+8], &offset, size, &prop.propval, prop.datatype)) {
+				ptp_debug (params ,"unpacking DPV of property %d encountered insufficient buffer. attack?", st->done);
+				st->broken = 1;
+				break;
+			}
+			ptp_cache_take_prop (params, &prop);
+		}
+		off += 8 + size;
+		st->done++;
+		ret = ptp_opl_stream_add (params, st, &prop);
+		if (ret != PTP_RC_OK) {
+			*used = off;
+			return ret;
+		}
+	}
+	*used = off;
+	return PTP_RC_OK;
+}
+
+static uint16_t
+opl_stream_getfunc(PTPParams* params, void* private,
+	       unsigned long wantlen, unsigned char *data,
+	       unsigned long *gotlen
+) {
+	return PTP_ERROR_BADPARAM;
+}
+
+static uint16_t
+opl_stream_putfunc(PTPParams* params, void* private,
+	       unsigned long sendlen, unsigned char *data
+) {
+	PTPOPLStream	*st = (PTPOPLStream*)private;
+	unsigned int	used;
+
+	if (!params)
+		params = st->params;
+	while (sendlen && !st->broken && !(st->started && st->done == st->count)) {
+		unsigned int	take;
+
+		if (!st->pendlen) {
+			take = sendlen > UINT_MAX ? UINT_MAX : sendlen;
+			CHECK_PTP_RC(ptp_opl_stream_parse (params, st, data, take, &used));
+			data += used;
+			sendlen -= used;
+			if (used == take && sendlen)
+				continue;
+			if (!sendlen || st->broken || (st->started && st->done == st->count))
+				break;
+			/* the rest is the start of a record, copy it aside */
+			take = sendlen;
+		} else {
+			/* top up the record carried over from the last read */
+			take = st->need - st->pendlen;
+			if (take > sendlen)
+				take = sendlen;
+		}
+		if (st->pendalloc < st->pendlen + take || st->pendalloc < st->need) {
+			unsigned int	newalloc = st->pendlen + take;
+			unsigned char	*newpending;
+
+			if (newalloc < st->need)
+				newalloc = st->need;
+			newpending = realloc (st->pending, newalloc);
+			if (!newpending) {
+				ptp_debug (params ,"cannot buffer MTP OPL record of %d bytes", st->need);
+				st->broken = 1;
+				break;
+			}
+			st->pending = newpending;
+			st->pendalloc = newalloc;
+		}
+		memcpy (st->pending + st->pendlen, data, take);
+		st->pendlen += take;
+		data += take;
+		sendlen -= take;
+		if (st->pendlen < st->need)
+			continue;
+		CHECK_PTP_RC(ptp_opl_stream_parse (params, st, st->pending, st->pendlen, &used));
+		/* the record count or an array header may reveal more to wait for */
+		if (used) {
+			memmove (st->pending, st->pending + used, st->pendlen - used);
+			st->pendlen -= used;
+		}
+	}
+	return PTP_RC_OK;
+}
+
+/* The objects lock is only held while a read is decoded into the cache */
+static uint16_t
+opl_stream_locked_putfunc(PTPParams* params, void* private,
+	       unsigned long sendlen, unsigned char *data
+) {
+	PTPOPLStream	*st = (PTPOPLStream*)private;
+	uint16_t	ret;
+
+	ptp_lock (st->params, PTP_LOCK_OBJECTS_WRITE);
+	ret = opl_stream_putfunc (params, st, sendlen, data);
+	ptp_lock (st->params, PTP_UNLOCK_OBJECTS);
+	return ret;
+}
+
+/**
+ * ptp_mtp_getobjectproplist_cache:
+ * params:	PTPParams*
+ *		handle		- object handle, 0xffffffff for all objects
+ *		level		- 0 for the object alone, 0xffffffff for everything below it
+ *		nrofobjects	- (out) number of objects the device reported on
+ *
+ * Like ptp_mtp_getobjectproplist_level(), but the list is decoded while
+ * it is received and stored straight into the object cache rather than
+ * returned. Parent, format, size, storage and filename go into the
+ * ObjectInfo of each object; all other properties are added to its
+ * mtpprops, which the caller should clear first for objects that may
+ * already have one. A truncated list keeps what could be decoded.
+ * The objects lock is only taken while a block of the list is stored,
+ * so readers of the cache get in between.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_mtp_getobjectproplist_cache (PTPParams* params, uint32_t handle, uint32_t level, unsigned int *nrofobjects)
+{
+	PTPContainer	ptp;
+	PTPDataHandler	handler;
+	PTPOPLStream	st;
+	uint16_t	ret;
+
+	memset (&st, 0, sizeof(st));
+	st.params = params;
+	handler.getfunc = opl_stream_getfunc;
+	handler.putfunc = opl_stream_locked_putfunc;
+	handler.getbuffunc = NULL;
+	handler.priv = &st;
+
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjPropList, handle, 0x00000000U, 0xFFFFFFFFU, 0, level);
+	ret = ptp_transaction_new(params, &ptp, PTP_DP_GETDATA, 0, &handler);
+	if (ret == PTP_RC_OK) {
+		if (!st.broken && (st.pendlen || st.done < st.count)) {
+			ptp_debug (params ,"short MTP Object Property List at property %d (of %d)", st.done, st.count);
+			ptp_debug (params ,"device probably needs DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST_ALL");
+			ptp_debug (params ,"or even DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST");
+		}
+		ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+		ret = ptp_opl_stream_flush (params, &st);
+		ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	}
+	/* what is left over of the values is in the cache memory */
+	free (st.props);
+	free (st.pending);
+	if (nrofobjects)
+		*nrofobjects = st.nrofobjects;
+	return ret;
+}
+
+/* The decoder of ptp_mtp_getobjectproplist_cache_async() */
+typedef struct {
+	PTPTransactionDoneFunc	done;
+	void			*data;
+	PTPOPLStream		st;
+	PTPDataHandler		handler;
+} PTPAsyncOPLStream;
+
+static void
+ptp_opl_stream_async_done (PTPParams* params, PTPContainer* resp,
+			   uint16_t ret, void *data)
+{
+	PTPAsyncOPLStream	*as = (PTPAsyncOPLStream*)data;
+
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	if (ret == PTP_RC_OK) {
+		if (!as->st.broken && (as->st.pendlen || as->st.done < as->st.count))
+			ptp_debug (params ,"short MTP Object Property List at property %d (of %d)", as->st.done, as->st.count);
+		ret = ptp_opl_stream_flush (params, &as->st);
+	}
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	free (as->st.props);
+	free (as->st.pending);
+	as->done (params, resp, ret, as->data);
+	free (as);
+}
+
+/**
+ * ptp_mtp_getobjectproplist_cache_async:
+ * params:	PTPParams*
+ *		handle		- object handle, 0xffffffff for all objects
+ *		level		- 0 for the object alone, 0xffffffff for everything below it
+ *		PTPTransactionDoneFunc	- called once the list is in the cache
+ *		void* data		- passed on to done
+ *
+ * Non-blocking ptp_mtp_getobjectproplist_cache(), see
+ * ptp_transaction_async(). For a single object its mtpprops are
+ * cleared first, as the list replaces them.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_mtp_getobjectproplist_cache_async (PTPParams* params, uint32_t handle, uint32_t level,
+				       PTPTransactionDoneFunc done, void *data)
+{
+	PTPContainer		ptp;
+	PTPAsyncOPLStream	*as;
+	uint16_t		ret;
+
+	as = calloc (1, sizeof(PTPAsyncOPLStream));
+	if (!as)
+		return PTP_RC_GeneralError;
+	as->done = done;
+	as->data = data;
+	as->st.params = params;
+	as->handler.getfunc = opl_stream_getfunc;
+	as->handler.putfunc = opl_stream_locked_putfunc;
+	as->handler.getbuffunc = NULL;
+	as->handler.priv = &as->st;
+
+	if (level == 0 && handle != 0xffffffff) {
+		PTPObject	*ob;
+
+		ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+		if (ptp_object_find (params, handle, &ob) == PTP_RC_OK)
+			ptp_object_free_props (params, ob);
+		ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	}
+
+	PTP_CNT_INIT(ptp, PTP_OC_MTP_GetObjPropList, handle, 0x00000000U, 0xFFFFFFFFU, 0, level);
+	ret = ptp_transaction_async(params, &ptp, PTP_DP_GETDATA, 0, &as->handler,
+				    ptp_opl_stream_async_done, as);
+	if (ret != PTP_RC_OK)
+		free (as);
+	return ret;
+}
+
 uint16_t
 ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
 			    uint16_t objecttype, uint64_t objectsize, MTPProperties *props, int nrofprops)
@@ -4954,6 +6307,8 @@ ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parent
 
 	/* Set object handle to 0 for a new object */
 	size = ptp_pack_OPL(params,props,nrofprops,&data);
+	if (!data)
+		return PTP_RC_GeneralError;
 	ret = ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
 	free(data);
 	*store = ptp.Param1;
@@ -4967,14 +6322,17 @@ uint16_t
 ptp_mtp_setobjectproplist (PTPParams* params, MTPProperties *props, int nrofprops)
 {
 	PTPContainer	ptp;
+	uint16_t	ret;
 	unsigned char	*data = NULL;
 	uint32_t	size;
 
 	PTP_CNT_INIT(ptp, PTP_OC_MTP_SetObjPropList);
 	size = ptp_pack_OPL(params,props,nrofprops,&data);
-	CHECK_PTP_RC(ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL));
+	if (!data)
+		return PTP_RC_GeneralError;
+	ret = ptp_transaction(params, &ptp, PTP_DP_SENDDATA, size, &data, NULL);
 	free(data);
-	return PTP_RC_OK;
+	return ret;
 }
 
 uint16_t
@@ -5244,7 +6602,7 @@ ptp_chdk_parse_live_data (PTPParams* params, unsigned char *data, unsigned int d
 	if (data_size < (header->vp_desc_start + sizeof (*vpd)) || data_size < (header->bm_desc_start + sizeof (*bmd)))
 		return PTP_ERROR_IO;
 	ptp_unpack_chdk_lv_framebuffer_desc (params, data+header->vp_desc_start, vpd);
-	ptp_unpack_chdk_lv_framebuffer_desc (params, data+header->vp_desc_start, bmd);
+	ptp_unpack_chdk_lv_framebuffer_desc (params, data+header->bm_desc_start, bmd);
 
 	/* The buffer_width field corresponds to the number of Y values in a row,
 	 * so the actual number of bytes would be either one and a half times
@@ -5255,6 +6613,244 @@ ptp_chdk_parse_live_data (PTPParams* params, unsigned char *data, unsigned int d
 	return PTP_RC_OK;
 }
 
+/* Continuous CHDK live view, see ptp_chdk_live_view_start() */
+struct _PTPCHDKLiveView {
+	unsigned		flags;
+	PTPCHDKLiveViewFunc	func;
+	void			*data;
+	PTPCHDKLiveFrame	*frames;	/* the ring of frame buffers */
+	unsigned int		*alloced;	/* size of each frame buffer */
+	unsigned int		nrofframes;
+	unsigned int		next;		/* the frame being received */
+	uint32_t		sequence;
+	uint32_t		dropped;
+	PTPDataHandler		handler;
+	int			pending;	/* a frame request is underway */
+	int			delivering;	/* func is being called */
+	int			stopping;
+};
+
+/* Make room for len more bytes in the frame being received. */
+static unsigned char *
+chdk_live_view_room (PTPCHDKLiveView *lv, unsigned long len)
+{
+	PTPCHDKLiveFrame	*frame = &lv->frames[lv->next];
+	unsigned int		*alloced = &lv->alloced[lv->next];
+
+	if (len > UINT_MAX - frame->size)
+		return NULL;
+	if (frame->size + len > *alloced) {
+		unsigned int	newsize = *alloced ? *alloced : 0x10000;
+		unsigned char	*newdata;
+
+		while (newsize < frame->size + len)
+			newsize = (newsize > UINT_MAX / 2) ? UINT_MAX : newsize * 2;
+		newdata = realloc (frame->data, newsize);
+		if (!newdata)
+			return NULL;
+		frame->data = newdata;
+		*alloced = newsize;
+	}
+	return frame->data + frame->size;
+}
+
+static unsigned char *
+chdk_live_view_getbuffunc (PTPParams* params, void* priv, unsigned long ahead,
+			   unsigned long wantlen
+) {
+	PTPCHDKLiveView		*lv = (PTPCHDKLiveView*)priv;
+	unsigned char		*room;
+
+	if (ahead > ULONG_MAX - wantlen)
+		return NULL;
+	room = chdk_live_view_room (lv, ahead + wantlen);
+	return room ? room + ahead : NULL;
+}
+
+static uint16_t
+chdk_live_view_getfunc (PTPParams* params, void* priv,
+			unsigned long wantlen, unsigned char *data,
+			unsigned long *gotlen
+) {
+	/* a receiving handler is never asked for data */
+	*gotlen = 0;
+	return PTP_ERROR_BADPARAM;
+}
+
+static uint16_t
+chdk_live_view_putfunc (PTPParams* params, void* priv,
+			unsigned long sendlen, unsigned char *data
+) {
+	PTPCHDKLiveView		*lv = (PTPCHDKLiveView*)priv;
+	PTPCHDKLiveFrame	*frame = &lv->frames[lv->next];
+	unsigned char		*room;
+
+	room = chdk_live_view_room (lv, sendlen);
+	if (!room)
+		return PTP_RC_GeneralError;
+	/* data already is in place if it came through getbuffunc */
+	if (room != data)
+		memcpy (room, data, sendlen);
+	frame->size += sendlen;
+	return PTP_RC_OK;
+}
+
+static void
+chdk_live_view_free (PTPCHDKLiveView *lv)
+{
+	unsigned int	i;
+
+	for (i = 0; i < lv->nrofframes; i++)
+		free (lv->frames[i].data);
+	free (lv->frames);
+	free (lv->alloced);
+	free (lv);
+}
+
+static void chdk_live_view_done (PTPParams* params, PTPContainer* resp,
+				 uint16_t ret, void *data);
+
+static uint16_t
+chdk_live_view_request (PTPParams* params, PTPCHDKLiveView *lv)
+{
+	PTPContainer	ptp;
+	uint16_t	ret;
+
+	PTP_CNT_INIT(ptp, PTP_OC_CHDK, PTP_CHDK_GetDisplayData, lv->flags);
+	lv->frames[lv->next].size = 0;
+	ret = ptp_transaction_async (params, &ptp, PTP_DP_GETDATA, 0, &lv->handler,
+				     chdk_live_view_done, lv);
+	if (ret == PTP_RC_OK)
+		lv->pending = 1;
+	return ret;
+}
+
+static void
+chdk_live_view_done (PTPParams* params, PTPContainer* resp, uint16_t ret, void *data)
+{
+	PTPCHDKLiveView		*lv = (PTPCHDKLiveView*)data;
+	PTPCHDKLiveFrame	*frame = &lv->frames[lv->next];
+	int			stopped = lv->stopping;
+	int			good = 0;
+
+	lv->pending = 0;
+	frame->timestamp = ptp_time_us ();
+	frame->sequence = lv->sequence++;
+	if (ret == PTP_RC_OK)
+		good = (ptp_chdk_parse_live_data (params, frame->data, frame->size,
+						  &frame->header, &frame->vpd,
+						  &frame->bmd) == PTP_RC_OK);
+	else
+		ptp_debug (params, "CHDK live view frame %u failed: 0x%04x", frame->sequence, ret);
+	if (!good)
+		lv->dropped++;
+	frame->dropped = lv->dropped;
+
+	/* Ask for the next frame, into the next buffer, before handing this
+	 * one out. A transport error ends the live view, a camera that could
+	 * not give a frame only costs that frame. */
+	if (!lv->stopping && (ret < PTP_ERROR_NODEVICE || ret > PTP_ERROR_IO)) {
+		lv->next = (lv->next + 1) % lv->nrofframes;
+		if (chdk_live_view_request (params, lv) != PTP_RC_OK)
+			lv->stopping = 1;
+	} else {
+		lv->stopping = 1;
+	}
+
+	/* nothing is handed out any more once stopped */
+	if (good && !stopped) {
+		lv->delivering = 1;
+		lv->func (params, frame, lv->data);
+		lv->delivering = 0;
+	}
+	if (lv->stopping && !lv->pending) {
+		lv->func (params, NULL, lv->data);
+		chdk_live_view_free (lv);
+	}
+}
+
+/**
+ * ptp_chdk_live_view_start:
+ * params:	PTPParams*
+ *		flags		- LV_TFR_* flags of the data wanted
+ *		nrofframes	- number of frame buffers, at least 2
+ *		func		- called with each frame
+ *		data		- passed on to func
+ *		lv		- (out) the live view, for ptp_chdk_live_view_stop()
+ *
+ * Starts asking the camera for live view frames without pause: the next
+ * frame is requested as soon as one came in, before it is handed to
+ * func. Frames are received into a ring of nrofframes buffers that are
+ * reused, so that after the first frames nothing is allocated any more.
+ * A frame, laid out as in chdk_live_view.h with its header and
+ * framebuffer descriptions already unpacked, stays valid until
+ * nrofframes - 1 further frames have come in. Frames that failed or came
+ * in malformed are not handed out but counted as dropped.
+ *
+ * This needs a data layer with non-blocking transactions, which calls
+ * back from its event handling; no other transaction may be done until
+ * the live view ended. It ends after ptp_chdk_live_view_stop() or a
+ * transport error, and then func is called once more with a NULL frame,
+ * after which lv is gone.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_chdk_live_view_start (PTPParams* params, unsigned flags, unsigned int nrofframes,
+			  PTPCHDKLiveViewFunc func, void *data, PTPCHDKLiveView **lv)
+{
+	PTPCHDKLiveView	*view;
+	uint16_t	ret;
+
+	*lv = NULL;
+	if (!func || nrofframes < 2)
+		return PTP_ERROR_BADPARAM;
+	if (!params->transaction_async_func)
+		return PTP_RC_OperationNotSupported;
+	view = calloc (1, sizeof(PTPCHDKLiveView));
+	if (!view)
+		return PTP_RC_GeneralError;
+	view->frames = calloc (nrofframes, sizeof(PTPCHDKLiveFrame));
+	view->alloced = calloc (nrofframes, sizeof(unsigned int));
+	if (!view->frames || !view->alloced) {
+		chdk_live_view_free (view);
+		return PTP_RC_GeneralError;
+	}
+	view->nrofframes = nrofframes;
+	view->flags = flags;
+	view->func = func;
+	view->data = data;
+	view->handler.getfunc = chdk_live_view_getfunc;
+	view->handler.putfunc = chdk_live_view_putfunc;
+	view->handler.getbuffunc = chdk_live_view_getbuffunc;
+	view->handler.priv = view;
+	ret = chdk_live_view_request (params, view);
+	if (ret != PTP_RC_OK) {
+		chdk_live_view_free (view);
+		return ret;
+	}
+	*lv = view;
+	return PTP_RC_OK;
+}
+
+/**
+ * ptp_chdk_live_view_stop:
+ * params:	PTPParams*
+ *		lv		- the live view to stop
+ *
+ * Stops asking for frames. The frame request underway is still
+ * completed; see ptp_chdk_live_view_start() for when lv is gone.
+ **/
+void
+ptp_chdk_live_view_stop (PTPParams* params, PTPCHDKLiveView *lv)
+{
+	lv->stopping = 1;
+	if (!lv->pending && !lv->delivering) {
+		lv->func (params, NULL, lv->data);
+		chdk_live_view_free (lv);
+	}
+}
+
 
 /**
  * Android MTP Extensions
@@ -5288,6 +6884,31 @@ ptp_android_getpartialobject64 (PTPParams* params, uint32_t handle, uint64_t off
 	return ptp_transaction(params, &ptp, PTP_DP_GETDATA, 0, object, len);
 }
 
+/**
+ * ptp_android_getpartialobject64_to_handler:
+ * params:	PTPParams*
+ *		handle			- Object handle
+ *		offset			- Offset into object
+ *		maxbytes		- Maximum of bytes to read
+ *		handler			- a ptp data handler
+ *
+ * Get object 'handle' from device and send the data to the
+ * data handler. Start from offset and read at most maxbytes.
+ *
+ * This is a 64bit offset version of ptp_getpartialobject_to_handler.
+ *
+ * Return values: Some PTP_RC_* code.
+ **/
+uint16_t
+ptp_android_getpartialobject64_to_handler (PTPParams* params, uint32_t handle, uint64_t offset,
+				uint32_t maxbytes, PTPDataHandler *handler)
+{
+	PTPContainer ptp;
+
+	PTP_CNT_INIT(ptp, PTP_OC_ANDROID_GetPartialObject64, handle, ((uint32_t)offset & 0xFFFFFFFF), (uint32_t)(offset >> 32), maxbytes);
+	return ptp_transaction_new(params, &ptp, PTP_DP_GETDATA, 0, handler);
+}
+
 uint16_t
 ptp_android_sendpartialobject (PTPParams* params, uint32_t handle, uint64_t offset,
 				unsigned char* object,	uint32_t len)
@@ -5427,6 +7048,7 @@ ptp_free_objectinfo (PTPObjectInfo *oi)
         free (oi->Keywords); oi->Keywords = NULL;
 }
 
+/* Not for objects in the cache, ptp_free_objects() takes care of those. */
 void
 ptp_free_object (PTPObject *ob)
 {
@@ -8818,29 +10440,365 @@ ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t
 	return NULL;
 }
 
-uint16_t
-ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
+/*
+ * The object cache.
+ *
+ * Objects are allocated one by one so PTPObject pointers stay valid
+ * while the cache grows. They are indexed by handle in a chained hash
+ * table, and params->objects is an ordered view of the same pointers
+ * for the code that walks all objects.
+ */
+#define PTP_OBJECTHASH_MINBITS	8
+#define PTP_OBJECTS_MINALLOC	256
+
+static unsigned int
+ptp_objecthash_slot (PTPParams *params, uint32_t handle)
+{
+	/* handles are often sequential, multiplicative hashing spreads them */
+	return (uint32_t)(handle * 2654435761U) >> (32 - params->objecthash_bits);
+}
+
+static uint16_t
+ptp_objecthash_grow (PTPParams *params)
+{
+	unsigned int	i, bits;
+	PTPObject	**newhash;
+
+	bits = params->objecthash_bits ? params->objecthash_bits + 1 : PTP_OBJECTHASH_MINBITS;
+	newhash = calloc (1U << bits, sizeof(PTPObject*));
+	if (!newhash)
+		return PTP_RC_GeneralError;
+	free (params->objecthash);
+	params->objecthash = newhash;
+	params->objecthash_bits = bits;
+	for (i=0;i<params->nrofobjects;i++) {
+		PTPObject	*ob = params->objects[i];
+		unsigned int	slot = ptp_objecthash_slot (params, ob->oid);
+
+		ob->hashnext = newhash[slot];
+		newhash[slot] = ob;
+	}
+	return PTP_RC_OK;
+}
+
+/*
+ * The filename index.
+ *
+ * Devices that need unique filenames make us look up a name among all
+ * cached objects before each upload. The index is a chained hash over
+ * the names, built the first time it is needed and then kept up to
+ * date by ptp_object_name_changed() wherever a cached object gets its
+ * filename, and when objects leave the cache.
+ */
+static uint32_t
+ptp_objectname_hash (const char *name)
+{
+	uint32_t	h = 2166136261U;	/* FNV-1a */
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static unsigned int
+ptp_objectname_slot (PTPParams *params, uint32_t namehash)
+{
+	return (uint32_t)(namehash * 2654435761U) >> (32 - params->objectnames_bits);
+}
+
+static void
+ptp_objectname_unlink (PTPParams *params, PTPObject *ob)
+{
+	PTPObject	**pob;
+
+	if (!(ob->flags & PTPOBJECT_NAME_INDEXED))
+		return;
+	pob = &params->objectnames[ptp_objectname_slot (params, ob->namehash)];
+	while (*pob && *pob != ob)
+		pob = &(*pob)->namenext;
+	if (*pob)
+		*pob = ob->namenext;
+	ob->namenext = NULL;
+	ob->flags &= ~PTPOBJECT_NAME_INDEXED;
+	params->nrofobjectnames--;
+}
+
+static uint16_t
+ptp_objectnames_build (PTPParams *params, unsigned int bits)
+{
+	unsigned int	i;
+	PTPObject	**newnames;
+
+	newnames = calloc (1U << bits, sizeof(PTPObject*));
+	if (!newnames)
+		return PTP_RC_GeneralError;
+	free (params->objectnames);
+	params->objectnames = newnames;
+	params->objectnames_bits = bits;
+	params->nrofobjectnames = 0;
+	for (i=0;i<params->nrofobjects;i++) {
+		PTPObject	*ob = params->objects[i];
+		unsigned int	slot;
+
+		ob->flags &= ~PTPOBJECT_NAME_INDEXED;
+		if (!ob->oi.Filename)
+			continue;
+		ob->namehash = ptp_objectname_hash (ob->oi.Filename);
+		slot = ptp_objectname_slot (params, ob->namehash);
+		ob->namenext = newnames[slot];
+		newnames[slot] = ob;
+		ob->flags |= PTPOBJECT_NAME_INDEXED;
+		params->nrofobjectnames++;
+	}
+	return PTP_RC_OK;
+}
+
+static void
+ptp_object_name_changed_nolock (PTPParams *params, PTPObject *ob)
+{
+	unsigned int	slot;
+
+	if (!params->objectnames)
+		return;
+	ptp_objectname_unlink (params, ob);
+	if (!ob->oi.Filename)
+		return;
+	if (params->nrofobjectnames >= (1U << params->objectnames_bits)) {
+		/* this also indexes ob */
+		if (ptp_objectnames_build (params, params->objectnames_bits + 1) == PTP_RC_OK)
+			return;
+	}
+	ob->namehash = ptp_objectname_hash (ob->oi.Filename);
+	slot = ptp_objectname_slot (params, ob->namehash);
+	ob->namenext = params->objectnames[slot];
+	params->objectnames[slot] = ob;
+	ob->flags |= PTPOBJECT_NAME_INDEXED;
+	params->nrofobjectnames++;
+}
+
+/* To be called after changing ob->oi.Filename of a cached object. */
+void
+ptp_object_name_changed (PTPParams *params, PTPObject *ob)
+{
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	params->objects_generation++;
+	ptp_object_name_changed_nolock (params, ob);
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+}
+
+/* Builds the filename index if there is none yet, returns 0 if it cannot be built. */
+static int
+ptp_objectnames_ready (PTPParams *params)
+{
+	unsigned int bits = PTP_OBJECTHASH_MINBITS;
+
+	if (params->objectnames)
+		return 1;
+	while ((1U << bits) < params->nrofobjects)
+		bits++;
+	return ptp_objectnames_build (params, bits) == PTP_RC_OK;
+}
+
+static int
+ptp_object_filename_exists_nolock (PTPParams *params, const char *filename)
+{
+	PTPObject	*ob;
+	uint32_t	namehash;
+	unsigned int	i;
+
+	if (!ptp_objectnames_ready (params)) {
+		/* no index, just look at them all */
+		for (i=0;i<params->nrofobjects;i++) {
+			char *fname = params->objects[i]->oi.Filename;
+
+			if (fname && !strcmp (filename, fname))
+				return 1;
+		}
+		return 0;
+	}
+	namehash = ptp_objectname_hash (filename);
+	ob = params->objectnames[ptp_objectname_slot (params, namehash)];
+	for (;ob;ob=ob->namenext)
+		if ((ob->namehash == namehash) && !strcmp (filename, ob->oi.Filename))
+			return 1;
+	return 0;
+}
+
+/* Returns 1 if any cached object has this filename, 0 otherwise. */
+int
+ptp_object_filename_exists (PTPParams *params, const char *filename)
+{
+	int	ret;
+
+	/* exclusive, the first lookup builds the index */
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	ret = ptp_object_filename_exists_nolock (params, filename);
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	return ret;
+}
+
+static int
+ptp_object_is_child (PTPObject *ob, uint32_t storage, uint32_t parent, const char *filename)
+{
+	return ob->oi.Filename && (ob->oi.ParentObject == parent) &&
+		(!storage || (ob->oi.StorageID == storage)) &&
+		!strcmp (filename, ob->oi.Filename);
+}
+
+/*
+ * Returns the handle of the cached object with this filename in a
+ * folder (0 for the root), or 0 if there is none. A storage of 0 matches
+ * all storages.
+ */
+uint32_t
+ptp_object_find_child (PTPParams *params, uint32_t storage, uint32_t parent, const char *filename)
 {
-	unsigned int i;
 	PTPObject	*ob;
+	uint32_t	namehash;
+	uint32_t	oid = 0;
+	unsigned int	i;
+
+	/* exclusive, the first lookup builds the index */
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	if (!ptp_objectnames_ready (params)) {
+		for (i=0;i<params->nrofobjects;i++) {
+			if (ptp_object_is_child (params->objects[i], storage, parent, filename)) {
+				oid = params->objects[i]->oid;
+				break;
+			}
+		}
+	} else {
+		namehash = ptp_objectname_hash (filename);
+		ob = params->objectnames[ptp_objectname_slot (params, namehash)];
+		for (;ob;ob=ob->namenext) {
+			if ((ob->namehash == namehash) &&
+			    ptp_object_is_child (ob, storage, parent, filename)) {
+				oid = ob->oid;
+				break;
+			}
+		}
+	}
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	return oid;
+}
+
+/* Free all cached objects. */
+void
+ptp_free_objects (PTPParams *params)
+{
+	struct _PTPArenaChunk	*chunk;
+
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	/* everything the objects point to is in the chunks */
+	while ((chunk = params->objectarena) != NULL) {
+		params->objectarena = chunk->next;
+		free (chunk);
+	}
+	params->objects_free	= NULL;
+	free (params->objectarena_free);
+	params->objectarena_free = NULL;
+	params->objects_generation++;
+	free (params->objectcolumns.size);
+	memset (&params->objectcolumns, 0, sizeof(params->objectcolumns));
+	free (params->objects);
+	free (params->objecthash);
+	free (params->objectnames);
+	params->objects		= NULL;
+	params->nrofobjects	= 0;
+	params->objects_alloced	= 0;
+	params->objecthash	= NULL;
+	params->objecthash_bits	= 0;
+	params->objectnames	= NULL;
+	params->objectnames_bits = 0;
+	params->nrofobjectnames	= 0;
+	ptp_lock (params, PTP_LOCK_EVENTS);
+	free (params->object_events);
+	params->object_events	= NULL;
+	params->nrofobject_events = 0;
+	params->object_events_lost = 0;
+	ptp_lock (params, PTP_UNLOCK_EVENTS);
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+}
+
+static uint16_t
+ptp_remove_object_from_cache_nolock (PTPParams *params, uint32_t handle)
+{
+	unsigned int i;
+	PTPObject	*ob, **pob;
 
 	CHECK_PTP_RC(ptp_object_find (params, handle, &ob));
-	i = ob-params->objects;
-	/* remove object from object info cache */
-	ptp_free_object (ob);
-
-	if (i < params->nrofobjects-1)
-		memmove (ob,ob+1,(params->nrofobjects-1-i)*sizeof(PTPObject));
-	params->nrofobjects--;
-	/* We use less memory than before so this shouldn't fail */
-	params->objects = realloc(params->objects, sizeof(PTPObject)*params->nrofobjects);
+	pob = &params->objecthash[ptp_objecthash_slot (params, handle)];
+	while (*pob != ob)
+		pob = &(*pob)->hashnext;
+	*pob = ob->hashnext;
+	ptp_objectname_unlink (params, ob);
+
+	/* the last object takes its place */
+	i = ob->index;
+	params->objects[i] = params->objects[--params->nrofobjects];
+	params->objects[i]->index = i;
+
+	params->objects_generation++;
+	/* its data stays with the cache, the object itself is reused */
+	ob->hashnext = params->objects_free;
+	params->objects_free = ob;
 	return PTP_RC_OK;
 }
 
+/* Remove one object; the last one of the ordered view takes its place. */
+uint16_t
+ptp_remove_object_from_cache(PTPParams *params, uint32_t handle)
+{
+	uint16_t	ret;
+
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	ret = ptp_remove_object_from_cache_nolock (params, handle);
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	return ret;
+}
+
+/* Remove a set of objects, compacting the ordered view only once. */
+void
+ptp_remove_objects_from_cache (PTPParams *params, uint32_t const *handles, unsigned int n)
+{
+	unsigned int	i, j, removed = 0;
+	PTPObject	*ob, *found, **pob;
+
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	for (i=0;i<n;i++) {
+		if (ptp_object_find (params, handles[i], &ob) != PTP_RC_OK)
+			continue;
+		pob = &params->objecthash[ptp_objecthash_slot (params, handles[i])];
+		while (*pob != ob)
+			pob = &(*pob)->hashnext;
+		*pob = ob->hashnext;
+		ptp_objectname_unlink (params, ob);
+		removed++;
+	}
+	if (removed) {
+		params->objects_generation++;
+		/* whatever the hash no longer finds goes, keeping the order */
+		for (i=0,j=0;i<params->nrofobjects;i++) {
+			ob = params->objects[i];
+			if ((ptp_object_find (params, ob->oid, &found) == PTP_RC_OK) && (found == ob)) {
+				ob->index = j;
+				params->objects[j++] = ob;
+				continue;
+			}
+			ob->hashnext = params->objects_free;
+			params->objects_free = ob;
+		}
+		params->nrofobjects = j;
+	}
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+}
+
 static int _cmp_ob (const void *a, const void *b)
 {
-	PTPObject *oa = (PTPObject*)a;
-	PTPObject *ob = (PTPObject*)b;
+	PTPObject *oa = *(PTPObject**)a;
+	PTPObject *ob = *(PTPObject**)b;
 
 	/* Do not subtract the oids and return ...
 	 * the unsigned int -> int conversion will overflow in cases
@@ -8850,90 +10808,279 @@ static int _cmp_ob (const void *a, const void *b)
 	return 0;
 }
 
+/* Sort the ordered view of the objects by handle. Lookups do not need this. */
 void
 ptp_objects_sort (PTPParams *params)
 {
-	qsort (params->objects, params->nrofobjects, sizeof(PTPObject), _cmp_ob);
+	unsigned int	i;
+
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	params->objects_generation++;
+	qsort (params->objects, params->nrofobjects, sizeof(PTPObject*), _cmp_ob);
+	for (i=0;i<params->nrofobjects;i++)
+		params->objects[i]->index = i;
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+}
+
+/*
+ * To be called after changing the parent, storage, format or size of a
+ * cached object other than through the functions here, which do it
+ * themselves.
+ */
+void
+ptp_objects_changed (PTPParams *params)
+{
+	params->objects_generation++;
 }
 
-/* Binary search in objects. Needs "objects" to be a sorted by objectid list!  */
+/*
+ * The hot fields of the cached objects in columns, so that a listing
+ * can pick out the objects of a storage or format without touching
+ * the objects themselves. The columns are rebuilt here when the cache
+ * changed since the last call. The caller holds the objects lock for
+ * writing, and the columns are only good while it does. Returns NULL
+ * if out of memory.
+ */
+const PTPObjectColumns *
+ptp_object_columns (PTPParams *params)
+{
+	PTPObjectColumns	*cols = &params->objectcolumns;
+	unsigned int		i, n = params->nrofobjects;
+
+	if (cols->size && cols->generation == params->objects_generation &&
+	    cols->nrofobjects == n)
+		return cols;
+	if (!cols->size || cols->alloced < n) {
+		unsigned int	alloced = n < PTP_OBJECTS_MINALLOC ? PTP_OBJECTS_MINALLOC : n;
+		unsigned char	*block;
+
+		/* one block, the widest column first */
+		block = malloc (alloced*(sizeof(uint64_t)+3*sizeof(uint32_t)+sizeof(uint16_t)));
+		if (!block)
+			return NULL;
+		free (cols->size);
+		cols->size	= (uint64_t*)block;
+		cols->oid	= (uint32_t*)(block + alloced*sizeof(uint64_t));
+		cols->parent	= cols->oid + alloced;
+		cols->storage	= cols->parent + alloced;
+		cols->format	= (uint16_t*)(cols->storage + alloced);
+		cols->alloced	= alloced;
+	}
+	for (i=0;i<n;i++) {
+		PTPObject	*ob = params->objects[i];
+
+		cols->size[i]		= ob->oi.ObjectCompressedSize;
+		cols->oid[i]		= ob->oid;
+		cols->parent[i]		= ob->oi.ParentObject;
+		cols->storage[i]	= ob->oi.StorageID;
+		cols->format[i]		= ob->oi.ObjectFormat;
+	}
+	cols->nrofobjects = n;
+	cols->generation = params->objects_generation;
+	return cols;
+}
+
+/* Hash lookup of an object by handle. */
 uint16_t
 ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob)
 {
-	PTPObject	tmpob;
+	PTPObject	*ob;
 
-	tmpob.oid = handle;
-	*retob = bsearch (&tmpob, params->objects, params->nrofobjects, sizeof(tmpob), _cmp_ob);
-	if (!*retob)
+	*retob = NULL;
+	if (!params->objecthash)
 		return PTP_RC_GeneralError;
+	for (ob = params->objecthash[ptp_objecthash_slot (params, handle)]; ob; ob = ob->hashnext) {
+		if (ob->oid == handle) {
+			*retob = ob;
+			return PTP_RC_OK;
+		}
+	}
+	return PTP_RC_GeneralError;
+}
+
+static uint16_t
+ptp_object_find_or_insert_nolock (PTPParams *params, uint32_t handle, PTPObject **retob)
+{
+	unsigned int	slot;
+	PTPObject	*ob;
+
+	if (!handle) return PTP_RC_GeneralError;
+	if (ptp_object_find (params, handle, retob) == PTP_RC_OK)
+		return PTP_RC_OK;
+
+	/* keep the load factor of the hash at most 1 */
+	if (!params->objecthash || params->nrofobjects >= (1U << params->objecthash_bits))
+		CHECK_PTP_RC(ptp_objecthash_grow (params));
+	if (params->nrofobjects == params->objects_alloced) {
+		unsigned int	alloced = params->objects_alloced ? params->objects_alloced*2 : PTP_OBJECTS_MINALLOC;
+		PTPObject	**newobs;
+
+		newobs = realloc (params->objects, sizeof(PTPObject*)*alloced);
+		if (!newobs) return PTP_RC_GeneralError;
+		params->objects = newobs;
+		params->objects_alloced = alloced;
+	}
+	if (params->objects_free) {
+		ob = params->objects_free;
+		params->objects_free = ob->hashnext;
+	} else {
+		ob = ptp_cache_alloc (params, sizeof(PTPObject));
+		if (!ob) return PTP_RC_GeneralError;
+	}
+	memset (ob, 0, sizeof(PTPObject));
+	ob->oid = handle;
+	params->objects_generation++;
+	slot = ptp_objecthash_slot (params, handle);
+	ob->hashnext = params->objecthash[slot];
+	params->objecthash[slot] = ob;
+	ob->index = params->nrofobjects;
+	params->objects[params->nrofobjects++] = ob;
+	*retob = ob;
 	return PTP_RC_OK;
 }
 
-/* Binary search in objects + insert of not found. Needs "objects" to be a sorted by objectid list!  */
+/* Lookup of an object by handle, adding an empty one if it is not cached yet. */
 uint16_t
 ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob)
 {
-	unsigned int 	begin, end, cursor;
-	unsigned int	insertat;
-	PTPObject	*newobs;
+	uint16_t	ret;
 
-	if (!handle) return PTP_RC_GeneralError;
-	*retob = NULL;
-	if (!params->nrofobjects) {
-		params->objects = calloc(1,sizeof(PTPObject));
-		params->nrofobjects = 1;
-		params->objects[0].oid = handle;
-		*retob = &params->objects[0];
-		return PTP_RC_OK;
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	ret = ptp_object_find_or_insert_nolock (params, handle, retob);
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	return ret;
+}
+
+/* The media tier, the tags a track listing shows. */
+static const uint16_t ptp_media_props[] = {
+	PTP_OPC_Name,
+	PTP_OPC_Artist,
+	PTP_OPC_Composer,
+	PTP_OPC_AlbumName,
+	PTP_OPC_Genre,
+	PTP_OPC_Track,
+	PTP_OPC_Duration,
+	PTP_OPC_OriginalReleaseDate,
+	PTP_OPC_SampleRate,
+	PTP_OPC_NumberOfChannels,
+	PTP_OPC_AudioWAVECodec,
+	PTP_OPC_AudioBitRate,
+	PTP_OPC_BitRateType,
+	PTP_OPC_Rating,
+	PTP_OPC_UseCount,
+};
+
+/*
+ * Find the device property group that holds all properties of a tier
+ * the format has, so that the tier can be read with one
+ * GetObjPropList by group. Groups are assigned by the device in the
+ * property descriptions; many devices put everything in group 0, which
+ * means no group, and then 0 is returned. The answer is kept for the
+ * session.
+ */
+static uint32_t
+ptp_object_tier_group (PTPParams *params, uint16_t ofc, unsigned int tier,
+		       const uint16_t *opcs, unsigned int nropcs)
+{
+	PTPObjectTierGroup	*tg;
+	PTPObjectPropDesc	opd;
+	uint16_t		*props = NULL;
+	uint32_t		nrofprops = 0;
+	uint32_t		group = 0;
+	unsigned int		i, j;
+
+	for (i=0;i<params->nrofobjecttiergroups;i++) {
+		tg = &params->objecttiergroups[i];
+		if ((tg->ofc == ofc) && (tg->tier == tier))
+			return tg->group;
 	}
-	begin = 0;
-	end = params->nrofobjects-1;
-	/*ptp_debug (params, "searching %08x, total=%d", handle, params->nrofobjects);*/
-	while (1) {
-		cursor = (end-begin)/2+begin;
-		/*ptp_debug (params, "ob %d: %08x [%d-%d]", cursor, params->objects[cursor].oid, begin, end);*/
-		if (params->objects[cursor].oid == handle) {
-			*retob = &params->objects[cursor];
-			return PTP_RC_OK;
+
+	if (ptp_operation_issupported(params, PTP_OC_MTP_GetObjPropList) &&
+	    !(params->device_flags & DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST) &&
+	    (ptp_mtp_getobjectpropssupported (params, ofc, &nrofprops, &props) == PTP_RC_OK)) {
+		for (i=0;i<nropcs;i++) {
+			for (j=0;j<nrofprops;j++)
+				if (props[j] == opcs[i])
+					break;
+			/* this format does not have it */
+			if (j == nrofprops)
+				continue;
+			if (ptp_mtp_getobjectpropdesc (params, opcs[i], ofc, &opd) != PTP_RC_OK) {
+				group = 0;
+				break;
+			}
+			j = (opd.GroupCode && (!group || (opd.GroupCode == group)));
+			group = opd.GroupCode;
+			ptp_free_objectpropdesc (&opd);
+			if (!j) {
+				group = 0;
+				break;
+			}
 		}
-		if (params->objects[cursor].oid < handle)
-			begin = cursor;
-		else
-			end = cursor;
-		if ((end - begin) <= 1)
-			break;
+		free (props);
 	}
-	if (params->objects[begin].oid == handle) {
-		*retob = &params->objects[begin];
-		return PTP_RC_OK;
+
+	tg = realloc (params->objecttiergroups, (params->nrofobjecttiergroups+1)*sizeof(PTPObjectTierGroup));
+	if (tg) {
+		params->objecttiergroups = tg;
+		tg = &params->objecttiergroups[params->nrofobjecttiergroups++];
+		tg->ofc = ofc;
+		tg->tier = tier;
+		tg->group = group;
 	}
-	if (params->objects[end].oid == handle) {
-		*retob = &params->objects[end];
+	return group;
+}
+
+/*
+ * Read one property (opc) or one property group (opc 0) of an object
+ * and add what it does not have yet to its cached properties.
+ */
+static uint16_t
+ptp_object_load_props (PTPParams *params, PTPObject *ob, uint16_t opc, uint32_t group)
+{
+	MTPProperties	*props = NULL, *newprops;
+	int		nrofprops = 0, i;
+	unsigned int	j, n;
+
+	CHECK_PTP_RC(ptp_mtp_getobjectproplist_generic (params, ob->oid, 0x00000000U, opc, group, 0, &props, &nrofprops));
+	if (!nrofprops) {
+		free (props);
 		return PTP_RC_OK;
 	}
-	if ((begin == 0) && (handle < params->objects[0].oid)) {
-		insertat=begin;
-	} else {
-		if ((end == params->nrofobjects-1) && (handle > params->objects[end].oid))
-			insertat=end+1;
-		else
-			insertat=begin+1;
-	}
-	/*ptp_debug (params, "inserting oid %x at [%x,%x], begin=%d, end=%d, insertat=%d\n", handle, params->objects[begin].oid, params->objects[end].oid, begin, end, insertat);*/
-	newobs = realloc (params->objects, sizeof(PTPObject)*(params->nrofobjects+1));
-	if (!newobs) return PTP_RC_GeneralError;
-	params->objects = newobs;
-	if (insertat<params->nrofobjects)
-		memmove (&params->objects[insertat+1],&params->objects[insertat],(params->nrofobjects-insertat)*sizeof(PTPObject));
-	memset(&params->objects[insertat],0,sizeof(PTPObject));
-	params->objects[insertat].oid = handle;
-	*retob = &params->objects[insertat];
-	params->nrofobjects++;
+	newprops = ptp_cache_alloc (params, (ob->nrofmtpprops+nrofprops)*sizeof(MTPProperties));
+	if (!newprops) {
+		ptp_destroy_object_prop_list (props, nrofprops);
+		return PTP_RC_GeneralError;
+	}
+	if (ob->nrofmtpprops)
+		memcpy (newprops, ob->mtpprops, ob->nrofmtpprops*sizeof(MTPProperties));
+	ptp_cache_free (params, ob->mtpprops, ob->nrofmtpprops*sizeof(MTPProperties));
+	ob->mtpprops = newprops;
+	n = ob->nrofmtpprops;
+	for (i=0;i<nrofprops;i++) {
+		for (j=0;j<n;j++)
+			if (newprops[j].property == props[i].property)
+				break;
+		if ((props[i].ObjectHandle != ob->oid) || (j < n)) {
+			ptp_destroy_object_prop (&props[i]);
+			continue;
+		}
+		if (props[i].property == PTP_OPC_ObjectSize) {
+			if (props[i].datatype == PTP_DTC_UINT64)
+				ob->oi.ObjectCompressedSize = props[i].propval.u64;
+			else if (props[i].datatype == PTP_DTC_UINT32)
+				ob->oi.ObjectCompressedSize = props[i].propval.u32;
+			ob->flags |= PTPOBJECT_OBJECTSIZE_LOADED;
+		}
+		newprops[ob->nrofmtpprops] = props[i];
+		ptp_cache_take_prop (params, &newprops[ob->nrofmtpprops++]);
+	}
+	free (props);
 	return PTP_RC_OK;
 }
 
-uint16_t
-ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObject **retob)
+static uint16_t
+ptp_object_want_nolock (PTPParams *params, uint32_t handle, unsigned int want, PTPObject **retob)
 {
 	uint16_t	ret;
 	PTPObject	*ob;
@@ -8942,6 +11089,9 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 	/* If GetObjectInfo is broken, force GetPropList */
 	if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI)
 		want |= PTPOBJECT_MTPPROPLIST_LOADED;
+	/* The core tier is the ObjectInfo, fixed up where it falls short */
+	if (want & PTPOBJECT_COREPROPS_LOADED)
+		want |= PTPOBJECT_OBJECTINFO_LOADED;
 
 	*retob = NULL;
 	if (!handle) {
@@ -8953,6 +11103,8 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 	/* Do we have all of it already? */
 	if ((ob->flags & want) == want)
 		return PTP_RC_OK;
+	/* the object is going to be filled in */
+	ptp_objects_changed (params);
 
 #define X (PTPOBJECT_OBJECTINFO_LOADED|PTPOBJECT_STORAGEID_LOADED|PTPOBJECT_PARENTOBJECT_LOADED)
 	if ((want & X) && ((ob->flags & X) != X)) {
@@ -8968,7 +11120,15 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 			ptp_remove_object_from_cache(params, handle);
 			return ret;
 		}
-		if (!ob->oi.Filename) ob->oi.Filename=strdup("<none>");
+		ob->oi.Filename = ptp_cache_take_string (params, ob->oi.Filename);
+		ob->oi.Keywords = ptp_cache_take_string (params, ob->oi.Keywords);
+		if (!ob->oi.Filename) ob->oi.Filename=ptp_cache_strdup(params, "<none>");
+		ptp_object_name_changed (params, ob);
+		/* the 32bit ObjectInfo size is only whole below 4GB */
+		if (ob->oi.ObjectCompressedSize != 0xffffffffUL)
+			ob->flags |= PTPOBJECT_OBJECTSIZE_LOADED;
+		else
+			ob->flags &= ~PTPOBJECT_OBJECTSIZE_LOADED;
 		if (ob->flags & PTPOBJECT_PARENTOBJECT_LOADED) {
 			if (ob->oi.ParentObject != saveparent)
 				ptp_debug (params, "saved parent %08x is not the same as read via getobjectinfo %08x", ob->oi.ParentObject, saveparent);
@@ -8988,9 +11148,19 @@ ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObjec
 				(PTP_RC_OK == ptp_nikon_getobjectsize(params, handle, &newsize))
 			) {
 				ob->oi.ObjectCompressedSize = newsize;
+				ob->flags |= PTPOBJECT_OBJECTSIZE_LOADED;
 				goto read64bit;
 			}
 			/* more methods like e.g. for Canon */
+			/* The core tier just needs the size, not the whole list */
+			if (	(want & PTPOBJECT_COREPROPS_LOADED)				&&
+				!(want & PTPOBJECT_MTPPROPLIST_LOADED)				&&
+				ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)	&&
+				!(params->device_flags & DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST)	&&
+				(PTP_RC_OK == ptp_object_load_props (params, ob, PTP_OPC_ObjectSize, 0)) &&
+				(ob->oi.ObjectCompressedSize != 0xffffffffUL)
+			)
+				goto read64bit;
 			/* if not try MTP method */
 			want |= PTPOBJECT_MTPPROPLIST_LOADED;
 			params->device_flags |= DEVICE_FLAG_PROPLIST_OVERRIDES_OI; /* FIXME: wild hack so below code works, needs review. */
@@ -9026,6 +11196,22 @@ read64bit:		;
 		ob->flags |= X;
 	}
 #undef X
+	if ((want & PTPOBJECT_COREPROPS_LOADED) && (ob->flags & PTPOBJECT_OBJECTINFO_LOADED))
+		ob->flags |= PTPOBJECT_COREPROPS_LOADED;
+	/* The media tier as one property group, or as part of the full list */
+	if (	(want & PTPOBJECT_MEDIAPROPS_LOADED) &&
+		!(want & PTPOBJECT_MTPPROPLIST_LOADED) &&
+		!(ob->flags & PTPOBJECT_MEDIAPROPS_LOADED)
+	) {
+		uint32_t	group;
+
+		group = ptp_object_tier_group (params, ob->oi.ObjectFormat, PTPOBJECT_MEDIAPROPS_LOADED,
+			ptp_media_props, sizeof(ptp_media_props)/sizeof(ptp_media_props[0]));
+		if (group && (ptp_object_load_props (params, ob, 0, group) == PTP_RC_OK))
+			ob->flags |= PTPOBJECT_MEDIAPROPS_LOADED;
+		else
+			want |= PTPOBJECT_MTPPROPLIST_LOADED;
+	}
 	if (	(want & PTPOBJECT_MTPPROPLIST_LOADED) &&
 		(!(ob->flags & PTPOBJECT_MTPPROPLIST_LOADED))
 	) {
@@ -9033,12 +11219,12 @@ read64bit:		;
 		MTPProperties 	*props = NULL;
 
 		if (params->device_flags & DEVICE_FLAG_BROKEN_MTPGETOBJPROPLIST) {
-			want &= ~PTPOBJECT_MTPPROPLIST_LOADED;
+			want &= ~(PTPOBJECT_MTPPROPLIST_LOADED|PTPOBJECT_MEDIAPROPS_LOADED);
 			goto fallback;
 		}
 		/* Microsoft/MTP has fast directory retrieval. */
 		if (!ptp_operation_issupported(params,PTP_OC_MTP_GetObjPropList)) {
-			want &= ~PTPOBJECT_MTPPROPLIST_LOADED;
+			want &= ~(PTPOBJECT_MTPPROPLIST_LOADED|PTPOBJECT_MEDIAPROPS_LOADED);
 			goto fallback;
 		}
 
@@ -9047,8 +11233,10 @@ read64bit:		;
 		ret = ptp_mtp_getobjectproplist_single (params, handle, &props, &nrofprops);
 		if (ret != PTP_RC_OK)
 			goto fallback;
-		ob->mtpprops = props;
-		ob->nrofmtpprops = nrofprops;
+		/* this replaces whatever tiers were read before */
+		ptp_object_free_props (params, ob);
+		ob->mtpprops = ptp_cache_take_props (params, props, nrofprops);
+		ob->nrofmtpprops = ob->mtpprops ? nrofprops : 0;
 
 		/* Override the ObjectInfo data with data from properties */
 		if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI) {
@@ -9075,6 +11263,7 @@ read64bit:		;
 					} else if (prop->datatype == PTP_DTC_UINT32) {
 						ob->oi.ObjectCompressedSize = prop->propval.u32;
 					}
+					ob->flags |= PTPOBJECT_OBJECTSIZE_LOADED;
 					break;
 				case PTP_OPC_AssociationType:
 					ob->oi.AssociationType = prop->propval.u16;
@@ -9084,8 +11273,8 @@ read64bit:		;
 					break;
 				case PTP_OPC_ObjectFileName:
 					if (prop->propval.str) {
-						free(ob->oi.Filename);
-						ob->oi.Filename = strdup(prop->propval.str);
+						ob->oi.Filename = prop->propval.str;
+						ptp_object_name_changed (params, ob);
 					}
 					break;
 				case PTP_OPC_DateCreated:
@@ -9096,8 +11285,7 @@ read64bit:		;
 					break;
 				case PTP_OPC_Keywords:
 					if (prop->propval.str) {
-						free(ob->oi.Keywords);
-						ob->oi.Keywords = strdup(prop->propval.str);
+						ob->oi.Keywords = prop->propval.str;
 					}
 					break;
 				case PTP_OPC_ParentObject:
@@ -9201,7 +11389,7 @@ read64bit:		;
 			/* i have one such file on my Creative */
 			oinfo.Filename = strdup("<null>");
 #endif
-		ob->flags |= PTPOBJECT_MTPPROPLIST_LOADED;
+		ob->flags |= PTPOBJECT_ALLPROPS_LOADED;
 fallback:	;
 	}
 	if ((ob->flags & want) == want)
@@ -9210,6 +11398,33 @@ fallback:	;
 	return PTP_RC_GeneralError;
 }
 
+uint16_t
+ptp_object_want (PTPParams *params, uint32_t handle, unsigned int want, PTPObject **retob)
+{
+	uint16_t	ret;
+
+	if (params->lock_func) {
+		unsigned int	xwant = want;
+		PTPObject	*ob;
+
+		/* Usually all of it is there, which only needs to be read. */
+		if (params->device_flags & DEVICE_FLAG_PROPLIST_OVERRIDES_OI)
+			xwant |= PTPOBJECT_MTPPROPLIST_LOADED;
+		ptp_lock (params, PTP_LOCK_OBJECTS_READ);
+		ret = ptp_object_find (params, handle, &ob);
+		if ((ret == PTP_RC_OK) && ((ob->flags & xwant) == xwant)) {
+			ptp_lock (params, PTP_UNLOCK_OBJECTS);
+			*retob = ob;
+			return PTP_RC_OK;
+		}
+		ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	}
+	ptp_lock (params, PTP_LOCK_OBJECTS_WRITE);
+	ret = ptp_object_want_nolock (params, handle, want, retob);
+	ptp_lock (params, PTP_UNLOCK_OBJECTS);
+	return ret;
+}
+
 
 uint16_t
 ptp_add_object_to_cache(PTPParams *params, uint32_t handle)
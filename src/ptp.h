@@ -3522,9 +3522,20 @@ typedef uint16_t (* PTPDataGetFunc)	(PTPParams* params, void*priv,
 typedef uint16_t (* PTPDataPutFunc)	(PTPParams* params, void*priv,
 					unsigned long sendlen,
 	                                unsigned char *data);
+/*
+ * Optional: return a pointer to where the wantlen bytes starting
+ * ahead bytes past the current position can be placed (receiving) or
+ * found (sending) directly, or NULL if they can not. The transport then
+ * hands that same pointer to putfunc/getfunc, which only has to
+ * advance its position.
+ */
+typedef unsigned char *(* PTPDataGetBufFunc)	(PTPParams* params, void*priv,
+					unsigned long ahead,
+					unsigned long wantlen);
 typedef struct _PTPDataHandler {
 	PTPDataGetFunc		getfunc;
 	PTPDataPutFunc		putfunc;
+	PTPDataGetBufFunc	getbuffunc;
 	void			*priv;
 } PTPDataHandler;
 
@@ -3541,6 +3552,25 @@ typedef uint16_t (* PTPIOGetData)	(PTPParams* params, PTPContainer* ptp,
 	                                 PTPDataHandler *putter);
 typedef uint16_t (* PTPIOCancelReq)	(PTPParams* params, uint32_t transaction_id);
 typedef uint16_t (* PTPIODevStatReq) (PTPParams* params);
+/*
+ * Gets the transport back in step after a transaction failed with
+ * error, before it is retried. Anything but PTP_RC_OK means the link
+ * is gone.
+ */
+typedef uint16_t (* PTPIORecover) (PTPParams* params, uint16_t error);
+
+/*
+ * Non-blocking transactions: the whole transaction is started at once
+ * and the data layer calls back with the response when it is done,
+ * from wherever it handles its I/O events.
+ */
+typedef void (* PTPTransactionDoneFunc) (PTPParams* params, PTPContainer* resp,
+					 uint16_t ret, void *data);
+typedef uint16_t (* PTPIOTransactionAsync) (PTPParams* params, PTPContainer* ptp,
+					    uint16_t flags, uint64_t sendlen,
+					    PTPDataHandler *handler,
+					    PTPTransactionDoneFunc done,
+					    void *data);
 
 /* debug functions */
 typedef void (* PTPErrorFunc) (void *data, const char *format, va_list args)
@@ -3554,6 +3584,87 @@ typedef void (* PTPDebugFunc) (void *data, const char *format, va_list args)
 #endif
 ;
 
+/*
+ * Optional locking, for sharing one PTPParams between threads.
+ * Transactions are serialized, and params->objects is guarded by a
+ * reader/writer lock. The objects lock is always taken before the
+ * transaction lock, and a thread holding it shared must not ask for it
+ * exclusively. Both may be taken again by a thread that holds them
+ * already. The events lock guards the queue of the event listener of
+ * the data layer and whether a non-blocking transaction is pending; it
+ * is held briefly, never taken again and nothing else is taken while
+ * holding it. The same goes for the property
+ * cache lock, which guards the cache of object property descriptions,
+ * and the statistics lock, which guards params->stats.
+ */
+#define PTP_LOCK_TRANSACTION	1
+#define PTP_UNLOCK_TRANSACTION	2
+#define PTP_LOCK_OBJECTS_READ	3
+#define PTP_LOCK_OBJECTS_WRITE	4
+#define PTP_UNLOCK_OBJECTS	5
+#define PTP_LOCK_EVENTS		6
+#define PTP_UNLOCK_EVENTS	7
+#define PTP_LOCK_PROPCACHE	8
+#define PTP_UNLOCK_PROPCACHE	9
+#define PTP_LOCK_STATS		10
+#define PTP_UNLOCK_STATS	11
+typedef void (* PTPLockFunc) (PTPParams* params, int what);
+
+#define ptp_lock(params,what) do {				\
+	if ((params)->lock_func) (params)->lock_func ((params), (what));	\
+} while (0)
+
+/*
+ * Transaction statistics, kept by ptp_transaction_new() and the
+ * transport under PTP_LOCK_STATS, so they can be read while a
+ * transaction is underway.
+ */
+#define PTP_STATS_LATENCY_BUCKETS	24
+struct _PTPOpcodeStats {
+	uint16_t	opcode;
+	uint32_t	transactions;
+	uint32_t	errors;
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+	uint64_t	total_us;
+	/* bucket i counts transactions that took less than 2^(i+1)
+	 * microseconds, the last one also all that took longer */
+	uint32_t	latency[PTP_STATS_LATENCY_BUCKETS];
+};
+typedef struct _PTPOpcodeStats PTPOpcodeStats;
+
+struct _PTPStats {
+	uint64_t	transactions;
+	uint64_t	bytes_in;
+	uint64_t	bytes_out;
+	uint64_t	bulk_transfers;
+	uint32_t	stalls_cleared;
+	uint32_t	timeouts;
+	uint32_t	retries;
+	/* sorted by opcode */
+	PTPOpcodeStats	*opcodes;
+	unsigned int	nrofopcodes;
+};
+typedef struct _PTPStats PTPStats;
+
+/* Called before (end 0) and after (end 1) every transaction */
+typedef void (* PTPTransactionFunc) (PTPParams* params, void *data,
+				     uint16_t opcode, int end, uint16_t ret,
+				     uint64_t usecs);
+
+/*
+ * Sees the data phase of transactions: once with the request before
+ * it (PTP_DATA_BEGIN, returns nonzero to watch this one), then with
+ * every block of data as it passes the data handler (PTP_DATA_BLOCK)
+ * and finally with the response (PTP_DATA_END).
+ */
+typedef int (* PTPDataFunc) (PTPParams* params, void *data, int phase,
+			     PTPContainer* ptp, uint16_t ret,
+			     unsigned char const *bytes, unsigned long len);
+#define PTP_DATA_BEGIN	0
+#define PTP_DATA_BLOCK	1
+#define PTP_DATA_END	2
+
 struct _PTPObject {
 	uint32_t	oid;
 	unsigned int	flags;
@@ -3563,14 +3674,53 @@ struct _PTPObject {
 #define PTPOBJECT_DIRECTORY_LOADED	(1<<3)
 #define PTPOBJECT_PARENTOBJECT_LOADED	(1<<4)
 #define PTPOBJECT_STORAGEID_LOADED	(1<<5)
+#define PTPOBJECT_NAME_INDEXED		(1<<6)	/* in the filename index */
+/* property tiers, see ptp_object_want() */
+#define PTPOBJECT_COREPROPS_LOADED	(1<<7)	/* what ObjectInfo carries, with the 64bit size */
+#define PTPOBJECT_MEDIAPROPS_LOADED	(1<<8)	/* media tags: title, artist, album, ... */
+#define PTPOBJECT_OBJECTSIZE_LOADED	(1<<9)	/* ObjectCompressedSize is the whole size, also past 4GB */
+/* the full property list holds every tier */
+#define PTPOBJECT_ALLPROPS_LOADED	(PTPOBJECT_MTPPROPLIST_LOADED|PTPOBJECT_COREPROPS_LOADED|PTPOBJECT_MEDIAPROPS_LOADED)
 
 	PTPObjectInfo	oi;
 	uint32_t	canon_flags;
 	MTPProperties	*mtpprops;
 	unsigned int	nrofmtpprops;
+
+	/* next object in the same object cache hash chain */
+	struct _PTPObject	*hashnext;
+	/* where it is in params->objects */
+	unsigned int		index;
+	/* next object in the same filename index chain, and its key */
+	struct _PTPObject	*namenext;
+	uint32_t		namehash;
 };
 typedef struct _PTPObject PTPObject;
 
+/*
+ * The fields of the cached objects that listings filter on, as one
+ * array per field in the order of the objects, see ptp_object_columns().
+ */
+struct _PTPObjectColumns {
+	unsigned int	nrofobjects;
+	unsigned int	generation;	/* of the cache it was built from */
+	unsigned int	alloced;
+	uint64_t	*size;
+	uint32_t	*oid;
+	uint32_t	*parent;
+	uint32_t	*storage;
+	uint16_t	*format;
+};
+typedef struct _PTPObjectColumns PTPObjectColumns;
+
+/* An object event from the device that the object cache still has to follow */
+struct _PTPObjectEvent {
+	uint32_t	oid;
+	uint16_t	code;	/* PTP_EC_Object{Added,Removed,InfoChanged} or
+				   PTP_EC_MTP_ObjectReferencesChanged */
+};
+typedef struct _PTPObjectEvent PTPObjectEvent;
+
 /* The Device Property Cache */
 struct _PTPDeviceProperty {
 	time_t			timestamp;
@@ -3579,6 +3729,23 @@ struct _PTPDeviceProperty {
 };
 typedef struct _PTPDeviceProperty PTPDeviceProperty;
 
+/* The MTP Object Property Description Cache */
+struct _PTPObjectPropCache {
+	uint16_t		ofc;
+	uint16_t		opc;	/* 0 for GetObjectPropsSupported */
+	unsigned char		*data;	/* data phase as received */
+	unsigned int		size;
+};
+typedef struct _PTPObjectPropCache PTPObjectPropCache;
+
+/* The device property group that holds a property tier of a format */
+struct _PTPObjectTierGroup {
+	uint16_t		ofc;
+	unsigned int		tier;	/* PTPOBJECT_*PROPS_LOADED */
+	uint32_t		group;	/* 0 if the tier is not one group */
+};
+typedef struct _PTPObjectTierGroup PTPObjectTierGroup;
+
 struct _MTPPropertyDesc {
 	uint16_t	opc;
 	PTPObjectPropDesc	opd;
@@ -3616,6 +3783,8 @@ struct _PTPParams {
 	PTPIOGetResp	event_wait;
 	PTPIOCancelReq	cancelreq_func;
 	PTPIODevStatReq	devstatreq_func;
+	PTPIOTransactionAsync	transaction_async_func;	/* optional */
+	PTPIORecover	recover_func;	/* optional, needed for retries */
 
 	/* Custom error and debug function */
 	PTPErrorFunc	error_func;
@@ -3624,6 +3793,34 @@ struct _PTPParams {
 	/* Data passed to above functions */
 	void		*data;
 
+	/* Optional locking, see PTP_LOCK_* */
+	PTPLockFunc	lock_func;
+	void		*lock_data;
+
+	/* Transaction statistics and an optional observer */
+	PTPStats		stats;
+	PTPTransactionFunc	transaction_func;
+	void			*transaction_data;
+	/* Optional observer of the data phases */
+	PTPDataFunc		data_func;
+	void			*data_data;
+
+	/* Retries of idempotent operations that failed in the transport,
+	 * see ptp_transaction_new(): how many, and the delay before the
+	 * first one in ms, doubled for each further one up to the max */
+	unsigned int	retries;
+	unsigned int	retry_delay;
+	unsigned int	retry_delay_max;
+	/* Transport failures in a row, and how many of them make the link
+	 * dead (0 for no limit); a dead link fails transactions at once */
+	unsigned int	failures;
+	unsigned int	max_failures;
+	int		link_dead;
+	/* A transaction of ptp_transaction_async() is underway; it ends
+	 * wherever the data layer handles its events, so this is under
+	 * PTP_LOCK_EVENTS rather than the transaction lock */
+	int		transaction_pending;
+
 	/* ptp transaction ID */
 	uint32_t	transaction_id;
 	/* ptp session ID */
@@ -3640,8 +3837,28 @@ struct _PTPParams {
 	MTPObjectFormat	*objectformats;
 
 	/* PTP: internal structures used by ptp driver */
-	PTPObject	*objects;
+	/* object cache: ordered view plus hash index, see ptp_object_find() */
+	PTPObject	**objects;
 	unsigned int	nrofobjects;
+	unsigned int	objects_alloced;
+	PTPObject	**objecthash;
+	unsigned int	objecthash_bits;
+	/* filename index of the object cache, built on first use */
+	PTPObject	**objectnames;
+	unsigned int	objectnames_bits;
+	unsigned int	nrofobjectnames;
+	/* memory of the cached objects and their data, see ptp_cache_alloc() */
+	struct _PTPArenaChunk	*objectarena;
+	void		**objectarena_free;	/* per size, see ptp_cache_free() */
+	PTPObject	*objects_free;
+	/* bumped whenever objects come, go or change, see ptp_objects_changed() */
+	unsigned int	objects_generation;
+	PTPObjectColumns	objectcolumns;
+	/* object events not yet applied to the cache, under PTP_LOCK_EVENTS */
+	PTPObjectEvent	*object_events;
+	unsigned int	nrofobject_events;
+	int		object_events_lost;
+	int		events_update_cache;
 
 	PTPDeviceInfo	deviceinfo;
 
@@ -3666,6 +3883,13 @@ struct _PTPParams {
 	PTPDeviceProperty	*deviceproperties;
 	unsigned int		nrofdeviceproperties;
 
+	/* MTP: Object Property Description Caching, valid per session,
+	 * under PTP_LOCK_PROPCACHE */
+	PTPObjectPropCache	*objectpropcache;
+	unsigned int		nrofobjectpropcache;
+	PTPObjectTierGroup	*objecttiergroups;
+	unsigned int		nrofobjecttiergroups;
+
 	/* PTP: Canon specific flags list */
 	PTPCanon_Property	*canon_props;
 	unsigned int		nrofcanon_props;
@@ -3714,6 +3938,14 @@ struct _PTPParams {
 	 */
 	uint8_t		*response_packet;
 	uint16_t	response_packet_size;
+	/* Length of the data phase being received if the transport
+	 * knows it up front, 0 otherwise. Only valid during the first
+	 * putfunc call of a data phase. */
+	uint64_t	data_phase_length;
+	/* Length the caller expects of the data phase, as known from
+	 * the object cache, 0 if it does not know. A data_phase_length
+	 * other than this is not allocated up front. */
+	uint64_t	data_phase_expected;
 };
 
 /* Asynchronous event callback */
@@ -3727,6 +3959,9 @@ uint16_t ptp_usb_getresp	(PTPParams* params, PTPContainer* resp);
 uint16_t ptp_usb_getdata	(PTPParams* params, PTPContainer* ptp,
 	                         PTPDataHandler *handler);
 uint16_t ptp_usb_event_async	(PTPParams *params, PTPEventCbFn cb, void *user_data);
+uint16_t ptp_usb_event_listen_start	(PTPParams *params);
+void ptp_usb_event_listen_stop	(PTPParams *params);
+int ptp_usb_event_listen_get	(PTPParams *params, PTPContainer *event, unsigned int *lost);
 uint16_t ptp_usb_event_wait	(PTPParams* params, PTPContainer* event);
 uint16_t ptp_usb_event_check	(PTPParams* params, PTPContainer* event);
 uint16_t ptp_usb_event_check_queue	(PTPParams* params, PTPContainer* event);
@@ -3739,6 +3974,7 @@ uint16_t ptp_usb_control_device_status_request (PTPParams *params);
 
 
 int      ptp_ptpip_connect	(PTPParams* params, const char *port);
+void     ptp_ptpip_disconnect	(PTPParams* params);
 uint16_t ptp_ptpip_sendreq	(PTPParams* params, PTPContainer* req, int dataphase);
 uint16_t ptp_ptpip_senddata	(PTPParams* params, PTPContainer* ptp,
 				uint64_t size, PTPDataHandler *handler);
@@ -3777,6 +4013,12 @@ uint16_t ptp_transaction (PTPParams* params, PTPContainer* ptp,
                 uint16_t flags, uint64_t sendlen,
                 unsigned char **data, unsigned int *recvlen
 );
+uint16_t ptp_transaction_async (PTPParams* params, PTPContainer* ptp,
+                uint16_t flags, uint64_t sendlen,
+                PTPDataHandler *handler,
+                PTPTransactionDoneFunc done, void *data
+);
+void ptp_reset_stats (PTPParams* params);
 
 /**
  * ptp_closesession:
@@ -3842,6 +4084,8 @@ uint16_t ptp_getobject_with_size	(PTPParams *params, uint32_t handle,
 				unsigned char** object, unsigned int *size);
 uint16_t ptp_getobject_tofd     (PTPParams* params, uint32_t handle, int fd);
 uint16_t ptp_getobject_to_handler (PTPParams* params, uint32_t handle, PTPDataHandler*);
+uint16_t ptp_getobject_to_handler_async (PTPParams* params, uint32_t handle, PTPDataHandler*,
+				PTPTransactionDoneFunc done, void *data);
 uint16_t ptp_getpartialobject	(PTPParams* params, uint32_t handle, uint32_t offset,
 				uint32_t maxbytes, unsigned char** object,
 				uint32_t *len);
@@ -3850,6 +4094,9 @@ uint16_t ptp_getpartialobject_to_handler (PTPParams* params, uint32_t handle, ui
 
 uint16_t ptp_getthumb		(PTPParams *params, uint32_t handle,
 				unsigned char** object, unsigned int *len);
+uint16_t ptp_getthumb_async	(PTPParams *params, uint32_t handle,
+				PTPDataHandler *handler,
+				PTPTransactionDoneFunc done, void *data);
 
 uint16_t ptp_deleteobject	(PTPParams* params, uint32_t handle,
 				uint32_t ofc);
@@ -3863,6 +4110,9 @@ uint16_t ptp_copyobject		(PTPParams* params, uint32_t handle,
 uint16_t ptp_sendobjectinfo	(PTPParams* params, uint32_t* store,
 				uint32_t* parenthandle, uint32_t* handle,
 				PTPObjectInfo* objectinfo);
+uint16_t ptp_sendobjectinfo_async (PTPParams* params, uint32_t store,
+				uint32_t parenthandle, PTPObjectInfo* objectinfo,
+				PTPTransactionDoneFunc done, void *data);
 /**
  * ptp_setobjectprotection:
  * params:      PTPParams*
@@ -3878,6 +4128,8 @@ uint16_t ptp_sendobject		(PTPParams* params, unsigned char* object,
 				 uint64_t size);
 uint16_t ptp_sendobject_fromfd  (PTPParams* params, int fd, uint64_t size);
 uint16_t ptp_sendobject_from_handler  (PTPParams* params, PTPDataHandler*, uint64_t size);
+uint16_t ptp_sendobject_from_handler_async (PTPParams* params, PTPDataHandler*, uint64_t size,
+				PTPTransactionDoneFunc done, void *data);
 /**
  * ptp_initiatecapture:
  * params:      PTPParams*
@@ -3938,6 +4190,9 @@ uint16_t ptp_mtp_getobjectproplist_generic (PTPParams* params, uint32_t handle,
 uint16_t ptp_mtp_getobjectproplist_level (PTPParams* params, uint32_t handle, uint32_t level, MTPProperties **props, int *nrofprops);
 uint16_t ptp_mtp_getobjectproplist (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops);
 uint16_t ptp_mtp_getobjectproplist_single (PTPParams* params, uint32_t handle, MTPProperties **props, int *nrofprops);
+uint16_t ptp_mtp_getobjectproplist_cache (PTPParams* params, uint32_t handle, uint32_t level, unsigned int *nrofobjects);
+uint16_t ptp_mtp_getobjectproplist_cache_async (PTPParams* params, uint32_t handle, uint32_t level,
+				PTPTransactionDoneFunc done, void *data);
 uint16_t ptp_mtp_sendobjectproplist (PTPParams* params, uint32_t* store, uint32_t* parenthandle, uint32_t* handle,
 				     uint16_t objecttype, uint64_t objectsize, MTPProperties *props, int nrofprops);
 uint16_t ptp_mtp_setobjectproplist (PTPParams* params, MTPProperties *props, int nrofprops);
@@ -4536,6 +4791,9 @@ uint16_t ptp_mtp_getobjectpropssupported (PTPParams* params, uint16_t ofc, uint3
 uint16_t ptp_android_getpartialobject64	(PTPParams* params, uint32_t handle, uint64_t offset,
 					uint32_t maxbytes, unsigned char** object,
 					uint32_t *len);
+uint16_t ptp_android_getpartialobject64_to_handler (PTPParams* params, uint32_t handle,
+					uint64_t offset, uint32_t maxbytes,
+					PTPDataHandler *handler);
 #define ptp_android_begineditobject(params,handle) ptp_generic_no_data (params, PTP_OC_ANDROID_BeginEditObject, 1, handle)
 #define ptp_android_truncate(params,handle,offset) ptp_generic_no_data (params, PTP_OC_ANDROID_TruncateObject, 3, handle, (offset & 0xFFFFFFFF), (offset >> 32))
 uint16_t ptp_android_sendpartialobject (PTPParams *params, uint32_t handle,
@@ -4575,6 +4833,7 @@ void ptp_free_objectinfo	(PTPObjectInfo *oi);
 void ptp_free_object		(PTPObject *oi);
 
 const char *ptp_strerror	(uint16_t ret, uint16_t vendor);
+size_t ptp_utf16le_to_utf8	(const unsigned char *src, unsigned int n, char *dst);
 void ptp_debug			(PTPParams *params, const char *format, ...);
 void ptp_error			(PTPParams *params, const char *format, ...);
 
@@ -4594,9 +4853,20 @@ void ptp_destroy_object_prop(MTPProperties *prop);
 void ptp_destroy_object_prop_list(MTPProperties *props, int nrofprops);
 MTPProperties *ptp_find_object_prop_in_cache(PTPParams *params, uint32_t const handle, uint32_t const attribute_id);
 uint16_t ptp_remove_object_from_cache(PTPParams *params, uint32_t handle);
+void ptp_remove_objects_from_cache(PTPParams *params, uint32_t const *handles, unsigned int n);
 uint16_t ptp_add_object_to_cache(PTPParams *params, uint32_t handle);
 uint16_t ptp_object_want (PTPParams *, uint32_t handle, unsigned int want, PTPObject**retob);
 void ptp_objects_sort (PTPParams *);
+void ptp_objects_changed (PTPParams *);
+const PTPObjectColumns *ptp_object_columns (PTPParams *);
+void ptp_free_objects (PTPParams *);
+void *ptp_cache_alloc (PTPParams *, size_t size);
+void ptp_cache_free (PTPParams *, void *ptr, size_t size);
+char *ptp_cache_strdup (PTPParams *, const char *str);
+void ptp_object_free_props (PTPParams *, PTPObject *);
+void ptp_object_name_changed (PTPParams *, PTPObject *);
+int ptp_object_filename_exists (PTPParams *, const char *filename);
+uint32_t ptp_object_find_child (PTPParams *, uint32_t storage, uint32_t parent, const char *filename);
 uint16_t ptp_object_find (PTPParams *params, uint32_t handle, PTPObject **retob);
 uint16_t ptp_object_find_or_insert (PTPParams *params, uint32_t handle, PTPObject **retob);
 uint16_t ptp_list_folder (PTPParams *params, uint32_t storage, uint32_t handle);
@@ -4663,6 +4933,25 @@ uint16_t ptp_chdk_read_script_msg(PTPParams* params, ptp_chdk_script_msg **msg);
 uint16_t ptp_chdk_get_live_data(PTPParams* params, unsigned flags, unsigned char **data, unsigned int *data_size);
 uint16_t ptp_chdk_parse_live_data (PTPParams* params, unsigned char *data, unsigned int data_size,
 				   lv_data_header *header, lv_framebuffer_desc *vpd, lv_framebuffer_desc *bmd);
+
+/* continuous live view */
+typedef struct {
+	unsigned char		*data;		/* the frame, laid out as in chdk_live_view.h */
+	unsigned int		size;
+	lv_data_header		header;
+	lv_framebuffer_desc	vpd;		/* viewport */
+	lv_framebuffer_desc	bmd;		/* bitmap overlay */
+	uint64_t		timestamp;	/* microseconds, when the frame came in */
+	uint32_t		sequence;	/* frames asked for before this one */
+	uint32_t		dropped;	/* frames lost since the start */
+} PTPCHDKLiveFrame;
+
+typedef struct _PTPCHDKLiveView PTPCHDKLiveView;
+typedef void (* PTPCHDKLiveViewFunc) (PTPParams* params, PTPCHDKLiveFrame *frame, void *data);
+
+uint16_t ptp_chdk_live_view_start (PTPParams* params, unsigned flags, unsigned int nrofframes,
+				   PTPCHDKLiveViewFunc func, void *data, PTPCHDKLiveView **lv);
+void ptp_chdk_live_view_stop (PTPParams* params, PTPCHDKLiveView *lv);
 uint16_t ptp_chdk_call_function(PTPParams* params, int *args, int size, int *ret);
 
 /*uint16_t ptp_chdk_get_script_output(PTPParams* params, char **output ); */
@@ -0,0 +1,1003 @@
+/* ptpip.c
+ *
+ * PTP/IP transport, for cameras and other devices that are reached over
+ * the network instead of the USB bus. It plugs into the same transport
+ * hooks of PTPParams as the USB glue.
+ *
+ * A PTP/IP device is connected to with two TCP connections: one carries
+ * the requests, data phases and responses, the other the events. All
+ * packets start with a PTPIPHeader, with the length including the
+ * header. Data phases come as a start packet with the total length,
+ * data packets and an end packet that carries the last of the data.
+ *
+ * The socket buffers are made large before connecting, so that the
+ * TCP window can open wide enough for the throughput of a wireless
+ * link, and the header and the payload of each packet are written and
+ * read in one system call with scatter-gather I/O, the payload going
+ * straight from and to the data handler where it allows it.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "config.h"
+#include "libmtp.h"
+#include "libusb-glue.h"
+#include "ptpip.h"
+#include "util.h"
+#include "ptp.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#if defined(HAVE_SYS_SOCKET_H) && defined(HAVE_NETDB_H) && defined(HAVE_POLL_H)
+#define PTPIP_SUPPORTED 1
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <poll.h>
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#endif
+#ifdef HAVE_NETINET_TCP_H
+#include <netinet/tcp.h>
+#endif
+#endif
+
+#include "ptp-pack.c"
+
+/* The port PTP/IP devices listen on */
+#define PTPIP_PORT		"15740"
+/* PTP/IP 1.0 */
+#define PTPIP_VERSION		0x00010000
+/* Socket buffers asked for, the kernel may give less */
+#define PTPIP_SOCKET_BUFFER	(4*1024*1024)
+/* Largest data packet sent, and block read into a bounce buffer */
+#define PTPIP_DATA_CHUNK	(1024*1024)
+/* Timeout when the device has no PTP_USB to take it from */
+#define PTPIP_TIMEOUT		60000
+
+/* Packet layouts, offsets from the start of the header */
+#define ptpip_len		0
+#define ptpip_type		4
+#define ptpip_hdr_len		8
+
+#define ptpip_init_guid		8
+#define ptpip_init_name		24
+
+#define ptpip_initack_conn	8
+#define ptpip_initack_guid	12
+#define ptpip_initack_name	28
+
+#define ptpip_initfail_reason	8
+
+#define ptpip_cmd_dataphase	8
+#define ptpip_cmd_code		12
+#define ptpip_cmd_transid	14
+#define ptpip_cmd_param1	18
+
+#define ptpip_resp_code		8
+#define ptpip_resp_transid	10
+#define ptpip_resp_param1	14
+
+#define ptpip_startdata_transid	8
+#define ptpip_startdata_len	12
+#define ptpip_startdata_size	20
+
+#define ptpip_data_transid	8
+#define ptpip_data_payload	12
+
+/*
+ * A GUID for the host, which devices that pair with it remember.
+ * It is made from the host name, so that it stays the same across
+ * runs without being stored anywhere.
+ */
+void
+ptp_nikon_getptpipguid (unsigned char* guid)
+{
+	char		host[256];
+	uint32_t	h = 2166136261U;
+	unsigned int	i;
+
+	memset (host, 0, sizeof(host));
+#ifdef HAVE_UNISTD_H
+	if (gethostname (host, sizeof(host)-1) != 0)
+#endif
+		strcpy (host, "libmtp");
+	for (i = 0; i < 16; i++) {
+		const char *s;
+
+		for (s = host; *s; s++)
+			h = (h ^ (unsigned char)*s) * 16777619U;
+		h = (h ^ i) * 16777619U;
+		guid[i] = h >> 24;
+	}
+	/* a random (version 4) UUID as far as anyone can tell */
+	guid[6] = (guid[6] & 0x0f) | 0x40;
+	guid[8] = (guid[8] & 0x3f) | 0x80;
+}
+
+#ifdef PTPIP_SUPPORTED
+
+static int
+ptpip_timeout (PTPParams *params)
+{
+	PTP_USB *ptp_usb = (PTP_USB *) params->data;
+
+	if (ptp_usb == NULL || ptp_usb->timeout <= 0)
+		return PTPIP_TIMEOUT;
+	return ptp_usb->timeout;
+}
+
+/* Progress of a data phase, as the USB glue reports it */
+static uint16_t
+ptpip_progress (PTPParams *params, unsigned long bytes)
+{
+	PTP_USB *ptp_usb = (PTP_USB *) params->data;
+
+	if (ptp_usb == NULL || !ptp_usb->callback_active)
+		return PTP_RC_OK;
+	ptp_usb->current_transfer_complete += bytes;
+	if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+		ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
+		ptp_usb->callback_active = 0;
+	}
+	if (ptp_usb->current_transfer_callback != NULL &&
+	    ptp_usb->current_transfer_callback (ptp_usb->current_transfer_complete,
+						ptp_usb->current_transfer_total,
+						ptp_usb->current_transfer_callback_data) != 0)
+		return PTP_ERROR_CANCEL;
+	return PTP_RC_OK;
+}
+
+/*
+ * Waits until fd is ready for events, for at most timeout
+ * milliseconds, or forever if timeout is negative.
+ */
+static uint16_t
+ptpip_poll (PTPParams *params, int fd, short events, int timeout)
+{
+	struct pollfd	pfd;
+	int		ret;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	pfd.revents = 0;
+	do {
+		ret = poll (&pfd, 1, timeout);
+	} while (ret == -1 && errno == EINTR);
+	if (ret == 0)
+		return PTP_ERROR_TIMEOUT;
+	if (ret < 0) {
+		ptp_error (params, "PTP/IP: poll failed: %s", strerror (errno));
+		return PTP_ERROR_IO;
+	}
+	/* a hangup still lets the data that came before it be read */
+	if (!(pfd.revents & events)) {
+		ptp_debug (params, "PTP/IP: connection closed");
+		return PTP_ERROR_NODEVICE;
+	}
+	return PTP_RC_OK;
+}
+
+/* Moves an I/O vector past n bytes that were transferred. */
+static void
+ptpip_iov_advance (struct iovec **iov, int *iovcnt, size_t n)
+{
+	while (*iovcnt && n >= (*iov)->iov_len) {
+		n -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+	if (*iovcnt) {
+		(*iov)->iov_base = (char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+	}
+}
+
+/* Writes all of an I/O vector, which is consumed. */
+static uint16_t
+ptpip_writev (PTPParams *params, int fd, struct iovec *iov, int iovcnt)
+{
+	int	timeout = ptpip_timeout (params);
+
+	while (iovcnt && iov->iov_len == 0) {
+		iov++;
+		iovcnt--;
+	}
+	while (iovcnt) {
+		struct msghdr	msg;
+		ssize_t		ret;
+		uint16_t	rc;
+
+		rc = ptpip_poll (params, fd, POLLOUT, timeout);
+		if (rc != PTP_RC_OK)
+			return rc;
+		/* sendmsg() is writev() that does not raise SIGPIPE */
+		memset (&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+#ifdef MSG_NOSIGNAL
+		ret = sendmsg (fd, &msg, MSG_NOSIGNAL);
+#else
+		ret = sendmsg (fd, &msg, 0);
+#endif
+		if (ret == -1) {
+			int err = errno;
+
+			if (err == EINTR || err == EAGAIN)
+				continue;
+			ptp_error (params, "PTP/IP: write failed: %s", strerror (err));
+			return (err == EPIPE || err == ECONNRESET) ? PTP_ERROR_NODEVICE : PTP_ERROR_IO;
+		}
+		ptpip_iov_advance (&iov, &iovcnt, ret);
+	}
+	return PTP_RC_OK;
+}
+
+/* Reads all of an I/O vector, which is consumed. */
+static uint16_t
+ptpip_readv (PTPParams *params, int fd, struct iovec *iov, int iovcnt, int timeout)
+{
+	while (iovcnt && iov->iov_len == 0) {
+		iov++;
+		iovcnt--;
+	}
+	while (iovcnt) {
+		ssize_t		ret;
+		uint16_t	rc;
+
+		rc = ptpip_poll (params, fd, POLLIN, timeout);
+		if (rc != PTP_RC_OK)
+			return rc;
+		ret = readv (fd, iov, iovcnt);
+		if (ret == -1) {
+			int err = errno;
+
+			if (err == EINTR || err == EAGAIN)
+				continue;
+			ptp_error (params, "PTP/IP: read failed: %s", strerror (err));
+			return (err == ECONNRESET) ? PTP_ERROR_NODEVICE : PTP_ERROR_IO;
+		}
+		if (ret == 0) {
+			ptp_debug (params, "PTP/IP: connection closed");
+			return PTP_ERROR_NODEVICE;
+		}
+		ptpip_iov_advance (&iov, &iovcnt, ret);
+	}
+	return PTP_RC_OK;
+}
+
+static uint16_t
+ptpip_write (PTPParams *params, int fd, unsigned char *data, size_t len)
+{
+	struct iovec	iov;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+	return ptpip_writev (params, fd, &iov, 1);
+}
+
+static uint16_t
+ptpip_read (PTPParams *params, int fd, unsigned char *data, size_t len, int timeout)
+{
+	struct iovec	iov;
+
+	iov.iov_base = data;
+	iov.iov_len = len;
+	return ptpip_readv (params, fd, &iov, 1, timeout);
+}
+
+/* Throws away len bytes of a packet that is of no interest. */
+static uint16_t
+ptpip_skip (PTPParams *params, int fd, uint32_t len)
+{
+	unsigned char	buf[256];
+	uint16_t	ret = PTP_RC_OK;
+
+	while (len && ret == PTP_RC_OK) {
+		uint32_t n = len > sizeof(buf) ? sizeof(buf) : len;
+
+		ret = ptpip_read (params, fd, buf, n, ptpip_timeout (params));
+		len -= n;
+	}
+	return ret;
+}
+
+/*
+ * Reads a whole packet that is at most maxlen bytes long, the header
+ * included, into data.
+ */
+static uint16_t
+ptpip_read_packet (PTPParams *params, int fd, unsigned char *data, uint32_t maxlen,
+		   uint32_t *type, uint32_t *len, int timeout)
+{
+	uint16_t	ret;
+
+	ret = ptpip_read (params, fd, data, ptpip_hdr_len, timeout);
+	if (ret != PTP_RC_OK)
+		return ret;
+	*len = dtoh32a (&data[ptpip_len]);
+	*type = dtoh32a (&data[ptpip_type]);
+	if (*len < ptpip_hdr_len) {
+		ptp_error (params, "PTP/IP: bad packet length %u", *len);
+		return PTP_ERROR_IO;
+	}
+	if (*len > maxlen) {
+		ptp_debug (params, "PTP/IP: skipping %u bytes of a packet of type %u", *len - maxlen, *type);
+		ret = ptpip_read (params, fd, data + ptpip_hdr_len, maxlen - ptpip_hdr_len, ptpip_timeout (params));
+		if (ret != PTP_RC_OK)
+			return ret;
+		ret = ptpip_skip (params, fd, *len - maxlen);
+		*len = maxlen;
+		return ret;
+	}
+	return ptpip_read (params, fd, data + ptpip_hdr_len, *len - ptpip_hdr_len, ptpip_timeout (params));
+}
+
+/* Packs a host name as a 0 terminated UCS-2 string, returns its size. */
+static unsigned int
+ptpip_pack_name (unsigned char *data, const char *name, unsigned int maxlen)
+{
+	unsigned int	i, n = 0;
+
+	for (i = 0; name[i] && 2*(n+1) < maxlen; i++, n++) {
+		data[2*n] = ((unsigned char)name[i] < 0x80) ? name[i] : '?';
+		data[2*n+1] = 0;
+	}
+	data[2*n] = 0;
+	data[2*n+1] = 0;
+	return 2*(n+1);
+}
+
+/*
+ * Opens a TCP connection to the device, with large socket buffers set
+ * before connecting so that the window scale is negotiated for them.
+ */
+static int
+ptpip_open (PTPParams *params, const char *host, const char *port, int nodelay)
+{
+	struct addrinfo	hints, *res, *ai;
+	int		fd = -1, ret;
+
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	ret = getaddrinfo (host, port, &hints, &res);
+	if (ret != 0) {
+		ptp_error (params, "PTP/IP: could not resolve %s: %s", host, gai_strerror (ret));
+		return -1;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		int	size = PTPIP_SOCKET_BUFFER;
+		int	one = 1;
+
+		fd = socket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1)
+			continue;
+		setsockopt (fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+		setsockopt (fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+#ifdef TCP_NODELAY
+		/* requests and responses are small, and waited for */
+		if (nodelay)
+			setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#endif
+#ifdef SO_NOSIGPIPE
+		setsockopt (fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+		if (connect (fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close (fd);
+		fd = -1;
+	}
+	freeaddrinfo (res);
+	if (fd == -1)
+		ptp_error (params, "PTP/IP: could not connect to %s port %s: %s", host, port, strerror (errno));
+	return fd;
+}
+
+/*
+ * Splits "[ptpip:]host[:port]" with IPv6 hosts in brackets. The host
+ * is returned in a buffer of its own.
+ */
+static char *
+ptpip_parse_address (const char *address, const char **port)
+{
+	const char	*colon;
+	char		*host;
+
+	if (!strncmp (address, "ptpip:", 6))
+		address += 6;
+	*port = PTPIP_PORT;
+	if (address[0] == '[') {
+		const char *end = strchr (address, ']');
+
+		if (end == NULL)
+			return NULL;
+		if (end[1] == ':' && end[2])
+			*port = end + 2;
+		return strndup (address + 1, end - address - 1);
+	}
+	colon = strchr (address, ':');
+	/* more than one colon is a bare IPv6 address */
+	if (colon && !strchr (colon + 1, ':')) {
+		if (colon[1])
+			*port = colon + 1;
+		host = strndup (address, colon - address);
+	} else
+		host = strdup (address);
+	return host;
+}
+
+/*
+ * Connects the command and the event channel of a PTP/IP device at
+ * address, "host[:port]", and does the initialization handshake.
+ * Returns 0 on success, -1 on failure.
+ */
+int
+ptp_ptpip_connect (PTPParams* params, const char *address)
+{
+	unsigned char	request[ptpip_init_name + 2*64 + 4];
+	unsigned char	ack[ptpip_initack_name + 2*256 + 4];
+	char		hostname[64];
+	const char	*port;
+	char		*host;
+	unsigned int	len;
+	uint32_t	type, acklen;
+	uint16_t	ret;
+
+	params->cmdfd = params->evtfd = params->jpgfd = -1;
+	params->byteorder = PTP_DL_LE;
+	host = ptpip_parse_address (address, &port);
+	if (host == NULL || !host[0]) {
+		ptp_error (params, "PTP/IP: bad address %s", address);
+		free (host);
+		return -1;
+	}
+
+	params->cmdfd = ptpip_open (params, host, port, 1);
+	if (params->cmdfd == -1)
+		goto fail;
+
+	/* Init Command Request: our GUID, name and version */
+	memset (hostname, 0, sizeof(hostname));
+	if (gethostname (hostname, sizeof(hostname)-1) != 0 || !hostname[0])
+		strcpy (hostname, "libmtp");
+	ptp_nikon_getptpipguid (&request[ptpip_init_guid]);
+	len = ptpip_init_name;
+	len += ptpip_pack_name (&request[len], hostname, 2*64);
+	htod32a (&request[len], PTPIP_VERSION);
+	len += 4;
+	htod32a (&request[ptpip_len], len);
+	htod32a (&request[ptpip_type], PTPIP_INIT_COMMAND_REQUEST);
+	ret = ptpip_write (params, params->cmdfd, request, len);
+	if (ret != PTP_RC_OK)
+		goto fail;
+
+	ret = ptpip_read_packet (params, params->cmdfd, ack, sizeof(ack), &type, &acklen,
+				 ptpip_timeout (params));
+	if (ret != PTP_RC_OK)
+		goto fail;
+	if (type == PTPIP_INIT_FAIL) {
+		ptp_error (params, "PTP/IP: device refused the connection, reason %u",
+			   acklen >= ptpip_initfail_reason + 4 ? dtoh32a (&ack[ptpip_initfail_reason]) : 0);
+		goto fail;
+	}
+	if (type != PTPIP_INIT_COMMAND_ACK || acklen < ptpip_initack_name) {
+		ptp_error (params, "PTP/IP: expected an init command ack, got packet type %u", type);
+		goto fail;
+	}
+	params->eventpipeid = dtoh32a (&ack[ptpip_initack_conn]);
+	memcpy (params->cameraguid, &ack[ptpip_initack_guid], 16);
+	free (params->cameraname);
+	params->cameraname = malloc (3*((acklen - ptpip_initack_name)/2) + 1);
+	if (params->cameraname)
+		ptp_utf16le_to_utf8 (&ack[ptpip_initack_name], (acklen - ptpip_initack_name)/2,
+				     params->cameraname);
+	ptp_debug (params, "PTP/IP: connected to '%s', connection %u",
+		   params->cameraname ? params->cameraname : "", params->eventpipeid);
+
+	/* Init Event Request: the event channel of that connection */
+	params->evtfd = ptpip_open (params, host, port, 0);
+	if (params->evtfd == -1)
+		goto fail;
+	htod32a (&request[ptpip_len], ptpip_hdr_len + 4);
+	htod32a (&request[ptpip_type], PTPIP_INIT_EVENT_REQUEST);
+	htod32a (&request[ptpip_hdr_len], params->eventpipeid);
+	ret = ptpip_write (params, params->evtfd, request, ptpip_hdr_len + 4);
+	if (ret != PTP_RC_OK)
+		goto fail;
+	ret = ptpip_read_packet (params, params->evtfd, ack, sizeof(ack), &type, &acklen,
+				 ptpip_timeout (params));
+	if (ret != PTP_RC_OK)
+		goto fail;
+	if (type != PTPIP_INIT_EVENT_ACK) {
+		ptp_error (params, "PTP/IP: expected an init event ack, got packet type %u", type);
+		goto fail;
+	}
+	free (host);
+	return 0;
+
+fail:
+	free (host);
+	ptp_ptpip_disconnect (params);
+	return -1;
+}
+
+/* Closes both channels of a PTP/IP device. */
+void
+ptp_ptpip_disconnect (PTPParams* params)
+{
+	if (params->cmdfd != -1)
+		close (params->cmdfd);
+	if (params->evtfd != -1)
+		close (params->evtfd);
+	params->cmdfd = params->evtfd = -1;
+	free (params->cameraname);
+	params->cameraname = NULL;
+}
+
+uint16_t
+ptp_ptpip_sendreq (PTPParams* params, PTPContainer* req, int dataphase)
+{
+	unsigned char	request[ptpip_cmd_param1 + 5*4];
+	uint32_t	len = ptpip_cmd_param1 + 4*req->Nparam;
+
+	htod32a (&request[ptpip_len], len);
+	htod32a (&request[ptpip_type], PTPIP_CMD_REQUEST);
+	/* 1: no data or data to the host, 2: data to the device */
+	htod32a (&request[ptpip_cmd_dataphase],
+		 ((dataphase & PTP_DP_DATA_MASK) == PTP_DP_SENDDATA) ? 2 : 1);
+	htod16a (&request[ptpip_cmd_code], req->Code);
+	htod32a (&request[ptpip_cmd_transid], req->Transaction_ID);
+	switch (req->Nparam) {
+	case 5: htod32a (&request[ptpip_cmd_param1 + 16], req->Param5);	/* fallthrough */
+	case 4: htod32a (&request[ptpip_cmd_param1 + 12], req->Param4);	/* fallthrough */
+	case 3: htod32a (&request[ptpip_cmd_param1 + 8], req->Param3);	/* fallthrough */
+	case 2: htod32a (&request[ptpip_cmd_param1 + 4], req->Param2);	/* fallthrough */
+	case 1: htod32a (&request[ptpip_cmd_param1], req->Param1);	/* fallthrough */
+	case 0:
+	default:
+		break;
+	}
+	return ptpip_write (params, params->cmdfd, request, len);
+}
+
+/*
+ * Sends a data phase: the start packet goes out with the first data
+ * packet, and each data packet with its header in one write.
+ */
+uint16_t
+ptp_ptpip_senddata (PTPParams* params, PTPContainer* ptp,
+		    uint64_t size, PTPDataHandler *handler)
+{
+	unsigned char	start[ptpip_startdata_size];
+	unsigned char	header[ptpip_data_payload];
+	unsigned char	*bounce = NULL;
+	uint64_t	sent = 0;
+	uint16_t	ret;
+	int		first = 1;
+
+	htod32a (&start[ptpip_len], ptpip_startdata_size);
+	htod32a (&start[ptpip_type], PTPIP_START_DATA_PACKET);
+	htod32a (&start[ptpip_startdata_transid], ptp->Transaction_ID);
+	htod32a (&start[ptpip_startdata_len], size & 0xffffffff);
+	htod32a (&start[ptpip_startdata_len + 4], size >> 32);
+
+	do {
+		struct iovec	iov[3];
+		unsigned long	chunk = size - sent > PTPIP_DATA_CHUNK ? PTPIP_DATA_CHUNK : size - sent;
+		unsigned long	got = 0;
+		unsigned char	*src = NULL;
+		int		n = 0;
+
+		/* send straight from the handler's memory if it allows it */
+		if (chunk && handler->getbuffunc)
+			src = handler->getbuffunc (params, handler->priv, 0, chunk);
+		if (src == NULL && chunk) {
+			if (bounce == NULL)
+				bounce = malloc (PTPIP_DATA_CHUNK);
+			if (bounce == NULL)
+				return PTP_ERROR_IO;
+			src = bounce;
+		}
+		if (chunk) {
+			ret = handler->getfunc (params, handler->priv, chunk, src, &got);
+			if (ret != PTP_RC_OK)
+				goto out;
+			if (got == 0) {
+				ret = PTP_ERROR_IO;
+				goto out;
+			}
+		}
+		if (first) {
+			iov[n].iov_base = start;
+			iov[n++].iov_len = ptpip_startdata_size;
+			first = 0;
+		}
+		sent += got;
+		htod32a (&header[ptpip_len], ptpip_data_payload + got);
+		htod32a (&header[ptpip_type], sent == size ? PTPIP_END_DATA_PACKET : PTPIP_DATA_PACKET);
+		htod32a (&header[ptpip_data_transid], ptp->Transaction_ID);
+		iov[n].iov_base = header;
+		iov[n++].iov_len = ptpip_data_payload;
+		iov[n].iov_base = src;
+		iov[n++].iov_len = got;
+		ret = ptpip_writev (params, params->cmdfd, iov, n);
+		if (ret == PTP_RC_OK && got)
+			ret = ptpip_progress (params, got);
+	} while (ret == PTP_RC_OK && sent < size);
+out:
+	free (bounce);
+	return ret;
+}
+
+/*
+ * Keeps a response that came instead of the data phase for
+ * ptp_ptpip_getresp(), in the place the USB glue keeps it.
+ */
+static uint16_t
+ptpip_keep_response (PTPParams *params, unsigned char *hdr, uint32_t len)
+{
+	unsigned char	*packet;
+	uint16_t	ret;
+
+	if (len > ptpip_resp_param1 + 5*4)
+		return PTP_ERROR_IO;
+	packet = malloc (len);
+	if (packet == NULL)
+		return PTP_ERROR_IO;
+	memcpy (packet, hdr, ptpip_hdr_len);
+	ret = ptpip_read (params, params->cmdfd, packet + ptpip_hdr_len, len - ptpip_hdr_len,
+			  ptpip_timeout (params));
+	if (ret != PTP_RC_OK) {
+		free (packet);
+		return ret;
+	}
+	free (params->response_packet);
+	params->response_packet = packet;
+	params->response_packet_size = len;
+	return PTP_RC_OK;
+}
+
+uint16_t
+ptp_ptpip_getdata (PTPParams* params, PTPContainer* ptp, PTPDataHandler *handler)
+{
+	unsigned char	hdr[ptpip_startdata_size];
+	unsigned char	*bounce = NULL;
+	uint16_t	ret;
+	uint32_t	len, type;
+	int		started = 0;
+
+	while (1) {
+		ret = ptpip_read (params, params->cmdfd, hdr, ptpip_hdr_len, ptpip_timeout (params));
+		if (ret != PTP_RC_OK)
+			break;
+		len = dtoh32a (&hdr[ptpip_len]);
+		type = dtoh32a (&hdr[ptpip_type]);
+		if (len < ptpip_hdr_len) {
+			ret = PTP_ERROR_IO;
+			break;
+		}
+		if (type == PTPIP_CMD_RESPONSE && !started) {
+			/* no data, the response tells why */
+			ret = ptpip_keep_response (params, hdr, len);
+			break;
+		}
+		if (type == PTPIP_START_DATA_PACKET) {
+			uint64_t total;
+
+			if (len != ptpip_startdata_size) {
+				ret = PTP_ERROR_IO;
+				break;
+			}
+			ret = ptpip_read (params, params->cmdfd, hdr + ptpip_hdr_len,
+					  ptpip_startdata_size - ptpip_hdr_len, ptpip_timeout (params));
+			if (ret != PTP_RC_OK)
+				break;
+			total = dtoh32a (&hdr[ptpip_startdata_len]) |
+				((uint64_t) dtoh32a (&hdr[ptpip_startdata_len + 4]) << 32);
+			/* 0xffffffffffffffff: the size is not known up front */
+			params->data_phase_length = (total == ~(uint64_t)0) ? 0 : total;
+			started = 1;
+			continue;
+		}
+		if (type == PTPIP_DATA_PACKET || type == PTPIP_END_DATA_PACKET) {
+			uint32_t	left;
+			int		first = 1;
+
+			if (len < ptpip_data_payload) {
+				ret = PTP_ERROR_IO;
+				break;
+			}
+			left = len - ptpip_data_payload;
+			/* the transaction ID and the payload in one read, in pieces */
+			do {
+				struct iovec	iov[2];
+				unsigned long	chunk = left > PTPIP_DATA_CHUNK ? PTPIP_DATA_CHUNK : left;
+				unsigned char	*dest = NULL;
+				int		n = 0;
+
+				if (chunk && handler->getbuffunc)
+					dest = handler->getbuffunc (params, handler->priv, 0, chunk);
+				if (dest == NULL && chunk) {
+					if (bounce == NULL)
+						bounce = malloc (PTPIP_DATA_CHUNK);
+					if (bounce == NULL) {
+						ret = PTP_ERROR_IO;
+						break;
+					}
+					dest = bounce;
+				}
+				if (first) {
+					iov[n].iov_base = hdr + ptpip_hdr_len;
+					iov[n++].iov_len = 4;
+					first = 0;
+				}
+				iov[n].iov_base = dest;
+				iov[n++].iov_len = chunk;
+				ret = ptpip_readv (params, params->cmdfd, iov, n, ptpip_timeout (params));
+				if (ret != PTP_RC_OK || chunk == 0)
+					break;
+				ret = handler->putfunc (params, handler->priv, chunk, dest);
+				if (ret == PTP_RC_OK)
+					ret = ptpip_progress (params, chunk);
+				left -= chunk;
+			} while (ret == PTP_RC_OK && left);
+			params->data_phase_length = 0;
+			if (ret != PTP_RC_OK || type == PTPIP_END_DATA_PACKET)
+				break;
+			continue;
+		}
+		ptp_debug (params, "PTP/IP: ignoring packet type %u in data phase", type);
+		ret = ptpip_skip (params, params->cmdfd, len - ptpip_hdr_len);
+		if (ret != PTP_RC_OK)
+			break;
+	}
+	free (bounce);
+	params->data_phase_length = 0;
+	return ret;
+}
+
+uint16_t
+ptp_ptpip_getresp (PTPParams* params, PTPContainer* resp)
+{
+	unsigned char	buf[ptpip_resp_param1 + 5*4];
+	unsigned char	*packet = buf;
+	uint32_t	len, type;
+	uint16_t	ret;
+	unsigned int	n;
+
+	if (params->response_packet) {
+		/* the response came in the data phase */
+		len = params->response_packet_size;
+		memcpy (buf, params->response_packet, len);
+		free (params->response_packet);
+		params->response_packet = NULL;
+		params->response_packet_size = 0;
+		type = PTPIP_CMD_RESPONSE;
+	} else {
+		ret = ptpip_read_packet (params, params->cmdfd, packet, sizeof(buf), &type, &len,
+					 ptpip_timeout (params));
+		if (ret != PTP_RC_OK)
+			return ret;
+	}
+	if (type != PTPIP_CMD_RESPONSE || len < ptpip_resp_param1) {
+		ptp_debug (params, "PTP/IP: expected a response, got packet type %u", type);
+		return PTP_ERROR_RESP_EXPECTED;
+	}
+	resp->Code = dtoh16a (&packet[ptpip_resp_code]);
+	resp->SessionID = params->session_id;
+	resp->Transaction_ID = dtoh32a (&packet[ptpip_resp_transid]);
+	n = (len - ptpip_resp_param1) / 4;
+	resp->Nparam = n;
+	resp->Param1 = n > 0 ? dtoh32a (&packet[ptpip_resp_param1]) : 0;
+	resp->Param2 = n > 1 ? dtoh32a (&packet[ptpip_resp_param1 + 4]) : 0;
+	resp->Param3 = n > 2 ? dtoh32a (&packet[ptpip_resp_param1 + 8]) : 0;
+	resp->Param4 = n > 3 ? dtoh32a (&packet[ptpip_resp_param1 + 12]) : 0;
+	resp->Param5 = n > 4 ? dtoh32a (&packet[ptpip_resp_param1 + 16]) : 0;
+	return PTP_RC_OK;
+}
+
+/* Asks the device to cancel a transaction, on the event channel. */
+static uint16_t
+ptpip_cancelreq (PTPParams* params, uint32_t transid)
+{
+	unsigned char	cancel[ptpip_hdr_len + 4];
+
+	htod32a (&cancel[ptpip_len], sizeof(cancel));
+	htod32a (&cancel[ptpip_type], PTPIP_CANCEL_TRANSACTION);
+	htod32a (&cancel[ptpip_hdr_len], transid);
+	return ptpip_write (params, params->evtfd, cancel, sizeof(cancel));
+}
+
+static uint16_t
+ptpip_devstatreq (PTPParams* params)
+{
+	return PTP_RC_OK;
+}
+
+/*
+ * Reads the next event, waiting for at most timeout milliseconds or
+ * forever if it is negative. Pings are answered on the way.
+ */
+static uint16_t
+ptpip_event (PTPParams* params, PTPContainer* event, int timeout)
+{
+	unsigned char	buf[ptpip_resp_param1 + 5*4];
+	uint32_t	len, type;
+	uint16_t	ret;
+	unsigned int	n;
+
+	while (1) {
+		ret = ptpip_poll (params, params->evtfd, POLLIN, timeout);
+		if (ret != PTP_RC_OK)
+			return ret;
+		ret = ptpip_read_packet (params, params->evtfd, buf, sizeof(buf), &type, &len,
+					 ptpip_timeout (params));
+		if (ret != PTP_RC_OK)
+			return ret;
+		if (type == PTPIP_PING) {
+			htod32a (&buf[ptpip_len], ptpip_hdr_len);
+			htod32a (&buf[ptpip_type], PTPIP_PONG);
+			ret = ptpip_write (params, params->evtfd, buf, ptpip_hdr_len);
+			if (ret != PTP_RC_OK)
+				return ret;
+			continue;
+		}
+		if (type == PTPIP_EVENT && len >= ptpip_resp_param1)
+			break;
+		ptp_debug (params, "PTP/IP: ignoring packet type %u on the event channel", type);
+	}
+	memset (event, 0, sizeof(*event));
+	/* events are laid out like responses */
+	event->Code = dtoh16a (&buf[ptpip_resp_code]);
+	event->SessionID = params->session_id;
+	event->Transaction_ID = dtoh32a (&buf[ptpip_resp_transid]);
+	n = (len - ptpip_resp_param1) / 4;
+	event->Nparam = n;
+	event->Param1 = n > 0 ? dtoh32a (&buf[ptpip_resp_param1]) : 0;
+	event->Param2 = n > 1 ? dtoh32a (&buf[ptpip_resp_param1 + 4]) : 0;
+	event->Param3 = n > 2 ? dtoh32a (&buf[ptpip_resp_param1 + 8]) : 0;
+	return PTP_RC_OK;
+}
+
+uint16_t
+ptp_ptpip_event_check (PTPParams* params, PTPContainer* event)
+{
+	return ptpip_event (params, event, 0);
+}
+
+uint16_t
+ptp_ptpip_event_check_queue (PTPParams* params, PTPContainer* event)
+{
+	return ptpip_event (params, event, 0);
+}
+
+uint16_t
+ptp_ptpip_event_wait (PTPParams* params, PTPContainer* event)
+{
+	return ptpip_event (params, event, -1);
+}
+
+#endif /* PTPIP_SUPPORTED */
+
+/**
+ * Fills in the raw device of a PTP/IP device. There is no USB
+ * device entry to go by, so it has no device flags.
+ * @param address the address of the device.
+ * @param rawdevice the raw device to fill in.
+ * @return an error code.
+ */
+LIBMTP_error_number_t ptpip_raw_device(char const *address,
+				       LIBMTP_raw_device_t *rawdevice)
+{
+  if (address == NULL || address[0] == '\0')
+    return LIBMTP_ERROR_CONNECTING;
+  memset(rawdevice, 0, sizeof(LIBMTP_raw_device_t));
+  rawdevice->device_entry.vendor = "PTP/IP";
+  rawdevice->device_entry.product = "Network device";
+  rawdevice->device_entry.device_flags = DEVICE_FLAG_NONE;
+  return LIBMTP_ERROR_NONE;
+}
+
+/**
+ * Connects to a PTP/IP device, sets up its transport in place of the
+ * USB glue and opens the session, like configure_usb_device() does.
+ * @param address the address of the device, "host[:port]".
+ * @param rawdevice its raw device, from ptpip_raw_device().
+ * @param params the PTP parameters to connect.
+ * @param usbinfo the PTP_USB of the device is returned here.
+ * @return an error code.
+ */
+LIBMTP_error_number_t configure_ptpip_device(char const *address,
+					     LIBMTP_raw_device_t const *rawdevice,
+					     PTPParams *params,
+					     void **usbinfo)
+{
+#ifdef PTPIP_SUPPORTED
+  PTP_USB *ptp_usb;
+  uint16_t ret;
+
+  ptp_usb = (PTP_USB *) calloc(1, sizeof(PTP_USB));
+  if (ptp_usb == NULL)
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  memcpy(&ptp_usb->rawdevice, rawdevice, sizeof(LIBMTP_raw_device_t));
+  ptp_usb->ptpip = 1;
+  ptp_usb->params = params;
+  ptp_usb->timeout = PTPIP_TIMEOUT;
+  ptp_usb->transfer_block_size = PTPIP_DATA_CHUNK;
+  ptp_usb->transfer_queue_depth = 1;
+  params->data = ptp_usb;
+
+  if (ptp_ptpip_connect(params, address) != 0) {
+    LIBMTP_ERROR("LIBMTP PANIC: could not connect to PTP/IP device %s\n",
+		 address);
+    params->data = NULL;
+    free(ptp_usb);
+    return LIBMTP_ERROR_CONNECTING;
+  }
+  params->sendreq_func = ptp_ptpip_sendreq;
+  params->senddata_func = ptp_ptpip_senddata;
+  params->getresp_func = ptp_ptpip_getresp;
+  params->getdata_func = ptp_ptpip_getdata;
+  params->cancelreq_func = ptpip_cancelreq;
+  params->devstatreq_func = ptpip_devstatreq;
+  params->event_check = ptp_ptpip_event_check;
+  params->event_check_queue = ptp_ptpip_event_check_queue;
+  params->event_wait = ptp_ptpip_event_wait;
+  params->transaction_async_func = NULL;
+  params->transaction_id = 0;
+
+  ret = ptp_opensession(params, 1);
+  if (ret == PTP_RC_SessionAlreadyOpened) {
+    ptp_closesession(params);
+    ret = ptp_opensession(params, 1);
+  }
+  if (ret != PTP_RC_OK) {
+    LIBMTP_ERROR("LIBMTP PANIC: could not open session on PTP/IP "
+		 "device %s: %04x\n", address, ret);
+    ptp_ptpip_disconnect(params);
+    params->data = NULL;
+    free(ptp_usb);
+    return LIBMTP_ERROR_CONNECTING;
+  }
+  *usbinfo = (void *) ptp_usb;
+  return LIBMTP_ERROR_NONE;
+#else
+  LIBMTP_ERROR("LIBMTP PANIC: PTP/IP is not supported on this platform\n");
+  return LIBMTP_ERROR_CONNECTING;
+#endif
+}
+
+/**
+ * Closes the session of a PTP/IP device and its connections, in place
+ * of close_device().
+ * @param ptp_usb the PTP_USB of the device.
+ * @param params its PTP parameters.
+ */
+void close_ptpip_device(PTP_USB *ptp_usb, PTPParams *params)
+{
+#ifdef PTPIP_SUPPORTED
+  if (ptp_closesession(params) != PTP_RC_OK)
+    LIBMTP_ERROR("ERROR: Could not close session!\n");
+  ptp_ptpip_disconnect(params);
+#endif
+}
@@ -0,0 +1,1411 @@
+/**
+ * \file simulator.c
+ *
+ * A simulated MTP device that answers the PTP transactions of a device
+ * from memory, in place of the USB glue. The objects are not stored but
+ * made up from their handles, so that devices with millions of objects
+ * cost next to nothing, and the latency and bandwidth of a real device
+ * can be imitated. The device info can be taken from the output of
+ * mtp-detect, such as the files in logs/, so that the library takes
+ * the same paths it would with that device.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "simulator.h"
+#include "util.h"
+
+// Size of the blocks data phases are handed over in
+#define SIM_CHUNK 0x10000
+// Subfolders of each folder, the first ones are in the root
+#define SIM_FANOUT 8
+// Data sent to the device that is kept, for datasets and property lists
+#define SIM_MAX_DATASET 0x100000
+// Capacity of each storage
+#define SIM_CAPACITY 0x1000000000ULL
+// Date of all generated objects
+#define SIM_DATE "20240101T120000"
+
+// What the device says it can do when there is no profile
+static uint16_t const sim_default_operations[] = {
+  PTP_OC_GetDeviceInfo, PTP_OC_OpenSession, PTP_OC_CloseSession,
+  PTP_OC_GetStorageIDs, PTP_OC_GetStorageInfo, PTP_OC_GetNumObjects,
+  PTP_OC_GetObjectHandles, PTP_OC_GetObjectInfo, PTP_OC_GetObject,
+  PTP_OC_GetThumb, PTP_OC_DeleteObject, PTP_OC_SendObjectInfo,
+  PTP_OC_SendObject, PTP_OC_GetDevicePropDesc, PTP_OC_GetDevicePropValue,
+  PTP_OC_SetDevicePropValue, PTP_OC_GetPartialObject,
+  PTP_OC_MTP_GetObjectPropsSupported, PTP_OC_MTP_GetObjectPropDesc,
+  PTP_OC_MTP_GetObjectPropValue, PTP_OC_MTP_SetObjectPropValue,
+  PTP_OC_MTP_GetObjPropList, PTP_OC_MTP_GetObjectReferences,
+  PTP_OC_MTP_SetObjectReferences, PTP_OC_ANDROID_GetPartialObject64
+};
+static uint16_t const sim_default_events[] = {
+  PTP_EC_ObjectAdded, PTP_EC_ObjectRemoved, PTP_EC_StoreAdded,
+  PTP_EC_StoreRemoved, PTP_EC_DevicePropChanged, PTP_EC_ObjectInfoChanged,
+  PTP_EC_StorageInfoChanged
+};
+static uint16_t const sim_default_properties[] = {
+  PTP_DPC_MTP_SynchronizationPartner, PTP_DPC_MTP_DeviceFriendlyName,
+  PTP_DPC_BatteryLevel
+};
+static uint16_t const sim_default_formats[] = {
+  PTP_OFC_Undefined, PTP_OFC_Association, PTP_OFC_Text, PTP_OFC_MP3,
+  PTP_OFC_EXIF_JPEG, PTP_OFC_MTP_AbstractAudioVideoPlaylist
+};
+// The object properties every object has
+static uint16_t const sim_properties[] = {
+  PTP_OPC_StorageID, PTP_OPC_ObjectFormat, PTP_OPC_ObjectSize,
+  PTP_OPC_ObjectFileName, PTP_OPC_DateModified, PTP_OPC_ParentObject
+};
+#define SIM_PROPERTIES (sizeof(sim_properties) / sizeof(sim_properties[0]))
+// Names of the first root folders, which libmtp looks for
+static char const * const sim_folder_names[] = {
+  "Music", "Pictures", "Video", "Playlists"
+};
+
+/**
+ * An object that was sent to the simulated device.
+ */
+typedef struct {
+  uint32_t storage;
+  uint32_t parent;
+  uint16_t format;
+  uint64_t size;
+  char *name;
+} sim_object_t;
+
+/**
+ * A list of 16 bit codes from the device info.
+ */
+typedef struct {
+  uint16_t *codes;
+  uint32_t n;
+} sim_codes_t;
+
+typedef struct {
+  LIBMTP_simulation_t config;
+  // Device info, from the profile or made up
+  char *manufacturer;
+  char *model;
+  char *version;
+  char *serial;
+  char *extensions;
+  sim_codes_t operations;
+  sim_codes_t events;
+  sim_codes_t properties;
+  sim_codes_t formats;
+  uint16_t vendor_id;
+  uint16_t product_id;
+  uint32_t device_flags;
+  // The generated objects, handles 1 to generated, folders first
+  uint32_t perstorage;
+  uint32_t generated;
+  // Objects sent to the device get the handles after the generated ones
+  sim_object_t *added;
+  uint32_t nrofadded;
+  uint32_t alloced;
+  // Deleted objects, one bit per handle
+  unsigned char *deleted;
+  uint32_t deletedbits;
+  uint64_t used;
+  // The object a SendObject is for
+  uint32_t sendobject;
+  // The transaction underway
+  PTPContainer request;
+  PTPContainer response;
+  int answered;
+  // Time owed to the bandwidth limit
+  double debt;
+  unsigned char chunk[SIM_CHUNK];
+} sim_device_t;
+
+/**
+ * Writes a data phase to the data handler of the host in blocks.
+ */
+typedef struct {
+  PTPParams *params;
+  PTP_USB *ptp_usb;
+  sim_device_t *sim;
+  PTPDataHandler *handler;
+  unsigned long len;
+  uint16_t ret;
+} sim_writer_t;
+
+/**
+ * An object, generated or sent, as the host sees it.
+ */
+typedef struct {
+  uint32_t handle;
+  uint32_t storage;
+  uint32_t parent;
+  uint16_t format;
+  uint64_t size;
+  char const *name;
+  char namebuf[32];
+} sim_info_t;
+
+static void sim_sleep(uint64_t const usecs)
+{
+  struct timespec ts;
+
+  ts.tv_sec = usecs / 1000000;
+  ts.tv_nsec = (usecs % 1000000) * 1000;
+  while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    ;
+}
+
+/*
+ * Let the time pass that len bytes take at the bandwidth of the device,
+ * once it adds up to a millisecond.
+ */
+static void sim_transfer_time(sim_device_t *sim, unsigned long const len)
+{
+  if (sim->config.bandwidth == 0)
+    return;
+  sim->debt += (double) len * 1000000.0 / (double) sim->config.bandwidth;
+  if (sim->debt >= 1000.0) {
+    sim_sleep((uint64_t) sim->debt);
+    sim->debt -= (uint64_t) sim->debt;
+  }
+}
+
+/*
+ * Account for bytes of a data phase and call the progress callback,
+ * like the USB glue does.
+ */
+static uint16_t sim_progress(PTP_USB *ptp_usb, unsigned long const bytes)
+{
+  if (!ptp_usb->callback_active)
+    return PTP_RC_OK;
+  ptp_usb->current_transfer_complete += bytes;
+  if (ptp_usb->current_transfer_complete >= ptp_usb->current_transfer_total) {
+    ptp_usb->current_transfer_complete = ptp_usb->current_transfer_total;
+    ptp_usb->callback_active = 0;
+  }
+  if (ptp_usb->current_transfer_callback != NULL &&
+      ptp_usb->current_transfer_callback(ptp_usb->current_transfer_complete,
+					 ptp_usb->current_transfer_total,
+					 ptp_usb->current_transfer_callback_data) != 0)
+    return PTP_ERROR_CANCEL;
+  return PTP_RC_OK;
+}
+
+static void sim_flush(sim_writer_t *w)
+{
+  if (w->len == 0 || w->ret != PTP_RC_OK)
+    return;
+  sim_transfer_time(w->sim, w->len);
+  w->ret = w->handler->putfunc(w->params, w->handler->priv, w->len,
+			       w->sim->chunk);
+  if (w->ret == PTP_RC_OK)
+    w->ret = sim_progress(w->ptp_usb, w->len);
+  w->len = 0;
+}
+
+static void sim_put(sim_writer_t *w, void const *data, unsigned long len)
+{
+  unsigned char const *p = (unsigned char const *) data;
+
+  while (len > 0 && w->ret == PTP_RC_OK) {
+    unsigned long n = SIM_CHUNK - w->len;
+
+    if (n > len)
+      n = len;
+    memcpy(w->sim->chunk + w->len, p, n);
+    w->len += n;
+    p += n;
+    len -= n;
+    if (w->len == SIM_CHUNK)
+      sim_flush(w);
+  }
+}
+
+static void sim_put8(sim_writer_t *w, uint8_t const v)
+{
+  sim_put(w, &v, 1);
+}
+
+static void sim_put16(sim_writer_t *w, uint16_t const v)
+{
+  unsigned char b[2];
+
+  b[0] = v & 0xff;
+  b[1] = v >> 8;
+  sim_put(w, b, 2);
+}
+
+static void sim_put32(sim_writer_t *w, uint32_t const v)
+{
+  sim_put16(w, v & 0xffff);
+  sim_put16(w, v >> 16);
+}
+
+static void sim_put64(sim_writer_t *w, uint64_t const v)
+{
+  sim_put32(w, v & 0xffffffffU);
+  sim_put32(w, v >> 32);
+}
+
+// A PTP string, the names here are all ASCII
+static void sim_put_string(sim_writer_t *w, char const *s)
+{
+  size_t len = s ? strlen(s) : 0;
+  size_t i;
+
+  if (len == 0) {
+    sim_put8(w, 0);
+    return;
+  }
+  if (len > 254)
+    len = 254;
+  sim_put8(w, len + 1);
+  for (i = 0; i < len; i++)
+    sim_put16(w, (unsigned char) s[i]);
+  sim_put16(w, 0);
+}
+
+static void sim_put_codes(sim_writer_t *w, uint16_t const *codes,
+			  uint32_t const n)
+{
+  uint32_t i;
+
+  sim_put32(w, n);
+  for (i = 0; i < n; i++)
+    sim_put16(w, codes[i]);
+}
+
+static void sim_put_handles(sim_writer_t *w, uint32_t const *handles,
+			    uint32_t const n)
+{
+  uint32_t i;
+
+  sim_put32(w, n);
+  for (i = 0; i < n; i++)
+    sim_put32(w, handles[i]);
+}
+
+static uint16_t sim_get16(unsigned char const *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t sim_get32(unsigned char const *p)
+{
+  return sim_get16(p) | ((uint32_t) sim_get16(p + 2) << 16);
+}
+
+/*
+ * Read a PTP string at offset off of a dataset of len bytes.
+ * @return the bytes it takes, or 0 if it does not fit.
+ */
+static unsigned long sim_get_string(unsigned char const *data,
+				    unsigned long const len,
+				    unsigned long const off,
+				    char **s)
+{
+  unsigned int n;
+  unsigned int i;
+
+  *s = NULL;
+  if (off >= len)
+    return 0;
+  n = data[off];
+  if (off + 1 + 2 * (unsigned long) n > len)
+    return 0;
+  *s = (char *) malloc(n + 1);
+  if (*s == NULL)
+    return 0;
+  for (i = 0; i < n; i++) {
+    uint16_t c = sim_get16(data + off + 1 + 2 * i);
+
+    (*s)[i] = (c < 0x80) ? (char) c : '_';
+  }
+  (*s)[n] = '\0';
+  return 1 + 2 * n;
+}
+
+/*
+ * The profile is the output of mtp-detect. What it says about the
+ * device info is used, anything else is made up.
+ */
+static char *sim_profile_value(char const *line, char const *key)
+{
+  char const *p = line;
+  size_t len;
+
+  while (*p == ' ')
+    p++;
+  len = strlen(key);
+  if (strncmp(p, key, len) != 0)
+    return NULL;
+  p += len;
+  while (*p == ' ')
+    p++;
+  len = strcspn(p, "\r\n");
+  return strndup(p, len);
+}
+
+static void sim_add_code(sim_codes_t *codes, uint16_t const code)
+{
+  uint16_t *tmp;
+
+  tmp = (uint16_t *) realloc(codes->codes, (codes->n + 1) * sizeof(uint16_t));
+  if (tmp == NULL)
+    return;
+  codes->codes = tmp;
+  codes->codes[codes->n++] = code;
+}
+
+static void sim_set_codes(sim_codes_t *codes, uint16_t const *from,
+			  uint32_t const n)
+{
+  uint32_t i;
+
+  if (codes->n != 0)
+    return;
+  for (i = 0; i < n; i++)
+    sim_add_code(codes, from[i]);
+}
+
+static int sim_read_profile(sim_device_t *sim, char const *path)
+{
+  FILE *f;
+  char line[512];
+  sim_codes_t *section = NULL;
+  char *value;
+
+  f = fopen(path, "r");
+  if (f == NULL) {
+    LIBMTP_ERROR("LIBMTP PANIC: could not open device profile %s\n", path);
+    return -1;
+  }
+  while (fgets(line, sizeof(line), f) != NULL) {
+    unsigned int code;
+    int indent = strspn(line, " ");
+
+    if (indent == 0) {
+      section = NULL;
+      if (!strncmp(line, "Supported operations:", 21))
+	section = &sim->operations;
+      else if (!strncmp(line, "Events supported:", 17))
+	section = &sim->events;
+      else if (!strncmp(line, "Device Properties Supported:", 28))
+	section = &sim->properties;
+      else if (!strncmp(line, "Playable File (Object) Types", 28))
+	section = &sim->formats;
+      continue;
+    }
+    // The codes are listed in hex at three spaces indentation
+    if (section != NULL && indent == 3) {
+      if (sscanf(line + 3, "%x", &code) == 1)
+	sim_add_code(section, code);
+      continue;
+    }
+    if (sim->manufacturer == NULL &&
+	(value = sim_profile_value(line, "Manufacturer:")) != NULL)
+      sim->manufacturer = value;
+    else if (sim->model == NULL &&
+	     (value = sim_profile_value(line, "Model:")) != NULL)
+      sim->model = value;
+    else if (sim->version == NULL &&
+	     (value = sim_profile_value(line, "Device version:")) != NULL)
+      sim->version = value;
+    else if (sim->serial == NULL &&
+	     (value = sim_profile_value(line, "Serial number:")) != NULL)
+      sim->serial = value;
+    else if (sim->extensions == NULL &&
+	     (value = sim_profile_value(line,
+					"Vendor extension description:")) != NULL)
+      sim->extensions = value;
+    else if ((value = sim_profile_value(line, "idVendor:")) != NULL) {
+      sim->vendor_id = strtoul(value, NULL, 16);
+      free(value);
+    } else if ((value = sim_profile_value(line, "idProduct:")) != NULL) {
+      sim->product_id = strtoul(value, NULL, 16);
+      free(value);
+    } else if ((value = sim_profile_value(line, "Device flags:")) != NULL) {
+      sim->device_flags = strtoul(value, NULL, 16);
+      free(value);
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+static void free_simulation(sim_device_t *sim)
+{
+  uint32_t i;
+
+  if (sim == NULL)
+    return;
+  free(sim->manufacturer);
+  free(sim->model);
+  free(sim->version);
+  free(sim->serial);
+  free(sim->extensions);
+  free(sim->operations.codes);
+  free(sim->events.codes);
+  free(sim->properties.codes);
+  free(sim->formats.codes);
+  for (i = 0; i < sim->nrofadded; i++)
+    free(sim->added[i].name);
+  free(sim->added);
+  free(sim->deleted);
+  free(sim);
+}
+
+#define SIM_CODES(a) a, sizeof(a) / sizeof(a[0])
+
+static sim_device_t *new_simulation(LIBMTP_simulation_t const *simulation)
+{
+  sim_device_t *sim;
+  uint64_t perstorage;
+
+  sim = (sim_device_t *) calloc(1, sizeof(sim_device_t));
+  if (sim == NULL)
+    return NULL;
+  sim->config = *simulation;
+  sim->config.profile = NULL;
+  if (sim->config.nrofstorages == 0)
+    sim->config.nrofstorages = 1;
+  perstorage = (uint64_t) simulation->nroffolders + simulation->nroffiles;
+  if (perstorage * sim->config.nrofstorages >= 0x7fffffffU) {
+    LIBMTP_ERROR("LIBMTP PANIC: too many simulated objects\n");
+    free(sim);
+    return NULL;
+  }
+  sim->perstorage = perstorage;
+  sim->generated = perstorage * sim->config.nrofstorages;
+  sim->used = sim->config.filesize * simulation->nroffiles;
+  if (simulation->profile != NULL &&
+      sim_read_profile(sim, simulation->profile) != 0) {
+    free_simulation(sim);
+    return NULL;
+  }
+  if (sim->manufacturer == NULL)
+    sim->manufacturer = strdup("libmtp");
+  if (sim->model == NULL)
+    sim->model = strdup("Simulated device");
+  if (sim->version == NULL)
+    sim->version = strdup("1.0");
+  if (sim->serial == NULL)
+    sim->serial = strdup("SIMULATED0001");
+  if (sim->extensions == NULL)
+    sim->extensions = strdup("microsoft.com: 1.0;");
+  sim_set_codes(&sim->operations, SIM_CODES(sim_default_operations));
+  sim_set_codes(&sim->events, SIM_CODES(sim_default_events));
+  sim_set_codes(&sim->properties, SIM_CODES(sim_default_properties));
+  sim_set_codes(&sim->formats, SIM_CODES(sim_default_formats));
+  sim->device_flags |= simulation->device_flags;
+  if (sim->manufacturer == NULL || sim->model == NULL ||
+      sim->version == NULL || sim->serial == NULL || sim->extensions == NULL) {
+    free_simulation(sim);
+    return NULL;
+  }
+  return sim;
+}
+
+static uint32_t sim_storage_id(uint32_t const index)
+{
+  return 0x00010001U + (index << 16);
+}
+
+/*
+ * Find out about the object with a handle.
+ * @return 1 if it exists, 0 if not.
+ */
+static int sim_object(sim_device_t *sim, uint32_t const handle,
+		      sim_info_t *info)
+{
+  uint32_t const folders = sim->config.nroffolders;
+  uint32_t index;
+  uint32_t local;
+
+  if (handle == 0 || handle > sim->generated + sim->nrofadded)
+    return 0;
+  if (handle <= sim->deletedbits &&
+      (sim->deleted[(handle - 1) / 8] & (1 << ((handle - 1) % 8))))
+    return 0;
+  info->handle = handle;
+  if (handle > sim->generated) {
+    sim_object_t *ob = &sim->added[handle - sim->generated - 1];
+
+    info->storage = ob->storage;
+    info->parent = ob->parent;
+    info->format = ob->format;
+    info->size = ob->size;
+    info->name = ob->name;
+    return 1;
+  }
+  index = (handle - 1) / sim->perstorage;
+  local = (handle - 1) % sim->perstorage;
+  info->storage = sim_storage_id(index);
+  if (local < folders) {
+    info->format = PTP_OFC_Association;
+    info->size = 0;
+    info->parent = (local < SIM_FANOUT) ? 0 :
+      index * sim->perstorage + local / SIM_FANOUT;
+    if (local < sizeof(sim_folder_names) / sizeof(sim_folder_names[0]))
+      info->name = sim_folder_names[local];
+    else {
+      snprintf(info->namebuf, sizeof(info->namebuf), "Folder%u", local);
+      info->name = info->namebuf;
+    }
+  } else {
+    local -= folders;
+    info->format = PTP_OFC_MP3;
+    info->size = sim->config.filesize;
+    info->parent = folders ? index * sim->perstorage + local % folders + 1 : 0;
+    snprintf(info->namebuf, sizeof(info->namebuf), "File%07u.mp3", local);
+    info->name = info->namebuf;
+  }
+  return 1;
+}
+
+/*
+ * The objects in a storage (0xffffffff for all) with a parent
+ * (0xffffffff for the root, 0 for anywhere), which may need to be
+ * an existing folder.
+ */
+static uint16_t sim_children(sim_device_t *sim, uint32_t const storage,
+			     uint32_t const parent, uint16_t const format,
+			     uint32_t **handles, uint32_t *n)
+{
+  uint32_t const all = sim->generated + sim->nrofadded;
+  uint32_t alloced = 0;
+  uint32_t h;
+  sim_info_t info;
+
+  *handles = NULL;
+  *n = 0;
+  if (parent != 0 && parent != 0xffffffffU &&
+      (!sim_object(sim, parent, &info) || info.format != PTP_OFC_Association))
+    return PTP_RC_InvalidParentObject;
+  for (h = 1; h <= all; h++) {
+    uint32_t want = (parent == 0xffffffffU) ? 0 : parent;
+
+    if (!sim_object(sim, h, &info))
+      continue;
+    if (storage != 0xffffffffU && info.storage != storage)
+      continue;
+    if (parent != 0 && info.parent != want)
+      continue;
+    if (format != 0 && info.format != format)
+      continue;
+    if (*n == alloced) {
+      uint32_t *tmp;
+
+      alloced = alloced ? alloced * 2 : 256;
+      tmp = (uint32_t *) realloc(*handles, alloced * sizeof(uint32_t));
+      if (tmp == NULL) {
+	free(*handles);
+	*handles = NULL;
+	*n = 0;
+	return PTP_RC_GeneralError;
+      }
+      *handles = tmp;
+    }
+    (*handles)[(*n)++] = h;
+  }
+  return PTP_RC_OK;
+}
+
+/*
+ * The objects below a handle for an object property list: the object
+ * alone at depth 0, its children at depth 1, everything below it for
+ * other depths. 0xffffffff is all objects.
+ */
+static uint16_t sim_below(sim_device_t *sim, uint32_t const handle,
+			  uint32_t const depth, uint16_t const format,
+			  uint32_t **handles, uint32_t *n)
+{
+  sim_info_t info;
+  uint32_t i;
+  uint16_t ret;
+
+  if (handle == 0xffffffffU)
+    return sim_children(sim, 0xffffffffU, 0, format, handles, n);
+  if (!sim_object(sim, handle, &info))
+    return PTP_RC_InvalidObjectHandle;
+  if (depth == 0) {
+    *handles = (uint32_t *) malloc(sizeof(uint32_t));
+    if (*handles == NULL)
+      return PTP_RC_GeneralError;
+    (*handles)[0] = handle;
+    *n = 1;
+    return PTP_RC_OK;
+  }
+  ret = sim_children(sim, info.storage, handle, format, handles, n);
+  if (ret != PTP_RC_OK || depth == 1)
+    return ret;
+  // The list grows while it is walked, the subfolders go at the end
+  for (i = 0; i < *n; i++) {
+    uint32_t *sub;
+    uint32_t nsub;
+    uint32_t *tmp;
+
+    if (!sim_object(sim, (*handles)[i], &info) ||
+	info.format != PTP_OFC_Association)
+      continue;
+    ret = sim_children(sim, info.storage, (*handles)[i], format, &sub, &nsub);
+    if (ret != PTP_RC_OK || nsub == 0)
+      continue;
+    tmp = (uint32_t *) realloc(*handles, (*n + nsub) * sizeof(uint32_t));
+    if (tmp == NULL) {
+      free(sub);
+      return PTP_RC_GeneralError;
+    }
+    *handles = tmp;
+    memcpy(*handles + *n, sub, nsub * sizeof(uint32_t));
+    *n += nsub;
+    free(sub);
+  }
+  return PTP_RC_OK;
+}
+
+static uint16_t sim_property_type(uint16_t const property)
+{
+  switch (property) {
+  case PTP_OPC_StorageID:
+  case PTP_OPC_ParentObject:
+    return PTP_DTC_UINT32;
+  case PTP_OPC_ObjectFormat:
+    return PTP_DTC_UINT16;
+  case PTP_OPC_ObjectSize:
+    return PTP_DTC_UINT64;
+  case PTP_OPC_ObjectFileName:
+  case PTP_OPC_DateModified:
+  case PTP_OPC_Name:
+    return PTP_DTC_STR;
+  default:
+    return 0;
+  }
+}
+
+static void sim_put_property(sim_writer_t *w, sim_info_t const *info,
+			     uint16_t const property)
+{
+  switch (property) {
+  case PTP_OPC_StorageID:
+    sim_put32(w, info->storage);
+    break;
+  case PTP_OPC_ParentObject:
+    sim_put32(w, info->parent);
+    break;
+  case PTP_OPC_ObjectFormat:
+    sim_put16(w, info->format);
+    break;
+  case PTP_OPC_ObjectSize:
+    sim_put64(w, info->size);
+    break;
+  case PTP_OPC_ObjectFileName:
+  case PTP_OPC_Name:
+    sim_put_string(w, info->name);
+    break;
+  case PTP_OPC_DateModified:
+    sim_put_string(w, SIM_DATE);
+    break;
+  }
+}
+
+static void sim_device_info(sim_device_t *sim, sim_writer_t *w)
+{
+  sim_put16(w, 100);
+  sim_put32(w, 0x00000006);
+  sim_put16(w, 100);
+  sim_put_string(w, sim->extensions);
+  sim_put16(w, 0);
+  sim_put_codes(w, sim->operations.codes, sim->operations.n);
+  sim_put_codes(w, sim->events.codes, sim->events.n);
+  sim_put_codes(w, sim->properties.codes, sim->properties.n);
+  sim_put_codes(w, NULL, 0);
+  sim_put_codes(w, sim->formats.codes, sim->formats.n);
+  sim_put_string(w, sim->manufacturer);
+  sim_put_string(w, sim->model);
+  sim_put_string(w, sim->version);
+  sim_put_string(w, sim->serial);
+}
+
+static uint16_t sim_storage_info(sim_device_t *sim, sim_writer_t *w,
+				 uint32_t const storage)
+{
+  uint64_t used = sim->used / sim->config.nrofstorages;
+  uint32_t i;
+
+  for (i = 0; i < sim->config.nrofstorages; i++) {
+    if (sim_storage_id(i) == storage)
+      break;
+  }
+  if (i == sim->config.nrofstorages)
+    return PTP_RC_InvalidStorageId;
+  sim_put16(w, PTP_ST_FixedRAM);
+  sim_put16(w, PTP_FST_GenericHierarchical);
+  sim_put16(w, PTP_AC_ReadWrite);
+  sim_put64(w, SIM_CAPACITY);
+  sim_put64(w, used < SIM_CAPACITY ? SIM_CAPACITY - used : 0);
+  sim_put32(w, 0xffffffffU);
+  sim_put_string(w, "Internal storage");
+  sim_put_string(w, "");
+  return PTP_RC_OK;
+}
+
+static void sim_object_info(sim_writer_t *w, sim_info_t const *info)
+{
+  sim_put32(w, info->storage);
+  sim_put16(w, info->format);
+  sim_put16(w, 0);
+  sim_put32(w, info->size > 0xffffffffU ? 0xffffffffU : info->size);
+  sim_put16(w, 0);
+  sim_put32(w, 0);
+  sim_put32(w, 0);
+  sim_put32(w, 0);
+  sim_put32(w, 0);
+  sim_put32(w, 0);
+  sim_put32(w, 0);
+  sim_put32(w, info->parent);
+  sim_put16(w, info->format == PTP_OFC_Association ? PTP_AT_GenericFolder : 0);
+  sim_put32(w, 0);
+  sim_put32(w, 0);
+  sim_put_string(w, info->name);
+  sim_put_string(w, SIM_DATE);
+  sim_put_string(w, SIM_DATE);
+  sim_put_string(w, "");
+}
+
+static void sim_object_data(sim_writer_t *w, sim_info_t const *info,
+			    uint64_t offset, uint64_t len)
+{
+  unsigned char block[4096];
+
+  if (offset > info->size)
+    offset = info->size;
+  if (len > info->size - offset)
+    len = info->size - offset;
+  // Each byte tells where it is, so that reads can be checked
+  while (len > 0 && w->ret == PTP_RC_OK) {
+    unsigned int n = (len > sizeof(block)) ? sizeof(block) : len;
+    unsigned int i;
+
+    for (i = 0; i < n; i++)
+      block[i] = (unsigned char) (info->handle + offset + i);
+    sim_put(w, block, n);
+    offset += n;
+    len -= n;
+  }
+}
+
+static uint16_t sim_property_list(sim_device_t *sim, sim_writer_t *w,
+				  PTPContainer const *req)
+{
+  uint32_t *handles;
+  uint32_t n;
+  uint32_t i;
+  uint32_t j;
+  uint32_t nprops = SIM_PROPERTIES;
+  uint16_t ret;
+
+  if (req->Param4 != 0)
+    return PTP_RC_MTP_Specification_By_Group_Unsupported;
+  if (req->Param3 != 0xffffffffU) {
+    if (sim_property_type(req->Param3) == 0)
+      return PTP_RC_MTP_ObjectProp_Not_Supported;
+    nprops = 1;
+  }
+  ret = sim_below(sim, req->Param1, req->Param5, req->Param2, &handles, &n);
+  if (ret != PTP_RC_OK)
+    return ret;
+  sim_put32(w, n * nprops);
+  for (i = 0; i < n && w->ret == PTP_RC_OK; i++) {
+    sim_info_t info;
+
+    sim_object(sim, handles[i], &info);
+    for (j = 0; j < SIM_PROPERTIES; j++) {
+      uint16_t property = sim_properties[j];
+
+      if (req->Param3 != 0xffffffffU) {
+	if (j > 0)
+	  break;
+	property = req->Param3;
+      }
+      sim_put32(w, handles[i]);
+      sim_put16(w, property);
+      sim_put16(w, sim_property_type(property));
+      sim_put_property(w, &info, property);
+    }
+  }
+  free(handles);
+  return PTP_RC_OK;
+}
+
+static uint16_t sim_property_desc(sim_writer_t *w, uint16_t const property)
+{
+  uint16_t type = sim_property_type(property);
+  sim_info_t info;
+
+  if (type == 0)
+    return PTP_RC_MTP_ObjectProp_Not_Supported;
+  memset(&info, 0, sizeof(info));
+  info.name = "";
+  sim_put16(w, property);
+  sim_put16(w, type);
+  sim_put8(w, property == PTP_OPC_ObjectFileName || property == PTP_OPC_Name);
+  if (property == PTP_OPC_DateModified)
+    sim_put_string(w, "");
+  else
+    sim_put_property(w, &info, property);
+  sim_put32(w, 0);
+  sim_put8(w, 0);
+  return PTP_RC_OK;
+}
+
+static uint16_t sim_device_property(sim_device_t *sim, sim_writer_t *w,
+				    uint16_t const property, int const desc)
+{
+  if (desc) {
+    sim_put16(w, property);
+    sim_put16(w, property == PTP_DPC_BatteryLevel ? PTP_DTC_UINT8 :
+	      PTP_DTC_STR);
+    sim_put8(w, property != PTP_DPC_BatteryLevel);
+  }
+  switch (property) {
+  case PTP_DPC_BatteryLevel:
+    if (desc) {
+      sim_put8(w, 100);
+      sim_put8(w, 100);
+      sim_put8(w, 0x01);
+      sim_put8(w, 0);
+      sim_put8(w, 100);
+      sim_put8(w, 1);
+    } else {
+      sim_put8(w, 100);
+    }
+    return PTP_RC_OK;
+  case PTP_DPC_MTP_SynchronizationPartner:
+  case PTP_DPC_MTP_DeviceFriendlyName:
+    if (desc)
+      sim_put_string(w, "");
+    sim_put_string(w, property == PTP_DPC_MTP_DeviceFriendlyName ?
+		   sim->model : "libmtp");
+    if (desc)
+      sim_put8(w, 0);
+    return PTP_RC_OK;
+  default:
+    return PTP_RC_DevicePropNotSupported;
+  }
+}
+
+/*
+ * Answers the transaction underway with a data phase to the host.
+ */
+static uint16_t sim_get(sim_device_t *sim, sim_writer_t *w)
+{
+  PTPContainer *req = &sim->request;
+  sim_info_t info;
+  uint32_t *handles;
+  uint32_t n;
+  uint32_t i;
+  uint16_t ret;
+
+  switch (req->Code) {
+  case PTP_OC_GetDeviceInfo:
+    sim_device_info(sim, w);
+    return PTP_RC_OK;
+  case PTP_OC_GetStorageIDs:
+    sim_put32(w, sim->config.nrofstorages);
+    for (i = 0; i < sim->config.nrofstorages; i++)
+      sim_put32(w, sim_storage_id(i));
+    return PTP_RC_OK;
+  case PTP_OC_GetStorageInfo:
+    return sim_storage_info(sim, w, req->Param1);
+  case PTP_OC_GetObjectHandles:
+    ret = sim_children(sim, req->Param1, req->Param3, req->Param2,
+		       &handles, &n);
+    if (ret != PTP_RC_OK)
+      return ret;
+    sim_put_handles(w, handles, n);
+    free(handles);
+    return PTP_RC_OK;
+  case PTP_OC_GetObjectInfo:
+    if (!sim_object(sim, req->Param1, &info))
+      return PTP_RC_InvalidObjectHandle;
+    sim_object_info(w, &info);
+    return PTP_RC_OK;
+  case PTP_OC_GetObject:
+    if (!sim_object(sim, req->Param1, &info))
+      return PTP_RC_InvalidObjectHandle;
+    sim_object_data(w, &info, 0, info.size);
+    return PTP_RC_OK;
+  case PTP_OC_GetPartialObject:
+    if (!sim_object(sim, req->Param1, &info))
+      return PTP_RC_InvalidObjectHandle;
+    sim_object_data(w, &info, req->Param2, req->Param3);
+    return PTP_RC_OK;
+  case PTP_OC_ANDROID_GetPartialObject64:
+    if (!sim_object(sim, req->Param1, &info))
+      return PTP_RC_InvalidObjectHandle;
+    sim_object_data(w, &info, req->Param2 | ((uint64_t) req->Param3 << 32),
+		    req->Param4);
+    return PTP_RC_OK;
+  case PTP_OC_GetThumb:
+    return sim_object(sim, req->Param1, &info) ?
+      PTP_RC_NoThumbnailPresent : PTP_RC_InvalidObjectHandle;
+  case PTP_OC_GetDevicePropDesc:
+  case PTP_OC_GetDevicePropValue:
+    return sim_device_property(sim, w, req->Param1,
+			       req->Code == PTP_OC_GetDevicePropDesc);
+  case PTP_OC_MTP_GetObjectPropsSupported:
+    sim_put_codes(w, sim_properties, SIM_PROPERTIES);
+    return PTP_RC_OK;
+  case PTP_OC_MTP_GetObjectPropDesc:
+    return sim_property_desc(w, req->Param1);
+  case PTP_OC_MTP_GetObjectPropValue:
+    if (!sim_object(sim, req->Param1, &info))
+      return PTP_RC_InvalidObjectHandle;
+    if (sim_property_type(req->Param2) == 0)
+      return PTP_RC_MTP_ObjectProp_Not_Supported;
+    sim_put_property(w, &info, req->Param2);
+    return PTP_RC_OK;
+  case PTP_OC_MTP_GetObjPropList:
+    return sim_property_list(sim, w, req);
+  case PTP_OC_MTP_GetObjectReferences:
+    if (!sim_object(sim, req->Param1, &info))
+      return PTP_RC_InvalidObjectHandle;
+    sim_put32(w, 0);
+    return PTP_RC_OK;
+  default:
+    return PTP_RC_OperationNotSupported;
+  }
+}
+
+/*
+ * Makes room for one more sent object.
+ * @return its handle, or 0 if out of memory.
+ */
+static uint32_t sim_add_object(sim_device_t *sim, uint32_t const storage,
+			       uint32_t const parent, uint16_t const format,
+			       uint64_t const size, char *name)
+{
+  uint32_t handle = sim->generated + sim->nrofadded + 1;
+  sim_object_t *ob;
+
+  if (handle >= 0x7fffffffU)
+    return 0;
+  if (sim->nrofadded == sim->alloced) {
+    uint32_t alloced = sim->alloced ? sim->alloced * 2 : 64;
+    sim_object_t *tmp;
+
+    tmp = (sim_object_t *) realloc(sim->added, alloced * sizeof(sim_object_t));
+    if (tmp == NULL)
+      return 0;
+    sim->added = tmp;
+    sim->alloced = alloced;
+  }
+  ob = &sim->added[sim->nrofadded++];
+  ob->storage = storage;
+  ob->parent = (parent == 0xffffffffU) ? 0 : parent;
+  ob->format = format;
+  ob->size = size;
+  ob->name = name;
+  sim->used += size;
+  return handle;
+}
+
+static uint16_t sim_delete(sim_device_t *sim, uint32_t const handle)
+{
+  sim_info_t info;
+
+  if (!sim_object(sim, handle, &info))
+    return PTP_RC_InvalidObjectHandle;
+  if (handle > sim->deletedbits) {
+    uint32_t bits = sim->generated + sim->alloced;
+    unsigned char *tmp;
+
+    if (bits < handle)
+      bits = handle;
+    tmp = (unsigned char *) realloc(sim->deleted, (bits + 7) / 8);
+    if (tmp == NULL)
+      return PTP_RC_GeneralError;
+    memset(tmp + (sim->deletedbits + 7) / 8, 0,
+	   (bits + 7) / 8 - (sim->deletedbits + 7) / 8);
+    sim->deleted = tmp;
+    sim->deletedbits = bits;
+  }
+  sim->deleted[(handle - 1) / 8] |= 1 << ((handle - 1) % 8);
+  sim->used -= (info.size < sim->used) ? info.size : sim->used;
+  return PTP_RC_OK;
+}
+
+static void sim_respond(sim_device_t *sim, uint16_t const code, int const n,
+			uint32_t const p1, uint32_t const p2, uint32_t const p3)
+{
+  memset(&sim->response, 0, sizeof(sim->response));
+  sim->response.Code = code;
+  sim->response.Nparam = n;
+  sim->response.Param1 = p1;
+  sim->response.Param2 = p2;
+  sim->response.Param3 = p3;
+  sim->answered = 1;
+}
+
+/*
+ * Takes in the data sent with the transaction underway, which has len
+ * bytes of the first at most SIM_MAX_DATASET bytes that were sent.
+ */
+static void sim_sent(sim_device_t *sim, unsigned char const *data,
+		     unsigned long const len, uint64_t const total)
+{
+  PTPContainer *req = &sim->request;
+  uint32_t storage = req->Param1;
+  uint32_t parent = req->Param2;
+  uint32_t handle;
+  uint64_t size;
+  uint16_t format;
+  char *name = NULL;
+  sim_info_t info;
+
+  switch (req->Code) {
+  case PTP_OC_SendObjectInfo:
+    // The dataset is laid out as in sim_object_info()
+    if (len < 53 || sim_get_string(data, len, 52, &name) == 0) {
+      free(name);
+      sim_respond(sim, PTP_RC_InvalidDataSet, 0, 0, 0, 0);
+      return;
+    }
+    format = sim_get16(data + 4);
+    size = sim_get32(data + 8);
+    break;
+  case PTP_OC_MTP_SendObjectPropList:
+    {
+      unsigned long off = 4;
+      uint32_t count = len >= 4 ? sim_get32(data) : 0;
+      uint32_t i;
+
+      format = req->Param3;
+      size = ((uint64_t) req->Param4 << 32) | req->Param5;
+      for (i = 0; i < count && off + 8 <= len; i++) {
+	uint16_t property = sim_get16(data + off + 4);
+	uint16_t type = sim_get16(data + off + 6);
+	unsigned long vlen;
+
+	off += 8;
+	if (type == PTP_DTC_STR) {
+	  char *s;
+
+	  vlen = sim_get_string(data, len, off, &s);
+	  if (vlen == 0)
+	    break;
+	  if (property == PTP_OPC_ObjectFileName && name == NULL)
+	    name = s;
+	  else
+	    free(s);
+	} else if (type >= PTP_DTC_INT8 && type <= PTP_DTC_UINT128) {
+	  vlen = 1 << ((type - 1) / 2);
+	} else {
+	  break;
+	}
+	off += vlen;
+      }
+      if (name == NULL) {
+	sim_respond(sim, PTP_RC_InvalidDataSet, 0, 0, 0, 0);
+	return;
+      }
+    }
+    break;
+  case PTP_OC_SendObject:
+    if (sim->sendobject == 0 || !sim_object(sim, sim->sendobject, &info)) {
+      sim_respond(sim, PTP_RC_NoValidObjectInfo, 0, 0, 0, 0);
+      return;
+    }
+    // Sizes over 4 GB are only known once the data came in
+    sim->added[sim->sendobject - sim->generated - 1].size = total;
+    sim->used += total - info.size;
+    sim->sendobject = 0;
+    sim_respond(sim, PTP_RC_OK, 0, 0, 0, 0);
+    return;
+  default:
+    // Property values, references and partial objects are taken as they are
+    sim_respond(sim, PTP_RC_OK, 0, 0, 0, 0);
+    return;
+  }
+
+  if (storage == 0)
+    storage = sim_storage_id(0);
+  if (parent != 0 && parent != 0xffffffffU &&
+      (!sim_object(sim, parent, &info) || info.format != PTP_OFC_Association)) {
+    free(name);
+    sim_respond(sim, PTP_RC_InvalidParentObject, 0, 0, 0, 0);
+    return;
+  }
+  handle = sim_add_object(sim, storage, parent, format, size, name);
+  if (handle == 0) {
+    free(name);
+    sim_respond(sim, PTP_RC_StoreFull, 0, 0, 0, 0);
+    return;
+  }
+  // Folders have no data, anything else is waited for
+  sim->sendobject = (format == PTP_OFC_Association) ? 0 : handle;
+  sim_respond(sim, PTP_RC_OK, 3, storage, parent, handle);
+}
+
+/*
+ * Answers the transaction underway when it has no data phase.
+ */
+static void sim_nodata(sim_device_t *sim)
+{
+  PTPContainer *req = &sim->request;
+  uint32_t *handles;
+  uint32_t n;
+  uint16_t ret;
+
+  switch (req->Code) {
+  case PTP_OC_OpenSession:
+  case PTP_OC_CloseSession:
+  case PTP_OC_MTP_SetObjectPropValue:
+  case PTP_OC_ANDROID_TruncateObject:
+  case PTP_OC_ANDROID_BeginEditObject:
+  case PTP_OC_ANDROID_EndEditObject:
+    sim_respond(sim, PTP_RC_OK, 0, 0, 0, 0);
+    break;
+  case PTP_OC_GetNumObjects:
+    ret = sim_children(sim, req->Param1, req->Param3, req->Param2,
+		       &handles, &n);
+    free(handles);
+    sim_respond(sim, ret, ret == PTP_RC_OK, n, 0, 0);
+    break;
+  case PTP_OC_DeleteObject:
+    sim_respond(sim, sim_delete(sim, req->Param1), 0, 0, 0, 0);
+    break;
+  default:
+    sim_respond(sim, PTP_RC_OperationNotSupported, 0, 0, 0, 0);
+    break;
+  }
+}
+
+static sim_device_t *sim_of(PTPParams *params)
+{
+  return (sim_device_t *) ((PTP_USB *) params->data)->simulation;
+}
+
+static uint16_t sim_sendreq(PTPParams *params, PTPContainer *req, int flags)
+{
+  sim_device_t *sim = sim_of(params);
+
+  sim->request = *req;
+  sim->answered = 0;
+  return PTP_RC_OK;
+}
+
+static uint16_t sim_getdata(PTPParams *params, PTPContainer *ptp,
+			    PTPDataHandler *handler)
+{
+  sim_device_t *sim = sim_of(params);
+  sim_writer_t w;
+  uint16_t ret;
+
+  w.params = params;
+  w.ptp_usb = (PTP_USB *) params->data;
+  w.sim = sim;
+  w.handler = handler;
+  w.len = 0;
+  w.ret = PTP_RC_OK;
+  ret = sim_get(sim, &w);
+  sim_flush(&w);
+  if (w.ret != PTP_RC_OK)
+    return w.ret;
+  sim_respond(sim, ret, 0, 0, 0, 0);
+  return PTP_RC_OK;
+}
+
+static uint16_t sim_senddata(PTPParams *params, PTPContainer *ptp,
+			     uint64_t size, PTPDataHandler *handler)
+{
+  sim_device_t *sim = sim_of(params);
+  PTP_USB *ptp_usb = (PTP_USB *) params->data;
+  unsigned char *kept = NULL;
+  unsigned long nkept = 0;
+  uint64_t total = 0;
+  uint16_t ret = PTP_RC_OK;
+
+  // Object data only counts, datasets are kept to be looked at
+  if (sim->request.Code != PTP_OC_SendObject &&
+      sim->request.Code != PTP_OC_ANDROID_SendPartialObject) {
+    kept = (unsigned char *) malloc(size < SIM_MAX_DATASET ?
+				    size + 1 : SIM_MAX_DATASET);
+    if (kept == NULL)
+      return PTP_RC_GeneralError;
+  }
+  while (total < size && ret == PTP_RC_OK) {
+    unsigned long want = (size - total > SIM_CHUNK) ? SIM_CHUNK : size - total;
+    unsigned long got = 0;
+
+    ret = handler->getfunc(params, handler->priv, want, sim->chunk, &got);
+    if (ret != PTP_RC_OK)
+      break;
+    if (got == 0) {
+      ret = PTP_ERROR_IO;
+      break;
+    }
+    if (kept != NULL && nkept < SIM_MAX_DATASET) {
+      unsigned long n = got;
+
+      if (n > SIM_MAX_DATASET - nkept)
+	n = SIM_MAX_DATASET - nkept;
+      memcpy(kept + nkept, sim->chunk, n);
+      nkept += n;
+    }
+    total += got;
+    sim_transfer_time(sim, got);
+    ret = sim_progress(ptp_usb, got);
+  }
+  if (ret == PTP_RC_OK)
+    sim_sent(sim, kept, nkept, total);
+  free(kept);
+  return ret;
+}
+
+static uint16_t sim_getresp(PTPParams *params, PTPContainer *resp)
+{
+  sim_device_t *sim = sim_of(params);
+
+  if (!sim->answered)
+    sim_nodata(sim);
+  if (sim->config.latency)
+    sim_sleep(sim->config.latency);
+  sim->answered = 0;
+  resp->Code = sim->response.Code;
+  resp->Nparam = sim->response.Nparam;
+  resp->Param1 = sim->response.Param1;
+  resp->Param2 = sim->response.Param2;
+  resp->Param3 = sim->response.Param3;
+  resp->Param4 = 0;
+  resp->Param5 = 0;
+  resp->SessionID = sim->request.SessionID;
+  resp->Transaction_ID = sim->request.Transaction_ID;
+  return PTP_RC_OK;
+}
+
+static uint16_t sim_cancelreq(PTPParams *params, uint32_t transaction_id)
+{
+  sim_device_t *sim = sim_of(params);
+
+  sim_respond(sim, PTP_RC_TransactionCanceled, 0, 0, 0, 0);
+  return PTP_RC_OK;
+}
+
+static uint16_t sim_devstatreq(PTPParams *params)
+{
+  return PTP_RC_OK;
+}
+
+/**
+ * Fills in the raw device of a simulated device, the device entry
+ * comes from the profile if there is one.
+ * @param simulation the simulated device.
+ * @param rawdevice the raw device to fill in.
+ * @return an error code.
+ */
+LIBMTP_error_number_t simulated_raw_device(LIBMTP_simulation_t const *simulation,
+					   LIBMTP_raw_device_t *rawdevice)
+{
+  sim_device_t *sim = new_simulation(simulation);
+
+  if (sim == NULL)
+    return LIBMTP_ERROR_CONNECTING;
+  memset(rawdevice, 0, sizeof(LIBMTP_raw_device_t));
+  rawdevice->device_entry.vendor = "Simulated";
+  rawdevice->device_entry.product = "MTP device";
+  rawdevice->device_entry.vendor_id = sim->vendor_id;
+  rawdevice->device_entry.product_id = sim->product_id;
+  rawdevice->device_entry.device_flags = sim->device_flags;
+  free_simulation(sim);
+  return LIBMTP_ERROR_NONE;
+}
+
+/**
+ * Sets up the transport of a simulated device in place of the USB
+ * glue and opens the session, like configure_usb_device() does.
+ * @param simulation the simulated device.
+ * @param rawdevice its raw device, from simulated_raw_device().
+ * @param params the PTP parameters to serve.
+ * @param usbinfo the PTP_USB of the device is returned here.
+ * @return an error code.
+ */
+LIBMTP_error_number_t configure_simulated_device(LIBMTP_simulation_t const *simulation,
+						 LIBMTP_raw_device_t const *rawdevice,
+						 PTPParams *params,
+						 void **usbinfo)
+{
+  PTP_USB *ptp_usb;
+  sim_device_t *sim;
+
+  sim = new_simulation(simulation);
+  if (sim == NULL)
+    return LIBMTP_ERROR_CONNECTING;
+  ptp_usb = (PTP_USB *) calloc(1, sizeof(PTP_USB));
+  if (ptp_usb == NULL) {
+    free_simulation(sim);
+    return LIBMTP_ERROR_MEMORY_ALLOCATION;
+  }
+  memcpy(&ptp_usb->rawdevice, rawdevice, sizeof(LIBMTP_raw_device_t));
+  ptp_usb->simulation = sim;
+  ptp_usb->params = params;
+  ptp_usb->timeout = 60000;
+  ptp_usb->bcdusb = 0x0200;
+  ptp_usb->inep_maxpacket = 512;
+  ptp_usb->outep_maxpacket = 512;
+  ptp_usb->transfer_block_size = SIM_CHUNK;
+  ptp_usb->transfer_queue_depth = 1;
+
+  params->sendreq_func = sim_sendreq;
+  params->senddata_func = sim_senddata;
+  params->getresp_func = sim_getresp;
+  params->getdata_func = sim_getdata;
+  params->cancelreq_func = sim_cancelreq;
+  params->devstatreq_func = sim_devstatreq;
+  params->transaction_async_func = NULL;
+  params->data = ptp_usb;
+  params->transaction_id = 0;
+  params->byteorder = PTP_DL_LE;
+  params->maxpacketsize = 512;
+
+  if (ptp_opensession(params, 1) != PTP_RC_OK) {
+    free_simulation(sim);
+    free(ptp_usb);
+    return LIBMTP_ERROR_CONNECTING;
+  }
+  *usbinfo = (void *) ptp_usb;
+  return LIBMTP_ERROR_NONE;
+}
+
+/**
+ * Closes the session of a simulated device and frees the simulation,
+ * in place of close_device().
+ * @param ptp_usb the PTP_USB of the device.
+ * @param params its PTP parameters.
+ */
+void close_simulated_device(PTP_USB *ptp_usb, PTPParams *params)
+{
+  if (ptp_closesession(params) != PTP_RC_OK)
+    LIBMTP_ERROR("ERROR: Could not close session!\n");
+  free_simulation((sim_device_t *) ptp_usb->simulation);
+  ptp_usb->simulation = NULL;
+}
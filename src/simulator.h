@@ -0,0 +1,35 @@
+/**
+ * \file simulator.h
+ * A simulated MTP device, see LIBMTP_Open_Simulated_Device().
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+#ifndef __MTP__SIMULATOR__H
+#define __MTP__SIMULATOR__H
+
+#include "ptp.h"
+#include "libmtp.h"
+#include "libusb-glue.h"
+
+LIBMTP_error_number_t simulated_raw_device(LIBMTP_simulation_t const *simulation,
+					   LIBMTP_raw_device_t *rawdevice);
+LIBMTP_error_number_t configure_simulated_device(LIBMTP_simulation_t const *simulation,
+						 LIBMTP_raw_device_t const *rawdevice,
+						 PTPParams *params,
+						 void **usbinfo);
+void close_simulated_device(PTP_USB *ptp_usb, PTPParams *params);
+
+#endif //__MTP__SIMULATOR__H